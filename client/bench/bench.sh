@@ -0,0 +1,101 @@
+#!/bin/sh
+# bench.sh
+# By Ron Bowes
+# Created October, 2026
+#
+# (See LICENSE.md)
+#
+# Pushes data through a real dnscat client and bench_server over loopback,
+# each way, for each record type, with and without encryption, and prints
+# the throughput. Run it with 'make bench'; these can be set to change it:
+#
+#   BENCH_BYTES   How much data to send each way (default: 65536)
+#   BENCH_WINDOW  The client's --window (default: 8)
+#   BENCH_PORT    The port bench_server listens on (default: 53535)
+#   BENCH_TYPES   The record types to try (default: TXT CNAME MX A AAAA
+#                 TCP; TCP means the TCP driver rather than DNS at all)
+
+BYTES=${BENCH_BYTES:-65536}
+WINDOW=${BENCH_WINDOW:-8}
+PORT=${BENCH_PORT:-53535}
+TYPES=${BENCH_TYPES:-"TXT CNAME MX A AAAA TCP"}
+DOMAIN=bench.test
+
+cd "$(dirname "$0")/.." || exit 1
+
+# Runs one transfer; prints the bench_server's line (or a note that it failed)
+run() {
+  crypto=$1
+  type=$2
+  direction=$3
+
+  if [ "$direction" = "up" ]; then
+    process="head -c $BYTES /dev/urandom"
+  else
+    process="cat > /dev/null"
+  fi
+
+  if [ "$crypto" = "plain" ]; then
+    flags="--no-encryption"
+  else
+    flags=""
+  fi
+
+  if [ "$type" = "TCP" ]; then
+    server_flags="--tcp 1"
+    driver="--tcp host=127.0.0.1,port=$PORT"
+  else
+    server_flags=""
+    driver="--dns server=127.0.0.1,port=$PORT,domain=$DOMAIN,type=$type"
+  fi
+
+  ./bench/bench_server --port "$PORT" --domain "$DOMAIN" $server_flags "--$direction" "$BYTES" > bench/.result 2> /dev/null &
+  server=$!
+  sleep 0.2
+
+  ./dnscat $flags -q -q --window "$WINDOW" --exec "$process" $driver > /dev/null 2>&1 &
+  client=$!
+
+  if wait $server; then
+    result=$(cat bench/.result)
+  else
+    result="failed"
+  fi
+
+  kill $client 2> /dev/null
+  wait $client 2> /dev/null
+  rm -f bench/.result
+
+  echo "$result"
+}
+
+# Pulls one value out of a result line
+field() {
+  echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+printf "%-9s %-6s %-5s %10s %10s %10s %9s %9s\n" "mode" "type" "dir" "bytes/s" "queries" "queries/s" "p50 ms" "p99 ms"
+
+for crypto in plain encrypted; do
+  for type in $TYPES; do
+    for direction in up down; do
+      result=$(run $crypto $type $direction)
+
+      if [ "$result" = "failed" ]; then
+        printf "%-9s %-6s %-5s %10s\n" $crypto $type $direction "(failed)"
+        continue
+      fi
+
+      bytes=$(field "$result" bytes)
+      seconds=$(field "$result" seconds)
+      queries=$(field "$result" queries)
+
+      printf "%-9s %-6s %-5s %10s %10s %10s %9s %9s\n" $crypto $type $direction \
+        "$(awk "BEGIN { if($seconds > 0) printf(\"%d\", $bytes / $seconds); else print \"-\" }")" \
+        "$queries" \
+        "$(awk "BEGIN { if($seconds > 0) printf(\"%d\", $queries / $seconds); else print \"-\" }")" \
+        "$(field "$result" rtt_p50_ms)" \
+        "$(field "$result" rtt_p99_ms)"
+    done
+  done
+done
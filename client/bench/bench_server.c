@@ -0,0 +1,1158 @@
+/* bench_server.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A stand-in for the dnscat2 server, for 'make bench' (see bench.sh). It
+ * answers DNS queries on a local port and speaks just enough of the dnscat
+ * protocol to push a given number of bytes through one session of the real
+ * client: encryption (without a pre-shared secret), sliding windows, FEC and
+ * MSG flags (so --down says when there's more) are supported, but compression, bundles and the like are never agreed to,
+ * and names have to be hex-encoded.
+ *
+ * With --up, it waits till the client has sent that many bytes; with --down,
+ * it sends that many itself. Either way, it then ends the session with a FIN
+ * and prints one line of results:
+ *
+ *   bytes=<n> seconds=<n> queries=<n> retransmits=<n> rtt_p50_ms=<n> rtt_p99_ms=<n> rebuilt=<n>
+ *
+ * (retransmits counts the data either side sent again: MSGs from the client
+ * with data we already had, and answers with data we'd already sent. rebuilt
+ * counts the MSGs we got from FEC packets instead.)
+ *
+ * The round trips are only known for --down: from when a piece of data goes
+ * out in a response to when the ACK for it comes back. They're '-' for --up.
+ *
+ * Queries can come over UDP, or over TCP on the same port (where answers can
+ * be a lot bigger). With --tcp, it takes one connection from the client's
+ * TCP driver instead (queries= then counts the MSG packets, same as it does
+ * for DNS).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "controller/packet.h"
+#include "libs/log.h"
+#include "libs/memory.h"
+#include "libs/tcp.h"
+#include "libs/types.h"
+#include "libs/udp.h"
+
+#ifndef NO_ENCRYPTION
+#include "libs/crypto/encryptor.h"
+#endif
+
+/* The same limits the real server uses (see driver_dns.rb), so the client
+ * sees the same size responses. */
+#define DNS_PACKET_SIZE  512
+#define EDNS_MAX_SIZE    4096
+#define MAX_NAME_RECORD  241
+#define MAX_A_RECORDS    64
+#define MAX_AAAA_RECORDS 16
+
+/* The biggest DNS message over TCP (its length is 16 bits). */
+#define DNS_TCP_SIZE     65535
+
+/* With a sliding window, the most data we'll have unacknowledged (the
+ * sequence numbers are only 16 bits, and answers over TCP are big). */
+#define MAX_IN_FLIGHT    16384
+
+/* The most data we put in an answer over TCP (handle_msg() builds them on
+ * the stack). */
+#define TCP_MAX_ANSWER   EDNS_MAX_SIZE
+
+#define TYPE_A     0x0001
+#define TYPE_CNAME 0x0005
+#define TYPE_MX    0x000F
+#define TYPE_TXT   0x0010
+#define TYPE_AAAA  0x001C
+#define TYPE_OPT   0x0029
+
+/* How long the ACK can sit still (in ms) before we assume a response went
+ * missing and send everything after it again. */
+#define GO_BACK_MS 1000
+
+/* How many round-trip samples we keep, and how many segments can be waiting
+ * on an ACK at once. */
+#define MAX_SAMPLES  65536
+#define MAX_SEGMENTS 256
+
+/* With FEC, how many of the client's segments we'll hold onto when they come
+ * in ahead of one that's missing. */
+#define MAX_HELD     64
+
+typedef struct
+{
+  uint16_t trn_id;
+  uint16_t flags;
+  char     name[256];
+  size_t   question_end;
+  uint16_t type;
+  uint16_t edns_size;
+  NBBOOL   tcp;
+} query_t;
+
+typedef struct
+{
+  size_t   end;
+  uint64_t sent_at;
+} segment_t;
+
+/* Only where the client's data goes and how long it is matters to us (we
+ * don't look at what's in it), so that's all that's held. */
+typedef struct
+{
+  uint16_t seq;
+  size_t   length;
+} held_t;
+
+/* Settings. */
+static char    *domain    = NULL;
+static size_t   up_goal   = 0;
+static size_t   down_goal = 0;
+static int      timeout   = 60;
+static NBBOOL   use_tcp   = FALSE;
+
+/* The session (we only ever have one). */
+static NBBOOL       has_session = FALSE;
+static NBBOOL       is_open     = FALSE;
+static uint16_t     session_id;
+static uint16_t     options;
+static uint16_t     their_seq;
+static uint16_t     my_seq;
+#ifndef NO_ENCRYPTION
+static encryptor_t *encryptor   = NULL;
+static uint8_t      enc_reply[DNS_PACKET_SIZE];
+static size_t       enc_reply_length;
+#endif
+
+/* Progress. */
+static size_t    up_received  = 0;
+static size_t    down_acked   = 0;
+static size_t    down_sent    = 0;
+static uint64_t  last_ack_at  = 0;
+static uint64_t  started      = 0;
+static uint64_t  finished     = 0;
+static uint32_t  queries      = 0;
+static uint32_t  retransmits  = 0;
+static size_t    highest_sent = 0;
+static uint32_t  rebuilt      = 0;
+static NBBOOL    sent_fin     = FALSE;
+
+/* The client's segments that came in early (with FEC). */
+static held_t    held[MAX_HELD];
+static size_t    held_count = 0;
+
+/* Downstream data that's waiting on an ACK, and the round trips so far. */
+static segment_t segments[MAX_SEGMENTS];
+static size_t    segment_count = 0;
+static uint32_t  samples[MAX_SAMPLES];
+static size_t    sample_count  = 0;
+
+/* What we send downstream (repeated as needed); random, so it looks like any
+ * other data. */
+static uint8_t   pattern[4096];
+
+static uint64_t time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s --port <port> [--domain <domain>] (--up <bytes> | --down <bytes>) [--timeout <s>] [--tcp 1]\n", name);
+  exit(1);
+}
+
+/* Read a query's header, question, and OPT record (if any). Returns FALSE if
+ * it's not something we can answer. */
+static NBBOOL parse_query(uint8_t *packet, size_t length, query_t *query)
+{
+  size_t   p = 12;
+  size_t   n = 0;
+  uint16_t additionals;
+
+  if(length < 12 || packet[4] != 0 || packet[5] != 1)
+    return FALSE;
+
+  query->trn_id    = (packet[0] << 8) | packet[1];
+  query->flags     = (packet[2] << 8) | packet[3];
+  additionals      = (packet[10] << 8) | packet[11];
+  query->edns_size = 0;
+
+  while(p < length && packet[p])
+  {
+    size_t label = packet[p++];
+
+    if(label > 63 || p + label > length || n + label + 1 >= sizeof(query->name))
+      return FALSE;
+    if(n)
+      query->name[n++] = '.';
+    memcpy(query->name + n, packet + p, label);
+    n += label;
+    p += label;
+  }
+  query->name[n] = '\0';
+
+  if(p + 5 > length)
+    return FALSE;
+  query->type = (packet[p + 1] << 8) | packet[p + 2];
+  query->question_end = p + 5;
+
+  /* The client only ever adds an OPT record: a root name, then the type,
+   * then the size in place of the class. */
+  if(additionals && query->question_end + 5 <= length && packet[query->question_end] == 0)
+  {
+    uint8_t *opt = packet + query->question_end + 1;
+
+    if(((opt[0] << 8) | opt[1]) == TYPE_OPT)
+      query->edns_size = MAX(512, ((opt[2] << 8) | opt[3]));
+  }
+
+  return TRUE;
+}
+
+/* Pull the data out of a name: hex, before ".<domain>" (or after
+ * "dnscat."). Returns the number of bytes, or -1. */
+static int decode_name(char *name, uint8_t *out, size_t max_length)
+{
+  char  *end;
+  size_t o = 0;
+  int    hi = -1;
+
+  if(domain)
+  {
+    size_t name_length   = strlen(name);
+    size_t domain_length = strlen(domain);
+
+    if(name_length < domain_length + 1 || strcasecmp(name + name_length - domain_length, domain) || name[name_length - domain_length - 1] != '.')
+      return -1;
+    end = name + name_length - domain_length - 1;
+  }
+  else
+  {
+    if(strncasecmp(name, "dnscat.", 7))
+      return -1;
+    name += 7;
+    end = name + strlen(name);
+  }
+
+  for(; name < end; name++)
+  {
+    int c = *name;
+    int v;
+
+    if(c == '.')
+      continue;
+    else if(c >= '0' && c <= '9')
+      v = c - '0';
+    else if(c >= 'a' && c <= 'f')
+      v = c - 'a' + 10;
+    else if(c >= 'A' && c <= 'F')
+      v = c - 'A' + 10;
+    else
+      return -1;
+
+    if(hi < 0)
+    {
+      hi = v;
+    }
+    else
+    {
+      if(o == max_length)
+        return -1;
+      out[o++] = (hi << 4) | v;
+      hi = -1;
+    }
+  }
+
+  return (int)o;
+}
+
+/* The response room left after the header, question, OPT record and the
+ * records' own headers (as driver_dns.rb works it out). */
+static int get_room(query_t *query, int record_count)
+{
+  int size = query->tcp ? DNS_TCP_SIZE : query->edns_size ? MIN(query->edns_size, EDNS_MAX_SIZE) : DNS_PACKET_SIZE;
+  int room = size - 12 - ((int)strlen(query->name) + 2 + 4) - (12 * record_count);
+
+  if(query->edns_size)
+    room -= 11;
+
+  return room;
+}
+
+/* The most dnscat data that fits in an answer to this query. */
+static size_t get_max_length(query_t *query)
+{
+  int domain_length = domain ? (int)strlen(domain) + 1 : (int)strlen("dnscat.");
+  int room;
+  int records;
+
+  switch(query->type)
+  {
+    case TYPE_TXT:
+      if(!query->edns_size)
+        return MAX_NAME_RECORD / 2;
+      room = get_room(query, 1);
+      return (room - ((room + 255) / 256)) / 2;
+
+    case TYPE_CNAME:
+    case TYPE_MX:
+      return (MAX_NAME_RECORD / 2) - domain_length;
+
+    case TYPE_A:
+      if(!query->edns_size)
+        return (MAX_A_RECORDS * 3) - 1;
+      records = get_room(query, 0) / (12 + 4);
+      return MAX(MIN((records * 3) - 1, 255), (MAX_A_RECORDS * 3) - 1);
+
+    case TYPE_AAAA:
+      if(!query->edns_size)
+        return (MAX_AAAA_RECORDS * 15) - 1;
+      records = get_room(query, 0) / (12 + 16);
+      return MAX(MIN((records * 15) - 1, 255), (MAX_AAAA_RECORDS * 15) - 1);
+  }
+
+  return 0;
+}
+
+/* Add one answer record (pointing back at the question's name). */
+static uint8_t *add_record(uint8_t *p, uint16_t type, uint8_t *rdata, size_t rdata_length)
+{
+  *p++ = 0xC0; *p++ = 0x0C;
+  *p++ = (type >> 8) & 0xFF; *p++ = type & 0xFF;
+  *p++ = 0; *p++ = 1;
+  *p++ = 0; *p++ = 0; *p++ = 0; *p++ = 60;
+  *p++ = (rdata_length >> 8) & 0xFF; *p++ = rdata_length & 0xFF;
+  memcpy(p, rdata, rdata_length);
+
+  return p + rdata_length;
+}
+
+/* Encode data as hex, in labels of up to 63 characters, followed by the
+ * domain (or preceded by "dnscat"), in wire format. */
+static size_t encode_name(uint8_t *data, size_t length, uint8_t *out)
+{
+  static const char *hex = "0123456789abcdef";
+  size_t o = 0;
+  size_t i;
+
+  if(!domain)
+  {
+    out[o++] = 6;
+    memcpy(out + o, "dnscat", 6);
+    o += 6;
+  }
+
+  for(i = 0; i < length * 2; i++)
+  {
+    if(i % 63 == 0)
+      out[o++] = (uint8_t)MIN(63, length * 2 - i);
+    out[o++] = hex[(data[i / 2] >> ((i % 2) ? 0 : 4)) & 0x0F];
+  }
+
+  if(domain)
+  {
+    char *label = domain;
+    char *dot;
+
+    while(*label)
+    {
+      size_t label_length;
+
+      dot = strchr(label, '.');
+      label_length = dot ? (size_t)(dot - label) : strlen(label);
+
+      out[o++] = (uint8_t)label_length;
+      memcpy(out + o, label, label_length);
+      o += label_length;
+
+      if(!dot)
+        break;
+      label = dot + 1;
+    }
+  }
+  out[o++] = 0;
+
+  return o;
+}
+
+/* Build the DNS response carrying data, the way driver_dns.rb would encode
+ * it for the query's type. Returns the length. */
+static size_t build_response(uint8_t *query_packet, query_t *query, uint8_t *data, size_t length, uint8_t *out)
+{
+  static const char *hex = "0123456789abcdef";
+  uint8_t  rdata[DNS_TCP_SIZE];
+  uint8_t *p = out + query->question_end;
+  uint16_t answers = 0;
+  size_t   i;
+  size_t   n;
+
+  memcpy(out, query_packet, query->question_end);
+
+  if(query->type == TYPE_TXT)
+  {
+    /* Hex, split into 255-character strings. */
+    for(i = 0, n = 0; i < length * 2; i++)
+    {
+      if(i % 255 == 0)
+        rdata[n++] = (uint8_t)MIN(255, length * 2 - i);
+      rdata[n++] = hex[(data[i / 2] >> ((i % 2) ? 0 : 4)) & 0x0F];
+    }
+    if(n == 0)
+      rdata[n++] = 0;
+
+    p = add_record(p, TYPE_TXT, rdata, n);
+    answers = 1;
+  }
+  else if(query->type == TYPE_CNAME || query->type == TYPE_MX)
+  {
+    n = 0;
+    if(query->type == TYPE_MX)
+    {
+      rdata[n++] = 0;
+      rdata[n++] = 10;
+    }
+    n += encode_name(data, length, rdata + n);
+
+    p = add_record(p, query->type, rdata, n);
+    answers = 1;
+  }
+  else
+  {
+    /* A and AAAA: a length byte then the data, in records that each start
+     * with a sequence number (from a random start) and are padded with
+     * 0xFF. */
+    size_t  per_record = (query->type == TYPE_A) ? 3 : 15;
+    size_t  total      = length + 1;
+    size_t  count      = (total + per_record - 1) / per_record;
+    uint8_t seq        = (uint8_t)(rand() % (255 - count - 1));
+
+    for(i = 0; i < count; i++)
+    {
+      size_t j;
+
+      rdata[0] = ++seq;
+      for(j = 0; j < per_record; j++)
+      {
+        size_t offset = (i * per_record) + j;
+
+        if(offset == 0)
+          rdata[j + 1] = (uint8_t)length;
+        else if(offset < total)
+          rdata[j + 1] = data[offset - 1];
+        else
+          rdata[j + 1] = 0xFF;
+      }
+
+      p = add_record(p, query->type, rdata, per_record + 1);
+      answers++;
+    }
+  }
+
+  /* The header: a response, same question, our answers, and an OPT record if
+   * they sent one. */
+  out[2] = 0x84 | (query->flags >> 8 & 0x01);
+  out[3] = 0x80;
+  out[6] = (answers >> 8) & 0xFF;
+  out[7] = answers & 0xFF;
+  out[8] = 0; out[9] = 0;
+  out[10] = 0; out[11] = query->edns_size ? 1 : 0;
+
+  if(query->edns_size)
+  {
+    *p++ = 0;
+    *p++ = 0; *p++ = TYPE_OPT;
+    *p++ = (query->edns_size >> 8) & 0xFF; *p++ = query->edns_size & 0xFF;
+    memset(p, 0, 6);
+    p += 6;
+  }
+
+  return p - out;
+}
+
+#ifndef NO_ENCRYPTION
+/* The encryptor was written for the client, so once the keys are worked
+ * out, everything it calls "mine" is really the server's. */
+static void swap(void *a, void *b, size_t length)
+{
+  uint8_t *x = (uint8_t*)a;
+  uint8_t *y = (uint8_t*)b;
+  uint8_t  t;
+  size_t   i;
+
+  for(i = 0; i < length; i++)
+  {
+    t = x[i];
+    x[i] = y[i];
+    y[i] = t;
+  }
+}
+
+static void become_server(encryptor_t *e)
+{
+  swap(e->my_write_key,     e->their_write_key,     sizeof(e->my_write_key));
+  swap(e->my_mac_key,       e->their_mac_key,       sizeof(e->my_mac_key));
+  swap(&e->my_cipher,       &e->their_cipher,       sizeof(e->my_cipher));
+  swap(&e->my_mac,          &e->their_mac,          sizeof(e->my_mac));
+}
+#endif
+
+/* Turn a packet into bytes, encrypting it if the session is. */
+static uint8_t *finish_packet(packet_t *packet, size_t *length)
+{
+  uint8_t *bytes = packet_to_bytes(packet, length, options);
+
+#ifndef NO_ENCRYPTION
+  if(encryptor && is_open)
+  {
+    bytes = safe_realloc(bytes, *length + ENCRYPTOR_OVERHEAD);
+    *length = encryptor_seal(encryptor, bytes, *length);
+  }
+#endif
+
+  packet_destroy(packet);
+
+  return bytes;
+}
+
+/* Note the round trip for every segment the ACK covers. */
+static void segments_acked(size_t acked_to)
+{
+  uint64_t now = time_us();
+  size_t   i = 0;
+
+  while(i < segment_count && segments[i].end <= acked_to)
+  {
+    if(sample_count < MAX_SAMPLES)
+      samples[sample_count++] = (uint32_t)(now - segments[i].sent_at);
+    i++;
+  }
+
+  segment_count -= i;
+  memmove(segments, segments + i, segment_count * sizeof(segment_t));
+}
+
+static void segment_sent(size_t end)
+{
+  /* Retransmissions don't count; the clock started the first time. */
+  if(segment_count > 0 && segments[segment_count - 1].end >= end)
+    return;
+  if(segment_count == 0 && end <= down_acked)
+    return;
+
+  if(segment_count == MAX_SEGMENTS)
+    return;
+
+  segments[segment_count].end     = end;
+  segments[segment_count].sent_at = time_us();
+  segment_count++;
+}
+
+/* How far past their_seq a segment starts, or -1 if it's one we've had. */
+static int seq_ahead(uint16_t seq)
+{
+  uint16_t ahead = seq - their_seq;
+
+  return (ahead < 0x8000) ? ahead : -1;
+}
+
+static int find_held(uint16_t seq)
+{
+  size_t i;
+
+  for(i = 0; i < held_count; i++)
+    if(held[i].seq == seq)
+      return (int)i;
+
+  return -1;
+}
+
+/* Take a segment of the client's data: count it if it's next (along with any
+ * held ones that follow it), or, with FEC, hold onto it if it's early. */
+static void take_segment(uint16_t seq, size_t length)
+{
+  int i;
+
+  if(length == 0)
+    return;
+
+  if(seq == their_seq)
+  {
+    if(!started)
+      started = time_us();
+
+    their_seq = (their_seq + length) & 0xFFFF;
+    up_received += length;
+
+    while((i = find_held(their_seq)) >= 0)
+    {
+      their_seq = (their_seq + held[i].length) & 0xFFFF;
+      up_received += held[i].length;
+      held[i] = held[--held_count];
+    }
+  }
+  else if(seq_ahead(seq) < 0 || find_held(seq) >= 0)
+  {
+    retransmits++;
+  }
+  else if((options & OPT_FEC) && held_count < MAX_HELD)
+  {
+    held[held_count].seq    = seq;
+    held[held_count].length = length;
+    held_count++;
+  }
+}
+
+/* An FEC packet can stand in for any one of the segments it covers. */
+static void handle_fec(packet_t *packet)
+{
+  uint16_t seq     = packet->body.fec.seq;
+  int      missing = -1;
+  int      i;
+
+  for(i = 0; i < packet->body.fec.count; i++)
+  {
+    if(seq_ahead(seq) >= 0 && find_held(seq) < 0)
+    {
+      /* Two missing means there's nothing we can do. */
+      if(missing >= 0)
+        return;
+      missing = i;
+    }
+    seq = (seq + packet->body.fec.lengths[i]) & 0xFFFF;
+  }
+
+  if(missing < 0)
+    return;
+
+  seq = packet->body.fec.seq;
+  for(i = 0; i < missing; i++)
+    seq = (seq + packet->body.fec.lengths[i]) & 0xFFFF;
+
+  rebuilt++;
+  take_segment(seq, packet->body.fec.lengths[missing]);
+}
+
+/* Handle a MSG from the client, and build the answer (up to max_data bytes
+ * of data). */
+static packet_t *handle_msg(packet_t *packet, size_t max_data)
+{
+  uint16_t acked = packet->body.msg.ack - my_seq;
+  size_t   in_flight = ((options & OPT_WINDOWED) ? MAX(down_sent, highest_sent) : down_goal) - down_acked;
+  size_t   offset;
+  size_t   length;
+  uint8_t  data[DNS_TCP_SIZE];
+  size_t   i;
+  packet_t *response;
+
+  /* Their data, if it's the next thing we're expecting (or a retransmit, if
+   * it's something we've had already). */
+  take_segment(packet->body.msg.seq, packet->body.msg.data_length);
+
+  /* Our data, if the ACK covers any of it. */
+  if(acked > 0 && acked <= in_flight)
+  {
+    my_seq = (my_seq + acked) & 0xFFFF;
+    down_acked += acked;
+    last_ack_at = time_us();
+    segments_acked(down_acked);
+  }
+
+  if(options & OPT_WINDOWED)
+  {
+    /* Nothing's come back for a while; start over from the ACK (once, till
+     * another while goes by; a client that's holding off, like when its
+     * driver's backed up, will get to acknowledging what it already has). */
+    if(down_sent > down_acked && time_us() - last_ack_at > GO_BACK_MS * 1000)
+    {
+      down_sent = down_acked;
+      segment_count = 0;
+      last_ack_at = time_us();
+    }
+    down_sent = MAX(down_sent, down_acked);
+    offset = down_sent - down_acked;
+  }
+  else
+  {
+    offset = 0;
+  }
+
+  length = MIN(max_data, down_goal - down_acked - offset);
+  if(options & OPT_WINDOWED)
+    length = (offset < MAX_IN_FLIGHT) ? MIN(length, MAX_IN_FLIGHT - offset) : 0;
+  for(i = 0; i < length; i++)
+    data[i] = pattern[(down_acked + offset + i) % sizeof(pattern)];
+
+  if(length > 0)
+  {
+    if(!started)
+    {
+      started = time_us();
+      last_ack_at = started;
+    }
+    segment_sent(down_acked + offset + length);
+    if(down_acked + offset + length <= highest_sent)
+      retransmits++;
+    highest_sent = MAX(highest_sent, down_acked + offset + length);
+    if(options & OPT_WINDOWED)
+      down_sent += length;
+  }
+
+  response = packet_create_msg(session_id, (my_seq + offset) & 0xFFFF, their_seq, data, length);
+  if(down_acked + offset + length < down_goal)
+    response->body.msg.flags = PACKET_MSG_FLAG_MORE;
+
+  return response;
+}
+
+/* Work out the answer to one dnscat packet; returns NULL if it doesn't get
+ * one. */
+static uint8_t *handle_packet(uint8_t *bytes, size_t length, size_t max_length, size_t *out_length)
+{
+  packet_t *packet;
+  packet_t *response = NULL;
+  int       type     = packet_peek_type(bytes, length);
+
+  if(type < 0)
+    return NULL;
+
+  if(type == PACKET_TYPE_PING)
+  {
+    *out_length = length;
+    return (uint8_t*)safe_memcpy(bytes, length);
+  }
+
+  if(has_session && packet_peek_session_id(bytes, length) != session_id)
+    return NULL;
+  session_id  = packet_peek_session_id(bytes, length);
+  has_session = TRUE;
+
+#ifndef NO_ENCRYPTION
+  /* The key exchange is always in the clear. */
+  if(type == PACKET_TYPE_ENC && !is_open)
+  {
+    if(!encryptor)
+    {
+      uint8_t *reply;
+
+      packet = packet_parse(bytes, length, 0);
+      if(packet->body.enc.subtype != PACKET_ENC_SUBTYPE_INIT)
+      {
+        LOG_FATAL("bench_server: only the INIT part of the key exchange is supported");
+        exit(1);
+      }
+
+      encryptor = encryptor_create(NULL);
+      if(!encryptor || !encryptor_set_their_public_key(encryptor, packet->body.enc.public_key))
+      {
+        LOG_FATAL("bench_server: the key exchange failed");
+        exit(1);
+      }
+      become_server(encryptor);
+      packet_destroy(packet);
+
+      response = packet_create_enc(session_id, 0);
+      packet_enc_set_init(response, encryptor->my_public_key);
+      reply = packet_to_bytes(response, &enc_reply_length, 0);
+      memcpy(enc_reply, reply, enc_reply_length);
+      safe_free(reply);
+      packet_destroy(response);
+    }
+
+    /* (The same answer if they ask again.) */
+    *out_length = enc_reply_length;
+    return (uint8_t*)safe_memcpy(enc_reply, enc_reply_length);
+  }
+
+  if(encryptor)
+  {
+    if(!encryptor_open(encryptor, bytes, &length, NULL))
+    {
+      LOG_WARNING("bench_server: a packet's signature was wrong, ignoring it");
+      return NULL;
+    }
+    is_open = TRUE;
+    max_length -= ENCRYPTOR_OVERHEAD;
+  }
+#endif
+
+  if(type == PACKET_TYPE_SYN)
+  {
+    /* seq and options are right after the header; nothing after them
+     * matters to us, but OPT_FEC's group (which is last). */
+    if(length < 9)
+      return NULL;
+
+    if(!is_open || their_seq == 0)
+    {
+      their_seq = (bytes[5] << 8) | bytes[6];
+      options   = ((bytes[7] << 8) | bytes[8]) & (OPT_WINDOWED | OPT_FEC | OPT_MSG_FLAGS);
+      if(!(options & OPT_WINDOWED) || length < 11)
+        options &= ~OPT_FEC;
+      if(!my_seq)
+        my_seq = (uint16_t)(rand() | 1);
+    }
+    is_open = TRUE;
+
+    response = packet_create_syn(session_id, my_seq, (options_t)(options & ~OPT_FEC));
+
+    /* Whatever group they asked for (the last thing in their SYN) is fine. */
+    if(options & OPT_FEC)
+      packet_syn_set_fec(response, (bytes[length - 2] << 8) | bytes[length - 1]);
+  }
+  else if(type == PACKET_TYPE_MSG)
+  {
+    if(sent_fin)
+      return NULL;
+
+    packet = packet_parse(bytes, length, (options_t)options);
+    queries++;
+
+    if((up_goal && up_received >= up_goal) || (down_goal && down_acked >= down_goal))
+    {
+      response = packet_create_fin(session_id, "Benchmark done");
+      sent_fin = TRUE;
+    }
+    else
+    {
+      response = handle_msg(packet, max_length - packet_get_msg_size((options_t)options));
+
+      if(!finished && ((up_goal && up_received >= up_goal) || (down_goal && down_acked >= down_goal)))
+        finished = time_us();
+    }
+    packet_destroy(packet);
+  }
+  else if(type == PACKET_TYPE_FEC && (options & OPT_FEC))
+  {
+    if(sent_fin)
+      return NULL;
+
+    packet = packet_parse(bytes, length, (options_t)options);
+    queries++;
+
+    if((up_goal && up_received >= up_goal) || (down_goal && down_acked >= down_goal))
+    {
+      response = packet_create_fin(session_id, "Benchmark done");
+      sent_fin = TRUE;
+    }
+    else
+    {
+      /* Other than the data, it gets the same answer as a MSG would. */
+      packet_t *msg = packet_create_msg(session_id, their_seq, packet->body.fec.ack, (uint8_t*)"", 0);
+
+      handle_fec(packet);
+      response = handle_msg(msg, max_length - packet_get_msg_size((options_t)options));
+      packet_destroy(msg);
+
+      if(!finished && ((up_goal && up_received >= up_goal) || (down_goal && down_acked >= down_goal)))
+        finished = time_us();
+    }
+    packet_destroy(packet);
+  }
+  else if(type == PACKET_TYPE_FIN)
+  {
+    response = packet_create_fin(session_id, "Bye");
+    sent_fin = TRUE;
+  }
+  else
+  {
+    return NULL;
+  }
+
+  return finish_packet(response, out_length);
+}
+
+static int cmp_samples(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+
+  return (x > y) - (x < y);
+}
+
+static void print_results()
+{
+  double seconds = (finished && started) ? (finished - started) / 1000000.0 : 0;
+
+  printf("bytes=%zu seconds=%.6f queries=%u retransmits=%u", up_goal ? up_received : down_acked, seconds, queries, retransmits);
+
+  if(sample_count > 0)
+  {
+    qsort(samples, sample_count, sizeof(uint32_t), cmp_samples);
+    printf(" rtt_p50_ms=%.2f rtt_p99_ms=%.2f", samples[sample_count / 2] / 1000.0, samples[(sample_count * 99) / 100] / 1000.0);
+  }
+  else
+  {
+    printf(" rtt_p50_ms=- rtt_p99_ms=-");
+  }
+
+  printf(" rebuilt=%u\n", rebuilt);
+}
+
+/* Work out the response to one query (over TCP, if tcp is set) into
+ * response, which must hold DNS_TCP_SIZE bytes; returns its length, or 0 if
+ * it doesn't get one. */
+static size_t answer_query(uint8_t *packet, size_t length, NBBOOL tcp, uint8_t *response)
+{
+  uint8_t  data[256];
+  query_t  query;
+  int      data_length;
+  uint8_t *answer;
+  size_t   answer_length;
+  size_t   max_length;
+  size_t   response_length;
+
+  if(!parse_query(packet, length, &query))
+    return 0;
+  query.tcp = tcp;
+
+  data_length = decode_name(query.name, data, sizeof(data));
+  max_length  = get_max_length(&query);
+  if(data_length < 0 || max_length == 0)
+  {
+    LOG_WARNING("bench_server: can't handle the query for %s", query.name);
+    return 0;
+  }
+
+  answer = handle_packet(data, data_length, max_length, &answer_length);
+  if(!answer)
+  {
+    answer = (uint8_t*)safe_malloc(1);
+    answer_length = 0;
+  }
+
+  response_length = build_response(packet, &query, answer, answer_length, response);
+  safe_free(answer);
+
+  return response_length;
+}
+
+/* Answer DNS queries - over UDP, or over TCP on the same port (one
+ * connection at a time) - till the session's over; returns FALSE if it
+ * times out. */
+static NBBOOL serve_dns(int port, uint64_t deadline)
+{
+  int     s        = udp_create_socket(port, "127.0.0.1");
+  int     listener = tcp_listen("127.0.0.1", port);
+  int     c        = -1;
+  uint8_t packet[DNS_TCP_SIZE + 2];
+  uint8_t response[DNS_TCP_SIZE + 2];
+  size_t  incoming_length = 0;
+
+  while(!sent_fin)
+  {
+    udp_addr_t     from;
+    ssize_t        length;
+    size_t         query_length;
+    size_t         response_length;
+    fd_set         fds;
+    struct timeval tv = { 1, 0 };
+
+    if(time_us() > deadline)
+      return FALSE;
+
+    log_drain();
+
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    FD_SET(listener, &fds);
+    if(c != -1)
+      FD_SET(c, &fds);
+    if(select(MAX(MAX(s, listener), c) + 1, &fds, NULL, NULL, &tv) <= 0)
+      continue;
+
+    if(FD_ISSET(s, &fds))
+    {
+      from.length = sizeof(from.addr);
+      length = recvfrom(s, (char*)packet, EDNS_MAX_SIZE, 0, (struct sockaddr*)&from.addr, &from.length);
+      if(length > 0 && (response_length = answer_query(packet, length, FALSE, response)) > 0)
+        udp_send_addr(s, &from, response, response_length);
+    }
+
+    if(FD_ISSET(listener, &fds))
+    {
+      char     *address;
+      uint16_t  their_port;
+
+      if(c != -1)
+        tcp_close(c);
+      c = tcp_accept(listener, &address, &their_port);
+      tcp_set_nodelay(c);
+      incoming_length = 0;
+    }
+    else if(c != -1 && FD_ISSET(c, &fds))
+    {
+      length = tcp_recv(c, packet + incoming_length, sizeof(packet) - incoming_length);
+      if(length <= 0)
+      {
+        tcp_close(c);
+        c = -1;
+        continue;
+      }
+      incoming_length += length;
+
+      /* Answer every whole query, in order. */
+      while(!sent_fin && incoming_length >= 2 && incoming_length >= (size_t)((packet[0] << 8) | packet[1]) + 2)
+      {
+        query_length = (packet[0] << 8) | packet[1];
+
+        response_length = answer_query(packet + 2, query_length, TRUE, response + 2);
+        if(response_length > 0)
+        {
+          response[0] = (uint8_t)(response_length >> 8);
+          response[1] = (uint8_t)(response_length & 0xFF);
+          tcp_send(c, response, response_length + 2);
+        }
+
+        memmove(packet, packet + query_length + 2, incoming_length - query_length - 2);
+        incoming_length -= query_length + 2;
+      }
+    }
+  }
+
+  if(c != -1)
+    tcp_close(c);
+  tcp_close(listener);
+  udp_close(s);
+
+  return TRUE;
+}
+
+/* Answer the packets on one TCP connection till the session's over; returns
+ * FALSE if it times out or the connection goes away. */
+static NBBOOL serve_tcp(int port, uint64_t deadline)
+{
+  int       listener = tcp_listen("127.0.0.1", port);
+  int       s;
+  char     *address;
+  uint16_t  their_port;
+  uint8_t   incoming[65536 + 2];
+  size_t    incoming_length = 0;
+
+  s = tcp_accept(listener, &address, &their_port);
+  tcp_close(listener);
+  tcp_set_nodelay(s);
+
+  while(!sent_fin)
+  {
+    size_t         packet_length;
+    ssize_t        length;
+    uint8_t       *answer;
+    size_t         answer_length;
+    uint8_t        header[2];
+    fd_set         fds;
+    struct timeval tv = { 1, 0 };
+
+    if(time_us() > deadline)
+      return FALSE;
+
+    log_drain();
+
+    FD_ZERO(&fds);
+    FD_SET(s, &fds);
+    if(select(s + 1, &fds, NULL, NULL, &tv) <= 0)
+      continue;
+
+    /* The client may well hang up as soon as it's done, before we get to
+     * end the session ourselves. */
+    length = tcp_recv(s, incoming + incoming_length, sizeof(incoming) - incoming_length);
+    if(length <= 0)
+      break;
+    incoming_length += length;
+
+    /* Answer every whole packet, in order. */
+    while(!sent_fin && incoming_length >= 2 && incoming_length >= (size_t)((incoming[0] << 8) | incoming[1]) + 2)
+    {
+      packet_length = (incoming[0] << 8) | incoming[1];
+
+      if(packet_length > 0)
+        answer = handle_packet(incoming + 2, packet_length, TCP_MAX_ANSWER, &answer_length);
+      else
+        answer = NULL;
+      if(!answer)
+      {
+        answer = (uint8_t*)safe_malloc(1);
+        answer_length = 0;
+      }
+
+      header[0] = (uint8_t)(answer_length >> 8);
+      header[1] = (uint8_t)(answer_length & 0xFF);
+      if(tcp_send(s, header, 2) != 2 || tcp_send(s, answer, answer_length) != (ssize_t)answer_length)
+        sent_fin = TRUE;
+      safe_free(answer);
+
+      memmove(incoming, incoming + packet_length + 2, incoming_length - packet_length - 2);
+      incoming_length -= packet_length + 2;
+    }
+  }
+
+  tcp_close(s);
+
+  return sent_fin || (up_goal && up_received >= up_goal) || (down_goal && down_acked >= down_goal);
+}
+
+int main(int argc, char *argv[])
+{
+  int      port = 0;
+  int      i;
+  uint64_t deadline;
+
+  log_set_min_console_level(LOG_LEVEL_WARNING);
+
+  for(i = 1; i < argc; i++)
+  {
+    if(i + 1 >= argc)
+      usage(argv[0]);
+    else if(!strcmp(argv[i], "--port"))
+      port = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--domain"))
+      domain = argv[++i];
+    else if(!strcmp(argv[i], "--up"))
+      up_goal = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--down"))
+      down_goal = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--timeout"))
+      timeout = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--tcp"))
+      use_tcp = atoi(argv[++i]) ? TRUE : FALSE;
+    else
+      usage(argv[0]);
+  }
+
+  if(!port || (!up_goal == !down_goal))
+    usage(argv[0]);
+
+  srand((unsigned int)time(NULL));
+  for(i = 0; i < (int)sizeof(pattern); i++)
+    pattern[i] = rand() & 0xFF;
+
+  deadline = time_us() + (uint64_t)timeout * 1000000;
+
+  /* (So a client that's hung up is an error rather than a signal.) */
+  signal(SIGPIPE, SIG_IGN);
+
+  if(!(use_tcp ? serve_tcp(port, deadline) : serve_dns(port, deadline)))
+  {
+    fprintf(stderr, "bench_server: timed out (%zu bytes up, %zu bytes down)\n", up_received, down_acked);
+    return 1;
+  }
+
+  if(!finished)
+    finished = time_us();
+  print_results();
+
+  return 0;
+}
@@ -0,0 +1,718 @@
+/* check.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Checks the pieces of the client that are fiddly enough to get wrong
+ * without anybody noticing (they'd only show up as a slow or stuck session,
+ * not a crash). Run it with 'make check'; pass names (or parts of names) to
+ * only run some of them:
+ *
+ *   ./bench/check [name...]
+ *
+ * It prints each check that fails and exits with a non-zero status if any
+ * did.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "drivers/command/command_packet.h"
+#include "drivers/command/driver_command.h"
+#include "drivers/driver_exec.h"
+#include "libs/buffer.h"
+#include "libs/dns.h"
+#include "libs/log.h"
+#include "libs/memory.h"
+#include "libs/reorder_buffer.h"
+#include "libs/select_group.h"
+#include "libs/tcp.h"
+#include "libs/types.h"
+#include "tunnel_drivers/driver_dns.h"
+
+typedef struct
+{
+  char  *name;
+  void (*run)();
+} check_t;
+
+static int failures;
+
+#define CHECK(x) do { if(!(x)) { printf("  %s:%d: failed: %s\n", __FILE__, __LINE__, #x); failures++; } } while(0)
+
+/* Any old data. */
+static void fill(uint8_t *data, size_t length)
+{
+  size_t i;
+
+  for(i = 0; i < length; i++)
+    data[i] = (uint8_t) rand();
+}
+
+#ifndef NO_ADDRESS_TYPES
+/* The most data an A or AAAA response can carry (it's length-prefixed). */
+#define ADDRESS_MAX_LENGTH 255
+
+/* Build an A or AAAA response the way the server does - the length, then the
+ * data, then padding, 3 (or 15) bytes to a record, each after a sequence
+ * number that starts at first - and put it through a real packet, so the
+ * records are parsed like they would be. claimed is the length it says it
+ * has (normally just length); skip is a record to leave out and repeat is
+ * one to send twice (or -1). */
+static dns_t *make_address_response(dns_type_t type, uint8_t first, uint8_t *data, size_t length, size_t claimed, int skip, int repeat, NBBOOL shuffle)
+{
+  size_t   piece = (type == _DNS_TYPE_A) ? 3 : 15;
+  uint8_t  raw[ADDRESS_MAX_LENGTH + 16];
+  size_t   count = (length + 1 + piece - 1) / piece;
+  int      order[(ADDRESS_MAX_LENGTH + 1) * 2];
+  size_t   order_count = 0;
+  dns_t   *dns;
+  uint8_t *packet;
+  size_t   packet_length;
+  size_t   i;
+
+  memset(raw, 0xFF, sizeof(raw));
+  raw[0] = (uint8_t) claimed;
+  memcpy(raw + 1, data, length);
+
+  for(i = 0; i < count; i++)
+    if((int)i != skip)
+      order[order_count++] = (int)i;
+  if(repeat >= 0)
+    order[order_count++] = repeat;
+
+  if(shuffle)
+  {
+    for(i = order_count - 1; i > 0; i--)
+    {
+      size_t j   = rand() % (i + 1);
+      int    tmp = order[i];
+
+      order[i] = order[j];
+      order[j] = tmp;
+    }
+  }
+
+  dns = dns_create(_DNS_OPCODE_QUERY, _DNS_FLAG_QR | _DNS_FLAG_AA | _DNS_FLAG_RD, _DNS_RCODE_SUCCESS);
+  dns_add_question(dns, "check.test", type, _DNS_CLASS_IN);
+
+  for(i = 0; i < order_count; i++)
+  {
+    uint8_t  bytes[16];
+    char     address[64];
+
+    bytes[0] = first + order[i];
+    memcpy(bytes + 1, raw + (order[i] * piece), piece);
+
+    if(type == _DNS_TYPE_A)
+    {
+      sprintf(address, "%d.%d.%d.%d", bytes[0], bytes[1], bytes[2], bytes[3]);
+      dns_add_answer_A(dns, "check.test", _DNS_CLASS_IN, 1, address);
+    }
+    else
+    {
+      inet_ntop(AF_INET6, bytes, address, sizeof(address));
+      dns_add_answer_AAAA(dns, "check.test", _DNS_CLASS_IN, 1, address);
+    }
+  }
+
+  packet = dns_to_packet(dns, &packet_length);
+  dns_destroy(dns);
+
+  dns = dns_create_from_packet(packet, packet_length);
+  safe_free(packet);
+
+  return dns;
+}
+
+/* Decode a response, with a marker past max_length to make sure nothing's
+ * written there. */
+static NBBOOL decode(dns_t *dns, uint8_t *out, size_t max_length, size_t *out_length)
+{
+  NBBOOL result;
+
+  memset(out, 0xAA, max_length + 16);
+  result = driver_dns_decode_addresses(dns, out, max_length, out_length);
+  dns_destroy(dns);
+
+  CHECK(out[max_length] == 0xAA);
+
+  return result;
+}
+
+/* Random sequence numbers, but never running past 255 (the server doesn't
+ * wrap them). */
+static uint8_t random_first(dns_type_t type, size_t length)
+{
+  size_t count = (length + 1 + ((type == _DNS_TYPE_A) ? 3 : 15) - 1) / ((type == _DNS_TYPE_A) ? 3 : 15);
+
+  return (uint8_t) (rand() % (256 - count + 1));
+}
+
+static void check_decode_addresses_type(dns_type_t type)
+{
+  size_t   piece = (type == _DNS_TYPE_A) ? 3 : 15;
+  uint8_t  data[ADDRESS_MAX_LENGTH];
+  uint8_t  out[ADDRESS_MAX_LENGTH + 16];
+  size_t   out_length;
+  size_t   length;
+
+  fill(data, sizeof(data));
+
+  /* Every length, in order and shuffled. */
+  for(length = 0; length <= ADDRESS_MAX_LENGTH; length++)
+  {
+    CHECK(decode(make_address_response(type, random_first(type, length), data, length, length, -1, -1, FALSE), out, ADDRESS_MAX_LENGTH, &out_length));
+    CHECK(out_length == length && !memcmp(out, data, length));
+
+    CHECK(decode(make_address_response(type, random_first(type, length), data, length, length, -1, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+    CHECK(out_length == length && !memcmp(out, data, length));
+  }
+
+  /* The numbers can start anywhere, up to where the last one is 255. */
+  length = piece * 4;
+  CHECK(decode(make_address_response(type, 0, data, length, length, -1, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+  CHECK(out_length == length && !memcmp(out, data, length));
+  CHECK(decode(make_address_response(type, 256 - 5, data, length, length, -1, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+  CHECK(out_length == length && !memcmp(out, data, length));
+
+  /* The padding in the last record goes nowhere, even when out only has room
+   * for the data. */
+  length = piece + 1;
+  CHECK(decode(make_address_response(type, 10, data, length, length, -1, -1, TRUE), out, length, &out_length));
+  CHECK(out_length == length && !memcmp(out, data, length));
+
+  /* A gap in the middle, or a last record that's missing. */
+  length = piece * 5;
+  CHECK(!decode(make_address_response(type, 10, data, length, length, 2, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+  CHECK(!decode(make_address_response(type, 10, data, length, length, 5, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+
+  /* Repeats, including one that stands in for a missing record. */
+  CHECK(!decode(make_address_response(type, 10, data, length, length, -1, 3, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+  CHECK(!decode(make_address_response(type, 10, data, length, length, 2, 3, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+
+  /* Claiming more than the records hold, or more than out has room for. */
+  CHECK(!decode(make_address_response(type, 10, data, length, length + piece, -1, -1, TRUE), out, ADDRESS_MAX_LENGTH, &out_length));
+  CHECK(!decode(make_address_response(type, 10, data, length, length, -1, -1, TRUE), out, length - 1, &out_length));
+}
+
+static void check_decode_addresses()
+{
+  check_decode_addresses_type(_DNS_TYPE_A);
+  check_decode_addresses_type(_DNS_TYPE_AAAA);
+}
+#endif
+
+/* Check that the next segment taken at expected is data[offset..+length]. */
+static void check_take(reorder_buffer_t *reorder, uint16_t expected, uint8_t *data, size_t offset, size_t length)
+{
+  uint8_t *taken;
+  size_t   taken_length;
+
+  taken = reorder_buffer_take(reorder, expected, &taken_length);
+  CHECK(taken != NULL);
+  if(taken)
+  {
+    CHECK(taken_length == length && !memcmp(taken, data + offset, length));
+    safe_free(taken);
+  }
+}
+
+static void check_reorder_buffer()
+{
+  reorder_buffer_t *reorder = reorder_buffer_create(4, 100);
+  uint8_t           data[200];
+  size_t            length;
+
+  fill(data, sizeof(data));
+
+  /* Two segments ahead of a gap come out in order once it's filled (the
+   * caller delivers 100-109 itself). */
+  CHECK(reorder_buffer_add(reorder, 100, 120, data + 20, 5));
+  CHECK(reorder_buffer_add(reorder, 100, 110, data + 10, 10));
+  CHECK(reorder_buffer_get_count(reorder) == 2);
+  CHECK(reorder_buffer_take(reorder, 100, &length) == NULL && length == 0);
+  check_take(reorder, 110, data, 10, 10);
+  check_take(reorder, 120, data, 20, 5);
+  CHECK(reorder_buffer_get_count(reorder) == 0);
+
+  /* Repeats, the one we're waiting for, ones behind it, and empty ones are
+   * all turned away. */
+  CHECK(reorder_buffer_add(reorder, 100, 130, data, 10));
+  CHECK(!reorder_buffer_add(reorder, 100, 130, data, 10));
+  CHECK(!reorder_buffer_add(reorder, 100, 100, data, 10));
+  CHECK(!reorder_buffer_add(reorder, 100, 90, data, 10));
+  CHECK(!reorder_buffer_add(reorder, 100, 140, data, 0));
+  CHECK(reorder_buffer_get_count(reorder) == 1);
+  reorder_buffer_clear(reorder);
+
+  /* Too far ahead: it has to end within max_ahead of expected. */
+  CHECK(!reorder_buffer_add(reorder, 100, 190, data, 11));
+  CHECK(reorder_buffer_add(reorder, 100, 190, data, 10));
+  CHECK(!reorder_buffer_add(reorder, 100, 100 + 0x7FFF, data, 1));
+  reorder_buffer_clear(reorder);
+
+  /* Full. */
+  CHECK(reorder_buffer_add(reorder, 100, 110, data, 1));
+  CHECK(reorder_buffer_add(reorder, 100, 120, data, 1));
+  CHECK(reorder_buffer_add(reorder, 100, 130, data, 1));
+  CHECK(reorder_buffer_add(reorder, 100, 140, data, 1));
+  CHECK(!reorder_buffer_add(reorder, 100, 150, data, 1));
+  reorder_buffer_clear(reorder);
+
+  /* The 16-bit sequence numbers wrap around: 0x0005 is ahead of 0xFFF0, and
+   * 0xFFF8 is behind 0x0000 (so it's thrown away once we're past it). */
+  CHECK(reorder_buffer_add(reorder, 0xFFF0, 0x0005, data, 4));
+  CHECK(reorder_buffer_add(reorder, 0xFFF0, 0xFFF8, data + 50, 8));
+  CHECK(!reorder_buffer_add(reorder, 0x0005, 0xFFF8, data, 8));
+  check_take(reorder, 0xFFF8, data, 50, 8);
+  check_take(reorder, 0x0005, data, 0, 4);
+
+  CHECK(reorder_buffer_add(reorder, 0xFFF0, 0xFFF8, data, 8));
+  CHECK(reorder_buffer_take(reorder, 0x0000, &length) == NULL);
+  CHECK(reorder_buffer_get_count(reorder) == 0);
+
+  reorder_buffer_destroy(reorder);
+}
+
+/* A driver_command_t with tunnels to sockets that we have the other end of. */
+typedef struct
+{
+  select_group_t   *group;
+  driver_command_t *driver;
+  int               listener;
+  uint16_t          port;
+  uint16_t          request_id;
+
+  /* What the driver's sent us that hasn't been parsed yet. */
+  buffer_t         *stream;
+
+  /* The tunnel data that's come out so far, from every tunnel. */
+  size_t            data_length;
+} harness_t;
+
+/* What's come out of one tunnel so far. */
+typedef struct
+{
+  uint32_t  tunnel_id;
+  uint8_t  *data;
+  size_t    length;
+  size_t    packets;
+  NBBOOL    is_closed;
+
+  /* How much tunnel data (from any tunnel) came out before this one's. */
+  size_t    first_at;
+} seen_tunnel_t;
+
+#define HARNESS_MAX_DATA 65536
+
+static void harness_create(harness_t *harness, uint32_t coalesce_delay)
+{
+  struct sockaddr_in addr;
+  socklen_t          addr_length = sizeof(addr);
+
+  harness->group       = select_group_create();
+  harness->driver      = driver_command_create(harness->group);
+  harness->listener    = tcp_listen("127.0.0.1", 0);
+  harness->request_id  = 1;
+  harness->stream      = buffer_create(BO_BIG_ENDIAN);
+  harness->data_length = 0;
+
+  getsockname(harness->listener, (struct sockaddr*) &addr, &addr_length);
+  harness->port = ntohs(addr.sin_port);
+
+  driver_command_set_coalesce_delay(coalesce_delay);
+}
+
+static void harness_destroy(harness_t *harness)
+{
+  driver_command_destroy(harness->driver);
+  select_group_destroy(harness->group);
+  tcp_close(harness->listener);
+  buffer_destroy(harness->stream);
+}
+
+/* Let the group do what it does for ms milliseconds. */
+static void run_group(select_group_t *group, uint32_t ms)
+{
+  uint64_t until = select_group_time_ms() + ms;
+
+  do
+  {
+    select_group_do_select(group, 1);
+  } while(select_group_time_ms() < until);
+}
+
+static void harness_run(harness_t *harness, uint32_t ms)
+{
+  run_group(harness->group, ms);
+}
+
+/* The next whole packet the driver sends, taking up to max_length bytes of
+ * its outgoing data (like a session would) if there isn't one yet. */
+static command_packet_t *harness_next(harness_t *harness, size_t max_length)
+{
+  command_packet_t *packet = command_packet_read(harness->stream);
+  uint8_t          *data;
+  size_t            length;
+
+  if(packet)
+    return packet;
+
+  data = driver_command_get_outgoing(harness->driver, &length, max_length);
+  if(data)
+  {
+    buffer_add_bytes(harness->stream, data, length);
+    safe_free(data);
+  }
+  buffer_compact(harness->stream);
+
+  return command_packet_read(harness->stream);
+}
+
+static void harness_send(harness_t *harness, command_packet_t *packet)
+{
+  uint8_t *data;
+  size_t   length;
+
+  data = command_packet_to_bytes(packet, &length);
+  driver_command_data_received(harness->driver, data, length);
+  safe_free(data);
+  command_packet_destroy(packet);
+}
+
+/* Have the driver open a tunnel to us; returns our end of it (or -1). */
+static int harness_open(harness_t *harness, seen_tunnel_t *seen)
+{
+  command_packet_t *packet;
+  char             *address;
+  uint16_t          port;
+  int               s;
+  int               i;
+
+  harness_send(harness, command_packet_create_tunnel_connect_request(harness->request_id++, 0, "127.0.0.1", harness->port));
+  s = tcp_accept(harness->listener, &address, &port);
+
+  memset(seen, 0, sizeof(seen_tunnel_t));
+  seen->data = (uint8_t*) safe_malloc(HARNESS_MAX_DATA);
+
+  for(i = 0; i < 100; i++)
+  {
+    harness_run(harness, 10);
+
+    packet = harness_next(harness, HARNESS_MAX_DATA);
+    if(packet)
+    {
+      NBBOOL ok = packet->command_id == TUNNEL_CONNECT && !packet->is_request;
+
+      if(ok)
+        seen->tunnel_id = packet->r.response.body.tunnel_connect.tunnel_id;
+      command_packet_destroy(packet);
+
+      CHECK(ok);
+      return ok ? s : -1;
+    }
+  }
+
+  CHECK(!"the tunnel connected");
+  return -1;
+}
+
+/* Take what the driver has to send, max_length bytes at a time, and sort it
+ * by tunnel. Returns how many times it took any. */
+static size_t harness_collect(harness_t *harness, seen_tunnel_t *seen, size_t count, size_t max_length)
+{
+  command_packet_t *packet;
+  size_t            reads = 0;
+  size_t            i;
+
+  while((packet = harness_next(harness, max_length)))
+  {
+    reads++;
+
+    for(i = 0; i < count; i++)
+    {
+      if(packet->command_id == TUNNEL_DATA && packet->r.request.body.tunnel_data.tunnel_id == seen[i].tunnel_id)
+      {
+        uint32_t length = packet->r.request.body.tunnel_data.length;
+
+        /* Nothing comes after the close. */
+        CHECK(!seen[i].is_closed);
+        CHECK(seen[i].length + length <= HARNESS_MAX_DATA);
+
+        if(seen[i].length == 0)
+          seen[i].first_at = harness->data_length;
+        if(seen[i].length + length <= HARNESS_MAX_DATA)
+          memcpy(seen[i].data + seen[i].length, packet->r.request.body.tunnel_data.data, length);
+
+        seen[i].length += length;
+        seen[i].packets++;
+        harness->data_length += length;
+      }
+      else if(packet->command_id == TUNNEL_CLOSE && packet->r.request.body.tunnel_close.tunnel_id == seen[i].tunnel_id)
+      {
+        seen[i].is_closed = TRUE;
+      }
+    }
+
+    command_packet_destroy(packet);
+  }
+
+  return reads;
+}
+
+/* Small writes, a couple of ms apart, come out with delay (ms) between them
+ * at most. */
+static void check_tunnel_coalescing_with(uint32_t delay)
+{
+  harness_t      harness;
+  seen_tunnel_t  seen;
+  uint8_t        data[500];
+  int            s;
+  size_t         i;
+
+  fill(data, sizeof(data));
+
+  harness_create(&harness, delay);
+  s = harness_open(&harness, &seen);
+  if(s != -1)
+  {
+    for(i = 0; i < sizeof(data); i += 10)
+    {
+      CHECK(tcp_send(s, data + i, 10) == 10);
+      harness_run(&harness, 2);
+    }
+    harness_run(&harness, delay + 20);
+    harness_collect(&harness, &seen, 1, HARNESS_MAX_DATA);
+
+    CHECK(seen.length == sizeof(data) && !memcmp(seen.data, data, sizeof(data)));
+    if(delay)
+      CHECK(seen.packets <= 10);
+    else
+      CHECK(seen.packets >= 25);
+
+    /* What it's holding onto goes out before the close does. */
+    seen.length = 0;
+    CHECK(tcp_send(s, data, 10) == 10);
+    tcp_close(s);
+    harness_run(&harness, 10);
+    harness_collect(&harness, &seen, 1, HARNESS_MAX_DATA);
+
+    CHECK(seen.length == 10 && !memcmp(seen.data, data, 10));
+    CHECK(seen.is_closed);
+  }
+
+  safe_free(seen.data);
+  harness_destroy(&harness);
+}
+
+static void check_tunnel_coalescing()
+{
+  check_tunnel_coalescing_with(20);
+  check_tunnel_coalescing_with(0);
+}
+
+/* A tunnel that's sending as fast as it can doesn't hold up one that only
+ * sends a little, and doesn't lose anything by being made to wait. */
+static void check_tunnel_fairness()
+{
+  harness_t      harness;
+  seen_tunnel_t  seen[2];
+  uint8_t       *bulk = (uint8_t*) safe_malloc(HARNESS_MAX_DATA);
+  uint8_t        chat[100];
+  int            bulk_s;
+  int            chat_s;
+  size_t         length = 3 * COMMAND_MAX_BUFFERED;
+  int            i;
+
+  fill(bulk, HARNESS_MAX_DATA);
+  fill(chat, sizeof(chat));
+
+  harness_create(&harness, 0);
+  bulk_s = harness_open(&harness, &seen[0]);
+  chat_s = harness_open(&harness, &seen[1]);
+  if(bulk_s != -1 && chat_s != -1)
+  {
+    /* Far more than the bulk tunnel can queue up, so it has to pause. */
+    CHECK(tcp_send(bulk_s, bulk, length) == (ssize_t)length);
+    harness_run(&harness, 50);
+    CHECK(tcp_send(chat_s, chat, sizeof(chat)) == sizeof(chat));
+    harness_run(&harness, 10);
+
+    /* Take it out a bit at a time, like a session would. */
+    for(i = 0; i < 1000 && seen[0].length < length; i++)
+    {
+      harness_collect(&harness, seen, 2, 1024);
+      harness_run(&harness, 1);
+    }
+
+    CHECK(seen[0].length == length && !memcmp(seen[0].data, bulk, length));
+    CHECK(seen[1].length == sizeof(chat) && !memcmp(seen[1].data, chat, sizeof(chat)));
+
+    /* Everything the bulk tunnel had queued up (and more) would be ahead of
+     * it if they didn't take turns. */
+    CHECK(seen[1].first_at < COMMAND_MAX_BUFFERED);
+
+    /* What's still queued up goes out ahead of the close. */
+    seen[0].length = 0;
+    CHECK(tcp_send(bulk_s, bulk, COMMAND_MAX_BUFFERED / 2) == COMMAND_MAX_BUFFERED / 2);
+    harness_run(&harness, 10);
+    tcp_close(bulk_s);
+    harness_run(&harness, 10);
+    harness_collect(&harness, seen, 2, HARNESS_MAX_DATA);
+
+    CHECK(seen[0].length == COMMAND_MAX_BUFFERED / 2 && !memcmp(seen[0].data, bulk, COMMAND_MAX_BUFFERED / 2));
+    CHECK(seen[0].is_closed);
+    CHECK(!seen[1].is_closed);
+
+    tcp_close(chat_s);
+  }
+
+  safe_free(seen[0].data);
+  safe_free(seen[1].data);
+  safe_free(bulk);
+  harness_destroy(&harness);
+}
+
+/* A one-shot timer that adds itself again, with no delay, every time it
+ * runs (up to a limit, so a broken select_group can't hang the check). */
+static int timer_runs;
+
+static SELECT_RESPONSE_t readd_timeout(void *group, void *param)
+{
+  if(++timer_runs < 100000)
+    select_group_add_timer((select_group_t*) group, 0, 0, readd_timeout, NULL);
+
+  return SELECT_OK;
+}
+
+static void check_timers()
+{
+  select_group_t *group = select_group_create();
+
+  /* Each pass only runs it once, and the next one still gets to it. */
+  timer_runs = 0;
+  select_group_add_timer(group, 0, 0, readd_timeout, NULL);
+  select_group_do_select(group, 0);
+  CHECK(timer_runs == 1);
+  run_group(group, 20);
+  CHECK(timer_runs > 1 && timer_runs <= 21);
+
+  select_group_destroy(group);
+}
+
+/* Start process, destroy its driver once it's going, and make sure it's
+ * gone - not even a zombie - within ms. */
+static void check_exec_reaping_of(char *process, uint32_t ms)
+{
+  select_group_t *group  = select_group_create();
+  driver_exec_t  *driver = driver_exec_create(group, process);
+  pid_t           pid    = driver->pid;
+  uint64_t        until;
+
+  run_group(group, 100);
+  driver_exec_destroy(driver);
+
+  /* (A zombie still "exists" as far as kill() is concerned.) */
+  until = select_group_time_ms() + ms;
+  while(kill(pid, 0) == 0 && select_group_time_ms() < until)
+    run_group(group, 10);
+
+  CHECK(kill(pid, 0) != 0);
+
+  select_group_destroy(group);
+}
+
+static void check_exec_reaping()
+{
+  select_group_t *group;
+  driver_exec_t  *driver;
+  pid_t           pid;
+
+  /* One that exits when it's told to, and one that has to be killed. */
+  check_exec_reaping_of("exec sleep 30", 500);
+  check_exec_reaping_of("trap '' INT; exec sleep 30", 3000);
+
+  /* The group going away while it's still waiting on one (which, built with
+   * TESTMEMORY, shouldn't leave anything behind). */
+  group  = select_group_create();
+  driver = driver_exec_create(group, "trap '' INT; exec sleep 30");
+  pid    = driver->pid;
+
+  run_group(group, 100);
+  driver_exec_destroy(driver);
+  run_group(group, 100);
+  select_group_destroy(group);
+
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+}
+
+static check_t checks[] = {
+#ifndef NO_ADDRESS_TYPES
+  { "decode_addresses", check_decode_addresses },
+#endif
+  { "reorder_buffer",   check_reorder_buffer   },
+  { "tunnel_coalescing", check_tunnel_coalescing },
+  { "tunnel_fairness",  check_tunnel_fairness  },
+  { "timers",           check_timers           },
+  { "exec_reaping",     check_exec_reaping     },
+  { NULL,               NULL                   }
+};
+
+static NBBOOL is_selected(char *name, int argc, char *argv[])
+{
+  int i;
+
+  if(argc < 2)
+    return TRUE;
+
+  for(i = 1; i < argc; i++)
+    if(strstr(name, argv[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+  check_t *check;
+  int      failed_checks = 0;
+
+  srand(0);
+
+  /* The tunnels talk a lot. */
+  log_set_min_console_level(LOG_LEVEL_ERROR);
+
+  for(check = checks; check->name; check++)
+  {
+    int before = failures;
+
+    if(!is_selected(check->name, argc, argv))
+      continue;
+
+    check->run();
+
+    if(failures == before)
+    {
+      printf("%-28s ok\n", check->name);
+    }
+    else
+    {
+      printf("%-28s FAILED\n", check->name);
+      failed_checks++;
+    }
+  }
+
+  print_memory();
+
+  return failed_checks ? 1 : 0;
+}
@@ -0,0 +1,399 @@
+/* microbench.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Times the pieces the client's hot path is built from, one at a time, and
+ * prints how long each call takes and how many allocations it makes (going
+ * by memory_get_allocation_count()). Run it with 'make microbench'; pass
+ * names (or parts of names) to only run some of them:
+ *
+ *   ./bench/microbench [-t <ms>] [name...]
+ *
+ * Each one is repeated until it's taken at least the given time (default:
+ * 200ms), so the numbers are good to compare between builds and machines.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/time.h>
+
+#include "controller/packet.h"
+#include "drivers/command/command_packet.h"
+#include "libs/buffer.h"
+#include "libs/crypto/micro-ecc/uECC.h"
+#include "libs/crypto/salsa20.h"
+#include "libs/crypto/sha3.h"
+#include "libs/dns.h"
+#include "libs/memory.h"
+#include "libs/types.h"
+
+/* What a typical query carries, and what a typical answer does (about what
+ * fits in a TXT record). */
+#define NAME_DATA_LENGTH 100
+#define TXT_DATA_LENGTH  200
+
+/* How much data each call works on, for the ones that take any. */
+#define CHUNK_LENGTH 256
+
+typedef struct
+{
+  char   *name;
+  void  (*run)(size_t iterations);
+
+  /* How much data each call handles (0 if it doesn't make sense). */
+  size_t  bytes_per_op;
+} benchmark_t;
+
+/* Set by timer_start() and timer_stop(), so each benchmark can leave its
+ * setup and cleanup out of what's measured. */
+static uint64_t timer_started;
+static uint64_t timer_elapsed;
+static size_t   timer_allocations_started;
+static size_t   timer_allocations;
+
+static uint64_t time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+static void timer_start()
+{
+  timer_allocations_started = memory_get_allocation_count();
+  timer_started = time_us();
+}
+
+static void timer_stop()
+{
+  timer_elapsed     = time_us() - timer_started;
+  timer_allocations = memory_get_allocation_count() - timer_allocations_started;
+}
+
+/* Any old data; the contents don't matter to any of these. */
+static void fill(uint8_t *data, size_t length)
+{
+  size_t i;
+
+  for(i = 0; i < length; i++)
+    data[i] = (uint8_t)((i * 7) + 3);
+}
+
+/* A DNS response like the ones the client gets: one TXT answer to a
+ * hex-encoded name. */
+static uint8_t *make_dns_packet(size_t *length)
+{
+  static const char *hex = "0123456789abcdef";
+  char     name[(NAME_DATA_LENGTH * 2) + 16];
+  uint8_t  text[TXT_DATA_LENGTH];
+  dns_t   *dns = dns_create(_DNS_OPCODE_QUERY, _DNS_FLAG_QR | _DNS_FLAG_AA | _DNS_FLAG_RD, _DNS_RCODE_SUCCESS);
+  uint8_t *packet;
+  size_t   i;
+  size_t   n = 0;
+
+  for(i = 0; i < NAME_DATA_LENGTH * 2; i++)
+  {
+    if(i > 0 && i % 62 == 0)
+      name[n++] = '.';
+    name[n++] = hex[i % 16];
+  }
+  strcpy(name + n, ".bench.test");
+
+  fill(text, sizeof(text));
+
+  dns->trn_id = 0x1234;
+  dns_add_question(dns, name, _DNS_TYPE_TEXT, _DNS_CLASS_IN);
+  dns_add_answer_TEXT(dns, name, _DNS_CLASS_IN, 1, text, sizeof(text));
+
+  packet = dns_to_packet(dns, length);
+  dns_destroy(dns);
+
+  return packet;
+}
+
+static void bench_buffer_add_bytes(size_t iterations)
+{
+  uint8_t   data[CHUNK_LENGTH];
+  buffer_t *buffer;
+  size_t    i;
+
+  fill(data, sizeof(data));
+
+  buffer = buffer_create(BO_BIG_ENDIAN);
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    buffer_add_bytes(buffer, data, sizeof(data));
+  timer_stop();
+  buffer_destroy(buffer);
+}
+
+static void bench_buffer_read_remaining_bytes(size_t iterations)
+{
+  uint8_t   data[CHUNK_LENGTH];
+  uint8_t  *read;
+  size_t    length;
+  buffer_t *buffer;
+  size_t    i;
+
+  fill(data, sizeof(data));
+
+  buffer = buffer_create(BO_BIG_ENDIAN);
+  for(i = 0; i < iterations; i++)
+    buffer_add_bytes(buffer, data, sizeof(data));
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+  {
+    read = buffer_read_remaining_bytes(buffer, &length, sizeof(data), TRUE);
+    safe_free(read);
+  }
+  timer_stop();
+  buffer_destroy(buffer);
+}
+
+static void bench_dns_create_from_packet(size_t iterations)
+{
+  size_t   length;
+  uint8_t *packet = make_dns_packet(&length);
+  size_t   i;
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    dns_destroy(dns_create_from_packet(packet, length));
+  timer_stop();
+  safe_free(packet);
+}
+
+static void bench_dns_to_packet(size_t iterations)
+{
+  size_t   length;
+  uint8_t *packet = make_dns_packet(&length);
+  dns_t   *dns    = dns_create_from_packet(packet, length);
+  size_t   i;
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    safe_free(dns_to_packet(dns, &length));
+  timer_stop();
+  dns_destroy(dns);
+  safe_free(packet);
+}
+
+static void packet_parse_with(size_t iterations, packet_t *(*parse)(uint8_t *data, size_t length, options_t options))
+{
+  uint8_t   data[NAME_DATA_LENGTH];
+  packet_t *packet;
+  uint8_t  *bytes;
+  size_t    length;
+  size_t    i;
+
+  fill(data, sizeof(data));
+  packet = packet_create_msg(0x1234, 0x1111, 0x2222, data, sizeof(data));
+  bytes = packet_to_bytes(packet, &length, 0);
+  packet_destroy(packet);
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    packet_destroy(parse(bytes, length, 0));
+  timer_stop();
+  safe_free(bytes);
+}
+
+static void bench_packet_parse(size_t iterations)
+{
+  packet_parse_with(iterations, packet_parse);
+}
+
+static void bench_packet_parse_view(size_t iterations)
+{
+  packet_parse_with(iterations, packet_parse_view);
+}
+
+static void bench_packet_to_bytes(size_t iterations)
+{
+  uint8_t   data[NAME_DATA_LENGTH];
+  packet_t *packet;
+  size_t    length;
+  size_t    i;
+
+  fill(data, sizeof(data));
+  packet = packet_create_msg(0x1234, 0x1111, 0x2222, data, sizeof(data));
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    safe_free(packet_to_bytes(packet, &length, 0));
+  timer_stop();
+  packet_destroy(packet);
+}
+
+static void command_packet_read_with(size_t iterations, command_packet_t *(*read)(buffer_t *stream))
+{
+  uint8_t           data[NAME_DATA_LENGTH];
+  command_packet_t *packet;
+  uint8_t          *bytes;
+  size_t            length;
+  buffer_t         *stream;
+  size_t            i;
+
+  fill(data, sizeof(data));
+  packet = command_packet_create_tunnel_data_request(0x1234, 1, data, sizeof(data));
+  bytes = command_packet_to_bytes(packet, &length);
+  command_packet_destroy(packet);
+
+  /* The same stream of packets the command driver would see. */
+  stream = buffer_create(BO_BIG_ENDIAN);
+  for(i = 0; i < iterations; i++)
+    buffer_add_bytes(stream, bytes, length);
+  safe_free(bytes);
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    command_packet_destroy(read(stream));
+  timer_stop();
+  buffer_destroy(stream);
+}
+
+static void bench_command_packet_read(size_t iterations)
+{
+  command_packet_read_with(iterations, command_packet_read);
+}
+
+static void bench_command_packet_read_view(size_t iterations)
+{
+  command_packet_read_with(iterations, command_packet_read_view);
+}
+
+static void bench_s20_crypt(size_t iterations)
+{
+  uint8_t key[32];
+  uint8_t nonce[8];
+  uint8_t data[CHUNK_LENGTH];
+  size_t  i;
+
+  fill(key, sizeof(key));
+  fill(nonce, sizeof(nonce));
+  fill(data, sizeof(data));
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    s20_crypt(key, S20_KEYLEN_256, nonce, 0, data, sizeof(data));
+  timer_stop();
+}
+
+static void bench_sha3_update(size_t iterations)
+{
+  sha3_ctx ctx;
+  uint8_t  data[CHUNK_LENGTH];
+  uint8_t  hash[32];
+  size_t   i;
+
+  fill(data, sizeof(data));
+  sha3_256_init(&ctx);
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    sha3_update(&ctx, data, sizeof(data));
+  timer_stop();
+  sha3_final(&ctx, hash);
+}
+
+static void bench_uECC_shared_secret(size_t iterations)
+{
+  uint8_t     my_public_key[64];
+  uint8_t     my_private_key[32];
+  uint8_t     their_public_key[64];
+  uint8_t     their_private_key[32];
+  uint8_t     secret[32];
+  uECC_Curve  curve = uECC_secp256r1();
+  size_t      i;
+
+  if(!uECC_make_key(my_public_key, my_private_key, curve) || !uECC_make_key(their_public_key, their_private_key, curve))
+  {
+    fprintf(stderr, "Couldn't generate a key!\n");
+    exit(1);
+  }
+
+  timer_start();
+  for(i = 0; i < iterations; i++)
+    uECC_shared_secret(their_public_key, my_private_key, secret, curve);
+  timer_stop();
+}
+
+static benchmark_t benchmarks[] = {
+  { "buffer_add_bytes",            bench_buffer_add_bytes,            CHUNK_LENGTH     },
+  { "buffer_read_remaining_bytes", bench_buffer_read_remaining_bytes, CHUNK_LENGTH     },
+  { "dns_create_from_packet",      bench_dns_create_from_packet,      0                },
+  { "dns_to_packet",               bench_dns_to_packet,               0                },
+  { "packet_parse",                bench_packet_parse,                0                },
+  { "packet_parse_view",           bench_packet_parse_view,           0                },
+  { "packet_to_bytes",             bench_packet_to_bytes,             0                },
+  { "command_packet_read",         bench_command_packet_read,         0                },
+  { "command_packet_read_view",    bench_command_packet_read_view,    0                },
+  { "s20_crypt",                   bench_s20_crypt,                   CHUNK_LENGTH     },
+  { "sha3_update",                 bench_sha3_update,                 CHUNK_LENGTH     },
+  { "uECC_shared_secret",          bench_uECC_shared_secret,          0                },
+  { NULL,                          NULL,                              0                }
+};
+
+static NBBOOL is_selected(char *name, int argc, char *argv[], int first)
+{
+  int i;
+
+  if(first >= argc)
+    return TRUE;
+
+  for(i = first; i < argc; i++)
+    if(strstr(name, argv[i]))
+      return TRUE;
+
+  return FALSE;
+}
+
+int main(int argc, char *argv[])
+{
+  uint64_t     min_time = 200000;
+  int          first    = 1;
+  benchmark_t *benchmark;
+
+  if(argc > 2 && !strcmp(argv[1], "-t"))
+  {
+    min_time = (uint64_t)atoi(argv[2]) * 1000;
+    first = 3;
+  }
+
+  printf("%-28s %12s %10s %12s %10s\n", "benchmark", "iterations", "ns/op", "allocs/op", "MB/s");
+
+  for(benchmark = benchmarks; benchmark->name; benchmark++)
+  {
+    size_t iterations = 1;
+    double ns_per_op;
+
+    if(!is_selected(benchmark->name, argc, argv, first))
+      continue;
+
+    /* Keep doubling till it takes long enough to time. */
+    while(TRUE)
+    {
+      benchmark->run(iterations);
+      if(timer_elapsed >= min_time)
+        break;
+      iterations *= 2;
+    }
+
+    ns_per_op = (timer_elapsed * 1000.0) / iterations;
+
+    printf("%-28s %12lu %10.1f %12.2f", benchmark->name, (unsigned long)iterations, ns_per_op, (double)timer_allocations / iterations);
+    if(benchmark->bytes_per_op)
+      printf(" %10.1f\n", (benchmark->bytes_per_op * 1000.0) / ns_per_op);
+    else
+      printf(" %10s\n", "-");
+  }
+
+  print_memory();
+
+  return 0;
+}
@@ -0,0 +1,498 @@
+/* netsim.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A pretend resolver for trying the protocol out over a bad network: it sits
+ * between the client and a server (bench_server or the real one), passing
+ * queries and answers along, and on the way adds latency, jitter, loss,
+ * reordering and duplicate answers, caches answers like a resolver would
+ * (with the TTLs cut down to --max-ttl), and truncates answers that are
+ * bigger than --truncate. See netsim.sh for how it's used.
+ *
+ * Everything it decides comes from one random number generator with a fixed
+ * seed, one packet at a time, so the same settings (and the same traffic)
+ * get the same treatment every time. When it's killed (or --duration runs
+ * out) it prints what it did:
+ *
+ *   queries=<n> answers=<n> dropped=<n> duplicated=<n> reordered=<n> cache_hits=<n> truncated=<n>
+ */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include "libs/types.h"
+#include "libs/udp.h"
+
+#define MAX_DNS_PACKET 4096
+
+/* How many packets can be on their way at once (the rest are dropped). */
+#define MAX_PENDING 1024
+
+/* How many answers the cache holds, and how many queries we remember so the
+ * answers can be matched up with them (by transaction id). */
+#define CACHE_SIZE        256
+#define MAX_OUTSTANDING   256
+
+/* How much later a reordered packet shows up than it would have (in ms), on
+ * top of the usual latency. */
+#define REORDER_DELAY 20
+
+typedef struct
+{
+  NBBOOL   in_use;
+  uint64_t deliver_at;
+  NBBOOL   to_server;
+  size_t   length;
+  uint8_t  data[MAX_DNS_PACKET];
+} pending_t;
+
+typedef struct
+{
+  NBBOOL   in_use;
+  uint64_t expires_at;
+  size_t   key_length;
+  uint8_t  key[MAX_DNS_PACKET];
+  size_t   length;
+  uint8_t  data[MAX_DNS_PACKET];
+} cache_entry_t;
+
+typedef struct
+{
+  NBBOOL   in_use;
+  uint16_t trn_id;
+  size_t   key_length;
+  uint8_t  key[MAX_DNS_PACKET];
+} outstanding_t;
+
+/* Settings. */
+static uint32_t seed         = 1;
+static int      latency      = 0;
+static int      jitter       = 0;
+static double   loss         = 0;
+static double   duplicate    = 0;
+static double   reorder      = 0;
+static int      max_ttl      = 0;
+static size_t   truncate_at  = 0;
+
+static pending_t     pending[MAX_PENDING];
+static cache_entry_t cache[CACHE_SIZE];
+static int           next_cache_entry = 0;
+static outstanding_t outstanding[MAX_OUTSTANDING];
+static int           next_outstanding = 0;
+
+/* What we've done. */
+static uint32_t stat_queries    = 0;
+static uint32_t stat_answers    = 0;
+static uint32_t stat_dropped    = 0;
+static uint32_t stat_duplicated = 0;
+static uint32_t stat_reordered  = 0;
+static uint32_t stat_cache_hits = 0;
+static uint32_t stat_truncated  = 0;
+
+static volatile NBBOOL is_done = FALSE;
+
+static uint64_t time_us()
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return ((uint64_t)tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+/* xorshift32; nothing fancy, but the same on every platform. */
+static uint32_t next_random()
+{
+  seed ^= seed << 13;
+  seed ^= seed >> 17;
+  seed ^= seed << 5;
+
+  return seed;
+}
+
+static NBBOOL chance(double percent)
+{
+  if(percent <= 0)
+    return FALSE;
+
+  return (next_random() % 10000) < (uint32_t)(percent * 100);
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s --listen <port> --server <port> [options]\n", name);
+  fprintf(stderr, "\n");
+  fprintf(stderr, " --seed <n>        Seed for every random decision (default: 1)\n");
+  fprintf(stderr, " --latency <ms>    Added to every packet, each way\n");
+  fprintf(stderr, " --jitter <ms>     Up to this much more, at random\n");
+  fprintf(stderr, " --loss <%%>        Drop this many packets, each way\n");
+  fprintf(stderr, " --duplicate <%%>   Send this many answers twice\n");
+  fprintf(stderr, " --reorder <%%>     Hold this many packets back, so later ones pass them\n");
+  fprintf(stderr, " --max-ttl <s>     Cache answers for up to this long (default: 0, no cache)\n");
+  fprintf(stderr, " --truncate <n>    Truncate (set TC on) answers longer than this\n");
+  fprintf(stderr, " --duration <s>    Exit after this long (default: run till killed)\n");
+  exit(1);
+}
+
+static void on_signal(int sig)
+{
+  is_done = TRUE;
+}
+
+/* The length of the name at offset, or 0 if it's broken. */
+static size_t skip_name(uint8_t *packet, size_t length, size_t offset)
+{
+  size_t start = offset;
+
+  while(offset < length)
+  {
+    if((packet[offset] & 0xC0) == 0xC0)
+      return (offset + 2 <= length) ? (offset + 2 - start) : 0;
+    if(packet[offset] == 0)
+      return offset + 1 - start;
+    offset += packet[offset] + 1;
+  }
+
+  return 0;
+}
+
+/* The end of the question (the cache key is everything from the flags to
+ * there), or 0 if there isn't one. */
+static size_t get_question_end(uint8_t *packet, size_t length)
+{
+  size_t name_length;
+
+  if(length < 12 || packet[4] != 0 || packet[5] != 1)
+    return 0;
+
+  name_length = skip_name(packet, length, 12);
+  if(!name_length || 12 + name_length + 4 > length)
+    return 0;
+
+  return 12 + name_length + 4;
+}
+
+/* The smallest TTL in the answers (in seconds), or -1 if there aren't any. */
+static int get_min_ttl(uint8_t *packet, size_t length)
+{
+  size_t   offset = get_question_end(packet, length);
+  uint16_t count  = (packet[6] << 8) | packet[7];
+  int      ttl    = -1;
+
+  if(!offset)
+    return -1;
+
+  for(; count > 0; count--)
+  {
+    size_t   name_length = skip_name(packet, length, offset);
+    uint32_t this_ttl;
+
+    if(!name_length || offset + name_length + 10 > length)
+      return -1;
+    offset += name_length;
+
+    this_ttl = (packet[offset + 4] << 24) | (packet[offset + 5] << 16) | (packet[offset + 6] << 8) | packet[offset + 7];
+    if(ttl < 0 || this_ttl < (uint32_t)ttl)
+      ttl = (int)MIN(this_ttl, 0x7FFFFFFF);
+
+    offset += 10 + ((packet[offset + 8] << 8) | packet[offset + 9]);
+  }
+
+  return ttl;
+}
+
+static void schedule(uint8_t *data, size_t length, NBBOOL to_server)
+{
+  uint64_t delay = (uint64_t)latency * 1000;
+  int      i;
+
+  if(jitter > 0)
+    delay += (next_random() % ((uint32_t)jitter * 1000));
+
+  if(chance(reorder))
+  {
+    delay += (uint64_t)(latency + jitter + REORDER_DELAY) * 1000;
+    stat_reordered++;
+  }
+
+  for(i = 0; i < MAX_PENDING; i++)
+  {
+    if(!pending[i].in_use)
+    {
+      pending[i].in_use     = TRUE;
+      pending[i].deliver_at = time_us() + delay;
+      pending[i].to_server  = to_server;
+      pending[i].length     = length;
+      memcpy(pending[i].data, data, length);
+      return;
+    }
+  }
+
+  /* There's no room, so it's lost like any other packet. */
+  stat_dropped++;
+}
+
+static cache_entry_t *cache_find(uint8_t *key, size_t key_length)
+{
+  uint64_t now = time_us();
+  int      i;
+
+  for(i = 0; i < CACHE_SIZE; i++)
+  {
+    cache_entry_t *entry = &cache[i];
+
+    if(entry->in_use && entry->expires_at > now && entry->key_length == key_length && !memcmp(entry->key, key, key_length))
+      return entry;
+  }
+
+  return NULL;
+}
+
+static void cache_add(uint8_t *key, size_t key_length, uint8_t *data, size_t length, int ttl)
+{
+  cache_entry_t *entry = cache_find(key, key_length);
+
+  if(!entry)
+  {
+    entry = &cache[next_cache_entry];
+    next_cache_entry = (next_cache_entry + 1) % CACHE_SIZE;
+  }
+
+  entry->in_use     = TRUE;
+  entry->expires_at = time_us() + (uint64_t)ttl * 1000000;
+  entry->key_length = key_length;
+  memcpy(entry->key, key, key_length);
+  entry->length     = length;
+  memcpy(entry->data, data, length);
+}
+
+/* A query from the client: answer it from the cache, or pass it on. */
+static void handle_query(uint8_t *data, size_t length)
+{
+  size_t         question_end = get_question_end(data, length);
+  cache_entry_t *entry;
+
+  stat_queries++;
+
+  if(!question_end)
+    return;
+
+  /* Hits skip the trip to the server, but not the one back. */
+  if(max_ttl > 0 && (entry = cache_find(data + 2, question_end - 2)) != NULL)
+  {
+    uint8_t answer[MAX_DNS_PACKET];
+
+    memcpy(answer, entry->data, entry->length);
+    answer[0] = data[0];
+    answer[1] = data[1];
+
+    stat_cache_hits++;
+    schedule(answer, entry->length, FALSE);
+    return;
+  }
+
+  if(chance(loss))
+  {
+    stat_dropped++;
+    return;
+  }
+
+  if(max_ttl > 0)
+  {
+    outstanding_t *query = &outstanding[next_outstanding];
+    next_outstanding = (next_outstanding + 1) % MAX_OUTSTANDING;
+
+    query->in_use     = TRUE;
+    query->trn_id     = (data[0] << 8) | data[1];
+    query->key_length = question_end - 2;
+    memcpy(query->key, data + 2, query->key_length);
+  }
+
+  schedule(data, length, TRUE);
+}
+
+/* An answer from the server: cache it, maybe truncate it, and send it back
+ * (once or twice, or not at all). */
+static void handle_answer(uint8_t *data, size_t length)
+{
+  size_t question_end = get_question_end(data, length);
+
+  stat_answers++;
+
+  if(!question_end)
+    return;
+
+  if(max_ttl > 0)
+  {
+    uint16_t trn_id = (data[0] << 8) | data[1];
+    int      ttl    = get_min_ttl(data, length);
+    int      i;
+
+    for(i = 0; i < MAX_OUTSTANDING && ttl > 0; i++)
+    {
+      if(outstanding[i].in_use && outstanding[i].trn_id == trn_id)
+      {
+        cache_add(outstanding[i].key, outstanding[i].key_length, data, length, MIN(ttl, max_ttl));
+        outstanding[i].in_use = FALSE;
+        break;
+      }
+    }
+  }
+
+  /* Just the header and question, with TC set and no records. */
+  if(truncate_at && length > truncate_at)
+  {
+    data[2] |= 0x02;
+    data[6] = data[7] = data[8] = data[9] = data[10] = data[11] = 0;
+    length = question_end;
+    stat_truncated++;
+  }
+
+  if(chance(loss))
+  {
+    stat_dropped++;
+    return;
+  }
+
+  schedule(data, length, FALSE);
+  if(chance(duplicate))
+  {
+    stat_duplicated++;
+    schedule(data, length, FALSE);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  uint16_t   listen_port = 0;
+  uint16_t   server_port = 0;
+  int        duration    = 0;
+  int        client_socket;
+  int        server_socket;
+  udp_addr_t server;
+  udp_addr_t client;
+  NBBOOL     has_client  = FALSE;
+  uint64_t   deadline;
+  int        i;
+
+  for(i = 1; i < argc; i++)
+  {
+    if(i + 1 >= argc)
+      usage(argv[0]);
+    else if(!strcmp(argv[i], "--listen"))
+      listen_port = (uint16_t)atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--server"))
+      server_port = (uint16_t)atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--seed"))
+      seed = (uint32_t)strtoul(argv[++i], NULL, 10);
+    else if(!strcmp(argv[i], "--latency"))
+      latency = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--jitter"))
+      jitter = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--loss"))
+      loss = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--duplicate"))
+      duplicate = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--reorder"))
+      reorder = atof(argv[++i]);
+    else if(!strcmp(argv[i], "--max-ttl"))
+      max_ttl = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--truncate"))
+      truncate_at = atoi(argv[++i]);
+    else if(!strcmp(argv[i], "--duration"))
+      duration = atoi(argv[++i]);
+    else
+      usage(argv[0]);
+  }
+
+  if(!listen_port || !server_port)
+    usage(argv[0]);
+
+  /* xorshift gets stuck on 0. */
+  if(!seed)
+    seed = 1;
+
+  signal(SIGINT,  on_signal);
+  signal(SIGTERM, on_signal);
+
+  client_socket = udp_create_socket(listen_port, "127.0.0.1");
+  server_socket = udp_create_socket(0, "127.0.0.1");
+  if(!udp_resolve("127.0.0.1", server_port, AF_INET, &server))
+    return 1;
+
+  deadline = duration ? time_us() + (uint64_t)duration * 1000000 : 0;
+
+  while(!is_done && (!deadline || time_us() < deadline))
+  {
+    uint8_t        data[MAX_DNS_PACKET];
+    ssize_t        length;
+    fd_set         fds;
+    struct timeval tv;
+    uint64_t       now  = time_us();
+    uint64_t       wait = 100000;
+
+    /* Send whatever's due, and work out how long till the next one is. */
+    for(i = 0; i < MAX_PENDING; i++)
+    {
+      if(!pending[i].in_use)
+        continue;
+
+      if(pending[i].deliver_at <= now)
+      {
+        if(pending[i].to_server)
+          udp_send_addr(server_socket, &server, pending[i].data, pending[i].length);
+        else if(has_client)
+          udp_send_addr(client_socket, &client, pending[i].data, pending[i].length);
+        pending[i].in_use = FALSE;
+      }
+      else
+      {
+        wait = MIN(wait, pending[i].deliver_at - now);
+      }
+    }
+
+    FD_ZERO(&fds);
+    FD_SET(client_socket, &fds);
+    FD_SET(server_socket, &fds);
+    tv.tv_sec  = 0;
+    tv.tv_usec = (long)wait;
+
+    if(select(MAX(client_socket, server_socket) + 1, &fds, NULL, NULL, &tv) <= 0)
+      continue;
+
+    if(FD_ISSET(client_socket, &fds))
+    {
+      udp_addr_t from;
+
+      from.length = sizeof(from.addr);
+      length = recvfrom(client_socket, (char*)data, sizeof(data), 0, (struct sockaddr*)&from.addr, &from.length);
+      if(length > 0)
+      {
+        client = from;
+        has_client = TRUE;
+        handle_query(data, length);
+      }
+    }
+
+    if(FD_ISSET(server_socket, &fds))
+    {
+      length = recvfrom(server_socket, (char*)data, sizeof(data), 0, NULL, NULL);
+      if(length > 0)
+        handle_answer(data, length);
+    }
+  }
+
+  printf("queries=%u answers=%u dropped=%u duplicated=%u reordered=%u cache_hits=%u truncated=%u\n",
+      stat_queries, stat_answers, stat_dropped, stat_duplicated, stat_reordered, stat_cache_hits, stat_truncated);
+
+  udp_close(client_socket);
+  udp_close(server_socket);
+
+  return 0;
+}
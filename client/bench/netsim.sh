@@ -0,0 +1,113 @@
+#!/bin/sh
+# netsim.sh
+# By Ron Bowes
+# Created October, 2026
+#
+# (See LICENSE.md)
+#
+# Runs the same transfers as bench.sh, but through netsim (a resolver with a
+# bad network behind it), for a few kinds of bad network and a couple of
+# window sizes, and prints the goodput and how much had to be sent again.
+# Run it with 'make netsim'; these can be set to change it:
+#
+#   NETSIM_BYTES    How much data to send each way (default: 8192)
+#   NETSIM_SEED     The seed netsim uses (default: 1)
+#   NETSIM_WINDOWS  The client --window sizes to try (default: 1 8)
+#   NETSIM_TYPE     The record type to use (default: TXT)
+#   NETSIM_ARGS     If set, only try this one network (netsim's options)
+#   NETSIM_CLIENT   Any other options for the client
+#   NETSIM_PORT     The first of the two ports to use (default: 53545)
+
+BYTES=${NETSIM_BYTES:-8192}
+SEED=${NETSIM_SEED:-1}
+WINDOWS=${NETSIM_WINDOWS:-"1 8"}
+TYPE=${NETSIM_TYPE:-TXT}
+PORT=${NETSIM_PORT:-53545}
+SERVER_PORT=$((PORT + 1))
+DOMAIN=bench.test
+
+cd "$(dirname "$0")/.." || exit 1
+
+# Each network is "name|netsim options"
+if [ -n "$NETSIM_ARGS" ]; then
+  NETWORKS="custom|$NETSIM_ARGS"
+else
+  NETWORKS="clean|
+lan|--latency 1 --jitter 1
+wan|--latency 40 --jitter 10
+lossy|--latency 40 --jitter 10 --loss 5
+messy|--latency 40 --jitter 20 --loss 3 --reorder 5 --duplicate 5
+cached|--latency 40 --loss 3 --max-ttl 30
+small|--latency 20 --truncate 512"
+fi
+
+# Runs one transfer; prints bench_server's line then netsim's (or "failed")
+run() {
+  args=$1
+  window=$2
+  direction=$3
+
+  if [ "$direction" = "up" ]; then
+    process="head -c $BYTES /dev/urandom"
+  else
+    process="cat > /dev/null"
+  fi
+
+  ./bench/bench_server --port "$SERVER_PORT" --domain "$DOMAIN" "--$direction" "$BYTES" --timeout 120 > bench/.result 2> /dev/null &
+  server=$!
+  # shellcheck disable=SC2086
+  ./bench/netsim --listen "$PORT" --server "$SERVER_PORT" --seed "$SEED" $args > bench/.netsim 2> /dev/null &
+  netsim=$!
+  sleep 0.2
+
+  # shellcheck disable=SC2086
+  ./dnscat -q -q --window "$window" $NETSIM_CLIENT --exec "$process" \
+    --dns "server=127.0.0.1,port=$PORT,domain=$DOMAIN,type=$TYPE" > /dev/null 2>&1 &
+  client=$!
+
+  if wait $server; then
+    result=$(cat bench/.result)
+  else
+    result="failed"
+  fi
+
+  kill $client 2> /dev/null
+  wait $client 2> /dev/null
+  kill $netsim 2> /dev/null
+  wait $netsim 2> /dev/null
+
+  echo "$result $(cat bench/.netsim)"
+  rm -f bench/.result bench/.netsim
+}
+
+field() {
+  echo "$1" | tr ' ' '\n' | sed -n "s/^$2=//p"
+}
+
+printf "%-8s %6s %-5s %10s %9s %8s %12s %8s %10s\n" "network" "window" "dir" "goodput" "seconds" "queries" "retransmits" "dropped" "cache hits"
+
+echo "$NETWORKS" | while IFS='|' read -r name args; do
+  for window in $WINDOWS; do
+    for direction in up down; do
+      result=$(run "$args" "$window" "$direction")
+
+      case "$result" in
+        failed*)
+          printf "%-8s %6s %-5s %10s\n" "$name" "$window" "$direction" "(failed)"
+          continue
+          ;;
+      esac
+
+      bytes=$(field "$result" bytes)
+      seconds=$(field "$result" seconds)
+
+      printf "%-8s %6s %-5s %10s %9s %8s %12s %8s %10s\n" "$name" "$window" "$direction" \
+        "$(awk "BEGIN { if($seconds > 0) printf(\"%d\", $bytes / $seconds); else print \"-\" }")" \
+        "$(awk "BEGIN { printf(\"%.2f\", $seconds) }")" \
+        "$(field "$result" queries | head -1)" \
+        "$(field "$result" retransmits)" \
+        "$(field "$result" dropped)" \
+        "$(field "$result" cache_hits)"
+    done
+  done
+done
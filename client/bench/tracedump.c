@@ -0,0 +1,171 @@
+/* tracedump.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Prints a trace written by 'dnscat --trace-file' (see libs/trace.h), one
+ * packet per line, with the time (since the first packet) and direction:
+ *
+ *   ./bench/tracedump [-s <session id>] <file>
+ *
+ * Build it with 'make tracedump'.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "controller/packet.h"
+#include "libs/memory.h"
+#include "libs/trace.h"
+#include "libs/types.h"
+
+static uint32_t get_int32(uint8_t *data, NBBOOL swapped)
+{
+  if(swapped)
+    return (data[0] << 24) | (data[1] << 16) | (data[2] << 8) | data[3];
+  return (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
+}
+
+static void usage(char *name)
+{
+  fprintf(stderr, "Usage: %s [-s <session id>] <file>\n", name);
+  exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+  FILE     *f;
+  uint8_t   header[24];
+  uint8_t   record[16];
+  uint8_t  *data;
+  NBBOOL    swapped;
+  NBBOOL    have_first = FALSE;
+  double    first = 0;
+  int       session_id = -1;
+  char     *filename;
+  int       packets = 0;
+
+  if(argc == 4 && !strcmp(argv[1], "-s"))
+  {
+    session_id = (int)strtol(argv[2], NULL, 16);
+    filename = argv[3];
+  }
+  else if(argc == 2)
+  {
+    filename = argv[1];
+  }
+  else
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  f = fopen(filename, "rb");
+  if(!f)
+  {
+    fprintf(stderr, "Couldn't open %s\n", filename);
+    return 1;
+  }
+
+  if(fread(header, 1, sizeof(header), f) != sizeof(header))
+  {
+    fprintf(stderr, "%s is too short to be a trace\n", filename);
+    return 1;
+  }
+
+  if(get_int32(header, FALSE) == 0xa1b2c3d4)
+    swapped = FALSE;
+  else if(get_int32(header, TRUE) == 0xa1b2c3d4)
+    swapped = TRUE;
+  else
+  {
+    fprintf(stderr, "%s isn't a pcap file\n", filename);
+    return 1;
+  }
+
+  if(get_int32(header + 20, swapped) != TRACE_LINKTYPE)
+  {
+    fprintf(stderr, "%s isn't a dnscat trace (link type %u)\n", filename, get_int32(header + 20, swapped));
+    return 1;
+  }
+
+  while(fread(record, 1, sizeof(record), f) == sizeof(record))
+  {
+    double    time     = get_int32(record, swapped) + (get_int32(record + 4, swapped) / 1000000.0);
+    uint32_t  captured = get_int32(record + 8, swapped);
+    uint32_t  length   = get_int32(record + 12, swapped);
+    uint32_t  options;
+    packet_t *packet;
+    NBBOOL    resumable;
+
+    if(captured > TRACE_SNAPLEN)
+    {
+      fprintf(stderr, "Bad record length: %u\n", captured);
+      return 1;
+    }
+
+    data = safe_malloc(captured);
+    if(fread(data, 1, captured, f) != captured)
+    {
+      fprintf(stderr, "The trace was cut off\n");
+      safe_free(data);
+      break;
+    }
+
+    if(!have_first)
+    {
+      first = time;
+      have_first = TRUE;
+    }
+
+    /* Too short, or cut short, to parse. */
+    if(captured < TRACE_HEADER_LENGTH + 5 || captured != length)
+    {
+      printf("%10.6f (a %u-byte record we can't read)\n", time - first, length);
+      safe_free(data);
+      continue;
+    }
+
+    /* The trace_header_t, then the packet. */
+    options = (data[4] << 24) | (data[5] << 16) | (data[6] << 8) | data[7];
+
+    if(session_id != -1 && ((data[TRACE_HEADER_LENGTH + 3] << 8) | data[TRACE_HEADER_LENGTH + 4]) != session_id)
+    {
+      safe_free(data);
+      continue;
+    }
+
+    /* packet_parse() reads SYNs the way the server sends them, where
+     * OPT_RESUMABLE comes with a ticket; ours just ask for one. */
+    resumable = FALSE;
+    if(data[0] == TRACE_OUTGOING && data[TRACE_HEADER_LENGTH + 2] == PACKET_TYPE_SYN && captured >= TRACE_HEADER_LENGTH + 9)
+    {
+      uint16_t syn_options = (data[TRACE_HEADER_LENGTH + 7] << 8) | data[TRACE_HEADER_LENGTH + 8];
+
+      if((syn_options & OPT_RESUMABLE) && !(syn_options & OPT_RESUME))
+      {
+        resumable = TRUE;
+        data[TRACE_HEADER_LENGTH + 7] &= ~(OPT_RESUMABLE >> 8);
+      }
+    }
+
+    packet = packet_parse(data + TRACE_HEADER_LENGTH, captured - TRACE_HEADER_LENGTH, (options_t)options);
+    if(resumable)
+      packet->body.syn.options |= OPT_RESUMABLE;
+
+    printf("%10.6f %-8s ", time - first, data[0] == TRACE_OUTGOING ? "OUTGOING" : "INCOMING");
+    packet_print(packet, (options_t)options);
+    printf("\n");
+    packet_destroy(packet);
+
+    safe_free(data);
+    packets++;
+  }
+
+  fclose(f);
+  fprintf(stderr, "%d packets\n", packets);
+
+  return 0;
+}
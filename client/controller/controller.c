@@ -16,8 +16,10 @@
 #include <stdint.h>
 #endif
 
+#include "libs/buffer.h"
 #include "libs/dns.h"
 #include "libs/log.h"
+#include "libs/select_group.h"
 #include "tunnel_drivers/driver_dns.h"
 #include "packet.h"
 #include "session.h"
@@ -26,50 +28,165 @@
 
 static int max_retransmits = 20;
 
+/* Every CONTROLLER_BACKLOG_UNIT bytes a session has waiting adds one to its
+ * weight (times its priority), up to CONTROLLER_MAX_BACKLOG_WEIGHT. */
+#define CONTROLLER_BACKLOG_UNIT       1024
+#define CONTROLLER_MAX_BACKLOG_WEIGHT 16
+
+/* Don't bother asking a session for a packet to go in a bundle unless it'll
+ * have at least this much room. */
+#define CONTROLLER_MIN_BUNDLE_ROOM    32
+
 typedef struct _session_entry_t
 {
   session_t *session;
+
+  /* Scheduling state; see controller_get_outgoing(). */
+  int        weight;
+  int        credit;
+  NBBOOL     tried;
+
   struct _session_entry_t *next;
 } session_entry_t;
 static session_entry_t *first_session;
 
+/* Sessions are looked up by id in an open-addressed (linear probing) table,
+ * which is always a power of two in size and at most half full. When a
+ * session is reclaimed its slot becomes a tombstone that remembers the id,
+ * so a late response for it isn't mistaken for garbage. */
+#define SESSION_TABLE_MIN_SIZE 16
+
+typedef enum
+{
+  SLOT_EMPTY,
+  SLOT_USED,
+  SLOT_DEAD,
+} slot_state_t;
+
+typedef struct
+{
+  slot_state_t     state;
+  uint16_t         id;
+  session_entry_t *entry;
+} session_slot_t;
+
+static session_slot_t *session_table = NULL;
+static size_t          table_size    = 0;
+static size_t          table_used    = 0; /* Used and dead slots both count. */
+static size_t          session_count = 0;
+
+/* When the idle sessions' shared keepalive last went out. */
+static uint64_t last_keepalive = 0;
+
+/* Where the tunnel driver's counters come from; see controller_get_stats(). */
+static controller_stats_func_t *tunnel_stats        = NULL;
+static void                    *tunnel_stats_driver = NULL;
+
+static size_t table_hash(uint16_t id)
+{
+  /* Knuth's multiplicative hash, so sequential ids still spread out. */
+  return (size_t)(((uint32_t)id * 2654435761UL) >> 16) & (table_size - 1);
+}
+
+/* The slot holding id (live or dead), or NULL. */
+static session_slot_t *table_find(uint16_t id)
+{
+  size_t i;
+
+  if(!session_table)
+    return NULL;
+
+  for(i = table_hash(id); session_table[i].state != SLOT_EMPTY; i = (i + 1) & (table_size - 1))
+    if(session_table[i].id == id)
+      return &session_table[i];
+
+  return NULL;
+}
+
+static void table_insert(session_entry_t *entry)
+{
+  size_t i;
+
+  for(i = table_hash(entry->session->id); session_table[i].state == SLOT_USED; i = (i + 1) & (table_size - 1))
+    ;
+
+  if(session_table[i].state == SLOT_EMPTY)
+    table_used++;
+
+  session_table[i].state = SLOT_USED;
+  session_table[i].id    = entry->session->id;
+  session_table[i].entry = entry;
+}
+
+/* Rebuild the table from the list, big enough for one more session; this
+ * also clears out the tombstones. */
+static void table_rebuild()
+{
+  session_entry_t *entry;
+  size_t           new_size = SESSION_TABLE_MIN_SIZE;
+
+  while(new_size < (session_count + 1) * 4)
+    new_size *= 2;
+
+  if(session_table)
+    safe_free(session_table);
+  session_table = (session_slot_t*) safe_malloc(new_size * sizeof(session_slot_t));
+  table_size    = new_size;
+  table_used    = 0;
+
+  for(entry = first_session; entry; entry = entry->next)
+    table_insert(entry);
+}
+
 void controller_add_session(session_t *session)
 {
   session_entry_t *entry = NULL;
+  session_slot_t  *slot;
+
+  /* Ids are random, so they can collide; nothing has been sent yet, so it's
+   * safe to just pick another. */
+  while((slot = table_find(session->id)) && slot->state == SLOT_USED)
+  {
+    LOG_WARNING("Session id %d is already in use; picking another", session->id);
+    session->id = rand() % 0xFFFF;
+  }
 
   /* Add it to the linked list. */
   entry = safe_malloc(sizeof(session_entry_t));
   entry->session = session;
   entry->next = first_session;
   first_session = entry;
+  session_count++;
+
+  /* And the table. */
+  if(!session_table || (table_used + 1) * 2 > table_size)
+    table_rebuild();
+  else
+    table_insert(entry);
 }
 
 size_t controller_open_session_count()
 {
-  size_t count = 0;
-
-  session_entry_t *entry = first_session;
+  size_t           count = 0;
+  session_entry_t *entry;
 
-  while(entry)
-  {
+  /* Sessions that have shut down are only in the list till the next
+   * heartbeat, so this stays short. */
+  for(entry = first_session; entry; entry = entry->next)
     if(!session_is_shutdown(entry->session))
       count++;
 
-    entry = entry->next;
-  }
-
   return count;
 }
 
 static session_t *sessions_get_by_id(uint16_t session_id)
 {
-  session_entry_t *entry;
+  session_slot_t *slot = table_find(session_id);
 
-  for(entry = first_session; entry; entry = entry->next)
-    if(entry->session->id == session_id)
-      return entry->session;
+  if(!slot || slot->state != SLOT_USED)
+    return NULL;
 
-  return NULL;
+  return slot->entry->session;
 }
 
 /* Version beta 0.01 suffered from a bug that I didn't understand: if one
@@ -108,53 +225,210 @@ static session_t *sessions_get_next()
 }
 #endif
 
-/* Get the next session in line that isn't shutdown.
- * TODO: can/should we give higher priority to sessions that have data
- * waiting?
- */
-static session_t *sessions_get_next_active()
+static int get_weight(session_t *session)
 {
-  /* Keep track of where we start. */
-  session_entry_t *start = NULL;
+  size_t backlog = session_get_backlog(session) / CONTROLLER_BACKLOG_UNIT;
 
-  /* If there's no session, use the first one. */
-  if(!current_session)
-    current_session = first_session;
+  return session->priority * (1 + (int)MIN(backlog, CONTROLLER_MAX_BACKLOG_WEIGHT));
+}
 
-  /* If there's still no session, give up. */
-  if(!current_session)
-    return NULL;
+/* The busy session that's owed the most and hasn't had a turn yet. If
+ * bundled_only is set, only sessions that can go in a bundle (and are ready
+ * to send) count. */
+static session_entry_t *get_most_deserving(NBBOOL bundled_only)
+{
+  session_entry_t *entry;
+  session_entry_t *best = NULL;
 
-  /* Record our starting point. */
-  start = current_session;
+  for(entry = first_session; entry; entry = entry->next)
+  {
+    if(entry->weight == 0 || entry->tried)
+      continue;
+
+    if(bundled_only && (!session_can_be_bundled(entry->session) || session_get_next_transmit_ms(entry->session) != 0))
+      continue;
+
+    if(!best || entry->credit + entry->weight > best->credit + best->weight)
+      best = entry;
+  }
+
+  return best;
+}
+
+static buffer_t *bundle_create(uint8_t *first, size_t length)
+{
+  buffer_t *bundle = buffer_create(BO_BIG_ENDIAN);
+
+  buffer_add_int16(bundle, rand() % 0xFFFF);
+  buffer_add_int8(bundle, PACKET_TYPE_BUNDLE);
+  buffer_add_int16(bundle, 0);
+  buffer_add_int16(bundle, (uint16_t)length);
+  buffer_add_bytes(bundle, first, length);
+
+  return bundle;
+}
+
+/* Ask the session for a packet that fits in what's left of the bundle;
+ * returns TRUE if it had one. */
+static NBBOOL bundle_add(buffer_t *bundle, session_t *session, size_t max_length)
+{
+  uint8_t *data;
+  size_t   data_length;
+
+  if(buffer_get_length(bundle) + PACKET_BUNDLE_ENTRY_SIZE + CONTROLLER_MIN_BUNDLE_ROOM > max_length)
+    return FALSE;
+
+  data = session_get_outgoing(session, &data_length, max_length - buffer_get_length(bundle) - PACKET_BUNDLE_ENTRY_SIZE);
+  if(!data)
+    return FALSE;
+
+  buffer_add_int16(bundle, (uint16_t)data_length);
+  buffer_add_bytes(bundle, data, data_length);
+  safe_free(data);
+
+  return TRUE;
+}
+
+/* If nobody joined the first packet, it's sent as-is. */
+static uint8_t *bundle_finish(buffer_t *bundle, uint8_t *first, size_t count, size_t *length)
+{
+  if(count == 1)
+  {
+    buffer_destroy(bundle);
+    return first;
+  }
+
+  LOG_INFO("Bundling packets from %zd sessions into one", count);
+  safe_free(first);
+
+  return buffer_create_string_and_destroy(bundle, length);
+}
+
+/* Let the idle sessions take turns (starting after whoever went last)
+ * sending the poll that checks the server for data. If the server
+ * understands bundles, the rest of them come along for the ride. */
+static uint8_t *send_keepalive(size_t *length, size_t max_length)
+{
+  session_entry_t *entry = current_session ? current_session : first_session;
+  session_entry_t *start = entry;
+  uint8_t         *data  = NULL;
+  buffer_t        *bundle;
+  size_t           count;
+
+  if(!entry)
+    return NULL;
 
-  /* Get the next session. */
   do
   {
-    current_session = current_session->next;
+    entry = entry->next ? entry->next : first_session;
+
+    if(entry->weight == 0 && session_is_idle(entry->session))
+      data = session_get_outgoing(entry->session, length, max_length);
 
-    /* If we're at the end, go to the beginning. Also attempting a record for the
-    * number of NULL checks one a single pointer. */
-    if(!current_session)
-      current_session = first_session;
+    if(data)
+    {
+      current_session = entry;
+      last_keepalive  = select_group_time_ms();
 
-    if(!session_is_shutdown(current_session->session))
-      return current_session->session;
+      if(!session_can_be_bundled(entry->session))
+        return data;
+
+      bundle = bundle_create(data, *length);
+      count  = 1;
+
+      for(entry = entry->next ? entry->next : first_session; entry != current_session; entry = entry->next ? entry->next : first_session)
+        if(entry->weight == 0 && session_can_be_bundled(entry->session) && session_is_idle(entry->session) && bundle_add(bundle, entry->session, max_length))
+          count++;
+
+      return bundle_finish(bundle, data, count, length);
+    }
   }
-  while(current_session != start);
+  while(entry != start);
 
-  /* If we reached the starting point, there are no active sessions. */
   return NULL;
 }
 
+/* Everybody earns their weight, and the session that sent pays it back. */
+static void charge(session_entry_t *sender, int total_weight)
+{
+  session_entry_t *entry;
+
+  for(entry = first_session; entry; entry = entry->next)
+    entry->credit += entry->weight;
+  sender->credit -= total_weight;
+}
+
+/* Add as many other busy sessions' packets to the first one as will fit. */
+static uint8_t *fill_bundle(uint8_t *first, size_t *length, size_t max_length, int total_weight)
+{
+  buffer_t        *bundle = bundle_create(first, *length);
+  session_entry_t *entry;
+  size_t           count  = 1;
+
+  while((entry = get_most_deserving(TRUE)))
+  {
+    entry->tried = TRUE;
+
+    if(bundle_add(bundle, entry->session, max_length))
+    {
+      charge(entry, total_weight);
+      count++;
+    }
+  }
+
+  return bundle_finish(bundle, first, count, length);
+}
+
+/* Hand each packet in a bundle to its session, as if they'd come in one at a
+ * time. */
+static NBBOOL bundle_incoming(uint8_t *data, size_t length)
+{
+  size_t offset = PACKET_BUNDLE_HEADER_SIZE;
+  size_t entry_length;
+  NBBOOL result = FALSE;
+
+  while(offset + PACKET_BUNDLE_ENTRY_SIZE <= length)
+  {
+    entry_length = ((size_t)data[offset] << 8) | data[offset + 1];
+    offset += PACKET_BUNDLE_ENTRY_SIZE;
+
+    if(entry_length > length - offset)
+    {
+      LOG_ERROR("The server sent a truncated bundle!");
+      break;
+    }
+
+    /* An empty entry means the server had nothing for that session. */
+    if(entry_length > 0 && packet_peek_type(data + offset, entry_length) != PACKET_TYPE_BUNDLE)
+      if(controller_data_incoming(data + offset, entry_length))
+        result = TRUE;
+
+    offset += entry_length;
+  }
+
+  return result;
+}
+
 NBBOOL controller_data_incoming(uint8_t *data, size_t length)
 {
-  uint16_t session_id = packet_peek_session_id(data, length);
-  session_t *session = sessions_get_by_id(session_id);
+  uint16_t session_id;
+  session_t *session;
+
+  if(packet_peek_type(data, length) == PACKET_TYPE_BUNDLE)
+    return bundle_incoming(data, length);
+
+  session_id = packet_peek_session_id(data, length);
+  session = sessions_get_by_id(session_id);
 
   /* If we weren't able to find a session, print an error and return. */
   if(!session)
   {
+    if(table_find(session_id))
+    {
+      LOG_INFO("Ignoring a packet for session %d, which has already closed", session_id);
+      return FALSE;
+    }
+
     LOG_ERROR("Tried to access a non-existent session (%s): %d", __FUNCTION__, session_id);
     return FALSE;
   }
@@ -163,12 +437,49 @@ NBBOOL controller_data_incoming(uint8_t *data, size_t length)
   return session_data_incoming(session, data, length);
 }
 
+/* Sessions with something to send or ACK are picked by smooth weighted
+ * round-robin: each time one of them sends, they all earn their weight in
+ * credit and the sender pays back the total, so over time each gets a share
+ * of the queries proportional to its weight. Sessions with nothing to do
+ * don't get a slot of their own; see send_keepalive().
+ *
+ * If the server understands bundles, whatever room the chosen session
+ * leaves is shared out the same way, so small interactive sessions don't
+ * each cost a round trip. */
 uint8_t *controller_get_outgoing(size_t *length, size_t max_length)
 {
-  /* This needs to somehow be balanced. */
-  session_t *session = sessions_get_next_active();
+  session_entry_t *entry;
+  session_entry_t *best;
+  uint8_t         *data         = NULL;
+  int              total_weight = 0;
+  NBBOOL           any_active   = FALSE;
+  NBBOOL           any_idle     = FALSE;
+  int              poll_ms      = 0;
 
-  if(!session)
+  for(entry = first_session; entry; entry = entry->next)
+  {
+    entry->tried  = FALSE;
+    entry->weight = 0;
+
+    if(session_is_shutdown(entry->session))
+      continue;
+
+    any_active = TRUE;
+
+    if(session_is_idle(entry->session))
+    {
+      /* Don't let credit pile up while there's nothing to spend it on. */
+      entry->credit = 0;
+      poll_ms = any_idle ? MIN(poll_ms, session_get_timeout(entry->session)) : session_get_timeout(entry->session);
+      any_idle = TRUE;
+      continue;
+    }
+
+    entry->weight = get_weight(entry->session);
+    total_weight += entry->weight;
+  }
+
+  if(!any_active)
   {
     /* TODO: Drop to a "probe for sessions" mode instead. */
     LOG_FATAL("There are no active sessions left! Goodbye!");
@@ -176,26 +487,122 @@ uint8_t *controller_get_outgoing(size_t *length, size_t max_length)
     return NULL;
   }
 
-  return session_get_outgoing(session, length, max_length);
+  /* The most deserving session might be waiting for an ACK or its delay, so
+   * keep going till somebody actually sends something. */
+  while((best = get_most_deserving(FALSE)))
+  {
+    NBBOOL bundle;
+
+    best->tried = TRUE;
+
+    /* Only leave room for a bundle if somebody else could use it. */
+    bundle = session_can_be_bundled(best->session) && get_most_deserving(TRUE) != NULL;
+
+    data = session_get_outgoing(best->session, length, bundle ? max_length - PACKET_BUNDLE_HEADER_SIZE - PACKET_BUNDLE_ENTRY_SIZE : max_length);
+    if(data)
+    {
+      charge(best, total_weight);
+
+      if(bundle)
+        data = fill_bundle(data, length, max_length, total_weight);
+
+      return data;
+    }
+  }
+
+  /* One poll at a time, no matter how many sessions are idle (at the pace
+   * of whichever one wants them most often). */
+  if(any_idle && select_group_time_ms() - last_keepalive >= (uint64_t)poll_ms)
+    return send_keepalive(length, max_length);
+
+  return NULL;
 }
 
-static void kill_ignored_sessions()
+int controller_get_next_transmit_ms()
 {
-  session_entry_t *entry = first_session;
-
-  if(max_retransmits < 0)
-    return;
+  session_entry_t *entry     = first_session;
+  int              next      = -1;
+  int              idle_next = -1;
+  int              poll_ms   = 0;
+  int              ms;
 
   while(entry)
   {
-    if(!entry->session->is_shutdown && entry->session->missed_transmissions > max_retransmits)
+    ms = session_get_next_transmit_ms(entry->session);
+
+    /* (ms is -1 if it's shut down) */
+    if(ms >= 0)
     {
-      LOG_ERROR("The server hasn't returned a valid response in the last %d attempts.. closing session.", entry->session->missed_transmissions - 1);
-      session_kill(entry->session);
+      if(session_is_idle(entry->session))
+      {
+        poll_ms   = (idle_next < 0) ? session_get_timeout(entry->session) : MIN(poll_ms, session_get_timeout(entry->session));
+        idle_next = (idle_next < 0) ? ms : MIN(idle_next, ms);
+      }
+      else if(next < 0 || ms < next)
+        next = ms;
     }
 
     entry = entry->next;
   }
+
+  /* The idle sessions wait for the shared keepalive, too. */
+  if(idle_next >= 0)
+  {
+    uint64_t elapsed   = select_group_time_ms() - last_keepalive;
+    int      keepalive = (elapsed >= (uint64_t)poll_ms) ? 0 : poll_ms - (int)elapsed;
+
+    ms   = MAX(idle_next, keepalive);
+    next = (next < 0) ? ms : MIN(next, ms);
+  }
+
+  /* With no live sessions, come back right away so the caller notices. */
+  return next < 0 ? 0 : next;
+}
+
+/* Close (or try to resume) sessions the server has stopped answering, and
+ * forget about the ones that have shut down, so a long-running client with
+ * lots of short-lived sessions doesn't keep them all around. */
+static void kill_ignored_sessions()
+{
+  session_entry_t **link = &first_session;
+  session_entry_t  *entry;
+
+  while((entry = *link))
+  {
+    if(max_retransmits >= 0 && !entry->session->is_shutdown && entry->session->missed_transmissions > max_retransmits)
+    {
+      int missed = entry->session->missed_transmissions - 1;
+
+      /* Give it one more round of attempts, with its ticket. */
+      if(session_resume(entry->session))
+      {
+        LOG_WARNING("The server hasn't returned a valid response in the last %d attempts.. trying to resume session %d.", missed, entry->session->id);
+      }
+      else
+      {
+        LOG_ERROR("The server hasn't returned a valid response in the last %d attempts.. closing session.", missed);
+        session_kill(entry->session);
+      }
+    }
+
+    if(!entry->session->is_shutdown)
+    {
+      link = &entry->next;
+      continue;
+    }
+
+    LOG_INFO("Reclaiming session %d", entry->session->id);
+
+    *link = entry->next;
+    if(current_session == entry)
+      current_session = NULL;
+
+    table_find(entry->session->id)->state = SLOT_DEAD;
+    session_count--;
+
+    session_destroy(entry->session);
+    safe_free(entry);
+  }
 }
 
 void controller_kill_all_sessions()
@@ -210,10 +617,17 @@ void controller_kill_all_sessions()
   }
 }
 
-/* This will be called something like every 50ms. */
+/* This will be called at least as often as sessions transmit, after
+ * sending and before waiting for the responses. */
 void controller_heartbeat()
 {
+  session_entry_t *entry;
+
   kill_ignored_sessions();
+
+  for(entry = first_session; entry; entry = entry->next)
+    session_precompute(entry->session);
+  session_precompute_global();
 }
 
 void controller_set_max_retransmits(int retransmits)
@@ -221,6 +635,26 @@ void controller_set_max_retransmits(int retransmits)
   max_retransmits = retransmits;
 }
 
+void controller_set_tunnel_stats(controller_stats_func_t *func, void *driver)
+{
+  tunnel_stats        = func;
+  tunnel_stats_driver = driver;
+}
+
+void controller_get_stats(stats_callback_t *callback, void *param)
+{
+  session_entry_t *entry;
+
+  callback("controller.sessions", (uint32_t)controller_open_session_count(), param);
+
+  for(entry = first_session; entry; entry = entry->next)
+    if(!session_is_shutdown(entry->session))
+      session_get_stats(entry->session, callback, param);
+
+  if(tunnel_stats)
+    tunnel_stats(tunnel_stats_driver, callback, param);
+}
+
 void controller_destroy()
 {
   session_entry_t *prev_session = NULL;
@@ -236,4 +670,11 @@ void controller_destroy()
     entry = entry->next;
     safe_free(prev_session);
   }
+
+  first_session = NULL;
+  session_count = 0;
+
+  if(session_table)
+    safe_free(session_table);
+  session_table = NULL;
 }
@@ -20,9 +20,19 @@ size_t controller_open_session_count();
 void controller_add_session(session_t *session);
 NBBOOL controller_data_incoming(uint8_t *data, size_t length);
 uint8_t *controller_get_outgoing(size_t *length, size_t max_length);
+int controller_get_next_transmit_ms();
 void controller_kill_all_sessions();
 void controller_destroy();
 void controller_heartbeat();
 void controller_set_max_retransmits(int retransmits);
 
+/* How the controller gets the tunnel driver's counters; driver is whatever
+ * was passed to controller_set_tunnel_stats(). */
+typedef void(controller_stats_func_t)(void *driver, stats_callback_t *callback, void *param);
+void controller_set_tunnel_stats(controller_stats_func_t *func, void *driver);
+
+/* Report every counter we have (the controller's, each session's, and the
+ * tunnel driver's) to callback, one at a time. */
+void controller_get_stats(stats_callback_t *callback, void *param);
+
 #endif
@@ -21,10 +21,17 @@
 
 #include "packet.h"
 
-packet_t *packet_parse(uint8_t *data, size_t length, options_t options)
+static packet_t *parse(uint8_t *data, size_t length, options_t options, NBBOOL is_view)
 {
   packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
-  buffer_t *buffer = buffer_create_with_data(BO_BIG_ENDIAN, data, length);
+  buffer_t  view;
+  buffer_t *buffer = &view;
+  int       i;
+
+  /* Nothing's kept from the buffer but (maybe) the MSG data, FEC parity or
+   * an ENC's SYN, so it never needs its own copy. */
+  buffer_init_view(buffer, BO_BIG_ENDIAN, data, length);
+  packet->is_view = is_view;
 
   /* Validate the size */
   if(buffer_get_length(buffer) > MAX_PACKET_SIZE)
@@ -44,18 +51,53 @@ packet_t *packet_parse(uint8_t *data, size_t length, options_t options)
       packet->body.syn.options = buffer_read_next_int16(buffer);
       if(packet->body.syn.options & OPT_NAME)
         packet->body.syn.name = buffer_alloc_next_ntstring(buffer);
+
+      /* The server only sends a ticket with OPT_RESUMABLE, never asks for
+       * one, so there's no ambiguity. */
+      if(packet->body.syn.options & OPT_RESUME)
+        packet->body.syn.ack = buffer_read_next_int16(buffer);
+      if(packet->body.syn.options & (OPT_RESUME | OPT_RESUMABLE))
+        buffer_read_next_bytes(buffer, packet->body.syn.ticket, PACKET_TICKET_LENGTH);
+      if(packet->body.syn.options & OPT_LONG_POLL)
+        packet->body.syn.long_poll = buffer_read_next_int16(buffer);
+      if(packet->body.syn.options & OPT_FEC)
+        packet->body.syn.fec_group = buffer_read_next_int16(buffer);
       break;
 
     case PACKET_TYPE_MSG:
       packet->body.msg.seq     = buffer_read_next_int16(buffer);
       packet->body.msg.ack     = buffer_read_next_int16(buffer);
-      packet->body.msg.data    = buffer_read_remaining_bytes(buffer, &packet->body.msg.data_length, -1, FALSE);
+      if(options & OPT_MSG_FLAGS)
+        packet->body.msg.flags = buffer_read_next_int8(buffer);
+      if(is_view)
+        packet->body.msg.data  = buffer_read_remaining_bytes_view(buffer, &packet->body.msg.data_length, -1, FALSE);
+      else
+        packet->body.msg.data  = buffer_read_remaining_bytes(buffer, &packet->body.msg.data_length, -1, FALSE);
       break;
 
     case PACKET_TYPE_FIN:
       packet->body.fin.reason = buffer_alloc_next_ntstring(buffer);
       break;
 
+    case PACKET_TYPE_FEC:
+      packet->body.fec.seq   = buffer_read_next_int16(buffer);
+      packet->body.fec.ack   = buffer_read_next_int16(buffer);
+      packet->body.fec.count = buffer_read_next_int8(buffer);
+      if(packet->body.fec.count > PACKET_FEC_MAX_GROUP)
+      {
+        LOG_FATAL("FEC packet covers too many MSGs: %d\n", packet->body.fec.count);
+        exit(1);
+      }
+
+      for(i = 0; i < packet->body.fec.count; i++)
+        packet->body.fec.lengths[i] = buffer_read_next_int16(buffer);
+
+      if(is_view)
+        packet->body.fec.parity = buffer_read_remaining_bytes_view(buffer, &packet->body.fec.parity_length, -1, FALSE);
+      else
+        packet->body.fec.parity = buffer_read_remaining_bytes(buffer, &packet->body.fec.parity_length, -1, FALSE);
+      break;
+
     case PACKET_TYPE_PING:
       packet->body.ping.data = buffer_alloc_next_ntstring(buffer);
       break;
@@ -69,6 +111,13 @@ packet_t *packet_parse(uint8_t *data, size_t length, options_t options)
       {
         case PACKET_ENC_SUBTYPE_INIT:
           buffer_read_next_bytes(buffer, packet->body.enc.public_key, 64);
+          if(packet->body.enc.flags & PACKET_ENC_FLAG_SYN)
+          {
+            if(is_view)
+              packet->body.enc.syn = buffer_read_remaining_bytes_view(buffer, &packet->body.enc.syn_length, -1, FALSE);
+            else
+              packet->body.enc.syn = buffer_read_remaining_bytes(buffer, &packet->body.enc.syn_length, -1, FALSE);
+          }
           break;
         case PACKET_ENC_SUBTYPE_AUTH:
           buffer_read_next_bytes(buffer, packet->body.enc.authenticator, 32);
@@ -82,14 +131,23 @@ packet_t *packet_parse(uint8_t *data, size_t length, options_t options)
       exit(0);
   }
 
-  buffer_destroy(buffer);
-
   return packet;
 }
 
+packet_t *packet_parse(uint8_t *data, size_t length, options_t options)
+{
+  return parse(data, length, options, FALSE);
+}
+
+packet_t *packet_parse_view(uint8_t *data, size_t length, options_t options)
+{
+  return parse(data, length, options, TRUE);
+}
+
 uint16_t packet_peek_session_id(uint8_t *data, size_t length)
 {
-  buffer_t *buffer = NULL;
+  buffer_t  view;
+  buffer_t *buffer = &view;
   uint16_t session_id = -1;
 
   /* Create a buffer of the first 5 bytes. */
@@ -99,8 +157,8 @@ uint16_t packet_peek_session_id(uint8_t *data, size_t length)
     return -1;
   }
 
-  /* Create a buffer with the first 5 bytes of data. */
-  buffer = buffer_create_with_data(BO_BIG_ENDIAN, data, 5);
+  /* Look at the first 5 bytes of data. */
+  buffer_init_view(buffer, BO_BIG_ENDIAN, data, 5);
 
   /* Discard packet_id. */
   buffer_consume(buffer, 2);
@@ -111,13 +169,19 @@ uint16_t packet_peek_session_id(uint8_t *data, size_t length)
   /* Finally, get the session_id. */
   session_id = buffer_read_next_int16(buffer);
 
-  /* Kill the buffer. */
-  buffer_destroy(buffer);
-
   /* Done! */
   return session_id;
 }
 
+int packet_peek_type(uint8_t *data, size_t length)
+{
+  if(length < 5)
+    return -1;
+
+  /* The type comes right after the packet_id. */
+  return data[2];
+}
+
 packet_t *packet_create_syn(uint16_t session_id, uint16_t seq, options_t options)
 {
   packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
@@ -159,6 +223,98 @@ void packet_syn_set_is_command(packet_t *packet)
   packet->body.syn.options |= OPT_COMMAND;
 }
 
+void packet_syn_set_is_windowed(packet_t *packet)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'is_windowed' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_WINDOWED;
+}
+
+void packet_syn_set_is_compressed(packet_t *packet)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'is_compressed' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_COMPRESSED;
+}
+
+void packet_syn_set_is_bundled(packet_t *packet)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'is_bundled' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_BUNDLED;
+}
+
+void packet_syn_set_is_resumable(packet_t *packet)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'is_resumable' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_RESUMABLE;
+}
+
+void packet_syn_set_resume(packet_t *packet, uint16_t ack, uint8_t *ticket)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'resume' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_RESUME;
+  packet->body.syn.ack = ack;
+  memcpy(packet->body.syn.ticket, ticket, PACKET_TICKET_LENGTH);
+}
+
+void packet_syn_set_long_poll(packet_t *packet, uint16_t ms)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'long_poll' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_LONG_POLL;
+  packet->body.syn.long_poll = ms;
+}
+
+void packet_syn_set_fec(packet_t *packet, uint16_t group)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'fec' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_FEC;
+  packet->body.syn.fec_group = group;
+}
+
+void packet_syn_set_msg_flags(packet_t *packet)
+{
+  if(packet->packet_type != PACKET_TYPE_SYN)
+  {
+    LOG_FATAL("Attempted to set the 'msg_flags' field of a non-SYN message\n");
+    exit(1);
+  }
+
+  packet->body.syn.options |= OPT_MSG_FLAGS;
+}
+
 packet_t *packet_create_msg(uint16_t session_id, uint16_t seq, uint16_t ack, uint8_t *data, size_t data_length)
 {
   packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
@@ -186,6 +342,31 @@ packet_t *packet_create_fin(uint16_t session_id, char *reason)
   return packet;
 }
 
+packet_t *packet_create_fec(uint16_t session_id, uint16_t seq, uint16_t ack, size_t *lengths, uint8_t count, uint8_t *parity, size_t parity_length)
+{
+  packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
+  int       i;
+
+  if(count > PACKET_FEC_MAX_GROUP)
+  {
+    LOG_FATAL("Attempted to create an FEC packet covering too many MSGs: %d\n", count);
+    exit(1);
+  }
+
+  packet->packet_type            = PACKET_TYPE_FEC;
+  packet->packet_id              = rand() % 0xFFFF;
+  packet->session_id             = session_id;
+  packet->body.fec.seq           = seq;
+  packet->body.fec.ack           = ack;
+  packet->body.fec.count         = count;
+  for(i = 0; i < count; i++)
+    packet->body.fec.lengths[i]  = (uint16_t)lengths[i];
+  packet->body.fec.parity        = safe_memcpy(parity, parity_length);
+  packet->body.fec.parity_length = parity_length;
+
+  return packet;
+}
+
 packet_t *packet_create_ping(uint16_t session_id, char *data)
 {
   packet_t *packet = (packet_t*) safe_malloc(sizeof(packet_t));
@@ -207,6 +388,7 @@ packet_t *packet_create_enc(uint16_t session_id, uint16_t flags)
   packet->packet_id   = rand() % 0xFFFF;
   packet->session_id  = session_id;
   packet->body.enc.subtype     = -1;
+  packet->body.enc.flags       = flags;
 
   return packet;
 }
@@ -234,23 +416,41 @@ void packet_enc_set_auth(packet_t *packet, uint8_t *authenticator)
   packet->body.enc.subtype = PACKET_ENC_SUBTYPE_AUTH;
   memcpy(packet->body.enc.authenticator, authenticator, 32);
 }
+
+void packet_enc_set_syn(packet_t *packet, uint8_t *syn, size_t syn_length)
+{
+  if(packet->packet_type != PACKET_TYPE_ENC || packet->body.enc.subtype != PACKET_ENC_SUBTYPE_INIT)
+  {
+    LOG_FATAL("Attempted to add a SYN to something other than an ENC INIT\n");
+    exit(1);
+  }
+
+  if(packet->body.enc.syn)
+    safe_free(packet->body.enc.syn);
+
+  packet->body.enc.flags      |= PACKET_ENC_FLAG_SYN;
+  packet->body.enc.syn         = safe_memcpy(syn, syn_length);
+  packet->body.enc.syn_length  = syn_length;
+}
 #endif
 
 size_t packet_get_msg_size(options_t options)
 {
-  static size_t size = 0;
+  /* (Only OPT_MSG_FLAGS changes it.) */
+  static size_t sizes[2] = { 0, 0 };
+  size_t *size = &sizes[(options & OPT_MSG_FLAGS) ? 1 : 0];
 
   /* If the size isn't known yet, calculate it. */
-  if(size == 0)
+  if(*size == 0)
   {
     packet_t *p;
 
     p = packet_create_msg(0, 0, 0, (uint8_t *)"", 0);
-    safe_free(packet_to_bytes(p, &size, options));
+    safe_free(packet_to_bytes(p, size, (options_t)(options & OPT_MSG_FLAGS)));
     packet_destroy(p);
   }
 
-  return size;
+  return *size;
 }
 
 size_t packet_get_ping_size()
@@ -269,6 +469,20 @@ size_t packet_get_ping_size()
   return size;
 }
 
+#ifndef NO_ENCRYPTION
+size_t packet_get_enc_init_size()
+{
+  /* The header, subtype, flags, then the public key. */
+  return 5 + 2 + 2 + 64;
+}
+#endif
+
+size_t packet_get_fec_size(uint8_t count)
+{
+  /* The header, seq, ack, count, then a length for each MSG. */
+  return 5 + 2 + 2 + 1 + (2 * (size_t)count);
+}
+
 /* TODO: This is a little hacky - converting it to a bytestream and back to
  * clone - but it's by far the easiest way! */
 packet_t *packet_clone(packet_t *packet, options_t options)
@@ -286,6 +500,7 @@ packet_t *packet_clone(packet_t *packet, options_t options)
 uint8_t *packet_to_bytes(packet_t *packet, size_t *length, options_t options)
 {
   buffer_t *buffer = buffer_create(BO_BIG_ENDIAN);
+  int       i;
 
   buffer_add_int16(buffer, packet->packet_id);
   buffer_add_int8(buffer, packet->packet_type);
@@ -300,11 +515,26 @@ uint8_t *packet_to_bytes(packet_t *packet, size_t *length, options_t options)
       if(packet->body.syn.options & OPT_NAME)
         buffer_add_ntstring(buffer, packet->body.syn.name);
 
+      /* (We only ever send a ticket back, with OPT_RESUME.) */
+      if(packet->body.syn.options & OPT_RESUME)
+      {
+        buffer_add_int16(buffer, packet->body.syn.ack);
+        buffer_add_bytes(buffer, packet->body.syn.ticket, PACKET_TICKET_LENGTH);
+      }
+
+      if(packet->body.syn.options & OPT_LONG_POLL)
+        buffer_add_int16(buffer, packet->body.syn.long_poll);
+
+      if(packet->body.syn.options & OPT_FEC)
+        buffer_add_int16(buffer, packet->body.syn.fec_group);
+
       break;
 
     case PACKET_TYPE_MSG:
       buffer_add_int16(buffer, packet->body.msg.seq);
       buffer_add_int16(buffer, packet->body.msg.ack);
+      if(options & OPT_MSG_FLAGS)
+        buffer_add_int8(buffer, packet->body.msg.flags);
       buffer_add_bytes(buffer, packet->body.msg.data, packet->body.msg.data_length);
       break;
 
@@ -312,6 +542,15 @@ uint8_t *packet_to_bytes(packet_t *packet, size_t *length, options_t options)
       buffer_add_ntstring(buffer, packet->body.fin.reason);
       break;
 
+    case PACKET_TYPE_FEC:
+      buffer_add_int16(buffer, packet->body.fec.seq);
+      buffer_add_int16(buffer, packet->body.fec.ack);
+      buffer_add_int8(buffer, packet->body.fec.count);
+      for(i = 0; i < packet->body.fec.count; i++)
+        buffer_add_int16(buffer, packet->body.fec.lengths[i]);
+      buffer_add_bytes(buffer, packet->body.fec.parity, packet->body.fec.parity_length);
+      break;
+
     case PACKET_TYPE_PING:
       buffer_add_ntstring(buffer, packet->body.ping.data);
       break;
@@ -324,6 +563,8 @@ uint8_t *packet_to_bytes(packet_t *packet, size_t *length, options_t options)
       if(packet->body.enc.subtype == PACKET_ENC_SUBTYPE_INIT)
       {
         buffer_add_bytes(buffer, packet->body.enc.public_key, 64);
+        if(packet->body.enc.flags & PACKET_ENC_FLAG_SYN)
+          buffer_add_bytes(buffer, packet->body.enc.syn, packet->body.enc.syn_length);
       }
       else if(packet->body.enc.subtype == PACKET_ENC_SUBTYPE_AUTH)
       {
@@ -359,11 +600,17 @@ void packet_print(packet_t *packet, options_t options)
   else if(packet->packet_type == PACKET_TYPE_MSG)
   {
     printf("Type = MSG :: [0x%04x] session = 0x%04x, seq = 0x%04x, ack = 0x%04x, data = 0x%x bytes", packet->packet_id, packet->session_id, packet->body.msg.seq, packet->body.msg.ack, (unsigned int)packet->body.msg.data_length);
+    if(options & OPT_MSG_FLAGS)
+      printf(", flags = 0x%02x", packet->body.msg.flags);
   }
   else if(packet->packet_type == PACKET_TYPE_FIN)
   {
     printf("Type = FIN :: [0x%04x] session = 0x%04x :: %s", packet->packet_id, packet->session_id, packet->body.fin.reason);
   }
+  else if(packet->packet_type == PACKET_TYPE_FEC)
+  {
+    printf("Type = FEC :: [0x%04x] session = 0x%04x, seq = 0x%04x, ack = 0x%04x, count = %d, parity = 0x%x bytes", packet->packet_id, packet->session_id, packet->body.fec.seq, packet->body.fec.ack, packet->body.fec.count, (unsigned int)packet->body.fec.parity_length);
+  }
   else if(packet->packet_type == PACKET_TYPE_PING)
   {
     printf("Type = PING :: [0x%04x] data = %s", packet->packet_id, packet->body.ping.data);
@@ -371,7 +618,7 @@ void packet_print(packet_t *packet, options_t options)
 #ifndef NO_ENCRYPTION
   else if(packet->packet_type == PACKET_TYPE_ENC)
   {
-    printf("Type = ENC :: [0x%04x] session = 0x%04x", packet->packet_id, packet->session_id);
+    printf("Type = ENC :: [0x%04x] session = 0x%04x, subtype = 0x%04x, flags = 0x%04x", packet->packet_id, packet->session_id, packet->body.enc.subtype, packet->body.enc.flags);
   }
 #endif
   else
@@ -390,7 +637,7 @@ void packet_destroy(packet_t *packet)
 
   if(packet->packet_type == PACKET_TYPE_MSG)
   {
-    if(packet->body.msg.data)
+    if(packet->body.msg.data && !packet->is_view)
       safe_free(packet->body.msg.data);
   }
 
@@ -400,6 +647,12 @@ void packet_destroy(packet_t *packet)
       safe_free(packet->body.fin.reason);
   }
 
+  if(packet->packet_type == PACKET_TYPE_FEC)
+  {
+    if(packet->body.fec.parity && !packet->is_view)
+      safe_free(packet->body.fec.parity);
+  }
+
   if(packet->packet_type == PACKET_TYPE_PING)
   {
     if(packet->body.ping.data)
@@ -409,7 +662,8 @@ void packet_destroy(packet_t *packet)
 #ifndef NO_ENCRYPTION
   if(packet->packet_type == PACKET_TYPE_ENC)
   {
-    /* Nothing was allocated. */
+    if(packet->body.enc.syn && !packet->is_view)
+      safe_free(packet->body.enc.syn);
   }
 #endif
 
@@ -426,8 +680,12 @@ char *packet_type_to_string(packet_type_t type)
       return "MSG";
     case PACKET_TYPE_FIN:
       return "FIN";
+    case PACKET_TYPE_FEC:
+      return "FEC";
     case PACKET_TYPE_PING:
       return "PING";
+    case PACKET_TYPE_BUNDLE:
+      return "BUNDLE";
 #ifndef NO_ENCRYPTION
     case PACKET_TYPE_ENC:
       return "ENC";
@@ -14,13 +14,17 @@
 
 #include <stdlib.h>
 
+#include "libs/types.h"
+
 #ifdef WIN32
 #include "libs/pstdint.h"
 #else
 #include <stdint.h>
 #endif
 
-#define MAX_PACKET_SIZE 1024
+/* The biggest packet any tunnel driver can carry (TCP frames have a 16-bit
+ * length; DNS is much smaller). */
+#define MAX_PACKET_SIZE 65535
 
 typedef enum
 {
@@ -30,8 +34,11 @@ typedef enum
 #ifndef NO_ENCRYPTION
   PACKET_TYPE_ENC    = 0x03,
 #endif
+  PACKET_TYPE_FEC    = 0x04,
   PACKET_TYPE_COUNT_NOT_PING,
 
+  /* Like PING, these never reach a session; the controller unpacks them. */
+  PACKET_TYPE_BUNDLE = 0xFE,
   PACKET_TYPE_PING   = 0xFF,
 
 } packet_type_t;
@@ -44,11 +51,32 @@ typedef enum
   PACKET_ENC_SUBTYPE_AUTH = 0x01,
 } packet_enc_subtype_t;
 
+/* An ENC INIT with this flag has a whole SYN packet after the public key (in
+ * cleartext from the client, encrypted with the new keys from the server), so
+ * the session opens in a single round trip. */
+#define PACKET_ENC_FLAG_SYN 0x0001
+
+/* The length of a resumption ticket (see OPT_RESUMABLE). */
+#define PACKET_TICKET_LENGTH 16
+
 typedef struct
 {
   uint16_t seq;
   uint16_t options;
   char    *name;
+
+  /* Only with OPT_RESUME. */
+  uint16_t ack;
+
+  /* With OPT_RESUME, or in the server's answer to OPT_RESUMABLE. */
+  uint8_t  ticket[PACKET_TICKET_LENGTH];
+
+  /* Only with OPT_LONG_POLL: the longest the server can sit on a poll, in
+   * ms (whichever side's sending it). */
+  uint16_t long_poll;
+
+  /* Only with OPT_FEC: the most MSGs one parity packet covers. */
+  uint16_t fec_group;
 } syn_packet_t;
 
 typedef enum
@@ -59,8 +87,29 @@ typedef enum
   /* OPT_DOWNLOAD = 8, // Deprecated */
   /* OPT_CHUNKED_DOWNLOAD = 16, // Deprecated */
   OPT_COMMAND          = 0x0020,
+  /* OPT_ENCRYPTED = 0x0040, // Deprecated */
+  OPT_WINDOWED         = 0x0080,
+  OPT_COMPRESSED       = 0x0100,
+  OPT_BUNDLED          = 0x0200,
+  OPT_RESUMABLE        = 0x0400,
+  OPT_RESUME           = 0x0800,
+  OPT_LONG_POLL        = 0x1000,
+  OPT_FEC              = 0x2000,
+  OPT_MSG_FLAGS        = 0x4000,
 } options_t;
 
+/* With OPT_MSG_FLAGS, set in a MSG whose sender has more data waiting than
+ * fit in it. */
+#define PACKET_MSG_FLAG_MORE 0x01
+
+/* The most MSGs one FEC packet can cover. */
+#define PACKET_FEC_MAX_GROUP 16
+
+/* A bundle is a packet header (with session_id 0) followed by any number of
+ * other packets, each prefixed with a uint16_t length. */
+#define PACKET_BUNDLE_HEADER_SIZE 5
+#define PACKET_BUNDLE_ENTRY_SIZE  2
+
 typedef struct
 {
   uint16_t seq;
@@ -71,6 +120,10 @@ typedef struct
 {
   uint16_t seq;
   uint16_t ack;
+
+  /* Only with OPT_MSG_FLAGS. */
+  uint8_t  flags;
+
   uint8_t *data;
   size_t   data_length;
 } msg_packet_t;
@@ -80,6 +133,19 @@ typedef struct
   char *reason;
 } fin_packet_t;
 
+/* The XOR of a run of MSGs' data (each padded with zeroes to the longest),
+ * which the other side can rebuild any one of them from. seq is the first
+ * one's, and the rest follow it with no gaps. */
+typedef struct
+{
+  uint16_t seq;
+  uint16_t ack;
+  uint8_t  count;
+  uint16_t lengths[PACKET_FEC_MAX_GROUP];
+  uint8_t *parity;
+  size_t   parity_length;
+} fec_packet_t;
+
 typedef struct
 {
   char *data;
@@ -94,6 +160,10 @@ typedef struct
   uint8_t public_key[64];
 
   uint8_t authenticator[32];
+
+  /* With PACKET_ENC_FLAG_SYN, the packet that comes after the public key. */
+  uint8_t *syn;
+  size_t   syn_length;
 } enc_packet_t;
 #endif
 
@@ -103,11 +173,16 @@ typedef struct
   packet_type_t packet_type;
   uint16_t session_id;
 
+  /* Set by packet_parse_view(): body.msg.data (or body.fec.parity) points
+   * into the data it was parsed from, rather than being a copy. */
+  NBBOOL is_view;
+
   union
   {
     syn_packet_t    syn;
     msg_packet_t    msg;
     fin_packet_t    fin;
+    fec_packet_t    fec;
     ping_packet_t   ping;
 #ifndef NO_ENCRYPTION
     enc_packet_t    enc;
@@ -118,14 +193,22 @@ typedef struct
 /* Parse a packet from a byte stream. */
 packet_t *packet_parse(uint8_t *data, size_t length, options_t options);
 
+/* The same, except a MSG's data (or an FEC's parity) isn't copied: it points
+ * into data, so data has to outlive the packet. */
+packet_t *packet_parse_view(uint8_t *data, size_t length, options_t options);
+
 /* Just get the session_id. */
 uint16_t packet_peek_session_id(uint8_t *data, size_t length);
 
+/* Just get the packet_type (-1 if it's too short to have one). */
+int packet_peek_type(uint8_t *data, size_t length);
+
 /* Create a packet with the given characteristics. */
 packet_t *packet_create_syn(uint16_t session_id, uint16_t seq, options_t options);
 packet_t *packet_create_msg(uint16_t session_id, uint16_t seq, uint16_t ack, uint8_t *data, size_t data_length);
 packet_t *packet_create_fin(uint16_t session_id, char *reason);
 packet_t *packet_create_ping(uint16_t session_id, char *data);
+packet_t *packet_create_fec(uint16_t session_id, uint16_t seq, uint16_t ack, size_t *lengths, uint8_t count, uint8_t *parity, size_t parity_length);
 
 #ifndef NO_ENCRYPTION
 packet_t *packet_create_enc(uint16_t session_id, uint16_t flags);
@@ -137,17 +220,52 @@ void packet_syn_set_name(packet_t *packet, char *name);
 /* Set the OPT_COMMAND flag */
 void packet_syn_set_is_command(packet_t *packet);
 
+/* Set the OPT_WINDOWED flag (ask for sliding-window transmission) */
+void packet_syn_set_is_windowed(packet_t *packet);
+
+/* Set the OPT_COMPRESSED flag (ask for the session data to be compressed) */
+void packet_syn_set_is_compressed(packet_t *packet);
+
+/* Set the OPT_BUNDLED flag (tell the server we can handle bundles) */
+void packet_syn_set_is_bundled(packet_t *packet);
+
+/* Set the OPT_RESUMABLE flag (ask the server for a resumption ticket) */
+void packet_syn_set_is_resumable(packet_t *packet);
+
+/* Set the OPT_RESUME flag, and the ACK and ticket that go with it (pick an
+ * established session back up) */
+void packet_syn_set_resume(packet_t *packet, uint16_t ack, uint8_t *ticket);
+
+/* Set the OPT_LONG_POLL flag (let the server hold polls for up to ms) */
+void packet_syn_set_long_poll(packet_t *packet, uint16_t ms);
+
+/* Set the OPT_FEC flag (send a parity packet for every group MSGs) */
+void packet_syn_set_fec(packet_t *packet, uint16_t group);
+
+/* Set the OPT_MSG_FLAGS flag (give every MSG a flags field) */
+void packet_syn_set_msg_flags(packet_t *packet);
+
 #ifndef NO_ENCRYPTION
 /* Set up an encrypted session. */
 void packet_enc_set_init(packet_t *packet, uint8_t *public_key);
 
 /* Authenticate with a PSK. */
 void packet_enc_set_auth(packet_t *packet, uint8_t *authenticator);
+
+/* Set the PACKET_ENC_FLAG_SYN flag, and the packet that goes with it (an
+ * ENC INIT only). */
+void packet_enc_set_syn(packet_t *packet, uint8_t *syn, size_t syn_length);
 #endif
 
 /* Get minimum packet sizes so we can avoid magic numbers. */
 size_t packet_get_msg_size(options_t options);
 size_t packet_get_ping_size();
+#ifndef NO_ENCRYPTION
+size_t packet_get_enc_init_size();
+#endif
+
+/* The size of an FEC packet covering count MSGs, without the parity. */
+size_t packet_get_fec_size(uint8_t count);
 
 /* Free the packet data structures. */
 void packet_destroy(packet_t *packet);
@@ -19,6 +19,8 @@
 #include "libs/log.h"
 #include "libs/memory.h"
 #include "libs/select_group.h"
+#include "libs/trace.h"
+#include "libs/worker.h"
 
 #ifndef NO_ENCRYPTION
 #include "libs/crypto/encryptor.h"
@@ -32,20 +34,67 @@ static uint32_t isn = 0xFFFFFFFF;
 /* Enable/disable packet tracing. */
 static NBBOOL packet_trace;
 
-/* The amount of delay between packets. */
+/* The longest delay between polls, and the retransmit timer till the round
+ * trip's been measured. */
 static int packet_delay = 1000;
 
 /* Transmit instantly when data is received. */
 static NBBOOL transmit_instantly_on_data = TRUE;
 
+/* How many MSG packets we can have in flight at once. 1 means the classic
+ * stop-and-wait mode; anything higher asks the server for OPT_WINDOWED. */
+static int window_size = 1;
+
+/* Ask the server to compress the session data (OPT_COMPRESSED)? */
+static NBBOOL do_compression = TRUE;
+
+/* How long the server can hold our polls (OPT_LONG_POLL); 0 means don't ask. */
+static int long_poll = SESSION_DEFAULT_LONG_POLL;
+
+/* How many windowed MSGs each parity packet covers (OPT_FEC); 0 means don't
+ * ask. */
+static int fec_group = 0;
+
 #ifndef NO_ENCRYPTION
 /* Should we set up encryption? */
 static NBBOOL do_encryption = TRUE;
 
 /* Pre-shared secret (used for authentication) */
 static char *preshared_secret = NULL;
+
+/* Send the SYN with our public key? See session_set_fast_handshake(). */
+static NBBOOL fast_handshake = FALSE;
+
+/* Set while a key pair for the encryptor's pool is being generated. */
+static NBBOOL generating_key = FALSE;
+
+typedef struct
+{
+  uint8_t public_key[64];
+  uint8_t private_key[32];
+  NBBOOL  ok;
+} key_job_t;
+
+/* What to do once a session's shared secret has been worked out. */
+typedef void(ecdh_finish_t)(session_t *session);
+
+struct _ecdh_job_t
+{
+  /* NULL if the session was destroyed while the job was running. */
+  session_t     *session;
+  encryptor_t   *encryptor;
+  ecdh_finish_t *finish;
+
+  uint8_t        their_public_key[64];
+  uint8_t        my_private_key[32];
+  uint8_t        shared_secret[32];
+  NBBOOL         ok;
+};
 #endif
 
+/* Slow jobs (the key generation and ECDH) go to this, if it's set. */
+static worker_t *worker = NULL;
+
 /* Define a handler function pointer. */
 typedef NBBOOL(packet_handler)(session_t *session, packet_t *packet);
 
@@ -56,77 +105,578 @@ static NBBOOL should_we_encrypt(session_t *session)
 }
 #endif
 
-static uint64_t time_ms()
+static NBBOOL is_windowed(session_t *session)
 {
-#ifdef WIN32
-  FILETIME ft;
-  GetSystemTimeAsFileTime(&ft);
+  return (session->options & OPT_WINDOWED) ? TRUE : FALSE;
+}
 
-  return ((uint64_t)ft.dwLowDateTime + ((uint64_t)(ft.dwHighDateTime) << 32LL)) / 10000;
-#else
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (tv.tv_sec) * 1000 + (tv.tv_usec) / 1000 ;
-#endif
+/* In windowed mode, new data can go out without waiting for the delay as
+ * long as there's room in the window. */
+static NBBOOL window_has_room(session_t *session)
+{
+  if(!is_windowed(session) || session->state != SESSION_STATE_ESTABLISHED || session->is_resuming)
+    return FALSE;
+
+  if(session->in_flight_count >= window_size)
+    return FALSE;
+
+  return ring_buffer_get_length(session->outgoing_buffer) > session->sent_length;
+}
+
+/* While the server says it has more (and the driver can take it), poll for
+ * it without waiting for the delay: one poll at a time, or in windowed mode,
+ * enough to fill the window with its data. */
+static NBBOOL wants_more_polls(session_t *session)
+{
+  if(!session->server_has_more || session->state != SESSION_STATE_ESTABLISHED || session->is_resuming)
+    return FALSE;
+
+  if(driver_is_full(session->driver))
+    return FALSE;
+
+  return session->polls_in_flight < (is_windowed(session) ? window_size : 1);
+}
+
+/* Whether something can go out without waiting for the delay: new data that
+ * fits in the window, a poll for data the server says is waiting, or a
+ * parity packet that's ready (which doesn't take up any room in it). */
+static NBBOOL can_send_now(session_t *session)
+{
+  if(window_has_room(session) || wants_more_polls(session))
+    return TRUE;
+
+  return session->fec_ready && session->state == SESSION_STATE_ESTABLISHED && !session->is_resuming;
+}
+
+/* Double timeout up to times times, without going past max. */
+static int back_off(int timeout, int times, int max)
+{
+  while(times-- > 0 && timeout < max)
+    timeout *= 2;
+
+  return MIN(timeout, max);
+}
+
+/* Whether there's something to send besides a poll. */
+static NBBOOL has_news(session_t *session)
+{
+  if(is_windowed(session))
+    return session->needs_ack || can_send_now(session);
+
+  return session->needs_ack || ring_buffer_get_length(session->outgoing_buffer) > 0;
+}
+
+/* How long till the last query counts as lost. */
+static int get_retransmit_timeout(session_t *session)
+{
+  int timeout = back_off(session->rto, session->missed_transmissions - 1, MAX(session->rto, packet_delay * SESSION_MAX_BACKOFF));
+
+  /* The server might be sitting on it. */
+  if(session->last_was_poll)
+    timeout += session->long_poll;
+
+  return timeout;
+}
+
+int session_get_timeout(session_t *session)
+{
+  /* Nothing's come back since the last query, so the next one's a
+   * retransmit; unless the server's just holding onto our poll, and we've
+   * got something better to send. */
+  if(session->missed_transmissions > 0)
+    return (session->last_was_poll && session->long_poll && has_news(session)) ? 0 : get_retransmit_timeout(session);
+
+  /* Otherwise it's a poll: quick while there's something going on, and
+   * slowing down to the delay when there isn't. */
+  return back_off(session->rto, session->empty_polls, MAX(session->rto, packet_delay));
 }
 
 /* Decide whether or not we should transmit data yet. */
 static NBBOOL can_i_transmit_yet(session_t *session)
 {
-  if(time_ms() - session->last_transmit > packet_delay)
+  if(select_group_time_ms() - session->last_transmit > session_get_timeout(session))
     return TRUE;
   return FALSE;
 }
 
+/* Fold a round-trip sample into the estimates. */
+static void rtt_sample(session_t *session, int rtt)
+{
+  if(session->srtt == 0)
+  {
+    session->srtt   = MAX(rtt, 1);
+    session->rttvar = rtt / 2;
+  }
+  else
+  {
+    session->rttvar = (3 * session->rttvar + abs(session->srtt - rtt)) / 4;
+    session->srtt   = (7 * session->srtt + rtt) / 8;
+  }
+
+  session->rto = session->srtt + 4 * session->rttvar;
+  session->rto = MAX(session->rto, SESSION_MIN_RTO);
+  session->rto = MIN(session->rto, SESSION_MAX_RTO);
+
+  LOG_INFO("Session %d: RTT = %dms (smoothed %dms, variance %dms), RTO = %dms", session->id, rtt, session->srtt, session->rttvar, session->rto);
+}
+
+/* Called as each query goes out. Held polls aren't timed (the answer takes
+ * as long as the server likes), and neither are retransmits. */
+static void rtt_sent(session_t *session, NBBOOL is_retransmit, NBBOOL is_held_poll)
+{
+  if(is_retransmit)
+  {
+    /* The timer went off, so whatever was outstanding is probably gone; and
+     * since we can't tell which query an answer is for anymore, none of them
+     * get timed (Karn's algorithm). */
+    session->queries_answered = session->queries_sent;
+    session->timed_at         = 0;
+  }
+
+  session->queries_sent++;
+
+  if(!is_retransmit && !is_held_poll && !session->timed_at)
+  {
+    session->timed_query = session->queries_sent;
+    session->timed_at    = select_group_time_ms();
+  }
+}
+
+/* Called as each (valid) answer comes in. */
+static void rtt_answered(session_t *session)
+{
+  /* (Stragglers from queries we'd given up on don't count.) */
+  if(session->queries_answered < session->queries_sent)
+    session->queries_answered++;
+
+  if(session->timed_at && session->queries_answered == session->timed_query)
+  {
+    rtt_sample(session, (int)(select_group_time_ms() - session->timed_at));
+    session->timed_at = 0;
+  }
+
+  /* deliver_incoming() and poll_driver_for_data() reset this if anything
+   * actually happened. (Past 16 doublings, it's at the delay anyway.) */
+  if(session->empty_polls < 16)
+    session->empty_polls++;
+}
+
 static void you_can_transmit_now(session_t *session)
 {
   session->last_transmit = 0;
 }
 
+/* Copy some of the unacknowledged data, starting offset bytes past my_seq,
+ * into a newly allocated (and null-terminated) string. */
+static uint8_t *read_outgoing(session_t *session, size_t offset, size_t length)
+{
+  uint8_t *data = safe_malloc(length + 1);
+
+  ring_buffer_read_at(session->outgoing_buffer, offset, data, length);
+
+  return data;
+}
+
+
+/* Hand data from the server to the driver, decompressing it first if
+ * that's been negotiated. */
+static void deliver_incoming(session_t *session, uint8_t *data, size_t length)
+{
+  session->needs_ack   = TRUE;
+  session->empty_polls = 0;
+  session->stats.bytes_received += length;
+
+  if(session->compressor)
+  {
+    size_t   decompressed_length;
+    uint8_t *decompressed = compressor_decompress(session->compressor, data, length, &decompressed_length);
+
+    if(decompressed_length > 0)
+      driver_data_received(session->driver, decompressed, decompressed_length);
+
+    safe_free(decompressed);
+  }
+  else
+  {
+    driver_data_received(session->driver, data, length);
+  }
+}
+
+/* Leave data from the server unacknowledged, because the driver's backed up
+ * (see driver_is_full()); the server will send it again. */
+static void refuse_incoming(session_t *session, uint16_t seq)
+{
+  LOG_INFO("The driver is backed up; leaving SEQ %d for the server to send again", seq);
+  session->stats.refused++;
+}
+
+/* Start the parity over (after it's sent, or when the segments it covered
+ * aren't going to be sent the same way again). */
+static void fec_reset(session_t *session)
+{
+  session->fec_count         = 0;
+  session->fec_parity_length = 0;
+  session->fec_ready         = FALSE;
+}
+
+/* XOR a new segment into the parity. It's ready to go once it covers a full
+ * group, or once there's nothing left to send for now (so the end of a burst
+ * doesn't wait for a retransmit, either). */
+static void fec_add(session_t *session, uint16_t seq, uint8_t *data, size_t length)
+{
+  size_t i;
+
+  if(session->fec_count == 0)
+    session->fec_seq = seq;
+
+  /* Shorter segments are padded with zeroes. */
+  if(length > session->fec_parity_length)
+  {
+    if(session->fec_parity)
+      session->fec_parity = safe_realloc(session->fec_parity, length);
+    else
+      session->fec_parity = safe_malloc(length);
+
+    memset(session->fec_parity + session->fec_parity_length, 0, length - session->fec_parity_length);
+    session->fec_parity_length = length;
+  }
+
+  for(i = 0; i < length; i++)
+    session->fec_parity[i] ^= data[i];
+
+  session->fec_lengths[session->fec_count++] = length;
+
+  if(session->fec_count >= session->fec_group || ring_buffer_get_length(session->outgoing_buffer) == session->sent_length)
+    session->fec_ready = TRUE;
+}
+
+/* The FEC packet for the segments since the last one. The parity is as long
+ * as the longest of them, and max_data leaves room for its header (see
+ * session_get_outgoing()); if the room's shrunk since, it's just skipped. */
+static packet_t *get_fec_packet(session_t *session, size_t max_data)
+{
+  packet_t *packet = NULL;
+
+  if(session->fec_parity_length <= max_data)
+  {
+    LOG_INFO("In SESSION_STATE_ESTABLISHED, sending an FEC packet (SEQ = 0x%04x, %d segments, %zd bytes of parity)", session->fec_seq, session->fec_count, session->fec_parity_length);
+    packet = packet_create_fec(session->id, session->fec_seq, session->their_seq, session->fec_lengths, (uint8_t)session->fec_count, session->fec_parity, session->fec_parity_length);
+    session->stats.parity_sent++;
+  }
+
+  fec_reset(session);
+
+  return packet;
+}
+
+/* Build the next MSG for a windowed session. A parity packet that's ready
+ * goes first; then, if there's room, the next unsent piece of the buffer;
+ * otherwise (the delay has expired), it's a retransmission of the oldest
+ * unacknowledged segment only. */
+static packet_t *get_windowed_msg(session_t *session, size_t max_data)
+{
+  packet_t *packet      = NULL;
+  uint8_t  *data        = NULL;
+  size_t    data_length = 0;
+  size_t    offset      = 0;
+  uint16_t  seq         = session->my_seq;
+  NBBOOL    is_new      = FALSE;
+
+  if(session->fec_ready && (packet = get_fec_packet(session, max_data)))
+    return packet;
+
+  if(window_has_room(session))
+  {
+    offset      = session->sent_length;
+    data_length = MIN(ring_buffer_get_length(session->outgoing_buffer) - offset, max_data);
+
+    session->in_flight[session->in_flight_count++] = data_length;
+    session->sent_length += data_length;
+    is_new = TRUE;
+  }
+  else if(wants_more_polls(session))
+  {
+    LOG_INFO("Polling for more of the server's data (%d polls in flight)", session->polls_in_flight);
+  }
+  else if(session->in_flight_count > 0)
+  {
+    data_length = MIN(session->in_flight[0], max_data);
+    LOG_INFO("Retransmitting the oldest segment (SEQ = 0x%04x, %zd bytes; %d segments in flight)", seq, data_length, session->in_flight_count);
+  }
+  else if(session->is_shutdown)
+  {
+    return packet_create_fin(session->id, "Stream closed");
+  }
+
+  seq = (session->my_seq + offset) & 0xFFFF;
+
+  data = read_outgoing(session, offset, data_length);
+
+  if(is_new && session->fec_group)
+    fec_add(session, seq, data, data_length);
+
+  LOG_INFO("In SESSION_STATE_ESTABLISHED, sending a windowed MSG packet (SEQ = 0x%04x, ACK = 0x%04x, %zd bytes of data...)", seq, session->their_seq, data_length);
+  packet = packet_create_msg(session->id, seq, session->their_seq, data, data_length);
+  safe_free(data);
+
+  return packet;
+}
+
+/* Retire segments covered by a cumulative ACK. */
+static void window_ack(session_t *session, size_t bytes_acked)
+{
+  session->sent_length -= bytes_acked;
+
+  while(bytes_acked > 0 && session->in_flight_count > 0)
+  {
+    if(bytes_acked < session->in_flight[0])
+    {
+      /* A partial ACK, which happens if a retransmission was cut short. */
+      session->in_flight[0] -= bytes_acked;
+      break;
+    }
+
+    bytes_acked -= session->in_flight[0];
+    session->in_flight_count--;
+    memmove(session->in_flight, session->in_flight + 1, session->in_flight_count * sizeof(size_t));
+  }
+}
+
+int session_get_next_transmit_ms(session_t *session)
+{
+  uint64_t elapsed;
+
+  if(session->is_shutdown)
+    return -1;
+
+#ifndef NO_ENCRYPTION
+  /* The worker wakes us up when it's done, so don't bother polling. */
+  if(session->ecdh_job)
+    return packet_delay;
+#endif
+
+  if(can_send_now(session))
+    return 0;
+
+  elapsed = select_group_time_ms() - session->last_transmit;
+  if(elapsed > session_get_timeout(session))
+    return 0;
+
+  return session_get_timeout(session) - (int)elapsed;
+}
+
 /* Polls the driver for data and puts it in our own buffer. This is necessary
  * because the session needs to ACK data and such. */
 static void poll_driver_for_data(session_t *session)
 {
-  size_t length = -1;
+  size_t   length = -1;
+  uint8_t *data;
+
+  /* Leave the data with the driver until we've made room for it. */
+  if(ring_buffer_is_full(session->outgoing_buffer))
+    return;
 
   /* Read all the data we can. */
-  uint8_t *data = driver_get_outgoing(session->driver, &length, -1);
+  data = driver_get_outgoing(session->driver, &length, ring_buffer_get_room(session->outgoing_buffer));
 
   /* If a driver returns NULL, it means it's done - once the driver is
    * done and all our data is sent, go into 'shutdown' mode. */
   if(!data)
   {
-    if(buffer_get_remaining_bytes(session->outgoing_buffer) == 0)
+    if(ring_buffer_get_length(session->outgoing_buffer) == 0)
       session_kill(session);
   }
   else
   {
+    /* Compression happens before the data is queued, so retransmissions
+     * just re-send the same compressed bytes. */
+    if(length && session->compressor)
+    {
+      uint8_t *compressed = compressor_compress(session->compressor, data, length, &length);
+
+      safe_free(data);
+      data = compressed;
+    }
+
     if(length)
-      buffer_add_bytes(session->outgoing_buffer, data, length);
+    {
+      ring_buffer_add_bytes(session->outgoing_buffer, data, length);
+      session->empty_polls = 0;
+    }
 
     safe_free(data);
   }
 }
 
+NBBOOL session_is_idle(session_t *session)
+{
+  if(session->is_shutdown || session->state != SESSION_STATE_ESTABLISHED || session->is_resuming)
+    return FALSE;
+
+#ifndef NO_ENCRYPTION
+  if(session->ecdh_job)
+    return FALSE;
+#endif
+
+  /* Data the driver is still holding counts, too. */
+  poll_driver_for_data(session);
+
+  /* (Fetching the server's data counts as something to do.) */
+  return !session->is_shutdown && !session->needs_ack && ring_buffer_get_length(session->outgoing_buffer) == 0 && !wants_more_polls(session);
+}
+
+NBBOOL session_can_be_bundled(session_t *session)
+{
+  return session->state == SESSION_STATE_ESTABLISHED && (session->options & OPT_BUNDLED);
+}
+
+size_t session_get_backlog(session_t *session)
+{
+  return ring_buffer_get_length(session->outgoing_buffer);
+}
+
+void session_precompute(session_t *session)
+{
+#ifndef NO_ENCRYPTION
+  if(should_we_encrypt(session) && session->encryptor)
+    encryptor_precompute(session->encryptor);
+#endif
+}
+
+#ifndef NO_ENCRYPTION
+static void key_job_run(void *param)
+{
+  key_job_t *job = (key_job_t*) param;
+
+  job->ok = encryptor_make_key_pair(job->public_key, job->private_key);
+}
+
+static void key_job_done(void *param)
+{
+  key_job_t *job = (key_job_t*) param;
+
+  if(job->ok)
+    encryptor_add_to_key_pool(job->public_key, job->private_key);
+  generating_key = FALSE;
+
+  memset(job, 0, sizeof(key_job_t));
+  safe_free(job);
+}
+#endif
+
+void session_precompute_global()
+{
+#ifndef NO_ENCRYPTION
+  if(!do_encryption || generating_key || encryptor_key_pool_is_full())
+    return;
+
+  if(worker)
+  {
+    generating_key = TRUE;
+    worker_post(worker, key_job_run, key_job_done, safe_malloc(sizeof(key_job_t)));
+  }
+  else
+  {
+    encryptor_fill_key_pool();
+  }
+#endif
+}
+
+static packet_t *create_syn(session_t *session)
+{
+  packet_t *packet = packet_create_syn(session->id, session->my_seq, (options_t)0);
+
+  if(session->is_command)
+    packet_syn_set_is_command(packet);
+
+  if(session->name)
+    packet_syn_set_name(packet, session->name);
+
+  if(window_size > 1)
+    packet_syn_set_is_windowed(packet);
+
+  if(do_compression)
+    packet_syn_set_is_compressed(packet);
+
+  /* This one's for the controller's benefit; see
+   * session_can_be_bundled(). */
+  packet_syn_set_is_bundled(packet);
+
+  /* So the server can tell us when it has more to send. */
+  packet_syn_set_msg_flags(packet);
+
+  if(long_poll > 0)
+    packet_syn_set_long_poll(packet, (uint16_t)long_poll);
+
+  /* Parity only makes sense with more than one MSG in flight. */
+  if(window_size > 1 && fec_group > 0)
+    packet_syn_set_fec(packet, (uint16_t)MIN(fec_group, window_size));
+
+  packet_syn_set_is_resumable(packet);
+
+  return packet;
+}
+
+#ifndef NO_ENCRYPTION
+/* Put our SYN in an ENC INIT, if there's room for it. */
+static void add_handshake_syn(session_t *session, packet_t *packet, size_t max_length)
+{
+  packet_t *syn = create_syn(session);
+  uint8_t  *syn_bytes;
+  size_t    syn_length;
+
+  syn_bytes = packet_to_bytes(syn, &syn_length, (options_t)0);
+  packet_destroy(syn);
+
+  if(packet_get_enc_init_size() + syn_length <= max_length)
+    packet_enc_set_syn(packet, syn_bytes, syn_length);
+  else
+    LOG_INFO("There's no room for the SYN in the ENC INIT; doing the handshake the long way");
+
+  safe_free(syn_bytes);
+}
+#endif
+
 uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t max_length)
 {
   packet_t *packet       = NULL;
   uint8_t  *packet_bytes = NULL;
   uint8_t  *data         = NULL;
   size_t    data_length  = -1;
+  NBBOOL    is_retransmit;
 
   /* Suck in any data we can from the driver. */
   poll_driver_for_data(session);
 
-  /* Don't transmit too quickly without receiving anything. */
-  if(!can_i_transmit_yet(session))
+#ifndef NO_ENCRYPTION
+  /* Nothing can go out till we know which keys to use. */
+  if(session->ecdh_job)
+    return NULL;
+#endif
+
+  /* Don't transmit too quickly without receiving anything (unless we're
+   * still filling the window, or sending parity). */
+  if(!can_i_transmit_yet(session) && !can_send_now(session))
     return NULL;
 
+  /* If the server hasn't answered and it's not just the window filling up
+   * (or news going out past a held poll), this is going out because the
+   * retransmit timer went off. */
+  is_retransmit = session->missed_transmissions > 0 && !can_send_now(session) && select_group_time_ms() - session->last_transmit > get_retransmit_timeout(session);
+
+  /* Polls that haven't been answered by now never will be, so the one that
+   * replaces them is a retransmit, too. */
+  if(session->polls_in_flight > 0 && select_group_time_ms() - session->last_received > get_retransmit_timeout(session))
+  {
+    session->polls_in_flight = 0;
+    is_retransmit = TRUE;
+  }
+
 #ifndef NO_ENCRYPTION
   /* If we're in encryption mode, we have to save 8 bytes for the encrypted_packet header. */
   if(should_we_encrypt(session))
   {
-    max_length -= 8;
+    max_length -= ENCRYPTOR_OVERHEAD;
 
     if(max_length <= 0)
     {
@@ -141,7 +691,8 @@ uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t
   if(session->is_ping)
   {
     /* Read data without consuming it (ie, leave it in the buffer till it's ACKed) */
-    data = buffer_read_remaining_bytes(session->outgoing_buffer, &data_length, max_length - packet_get_ping_size(), FALSE);
+    data_length = MIN(ring_buffer_get_length(session->outgoing_buffer), max_length - packet_get_ping_size());
+    data = read_outgoing(session, 0, data_length);
     packet = packet_create_ping(session->id, (char*)data);
     safe_free(data);
 
@@ -155,6 +706,11 @@ uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t
       case SESSION_STATE_BEFORE_INIT:
         packet = packet_create_enc(session->id, 0);
         packet_enc_set_init(packet, session->encryptor->my_public_key);
+
+        /* (A server that doesn't know about it won't answer, so give up on
+         * it after a couple tries.) */
+        if(fast_handshake && !preshared_secret && session->missed_transmissions < SESSION_FAST_HANDSHAKE_TRIES)
+          add_handshake_syn(session, packet, max_length);
         break;
 
       case SESSION_STATE_BEFORE_AUTH:
@@ -164,17 +720,20 @@ uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t
 #endif
 
       case SESSION_STATE_NEW:
-        packet = packet_create_syn(session->id, session->my_seq, (options_t)0);
-
-        if(session->is_command)
-          packet_syn_set_is_command(packet);
-
-        if(session->name)
-          packet_syn_set_name(packet, session->name);
-
+        packet = create_syn(session);
         break;
 
       case SESSION_STATE_ESTABLISHED:
+        /* Knock till the server answers; see session_resume(). */
+        if(session->is_resuming)
+        {
+          LOG_INFO("In SESSION_STATE_ESTABLISHED, sending a SYN to resume the session (SEQ = 0x%04x, ACK = 0x%04x)", session->my_seq, session->their_seq);
+
+          packet = packet_create_syn(session->id, session->my_seq, (options_t)0);
+          packet_syn_set_resume(packet, session->their_seq, session->ticket);
+          break;
+        }
+
         /* Re-negotiate encryption if we have to */
 #ifndef NO_ENCRYPTION
         if(should_we_encrypt(session))
@@ -199,8 +758,22 @@ uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t
           }
         }
 #endif
+        if(is_windowed(session))
+        {
+          /* The parity's as long as the longest segment it covers, so with
+           * FEC the segments leave room for its (bigger) header. */
+          size_t header_length = packet_get_msg_size(session->options);
+
+          if(session->fec_group)
+            header_length = MAX(header_length, packet_get_fec_size((uint8_t)session->fec_group));
+
+          packet = get_windowed_msg(session, max_length - header_length);
+          break;
+        }
+
         /* Read data without consuming it (ie, leave it in the buffer till it's ACKed) */
-        data = buffer_read_remaining_bytes(session->outgoing_buffer, &data_length, max_length - packet_get_msg_size(session->options), FALSE);
+        data_length = MIN(ring_buffer_get_length(session->outgoing_buffer), max_length - packet_get_msg_size(session->options));
+        data = read_outgoing(session, 0, data_length);
         LOG_INFO("In SESSION_STATE_ESTABLISHED, sending a MSG packet (SEQ = 0x%04x, ACK = 0x%04x, %zd bytes of data...)", session->my_seq, session->their_seq, data_length);
 
         if(data_length == 0 && session->is_shutdown)
@@ -227,46 +800,112 @@ uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t
       printf("\n");
     }
 
+    /* Every MSG (and FEC) carries the latest ACK. */
+    if(packet->packet_type == PACKET_TYPE_FEC)
+      session->needs_ack = FALSE;
+
+    if(packet->packet_type == PACKET_TYPE_MSG)
+    {
+      session->needs_ack = FALSE;
+      session->stats.msgs_sent++;
+      session->stats.bytes_sent += packet->body.msg.data_length;
+    }
+
+    /* (Anything that was still out there is as good as lost, then.) */
+    if(is_retransmit)
+    {
+      session->stats.retransmits++;
+      session->polls_in_flight = 0;
+    }
+
+    if(packet->packet_type == PACKET_TYPE_MSG && packet->body.msg.data_length == 0)
+      session->polls_in_flight++;
+
+    /* An empty MSG is a poll, which the server might hold onto. */
+    session->last_was_poll = session->long_poll && packet->packet_type == PACKET_TYPE_MSG && packet->body.msg.data_length == 0;
+
     packet_bytes = packet_to_bytes(packet, packet_length, session->options);
     packet_destroy(packet);
 
+    trace_packet(TRACE_OUTGOING, session->options, packet_bytes, *packet_length);
+
 #ifndef NO_ENCRYPTION
     if(should_we_encrypt(session))
     {
-      buffer_t *packet_buffer = buffer_create(BO_BIG_ENDIAN);
-
-      buffer_add_bytes(packet_buffer, packet_bytes, *packet_length);
-      safe_free(packet_bytes);
-
-      encryptor_encrypt_buffer(session->encryptor, packet_buffer);
-      encryptor_sign_buffer(session->encryptor, packet_buffer);
-
-      packet_bytes = buffer_create_string_and_destroy(packet_buffer, packet_length);
+      packet_bytes = safe_realloc(packet_bytes, *packet_length + ENCRYPTOR_OVERHEAD);
+      *packet_length = encryptor_seal(session->encryptor, packet_bytes, *packet_length);
     }
 #endif
 
-    session->last_transmit = time_ms();
+    session->last_transmit = select_group_time_ms();
     session->missed_transmissions++;
+    rtt_sent(session, is_retransmit, session->last_was_poll);
   }
 
   return packet_bytes;
 }
 
 #ifndef NO_ENCRYPTION
-static NBBOOL _handle_enc_before_init(session_t *session, packet_t *packet)
+static void ecdh_job_run(void *param)
 {
-  if(packet->body.enc.subtype != PACKET_ENC_SUBTYPE_INIT)
+  struct _ecdh_job_t *job = (struct _ecdh_job_t*) param;
+
+  job->ok = encryptor_get_shared_secret(job->their_public_key, job->my_private_key, job->shared_secret);
+}
+
+static void ecdh_job_done(void *param)
+{
+  struct _ecdh_job_t *job     = (struct _ecdh_job_t*) param;
+  session_t          *session = job->session;
+
+  if(session)
   {
-    LOG_FATAL("Received an unexpected encryption packet for this state: 0x%04x!", packet->body.enc.subtype);
-    exit(1);
+    session->ecdh_job = NULL;
+
+    if(!job->ok)
+    {
+      LOG_FATAL("Failed to calculate a shared secret!");
+      exit(1);
+    }
+
+    encryptor_set_shared_secret(job->encryptor, job->their_public_key, job->shared_secret);
+    job->finish(session);
+
+    you_can_transmit_now(session);
   }
 
-  if(!encryptor_set_their_public_key(session->encryptor, packet->body.enc.public_key))
+  memset(job, 0, sizeof(struct _ecdh_job_t));
+  safe_free(job);
+}
+
+/* Work out the shared secret for encryptor (on the worker, if there is
+ * one), then call finish. The session doesn't send or receive anything in
+ * the meantime. */
+static void start_ecdh(session_t *session, encryptor_t *encryptor, uint8_t *their_public_key, ecdh_finish_t *finish)
+{
+  struct _ecdh_job_t *job = (struct _ecdh_job_t*) safe_malloc(sizeof(struct _ecdh_job_t));
+
+  job->session   = session;
+  job->encryptor = encryptor;
+  job->finish    = finish;
+  memcpy(job->their_public_key, their_public_key, 64);
+  memcpy(job->my_private_key, encryptor->my_private_key, 32);
+
+  session->ecdh_job = job;
+
+  if(worker)
   {
-    LOG_FATAL("Failed to calculate a shared secret!");
-    exit(1);
+    worker_post(worker, ecdh_job_run, ecdh_job_done, job);
   }
+  else
+  {
+    ecdh_job_run(job);
+    ecdh_job_done(job);
+  }
+}
 
+static void finish_enc_before_init(session_t *session)
+{
   if(LOG_LEVEL_INFO >= log_get_min_console_level())
     encryptor_print(session->encryptor);
 
@@ -283,12 +922,21 @@ static NBBOOL _handle_enc_before_init(session_t *session, packet_t *packet)
     printf("\n");
     encryptor_print_sas(session->encryptor);
     printf("\n");
-  }
 
-  return TRUE;
+    /* If the server answered our SYN already, we're done. */
+    if(session->handshake_syn)
+    {
+      uint8_t *syn        = session->handshake_syn;
+      size_t   syn_length = session->handshake_syn_length;
+
+      session->handshake_syn = NULL;
+      session_data_incoming(session, syn, syn_length);
+      safe_free(syn);
+    }
+  }
 }
 
-static NBBOOL _handle_enc_renegotiate(session_t *session, packet_t *packet)
+static NBBOOL _handle_enc_before_init(session_t *session, packet_t *packet)
 {
   if(packet->body.enc.subtype != PACKET_ENC_SUBTYPE_INIT)
   {
@@ -296,18 +944,20 @@ static NBBOOL _handle_enc_renegotiate(session_t *session, packet_t *packet)
     exit(1);
   }
 
-  if(!session->encryptor)
+  if((packet->body.enc.flags & PACKET_ENC_FLAG_SYN) && !session->handshake_syn)
   {
-    LOG_FATAL("Received an unexpected renegotiation from the server!");
-    exit(1);
+    session->handshake_syn        = safe_memcpy(packet->body.enc.syn, packet->body.enc.syn_length);
+    session->handshake_syn_length = packet->body.enc.syn_length;
   }
 
-  if(!encryptor_set_their_public_key(session->new_encryptor, packet->body.enc.public_key))
-  {
-    LOG_FATAL("Failed to calculate a shared secret for renegotiation!");
-    exit(1);
-  }
+  start_ecdh(session, session->encryptor, packet->body.enc.public_key, finish_enc_before_init);
 
+  /* If it's done already, the next packet can go right away. */
+  return !session->ecdh_job;
+}
+
+static void finish_enc_renegotiate(session_t *session)
+{
   LOG_WARNING("Server responded to re-negotiation request! Switching to new keys!");
 
   /* Kill the old encryptor and replace it with the new one. */
@@ -317,8 +967,25 @@ static NBBOOL _handle_enc_renegotiate(session_t *session, packet_t *packet)
 
   if(LOG_LEVEL_INFO >= log_get_min_console_level())
     encryptor_print(session->encryptor);
+}
 
-  return TRUE;
+static NBBOOL _handle_enc_renegotiate(session_t *session, packet_t *packet)
+{
+  if(packet->body.enc.subtype != PACKET_ENC_SUBTYPE_INIT)
+  {
+    LOG_FATAL("Received an unexpected encryption packet for this state: 0x%04x!", packet->body.enc.subtype);
+    exit(1);
+  }
+
+  if(!session->new_encryptor)
+  {
+    LOG_FATAL("Received an unexpected renegotiation from the server!");
+    exit(1);
+  }
+
+  start_ecdh(session, session->new_encryptor, packet->body.enc.public_key, finish_enc_renegotiate);
+
+  return !session->ecdh_job;
 }
 
 static NBBOOL _handle_enc_before_auth(session_t *session, packet_t *packet)
@@ -360,15 +1027,195 @@ static NBBOOL _handle_syn_new(session_t *session, packet_t *packet)
   /* Update the state. */
   session->state                = SESSION_STATE_ESTABLISHED;
 
-  printf("Session established!\n");
+  if(session->options & OPT_RESUMABLE)
+  {
+    memcpy(session->ticket, packet->body.syn.ticket, PACKET_TICKET_LENGTH);
+    session->has_ticket = TRUE;
+  }
+
+  /* The server says how long it'll actually hold a poll (no longer than we
+   * asked for). */
+  if(session->options & OPT_LONG_POLL)
+  {
+    session->long_poll = MIN(packet->body.syn.long_poll, long_poll);
+    LOG_INFO("The server will hold polls for up to %dms", session->long_poll);
+  }
+
+  /* Same with the FEC group; and it's only any use with a window. */
+  if((session->options & OPT_FEC) && is_windowed(session) && packet->body.syn.fec_group > 0)
+  {
+    session->fec_group = MIN(MIN(packet->body.syn.fec_group, fec_group), MIN(window_size, PACKET_FEC_MAX_GROUP));
+    LOG_INFO("The server agreed to FEC, with a parity packet for every %d MSGs", session->fec_group);
+  }
+  else
+  {
+    session->options &= ~OPT_FEC;
+  }
+
+  /* The server only echoes OPT_COMPRESSED if it agrees to it. */
+  if(session->options & OPT_COMPRESSED)
+  {
+    size_t   length;
+    uint8_t *queued;
+    uint8_t *compressed;
+
+    LOG_INFO("The server agreed to compress the session data");
+    session->compressor = compressor_create();
+
+    /* Anything the driver gave us before now hasn't been sent (SYNs don't
+     * carry data), so it can still be compressed. */
+    queued = ring_buffer_read_remaining_bytes(session->outgoing_buffer, &length, -1);
+    compressed = compressor_compress(session->compressor, queued, length, &length);
+    ring_buffer_add_bytes(session->outgoing_buffer, compressed, length);
+
+    safe_free(queued);
+    safe_free(compressed);
+  }
+
+  if(is_windowed(session))
+    printf("Session established (windowed, up to %d packets in flight)!\n", window_size);
+  else
+    printf("Session established!\n");
+
+  return TRUE;
+}
+
+/* The answer to a resumption SYN: the server's ACK says how much of our data
+ * it got, and everything that was in flight goes out again. */
+static NBBOOL _handle_syn_established(session_t *session, packet_t *packet)
+{
+  uint16_t bytes_acked = packet->body.syn.ack - session->my_seq;
+
+  if(!session->is_resuming || !(packet->body.syn.options & OPT_RESUME))
+  {
+    LOG_WARNING("Received a SYN packet in state %s; ignoring!", session_state_to_string(session->state));
+    return FALSE;
+  }
+
+  if(memcmp(packet->body.syn.ticket, session->ticket, PACKET_TICKET_LENGTH))
+  {
+    LOG_WARNING("The server answered our resumption SYN with the wrong ticket; ignoring!");
+    return FALSE;
+  }
+
+  if(bytes_acked > ring_buffer_get_length(session->outgoing_buffer) || packet->body.syn.seq != session->their_seq)
+  {
+    LOG_WARNING("The server's resumption SYN doesn't line up with our data (SEQ = 0x%04x, ACK = 0x%04x); ignoring!", packet->body.syn.seq, packet->body.syn.ack);
+    return FALSE;
+  }
+
+  ring_buffer_consume(session->outgoing_buffer, bytes_acked);
+  session->my_seq = (session->my_seq + bytes_acked) & 0xFFFF;
+  session->stats.bytes_acked += bytes_acked;
+
+  session->sent_length     = 0;
+  session->in_flight_count = 0;
+  session->polls_in_flight = 0;
+  session->server_has_more = FALSE;
+  fec_reset(session);
+
+  session->is_resuming          = FALSE;
+  session->missed_transmissions = 0;
+  you_can_transmit_now(session);
+
+  LOG_WARNING("Session %d resumed (%d bytes that were in flight had gotten through)", session->id, bytes_acked);
 
   return TRUE;
 }
 
+/* The windowed version of _handle_msg_established(). The ACK is cumulative
+ * and is processed even if the SEQ is out of order, since a dropped
+ * response doesn't mean the data we sent was lost. */
+static NBBOOL _handle_msg_windowed(session_t *session, packet_t *packet)
+{
+  NBBOOL   send_right_away = FALSE;
+  uint16_t bytes_acked     = packet->body.msg.ack - session->my_seq;
+
+  LOG_INFO("In SESSION_STATE_ESTABLISHED, received a windowed MSG");
+
+  if(bytes_acked <= session->sent_length)
+  {
+    /* Since we got a valid response back, the connection isn't dying. */
+    session->missed_transmissions = 0;
+
+    if(bytes_acked > 0)
+    {
+      ring_buffer_consume(session->outgoing_buffer, bytes_acked);
+      session->my_seq = (session->my_seq + bytes_acked) & 0xFFFF;
+      session->stats.bytes_acked += bytes_acked;
+      window_ack(session, bytes_acked);
+
+      if(transmit_instantly_on_data)
+      {
+        you_can_transmit_now(session);
+        send_right_away = TRUE;
+      }
+    }
+  }
+  else
+  {
+    LOG_INFO("Stale ACK received (%d bytes acked; %zd bytes in flight)", bytes_acked, session->sent_length);
+    session->stats.bad_acks++;
+  }
+
+  if(packet->body.msg.seq == session->their_seq && packet->body.msg.data_length > 0 && driver_is_full(session->driver))
+  {
+    refuse_incoming(session, packet->body.msg.seq);
+  }
+  else if(packet->body.msg.seq == session->their_seq)
+  {
+    uint8_t *data;
+    size_t   length;
+
+    session->their_seq = (session->their_seq + packet->body.msg.data_length) & 0xFFFF;
+
+    if(packet->body.msg.data_length > 0)
+    {
+      deliver_incoming(session, packet->body.msg.data, packet->body.msg.data_length);
+      you_can_transmit_now(session);
+    }
+
+    /* Along with anything that came early and was waiting on it (which stays
+     * where it is if the driver's backed up now). */
+    while(!driver_is_full(session->driver) && (data = reorder_buffer_take(session->reorder, session->their_seq, &length)))
+    {
+      session->their_seq = (session->their_seq + length) & 0xFFFF;
+      deliver_incoming(session, data, length);
+      safe_free(data);
+    }
+  }
+  else if(reorder_buffer_add(session->reorder, session->their_seq, packet->body.msg.seq, packet->body.msg.data, packet->body.msg.data_length))
+  {
+    LOG_INFO("Early SEQ received (expected %d, received %d); holding onto it", session->their_seq, packet->body.msg.seq);
+    session->stats.reordered++;
+  }
+  else
+  {
+    /* A repeat of something we already have, or too far ahead to keep. */
+    LOG_INFO("Out-of-order SEQ received (expected %d, received %d); dropping it", session->their_seq, packet->body.msg.seq);
+    session->stats.bad_seqs++;
+  }
+
+  /* Keep the window full. */
+  if(can_send_now(session))
+    send_right_away = TRUE;
+
+  return send_right_away;
+}
+
 static NBBOOL _handle_msg_established(session_t *session, packet_t *packet)
 {
   NBBOOL send_right_away = FALSE;
 
+  /* There's no telling which query this answers, so count it against the
+   * polls either way. */
+  if(session->polls_in_flight > 0)
+    session->polls_in_flight--;
+  session->server_has_more = (session->options & OPT_MSG_FLAGS) && (packet->body.msg.flags & PACKET_MSG_FLAG_MORE);
+
+  if(is_windowed(session))
+    return _handle_msg_windowed(session, packet);
+
   LOG_INFO("In SESSION_STATE_ESTABLISHED, received a MSG");
 
   /* Validate the SEQ */
@@ -376,9 +1223,10 @@ static NBBOOL _handle_msg_established(session_t *session, packet_t *packet)
   {
     /* Verify the ACK is sane */
     uint16_t bytes_acked = packet->body.msg.ack - session->my_seq;
+    size_t   data_length = packet->body.msg.data_length;
 
     /* If there's still bytes waiting in the buffer.. */
-    if(bytes_acked <= buffer_get_remaining_bytes(session->outgoing_buffer))
+    if(bytes_acked <= ring_buffer_get_length(session->outgoing_buffer))
     {
       /* Since we got a valid response back, the connection isn't dying. */
       session->missed_transmissions = 0;
@@ -396,11 +1244,20 @@ static NBBOOL _handle_msg_established(session_t *session, packet_t *packet)
         }
       }
 
+      /* If the driver's backed up, act like the data never came, and the
+       * server will send it again. */
+      if(data_length > 0 && driver_is_full(session->driver))
+      {
+        refuse_incoming(session, packet->body.msg.seq);
+        data_length = 0;
+      }
+
       /* Increment their sequence number */
-      session->their_seq = (session->their_seq + packet->body.msg.data_length) & 0xFFFF;
+      session->their_seq = (session->their_seq + data_length) & 0xFFFF;
 
       /* Remove the acknowledged data from the buffer */
-      buffer_consume(session->outgoing_buffer, bytes_acked);
+      ring_buffer_consume(session->outgoing_buffer, bytes_acked);
+      session->stats.bytes_acked += bytes_acked;
 
       /* Increment my sequence number */
       if(bytes_acked != 0)
@@ -409,20 +1266,29 @@ static NBBOOL _handle_msg_established(session_t *session, packet_t *packet)
       }
 
       /* Print the data, if we received any, and then immediately receive more. */
-      if(packet->body.msg.data_length > 0)
+      if(data_length > 0)
       {
-        driver_data_received(session->driver, packet->body.msg.data, packet->body.msg.data_length);
+        deliver_incoming(session, packet->body.msg.data, data_length);
         you_can_transmit_now(session);
       }
     }
     else
     {
-      LOG_WARNING("Bad ACK received (%d bytes acked; %d bytes in the buffer)", bytes_acked, buffer_get_remaining_bytes(session->outgoing_buffer));
+      LOG_WARNING("Bad ACK received (%d bytes acked; %d bytes in the buffer)", bytes_acked, ring_buffer_get_length(session->outgoing_buffer));
+      session->stats.bad_acks++;
+    }
+
+    /* If the server has more waiting, go get it. */
+    if(session->server_has_more)
+    {
+      you_can_transmit_now(session);
+      send_right_away = TRUE;
     }
   }
   else
   {
     LOG_WARNING("Bad SEQ received (Expected %d, received %d)", session->their_seq, packet->body.msg.seq);
+    session->stats.bad_seqs++;
   }
 
   return send_right_away;
@@ -464,6 +1330,16 @@ NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length)
   /* Suck in any data we can from the driver. */
   poll_driver_for_data(session);
 
+#ifndef NO_ENCRYPTION
+  /* We wouldn't know which keys to check it with; the server will
+   * retransmit. */
+  if(session->ecdh_job)
+  {
+    LOG_INFO("Session %d is still working out its keys; ignoring a packet", session->id);
+    return FALSE;
+  }
+#endif
+
   /* Make a copy of the data so we can mess around with it. */
   packet_bytes = safe_malloc(length);
   memcpy(packet_bytes, data, length);
@@ -474,28 +1350,24 @@ NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length)
 #ifndef NO_ENCRYPTION
   if(should_we_encrypt(session))
   {
-    buffer_t *packet_buffer = buffer_create_with_data(BO_BIG_ENDIAN, packet_bytes, length);
-    safe_free(packet_bytes);
-
-    if(!encryptor_check_signature(session->encryptor, packet_buffer))
+    /* Check the signature and decrypt it, right in our copy. */
+    if(!encryptor_open(session->encryptor, packet_bytes, &length, NULL))
     {
       LOG_WARNING("Server's signature was wrong! Ignoring!");
+      safe_free(packet_bytes);
       return FALSE;
     }
-
-    /* Decrypt the buffer. */
-    encryptor_decrypt_buffer(session->encryptor, packet_buffer, NULL);
-
-    /* Switch to the decrypted data. */
-    packet_bytes = buffer_create_string_and_destroy(packet_buffer, &length);
   }
 #endif
 
-  /* Parse the packet. */
-  packet = packet_parse(packet_bytes, length, session->options);
+  trace_packet(TRACE_INCOMING, session->options, packet_bytes, length);
 
-  /* Free the memory we allocated. */
-  safe_free(packet_bytes);
+  /* Parse the packet; a MSG's data is left where it is, in packet_bytes, so
+   * that has to stay around till the packet's done with. */
+  packet = packet_parse_view(packet_bytes, length, session->options);
+
+  rtt_answered(session);
+  session->last_received = select_group_time_ms();
 
   /* Print packet data if we're supposed to. */
   if(packet_trace)
@@ -520,7 +1392,7 @@ NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length)
     handlers[PACKET_TYPE_SYN][SESSION_STATE_BEFORE_AUTH]    = _handle_error;
 #endif
     handlers[PACKET_TYPE_SYN][SESSION_STATE_NEW]            = _handle_syn_new;
-    handlers[PACKET_TYPE_SYN][SESSION_STATE_ESTABLISHED]    = _handle_warning;
+    handlers[PACKET_TYPE_SYN][SESSION_STATE_ESTABLISHED]    = _handle_syn_established;
 
 #ifndef NO_ENCRYPTION
     handlers[PACKET_TYPE_MSG][SESSION_STATE_BEFORE_INIT]    = _handle_error;
@@ -536,6 +1408,14 @@ NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length)
     handlers[PACKET_TYPE_FIN][SESSION_STATE_NEW]            = _handle_fin;
     handlers[PACKET_TYPE_FIN][SESSION_STATE_ESTABLISHED]    = _handle_fin;
 
+    /* The server never sends parity (it's only for the data we send). */
+#ifndef NO_ENCRYPTION
+    handlers[PACKET_TYPE_FEC][SESSION_STATE_BEFORE_INIT]    = _handle_warning;
+    handlers[PACKET_TYPE_FEC][SESSION_STATE_BEFORE_AUTH]    = _handle_warning;
+#endif
+    handlers[PACKET_TYPE_FEC][SESSION_STATE_NEW]            = _handle_warning;
+    handlers[PACKET_TYPE_FEC][SESSION_STATE_ESTABLISHED]    = _handle_warning;
+
 #ifndef NO_ENCRYPTION
     handlers[PACKET_TYPE_ENC][SESSION_STATE_BEFORE_INIT]   = _handle_enc_before_init;
     handlers[PACKET_TYPE_ENC][SESSION_STATE_BEFORE_AUTH]   = _handle_enc_before_auth;
@@ -561,10 +1441,36 @@ NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length)
   }
 
   packet_destroy(packet);
+  safe_free(packet_bytes);
 
   return send_right_away;
 }
 
+NBBOOL session_resume(session_t *session)
+{
+  if(!session->has_ticket || session->is_resuming || session->state != SESSION_STATE_ESTABLISHED)
+    return FALSE;
+
+#ifndef NO_ENCRYPTION
+  /* The worker will finish it and let us know. */
+  if(session->ecdh_job)
+    return FALSE;
+
+  /* If the server never saw our half of a renegotiation, it'll be asked
+   * again once we're back. */
+  if(session->new_encryptor)
+  {
+    encryptor_destroy(session->new_encryptor);
+    session->new_encryptor = NULL;
+  }
+#endif
+
+  session->is_resuming          = TRUE;
+  session->missed_transmissions = 0;
+
+  return TRUE;
+}
+
 void session_kill(session_t *session)
 {
   if(session->is_shutdown)
@@ -589,11 +1495,28 @@ void session_destroy(session_t *session)
     driver_destroy(session->driver);
 
   if(session->outgoing_buffer)
-    buffer_destroy(session->outgoing_buffer);
+    ring_buffer_destroy(session->outgoing_buffer);
+
+  if(session->reorder)
+    reorder_buffer_destroy(session->reorder);
+
+  if(session->compressor)
+    compressor_destroy(session->compressor);
+
+  if(session->fec_parity)
+    safe_free(session->fec_parity);
 
 #ifndef NO_ENCRYPTION
+  /* If the worker's still on it, it'll throw the result away. */
+  if(session->ecdh_job)
+    session->ecdh_job->session = NULL;
+
   if(session->encryptor)
     encryptor_destroy(session->encryptor);
+  if(session->new_encryptor)
+    encryptor_destroy(session->new_encryptor);
+  if(session->handshake_syn)
+    safe_free(session->handshake_syn);
 #endif
 
   safe_free(session);
@@ -645,7 +1568,26 @@ static session_t *session_create(char *name)
 
   session->last_transmit = 0;
   session->missed_transmissions = 0;
-  session->outgoing_buffer = buffer_create(BO_BIG_ENDIAN);
+  session->outgoing_buffer = ring_buffer_create(SESSION_MAX_BUFFERED);
+
+  session->sent_length     = 0;
+  session->in_flight_count = 0;
+  session->reorder         = reorder_buffer_create(SESSION_MAX_WINDOW, SESSION_MAX_BUFFERED);
+  session->compressor      = NULL;
+  session->priority        = SESSION_DEFAULT_PRIORITY;
+  session->needs_ack       = FALSE;
+  session->has_ticket      = FALSE;
+  session->is_resuming     = FALSE;
+
+  session->srtt             = 0;
+  session->rttvar           = 0;
+  session->rto              = packet_delay;
+  session->queries_sent     = 0;
+  session->queries_answered = 0;
+  session->timed_at         = 0;
+  session->empty_polls      = 0;
+  session->long_poll        = 0;
+  session->last_was_poll    = FALSE;
 
 #ifndef NO_ENCRYPTION
   session->encryptor = encryptor_create(preshared_secret);
@@ -666,6 +1608,7 @@ static session_t *session_create(char *name)
   return session;
 }
 
+#ifndef NO_DRIVER_CONSOLE
 session_t *session_create_console(select_group_t *group, char *name)
 {
   session_t *session = session_create(name);
@@ -674,7 +1617,9 @@ session_t *session_create_console(select_group_t *group, char *name)
 
   return session;
 }
+#endif
 
+#ifndef NO_DRIVER_EXEC
 session_t *session_create_exec(select_group_t *group, char *name, char *process)
 {
   session_t *session = session_create(name);
@@ -683,7 +1628,9 @@ session_t *session_create_exec(select_group_t *group, char *name, char *process)
 
   return session;
 }
+#endif
 
+#ifndef NO_DRIVER_COMMAND
 session_t *session_create_command(select_group_t *group, char *name)
 {
   session_t *session = session_create(name);
@@ -693,7 +1640,9 @@ session_t *session_create_command(select_group_t *group, char *name)
 
   return session;
 }
+#endif
 
+#ifndef NO_DRIVER_PING
 session_t *session_create_ping(select_group_t *group, char *name)
 {
   session_t *session = session_create(name);
@@ -703,6 +1652,7 @@ session_t *session_create_ping(select_group_t *group, char *name)
 
   return session;
 }
+#endif
 
 void debug_set_isn(uint16_t value)
 {
@@ -721,11 +1671,75 @@ void session_set_delay(int delay_ms)
   packet_delay = delay_ms;
 }
 
+int session_get_delay()
+{
+  return packet_delay;
+}
+
+void session_set_priority(session_t *session, int priority)
+{
+  session->priority = MAX(1, MIN(priority, SESSION_MAX_PRIORITY));
+}
+
+static void report_stat(session_t *session, char *name, uint32_t value, stats_callback_t *callback, void *param)
+{
+  /* The names are all ours, and short. */
+  char full_name[64];
+
+  sprintf(full_name, "session.%04x.%s", session->id, name);
+
+  callback(full_name, value, param);
+}
+
+void session_get_stats(session_t *session, stats_callback_t *callback, void *param)
+{
+  report_stat(session, "bytes_sent",           session->stats.bytes_sent,     callback, param);
+  report_stat(session, "bytes_acked",          session->stats.bytes_acked,    callback, param);
+  report_stat(session, "bytes_received",       session->stats.bytes_received, callback, param);
+  report_stat(session, "msgs_sent",            session->stats.msgs_sent,      callback, param);
+  report_stat(session, "retransmits",          session->stats.retransmits,    callback, param);
+  report_stat(session, "missed_transmissions", session->missed_transmissions, callback, param);
+  report_stat(session, "bad_seqs",             session->stats.bad_seqs,       callback, param);
+  report_stat(session, "bad_acks",             session->stats.bad_acks,       callback, param);
+  report_stat(session, "reordered",            session->stats.reordered,      callback, param);
+  report_stat(session, "parity_sent",          session->stats.parity_sent,    callback, param);
+  report_stat(session, "refused",              session->stats.refused,        callback, param);
+  report_stat(session, "srtt_ms",              session->srtt,                 callback, param);
+  report_stat(session, "rto_ms",               session->rto,                  callback, param);
+  report_stat(session, "backlog_bytes",        (uint32_t)session_get_backlog(session), callback, param);
+  report_stat(session, "in_flight",            session->in_flight_count,      callback, param);
+}
+
 void session_set_transmit_immediately(NBBOOL transmit_immediately)
 {
   transmit_instantly_on_data = transmit_immediately;
 }
 
+void session_set_window_size(int new_window_size)
+{
+  window_size = MAX(1, MIN(new_window_size, SESSION_MAX_WINDOW));
+}
+
+void session_set_compression(NBBOOL new_compression)
+{
+  do_compression = new_compression;
+}
+
+void session_set_long_poll(int new_long_poll)
+{
+  long_poll = MAX(0, MIN(new_long_poll, 0xFFFF));
+}
+
+void session_set_fec(int new_fec_group)
+{
+  fec_group = MAX(0, MIN(new_fec_group, PACKET_FEC_MAX_GROUP));
+}
+
+void session_set_worker(worker_t *new_worker)
+{
+  worker = new_worker;
+}
+
 #ifndef NO_ENCRYPTION
 void session_set_preshared_secret(char *new_preshared_secret)
 {
@@ -735,6 +1749,10 @@ void session_set_encryption(NBBOOL new_encryption)
 {
   do_encryption = FALSE;
 }
+void session_set_fast_handshake(NBBOOL new_fast_handshake)
+{
+  fast_handshake = new_fast_handshake;
+}
 #endif
 
 NBBOOL session_is_shutdown(session_t *session)
@@ -12,10 +12,15 @@
 #ifndef __SESSION_H__
 #define __SESSION_H__
 
+#include "controller/packet.h"
 #include "drivers/driver.h"
 #include "libs/buffer.h"
+#include "libs/compressor.h"
 #include "libs/memory.h"
+#include "libs/reorder_buffer.h"
+#include "libs/ring_buffer.h"
 #include "libs/types.h"
+#include "libs/worker.h"
 
 #ifndef NO_ENCRYPTION
 #include "libs/crypto/encryptor.h"
@@ -35,6 +40,63 @@ typedef enum
 
 char *session_state_to_string(session_state_t state);
 
+/* The most MSG packets we'll ever have in flight at once (when OPT_WINDOWED
+ * is negotiated). */
+#define SESSION_MAX_WINDOW 16
+
+/* The most outgoing data a session queues up before leaving the rest with
+ * its driver. */
+#define SESSION_MAX_BUFFERED 16384
+
+/* How much of the controller's attention a session gets, relative to the
+ * others; see session_set_priority(). */
+#define SESSION_DEFAULT_PRIORITY 1
+#define SESSION_MAX_PRIORITY     16
+
+/* Bounds on the retransmit timer (in ms). Each retransmit doubles it, but
+ * never past SESSION_MAX_BACKOFF times the delay. */
+#define SESSION_MIN_RTO     50
+#define SESSION_MAX_RTO     60000
+#define SESSION_MAX_BACKOFF 4
+
+/* How long (in ms) we let the server hold onto a poll, by default; it has to
+ * be answered before the DNS driver gives up on the query (2s). */
+#define SESSION_DEFAULT_LONG_POLL 1500
+
+/* With the fast handshake, how many ENC INITs carry our SYN before we decide
+ * the server doesn't understand them and send plain ones. */
+#define SESSION_FAST_HANDSHAKE_TRIES 2
+
+/* Running totals for a session, for the stats command (see
+ * session_get_stats()). The byte counts are of data as it goes over the
+ * wire (so after compression, and counting every retransmission). */
+typedef struct
+{
+  uint32_t        bytes_sent;
+  uint32_t        bytes_acked;
+  uint32_t        bytes_received;
+  uint32_t        msgs_sent;
+
+  /* Packets that went out because the retransmit timer did. */
+  uint32_t        retransmits;
+
+  /* MSGs from the server that were dropped for having the wrong SEQ, or an
+   * ACK for data we never sent. */
+  uint32_t        bad_seqs;
+  uint32_t        bad_acks;
+
+  /* MSGs from the server that came early, and were held till the ones
+   * before them showed up. */
+  uint32_t        reordered;
+
+  /* FEC packets sent (with OPT_FEC). */
+  uint32_t        parity_sent;
+
+  /* MSGs from the server whose data was left unacknowledged because the
+   * driver was still backed up (see driver_is_full()). */
+  uint32_t        refused;
+} session_stats_t;
+
 typedef struct
 {
   /* Session information */
@@ -49,28 +111,117 @@ typedef struct
 
   int             missed_transmissions;
 
+  /* Round-trip estimates, in ms, worked out like TCP's (RFC 6298); rto
+   * starts at the delay, and srtt is 0 till the first sample. */
+  int             srtt;
+  int             rttvar;
+  int             rto;
+
+  /* The server answers every query, in order, so the Nth answer goes with
+   * the Nth query. One query at a time is timed: timed_query is its number,
+   * and timed_at is when it went out (0 if nothing's being timed). */
+  uint32_t        queries_sent;
+  uint32_t        queries_answered;
+  uint32_t        timed_query;
+  uint64_t        timed_at;
+
+  /* How many answers in a row had nothing new in them; each one doubles the
+   * time till the next poll, up to the delay. */
+  int             empty_polls;
+
+  /* How long the server might sit on a poll (0 unless both sides agreed to
+   * OPT_LONG_POLL), and whether the last thing we sent was one. */
+  int             long_poll;
+  NBBOOL          last_was_poll;
+
   uint16_t       options;
   NBBOOL         is_command;
 
   NBBOOL         is_ping;
 
+  int            priority;
+
+  /* Set when the server sent us data that we haven't ACKed yet. */
+  NBBOOL         needs_ack;
+
   driver_t       *driver;
 
-  buffer_t       *outgoing_buffer;
+  ring_buffer_t  *outgoing_buffer;
+
+  /* Sliding-window state, only used with OPT_WINDOWED. outgoing_buffer
+   * always starts at my_seq; sent_length is how much of it is already on
+   * the wire, and in_flight is the length of each unacknowledged segment,
+   * oldest first. */
+  size_t          sent_length;
+  size_t          in_flight[SESSION_MAX_WINDOW];
+  int             in_flight_count;
+
+  /* Also only for OPT_WINDOWED, where the server can have several MSGs in
+   * flight too: the ones that arrived ahead of their_seq (resolvers don't
+   * keep answers in order), which are used once the gap is filled. */
+  reorder_buffer_t *reorder;
+
+  /* With OPT_MSG_FLAGS: whether the server's last MSG said it had more
+   * waiting, and how many empty MSGs have gone out to fetch it (in windowed
+   * mode, up to the window's worth at once). Any that are still out a
+   * retransmit timeout after the last answer count as lost. */
+  NBBOOL          server_has_more;
+  int             polls_in_flight;
+  uint64_t        last_received;
+
+  /* Parity for the new segments sent since the last FEC packet, only used
+   * with OPT_FEC: fec_group is how many segments one packet covers, fec_seq
+   * is the first one's SEQ, and fec_lengths are their lengths. fec_ready is
+   * set once the FEC packet should go out. */
+  int             fec_group;
+  uint16_t        fec_seq;
+  size_t          fec_lengths[PACKET_FEC_MAX_GROUP];
+  int             fec_count;
+  uint8_t        *fec_parity;
+  size_t          fec_parity_length;
+  NBBOOL          fec_ready;
+
+  session_stats_t stats;
+
+  /* Only set once both sides have agreed to OPT_COMPRESSED. */
+  compressor_t   *compressor;
+
+  /* The server's resumption ticket (if it gave us one), and whether we're
+   * trying to use it; see session_resume(). */
+  NBBOOL          has_ticket;
+  uint8_t         ticket[PACKET_TICKET_LENGTH];
+  NBBOOL          is_resuming;
 
 #ifndef NO_ENCRYPTION
   encryptor_t *encryptor;
 
   /* Used for renegotiation. */
   encryptor_t *new_encryptor;
+
+  /* Set while the shared secret is being worked out (maybe on another
+   * thread); the session doesn't send or receive anything till it's done. */
+  struct _ecdh_job_t *ecdh_job;
+
+  /* The (encrypted) answer to our SYN, if it came with the server's key;
+   * it's handled once the keys are ready. */
+  uint8_t *handshake_syn;
+  size_t   handshake_syn_length;
 #endif
 } session_t;
 
 /* TODO: re-order and comment these. */
+#ifndef NO_DRIVER_CONSOLE
 session_t *session_create_console(select_group_t *group, char *name);
+#endif
+#ifndef NO_DRIVER_EXEC
 session_t *session_create_exec(select_group_t *group, char *name, char *process);
+#endif
+#ifndef NO_DRIVER_COMMAND
 session_t *session_create_command(select_group_t *group, char *name);
+#endif
+#ifndef NO_DRIVER_PING
 session_t *session_create_ping(select_group_t *group, char *name);
+#endif
 
 void debug_set_isn(uint16_t value);
 
@@ -79,12 +230,71 @@ NBBOOL session_is_shutdown(session_t *session);
 NBBOOL session_data_incoming(session_t *session, uint8_t *data, size_t length);
 uint8_t *session_get_outgoing(session_t *session, size_t *packet_length, size_t max_length);
 
+/* How long (in ms) till the session wants to transmit again: 0 if it can
+ * right now, or -1 if it's shut down. */
+int session_get_next_transmit_ms(session_t *session);
+
+/* How long (in ms) the session is waiting between transmissions right now:
+ * its retransmit timer (backed off) if the server hasn't answered, or its
+ * poll interval if it has. */
+int session_get_timeout(session_t *session);
+
+/* TRUE if the session is established and has nothing to send or ACK; all it
+ * would send is a poll for data from the server. */
+NBBOOL session_is_idle(session_t *session);
+
+/* TRUE if the server told us (in its SYN) that it understands bundles, so
+ * this session's packets can share a query with other sessions'. */
+NBBOOL session_can_be_bundled(session_t *session);
+
+/* How many bytes are waiting to go out (including any that are in flight). */
+size_t session_get_backlog(session_t *session);
+
+void session_set_priority(session_t *session, int priority);
+
+/* Report the session's counters (session_stats_t, plus its round-trip
+ * estimates and how much it has waiting) to callback, with names like
+ * "session.<id>.bytes_sent". */
+void session_get_stats(session_t *session, stats_callback_t *callback, void *param);
+
+/* For when the server seems to have gone away: instead of dying, the session
+ * starts sending SYNs with its resumption ticket, which pick it up right where
+ * it left off (keys and all) once one gets through. Returns FALSE if there's
+ * no ticket, or if it's already trying; either way, it's time to give up. */
+NBBOOL session_resume(session_t *session);
+
+/* Do any work that can be done ahead of time (getting the keystream for the
+ * next few packets ready); for when the controller is otherwise idle. */
+void session_precompute(session_t *session);
+
+/* The same, for work that isn't tied to a session (keys for new ones). */
+void session_precompute_global();
+
 void session_enable_packet_trace();
 void session_set_delay(int delay_ms);
+int session_get_delay();
 void session_set_transmit_immediately(NBBOOL transmit_immediately);
+void session_set_window_size(int new_window_size);
+void session_set_compression(NBBOOL new_compression);
+
+/* Let the server hold polls for up to this long (in ms; 0 turns it off). */
+void session_set_long_poll(int new_long_poll);
+
+/* Follow every new_fec_group windowed MSGs with a parity packet the server
+ * can rebuild a lost one from (OPT_FEC; 0 turns it off). */
+void session_set_fec(int new_fec_group);
+
+/* Hand the slow crypto work to this worker (without one, it's done on the
+ * spot). */
+void session_set_worker(worker_t *new_worker);
 #ifndef NO_ENCRYPTION
 void session_set_preshared_secret(char *new_preshared_secret);
 void session_set_encryption(NBBOOL new_encryption);
+
+/* Send the SYN along with our public key, so the session opens in one round
+ * trip instead of two (PACKET_ENC_FLAG_SYN). The SYN, name and all, isn't
+ * encrypted, and it doesn't happen with a pre-shared secret. */
+void session_set_fast_handshake(NBBOOL new_fast_handshake);
 #endif
 void session_kill(session_t *session);
 void session_destroy(session_t *session);
@@ -23,13 +23,20 @@
 
 #include "controller/controller.h"
 #include "controller/session.h"
+#include "drivers/command/driver_command.h"
 #include "libs/buffer.h"
 #include "libs/ll.h"
 #include "libs/log.h"
 #include "libs/memory.h"
+#include "libs/resolver.h"
 #include "libs/select_group.h"
+#include "libs/trace.h"
 #include "libs/udp.h"
+#include "libs/worker.h"
 #include "tunnel_drivers/driver_dns.h"
+#ifndef NO_TUNNEL_TCP
+#include "tunnel_drivers/driver_tcp.h"
+#endif
 #include "tunnel_drivers/tunnel_driver.h"
 
 /* Default options */
@@ -43,7 +50,16 @@
 /* Define these outside the function so they can be freed by the atexec() */
 select_group_t *group         = NULL;
 driver_dns_t   *tunnel_driver = NULL;
-char           *system_dns    = NULL;
+#ifndef NO_TUNNEL_TCP
+driver_tcp_t   *tcp_driver    = NULL;
+#endif
+worker_t       *worker        = NULL;
+#ifndef NO_DRIVER_COMMAND
+worker_t       *io_worker     = NULL;
+resolver_t     *resolver      = NULL;
+#endif
+char           *system_dns[DNS_MAX_SERVERS];
+size_t          system_dns_count = 0;
 
 typedef struct
 {
@@ -53,12 +69,14 @@ typedef struct
 typedef struct
 {
   driver_type_t type;
+  int           priority;
   union
   {
     exec_options_t exec;
   } options;
 } make_driver_t;
 
+#ifndef NO_DRIVER_CONSOLE
 static make_driver_t *make_console()
 {
   make_driver_t *make_driver = (make_driver_t*) safe_malloc(sizeof(make_driver_t));
@@ -66,7 +84,9 @@ static make_driver_t *make_console()
 
   return make_driver;
 }
+#endif
 
+#ifndef NO_DRIVER_COMMAND
 static make_driver_t *make_command()
 {
   make_driver_t *make_driver = (make_driver_t*) safe_malloc(sizeof(make_driver_t));
@@ -74,7 +94,9 @@ static make_driver_t *make_command()
 
   return make_driver;
 }
+#endif
 
+#ifndef NO_DRIVER_PING
 static make_driver_t *make_ping()
 {
   make_driver_t *make_driver = (make_driver_t*) safe_malloc(sizeof(make_driver_t));
@@ -82,7 +104,9 @@ static make_driver_t *make_ping()
 
   return make_driver;
 }
+#endif
 
+#ifndef NO_DRIVER_EXEC
 static make_driver_t *make_exec(char *process)
 {
   make_driver_t *make_driver = (make_driver_t*) safe_malloc(sizeof(make_driver_t));
@@ -91,45 +115,70 @@ static make_driver_t *make_exec(char *process)
 
   return make_driver;
 }
+#endif
 
 static int create_drivers(ll_t *drivers)
 {
   int num_created = 0;
   make_driver_t *this_driver;
+  session_t *session = NULL;
 
   while((this_driver = ll_remove_first(drivers)))
   {
     num_created++;
     switch(this_driver->type)
     {
+#ifndef NO_DRIVER_CONSOLE
       case DRIVER_TYPE_CONSOLE:
         printf("Creating a console session!\n");
-        controller_add_session(session_create_console(group, "console"));
+        session = session_create_console(group, "console");
         break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
       case DRIVER_TYPE_EXEC:
         printf("Creating a exec('%s') session!\n", this_driver->options.exec.process);
-        controller_add_session(session_create_exec(group, this_driver->options.exec.process, this_driver->options.exec.process));
+        session = session_create_exec(group, this_driver->options.exec.process, this_driver->options.exec.process);
         break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
       case DRIVER_TYPE_COMMAND:
         printf("Creating a command session!\n");
-        controller_add_session(session_create_command(group, "command"));
+        session = session_create_command(group, "command");
         break;
+#endif
 
+#ifndef NO_DRIVER_PING
       case DRIVER_TYPE_PING:
         printf("Creating a ping session!\n");
-        controller_add_session(session_create_ping(group, "ping"));
+        session = session_create_ping(group, "ping");
+        break;
+#endif
+
+      default:
+        LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in create_drivers)\n", this_driver->type);
+        exit(1);
         break;
     }
+
+    if(this_driver->priority)
+      session_set_priority(session, this_driver->priority);
+    controller_add_session(session);
+
     safe_free(this_driver);
   }
 
   /* Default to creating a command session. */
   if(num_created == 0)
   {
+#ifndef NO_DRIVER_COMMAND
     num_created++;
     controller_add_session(session_create_command(group, "command"));
+#else
+    LOG_FATAL("This build has no command sessions, so it needs to be told what to run (--console, --exec, etc.)");
+    exit(1);
+#endif
   }
 
   return num_created;
@@ -158,14 +207,31 @@ static void cleanup(void)
 
   controller_destroy();
 
+  /* (After the sessions, which might still be waiting on it.) */
+  if(worker)
+    worker_destroy(worker);
+#ifndef NO_DRIVER_COMMAND
+  if(io_worker)
+    worker_destroy(io_worker);
+  if(resolver)
+    resolver_destroy(resolver);
+#endif
+
   if(tunnel_driver)
     driver_dns_destroy(tunnel_driver);
 
+#ifndef NO_TUNNEL_TCP
+  if(tcp_driver)
+    driver_tcp_destroy(tcp_driver);
+#endif
+
   if(group)
     select_group_destroy(group);
 
-  if(system_dns)
-    safe_free(system_dns);
+  trace_close();
+
+  while(system_dns_count > 0)
+    safe_free(system_dns[--system_dns_count]);
 
   print_memory();
 }
@@ -173,7 +239,7 @@ static void cleanup(void)
 void usage(char *name, char *message)
 {
   fprintf(stderr,
-"Usage: %s [args] [domain]\n"
+"Usage: %s [args] [domain...]\n"
 "\n"
 "General options:\n"
 " --help -h               This page.\n"
@@ -181,10 +247,25 @@ void usage(char *name, char *message)
 " --delay <ms>            Set the maximum delay between packets (default: 1000).\n"
 "                         The minimum is technically 50 for technical reasons,\n"
 "                         but transmitting too quickly might make performance\n"
-"                         worse.\n"
+"                         worse. Once the round trip has been measured, quiet\n"
+"                         sessions poll faster than this (slowing down to it\n"
+"                         when there's nothing going on), and retransmits\n"
+"                         follow the measured round trip instead.\n"
 " --steady                If set, always wait for the delay before sending.\n"
 "                         the next message (by default, when a response is\n"
 "                         received, the next message is immediately transmitted.\n"
+" --window <n>            Allow up to <n> MSG packets in flight at once if the\n"
+"                         server supports it (default: 1, ie, stop-and-wait;\n"
+"                         max: 16).\n"
+" --fec <n>               With --window, follow every <n> MSGs with a parity\n"
+"                         packet that the server can rebuild a lost one from,\n"
+"                         if the server supports it (default: 0, ie, off).\n"
+" --no-compression        Don't ask the server to compress the session data.\n"
+" --long-poll <ms>        Let the server hold onto polls for up to <ms>, so data\n"
+"                         for us goes out as soon as it's there (default: 1500;\n"
+"                         0 to turn it off).\n"
+" --coalesce <ms>         Let tunnels hold onto small writes for up to <ms>, so\n"
+"                         they're sent together (default: 20; 0 to turn it off).\n"
 " --max-retransmits <n>   Only re-transmit a message <n> times before giving up\n"
 "                         and assuming the server is dead (default: 20).\n"
 " --retransmit-forever    Set if you want the client to re-transmit forever\n"
@@ -194,45 +275,97 @@ void usage(char *name, char *message)
 " --secret                Set the shared secret; set the same one on the server\n"
 "                         and the client to prevent man-in-the-middle attacks!\n"
 " --no-encryption         Turn off encryption/authentication.\n"
+" --fast-handshake        Send the session's options (and name) along with our\n"
+"                         key, so it opens one round trip sooner. They go out\n"
+"                         unencrypted, and it doesn't work with --secret.\n"
 #endif
 "\n"
 "Input options:\n"
+#ifndef NO_DRIVER_CONSOLE
 " --console               Send/receive output to the console.\n"
+#endif
+#ifndef NO_DRIVER_EXEC
 " --exec -e <process>     Execute the given process and link it to the stream.\n"
+#endif
 /*" --listen -l <port>      Listen on the given port and link each connection to\n"
 "                         a new stream\n"*/
+#ifndef NO_DRIVER_COMMAND
 " --command               Start an interactive 'command' session (default).\n"
+#endif
+#ifndef NO_DRIVER_PING
 " --ping                  Simply check if there's a dnscat2 server listening.\n"
+#endif
+" --priority <n>          Give the session before this option <n> times the usual\n"
+"                         share of queries when several are busy (max: 16).\n"
 "\n"
 "Debug options:\n"
 " -d                      Display more debug info (can be used multiple times).\n"
 " -q                      Display less debug info (can be used multiple times).\n"
 " --packet-trace          Display incoming/outgoing dnscat2 packets\n"
+" --trace-file <file>     Write incoming/outgoing dnscat2 packets to <file>, as\n"
+"                         a pcap (read it with bench/tracedump).\n"
 "\n"
 "Driver options:\n"
 " --dns <options>         Enable DNS mode with the given domain.\n"
-"   domain=<domain>       The domain to make requests for.\n"
+"   domain=<domain>       The domain to make requests for. Can be passed\n"
+"                         several times (up to 8); queries take turns\n"
+"                         going to each one.\n"
 "   host=<hostname>       The host to listen on (default: 0.0.0.0).\n"
 "   port=<port>           The port to listen on (default: 53).\n"
 "   type=<type>           The type of DNS requests to use, can use\n"
-"                         multiple comma-separated (options: TXT, MX,\n"
-"                         CNAME, A, AAAA) (default: "DEFAULT_TYPES").\n"
+"                         multiple comma-separated (options: "DNS_TYPES")\n"
+"                         (default: "DEFAULT_TYPES").\n"
 "   server=<server>       The upstream server for making DNS requests\n"
-"                         (default: autodetected = %s).\n"
-#if 0
-" --tcp <options>         Enable TCP mode.\n"
-"   port=<port>           The port to listen on (default: 1234).\n"
-"   host=<hostname>       The host to listen on (default: 0.0.0.0).\n"
+"                         (default: autodetected = %s). Can be passed\n"
+"                         several times (up to 8); queries are spread\n"
+"                         across them, favouring the faster and more\n"
+"                         reliable ones.\n"
+"   pipeline=<n>          The most DNS queries to have in flight at once\n"
+"                         (default: 8, max: 32).\n"
+"   encoding=<encoding>   How to encode the data (options: "DNS_ENCODINGS")\n"
+"                         (default: "DEFAULT_ENCODING"); the server has to\n"
+"                         support it. base64 needs resolvers that keep case.\n"
+"   edns=<size>           The largest response to ask for with EDNS0, or 0\n"
+"                         to not use EDNS0 (default: 1232, max: 4096).\n"
+"   probe=<0|1>           Whether to test the path to the server first and\n"
+"                         pick the types, encoding, pipeline and delay that\n"
+"                         work best through it (default: 0).\n"
+"   probe_cache=<file>    Where to keep what the probe found, so the next\n"
+"                         run (within a day) can skip it.\n"
+"   tcp=<mode>            When to send queries over TCP (options:\n"
+"                         "DNS_TCP_MODES") (default: "DEFAULT_TCP_MODE"); auto\n"
+"                         uses it while the responses outgrow UDP.\n"
+#ifdef USE_TLS
+"   secure=<mode>         Send every query over DNS-over-TLS or DNS-over-\n"
+"                         HTTPS instead (options: "DNS_SECURE_MODES"); the port\n"
+"                         defaults to 853 or 443.\n"
+"   verify=<0|1>          Whether to check the servers' certificates\n"
+"                         (default: 1).\n"
+"   path=<path>           The path for DNS-over-HTTPS requests (default:\n"
+"                         "DEFAULT_DOH_PATH").\n"
+#endif
+#ifndef NO_TUNNEL_TCP
+" --tcp <options>         Connect straight to the server over TCP instead. If\n"
+"                         there's a DNS driver too (--dns, or a domain), it's\n"
+"                         used once the connection fails or is lost.\n"
+"   host=<hostname>       The server to connect to (required).\n"
+"   port=<port>           The port to connect to (default: %d).\n"
+"   pipeline=<n>          The most packets to have in flight at once\n"
+"                         (default: %d, max: %d).\n"
 #endif
 "\n"
 "Examples:\n"
 " ./dnscat --dns domain=skullseclabs.org\n"
 " ./dnscat --dns domain=skullseclabs.org,server=8.8.8.8,port=53\n"
+" ./dnscat --dns domain=skullseclabs.org,server=8.8.8.8,server=1.1.1.1\n"
 " ./dnscat --dns domain=skullseclabs.org,port=5353\n"
 " ./dnscat --dns domain=skullseclabs.org,port=53,type=A,CNAME\n"
-#if 0
-" --tcp port=1234\n"
-" --tcp port=1234,host=127.0.0.1\n"
+#ifdef USE_TLS
+" ./dnscat --dns domain=skullseclabs.org,server=1.1.1.1,secure=dot\n"
+#endif
+#ifndef NO_TUNNEL_TCP
+" ./dnscat --tcp host=1.2.3.4\n"
+" ./dnscat --tcp host=1.2.3.4,port=443 skullseclabs.org\n"
 #endif
 "\n"
 "By default, a --dns driver on port 53 is enabled if a hostname is\n"
@@ -242,14 +375,20 @@ void usage(char *name, char *message)
 "\n"
 "ERROR: %s\n"
 "\n"
-, name, system_dns, message
+, name, system_dns_count ? system_dns[0] : "none",
+#ifndef NO_TUNNEL_TCP
+TCP_DEFAULT_PORT, TCP_DEFAULT_PIPELINE, TCP_MAX_PIPELINE,
+#endif
+message
 );
   exit(0);
 }
 
-driver_dns_t *create_dns_driver_internal(select_group_t *group, char *domain, char *host, uint16_t port, char *type, char *server)
+driver_dns_t *create_dns_driver_internal(select_group_t *group, char **domains, size_t domain_count, char *host, uint16_t port, char *type, char **servers, size_t server_count, size_t pipeline, char *encoding, uint16_t edns_size, char *tcp_mode, char *secure, char *doh_path, NBBOOL verify, NBBOOL probe, char *probe_cache)
 {
-  if(!server && !domain)
+  size_t i;
+
+  if(!server_count && !domain_count)
   {
     printf("\n");
     printf("** WARNING!\n");
@@ -274,10 +413,13 @@ driver_dns_t *create_dns_driver_internal(select_group_t *group, char *domain, ch
     printf("\n");
   }
 
-  if(!server)
-    server = system_dns;
+  if(!server_count)
+  {
+    servers      = system_dns;
+    server_count = system_dns_count;
+  }
 
-  if(!server)
+  if(!server_count)
   {
     LOG_FATAL("Couldn't determine the system DNS server! Please manually set");
     LOG_FATAL("the dns server with --dns server=8.8.8.8");
@@ -287,22 +429,48 @@ driver_dns_t *create_dns_driver_internal(select_group_t *group, char *domain, ch
   }
 
   printf("Creating DNS driver:\n");
-  printf(" domain = %s\n", domain);
+  if(!domain_count)
+    printf(" domain = (none)\n");
+  for(i = 0; i < domain_count; i++)
+    printf(" domain = %s\n", domains[i]);
   printf(" host   = %s\n", host);
   printf(" port   = %u\n", port);
   printf(" type   = %s\n", type);
-  printf(" server = %s\n", server);
+  for(i = 0; i < server_count; i++)
+    printf(" server = %s\n", servers[i]);
+  printf(" pipeline = %zu\n", pipeline);
+  printf(" encoding = %s\n", encoding);
+  printf(" edns   = %u\n", edns_size);
+  printf(" tcp    = %s\n", tcp_mode);
+  if(secure)
+  {
+    printf(" secure = %s\n", secure);
+    printf(" verify = %s\n", verify ? "yes" : "no");
+  }
+  if(probe)
+    printf(" probe  = %s\n", probe_cache ? probe_cache : "yes");
 
-  return driver_dns_create(group, domain, host, port, type, server);
+  return driver_dns_create(group, domains, domain_count, host, port, type, servers, server_count, pipeline, encoding, edns_size, tcp_mode, secure, doh_path, verify, probe, probe_cache);
 }
 
 driver_dns_t *create_dns_driver(select_group_t *group, char *options)
 {
-  char     *domain = NULL;
+  char     *domains[DNS_MAX_DOMAINS];
+  size_t    domain_count = 0;
   char     *host = "0.0.0.0";
-  uint16_t  port = 53;
+  uint16_t  port = 0;
   char     *type = DEFAULT_TYPES;
-  char     *server = system_dns;
+  char     *servers[DNS_MAX_SERVERS];
+  size_t    server_count = 0;
+  size_t    pipeline = DNS_DEFAULT_PIPELINE;
+  char     *encoding = DEFAULT_ENCODING;
+  uint16_t  edns_size = DNS_DEFAULT_EDNS_SIZE;
+  char     *tcp_mode = DEFAULT_TCP_MODE;
+  char     *secure = NULL;
+  char     *doh_path = DEFAULT_DOH_PATH;
+  NBBOOL    verify = TRUE;
+  NBBOOL    probe = FALSE;
+  char     *probe_cache = NULL;
 
   char *token = NULL;
 
@@ -317,7 +485,14 @@ driver_dns_t *create_dns_driver(select_group_t *group, char *options)
       value++;
 
       if(!strcmp(name, "domain"))
-        domain = value;
+      {
+        if(domain_count == DNS_MAX_DOMAINS)
+        {
+          LOG_FATAL("Too many domains (the most is %d)\n", DNS_MAX_DOMAINS);
+          exit(1);
+        }
+        domains[domain_count++] = value;
+      }
       else if(!strcmp(name, "host"))
         host = value;
       else if(!strcmp(name, "port"))
@@ -325,7 +500,32 @@ driver_dns_t *create_dns_driver(select_group_t *group, char *options)
       else if(!strcmp(name, "type"))
         type = value;
       else if(!strcmp(name, "server"))
-        server = value;
+      {
+        if(server_count == DNS_MAX_SERVERS)
+        {
+          LOG_FATAL("Too many DNS servers (the most is %d)\n", DNS_MAX_SERVERS);
+          exit(1);
+        }
+        servers[server_count++] = value;
+      }
+      else if(!strcmp(name, "pipeline"))
+        pipeline = atoi(value);
+      else if(!strcmp(name, "encoding"))
+        encoding = value;
+      else if(!strcmp(name, "edns"))
+        edns_size = atoi(value);
+      else if(!strcmp(name, "tcp"))
+        tcp_mode = value;
+      else if(!strcmp(name, "secure"))
+        secure = value;
+      else if(!strcmp(name, "path"))
+        doh_path = value;
+      else if(!strcmp(name, "verify"))
+        verify = atoi(value) ? TRUE : FALSE;
+      else if(!strcmp(name, "probe"))
+        probe = atoi(value) ? TRUE : FALSE;
+      else if(!strcmp(name, "probe_cache"))
+        probe_cache = value;
       else
       {
         LOG_FATAL("Unknown --dns option: %s\n", name);
@@ -339,17 +539,65 @@ driver_dns_t *create_dns_driver(select_group_t *group, char *options)
     }
   }
 
-  return create_dns_driver_internal(group, domain, host, port, type, server);
+  /* DoT and DoH have their own ports. */
+  if(!port)
+    port = !secure ? 53 : !strcmp(secure, "doh") ? DNS_DOH_PORT : DNS_DOT_PORT;
+
+  return create_dns_driver_internal(group, domains, domain_count, host, port, type, servers, server_count, pipeline, encoding, edns_size, tcp_mode, secure, doh_path, verify, probe, probe_cache);
 }
 
-void create_tcp_driver(char *options)
+#ifndef NO_TUNNEL_TCP
+driver_tcp_t *create_tcp_driver(select_group_t *group, char *options)
 {
-  char *host = "0.0.0.0";
-  uint16_t port = 1234;
+  char     *host     = NULL;
+  uint16_t  port     = TCP_DEFAULT_PORT;
+  size_t    pipeline = TCP_DEFAULT_PIPELINE;
+
+  char *token = NULL;
+
+  for(token = strtok(options, ":,"); token && *token; token = strtok(NULL, ":,"))
+  {
+    char *name  = token;
+    char *value = strchr(token, '=');
+
+    if(value)
+    {
+      *value = '\0';
+      value++;
+
+      if(!strcmp(name, "host"))
+        host = value;
+      else if(!strcmp(name, "port"))
+        port = atoi(value);
+      else if(!strcmp(name, "pipeline"))
+        pipeline = atoi(value);
+      else
+      {
+        LOG_FATAL("Unknown --tcp option: %s\n", name);
+        exit(1);
+      }
+    }
+    else
+    {
+      LOG_FATAL("ERROR parsing --tcp: it has to be colon-separated name=value pairs!\n");
+      exit(1);
+    }
+  }
+
+  if(!host)
+  {
+    LOG_FATAL("--tcp needs a host to connect to (--tcp host=<host>)\n");
+    exit(1);
+  }
 
+  printf("Creating TCP driver:\n");
   printf(" host   = %s\n", host);
   printf(" port   = %u\n", port);
+  printf(" pipeline = %zu\n", pipeline);
+
+  return driver_tcp_create(group, host, port, pipeline);
 }
+#endif
 
 int main(int argc, char *argv[])
 {
@@ -371,30 +619,46 @@ int main(int argc, char *argv[])
 
     {"delay",              required_argument, 0, 0}, /* Retransmit delay */
     {"steady",             no_argument,       0, 0}, /* Don't transmit immediately after getting a response. */
+    {"window",             required_argument, 0, 0}, /* Sliding window size */
+    {"fec",                required_argument, 0, 0}, /* MSGs per parity packet */
+    {"no-compression",     no_argument,       0, 0}, /* Disable compression */
+    {"long-poll",          required_argument, 0, 0}, /* How long the server can hold polls */
+    {"coalesce",           required_argument, 0, 0}, /* How long tunnels hold small writes */
     {"max-retransmits",    required_argument, 0, 0}, /* Set the max retransmissions */
     {"retransmit-forever", no_argument,       0, 0}, /* Retransmit forever if needed */
 #ifndef NO_ENCRYPTION
     {"secret",             required_argument, 0, 0}, /* Pre-shared secret */
     {"no-encryption",      no_argument,       0, 0}, /* Disable encryption */
+    {"fast-handshake",     no_argument,       0, 0}, /* Send the SYN with the key */
 #endif
 
     /* i/o options. */
+#ifndef NO_DRIVER_CONSOLE
     {"console", no_argument,       0, 0}, /* Enable console */
+#endif
+#ifndef NO_DRIVER_EXEC
     {"exec",    required_argument, 0, 0}, /* Enable execute */
     {"e",       required_argument, 0, 0},
+#endif
+#ifndef NO_DRIVER_COMMAND
     {"command", no_argument,       0, 0}, /* Enable command (default) */
+#endif
+#ifndef NO_DRIVER_PING
     {"ping",    no_argument,       0, 0}, /* Ping */
+#endif
+    {"priority", required_argument, 0, 0}, /* Priority of the previous session */
 
     /* Tunnel drivers */
     {"dns",     required_argument, 0, 0}, /* Enable DNS */
-#if 0
-    {"tcp",     optional_argument, 0, 0}, /* Enable TCP */
+#ifndef NO_TUNNEL_TCP
+    {"tcp",     required_argument, 0, 0}, /* Enable TCP */
 #endif
 
     /* Debug options */
     {"d",            no_argument, 0, 0}, /* More debug */
     {"q",            no_argument, 0, 0}, /* Less debug */
     {"packet-trace", no_argument, 0, 0}, /* Trace packets */
+    {"trace-file",   required_argument, 0, 0}, /* Trace packets to a file */
 
     /* Sentry */
     {0,              0,                 0, 0}  /* End */
@@ -407,11 +671,25 @@ int main(int argc, char *argv[])
   NBBOOL            tunnel_driver_created = FALSE;
   ll_t             *drivers_to_create     = ll_create(NULL);
   uint32_t          drivers_created       = 0;
+  make_driver_t    *last_driver           = NULL;
+
+  /* Set if --delay was given, so the probe doesn't override it. */
+  NBBOOL            delay_set             = FALSE;
+  int               probe_delay;
 
   log_level_t       min_log_level = LOG_LEVEL_WARNING;
 
   group = select_group_create();
-  system_dns = dns_get_system();
+  worker = worker_create(group);
+  session_set_worker(worker);
+#ifndef NO_DRIVER_COMMAND
+  /* A separate one, so a big download doesn't hold up key exchanges. */
+  io_worker = worker_create(group);
+  driver_command_set_worker(io_worker);
+  resolver = resolver_create(group);
+  driver_command_set_resolver(resolver);
+#endif
+  system_dns_count = dns_get_system(system_dns, DNS_MAX_SERVERS);
 
   /* Seed with the current time; not great, but it'll suit our purposes. */
   srand((unsigned int)time(NULL));
@@ -426,6 +704,9 @@ int main(int argc, char *argv[])
     perror("Couldn't set SIGCHLD handler to SIG_IGN");
     exit(1);
   }  
+
+  /* A server that hangs up on the TCP driver should be an error, not death. */
+  signal(SIGPIPE, SIG_IGN);
 #endif
 
   /* Set the default log level */
@@ -459,12 +740,33 @@ int main(int argc, char *argv[])
         {
           int delay = (int) atoi(optarg);
           session_set_delay(delay);
+          delay_set = TRUE;
           LOG_INFO("Setting delay between packets to %dms", delay);
         }
         else if(!strcmp(option_name, "steady"))
         {
           session_set_transmit_immediately(FALSE);
         }
+        else if(!strcmp(option_name, "window"))
+        {
+          session_set_window_size(atoi(optarg));
+        }
+        else if(!strcmp(option_name, "fec"))
+        {
+          session_set_fec(atoi(optarg));
+        }
+        else if(!strcmp(option_name, "no-compression"))
+        {
+          session_set_compression(FALSE);
+        }
+        else if(!strcmp(option_name, "long-poll"))
+        {
+          session_set_long_poll(atoi(optarg));
+        }
+        else if(!strcmp(option_name, "coalesce"))
+        {
+          driver_command_set_coalesce_delay(atoi(optarg));
+        }
         else if(!strcmp(option_name, "max-retransmits"))
         {
           controller_set_max_retransmits(atoi(optarg));
@@ -482,37 +784,60 @@ int main(int argc, char *argv[])
         {
           session_set_encryption(FALSE);
         }
+        else if(!strcmp(option_name, "fast-handshake"))
+        {
+          session_set_fast_handshake(TRUE);
+        }
 #endif
 
         /* i/o drivers */
+#ifndef NO_DRIVER_CONSOLE
         else if(!strcmp(option_name, "console"))
         {
-          ll_add(drivers_to_create, ll_32(drivers_created++), make_console());
+          last_driver = make_console();
+          ll_add(drivers_to_create, ll_32(drivers_created++), last_driver);
 
 /*          session = session_create_console(group, "console");
           controller_add_session(session); */
         }
+#endif
+#ifndef NO_DRIVER_EXEC
         else if(!strcmp(option_name, "exec") || !strcmp(option_name, "e"))
         {
-          ll_add(drivers_to_create, ll_32(drivers_created++), make_exec(optarg));
+          last_driver = make_exec(optarg);
+          ll_add(drivers_to_create, ll_32(drivers_created++), last_driver);
 
 /*          session = session_create_exec(group, optarg, optarg);
           controller_add_session(session); */
         }
+#endif
+#ifndef NO_DRIVER_COMMAND
         else if(!strcmp(option_name, "command"))
         {
-          ll_add(drivers_to_create, ll_32(drivers_created++), make_command());
+          last_driver = make_command();
+          ll_add(drivers_to_create, ll_32(drivers_created++), last_driver);
 
 /*          session = session_create_command(group, "command");
           controller_add_session(session); */
         }
+#endif
+#ifndef NO_DRIVER_PING
         else if(!strcmp(option_name, "ping"))
         {
-          ll_add(drivers_to_create, ll_32(drivers_created++), make_ping());
+          last_driver = make_ping();
+          ll_add(drivers_to_create, ll_32(drivers_created++), last_driver);
 
 /*          session = session_create_ping(group, "ping");
           controller_add_session(session); */
         }
+#endif
+        else if(!strcmp(option_name, "priority"))
+        {
+          if(!last_driver)
+            usage(argv[0], "--priority has to come after the session it's for (--console, --exec, etc.)");
+
+          last_driver->priority = atoi(optarg);
+        }
 
         /* Tunnel driver options */
         else if(!strcmp(option_name, "dns"))
@@ -520,11 +845,15 @@ int main(int argc, char *argv[])
           tunnel_driver_created = TRUE;
           tunnel_driver = create_dns_driver(group, optarg);
         }
+#ifndef NO_TUNNEL_TCP
         else if(!strcmp(option_name, "tcp"))
         {
-          tunnel_driver_created = TRUE;
-          create_tcp_driver(optarg);
+          if(tcp_driver)
+            usage(argv[0], "--tcp can only be used once");
+
+          tcp_driver = create_tcp_driver(group, optarg);
         }
+#endif
 
         /* Debug options */
         else if(!strcmp(option_name, "d"))
@@ -544,6 +873,11 @@ int main(int argc, char *argv[])
         {
           session_enable_packet_trace();
         }
+        else if(!strcmp(option_name, "trace-file"))
+        {
+          if(!trace_to_file(optarg))
+            exit(1);
+        }
         else
         {
           usage(argv[0], "Unknown option");
@@ -568,9 +902,14 @@ int main(int argc, char *argv[])
     exit(1);
   }
 
-  /* If no output was set, use the domain, and use the last option as the
-   * domain. */
+  /* If no output was set, use the domain, and use the rest of the options
+   * as the domains (with --tcp, only if there are some, since the DNS driver
+   * is just there to fall back on). */
+#ifndef NO_TUNNEL_TCP
+  if(!tunnel_driver_created && (!tcp_driver || optind < argc))
+#else
   if(!tunnel_driver_created)
+#endif
   {
     /* Make sure they gave a domain. */
     if(optind >= argc)
@@ -579,17 +918,48 @@ int main(int argc, char *argv[])
       printf("are directly connecting to the dnscat2 server.\n");
       printf("\n");
       printf("You'll need to use --dns server=<server> if you aren't.\n");
-      tunnel_driver = create_dns_driver_internal(group, NULL, "0.0.0.0", 53, DEFAULT_TYPES, NULL);
+      tunnel_driver = create_dns_driver_internal(group, NULL, 0, "0.0.0.0", 53, DEFAULT_TYPES, NULL, 0, DNS_DEFAULT_PIPELINE, DEFAULT_ENCODING, DNS_DEFAULT_EDNS_SIZE, DEFAULT_TCP_MODE, NULL, DEFAULT_DOH_PATH, TRUE, FALSE, NULL);
     }
     else
     {
-      tunnel_driver = create_dns_driver_internal(group, argv[optind], "0.0.0.0", 53, DEFAULT_TYPES, NULL);
+      if(argc - optind > DNS_MAX_DOMAINS)
+      {
+        LOG_FATAL("Too many domains (the most is %d)\n", DNS_MAX_DOMAINS);
+        exit(1);
+      }
+      tunnel_driver = create_dns_driver_internal(group, argv + optind, argc - optind, "0.0.0.0", 53, DEFAULT_TYPES, NULL, 0, DNS_DEFAULT_PIPELINE, DEFAULT_ENCODING, DNS_DEFAULT_EDNS_SIZE, DEFAULT_TCP_MODE, NULL, DEFAULT_DOH_PATH, TRUE, FALSE, NULL);
     }
   }
 
   /* Be sure we clean up at exit. */
   atexit(cleanup);
 
+#ifndef NO_TUNNEL_TCP
+  /* Use TCP for as long as it works, then DNS (if there is one); the
+   * sessions carry on either way. */
+  if(tcp_driver)
+  {
+    controller_set_tunnel_stats(driver_tcp_get_stats, tcp_driver);
+    driver_tcp_go(tcp_driver);
+
+    if(!tunnel_driver)
+    {
+      LOG_FATAL("The TCP connection failed, and there's no DNS driver to fall back to!");
+      exit(1);
+    }
+    LOG_WARNING("The TCP connection failed, falling back to DNS");
+  }
+#endif
+
+  /* Let the stats command see how the tunnel is doing. */
+  controller_set_tunnel_stats(driver_dns_get_stats, tunnel_driver);
+
+  /* See what gets through, if we were asked to; the delay it suggests is
+   * only used if --delay wasn't given. */
+  probe_delay = driver_dns_probe(tunnel_driver);
+  if(probe_delay > 0 && !delay_set)
+    session_set_delay(probe_delay);
+
   /* Start the driver! */
   driver_dns_go(tunnel_driver);
 
@@ -20,12 +20,28 @@
 
 #include "command_packet.h"
 
+/* Read the rest of the buffer, either as a copy or (for a view) where it
+ * is. */
+static uint8_t *read_remaining(buffer_t *buffer, size_t *length, NBBOOL is_view)
+{
+  if(is_view)
+    return buffer_read_remaining_bytes_view(buffer, length, -1, TRUE);
+
+  return buffer_read_remaining_bytes(buffer, length, -1, TRUE);
+}
+
 /* Parse a packet from a byte stream. */
-static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
+static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length, NBBOOL is_view)
 {
   command_packet_t *p         = safe_malloc(sizeof(command_packet_t));
-  buffer_t         *buffer    = buffer_create_with_data(BO_BIG_ENDIAN, data, length);
-  uint16_t          packed_id = buffer_read_next_int16(buffer);
+  buffer_t          view;
+  buffer_t         *buffer    = &view;
+  uint16_t          packed_id;
+  size_t            data_length;
+
+  buffer_init_view(buffer, BO_BIG_ENDIAN, data, length);
+  packed_id = buffer_read_next_int16(buffer);
+  p->is_view = is_view;
 
   /* The first bit of the request_id represents a response */
   p->request_id = (packed_id & 0x7FFF);
@@ -68,7 +84,8 @@ static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
       }
       else
       {
-        p->r.response.body.download.data = (uint8_t*)buffer_read_remaining_bytes(buffer, (size_t*)&p->r.response.body.download.length, -1, TRUE);
+        p->r.response.body.download.data   = read_remaining(buffer, &data_length, is_view);
+        p->r.response.body.download.length = (uint32_t)data_length;
       }
 
       break;
@@ -77,7 +94,8 @@ static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
       if(p->is_request)
       {
         p->r.request.body.upload.filename = buffer_alloc_next_ntstring(buffer);
-        p->r.request.body.upload.data = buffer_read_remaining_bytes(buffer, (size_t*)&p->r.request.body.upload.length, -1, TRUE);
+        p->r.request.body.upload.data     = read_remaining(buffer, &data_length, is_view);
+        p->r.request.body.upload.length   = (uint32_t)data_length;
       }
       else
       {
@@ -94,6 +112,104 @@ static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
       }
       break;
 
+    case COMMAND_DOWNLOAD_CHUNK:
+      if(p->is_request)
+      {
+        p->r.request.body.download_chunk.filename = buffer_alloc_next_ntstring(buffer);
+        p->r.request.body.download_chunk.offset   = buffer_read_next_int32(buffer);
+        p->r.request.body.download_chunk.length   = buffer_read_next_int32(buffer);
+      }
+      else
+      {
+        p->r.response.body.download_chunk.offset = buffer_read_next_int32(buffer);
+        p->r.response.body.download_chunk.size   = buffer_read_next_int32(buffer);
+        p->r.response.body.download_chunk.data   = read_remaining(buffer, &data_length, is_view);
+        p->r.response.body.download_chunk.length = (uint32_t)data_length;
+      }
+      break;
+
+    case COMMAND_UPLOAD_CHUNK:
+      if(p->is_request)
+      {
+        p->r.request.body.upload_chunk.filename = buffer_alloc_next_ntstring(buffer);
+        p->r.request.body.upload_chunk.offset   = buffer_read_next_int32(buffer);
+        p->r.request.body.upload_chunk.data     = read_remaining(buffer, &data_length, is_view);
+        p->r.request.body.upload_chunk.length   = (uint32_t)data_length;
+      }
+      else
+      {
+        p->r.response.body.upload_chunk.size = buffer_read_next_int32(buffer);
+      }
+      break;
+
+    case COMMAND_STATS:
+      if(!p->is_request)
+      {
+        uint32_t count = buffer_read_next_int32(buffer);
+        uint32_t i;
+
+        for(i = 0; i < count; i++)
+        {
+          char     *name  = buffer_alloc_next_ntstring(buffer);
+          uint32_t  value = buffer_read_next_int32(buffer);
+
+          command_packet_add_stat(p, name, value);
+          safe_free(name);
+        }
+      }
+      break;
+
+    case COMMAND_FILE_SIGNATURE:
+      if(p->is_request)
+      {
+        p->r.request.body.file_signature.filename    = buffer_alloc_next_ntstring(buffer);
+        p->r.request.body.file_signature.block_size  = buffer_read_next_int32(buffer);
+        p->r.request.body.file_signature.first_block = buffer_read_next_int32(buffer);
+        p->r.request.body.file_signature.count       = buffer_read_next_int32(buffer);
+      }
+      else
+      {
+        p->r.response.body.file_signature.size        = buffer_read_next_int32(buffer);
+        p->r.response.body.file_signature.first_block = buffer_read_next_int32(buffer);
+        p->r.response.body.file_signature.data        = read_remaining(buffer, &data_length, is_view);
+        p->r.response.body.file_signature.length      = (uint32_t)data_length;
+      }
+      break;
+
+    case COMMAND_UPLOAD_DELTA:
+      if(p->is_request)
+      {
+        p->r.request.body.upload_delta.filename   = buffer_alloc_next_ntstring(buffer);
+        p->r.request.body.upload_delta.block_size = buffer_read_next_int32(buffer);
+        p->r.request.body.upload_delta.offset     = buffer_read_next_int32(buffer);
+        p->r.request.body.upload_delta.size       = buffer_read_next_int32(buffer);
+        p->r.request.body.upload_delta.data       = read_remaining(buffer, &data_length, is_view);
+        p->r.request.body.upload_delta.length     = (uint32_t)data_length;
+      }
+      else
+      {
+        p->r.response.body.upload_delta.size = buffer_read_next_int32(buffer);
+      }
+      break;
+
+    case COMMAND_DOWNLOAD_DELTA:
+      if(p->is_request)
+      {
+        p->r.request.body.download_delta.filename   = buffer_alloc_next_ntstring(buffer);
+        p->r.request.body.download_delta.block_size = buffer_read_next_int32(buffer);
+        p->r.request.body.download_delta.offset     = buffer_read_next_int32(buffer);
+        p->r.request.body.download_delta.data       = read_remaining(buffer, &data_length, is_view);
+        p->r.request.body.download_delta.length     = (uint32_t)data_length;
+      }
+      else
+      {
+        p->r.response.body.download_delta.offset = buffer_read_next_int32(buffer);
+        p->r.response.body.download_delta.size   = buffer_read_next_int32(buffer);
+        p->r.response.body.download_delta.data   = read_remaining(buffer, &data_length, is_view);
+        p->r.response.body.download_delta.length = (uint32_t)data_length;
+      }
+      break;
+
     case TUNNEL_CONNECT:
       if(p->is_request)
       {
@@ -111,7 +227,7 @@ static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
       if(p->is_request)
       {
         p->r.request.body.tunnel_data.tunnel_id = buffer_read_next_int32(buffer);
-        p->r.request.body.tunnel_data.data = buffer_read_remaining_bytes(buffer, (size_t*)&p->r.request.body.tunnel_data.length, -1, TRUE);
+        p->r.request.body.tunnel_data.data = read_remaining(buffer, &p->r.request.body.tunnel_data.length, is_view);
       }
       else
       {
@@ -152,12 +268,11 @@ static command_packet_t *command_packet_parse(uint8_t *data, uint32_t length)
   return p;
 }
 
-command_packet_t *command_packet_read(buffer_t *stream)
+static command_packet_t *read_packet(buffer_t *stream, NBBOOL is_view)
 {
   size_t            remaining_bytes = buffer_get_remaining_bytes(stream);
   uint32_t          needed_bytes    = -1;
   uint8_t          *data;
-  command_packet_t *out = NULL;
   size_t            length;
 
   /* If we don't have a length, we're done. */
@@ -179,8 +294,8 @@ command_packet_t *command_packet_read(buffer_t *stream)
   /* Consume the length. */
   buffer_read_next_int32(stream);
 
-  /* Read the data. */
-  data = buffer_read_remaining_bytes(stream, &length, needed_bytes, TRUE);
+  /* Find the data (where it is; the parser copies whatever it keeps). */
+  data = buffer_read_remaining_bytes_view(stream, &length, needed_bytes, TRUE);
 
   /* Sanity check. */
   if(length != needed_bytes)
@@ -189,11 +304,17 @@ command_packet_t *command_packet_read(buffer_t *stream)
     exit(1);
   }
 
-  /* Parse the data and free the buffer. */
-  out = command_packet_parse(data, length);
-  safe_free(data);
+  return command_packet_parse(data, length, is_view);
+}
 
-  return out;
+command_packet_t *command_packet_read(buffer_t *stream)
+{
+  return read_packet(stream, FALSE);
+}
+
+command_packet_t *command_packet_read_view(buffer_t *stream)
+{
+  return read_packet(stream, TRUE);
 }
 
 static command_packet_t *command_packet_create(uint16_t request_id, command_packet_type_t command_id, NBBOOL is_request)
@@ -203,6 +324,7 @@ static command_packet_t *command_packet_create(uint16_t request_id, command_pack
   p->request_id = request_id;
   p->command_id = command_id;
   p->is_request = is_request;
+  p->is_view    = FALSE;
 
   return p;
 }
@@ -314,6 +436,154 @@ command_packet_t *command_packet_create_delay_response(uint16_t request_id)
   return packet;
 }
 
+command_packet_t *command_packet_create_download_chunk_request(uint16_t request_id, char *filename, uint32_t offset, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_DOWNLOAD_CHUNK, TRUE);
+
+  packet->r.request.body.download_chunk.filename = safe_strdup(filename);
+  packet->r.request.body.download_chunk.offset   = offset;
+  packet->r.request.body.download_chunk.length   = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_download_chunk_response(uint16_t request_id, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_DOWNLOAD_CHUNK, FALSE);
+
+  packet->r.response.body.download_chunk.offset = offset;
+  packet->r.response.body.download_chunk.size   = size;
+  packet->r.response.body.download_chunk.data   = safe_malloc(length);
+  memcpy(packet->r.response.body.download_chunk.data, data, length);
+  packet->r.response.body.download_chunk.length = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_upload_chunk_request(uint16_t request_id, char *filename, uint32_t offset, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_UPLOAD_CHUNK, TRUE);
+
+  packet->r.request.body.upload_chunk.filename = safe_strdup(filename);
+  packet->r.request.body.upload_chunk.offset   = offset;
+  packet->r.request.body.upload_chunk.data     = safe_malloc(length);
+  memcpy(packet->r.request.body.upload_chunk.data, data, length);
+  packet->r.request.body.upload_chunk.length   = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_upload_chunk_response(uint16_t request_id, uint32_t size)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_UPLOAD_CHUNK, FALSE);
+
+  packet->r.response.body.upload_chunk.size = size;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_file_signature_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t first_block, uint32_t count)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_FILE_SIGNATURE, TRUE);
+
+  packet->r.request.body.file_signature.filename    = safe_strdup(filename);
+  packet->r.request.body.file_signature.block_size  = block_size;
+  packet->r.request.body.file_signature.first_block = first_block;
+  packet->r.request.body.file_signature.count       = count;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_file_signature_response(uint16_t request_id, uint32_t size, uint32_t first_block, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_FILE_SIGNATURE, FALSE);
+
+  packet->r.response.body.file_signature.size        = size;
+  packet->r.response.body.file_signature.first_block = first_block;
+  packet->r.response.body.file_signature.data        = safe_malloc(length);
+  memcpy(packet->r.response.body.file_signature.data, data, length);
+  packet->r.response.body.file_signature.length      = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_upload_delta_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_UPLOAD_DELTA, TRUE);
+
+  packet->r.request.body.upload_delta.filename   = safe_strdup(filename);
+  packet->r.request.body.upload_delta.block_size = block_size;
+  packet->r.request.body.upload_delta.offset     = offset;
+  packet->r.request.body.upload_delta.size       = size;
+  packet->r.request.body.upload_delta.data       = safe_malloc(length);
+  memcpy(packet->r.request.body.upload_delta.data, data, length);
+  packet->r.request.body.upload_delta.length     = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_upload_delta_response(uint16_t request_id, uint32_t size)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_UPLOAD_DELTA, FALSE);
+
+  packet->r.response.body.upload_delta.size = size;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_download_delta_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t offset, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_DOWNLOAD_DELTA, TRUE);
+
+  packet->r.request.body.download_delta.filename   = safe_strdup(filename);
+  packet->r.request.body.download_delta.block_size = block_size;
+  packet->r.request.body.download_delta.offset     = offset;
+  packet->r.request.body.download_delta.data       = safe_malloc(length);
+  memcpy(packet->r.request.body.download_delta.data, data, length);
+  packet->r.request.body.download_delta.length     = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_download_delta_response(uint16_t request_id, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_DOWNLOAD_DELTA, FALSE);
+
+  packet->r.response.body.download_delta.offset = offset;
+  packet->r.response.body.download_delta.size   = size;
+  packet->r.response.body.download_delta.data   = safe_malloc(length);
+  memcpy(packet->r.response.body.download_delta.data, data, length);
+  packet->r.response.body.download_delta.length = length;
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_stats_request(uint16_t request_id)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_STATS, TRUE);
+
+  return packet;
+}
+
+command_packet_t *command_packet_create_stats_response(uint16_t request_id)
+{
+  command_packet_t *packet = command_packet_create(request_id, COMMAND_STATS, FALSE);
+
+  return packet;
+}
+
+void command_packet_add_stat(command_packet_t *packet, char *name, uint32_t value)
+{
+  uint32_t count = packet->r.response.body.stats.count;
+
+  packet->r.response.body.stats.names  = safe_realloc(packet->r.response.body.stats.names, (count + 1) * sizeof(char*));
+  packet->r.response.body.stats.values = safe_realloc(packet->r.response.body.stats.values, (count + 1) * sizeof(uint32_t));
+
+  packet->r.response.body.stats.names[count]  = safe_strdup(name);
+  packet->r.response.body.stats.values[count] = value;
+  packet->r.response.body.stats.count         = count + 1;
+}
+
 command_packet_t *command_packet_create_tunnel_connect_request(uint16_t request_id, uint32_t options, char *host, uint16_t port)
 {
   command_packet_t *packet = command_packet_create(request_id, TUNNEL_CONNECT, TRUE);
@@ -420,7 +690,7 @@ void command_packet_destroy(command_packet_t *packet)
       }
       else
       {
-        if(packet->r.response.body.download.data)
+        if(packet->r.response.body.download.data && !packet->is_view)
           safe_free(packet->r.response.body.download.data);
       }
       break;
@@ -430,7 +700,7 @@ void command_packet_destroy(command_packet_t *packet)
       {
         if(packet->r.request.body.upload.filename)
           safe_free(packet->r.request.body.upload.filename);
-        if(packet->r.request.body.upload.data)
+        if(packet->r.request.body.upload.data && !packet->is_view)
           safe_free(packet->r.request.body.upload.data);
       }
       else
@@ -450,6 +720,81 @@ void command_packet_destroy(command_packet_t *packet)
     case COMMAND_DELAY:
       break;
 
+    case COMMAND_DOWNLOAD_CHUNK:
+      if(packet->is_request)
+      {
+        if(packet->r.request.body.download_chunk.filename)
+          safe_free(packet->r.request.body.download_chunk.filename);
+      }
+      else
+      {
+        if(packet->r.response.body.download_chunk.data && !packet->is_view)
+          safe_free(packet->r.response.body.download_chunk.data);
+      }
+      break;
+
+    case COMMAND_UPLOAD_CHUNK:
+      if(packet->is_request)
+      {
+        if(packet->r.request.body.upload_chunk.filename)
+          safe_free(packet->r.request.body.upload_chunk.filename);
+        if(packet->r.request.body.upload_chunk.data && !packet->is_view)
+          safe_free(packet->r.request.body.upload_chunk.data);
+      }
+      break;
+
+    case COMMAND_STATS:
+      if(!packet->is_request)
+      {
+        uint32_t i;
+
+        for(i = 0; i < packet->r.response.body.stats.count; i++)
+          safe_free(packet->r.response.body.stats.names[i]);
+        if(packet->r.response.body.stats.names)
+          safe_free(packet->r.response.body.stats.names);
+        if(packet->r.response.body.stats.values)
+          safe_free(packet->r.response.body.stats.values);
+      }
+      break;
+
+    case COMMAND_FILE_SIGNATURE:
+      if(packet->is_request)
+      {
+        if(packet->r.request.body.file_signature.filename)
+          safe_free(packet->r.request.body.file_signature.filename);
+      }
+      else
+      {
+        if(packet->r.response.body.file_signature.data && !packet->is_view)
+          safe_free(packet->r.response.body.file_signature.data);
+      }
+      break;
+
+    case COMMAND_UPLOAD_DELTA:
+      if(packet->is_request)
+      {
+        if(packet->r.request.body.upload_delta.filename)
+          safe_free(packet->r.request.body.upload_delta.filename);
+        if(packet->r.request.body.upload_delta.data && !packet->is_view)
+          safe_free(packet->r.request.body.upload_delta.data);
+      }
+      break;
+
+    case COMMAND_DOWNLOAD_DELTA:
+      if(packet->is_request)
+      {
+        if(packet->r.request.body.download_delta.filename)
+          safe_free(packet->r.request.body.download_delta.filename);
+        if(packet->r.request.body.download_delta.data && !packet->is_view)
+          safe_free(packet->r.request.body.download_delta.data);
+      }
+      else
+      {
+        if(packet->r.response.body.download_delta.data && !packet->is_view)
+          safe_free(packet->r.response.body.download_delta.data);
+      }
+      break;
+
     case TUNNEL_CONNECT:
       if(packet->is_request)
       {
@@ -464,7 +809,7 @@ void command_packet_destroy(command_packet_t *packet)
     case TUNNEL_DATA:
       if(packet->is_request)
       {
-        if(packet->r.request.body.tunnel_data.data)
+        if(packet->r.request.body.tunnel_data.data && !packet->is_view)
           safe_free(packet->r.request.body.tunnel_data.data);
       }
       else
@@ -554,6 +899,48 @@ void command_packet_print(command_packet_t *packet)
         printf("COMMAND_DELAY [response] :: request_id 0x%04x\n", packet->request_id);
       break;
 
+    case COMMAND_DOWNLOAD_CHUNK:
+      if(packet->is_request)
+        printf("COMMAND_DOWNLOAD_CHUNK [request] :: request_id: 0x%04x :: filename: %s :: offset: 0x%x :: length: 0x%x\n", packet->request_id, packet->r.request.body.download_chunk.filename, packet->r.request.body.download_chunk.offset, packet->r.request.body.download_chunk.length);
+      else
+        printf("COMMAND_DOWNLOAD_CHUNK [response] :: request_id: 0x%04x :: offset: 0x%x :: size: 0x%x :: data: 0x%x bytes\n", packet->request_id, packet->r.response.body.download_chunk.offset, packet->r.response.body.download_chunk.size, packet->r.response.body.download_chunk.length);
+      break;
+
+    case COMMAND_UPLOAD_CHUNK:
+      if(packet->is_request)
+        printf("COMMAND_UPLOAD_CHUNK [request] :: request_id: 0x%04x :: filename: %s :: offset: 0x%x :: data: 0x%x bytes\n", packet->request_id, packet->r.request.body.upload_chunk.filename, packet->r.request.body.upload_chunk.offset, packet->r.request.body.upload_chunk.length);
+      else
+        printf("COMMAND_UPLOAD_CHUNK [response] :: request_id: 0x%04x :: size: 0x%x\n", packet->request_id, packet->r.response.body.upload_chunk.size);
+      break;
+
+    case COMMAND_STATS:
+      if(packet->is_request)
+        printf("COMMAND_STATS [request] :: request_id: 0x%04x\n", packet->request_id);
+      else
+        printf("COMMAND_STATS [response] :: request_id: 0x%04x :: count: %d\n", packet->request_id, packet->r.response.body.stats.count);
+      break;
+
+    case COMMAND_FILE_SIGNATURE:
+      if(packet->is_request)
+        printf("COMMAND_FILE_SIGNATURE [request] :: request_id: 0x%04x :: filename: %s :: block_size: 0x%x :: first_block: 0x%x :: count: 0x%x\n", packet->request_id, packet->r.request.body.file_signature.filename, packet->r.request.body.file_signature.block_size, packet->r.request.body.file_signature.first_block, packet->r.request.body.file_signature.count);
+      else
+        printf("COMMAND_FILE_SIGNATURE [response] :: request_id: 0x%04x :: size: 0x%x :: first_block: 0x%x :: signatures: 0x%x bytes\n", packet->request_id, packet->r.response.body.file_signature.size, packet->r.response.body.file_signature.first_block, packet->r.response.body.file_signature.length);
+      break;
+
+    case COMMAND_UPLOAD_DELTA:
+      if(packet->is_request)
+        printf("COMMAND_UPLOAD_DELTA [request] :: request_id: 0x%04x :: filename: %s :: block_size: 0x%x :: offset: 0x%x :: size: 0x%x :: ops: 0x%x bytes\n", packet->request_id, packet->r.request.body.upload_delta.filename, packet->r.request.body.upload_delta.block_size, packet->r.request.body.upload_delta.offset, packet->r.request.body.upload_delta.size, packet->r.request.body.upload_delta.length);
+      else
+        printf("COMMAND_UPLOAD_DELTA [response] :: request_id: 0x%04x :: size: 0x%x\n", packet->request_id, packet->r.response.body.upload_delta.size);
+      break;
+
+    case COMMAND_DOWNLOAD_DELTA:
+      if(packet->is_request)
+        printf("COMMAND_DOWNLOAD_DELTA [request] :: request_id: 0x%04x :: filename: %s :: block_size: 0x%x :: offset: 0x%x :: signatures: 0x%x bytes\n", packet->request_id, packet->r.request.body.download_delta.filename, packet->r.request.body.download_delta.block_size, packet->r.request.body.download_delta.offset, packet->r.request.body.download_delta.length);
+      else
+        printf("COMMAND_DOWNLOAD_DELTA [response] :: request_id: 0x%04x :: offset: 0x%x :: size: 0x%x :: ops: 0x%x bytes\n", packet->request_id, packet->r.response.body.download_delta.offset, packet->r.response.body.download_delta.size, packet->r.response.body.download_delta.length);
+      break;
+
     case TUNNEL_CONNECT:
       if(packet->is_request)
         printf("TUNNEL_CONNECT [request] :: request_id 0x%04x :: host %s :: port %d\n", packet->request_id, packet->r.request.body.tunnel_connect.host, packet->r.request.body.tunnel_connect.port);
@@ -660,6 +1047,95 @@ uint8_t *command_packet_to_bytes(command_packet_t *packet, size_t *length)
       }
       break;
 
+    case COMMAND_DOWNLOAD_CHUNK:
+      if(packet->is_request)
+      {
+        buffer_add_ntstring(buffer, packet->r.request.body.download_chunk.filename);
+        buffer_add_int32(buffer, packet->r.request.body.download_chunk.offset);
+        buffer_add_int32(buffer, packet->r.request.body.download_chunk.length);
+      }
+      else
+      {
+        buffer_add_int32(buffer, packet->r.response.body.download_chunk.offset);
+        buffer_add_int32(buffer, packet->r.response.body.download_chunk.size);
+        buffer_add_bytes(buffer, packet->r.response.body.download_chunk.data, packet->r.response.body.download_chunk.length);
+      }
+      break;
+
+    case COMMAND_UPLOAD_CHUNK:
+      if(packet->is_request)
+      {
+        buffer_add_ntstring(buffer, packet->r.request.body.upload_chunk.filename);
+        buffer_add_int32(buffer, packet->r.request.body.upload_chunk.offset);
+        buffer_add_bytes(buffer, packet->r.request.body.upload_chunk.data, packet->r.request.body.upload_chunk.length);
+      }
+      else
+      {
+        buffer_add_int32(buffer, packet->r.response.body.upload_chunk.size);
+      }
+      break;
+
+    case COMMAND_STATS:
+      if(!packet->is_request)
+      {
+        uint32_t i;
+
+        buffer_add_int32(buffer, packet->r.response.body.stats.count);
+        for(i = 0; i < packet->r.response.body.stats.count; i++)
+        {
+          buffer_add_ntstring(buffer, packet->r.response.body.stats.names[i]);
+          buffer_add_int32(buffer, packet->r.response.body.stats.values[i]);
+        }
+      }
+      break;
+
+    case COMMAND_FILE_SIGNATURE:
+      if(packet->is_request)
+      {
+        buffer_add_ntstring(buffer, packet->r.request.body.file_signature.filename);
+        buffer_add_int32(buffer, packet->r.request.body.file_signature.block_size);
+        buffer_add_int32(buffer, packet->r.request.body.file_signature.first_block);
+        buffer_add_int32(buffer, packet->r.request.body.file_signature.count);
+      }
+      else
+      {
+        buffer_add_int32(buffer, packet->r.response.body.file_signature.size);
+        buffer_add_int32(buffer, packet->r.response.body.file_signature.first_block);
+        buffer_add_bytes(buffer, packet->r.response.body.file_signature.data, packet->r.response.body.file_signature.length);
+      }
+      break;
+
+    case COMMAND_UPLOAD_DELTA:
+      if(packet->is_request)
+      {
+        buffer_add_ntstring(buffer, packet->r.request.body.upload_delta.filename);
+        buffer_add_int32(buffer, packet->r.request.body.upload_delta.block_size);
+        buffer_add_int32(buffer, packet->r.request.body.upload_delta.offset);
+        buffer_add_int32(buffer, packet->r.request.body.upload_delta.size);
+        buffer_add_bytes(buffer, packet->r.request.body.upload_delta.data, packet->r.request.body.upload_delta.length);
+      }
+      else
+      {
+        buffer_add_int32(buffer, packet->r.response.body.upload_delta.size);
+      }
+      break;
+
+    case COMMAND_DOWNLOAD_DELTA:
+      if(packet->is_request)
+      {
+        buffer_add_ntstring(buffer, packet->r.request.body.download_delta.filename);
+        buffer_add_int32(buffer, packet->r.request.body.download_delta.block_size);
+        buffer_add_int32(buffer, packet->r.request.body.download_delta.offset);
+        buffer_add_bytes(buffer, packet->r.request.body.download_delta.data, packet->r.request.body.download_delta.length);
+      }
+      else
+      {
+        buffer_add_int32(buffer, packet->r.response.body.download_delta.offset);
+        buffer_add_int32(buffer, packet->r.response.body.download_delta.size);
+        buffer_add_bytes(buffer, packet->r.response.body.download_delta.data, packet->r.response.body.download_delta.length);
+      }
+      break;
+
     case TUNNEL_CONNECT:
       if(packet->is_request)
       {
@@ -23,6 +23,10 @@
 /* Just make sure it doesn't overflow, basically */
 #define MAX_COMMAND_PACKET_SIZE 0x7FFFFF00
 
+/* A COMMAND_UPLOAD_CHUNK with this offset just asks how much of the file is
+ * already there. */
+#define UPLOAD_QUERY_OFFSET 0xFFFFFFFF
+
 typedef enum
 {
   COMMAND_PING      = 0x0000,
@@ -32,6 +36,12 @@ typedef enum
   COMMAND_UPLOAD    = 0x0004,
   COMMAND_SHUTDOWN  = 0x0005,
   COMMAND_DELAY     = 0x0006,
+  COMMAND_DOWNLOAD_CHUNK = 0x0007,
+  COMMAND_UPLOAD_CHUNK   = 0x0008,
+  COMMAND_STATS     = 0x0009,
+  COMMAND_FILE_SIGNATURE = 0x000A,
+  COMMAND_UPLOAD_DELTA   = 0x000B,
+  COMMAND_DOWNLOAD_DELTA = 0x000C,
 
   TUNNEL_CONNECT    = 0x1000,
   TUNNEL_DATA       = 0x1001,
@@ -51,6 +61,10 @@ typedef struct
   command_packet_type_t command_id;
   NBBOOL is_request;
 
+  /* Set by command_packet_read_view(): the data fields of uploads, downloads,
+   * and tunnel data point into the stream instead of being copies. */
+  NBBOOL is_view;
+
   union
   {
     struct
@@ -63,6 +77,12 @@ typedef struct
         struct { char *filename; uint8_t *data; uint32_t length; } upload;
         struct { int dummy; } shutdown;
         struct { uint32_t delay; } delay;
+        struct { char *filename; uint32_t offset; uint32_t length; } download_chunk;
+        struct { char *filename; uint32_t offset; uint8_t *data; uint32_t length; } upload_chunk;
+        struct { int dummy; } stats;
+        struct { char *filename; uint32_t block_size; uint32_t first_block; uint32_t count; } file_signature;
+        struct { char *filename; uint32_t block_size; uint32_t offset; uint32_t size; uint8_t *data; uint32_t length; } upload_delta;
+        struct { char *filename; uint32_t block_size; uint32_t offset; uint8_t *data; uint32_t length; } download_delta;
         struct { uint32_t options; char *host; uint16_t port; } tunnel_connect;
         struct { uint32_t tunnel_id; uint8_t *data; size_t length; } tunnel_data;
         struct { uint32_t tunnel_id; char *reason; } tunnel_close;
@@ -80,6 +100,12 @@ typedef struct
         struct { int dummy; } upload;
         struct { int dummy; } shutdown;
         struct { int dummy; } delay;
+        struct { uint32_t offset; uint32_t size; uint8_t *data; uint32_t length; } download_chunk;
+        struct { uint32_t size; } upload_chunk;
+        struct { uint32_t count; char **names; uint32_t *values; } stats;
+        struct { uint32_t size; uint32_t first_block; uint8_t *data; uint32_t length; } file_signature;
+        struct { uint32_t size; } upload_delta;
+        struct { uint32_t offset; uint32_t size; uint8_t *data; uint32_t length; } download_delta;
         struct { uint16_t status; uint32_t tunnel_id; } tunnel_connect;
         struct { int dummy; } tunnel_data;
         struct { int dummy; } tunnel_close;
@@ -92,6 +118,10 @@ typedef struct
 /* Parse a packet from a byte stream. */
 command_packet_t *command_packet_read(buffer_t *buffer);
 
+/* The same, but the packet's bulk data isn't copied out of the stream, so
+ * the packet can only be used until the stream is next changed. */
+command_packet_t *command_packet_read_view(buffer_t *buffer);
+
 /* Create a packet with the given characteristics. */
 command_packet_t *command_packet_create_ping_request(uint16_t request_id, char *data);
 command_packet_t *command_packet_create_ping_response(uint16_t request_id, char *data);
@@ -112,6 +142,29 @@ command_packet_t *command_packet_create_shutdown_response(uint16_t request_id);
 
 command_packet_t *command_packet_create_delay_response(uint16_t request_id);
 
+command_packet_t *command_packet_create_download_chunk_request(uint16_t request_id, char *filename, uint32_t offset, uint32_t length);
+command_packet_t *command_packet_create_download_chunk_response(uint16_t request_id, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length);
+
+command_packet_t *command_packet_create_upload_chunk_request(uint16_t request_id, char *filename, uint32_t offset, uint8_t *data, uint32_t length);
+command_packet_t *command_packet_create_upload_chunk_response(uint16_t request_id, uint32_t size);
+
+command_packet_t *command_packet_create_stats_request(uint16_t request_id);
+command_packet_t *command_packet_create_stats_response(uint16_t request_id);
+
+/* Add one counter to a stats response. */
+void command_packet_add_stat(command_packet_t *packet, char *name, uint32_t value);
+
+/* The delta commands; the signatures and ops are packed the way
+ * libs/delta.h describes. */
+command_packet_t *command_packet_create_file_signature_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t first_block, uint32_t count);
+command_packet_t *command_packet_create_file_signature_response(uint16_t request_id, uint32_t size, uint32_t first_block, uint8_t *data, uint32_t length);
+
+command_packet_t *command_packet_create_upload_delta_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length);
+command_packet_t *command_packet_create_upload_delta_response(uint16_t request_id, uint32_t size);
+
+command_packet_t *command_packet_create_download_delta_request(uint16_t request_id, char *filename, uint32_t block_size, uint32_t offset, uint8_t *data, uint32_t length);
+command_packet_t *command_packet_create_download_delta_response(uint16_t request_id, uint32_t offset, uint32_t size, uint8_t *data, uint32_t length);
+
 command_packet_t *command_packet_create_tunnel_connect_request(uint16_t request_id, uint32_t options, char *host, uint16_t port);
 command_packet_t *command_packet_create_tunnel_connect_response(uint16_t request_id, uint32_t tunnel_id);
 
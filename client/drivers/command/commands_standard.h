@@ -19,11 +19,16 @@ static command_packet_t *handle_ping(driver_command_t *driver, command_packet_t
 
 static command_packet_t *handle_shell(driver_command_t *driver, command_packet_t *in)
 {
+#ifndef NO_DRIVER_EXEC
   session_t *session = NULL;
+#endif
 
   if(!in->is_request)
     return NULL;
 
+#ifdef NO_DRIVER_EXEC
+  return command_packet_create_error_response(in->request_id, -1, "This client was built without exec sessions");
+#else
 #ifdef WIN32
   session = session_create_exec(driver->group, "cmd.exe", "cmd.exe");
 #else
@@ -32,74 +37,630 @@ static command_packet_t *handle_shell(driver_command_t *driver, command_packet_t
   controller_add_session(session);
 
   return command_packet_create_shell_response(in->request_id, session->id);
+#endif
 }
 
 static command_packet_t *handle_exec(driver_command_t *driver, command_packet_t *in)
 {
+#ifndef NO_DRIVER_EXEC
   session_t *session = NULL;
+#endif
 
   if(!in->is_request)
     return NULL;
 
+#ifdef NO_DRIVER_EXEC
+  return command_packet_create_error_response(in->request_id, -1, "This client was built without exec sessions");
+#else
   session = session_create_exec(driver->group, in->r.request.body.exec.name, in->r.request.body.exec.command);
   controller_add_session(session);
 
   return command_packet_create_exec_response(in->request_id, session->id);
+#endif
 }
 
-static command_packet_t *handle_download(driver_command_t *driver, command_packet_t *in)
+/* The worker that does the file reads and writes, so a big file (or a slow
+ * disk) doesn't hold up every other session; see driver_command_set_worker().
+ * Without one, they're done on the spot. */
+static worker_t *g_io_worker = NULL;
+
+typedef enum
 {
-  struct stat s;
-  uint8_t *data;
-  FILE *f = NULL;
-  command_packet_t *out = NULL;
+  /* A whole-file download takes two jobs: one to find out how big it is (so
+   * the buffer can be made on the main thread), then one to read it. */
+  FILE_JOB_DOWNLOAD_OPEN,
+  FILE_JOB_DOWNLOAD_READ,
+  FILE_JOB_DOWNLOAD_CHUNK,
+  FILE_JOB_UPLOAD,
+  FILE_JOB_UPLOAD_CHUNK,
+  FILE_JOB_UPLOAD_QUERY,
+  FILE_JOB_FILE_SIGNATURE,
+  FILE_JOB_UPLOAD_DELTA,
+  FILE_JOB_DOWNLOAD_DELTA
+} file_job_type_t;
 
-  if(!in->is_request)
-    return NULL;
+/* Everything a job needs is copied out of the request, since the request
+ * only points into the stream. */
+typedef struct _file_job_t
+{
+  file_job_type_t     type;
+
+  /* Set to NULL if the driver goes away first; the result is thrown away. */
+  driver_command_t   *driver;
+  uint16_t            request_id;
+  char               *filename;
+  FILE               *f;
+
+  uint32_t            offset;
+  uint8_t            *data;
+  uint32_t            length;
+
+  /* For the delta commands: the block size, the signatures (with
+   * COMMAND_FILE_SIGNATURE, which ones) or the index on them, the file being
+   * rebuilt (and its basis), the size it'll end up, and buffers for
+   * delta_encode() and the like. */
+  uint32_t            block_size;
+  uint32_t            first_block;
+  uint32_t            count;
+  delta_index_t      *index;
+  char               *temp_filename;
+  FILE               *basis;
+  uint32_t            size;
+  uint8_t            *work;
+  size_t              work_size;
+
+  /* What the job found out (the run functions set these). */
+  uint32_t            file_size;
+  uint8_t            *out;
+  size_t              out_length;
+  char               *error;
 
-  if(stat(in->r.request.body.download.filename, &s) != 0)
-    return command_packet_create_error_response(in->request_id, -1, "Error opening file for reading");
+  struct _file_job_t *next;
+} file_job_t;
+
+static FILE *open_file(char *filename, char *mode)
+{
+  FILE *f = NULL;
 
 #ifdef WIN32
-  fopen_s(&f, in->r.request.body.download.filename, "rb");
+  fopen_s(&f, filename, mode);
 #else
-  f = fopen(in->r.request.body.download.filename, "rb");
+  f = fopen(filename, mode);
+#endif
+
+  return f;
+}
+
+static file_job_t *file_job_create(driver_command_t *driver, file_job_type_t type, uint16_t request_id, char *filename)
+{
+  file_job_t *job = (file_job_t*) safe_malloc(sizeof(file_job_t));
+
+  job->type       = type;
+  job->driver     = driver;
+  job->request_id = request_id;
+  job->filename   = safe_strdup(filename);
+
+  return job;
+}
+
+static void file_job_destroy(file_job_t *job)
+{
+  if(job->f)
+    fclose(job->f);
+  if(job->basis)
+    fclose(job->basis);
+  if(job->data)
+    safe_free(job->data);
+  if(job->index)
+    delta_index_destroy(job->index);
+  if(job->temp_filename)
+    safe_free(job->temp_filename);
+  if(job->work)
+    safe_free(job->work);
+  if(job->out)
+    safe_free(job->out);
+  safe_free(job->filename);
+  safe_free(job);
+}
+
+/* (On the worker's thread, so no allocating, and nothing but the job.) */
+static void file_job_run(void *param)
+{
+  file_job_t  *job = (file_job_t*) param;
+  struct stat  s;
+  size_t       read;
+  uint32_t     i;
+  uint32_t     written;
+  NBBOOL       error;
+
+  switch(job->type)
+  {
+    case FILE_JOB_DOWNLOAD_OPEN:
+      if(stat(job->filename, &s) != 0 || !(job->f = open_file(job->filename, "rb")))
+        job->error = "Error opening file for reading";
+      else
+        job->file_size = (uint32_t)s.st_size;
+      break;
+
+    case FILE_JOB_DOWNLOAD_READ:
+      if(fread(job->data, 1, job->file_size, job->f) != job->file_size)
+        job->error = "There was an error reading the file";
+      fclose(job->f);
+      job->f = NULL;
+      break;
+
+    case FILE_JOB_DOWNLOAD_CHUNK:
+      if(stat(job->filename, &s) != 0)
+      {
+        job->error = "Error opening file for reading";
+        break;
+      }
+
+      if(job->offset > s.st_size)
+      {
+        job->error = "The offset is past the end of the file";
+        break;
+      }
+
+      if(!(job->f = open_file(job->filename, "rb")))
+      {
+        job->error = "Error opening file for reading";
+        break;
+      }
+
+      if(fseek(job->f, job->offset, SEEK_SET) != 0)
+      {
+        job->error = "There was an error reading the file";
+      }
+      else
+      {
+        /* A short read is fine, it just means we hit the end. */
+        read = fread(job->data, 1, job->length, job->f);
+
+        if(ferror(job->f))
+          job->error = "There was an error reading the file";
+        else
+          job->length = (uint32_t)read;
+      }
+
+      job->file_size = (uint32_t)s.st_size;
+      fclose(job->f);
+      job->f = NULL;
+      break;
+
+    case FILE_JOB_UPLOAD:
+      if(!(job->f = open_file(job->filename, "wb")))
+      {
+        job->error = "Error opening file for writing";
+        break;
+      }
+
+      fwrite(job->data, job->length, 1, job->f);
+      fclose(job->f);
+      job->f = NULL;
+      break;
+
+    case FILE_JOB_UPLOAD_QUERY:
+      job->file_size = stat(job->filename, &s) == 0 ? (uint32_t)s.st_size : 0;
+      break;
+
+    case FILE_JOB_UPLOAD_CHUNK:
+      /* The first chunk starts a new file; the rest go on the end of it. */
+      if(job->offset != 0)
+      {
+        if(stat(job->filename, &s) != 0)
+        {
+          job->error = "Error opening file for writing";
+          break;
+        }
+
+        if(job->offset > s.st_size)
+        {
+          job->error = "The offset is past the end of the file";
+          break;
+        }
+      }
+
+      if(!(job->f = open_file(job->filename, job->offset == 0 ? "wb" : "r+b")))
+      {
+        job->error = "Error opening file for writing";
+        break;
+      }
+
+      if(fseek(job->f, job->offset, SEEK_SET) != 0 || fwrite(job->data, 1, job->length, job->f) != job->length)
+        job->error = "There was an error writing the file";
+
+      /* Only report it as written once it's really there. */
+      if(fclose(job->f) != 0)
+        job->error = "There was an error writing the file";
+      job->f = NULL;
+      break;
+
+    case FILE_JOB_FILE_SIGNATURE:
+      /* A file that isn't there just has no blocks. */
+      if(stat(job->filename, &s) != 0)
+        break;
+
+      job->file_size = (uint32_t)s.st_size;
+      if(job->first_block >= job->file_size / job->block_size)
+        break;
+      job->count = MIN(job->count, job->file_size / job->block_size - job->first_block);
+
+      if(!(job->f = open_file(job->filename, "rb")) || fseek(job->f, job->first_block * job->block_size, SEEK_SET) != 0)
+      {
+        job->error = "Error opening file for reading";
+        break;
+      }
+
+      for(i = 0; i < job->count; i++)
+      {
+        if(fread(job->work, 1, job->block_size, job->f) != job->block_size)
+        {
+          job->error = "There was an error reading the file";
+          break;
+        }
+
+        delta_sign_block(job->work, job->block_size, job->out + i * DELTA_SIGNATURE_LENGTH);
+      }
+      job->out_length = i * DELTA_SIGNATURE_LENGTH;
+      break;
+
+    case FILE_JOB_UPLOAD_DELTA:
+      /* The new file is put together next to the old one (which the COPYs
+       * read from), and only replaces it once it's all there. */
+      if(job->offset != 0)
+      {
+        if(stat(job->temp_filename, &s) != 0)
+        {
+          job->error = "Error opening file for writing";
+          break;
+        }
+
+        if(job->offset != s.st_size)
+        {
+          job->error = "The offset isn't the end of what's been written";
+          break;
+        }
+      }
+
+      if(!(job->f = open_file(job->temp_filename, job->offset == 0 ? "wb" : "r+b")) || fseek(job->f, job->offset, SEEK_SET) != 0)
+      {
+        job->error = "Error opening file for writing";
+        break;
+      }
+
+      job->basis = open_file(job->filename, "rb");
+      if(!delta_apply(job->data, job->length, job->block_size, job->basis, job->f, job->work, job->work_size, &written))
+        job->error = "The delta doesn't fit the file";
+
+      if(fclose(job->f) != 0)
+        job->error = "There was an error writing the file";
+      job->f = NULL;
+
+      job->file_size = job->offset + written;
+      if(job->error)
+        break;
+
+      if(job->file_size > job->size)
+      {
+        job->error = "The delta is longer than the file";
+        break;
+      }
+
+      if(job->file_size == job->size)
+      {
+#ifndef WIN32
+        /* Keep the old file's permissions (it's probably a program). */
+        if(job->basis && stat(job->filename, &s) == 0)
+          chmod(job->temp_filename, s.st_mode & 07777);
 #endif
-  if(!f)
-    return command_packet_create_error_response(in->request_id, -1, "Error opening file for reading");
+        if(job->basis)
+          fclose(job->basis);
+        job->basis = NULL;
+
+#ifdef WIN32
+        remove(job->filename);
+#endif
+        if(rename(job->temp_filename, job->filename) != 0)
+          job->error = "Couldn't replace the file";
+      }
+      break;
+
+    case FILE_JOB_DOWNLOAD_DELTA:
+      if(stat(job->filename, &s) != 0 || !(job->f = open_file(job->filename, "rb")))
+      {
+        job->error = "Error opening file for reading";
+        break;
+      }
 
-  data = safe_malloc(s.st_size);
-  if(fread(data, 1, s.st_size, f) == s.st_size)
-    out = command_packet_create_download_response(in->request_id, data, s.st_size);
+      job->file_size = (uint32_t)s.st_size;
+      if(job->offset > job->file_size)
+      {
+        job->error = "The offset is past the end of the file";
+        break;
+      }
+
+      if(fseek(job->f, job->offset, SEEK_SET) != 0)
+      {
+        job->error = "There was an error reading the file";
+        break;
+      }
+
+      delta_encode(job->index, job->f, job->work, job->out, DOWNLOAD_MAX_CHUNK, &job->out_length, &error);
+      if(error)
+        job->error = "There was an error reading the file";
+      break;
+  }
+}
+
+static void file_job_done(void *param);
+
+static void post_file_job(file_job_t *job)
+{
+  job->next = job->driver->file_jobs;
+  job->driver->file_jobs = job;
+
+  if(g_io_worker)
+  {
+    worker_post(g_io_worker, file_job_run, file_job_done, job);
+  }
   else
-    out = command_packet_create_error_response(in->request_id, -1, "There was an error reading the file");
+  {
+    file_job_run(job);
+    file_job_done(job);
+  }
+}
 
-  fclose(f);
-  safe_free(data);
+static void remove_file_job(driver_command_t *driver, file_job_t *job)
+{
+  file_job_t **i;
 
-  return out;
+  for(i = &driver->file_jobs; *i; i = &(*i)->next)
+  {
+    if(*i == job)
+    {
+      *i = job->next;
+      break;
+    }
+  }
+}
+
+/* Let any jobs that are still going know the driver's gone. */
+static void abandon_file_jobs(driver_command_t *driver)
+{
+  file_job_t *job;
+
+  for(job = driver->file_jobs; job; job = job->next)
+    job->driver = NULL;
+  driver->file_jobs = NULL;
+}
+
+static void file_job_done(void *param)
+{
+  file_job_t       *job = (file_job_t*) param;
+  command_packet_t *out = NULL;
+
+  if(!job->driver)
+  {
+    file_job_destroy(job);
+    return;
+  }
+
+  remove_file_job(job->driver, job);
+
+  if(job->error)
+  {
+    out = command_packet_create_error_response(job->request_id, -1, job->error);
+  }
+  else
+  {
+    switch(job->type)
+    {
+      case FILE_JOB_DOWNLOAD_OPEN:
+        job->data = safe_malloc(job->file_size);
+        job->type = FILE_JOB_DOWNLOAD_READ;
+        post_file_job(job);
+        return;
+
+      case FILE_JOB_DOWNLOAD_READ:
+        out = command_packet_create_download_response(job->request_id, job->data, job->file_size);
+        break;
+
+      case FILE_JOB_DOWNLOAD_CHUNK:
+        out = command_packet_create_download_chunk_response(job->request_id, job->offset, job->file_size, job->data, job->length);
+        break;
+
+      case FILE_JOB_UPLOAD:
+        out = command_packet_create_upload_response(job->request_id);
+        break;
+
+      case FILE_JOB_UPLOAD_QUERY:
+        out = command_packet_create_upload_chunk_response(job->request_id, job->file_size);
+        break;
+
+      case FILE_JOB_UPLOAD_CHUNK:
+        out = command_packet_create_upload_chunk_response(job->request_id, job->offset + job->length);
+        break;
+
+      case FILE_JOB_FILE_SIGNATURE:
+        out = command_packet_create_file_signature_response(job->request_id, job->file_size, job->first_block, job->out, (uint32_t)job->out_length);
+        break;
+
+      case FILE_JOB_UPLOAD_DELTA:
+        out = command_packet_create_upload_delta_response(job->request_id, job->file_size);
+        break;
+
+      case FILE_JOB_DOWNLOAD_DELTA:
+        out = command_packet_create_download_delta_response(job->request_id, job->offset, job->file_size, job->out, (uint32_t)job->out_length);
+        break;
+    }
+  }
+
+  printf("Response: ");
+  command_packet_print(out);
+  send_and_free(job->driver, out);
+
+  file_job_destroy(job);
+}
+
+/* The file handlers below just hand the work to the worker; the response
+ * goes out from file_job_done(). */
+static command_packet_t *handle_download(driver_command_t *driver, command_packet_t *in)
+{
+  if(!in->is_request)
+    return NULL;
+
+  post_file_job(file_job_create(driver, FILE_JOB_DOWNLOAD_OPEN, in->request_id, in->r.request.body.download.filename));
+
+  return NULL;
+}
+
+/* Send one piece of a file, so the whole thing is never in memory at once.
+ * The server asks for each chunk in turn, which also means it can pick up
+ * where it left off. */
+static command_packet_t *handle_download_chunk(driver_command_t *driver, command_packet_t *in)
+{
+  file_job_t *job;
+
+  if(!in->is_request)
+    return NULL;
+
+  job = file_job_create(driver, FILE_JOB_DOWNLOAD_CHUNK, in->request_id, in->r.request.body.download_chunk.filename);
+  job->offset = in->r.request.body.download_chunk.offset;
+  job->length = MIN(in->r.request.body.download_chunk.length, DOWNLOAD_MAX_CHUNK);
+  job->data   = safe_malloc(job->length);
+  post_file_job(job);
+
+  return NULL;
 }
 
 static command_packet_t *handle_upload(driver_command_t *driver, command_packet_t *in)
 {
-  FILE *f;
+  file_job_t *job;
 
   if(!in->is_request)
     return NULL;
 
-#ifdef WIN32
-  fopen_s(&f, in->r.request.body.upload.filename, "wb");
-#else
-  f = fopen(in->r.request.body.upload.filename, "wb");
-#endif
+  job = file_job_create(driver, FILE_JOB_UPLOAD, in->request_id, in->r.request.body.upload.filename);
+  job->length = in->r.request.body.upload.length;
+  job->data   = safe_malloc(job->length);
+  memcpy(job->data, in->r.request.body.upload.data, job->length);
+  post_file_job(job);
+
+  return NULL;
+}
+
+/* Write one piece of a file as soon as it arrives, so the whole thing never
+ * has to be in memory. The response has how much of the file is safely
+ * written, which is where the server continues from (even after the session
+ * was lost and a new one started). */
+static command_packet_t *handle_upload_chunk(driver_command_t *driver, command_packet_t *in)
+{
+  file_job_t *job;
 
-  if(!f)
-    return command_packet_create_error_response(in->request_id, -1, "Error opening file for writing");
+  if(!in->is_request)
+    return NULL;
 
-  fwrite(in->r.request.body.upload.data, in->r.request.body.upload.length, 1, f);
-  fclose(f);
+  /* The server wants to know where to resume from. */
+  if(in->r.request.body.upload_chunk.offset == UPLOAD_QUERY_OFFSET)
+  {
+    post_file_job(file_job_create(driver, FILE_JOB_UPLOAD_QUERY, in->request_id, in->r.request.body.upload_chunk.filename));
+    return NULL;
+  }
 
-  return command_packet_create_upload_response(in->request_id);
+  job = file_job_create(driver, FILE_JOB_UPLOAD_CHUNK, in->request_id, in->r.request.body.upload_chunk.filename);
+  job->offset = in->r.request.body.upload_chunk.offset;
+  job->length = in->r.request.body.upload_chunk.length;
+  job->data   = safe_malloc(job->length);
+  memcpy(job->data, in->r.request.body.upload_chunk.data, job->length);
+  post_file_job(job);
+
+  return NULL;
+}
+
+static NBBOOL is_good_block_size(uint32_t block_size)
+{
+  return block_size > 0 && block_size <= DELTA_MAX_BLOCK_SIZE;
+}
+
+/* The signatures of the blocks of a file, so the server can work out a
+ * COMMAND_UPLOAD_DELTA against it. */
+static command_packet_t *handle_file_signature(driver_command_t *driver, command_packet_t *in)
+{
+  file_job_t *job;
+
+  if(!in->is_request)
+    return NULL;
+
+  if(!is_good_block_size(in->r.request.body.file_signature.block_size))
+    return command_packet_create_error_response(in->request_id, -1, "That block size isn't supported");
+
+  job = file_job_create(driver, FILE_JOB_FILE_SIGNATURE, in->request_id, in->r.request.body.file_signature.filename);
+  job->block_size  = in->r.request.body.file_signature.block_size;
+  job->first_block = in->r.request.body.file_signature.first_block;
+  job->count       = MIN(in->r.request.body.file_signature.count, DELTA_MAX_SIGNATURES);
+  job->work        = safe_malloc(job->block_size);
+  job->out         = safe_malloc(job->count * DELTA_SIGNATURE_LENGTH + 1);
+  post_file_job(job);
+
+  return NULL;
+}
+
+/* Build the new version of a file out of the old one and the ops, a piece at
+ * a time (like COMMAND_UPLOAD_CHUNK), replacing the old one once the last
+ * piece is in. */
+static command_packet_t *handle_upload_delta(driver_command_t *driver, command_packet_t *in)
+{
+  file_job_t *job;
+
+  if(!in->is_request)
+    return NULL;
+
+  if(!is_good_block_size(in->r.request.body.upload_delta.block_size))
+    return command_packet_create_error_response(in->request_id, -1, "That block size isn't supported");
+
+  job = file_job_create(driver, FILE_JOB_UPLOAD_DELTA, in->request_id, in->r.request.body.upload_delta.filename);
+  job->block_size    = in->r.request.body.upload_delta.block_size;
+  job->offset        = in->r.request.body.upload_delta.offset;
+  job->size          = in->r.request.body.upload_delta.size;
+  job->length        = in->r.request.body.upload_delta.length;
+  job->data          = safe_malloc(job->length + 1);
+  memcpy(job->data, in->r.request.body.upload_delta.data, job->length);
+  job->temp_filename = safe_malloc(strlen(job->filename) + strlen(DELTA_TEMP_SUFFIX) + 1);
+  sprintf(job->temp_filename, "%s%s", job->filename, DELTA_TEMP_SUFFIX);
+  job->work_size     = DELTA_COPY_SIZE;
+  job->work          = safe_malloc(job->work_size);
+  post_file_job(job);
+
+  return NULL;
+}
+
+/* The next piece of a file, as ops against the server's copy of it. */
+static command_packet_t *handle_download_delta(driver_command_t *driver, command_packet_t *in)
+{
+  file_job_t *job;
+
+  if(!in->is_request)
+    return NULL;
+
+  if(!is_good_block_size(in->r.request.body.download_delta.block_size))
+    return command_packet_create_error_response(in->request_id, -1, "That block size isn't supported");
+
+  if(in->r.request.body.download_delta.length % DELTA_SIGNATURE_LENGTH != 0)
+    return command_packet_create_error_response(in->request_id, -1, "The signatures are the wrong length");
+
+  job = file_job_create(driver, FILE_JOB_DOWNLOAD_DELTA, in->request_id, in->r.request.body.download_delta.filename);
+  job->block_size = in->r.request.body.download_delta.block_size;
+  job->offset     = in->r.request.body.download_delta.offset;
+  job->length     = in->r.request.body.download_delta.length;
+  job->data       = safe_malloc(job->length + 1);
+  memcpy(job->data, in->r.request.body.download_delta.data, job->length);
+  job->index      = delta_index_create(job->data, job->length / DELTA_SIGNATURE_LENGTH, job->block_size);
+  job->work       = safe_malloc(DELTA_WORK_SIZE(job->block_size));
+  job->out        = safe_malloc(DOWNLOAD_MAX_CHUNK);
+  post_file_job(job);
+
+  return NULL;
 }
 
 static command_packet_t *handle_shutdown(driver_command_t *driver, command_packet_t *in)
@@ -122,6 +683,24 @@ static command_packet_t *handle_delay(driver_command_t *driver, command_packet_t
   return command_packet_create_delay_response(in->request_id);
 }
 
+static void add_stat(char *name, uint32_t value, void *param)
+{
+  command_packet_add_stat((command_packet_t*)param, name, value);
+}
+
+static command_packet_t *handle_stats(driver_command_t *driver, command_packet_t *in)
+{
+  command_packet_t *out;
+
+  if(!in->is_request)
+    return NULL;
+
+  out = command_packet_create_stats_response(in->request_id);
+  controller_get_stats(add_stat, out);
+
+  return out;
+}
+
 static command_packet_t *handle_error(driver_command_t *driver, command_packet_t *in)
 {
   if(!in->is_request)
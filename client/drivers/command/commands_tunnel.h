@@ -10,6 +10,17 @@
 
 static uint32_t g_tunnel_id = 0;
 
+/* Small reads from a tunnel are held onto for up to this long (or till
+ * there's TUNNEL_COALESCE_MAX bytes), in case more comes, so they can go
+ * out in one packet instead of paying for the header each time. 0 sends
+ * each read right away. */
+static uint32_t g_coalesce_delay = 20;
+
+/* Looks up the hosts we're asked to connect to, so a slow name doesn't hold
+ * up every other session; see driver_command_set_resolver(). Without one,
+ * they're looked up on the spot. */
+static resolver_t *g_resolver = NULL;
+
 typedef struct
 {
   uint32_t          tunnel_id;
@@ -18,17 +29,208 @@ typedef struct
   uint16_t          connect_request_id;
   char             *host;
   uint16_t          port;
+
+  /* Data read from the socket that hasn't been sent yet, and the timer that
+   * sends it (0 if there isn't one). */
+  uint8_t           pending[TUNNEL_COALESCE_MAX];
+  size_t            pending_length;
+  int               flush_timer;
+
+  /* TUNNEL_DATA packets waiting for their turn to go out (see
+   * schedule_tunnels()), and how many bytes of turns the tunnel has saved
+   * up. */
+  ring_buffer_t    *queue;
+  size_t            deficit;
+
+  /* Set while we're not reading from the socket because queue is full. */
+  NBBOOL            is_paused;
+
+  /* TUNNEL_DATA from the server that the socket wouldn't take yet. */
+  ring_buffer_t    *unsent;
+
+  /* Set while the host's being looked up (s is -1 till it's done). */
+  NBBOOL            is_resolving;
 } tunnel_t;
 
-static void send_and_free(buffer_t *outgoing_data, command_packet_t *out)
+/* Free a tunnel that's already been taken out of the table (and whose
+ * socket is taken care of), throwing away anything it was holding onto. */
+static void destroy_tunnel(tunnel_t *tunnel)
+{
+  if(tunnel->flush_timer)
+    select_group_cancel_timer(tunnel->driver->group, tunnel->flush_timer);
+  if(tunnel->is_resolving)
+    resolver_cancel(g_resolver, tunnel);
+
+  ring_buffer_destroy(tunnel->queue);
+  ring_buffer_destroy(tunnel->unsent);
+  safe_free(tunnel->host);
+  safe_free(tunnel);
+}
+
+/* Close every tunnel without telling the server (used when the session's
+ * going away). */
+static void close_all_tunnels(driver_command_t *driver)
+{
+  tunnel_t *tunnel;
+
+  while((tunnel = (tunnel_t*) hash_remove_any(driver->tunnels)))
+  {
+    LOG_WARNING("[Tunnel %d] closing the connection to %s:%d", tunnel->tunnel_id, tunnel->host, tunnel->port);
+
+    if(tunnel->s != -1)
+      select_group_remove_and_close_socket(driver->group, tunnel->s);
+    destroy_tunnel(tunnel);
+  }
+}
+
+/* Queue up a packet behind the tunnel's other data, instead of ahead of it
+ * like send_and_free() would. */
+static void queue_and_free(tunnel_t *tunnel, command_packet_t *out)
 {
   uint8_t          *out_data = NULL;
   size_t            out_length;
 
   out_data = command_packet_to_bytes(out, &out_length);
-  buffer_add_bytes(outgoing_data, out_data, out_length);
+  ring_buffer_add_bytes(tunnel->queue, out_data, out_length);
   safe_free(out_data);
   command_packet_destroy(out);
+
+  /* Leave the data in the socket till the other tunnels let it through. */
+  if(!tunnel->is_paused && ring_buffer_is_full(tunnel->queue))
+  {
+    LOG_INFO("[Tunnel %d] Outgoing buffer is full, pausing", tunnel->tunnel_id);
+    select_group_pause_socket(tunnel->driver->group, tunnel->s);
+    tunnel->is_paused = TRUE;
+  }
+}
+
+/* The length of the packet at the front of a queue, including its length. */
+static size_t next_packet_length(ring_buffer_t *queue)
+{
+  uint8_t length[4];
+
+  ring_buffer_read_at(queue, 0, length, 4);
+
+  return 4 + (((size_t)length[0] << 24) | ((size_t)length[1] << 16) | ((size_t)length[2] << 8) | (size_t)length[3]);
+}
+
+/* Move length bytes from the front of one ring to the end of another. */
+static void move_bytes(ring_buffer_t *from, ring_buffer_t *to, size_t length)
+{
+  uint8_t *data;
+  size_t   contiguous;
+
+  while(length)
+  {
+    contiguous = ring_buffer_peek(from, 0, &data);
+    if(contiguous > length)
+      contiguous = length;
+
+    ring_buffer_add_bytes(to, data, contiguous);
+    ring_buffer_consume(from, contiguous);
+    length -= contiguous;
+  }
+}
+
+typedef struct
+{
+  uint32_t  after;
+  tunnel_t *first;
+  tunnel_t *next;
+} next_tunnel_t;
+
+static void find_next_tunnel(ll_index_t index, void *data, void *param)
+{
+  tunnel_t      *tunnel = (tunnel_t*) data;
+  next_tunnel_t *find   = (next_tunnel_t*) param;
+
+  if(ring_buffer_get_length(tunnel->queue) == 0)
+    return;
+
+  if(!find->first || tunnel->tunnel_id < find->first->tunnel_id)
+    find->first = tunnel;
+  if(tunnel->tunnel_id > find->after && (!find->next || tunnel->tunnel_id < find->next->tunnel_id))
+    find->next = tunnel;
+}
+
+/* Move packets from the tunnels' queues into outgoing_data till it has at
+ * least wanted bytes (or they're empty). This is deficit round-robin: each
+ * tunnel with something queued gets TUNNEL_QUANTUM bytes' worth of turn, in
+ * order of tunnel_id, and sends as many whole packets as that (plus what it
+ * saved up from last time) covers. Everything else that goes in
+ * outgoing_data - responses, and so on - goes in ahead of the tunnels, as
+ * soon as it's made. */
+static void schedule_tunnels(driver_command_t *driver, size_t wanted)
+{
+  next_tunnel_t find;
+  tunnel_t     *tunnel;
+  size_t        length;
+
+  while(ring_buffer_get_length(driver->outgoing_data) < wanted)
+  {
+    find.after = driver->last_tunnel_id;
+    find.first = NULL;
+    find.next  = NULL;
+    hash_each(driver->tunnels, find_next_tunnel, &find);
+
+    tunnel = find.next ? find.next : find.first;
+    if(!tunnel)
+      break;
+
+    driver->last_tunnel_id = tunnel->tunnel_id;
+    tunnel->deficit += TUNNEL_QUANTUM;
+
+    while(ring_buffer_get_length(tunnel->queue) > 0)
+    {
+      length = next_packet_length(tunnel->queue);
+      if(length > tunnel->deficit)
+        break;
+
+      move_bytes(tunnel->queue, driver->outgoing_data, length);
+      tunnel->deficit -= length;
+    }
+
+    /* Turns can't be saved up while there's nothing to use them on. */
+    if(ring_buffer_get_length(tunnel->queue) == 0)
+      tunnel->deficit = 0;
+
+    if(tunnel->is_paused && ring_buffer_is_drained(tunnel->queue))
+    {
+      LOG_INFO("[Tunnel %d] Outgoing buffer has drained, resuming", tunnel->tunnel_id);
+      select_group_resume_socket(driver->group, tunnel->s);
+      tunnel->is_paused = FALSE;
+    }
+  }
+}
+
+/* Send whatever the tunnel's been holding onto. */
+static void flush_tunnel(tunnel_t *tunnel)
+{
+  command_packet_t *out = NULL;
+
+  if(tunnel->flush_timer)
+  {
+    select_group_cancel_timer(tunnel->driver->group, tunnel->flush_timer);
+    tunnel->flush_timer = 0;
+  }
+
+  if(tunnel->pending_length == 0)
+    return;
+
+  out = command_packet_create_tunnel_data_request(request_id(), tunnel->tunnel_id, tunnel->pending, tunnel->pending_length);
+  tunnel->pending_length = 0;
+  queue_and_free(tunnel, out);
+}
+
+static SELECT_RESPONSE_t tunnel_flush_timer(void *group, void *param)
+{
+  tunnel_t *tunnel = (tunnel_t*) param;
+
+  /* It's a one-shot timer, so it's already gone. */
+  tunnel->flush_timer = 0;
+  flush_tunnel(tunnel);
+
+  return SELECT_OK;
 }
 
 static SELECT_RESPONSE_t tunnel_data_in(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
@@ -38,8 +240,26 @@ static SELECT_RESPONSE_t tunnel_data_in(void *group, int s, uint8_t *data, size_
 
   LOG_INFO("[Tunnel %d] Received %zd bytes of data from server; forwarding to client", tunnel->tunnel_id, length);
 
-  out = command_packet_create_tunnel_data_request(request_id(), tunnel->tunnel_id, data, length);
-  send_and_free(tunnel->driver->outgoing_data, out);
+  /* If it won't fit with what's waiting, send what's waiting first. */
+  if(tunnel->pending_length + length > TUNNEL_COALESCE_MAX)
+    flush_tunnel(tunnel);
+
+  /* Big reads aren't worth holding onto. */
+  if(g_coalesce_delay == 0 || length >= TUNNEL_COALESCE_MAX)
+  {
+    out = command_packet_create_tunnel_data_request(request_id(), tunnel->tunnel_id, data, length);
+    queue_and_free(tunnel, out);
+
+    return SELECT_OK;
+  }
+
+  memcpy(tunnel->pending + tunnel->pending_length, data, length);
+  tunnel->pending_length += length;
+
+  if(tunnel->pending_length == TUNNEL_COALESCE_MAX)
+    flush_tunnel(tunnel);
+  else if(!tunnel->flush_timer)
+    tunnel->flush_timer = select_group_add_timer(tunnel->driver->group, g_coalesce_delay, 0, tunnel_flush_timer, tunnel);
 
   return SELECT_OK;
 }
@@ -51,18 +271,21 @@ static SELECT_RESPONSE_t tunnel_closed(void *group, int s, void *param)
 
   LOG_WARNING("[Tunnel %d] connection to %s:%d closed by the server!", tunnel->tunnel_id, tunnel->host, tunnel->port);
 
-  /* Queue up a packet letting the server know the connection is gone. */
+  /* Send what the socket gave us before it went (all at once, since the
+   * queue's about to go away), then a packet letting the server know the
+   * connection is gone. */
+  flush_tunnel(tunnel);
+  move_bytes(tunnel->queue, tunnel->driver->outgoing_data, ring_buffer_get_length(tunnel->queue));
   out = command_packet_create_tunnel_close_request(request_id(), tunnel->tunnel_id, "Server closed the connection");
-  send_and_free(tunnel->driver->outgoing_data, out);
-
-  /* Remove the tunnel from the linked list of tunnels. */
-  ll_remove(tunnel->driver->tunnels, ll_32(tunnel->tunnel_id));
-  safe_free(tunnel->host);
-  safe_free(tunnel);
+  send_and_free(tunnel->driver, out);
 
   /* Close the socket. */
   tcp_close(tunnel->s);
 
+  /* Remove the tunnel from the table of tunnels. */
+  hash_remove(tunnel->driver->tunnels, ll_32(tunnel->tunnel_id));
+  destroy_tunnel(tunnel);
+
   return SELECT_REMOVE;
 }
 
@@ -73,21 +296,70 @@ static SELECT_RESPONSE_t tunnel_error(void *group, int s, int err, void *param)
 
   LOG_WARNING("[Tunnel %d] connection to %s:%d closed because of error %d", tunnel->tunnel_id, tunnel->host, tunnel->port, err);
 
-  /* Queue up a packet letting the server know the connection is gone. */
+  /* Send what the socket gave us before it went (all at once, since the
+   * queue's about to go away), then a packet letting the server know the
+   * connection is gone. */
+  flush_tunnel(tunnel);
+  move_bytes(tunnel->queue, tunnel->driver->outgoing_data, ring_buffer_get_length(tunnel->queue));
   out = command_packet_create_tunnel_close_request(request_id(), tunnel->tunnel_id, "Connection error");
-  send_and_free(tunnel->driver->outgoing_data, out);
-
-  /* Remove the tunnel from the linked list of tunnels. */
-  ll_remove(tunnel->driver->tunnels, ll_32(tunnel->tunnel_id));
-  safe_free(tunnel->host);
-  safe_free(tunnel);
+  send_and_free(tunnel->driver, out);
 
   /* Close the socket. */
   tcp_close(tunnel->s);
 
+  /* Remove the tunnel from the table of tunnels. */
+  hash_remove(tunnel->driver->tunnels, ll_32(tunnel->tunnel_id));
+  destroy_tunnel(tunnel);
+
   return SELECT_REMOVE;
 }
 
+/* Give the socket as much of what the server sent as it'll take, and wait
+ * for it to take the rest. */
+static void flush_unsent(tunnel_t *tunnel)
+{
+  uint8_t *data;
+  size_t   length;
+  ssize_t  sent;
+
+  /* (It's sent once there's a socket to send it on.) */
+  if(tunnel->s == -1)
+    return;
+
+  while(ring_buffer_get_length(tunnel->unsent) > 0)
+  {
+    length = ring_buffer_peek(tunnel->unsent, 0, &data);
+    sent   = tcp_send(tunnel->s, data, length);
+
+    if(sent < 0)
+    {
+#ifdef WIN32
+      if(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+      {
+        select_group_wait_for_writable(tunnel->driver->group, tunnel->s);
+        return;
+      }
+
+      /* Reading from it will find out that it's gone, and close the tunnel. */
+      LOG_ERROR("[Tunnel %d] couldn't send to %s:%d; throwing away %zd bytes", tunnel->tunnel_id, tunnel->host, tunnel->port, ring_buffer_get_length(tunnel->unsent));
+      ring_buffer_consume(tunnel->unsent, ring_buffer_get_length(tunnel->unsent));
+      return;
+    }
+
+    ring_buffer_consume(tunnel->unsent, sent);
+  }
+}
+
+static SELECT_RESPONSE_t tunnel_writable(void *group, int s, void *param)
+{
+  flush_unsent((tunnel_t*) param);
+
+  return SELECT_OK;
+}
+
 static SELECT_RESPONSE_t tunnel_ready(void *group, int s, void *param)
 {
   tunnel_t         *tunnel   = (tunnel_t*) param;
@@ -97,14 +369,74 @@ static SELECT_RESPONSE_t tunnel_ready(void *group, int s, void *param)
 
   /* Queue up a packet letting the server know the connection is ready. */
   out = command_packet_create_tunnel_connect_response(tunnel->connect_request_id, tunnel->tunnel_id);
-  send_and_free(tunnel->driver->outgoing_data, out);
+  send_and_free(tunnel->driver, out);
+
+  /* From now on, it being writable means there's room for more data. */
+  select_set_ready(tunnel->driver->group, tunnel->s, tunnel_writable);
+  flush_unsent(tunnel);
 
   return SELECT_OK;
 }
 
-static command_packet_t *handle_tunnel_connect(driver_command_t *driver, command_packet_t *in)
+static void find_full_tunnel(ll_index_t index, void *data, void *param)
+{
+  if(ring_buffer_is_full(((tunnel_t*) data)->unsent))
+    *((NBBOOL*) param) = TRUE;
+}
+
+NBBOOL driver_command_is_full(driver_command_t *driver)
 {
+  NBBOOL is_full = FALSE;
+
+  hash_each(driver->tunnels, find_full_tunnel, &is_full);
+
+  return is_full;
+}
+
+/* Start watching the tunnel's socket, now that it's connecting; or, if s is
+ * -1, let the server know why there isn't one and get rid of the tunnel. */
+static void tunnel_connecting(tunnel_t *tunnel, int s, char *error)
+{
+  driver_command_t *driver = tunnel->driver;
   command_packet_t *out    = NULL;
+
+  if(s == -1)
+  {
+    LOG_WARNING("[Tunnel %d] couldn't connect to %s:%d", tunnel->tunnel_id, tunnel->host, tunnel->port);
+
+    out = command_packet_create_error_response(tunnel->connect_request_id, TUNNEL_STATUS_FAIL, error);
+    send_and_free(driver, out);
+
+    hash_remove(driver->tunnels, ll_32(tunnel->tunnel_id));
+    destroy_tunnel(tunnel);
+
+    return;
+  }
+
+  tunnel->s = s;
+
+  /* Add the socket to the socket_group and set up various callbacks. */
+  select_group_add_socket(driver->group, tunnel->s, SOCKET_TYPE_STREAM, tunnel);
+  select_set_recv(driver->group, tunnel->s, tunnel_data_in);
+  select_set_closed(driver->group, tunnel->s, tunnel_closed);
+  select_set_ready(driver->group, tunnel->s, tunnel_ready);
+  select_set_error(driver->group, tunnel->s, tunnel_error);
+}
+
+static void tunnel_resolved(char *host, NBBOOL found, uint32_t address, void *param)
+{
+  tunnel_t *tunnel = (tunnel_t*) param;
+
+  tunnel->is_resolving = FALSE;
+
+  if(!found)
+    tunnel_connecting(tunnel, -1, "The dnscat2 client couldn't find the remote host!");
+  else
+    tunnel_connecting(tunnel, tcp_connect_address(address, tunnel->port, TRUE), "The dnscat2 client couldn't connect to the remote host!");
+}
+
+static command_packet_t *handle_tunnel_connect(driver_command_t *driver, command_packet_t *in)
+{
   tunnel_t         *tunnel = NULL;
 
   if(!in->is_request)
@@ -113,42 +445,43 @@ static command_packet_t *handle_tunnel_connect(driver_command_t *driver, command
   /* Set up the tunnel object. */
   tunnel = (tunnel_t*)safe_malloc(sizeof(tunnel_t));
   tunnel->tunnel_id          = g_tunnel_id++;
+  tunnel->s                  = -1;
   tunnel->connect_request_id = in->request_id;
   tunnel->driver             = driver;
   tunnel->host               = safe_strdup(in->r.request.body.tunnel_connect.host);
   tunnel->port               = in->r.request.body.tunnel_connect.port;
+  tunnel->pending_length     = 0;
+  tunnel->flush_timer        = 0;
+  tunnel->queue              = ring_buffer_create(COMMAND_MAX_BUFFERED);
+  tunnel->deficit            = 0;
+  tunnel->is_paused          = FALSE;
+  tunnel->unsent             = ring_buffer_create(TUNNEL_MAX_QUEUED);
+  tunnel->is_resolving       = FALSE;
   LOG_WARNING("[Tunnel %d] connecting to %s:%d...", tunnel->tunnel_id, tunnel->host, tunnel->port);
 
-  /* Do the actual connection. */
-  tunnel->s                  = tcp_connect_options(in->r.request.body.tunnel_connect.host, in->r.request.body.tunnel_connect.port, TRUE);
+  /* Add the driver to the table of tunnels. */
+  hash_add(driver->tunnels, ll_32(tunnel->tunnel_id), tunnel);
 
-  if(tunnel->s == -1)
+  /* Look up the host then connect (which might be done before this returns,
+   * if it's cached), or do both on the spot without a resolver. */
+  if(g_resolver)
   {
-    out = command_packet_create_error_response(in->request_id, TUNNEL_STATUS_FAIL, "The dnscat2 client couldn't connect to the remote host!");
+    tunnel->is_resolving = TRUE;
+    resolver_lookup(g_resolver, tunnel->host, tunnel_resolved, tunnel);
   }
   else
   {
-    /* Add the driver to the global list. */
-    ll_add(driver->tunnels, ll_32(tunnel->tunnel_id), tunnel);
-
-    /* Add the socket to the socket_group and set up various callbacks. */
-    select_group_add_socket(driver->group, tunnel->s, SOCKET_TYPE_STREAM, tunnel);
-    select_set_recv(driver->group, tunnel->s, tunnel_data_in);
-    select_set_closed(driver->group, tunnel->s, tunnel_closed);
-    select_set_ready(driver->group, tunnel->s, tunnel_ready);
-    select_set_error(driver->group, tunnel->s, tunnel_error);
-
-    /* Don't respond to the packet... yet! */
-    out = NULL;
+    tunnel_connecting(tunnel, tcp_connect_options(tunnel->host, tunnel->port, TRUE), "The dnscat2 client couldn't connect to the remote host!");
   }
 
-  return out;
+  /* Don't respond to the packet... yet! */
+  return NULL;
 }
 
 static command_packet_t *handle_tunnel_data(driver_command_t *driver, command_packet_t *in)
 {
   /* TODO: Find socket by tunnel_id */
-  tunnel_t *tunnel = (tunnel_t *)ll_find(driver->tunnels, ll_32(in->r.request.body.tunnel_data.tunnel_id));
+  tunnel_t *tunnel = (tunnel_t *)hash_find(driver->tunnels, ll_32(in->r.request.body.tunnel_data.tunnel_id));
   if(!tunnel)
   {
     LOG_ERROR("Couldn't find tunnel: %d", in->r.request.body.tunnel_data.tunnel_id);
@@ -156,14 +489,19 @@ static command_packet_t *handle_tunnel_data(driver_command_t *driver, command_pa
   }
 
   LOG_INFO("[Tunnel %d] Received %zd bytes of data from client; forwarding to server", tunnel->tunnel_id, in->r.request.body.tunnel_data.length);
-  tcp_send(tunnel->s, in->r.request.body.tunnel_data.data, in->r.request.body.tunnel_data.length);
+
+  /* Line up behind anything that's still waiting (the socket will say when
+   * it's ready for it), or try to send it all now. */
+  ring_buffer_add_bytes(tunnel->unsent, in->r.request.body.tunnel_data.data, in->r.request.body.tunnel_data.length);
+  if(ring_buffer_get_length(tunnel->unsent) == in->r.request.body.tunnel_data.length)
+    flush_unsent(tunnel);
 
   return NULL;
 }
 
 static command_packet_t *handle_tunnel_close(driver_command_t *driver, command_packet_t *in)
 {
-  tunnel_t *tunnel = (tunnel_t *)ll_remove(driver->tunnels, ll_32(in->r.request.body.tunnel_data.tunnel_id));
+  tunnel_t *tunnel = (tunnel_t *)hash_remove(driver->tunnels, ll_32(in->r.request.body.tunnel_data.tunnel_id));
 
   if(!tunnel)
   {
@@ -173,10 +511,12 @@ static command_packet_t *handle_tunnel_close(driver_command_t *driver, command_p
 
   LOG_WARNING("[Tunnel %d] connection to %s:%d closed by the client: %s", tunnel->tunnel_id, tunnel->host, tunnel->port, in->r.request.body.tunnel_close.reason);
 
-  select_group_remove_socket(driver->group, tunnel->s);
-  tcp_close(tunnel->s);
-  safe_free(tunnel->host);
-  safe_free(tunnel);
+  if(tunnel->s != -1)
+  {
+    select_group_remove_socket(driver->group, tunnel->s);
+    tcp_close(tunnel->s);
+  }
+  destroy_tunnel(tunnel);
 
   return NULL;
 }
@@ -6,6 +6,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,8 +21,10 @@
 #include "controller/session.h"
 #include "controller/controller.h"
 #include "drivers/driver_exec.h"
+#include "libs/delta.h"
 #include "libs/log.h"
 #include "libs/memory.h"
+#include "libs/resolver.h"
 #include "libs/select_group.h"
 #include "libs/tcp.h"
 #include "libs/types.h"
@@ -35,6 +38,17 @@ static uint16_t request_id()
   return request_id++;
 }
 
+static void send_and_free(driver_command_t *driver, command_packet_t *out)
+{
+  uint8_t          *out_data = NULL;
+  size_t            out_length;
+
+  out_data = command_packet_to_bytes(out, &out_length);
+  ring_buffer_add_bytes(driver->outgoing_data, out_data, out_length);
+  safe_free(out_data);
+  command_packet_destroy(out);
+}
+
 /* I moved some functions into other files for better organization;
  * this includes them. */
 #include "commands_standard.h"
@@ -47,7 +61,9 @@ void driver_command_data_received(driver_command_t *driver, uint8_t *data, size_
 
   buffer_add_bytes(driver->stream, data, length);
 
-  while((in = command_packet_read(driver->stream)))
+  /* The packets only point into the stream, which is fine: nothing touches
+   * it again until they've been handled and destroyed. */
+  while((in = command_packet_read_view(driver->stream)))
   {
     /* TUNNEL_DATA commands are too noisy to print. */
     if(in->command_id != TUNNEL_DATA)
@@ -78,6 +94,14 @@ void driver_command_data_received(driver_command_t *driver, uint8_t *data, size_
         out = handle_upload(driver, in);
         break;
 
+      case COMMAND_DOWNLOAD_CHUNK:
+        out = handle_download_chunk(driver, in);
+        break;
+
+      case COMMAND_UPLOAD_CHUNK:
+        out = handle_upload_chunk(driver, in);
+        break;
+
       case COMMAND_SHUTDOWN:
         out = handle_shutdown(driver, in);
         break;
@@ -86,6 +110,22 @@ void driver_command_data_received(driver_command_t *driver, uint8_t *data, size_
         out = handle_delay(driver, in);
         break;
 
+      case COMMAND_STATS:
+        out = handle_stats(driver, in);
+        break;
+
+      case COMMAND_FILE_SIGNATURE:
+        out = handle_file_signature(driver, in);
+        break;
+
+      case COMMAND_UPLOAD_DELTA:
+        out = handle_upload_delta(driver, in);
+        break;
+
+      case COMMAND_DOWNLOAD_DELTA:
+        out = handle_download_delta(driver, in);
+        break;
+
       case TUNNEL_CONNECT:
         out = handle_tunnel_connect(driver, in);
         break;
@@ -110,31 +150,32 @@ void driver_command_data_received(driver_command_t *driver, uint8_t *data, size_
     /* Respond if and only if an outgoing packet was created. */
     if(out)
     {
-      uint8_t *data;
-      size_t   length;
-
       if(out->command_id != TUNNEL_DATA)
       {
         printf("Response: ");
         command_packet_print(out);
       }
 
-      data = command_packet_to_bytes(out, &length);
-      buffer_add_bytes(driver->outgoing_data, data, length);
-      safe_free(data);
-      command_packet_destroy(out);
+      send_and_free(driver, out);
     }
     command_packet_destroy(in);
   }
+
+  /* Keep only the partial packet (if any); otherwise, while the server keeps
+   * sending, the stream holds every byte that's ever come in. */
+  buffer_compact(driver->stream);
 }
 
 uint8_t *driver_command_get_outgoing(driver_command_t *driver, size_t *length, size_t max_length)
 {
+  /* Let the tunnels take turns filling what's wanted. */
+  schedule_tunnels(driver, max_length);
+
   /* If the driver has been killed and we have no bytes left, return NULL to close the session. */
-  if(driver->is_shutdown && buffer_get_remaining_bytes(driver->outgoing_data) == 0)
+  if(driver->is_shutdown && ring_buffer_get_length(driver->outgoing_data) == 0)
     return NULL;
 
-  return buffer_read_remaining_bytes(driver->outgoing_data, length, max_length, TRUE);
+  return ring_buffer_read_remaining_bytes(driver->outgoing_data, length, max_length);
 }
 
 driver_command_t *driver_command_create(select_group_t *group)
@@ -144,8 +185,9 @@ driver_command_t *driver_command_create(select_group_t *group)
   driver->stream        = buffer_create(BO_BIG_ENDIAN);
   driver->group         = group;
   driver->is_shutdown   = FALSE;
-  driver->outgoing_data = buffer_create(BO_LITTLE_ENDIAN);
-  driver->tunnels       = ll_create(NULL);
+  driver->outgoing_data = ring_buffer_create(COMMAND_MAX_BUFFERED);
+  driver->tunnels       = hash_create(NULL, NULL);
+  driver->last_tunnel_id = 0;
 
   return driver;
 }
@@ -160,6 +202,13 @@ void driver_command_destroy(driver_command_t *driver)
 
   if(driver->stream)
     buffer_destroy(driver->stream);
+
+  /* The tunnels' sockets point back at us, and so do any file jobs. */
+  close_all_tunnels(driver);
+  abandon_file_jobs(driver);
+  hash_destroy(driver->tunnels);
+
+  ring_buffer_destroy(driver->outgoing_data);
   safe_free(driver);
 }
 
@@ -167,3 +216,18 @@ void driver_command_close(driver_command_t *driver)
 {
   driver->is_shutdown = TRUE;
 }
+
+void driver_command_set_worker(worker_t *worker)
+{
+  g_io_worker = worker;
+}
+
+void driver_command_set_resolver(resolver_t *resolver)
+{
+  g_resolver = resolver;
+}
+
+void driver_command_set_coalesce_delay(uint32_t delay_ms)
+{
+  g_coalesce_delay = delay_ms;
+}
@@ -9,9 +9,38 @@
 #define __DRIVER_command_H__
 
 #include "command_packet.h"
-#include "libs/ll.h"
+#include "libs/hash.h"
+#include "libs/resolver.h"
+#include "libs/ring_buffer.h"
 #include "libs/select_group.h"
 #include "libs/types.h"
+#include "libs/worker.h"
+
+/* How much we queue up for each tunnel before we stop reading from it. */
+#define COMMAND_MAX_BUFFERED 16384
+
+/* How much of the server's data we hold for each tunnel's socket before the
+ * session stops taking more (see driver_command_is_full()). */
+#define TUNNEL_MAX_QUEUED 16384
+
+/* How many bytes each busy tunnel gets to send per turn (see
+ * schedule_tunnels() in commands_tunnel.h). */
+#define TUNNEL_QUANTUM 1024
+
+/* The most of a file we'll send in one COMMAND_DOWNLOAD_CHUNK response. */
+#define DOWNLOAD_MAX_CHUNK 65536
+
+/* The most signatures we'll send in one COMMAND_FILE_SIGNATURE response. */
+#define DELTA_MAX_SIGNATURES 4096
+
+/* With COMMAND_UPLOAD_DELTA, the new file is put together here (next to the
+ * old one) till it's done; DELTA_COPY_SIZE is how much of the old one is
+ * copied over at a time. */
+#define DELTA_TEMP_SUFFIX ".dnscat-delta"
+#define DELTA_COPY_SIZE   16384
+
+/* The most a tunnel holds onto before sending it, however soon that is. */
+#define TUNNEL_COALESCE_MAX 4096
 
 typedef struct
 {
@@ -19,9 +48,17 @@ typedef struct
   uint16_t        session_id;
   buffer_t       *stream;
   select_group_t *group;
-  buffer_t       *outgoing_data;
+  ring_buffer_t  *outgoing_data;
   NBBOOL          is_shutdown;
-  ll_t           *tunnels;
+  hash_t         *tunnels;
+
+  /* The tunnel that had the last turn at sending, so the next one gets the
+   * next turn. */
+  uint32_t        last_tunnel_id;
+
+  /* Downloads and uploads that are still with the I/O worker (see
+   * commands_standard.h). */
+  struct _file_job_t *file_jobs;
 } driver_command_t;
 
 driver_command_t *driver_command_create(select_group_t *group);
@@ -30,4 +67,20 @@ void driver_command_data_received(driver_command_t *driver, uint8_t *data, size_
 uint8_t *driver_command_get_outgoing(driver_command_t *driver, size_t *length, size_t max_length);
 void driver_command_close(driver_command_t *driver);
 
+/* TRUE while any tunnel's socket is so far behind that the session shouldn't
+ * give us any more. */
+NBBOOL driver_command_is_full(driver_command_t *driver);
+
+/* Do file reads and writes on this worker, so they don't hold up the other
+ * sessions (without one, they're done on the spot). */
+void driver_command_set_worker(worker_t *worker);
+
+/* Look up the hosts that tunnels connect to with this, so they don't hold up
+ * the other sessions (without one, they're looked up on the spot). */
+void driver_command_set_resolver(resolver_t *resolver);
+
+/* How long (in ms) tunnels can hold onto small reads so they go out
+ * together; 0 turns that off. */
+void driver_command_set_coalesce_delay(uint32_t delay_ms);
+
 #endif
@@ -26,21 +26,29 @@ driver_t *driver_create(driver_type_t type, void *real_driver)
 
   switch(type)
   {
+#ifndef NO_DRIVER_CONSOLE
     case DRIVER_TYPE_CONSOLE:
       driver->real_driver.console = (driver_console_t*) real_driver;
       break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
     case DRIVER_TYPE_EXEC:
       driver->real_driver.exec = (driver_exec_t*) real_driver;
       break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
     case DRIVER_TYPE_COMMAND:
       driver->real_driver.command = (driver_command_t*) real_driver;
       break;
+#endif
 
+#ifndef NO_DRIVER_PING
     case DRIVER_TYPE_PING:
       driver->real_driver.ping = (driver_ping_t*) real_driver;
       break;
+#endif
 
     default:
       LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in driver_create)\n", type);
@@ -55,21 +63,29 @@ void driver_destroy(driver_t *driver)
 {
   switch(driver->type)
   {
+#ifndef NO_DRIVER_CONSOLE
     case DRIVER_TYPE_CONSOLE:
       driver_console_destroy(driver->real_driver.console);
       break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
     case DRIVER_TYPE_EXEC:
       driver_exec_destroy(driver->real_driver.exec);
       break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
     case DRIVER_TYPE_COMMAND:
       driver_command_destroy(driver->real_driver.command);
       break;
+#endif
 
+#ifndef NO_DRIVER_PING
     case DRIVER_TYPE_PING:
       driver_ping_destroy(driver->real_driver.ping);
       break;
+#endif
 
     default:
       LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in driver_destroy)\n", driver->type);
@@ -84,21 +100,29 @@ void driver_close(driver_t *driver)
 {
   switch(driver->type)
   {
+#ifndef NO_DRIVER_CONSOLE
     case DRIVER_TYPE_CONSOLE:
       driver_console_close(driver->real_driver.console);
       break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
     case DRIVER_TYPE_EXEC:
       driver_exec_close(driver->real_driver.exec);
       break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
     case DRIVER_TYPE_COMMAND:
       driver_command_close(driver->real_driver.command);
       break;
+#endif
 
+#ifndef NO_DRIVER_PING
     case DRIVER_TYPE_PING:
       driver_ping_close(driver->real_driver.ping);
       break;
+#endif
 
     default:
       LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in driver_close)\n", driver->type);
@@ -111,21 +135,29 @@ void driver_data_received(driver_t *driver, uint8_t *data, size_t length)
 {
   switch(driver->type)
   {
+#ifndef NO_DRIVER_CONSOLE
     case DRIVER_TYPE_CONSOLE:
       driver_console_data_received(driver->real_driver.console, data, length);
       break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
     case DRIVER_TYPE_EXEC:
       driver_exec_data_received(driver->real_driver.exec, data, length);
       break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
     case DRIVER_TYPE_COMMAND:
       driver_command_data_received(driver->real_driver.command, data, length);
       break;
+#endif
 
+#ifndef NO_DRIVER_PING
     case DRIVER_TYPE_PING:
       driver_ping_data_received(driver->real_driver.ping, data, length);
       break;
+#endif
 
     default:
       LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in driver_data_received)\n", driver->type);
@@ -138,21 +170,29 @@ uint8_t *driver_get_outgoing(driver_t *driver, size_t *length, size_t max_length
 {
   switch(driver->type)
   {
+#ifndef NO_DRIVER_CONSOLE
     case DRIVER_TYPE_CONSOLE:
       return driver_console_get_outgoing(driver->real_driver.console, length, max_length);
       break;
+#endif
 
+#ifndef NO_DRIVER_EXEC
     case DRIVER_TYPE_EXEC:
       return driver_exec_get_outgoing(driver->real_driver.exec, length, max_length);
       break;
+#endif
 
+#ifndef NO_DRIVER_COMMAND
     case DRIVER_TYPE_COMMAND:
       return driver_command_get_outgoing(driver->real_driver.command, length, max_length);
       break;
+#endif
 
+#ifndef NO_DRIVER_PING
     case DRIVER_TYPE_PING:
       return driver_ping_get_outgoing(driver->real_driver.ping, length, max_length);
       break;
+#endif
 
     default:
       LOG_FATAL("UNKNOWN DRIVER TYPE! (%d in driver_get_outgoing)\n", driver->type);
@@ -161,3 +201,22 @@ uint8_t *driver_get_outgoing(driver_t *driver, size_t *length, size_t max_length
   }
 }
 
+NBBOOL driver_is_full(driver_t *driver)
+{
+  switch(driver->type)
+  {
+#ifndef NO_DRIVER_EXEC
+    case DRIVER_TYPE_EXEC:
+      return driver_exec_is_full(driver->real_driver.exec);
+#endif
+
+#ifndef NO_DRIVER_COMMAND
+    case DRIVER_TYPE_COMMAND:
+      return driver_command_is_full(driver->real_driver.command);
+#endif
+
+    /* The console and ping drivers deal with everything right away. */
+    default:
+      return FALSE;
+  }
+}
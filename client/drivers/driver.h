@@ -5,6 +5,10 @@
  *
  * This is basically a hack to make a polymorphic class in C. It just lets
  * other stuff call functions, and passes it to the appropriate implementation.
+ *
+ * A smaller build can leave any of them out with -DNO_DRIVER_CONSOLE,
+ * -DNO_DRIVER_EXEC, -DNO_DRIVER_COMMAND or -DNO_DRIVER_PING (see 'make
+ * tiny'); nothing refers to its code then, so the linker drops it.
  */
 
 #ifndef __DRIVER_H__
@@ -15,6 +19,10 @@
 #include "driver_ping.h"
 #include "drivers/command/driver_command.h"
 
+#if defined(NO_DRIVER_CONSOLE) && defined(NO_DRIVER_EXEC) && defined(NO_DRIVER_COMMAND) && defined(NO_DRIVER_PING)
+#error "There has to be at least one kind of session left to run"
+#endif
+
 typedef enum
 {
   DRIVER_TYPE_CONSOLE,
@@ -42,4 +50,10 @@ void      driver_close(driver_t *driver);
 void      driver_data_received(driver_t *driver, uint8_t *data, size_t length);
 uint8_t  *driver_get_outgoing(driver_t *driver, size_t *length, size_t max_length);
 
+/* TRUE while the driver has so much of the server's data waiting to go
+ * wherever it goes (a process's stdin, or a tunnel) that it shouldn't be
+ * given any more; the session leaves new data unacknowledged till then, so
+ * the server sends it again later. */
+NBBOOL    driver_is_full(driver_t *driver);
+
 #endif
@@ -13,7 +13,7 @@
 #include <unistd.h>
 #endif
 
-#include "libs/buffer.h"
+#include "libs/ring_buffer.h"
 #include "libs/log.h"
 #include "libs/memory.h"
 #include "libs/select_group.h"
@@ -21,12 +21,27 @@
 
 #include "driver_console.h"
 
+/* stdin, as the select_group knows it. */
+#ifdef WIN32
+#define STDIN_SOCKET -1
+#else
+#define STDIN_SOCKET STDIN_FILENO
+#endif
+
 /* There can only be one driver_console, so store these as global variables. */
 static SELECT_RESPONSE_t console_stdin_recv(void *group, int socket, uint8_t *data, size_t length, char *addr, uint16_t port, void *d)
 {
   driver_console_t *driver = (driver_console_t*) d;
 
-  buffer_add_bytes(driver->outgoing_data, data, length);
+  ring_buffer_add_bytes(driver->outgoing_data, data, length);
+
+  /* Stop reading (so a pipe into stdin blocks) till the session catches up. */
+  if(ring_buffer_is_full(driver->outgoing_data))
+  {
+    LOG_INFO("console: input buffer is full, pausing stdin");
+    select_group_pause_socket(driver->group, STDIN_SOCKET);
+    driver->is_paused = TRUE;
+  }
 
   return SELECT_OK;
 }
@@ -38,6 +53,7 @@ static SELECT_RESPONSE_t console_stdin_closed(void *group, int socket, void *d)
 
   /* Record that we've been shut down - we'll continue reading to the end of the buffer, still. */
   driver->is_shutdown = TRUE;
+  driver->is_reading  = FALSE;
 
   return SELECT_CLOSE_REMOVE;
 }
@@ -53,10 +69,21 @@ void driver_console_data_received(driver_console_t *driver, uint8_t *data, size_
 uint8_t *driver_console_get_outgoing(driver_console_t *driver, size_t *length, size_t max_length)
 {
   /* If the driver has been killed and we have no bytes left, return NULL to close the session. */
-  if(driver->is_shutdown && buffer_get_remaining_bytes(driver->outgoing_data) == 0)
+  uint8_t *data;
+
+  if(driver->is_shutdown && ring_buffer_get_length(driver->outgoing_data) == 0)
     return NULL;
 
-  return buffer_read_remaining_bytes(driver->outgoing_data, length, max_length, TRUE);
+  data = ring_buffer_read_remaining_bytes(driver->outgoing_data, length, max_length);
+
+  if(driver->is_paused && ring_buffer_is_drained(driver->outgoing_data))
+  {
+    LOG_INFO("console: input buffer has drained, resuming stdin");
+    select_group_resume_socket(driver->group, STDIN_SOCKET);
+    driver->is_paused = FALSE;
+  }
+
+  return data;
 }
 
 driver_console_t *driver_console_create(select_group_t *group)
@@ -69,19 +96,20 @@ driver_console_t *driver_console_create(select_group_t *group)
 
   driver->group         = group;
   driver->is_shutdown   = FALSE;
-  driver->outgoing_data = buffer_create(BO_LITTLE_ENDIAN);
+  driver->is_paused     = FALSE;
+  driver->is_reading    = TRUE;
+  driver->outgoing_data = ring_buffer_create(CONSOLE_MAX_BUFFERED);
 
 #ifdef WIN32
   /* On Windows, the stdin_handle is quite complicated, and involves a sub-thread. */
-  select_group_add_pipe(group, -1, stdin_handle, driver);
-  select_set_recv(group,       -1, console_stdin_recv);
-  select_set_closed(group,     -1, console_stdin_closed);
+  select_group_add_pipe(group, STDIN_SOCKET, stdin_handle, driver);
+  select_set_recv(group,       STDIN_SOCKET, console_stdin_recv);
+  select_set_closed(group,     STDIN_SOCKET, console_stdin_closed);
 #else
   /* On Linux, the stdin_handle is easy. */
-  int stdin_handle = STDIN_FILENO;
-  select_group_add_socket(group, stdin_handle, SOCKET_TYPE_STREAM, driver);
-  select_set_recv(group,         stdin_handle, console_stdin_recv);
-  select_set_closed(group,       stdin_handle, console_stdin_closed);
+  select_group_add_socket(group, STDIN_SOCKET, SOCKET_TYPE_STREAM, driver);
+  select_set_recv(group,         STDIN_SOCKET, console_stdin_recv);
+  select_set_closed(group,       STDIN_SOCKET, console_stdin_closed);
 #endif
 
   return driver;
@@ -91,6 +119,12 @@ void driver_console_destroy(driver_console_t *driver)
 {
   if(!driver->is_shutdown)
     driver_console_close(driver);
+
+  /* Don't leave stdin pointing at a freed driver. */
+  if(driver->is_reading)
+    select_group_remove_socket(driver->group, STDIN_SOCKET);
+
+  ring_buffer_destroy(driver->outgoing_data);
   safe_free(driver);
 }
 
@@ -13,14 +13,23 @@
 #ifndef __DRIVER_CONSOLE_H__
 #define __DRIVER_CONSOLE_H__
 
-#include "libs/buffer.h"
+#include "libs/ring_buffer.h"
 #include "libs/select_group.h"
 
+/* How much input we hold before we stop reading stdin. */
+#define CONSOLE_MAX_BUFFERED 16384
+
 typedef struct
 {
   select_group_t *group;
-  buffer_t       *outgoing_data;
+  ring_buffer_t  *outgoing_data;
   NBBOOL          is_shutdown;
+
+  /* Set while we're not reading because outgoing_data is full. */
+  NBBOOL          is_paused;
+
+  /* Set till stdin closes (and the select_group forgets it). */
+  NBBOOL          is_reading;
 } driver_console_t;
 
 driver_console_t *driver_console_create(select_group_t *group);
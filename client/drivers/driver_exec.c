@@ -11,12 +11,14 @@
 #include <string.h>
 
 #ifndef WIN32
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 #include <signal.h>
 #endif
 
-#include "libs/buffer.h"
+#include "libs/ring_buffer.h"
 #include "libs/log.h"
 #include "libs/memory.h"
 #include "libs/select_group.h"
@@ -32,13 +34,65 @@
  * https://github.com/iagox86/dnscat2/issues/61
  */
 int kill(pid_t pid, int sig);
+
+/* Once the process has been told to stop, how often (in ms) we check whether
+ * it has, and how many times before it's SIGKILLed instead. */
+#define REAP_INTERVAL 100
+#define REAP_TRIES    20
+
+/* A process that didn't exit right away, which outlives its driver; it
+ * belongs to the timer that checks on it (see
+ * select_group_add_owned_timer()). */
+typedef struct
+{
+  pid_t pid;
+  int   tries;
+} reaper_t;
+
+static SELECT_RESPONSE_t reap_timeout(void *group, void *param)
+{
+  reaper_t *reaper = (reaper_t*) param;
+  pid_t     result = waitpid(reaper->pid, NULL, WNOHANG);
+
+  /* (-1 means it isn't ours to wait for any more; when SIGCHLD is ignored,
+   * the system reaps it for us.) */
+  if(result == 0 && ++reaper->tries < REAP_TRIES)
+    return SELECT_OK;
+
+  if(result == 0)
+  {
+    LOG_WARNING("exec: process %d didn't exit; killing it", reaper->pid);
+    kill(reaper->pid, SIGKILL);
+    waitpid(reaper->pid, NULL, 0);
+  }
+
+  return SELECT_REMOVE;
+}
+#endif
+
+/* The process's stdout, as the select_group knows it. */
+static int get_socket(driver_exec_t *driver)
+{
+#ifdef WIN32
+  return driver->socket_id;
+#else
+  return driver->pipe_stdout[PIPE_READ];
 #endif
+}
 
 static SELECT_RESPONSE_t exec_callback(void *group, int socket, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
 {
   driver_exec_t *driver = (driver_exec_t*) param;
 
-  buffer_add_bytes(driver->outgoing_data, data, length);
+  ring_buffer_add_bytes(driver->outgoing_data, data, length);
+
+  /* Let the process block on its output till the session catches up. */
+  if(ring_buffer_is_full(driver->outgoing_data))
+  {
+    LOG_INFO("exec: output buffer is full, pausing the process's output");
+    select_group_pause_socket(driver->group, get_socket(driver));
+    driver->is_paused = TRUE;
+  }
 
   return SELECT_OK;
 }
@@ -50,28 +104,119 @@ static SELECT_RESPONSE_t exec_closed_callback(void *group, int socket, void *d)
 
   /* Record that we've been shut down - we'll continue reading to the end of the buffer, still. */
   driver->is_shutdown = TRUE;
+  driver->is_reading  = FALSE;
 
   return SELECT_CLOSE_REMOVE;
 }
 
+#ifndef WIN32
+/* Give the process's stdin as much of what's queued as it'll take, and wait
+ * for it to take the rest. */
+static void flush_incoming(driver_exec_t *driver)
+{
+  uint8_t *data;
+  size_t   length;
+  ssize_t  written;
+
+  while(driver->is_writing && ring_buffer_get_length(driver->incoming_data) > 0)
+  {
+    length  = ring_buffer_peek(driver->incoming_data, 0, &data);
+    written = write(driver->pipe_stdin[PIPE_WRITE], data, length);
+
+    if(written < 0)
+    {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        select_group_wait_for_writable(driver->group, driver->pipe_stdin[PIPE_WRITE]);
+        return;
+      }
+
+      LOG_ERROR("exec: couldn't write to the process (%d); throwing away %zd bytes", errno, ring_buffer_get_length(driver->incoming_data));
+      ring_buffer_consume(driver->incoming_data, ring_buffer_get_length(driver->incoming_data));
+      return;
+    }
+
+    ring_buffer_consume(driver->incoming_data, written);
+  }
+}
+
+static SELECT_RESPONSE_t exec_stdin_ready(void *group, int socket, void *param)
+{
+  flush_incoming((driver_exec_t*) param);
+
+  return SELECT_OK;
+}
+
+/* The stdin pipe is never readable, so this is the process closing its end. */
+static SELECT_RESPONSE_t exec_stdin_closed(void *group, int socket, void *param)
+{
+  driver_exec_t *driver = (driver_exec_t*) param;
+
+  LOG_WARNING("exec: the process closed its stdin");
+  ring_buffer_consume(driver->incoming_data, ring_buffer_get_length(driver->incoming_data));
+  driver->is_writing = FALSE;
+
+  return SELECT_REMOVE;
+}
+
+static SELECT_RESPONSE_t exec_stdin_error(void *group, int socket, int err, void *param)
+{
+  return exec_stdin_closed(group, socket, param);
+}
+#endif
+
 void driver_exec_data_received(driver_exec_t *driver, uint8_t *data, size_t length)
 {
 #ifdef WIN32
+  /* CreatePipe() pipes can't be waited on, so this still blocks. */
   DWORD written;
   WriteFile(driver->exec_stdin[PIPE_WRITE], data, (DWORD)length, &written, NULL);
 #else
-  if(write(driver->pipe_stdin[PIPE_WRITE], data, length) != length)
-    LOG_ERROR("There was a problem writing data. :(");
+  ssize_t written = 0;
+
+  if(!driver->is_writing)
+    return;
+
+  /* Skip the queue if there isn't one. */
+  if(ring_buffer_get_length(driver->incoming_data) == 0)
+  {
+    written = write(driver->pipe_stdin[PIPE_WRITE], data, length);
+    if(written < 0)
+      written = 0;
+  }
+
+  /* flush_incoming() finds out about errors. */
+  if((size_t)written < length)
+  {
+    ring_buffer_add_bytes(driver->incoming_data, data + written, length - written);
+    flush_incoming(driver);
+  }
 #endif
 }
 
+NBBOOL driver_exec_is_full(driver_exec_t *driver)
+{
+  return ring_buffer_is_full(driver->incoming_data);
+}
+
 uint8_t *driver_exec_get_outgoing(driver_exec_t *driver, size_t *length, size_t max_length)
 {
   /* If the driver has been killed and we have no bytes left, return NULL to close the session. */
-  if(driver->is_shutdown && buffer_get_remaining_bytes(driver->outgoing_data) == 0)
+  uint8_t *data;
+
+  if(driver->is_shutdown && ring_buffer_get_length(driver->outgoing_data) == 0)
     return NULL;
 
-  return buffer_read_remaining_bytes(driver->outgoing_data, length, max_length, TRUE);
+  data = ring_buffer_read_remaining_bytes(driver->outgoing_data, length, max_length);
+
+  if(driver->is_paused && ring_buffer_is_drained(driver->outgoing_data))
+  {
+    LOG_INFO("exec: output buffer has drained, resuming the process's output");
+    select_group_resume_socket(driver->group, get_socket(driver));
+    driver->is_paused = FALSE;
+  }
+
+  return data;
 }
 
 driver_exec_t *driver_exec_create(select_group_t *group, char *process)
@@ -87,7 +232,10 @@ driver_exec_t *driver_exec_create(select_group_t *group, char *process)
 
   driver->process       = process;
   driver->group         = group;
-  driver->outgoing_data = buffer_create(BO_BIG_ENDIAN);
+  driver->outgoing_data = ring_buffer_create(EXEC_MAX_BUFFERED);
+  driver->incoming_data = ring_buffer_create(EXEC_MAX_QUEUED);
+  driver->is_paused     = FALSE;
+  driver->is_reading    = TRUE;
 
 #ifdef WIN32
   /* Create a security attributes structure. This is required to inherit handles. */
@@ -96,10 +244,10 @@ driver_exec_t *driver_exec_create(select_group_t *group, char *process)
   sa.lpSecurityDescriptor = NULL;
   sa.bInheritHandle       = TRUE;
 
-  /* Create the anonymous pipes. */
+  /* Create the pipes; stdout is read through the select_group, so it needs one of its pipes. */
   if(!CreatePipe(&driver->exec_stdin[PIPE_READ], &driver->exec_stdin[PIPE_WRITE], &sa, 0))
     DIE("exec: Couldn't create pipe for stdin");
-  if(!CreatePipe(&driver->exec_stdout[PIPE_READ], &driver->exec_stdout[PIPE_WRITE], &sa, 0))
+  if(!select_group_create_pipe(&driver->exec_stdout[PIPE_READ], &driver->exec_stdout[PIPE_WRITE], &sa))
     DIE("exec: Couldn't create pipe for stdout");
 
   fprintf(stderr, "Attempting to load the program: %s\n", driver->process);
@@ -193,6 +341,14 @@ driver_exec_t *driver_exec_create(select_group_t *group, char *process)
   select_group_add_socket(driver->group, driver->pipe_stdout[PIPE_READ], SOCKET_TYPE_STREAM, driver);
   select_set_recv(driver->group,         driver->pipe_stdout[PIPE_READ], exec_callback);
   select_set_closed(driver->group,       driver->pipe_stdout[PIPE_READ], exec_closed_callback);
+
+  /* And its stdin, so it can be written to whenever there's room. */
+  fcntl(driver->pipe_stdin[PIPE_WRITE], F_SETFL, O_NONBLOCK);
+  select_group_add_socket(driver->group, driver->pipe_stdin[PIPE_WRITE], SOCKET_TYPE_STREAM, driver);
+  select_set_ready(driver->group,        driver->pipe_stdin[PIPE_WRITE], exec_stdin_ready);
+  select_set_error(driver->group,        driver->pipe_stdin[PIPE_WRITE], exec_stdin_error);
+  select_set_closed(driver->group,       driver->pipe_stdin[PIPE_WRITE], exec_stdin_closed);
+  driver->is_writing = TRUE;
 #endif
 
   return driver;
@@ -200,8 +356,39 @@ driver_exec_t *driver_exec_create(select_group_t *group, char *process)
 
 void driver_exec_destroy(driver_exec_t *driver)
 {
+#ifndef WIN32
+  reaper_t *reaper;
+#endif
+
   if(!driver->is_shutdown)
     driver_exec_close(driver);
+
+  /* The session can be destroyed before the process closes its end, and the
+   * select_group mustn't call back into a freed driver. */
+#ifdef WIN32
+  if(driver->is_reading)
+    select_group_remove_socket(driver->group, driver->socket_id);
+  CloseHandle(driver->exec_stdin[PIPE_WRITE]);
+#else
+  if(driver->is_reading)
+    select_group_remove_and_close_socket(driver->group, driver->pipe_stdout[PIPE_READ]);
+  if(driver->is_writing)
+    select_group_remove_socket(driver->group, driver->pipe_stdin[PIPE_WRITE]);
+  close(driver->pipe_stdin[PIPE_WRITE]);
+
+  /* It got a SIGINT (or closed its output); reap it if it's gone already,
+   * otherwise keep checking till it is, so it isn't left a zombie. */
+  if(waitpid(driver->pid, NULL, WNOHANG) == 0)
+  {
+    reaper = (reaper_t*) safe_malloc(sizeof(reaper_t));
+    reaper->pid   = driver->pid;
+    reaper->tries = 0;
+    select_group_add_owned_timer(driver->group, REAP_INTERVAL, REAP_INTERVAL, reap_timeout, reaper);
+  }
+#endif
+
+  ring_buffer_destroy(driver->outgoing_data);
+  ring_buffer_destroy(driver->incoming_data);
   safe_free(driver);
 }
 
@@ -14,16 +14,35 @@
 
 #include <sys/types.h>
 
-#include "libs/buffer.h"
+#include "libs/ring_buffer.h"
 #include "libs/select_group.h"
 
+/* How much output we hold before we stop reading from the process. */
+#define EXEC_MAX_BUFFERED 16384
+
+/* How much of the server's data we hold for the process's stdin before the
+ * session stops taking more (see driver_exec_is_full()). */
+#define EXEC_MAX_QUEUED 16384
+
 typedef struct
 {
   char           *process;
   select_group_t *group;
-  buffer_t       *outgoing_data;
+  ring_buffer_t  *outgoing_data;
   NBBOOL          is_shutdown;
 
+  /* Data for the process's stdin that the pipe wouldn't take yet. */
+  ring_buffer_t  *incoming_data;
+
+  /* Set till the process's stdin breaks (and the select_group forgets it). */
+  NBBOOL          is_writing;
+
+  /* Set while we're not reading because outgoing_data is full. */
+  NBBOOL          is_paused;
+
+  /* Set till the process's output closes (and the select_group forgets it). */
+  NBBOOL          is_reading;
+
 #ifdef WIN32
   HANDLE exec_stdin[2];  /* The stdin handle. */
   HANDLE exec_stdout[2]; /* The stdout handle. */
@@ -41,6 +60,10 @@ driver_exec_t *driver_exec_create(select_group_t *group, char *process);
 void           driver_exec_destroy(driver_exec_t *driver);
 void           driver_exec_data_received(driver_exec_t *driver, uint8_t *data, size_t length);
 uint8_t       *driver_exec_get_outgoing(driver_exec_t *driver, size_t *length, size_t max_length);
+
+/* TRUE while the process is so far behind on its stdin that the session
+ * shouldn't give it any more. */
+NBBOOL         driver_exec_is_full(driver_exec_t *driver);
 void           driver_exec_close(driver_exec_t *driver);
 
 #endif
@@ -0,0 +1,100 @@
+/* arena.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <string.h>
+
+#include "memory.h"
+
+#include "arena.h"
+
+/* Everything we hand out is aligned for whatever might be stored in it. */
+typedef union
+{
+  long    l;
+  double  d;
+  void   *p;
+} arena_align_t;
+
+#define ALIGNMENT          (sizeof(arena_align_t))
+#define ALIGN(size)        (((size) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+#define BLOCK_HEADER_SIZE  ALIGN(sizeof(arena_block_t))
+#define BLOCK_DATA(block)  ((uint8_t*)(block) + BLOCK_HEADER_SIZE)
+
+static arena_block_t *block_create(size_t size)
+{
+  arena_block_t *block = (arena_block_t*) safe_malloc(BLOCK_HEADER_SIZE + size);
+
+  block->next = NULL;
+  block->size = size;
+  block->used = 0;
+
+  return block;
+}
+
+arena_t *arena_create(size_t size)
+{
+  arena_t *arena = (arena_t*) safe_malloc(sizeof(arena_t));
+
+  arena->first   = block_create(ALIGN(size));
+  arena->current = arena->first;
+
+  return arena;
+}
+
+void arena_destroy(arena_t *arena)
+{
+  arena_reset(arena);
+  safe_free(arena->first);
+  safe_free(arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+  arena_block_t *block = arena->current;
+  void          *result;
+
+  size = ALIGN(size);
+
+  /* If it doesn't fit, start an overflow block (at least as big as the
+   * first one, so a busy round doesn't allocate a block per object). */
+  if(block->size - block->used < size)
+  {
+    block->next = block_create(MAX(size, arena->first->size));
+    block = arena->current = block->next;
+  }
+
+  result = BLOCK_DATA(block) + block->used;
+  block->used += size;
+
+  memset(result, 0, size);
+
+  return result;
+}
+
+char *arena_strdup(arena_t *arena, const char *str)
+{
+  size_t length = strlen(str) + 1;
+
+  return (char*) memcpy(arena_alloc(arena, length), str, length);
+}
+
+void arena_reset(arena_t *arena)
+{
+  arena_block_t *block = arena->first->next;
+  arena_block_t *next;
+
+  while(block)
+  {
+    next = block->next;
+    safe_free(block);
+    block = next;
+  }
+
+  arena->first->next = NULL;
+  arena->first->used = 0;
+  arena->current     = arena->first;
+}
@@ -0,0 +1,50 @@
+/* arena.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Implements a simple bump allocator, for short-lived objects that are all
+ * thrown away at once (like a parsed DNS packet). Allocating is just moving
+ * a pointer, and there's no freeing individual objects: arena_reset() makes
+ * all the memory available again. If the first block fills up, more are
+ * allocated, and those are released by the next reset.
+ */
+
+#ifndef __ARENA_H__
+#define __ARENA_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+typedef struct _arena_block_t
+{
+  struct _arena_block_t *next;
+  size_t                 size;
+  size_t                 used;
+} arena_block_t;
+
+typedef struct
+{
+  /* The block that's always kept, followed by any overflow blocks. */
+  arena_block_t *first;
+  arena_block_t *current;
+} arena_t;
+
+/* Create an arena with a (reused) first block of the given size. */
+arena_t *arena_create(size_t size);
+
+/* Free the arena and everything that was allocated from it. */
+void     arena_destroy(arena_t *arena);
+
+/* Allocate zeroed, aligned memory from the arena. Never returns NULL. */
+void    *arena_alloc(arena_t *arena, size_t size);
+
+/* Copy a string into the arena. */
+char    *arena_strdup(arena_t *arena, const char *str);
+
+/* Throw away everything allocated so far. */
+void     arena_reset(arena_t *arena);
+
+#endif
@@ -138,6 +138,18 @@ buffer_t *buffer_create_with_data(BYTE_ORDER_t byte_order, const void *data, con
   return new_buffer;
 }
 
+void buffer_init_view(buffer_t *buffer, BYTE_ORDER_t byte_order, const uint8_t *data, size_t length)
+{
+  memset(buffer, 0, sizeof(buffer_t));
+
+  buffer->byte_order     = byte_order;
+  buffer->valid          = TRUE;
+  buffer->is_view        = TRUE;
+  buffer->max_length     = length;
+  buffer->current_length = length;
+  buffer->data           = (uint8_t*)data;
+}
+
 /* Go to the start of the buffer. */
 void buffer_reset(buffer_t *buffer)
 {
@@ -149,6 +161,8 @@ void buffer_destroy(buffer_t *buffer)
 {
   if(!buffer->valid)
     DIE("Program attempted to use deleted buffer.");
+  if(buffer->is_view)
+    DIE("Program attempted to destroy a view.");
   buffer->valid = FALSE;
 
   memset(buffer->data, 0, buffer->max_length);
@@ -166,8 +180,9 @@ buffer_t *buffer_duplicate(buffer_t *base)
   /* Make an exact copy (won't copy pointers properly). */
   memcpy(new, base, sizeof(buffer_t));
 
-  /* Create a new 'data' pointer. */
-  new->data = safe_malloc(new->max_length);
+  /* Create a new 'data' pointer (a copy of a view isn't a view). */
+  new->data = safe_malloc_nozero(new->max_length);
+  new->is_view = FALSE;
 
   /* Copy the data into the new data pointer. */
   memcpy(new->data, base->data, new->max_length);
@@ -197,6 +212,9 @@ size_t buffer_get_remaining_bytes(buffer_t *buffer)
 
 void buffer_clear(buffer_t *buffer)
 {
+  if(buffer->is_view)
+    DIE("Program attempted to clear a view.");
+
   memset(buffer->data, 0, buffer->current_length);
   buffer->position = 0;
   buffer->current_length = 0;
@@ -219,6 +237,19 @@ void buffer_consume(buffer_t *buffer, size_t count)
   buffer->position += count;
 }
 
+void buffer_compact(buffer_t *buffer)
+{
+  size_t remaining = buffer_get_remaining_bytes(buffer);
+
+  if(buffer->is_view)
+    DIE("Program attempted to compact a view.");
+
+  memmove(buffer->data, buffer->data + buffer->position, remaining);
+  memset(buffer->data + remaining, 0, buffer->current_length - remaining);
+  buffer->position = 0;
+  buffer->current_length = remaining;
+}
+
 uint8_t *buffer_create_string(buffer_t *buffer, size_t *length)
 {
   uint8_t *ret;
@@ -226,7 +257,7 @@ uint8_t *buffer_create_string(buffer_t *buffer, size_t *length)
   if(!buffer->valid)
     DIE("Program attempted to use deleted buffer.");
 
-  ret = safe_malloc(buffer_get_length(buffer));
+  ret = safe_malloc_nozero(buffer_get_length(buffer));
   memcpy(ret, buffer->data, buffer_get_length(buffer));
 
   if(length)
@@ -264,7 +295,9 @@ uint8_t *buffer_read_remaining_bytes(buffer_t *buffer, size_t *length, size_t ma
   if(*length+1 < *length)
     DIE("Overflow.");
 
-  ret = safe_malloc(*length+1);
+  /* (With a NUL after it, in case it's going to be used as a string.) */
+  ret = safe_malloc_nozero(*length+1);
+  ret[*length] = '\0';
 
   /* Copy the data into the new buffer */
   if(consume)
@@ -276,6 +309,29 @@ uint8_t *buffer_read_remaining_bytes(buffer_t *buffer, size_t *length, size_t ma
   return ret;
 }
 
+uint8_t *buffer_read_remaining_bytes_view(buffer_t *buffer, size_t *length, size_t max_bytes, NBBOOL consume)
+{
+  uint8_t *ret;
+
+  if(!buffer->valid)
+    DIE("Program attempted to use a deleted buffer.");
+
+  if(buffer->current_length < buffer->position)
+    DIE("Position is outside the buffer");
+
+  *length = buffer->current_length - buffer->position;
+
+  if(max_bytes != (size_t)-1 && *length > max_bytes)
+    *length = max_bytes;
+
+  ret = buffer->data + buffer->position;
+
+  if(consume)
+    buffer->position += *length;
+
+  return ret;
+}
+
 /* Add data to the end of the buffer */
 buffer_t *buffer_add_int8(buffer_t *buffer, const uint8_t data)
 {
@@ -370,6 +426,9 @@ buffer_t *buffer_add_bytes(buffer_t *buffer, const void *data, const size_t leng
   if(length >= 0x80000000)
     DIE("Too big!");
 
+  if(buffer->is_view)
+    DIE("Program attempted to add to a view.");
+
   /* Resize the buffer, if necessary. */
   if(buffer->current_length + length > buffer->max_length)
   {
@@ -705,8 +764,16 @@ void *buffer_read_bytes_at(buffer_t *buffer, size_t offset, void *data, size_t l
 
 char *buffer_alloc_ntstring_at(buffer_t *buffer, size_t offset)
 {
-  size_t length = strlen((char*)buffer->data + offset) + 1;
-  char *data_ret = safe_malloc(length);
+  size_t length = 0;
+  char *data_ret;
+
+  /* (Don't go past the end looking for the NUL; buffer_read_ntstring_at()
+   * will complain if there isn't one.) */
+  while(offset + length < buffer->current_length && buffer->data[offset + length])
+    length++;
+  length++;
+
+  data_ret = safe_malloc(length);
 
   /* Catch overflows. */
   if(length == 0)
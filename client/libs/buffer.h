@@ -56,6 +56,10 @@ typedef struct
    * re-use it (again) */
   NBBOOL valid;
 
+  /* Set for buffer_init_view(): data belongs to someone else, and can only
+   * be read. */
+  NBBOOL is_view;
+
 } buffer_t;
 
 /* Create a new packet buffer */
@@ -64,6 +68,11 @@ buffer_t *buffer_create(BYTE_ORDER_t byte_order);
 /* Create a new packet buffer, with data. */
 buffer_t *buffer_create_with_data(BYTE_ORDER_t byte_order, const void *data, const size_t length);
 
+/* Set up a buffer (usually on the stack) for reading the given data where
+ * it is, without copying it. It's only good while the data is; nothing can
+ * be added to it, and it mustn't be passed to buffer_destroy(). */
+void buffer_init_view(buffer_t *buffer, BYTE_ORDER_t byte_order, const uint8_t *data, size_t length);
+
 /* Go to the start of the buffer. */
 void buffer_reset(buffer_t *buffer);
 
@@ -95,6 +104,11 @@ void buffer_write_align(buffer_t *buffer, size_t align);
 /* Consume (discard) bytes. */
 void buffer_consume(buffer_t *buffer, size_t count);
 
+/* Throw away what's already been read, moving the rest to the front (so a
+ * buffer that's read from as it's added to doesn't keep growing). The memory
+ * is kept. */
+void buffer_compact(buffer_t *buffer);
+
 /* Return the contents of the buffer in a newly allocated string. Fill in the length, if a pointer
  * is given. Note that this allocates memory that has to be freed! */
 uint8_t *buffer_create_string(buffer_t *buffer, size_t *length);
@@ -105,6 +119,10 @@ uint8_t *buffer_create_string_and_destroy(buffer_t *buffer, size_t *length);
  * string. Returns the length in the length pointer. If max_bytes is -1, all bytes are returned. */
 uint8_t *buffer_read_remaining_bytes(buffer_t *buffer, size_t *length, size_t max_bytes, NBBOOL consume);
 
+/* The same, but returns a pointer into the buffer instead of a copy; it's
+ * only good till the buffer is changed or destroyed. */
+uint8_t *buffer_read_remaining_bytes_view(buffer_t *buffer, size_t *length, size_t max_bytes, NBBOOL consume);
+
 /* Add data to the end of the buffer */
 buffer_t *buffer_add_int8(buffer_t *buffer,      const uint8_t data);
 buffer_t *buffer_add_int16(buffer_t *buffer,     const uint16_t data);
@@ -0,0 +1,193 @@
+/* compressor.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "memory.h"
+
+#include "compressor.h"
+
+#define WINDOW_MASK (COMPRESSOR_WINDOW - 1)
+
+compressor_t *compressor_create()
+{
+  compressor_t *compressor = (compressor_t*) safe_malloc(sizeof(compressor_t));
+
+  compressor->out_window       = (uint8_t*) safe_malloc(COMPRESSOR_WINDOW);
+  compressor->out_hash         = (uint32_t*) safe_malloc(COMPRESSOR_HASH_SIZE * sizeof(uint32_t));
+  compressor->out_position     = 0;
+
+  compressor->in_window        = (uint8_t*) safe_malloc(COMPRESSOR_WINDOW);
+  compressor->in_position      = 0;
+  compressor->in_token_length  = 0;
+  compressor->in_literals_left = 0;
+
+  return compressor;
+}
+
+void compressor_destroy(compressor_t *compressor)
+{
+  safe_free(compressor->out_window);
+  safe_free(compressor->out_hash);
+  safe_free(compressor->in_window);
+  safe_free(compressor);
+}
+
+static uint32_t hash(uint8_t *data)
+{
+  uint32_t value = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | data[3];
+
+  /* Knuth's multiplicative hash, keeping the top 12 bits. */
+  return (uint32_t)(value * 2654435761UL) >> 20;
+}
+
+/* Read a byte from the stream; anything before this call's data comes from
+ * the window. */
+static uint8_t stream_byte(compressor_t *compressor, uint8_t *data, size_t length, uint32_t position)
+{
+  uint32_t offset = position - compressor->out_position;
+
+  if(offset < length)
+    return data[offset];
+
+  return compressor->out_window[position & WINDOW_MASK];
+}
+
+static size_t add_literals(uint8_t *out, size_t out_length, uint8_t *data, size_t length)
+{
+  while(length > 0)
+  {
+    size_t run = MIN(length, COMPRESSOR_MAX_RUN);
+
+    out[out_length++] = (uint8_t)(run - 1);
+    memcpy(out + out_length, data, run);
+
+    out_length += run;
+    data       += run;
+    length     -= run;
+  }
+
+  return out_length;
+}
+
+uint8_t *compressor_compress(compressor_t *compressor, uint8_t *data, size_t length, size_t *out_length)
+{
+  /* Literals cost one extra byte per run, and a match never costs more than
+   * it saves, so this is as big as it gets. */
+  uint8_t *out       = (uint8_t*) safe_malloc(length + (length / COMPRESSOR_MAX_RUN) + 1);
+  size_t   i         = 0;
+  size_t   run_start = 0;
+  size_t   j;
+
+  *out_length = 0;
+
+  while(i < length)
+  {
+    uint32_t here         = compressor->out_position + (uint32_t)i;
+    uint32_t distance     = 0;
+    size_t   match_length = 0;
+
+    if(length - i >= COMPRESSOR_MIN_MATCH)
+    {
+      uint32_t *bucket    = &compressor->out_hash[hash(data + i)];
+      uint32_t  candidate = *bucket;
+
+      *bucket = here + 1;
+
+      if(candidate)
+      {
+        candidate -= 1;
+        distance   = here - candidate;
+
+        if(distance > 0 && distance <= COMPRESSOR_WINDOW)
+        {
+          while(match_length < COMPRESSOR_MAX_MATCH && i + match_length < length && stream_byte(compressor, data, length, candidate + (uint32_t)match_length) == data[i + match_length])
+            match_length++;
+        }
+      }
+    }
+
+    if(match_length < COMPRESSOR_MIN_MATCH)
+    {
+      i++;
+      continue;
+    }
+
+    *out_length = add_literals(out, *out_length, data + run_start, i - run_start);
+
+    out[(*out_length)++] = (uint8_t)(0x80 | (match_length - COMPRESSOR_MIN_MATCH));
+    out[(*out_length)++] = (uint8_t)((distance - 1) >> 8);
+    out[(*out_length)++] = (uint8_t)((distance - 1) & 0xFF);
+
+    /* Remember where the rest of the match was, too; it helps a lot with
+     * repetitive text. */
+    for(j = 1; j < match_length && i + j + COMPRESSOR_MIN_MATCH <= length; j++)
+      compressor->out_hash[hash(data + i + j)] = here + (uint32_t)j + 1;
+
+    i        += match_length;
+    run_start = i;
+  }
+
+  *out_length = add_literals(out, *out_length, data + run_start, length - run_start);
+
+  /* Only the end of the data can matter for the next call. */
+  for(i = (length > COMPRESSOR_WINDOW) ? length - COMPRESSOR_WINDOW : 0; i < length; i++)
+    compressor->out_window[(compressor->out_position + i) & WINDOW_MASK] = data[i];
+  compressor->out_position += (uint32_t)length;
+
+  return out;
+}
+
+static void put_byte(compressor_t *compressor, buffer_t *out, uint8_t b)
+{
+  compressor->in_window[compressor->in_position & WINDOW_MASK] = b;
+  compressor->in_position++;
+
+  buffer_add_int8(out, b);
+}
+
+uint8_t *compressor_decompress(compressor_t *compressor, uint8_t *data, size_t length, size_t *out_length)
+{
+  buffer_t *out = buffer_create(BO_BIG_ENDIAN);
+  size_t    i;
+  size_t    j;
+
+  for(i = 0; i < length; i++)
+  {
+    uint8_t *token = compressor->in_token;
+
+    if(compressor->in_literals_left > 0)
+    {
+      put_byte(compressor, out, data[i]);
+      compressor->in_literals_left--;
+      continue;
+    }
+
+    token[compressor->in_token_length++] = data[i];
+
+    if(!(token[0] & 0x80))
+    {
+      compressor->in_literals_left = token[0] + 1;
+      compressor->in_token_length  = 0;
+    }
+    else if(compressor->in_token_length == 3)
+    {
+      size_t   match_length = (token[0] & 0x7F) + COMPRESSOR_MIN_MATCH;
+      uint32_t distance     = (((uint32_t)token[1] << 8) | token[2]) + 1;
+
+      /* One byte at a time, since a match can overlap what it's creating. */
+      for(j = 0; j < match_length; j++)
+        put_byte(compressor, out, compressor->in_window[(compressor->in_position - distance) & WINDOW_MASK]);
+
+      compressor->in_token_length = 0;
+    }
+  }
+
+  return buffer_create_string_and_destroy(out, out_length);
+}
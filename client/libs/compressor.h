@@ -0,0 +1,61 @@
+/* compressor.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A little streaming LZ77 compressor for session data (negotiated with
+ * OPT_COMPRESSED). Both directions remember the last COMPRESSOR_WINDOW bytes
+ * they've seen, so a match can point back into earlier packets; that's what
+ * makes it worthwhile for shell output, which arrives a line at a time.
+ *
+ * The stream is a series of tokens:
+ *
+ * - 0x00 - 0x7F: a literal run; the next (n + 1) bytes are copied as-is
+ * - 0x80 - 0xFF: a match of ((n & 0x7F) + 4) bytes, followed by a uint16_t
+ *   (big endian) distance, minus one, to where it starts
+ *
+ * Everything that's passed to compressor_compress() comes out right away
+ * (nothing is held back), and compressor_decompress() doesn't care where the
+ * stream was split.
+ */
+
+#ifndef __COMPRESSOR_H__
+#define __COMPRESSOR_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+#define COMPRESSOR_WINDOW     0x10000
+#define COMPRESSOR_HASH_SIZE  0x1000
+#define COMPRESSOR_MIN_MATCH  4
+#define COMPRESSOR_MAX_MATCH  (0x7F + COMPRESSOR_MIN_MATCH)
+#define COMPRESSOR_MAX_RUN    0x80
+
+typedef struct
+{
+  /* The last COMPRESSOR_WINDOW bytes that went into the compressor, and where
+   * (in the whole stream) each 4-byte sequence was last seen, plus one. */
+  uint8_t  *out_window;
+  uint32_t *out_hash;
+  uint32_t  out_position;
+
+  /* The last COMPRESSOR_WINDOW bytes that came out of the decompressor, and
+   * whatever part of a token we've seen so far. */
+  uint8_t  *in_window;
+  uint32_t  in_position;
+  uint8_t   in_token[3];
+  size_t    in_token_length;
+  size_t    in_literals_left;
+} compressor_t;
+
+compressor_t *compressor_create();
+void compressor_destroy(compressor_t *compressor);
+
+/* Both of these return a newly allocated buffer (which the caller frees) and
+ * set *out_length. */
+uint8_t *compressor_compress(compressor_t *compressor, uint8_t *data, size_t length, size_t *out_length);
+uint8_t *compressor_decompress(compressor_t *compressor, uint8_t *data, size_t length, size_t *out_length);
+
+#endif
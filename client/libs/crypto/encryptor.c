@@ -11,7 +11,6 @@
 #include <stdio.h>
 #include <string.h>
 
-#include "libs/buffer.h"
 #include "libs/crypto/sha3.h"
 #include "libs/crypto/salsa20.h"
 #include "libs/crypto/micro-ecc/uECC.h"
@@ -24,7 +23,6 @@
 #define SAS_AUTHSTRING ("authstring")
 
 #define HEADER_LENGTH 5
-#define SIGNATURE_LENGTH 6
 
 static void make_key(encryptor_t *encryptor, char *key_name, uint8_t *result)
 {
@@ -49,23 +47,101 @@ static void make_authenticator(encryptor_t *encryptor, char *authstring, uint8_t
   sha3_final(&ctx, buffer);
 }
 
+/* Key pairs generated ahead of time, so a new session (or a renegotiation)
+ * doesn't have to wait for one. */
+typedef struct
+{
+  uint8_t private_key[32];
+  uint8_t public_key[64];
+} key_pair_t;
+
+static key_pair_t key_pool[ENCRYPTOR_KEY_POOL_SIZE];
+static size_t     key_pool_count = 0;
+
+NBBOOL encryptor_make_key_pair(uint8_t *public_key, uint8_t *private_key)
+{
+  return (NBBOOL)uECC_make_key(public_key, private_key, uECC_secp256r1());
+}
+
+NBBOOL encryptor_key_pool_is_full()
+{
+  return key_pool_count >= ENCRYPTOR_KEY_POOL_SIZE;
+}
+
+void encryptor_add_to_key_pool(uint8_t *public_key, uint8_t *private_key)
+{
+  key_pair_t *pair;
+
+  if(encryptor_key_pool_is_full())
+    return;
+
+  pair = &key_pool[key_pool_count++];
+  memcpy(pair->public_key,  public_key,  64);
+  memcpy(pair->private_key, private_key, 32);
+}
+
+NBBOOL encryptor_fill_key_pool()
+{
+  key_pair_t pair;
+
+  if(encryptor_key_pool_is_full())
+    return FALSE;
+
+  if(!encryptor_make_key_pair(pair.public_key, pair.private_key))
+    return FALSE;
+
+  encryptor_add_to_key_pool(pair.public_key, pair.private_key);
+  memset(&pair, 0, sizeof(key_pair_t));
+
+  return TRUE;
+}
+
 encryptor_t *encryptor_create(char *preshared_secret)
 {
   encryptor_t *encryptor = safe_malloc(sizeof(encryptor_t));
 
-  if(!uECC_make_key(encryptor->my_public_key, encryptor->my_private_key, uECC_secp256r1()))
+  if(key_pool_count > 0)
+  {
+    key_pair_t *pair = &key_pool[--key_pool_count];
+
+    memcpy(encryptor->my_private_key, pair->private_key, 32);
+    memcpy(encryptor->my_public_key,  pair->public_key,  64);
+
+    /* Each key is only ever handed out once. */
+    memset(pair, 0, sizeof(key_pair_t));
+  }
+  else if(!encryptor_make_key_pair(encryptor->my_public_key, encryptor->my_private_key))
+  {
     return NULL;
+  }
 
   encryptor->preshared_secret = preshared_secret;
 
   return encryptor;
 }
 
+NBBOOL encryptor_get_shared_secret(uint8_t *their_public_key, uint8_t *my_private_key, uint8_t *shared_secret)
+{
+  return (NBBOOL)uECC_shared_secret(their_public_key, my_private_key, shared_secret, uECC_secp256r1());
+}
+
 NBBOOL encryptor_set_their_public_key(encryptor_t *encryptor, uint8_t *their_public_key)
 {
-  if(!uECC_shared_secret(their_public_key, encryptor->my_private_key, encryptor->shared_secret, uECC_secp256r1()))
+  uint8_t shared_secret[32];
+
+  if(!encryptor_get_shared_secret(their_public_key, encryptor->my_private_key, shared_secret))
     return FALSE;
 
+  encryptor_set_shared_secret(encryptor, their_public_key, shared_secret);
+  memset(shared_secret, 0, 32);
+
+  return TRUE;
+}
+
+void encryptor_set_shared_secret(encryptor_t *encryptor, uint8_t *their_public_key, uint8_t *shared_secret)
+{
+  memcpy(encryptor->shared_secret, shared_secret, 32);
+
   /* Store their key (we need it to generate the SAS). */
   memcpy(encryptor->their_public_key, their_public_key, 64);
 
@@ -80,7 +156,18 @@ NBBOOL encryptor_set_their_public_key(encryptor_t *encryptor, uint8_t *their_pub
     make_authenticator(encryptor, "server", encryptor->their_authenticator);
   }
 
-  return TRUE;
+  s20_setup(&encryptor->my_cipher,    encryptor->my_write_key,    S20_KEYLEN_256);
+  s20_setup(&encryptor->their_cipher, encryptor->their_write_key, S20_KEYLEN_256);
+
+  sha3_256_init(&encryptor->my_mac);
+  sha3_update(&encryptor->my_mac, encryptor->my_mac_key, 32);
+  sha3_256_init(&encryptor->their_mac);
+  sha3_update(&encryptor->their_mac, encryptor->their_mac_key, 32);
+
+  /* Any cached keystream was for the old keys. */
+  memset(encryptor->my_keystreams,    0, sizeof(encryptor->my_keystreams));
+  memset(encryptor->their_keystreams, 0, sizeof(encryptor->their_keystreams));
+  encryptor->has_keys = TRUE;
 }
 
 uint16_t encryptor_get_nonce(encryptor_t *encryptor)
@@ -130,157 +217,133 @@ void encryptor_print_sas(encryptor_t *encryptor)
   printf("\n");
 }
 
-NBBOOL encryptor_check_signature(encryptor_t *encryptor, buffer_t *buffer)
+/* The signature is H(mac_key || header || everything after the signature),
+ * truncated; it's calculated straight over the packet, skipping the gap where
+ * the signature itself goes. */
+static void make_signature(sha3_ctx *mac, uint8_t *packet, size_t length, uint8_t *signature)
 {
-  sha3_ctx  ctx;
-
-  uint8_t   header[HEADER_LENGTH];
-  uint8_t   their_signature[SIGNATURE_LENGTH];
-  uint8_t   good_signature[32];
-  uint8_t  *body;
-  size_t    body_length;
-
-  uint8_t  *signed_data         = NULL;
-  size_t    signed_length       = -1;
+  sha3_ctx ctx = *mac;
 
-  /* Start from the beginning. */
-  buffer_reset(buffer);
-
-  /* Read the 5-byte header. */
-  buffer_read_next_bytes(buffer, header, HEADER_LENGTH);
+  sha3_update(&ctx, packet, HEADER_LENGTH);
+  sha3_update(&ctx, packet + HEADER_LENGTH + SIGNATURE_LENGTH, length - HEADER_LENGTH - SIGNATURE_LENGTH);
+  sha3_final(&ctx, signature);
+}
 
-  /* Read their 6-byte (48-bit) signature off the front of the packet. */
-  buffer_read_next_bytes(buffer, their_signature, SIGNATURE_LENGTH);
+static void make_nonce_str(uint16_t nonce, uint8_t *nonce_str)
+{
+  memset(nonce_str, '\0', 8);
+  nonce_str[6] = (nonce >> 8) & 0x00FF;
+  nonce_str[7] = (nonce >> 0) & 0x00FF;
+}
 
-  /* Read the body. */
-  body = buffer_read_remaining_bytes(buffer, &body_length, -1, FALSE);
+/* Encrypt or decrypt the body, using the cached keystream for the nonce if
+ * there is some. Keystream is only ever used once, so it's wiped after. */
+static void crypt_body(s20_ctx_t *cipher, encryptor_keystream_t *keystreams, uint16_t nonce, uint8_t *body, size_t body_length)
+{
+  encryptor_keystream_t *cached = &keystreams[nonce % ENCRYPTOR_CACHED_NONCES];
+  uint8_t                nonce_str[8];
+  size_t                 done = 0;
+  size_t                 i;
 
-  /* Re-build the buffer without the signature. */
-  buffer_clear(buffer);
-  buffer_add_bytes(buffer, header, HEADER_LENGTH);
-  buffer_add_bytes(buffer, body, body_length);
+  make_nonce_str(nonce, nonce_str);
 
-  /* Get it out as a string. */
-  signed_data = buffer_create_string(buffer, &signed_length);
+  if(cached->valid && cached->nonce == nonce)
+  {
+    done = body_length < ENCRYPTOR_CACHED_BYTES ? body_length : ENCRYPTOR_CACHED_BYTES;
 
-  /* Calculate H(mac_key || data) */
-  sha3_256_init(&ctx);
-  sha3_update(&ctx, encryptor->their_mac_key, 32);
-  sha3_update(&ctx, signed_data, signed_length);
-  sha3_final(&ctx, good_signature);
+    for(i = 0; i < done; i++)
+      body[i] ^= cached->keystream[i];
 
-  /* Free the data we allocated. */
-  safe_free(signed_data);
-  safe_free(body);
+    memset(cached, 0, sizeof(encryptor_keystream_t));
+  }
 
-  /* Validate the signature */
-  return (NBBOOL)!memcmp(their_signature, good_signature, SIGNATURE_LENGTH);
+  s20_crypt_ctx(cipher, nonce_str, (uint32_t)done, body + done, (uint32_t)(body_length - done));
 }
 
-void encryptor_decrypt_buffer(encryptor_t *encryptor, buffer_t *buffer, uint16_t *nonce)
+static void fill_keystreams(s20_ctx_t *cipher, encryptor_keystream_t *keystreams, uint16_t first_nonce)
 {
-  uint8_t   header[HEADER_LENGTH] = {0};
-  uint8_t   nonce_str[8]          = {0};
-  uint8_t  *body                  = NULL;
-  size_t    body_length           = -1;
-
-  /* Start from the beginning. */
-  buffer_reset(buffer);
+  encryptor_keystream_t *cached;
+  uint8_t                nonce_str[8];
+  uint16_t               nonce;
+  size_t                 i;
 
-  /* Read the header. */
-  buffer_read_next_bytes(buffer, header, HEADER_LENGTH);
-
-  /* Read the nonce, padded with zeroes. */
-  memset(nonce_str, '\0', 8);
-  buffer_read_next_bytes(buffer, nonce_str+6, 2);
-
-  /* Read the nonce into a return variable. */
-  if(nonce)
-    *nonce = buffer_read_int16_at(buffer, HEADER_LENGTH);
+  for(i = 0; i < ENCRYPTOR_CACHED_NONCES; i++)
+  {
+    nonce  = (uint16_t)(first_nonce + i);
+    cached = &keystreams[nonce % ENCRYPTOR_CACHED_NONCES];
 
-  /* Read the body, which is what's encrypted. */
-  body = buffer_read_remaining_bytes(buffer, &body_length, -1, FALSE);
+    if(cached->valid && cached->nonce == nonce)
+      continue;
 
-  /* Decrypt the body! */
-  s20_crypt(encryptor->their_write_key, S20_KEYLEN_256, nonce_str, 0, body, body_length);
+    make_nonce_str(nonce, nonce_str);
+    s20_keystream(cipher, nonce_str, 0, cached->keystream, ENCRYPTOR_CACHED_BYTES / 64);
+    cached->nonce = nonce;
+    cached->valid = TRUE;
+  }
+}
 
-  /* Re-build the packet without the nonce. */
-  buffer_clear(buffer);
-  buffer_add_bytes(buffer, header, 5);
-  buffer_add_bytes(buffer, body, body_length);
+void encryptor_precompute(encryptor_t *encryptor)
+{
+  if(!encryptor->has_keys)
+    return;
 
-  /* Free up memory. */
-  safe_free(body);
+  fill_keystreams(&encryptor->my_cipher,    encryptor->my_keystreams,    encryptor->nonce);
+  fill_keystreams(&encryptor->their_cipher, encryptor->their_keystreams, encryptor->their_next_nonce);
 }
 
-void encryptor_sign_buffer(encryptor_t *encryptor, buffer_t *buffer)
+size_t encryptor_seal(encryptor_t *encryptor, uint8_t *packet, size_t length)
 {
-  sha3_ctx  ctx;
+  uint16_t  nonce        = encryptor_get_nonce(encryptor);
   uint8_t   signature[32];
+  uint8_t  *body         = packet + HEADER_LENGTH + ENCRYPTOR_OVERHEAD;
+  size_t    body_length  = length - HEADER_LENGTH;
 
-  uint8_t   header[HEADER_LENGTH]   = {0};
-  uint8_t  *body                    = NULL;
-  size_t    body_length             = -1;
-
-  /* Start from the beginning. */
-  buffer_reset(buffer);
-
-  /* Read the header. */
-  buffer_read_next_bytes(buffer, header, HEADER_LENGTH);
+  /* Make room for the signature and nonce between the header and the body. */
+  memmove(body, packet + HEADER_LENGTH, body_length);
 
-  /* Read the body. */
-  body = buffer_read_remaining_bytes(buffer, &body_length, -1, FALSE);
+  /* Add the nonce, and encrypt the body with it. */
+  packet[HEADER_LENGTH + SIGNATURE_LENGTH]     = (nonce >> 8) & 0x00FF;
+  packet[HEADER_LENGTH + SIGNATURE_LENGTH + 1] = (nonce >> 0) & 0x00FF;
 
-  /* Generate the signature.  */
-  sha3_256_init(&ctx);
-  sha3_update(&ctx, encryptor->my_mac_key, 32);
-  sha3_update(&ctx, header,                HEADER_LENGTH);
-  sha3_update(&ctx, body,                  body_length);
-  sha3_final(&ctx, signature);
+  crypt_body(&encryptor->my_cipher, encryptor->my_keystreams, nonce, body, body_length);
 
-  /* Add the truncated signature to the packet. */
-  buffer_clear(buffer);
-  buffer_add_bytes(buffer, header,    HEADER_LENGTH);
-  buffer_add_bytes(buffer, signature, SIGNATURE_LENGTH);
-  buffer_add_bytes(buffer, body,      body_length);
+  /* Sign the header, nonce, and encrypted body. */
+  length += ENCRYPTOR_OVERHEAD;
+  make_signature(&encryptor->my_mac, packet, length, signature);
+  memcpy(packet + HEADER_LENGTH, signature, SIGNATURE_LENGTH);
 
-  /* Free memory. */
-  safe_free(body);
+  return length;
 }
 
-void encryptor_encrypt_buffer(encryptor_t *encryptor, buffer_t *buffer)
+NBBOOL encryptor_open(encryptor_t *encryptor, uint8_t *packet, size_t *length, uint16_t *nonce)
 {
-  uint8_t   header[HEADER_LENGTH] = {0};
-  uint16_t  nonce                 = encryptor_get_nonce(encryptor);
-  uint8_t   nonce_str[8]          = {0};
-  uint8_t  *body                  = NULL;
-  size_t    body_length           = -1;
-
-  /* Start from the beginning. */
-  buffer_reset(buffer);
+  uint8_t   good_signature[32];
+  uint8_t  *body         = packet + HEADER_LENGTH + ENCRYPTOR_OVERHEAD;
+  size_t    body_length;
+  uint16_t  their_nonce;
 
-  /* Read the header. */
-  buffer_read_next_bytes(buffer, header, HEADER_LENGTH);
+  if(*length < HEADER_LENGTH + ENCRYPTOR_OVERHEAD)
+    return FALSE;
+  body_length = *length - HEADER_LENGTH - ENCRYPTOR_OVERHEAD;
 
-  /* Set up the nonce. */
-  memset(nonce_str, '\0', 8);
-  nonce_str[6] = (nonce >> 8) & 0x00FF;
-  nonce_str[7] = (nonce >> 0) & 0x00FF;
+  /* Validate the signature before touching anything. */
+  make_signature(&encryptor->their_mac, packet, *length, good_signature);
+  if(memcmp(packet + HEADER_LENGTH, good_signature, SIGNATURE_LENGTH))
+    return FALSE;
 
-  /* Read the body, which is what we will encrypt. */
-  body = buffer_read_remaining_bytes(buffer, &body_length, -1, FALSE);
+  /* Read the nonce. */
+  their_nonce = (uint16_t)((packet[HEADER_LENGTH + SIGNATURE_LENGTH] << 8) | packet[HEADER_LENGTH + SIGNATURE_LENGTH + 1]);
+  if(nonce)
+    *nonce = their_nonce;
+  encryptor->their_next_nonce = (uint16_t)(their_nonce + 1);
 
-  /* Encrypt the body! */
-  s20_crypt(encryptor->my_write_key, S20_KEYLEN_256, nonce_str, 0, body, body_length);
+  /* Decrypt the body, and slide it back up against the header. */
+  crypt_body(&encryptor->their_cipher, encryptor->their_keystreams, their_nonce, body, body_length);
+  memmove(packet + HEADER_LENGTH, body, body_length);
 
-  /* Re-build the packet with the nonce. */
-  buffer_clear(buffer);
-  buffer_add_bytes(buffer, header, 5);
-  buffer_add_int16(buffer, nonce);
-  buffer_add_bytes(buffer, body, body_length);
+  *length -= ENCRYPTOR_OVERHEAD;
 
-  /* Free memory. */
-  safe_free(body);
+  return TRUE;
 }
 
 void encryptor_destroy(encryptor_t *encryptor)
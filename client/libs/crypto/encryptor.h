@@ -8,6 +8,23 @@
 #ifndef __ENCRYPTOR_H__
 #define __ENCRYPTOR_H__
 
+#include "libs/crypto/salsa20.h"
+#include "libs/crypto/sha3.h"
+
+/* How many upcoming nonces, in each direction, encryptor_precompute() gets
+ * the keystream ready for, and how much of it; 256 bytes covers the body of
+ * any packet that fits in a DNS name. Anything past that is generated when
+ * the packet's handled. */
+#define ENCRYPTOR_CACHED_NONCES 4
+#define ENCRYPTOR_CACHED_BYTES  256
+
+typedef struct
+{
+  NBBOOL   valid;
+  uint16_t nonce;
+  uint8_t  keystream[ENCRYPTOR_CACHED_BYTES];
+} encryptor_keystream_t;
+
 typedef struct
 {
   char *preshared_secret;
@@ -26,14 +43,53 @@ typedef struct
   uint8_t their_mac_key[32];
 
   uint16_t nonce;
+
+  /* Set once the keys above have been derived. */
+  NBBOOL    has_keys;
+  s20_ctx_t my_cipher;
+  s20_ctx_t their_cipher;
+
+  /* SHA3 contexts that have already absorbed the mac keys; each signature
+   * starts from a copy of one. */
+  sha3_ctx  my_mac;
+  sha3_ctx  their_mac;
+
+  /* The nonce we expect from the server next (it counts up, too). */
+  uint16_t  their_next_nonce;
+
+  /* Indexed by nonce % ENCRYPTOR_CACHED_NONCES. */
+  encryptor_keystream_t my_keystreams[ENCRYPTOR_CACHED_NONCES];
+  encryptor_keystream_t their_keystreams[ENCRYPTOR_CACHED_NONCES];
 } encryptor_t;
 
-/* Create a new encryptor and generate a new private key. */
+/* How many key pairs encryptor_fill_key_pool() keeps ready. */
+#define ENCRYPTOR_KEY_POOL_SIZE 4
+
+/* Create a new encryptor with a new private key (from the pool, if there's
+ * one there). */
 encryptor_t *encryptor_create(char *preshared_secret);
 
+/* Generate a key pair for the pool, if it isn't full yet; one per call,
+ * since each can take a while on a slow CPU. Returns FALSE if nothing was
+ * added. */
+NBBOOL encryptor_fill_key_pool();
+
+/* The same thing in pieces, for generating the key somewhere else (like a
+ * worker thread): encryptor_make_key_pair() doesn't touch any shared state,
+ * but the pool functions have to be called from the main thread. */
+NBBOOL encryptor_make_key_pair(uint8_t *public_key, uint8_t *private_key);
+NBBOOL encryptor_key_pool_is_full();
+void   encryptor_add_to_key_pool(uint8_t *public_key, uint8_t *private_key);
+
 /* Set their pubkey, and also calculate all the various derived values. */
 NBBOOL encryptor_set_their_public_key(encryptor_t *encryptor, uint8_t *their_public_key);
 
+/* encryptor_set_their_public_key() in two steps: the slow ECDH part, which
+ * doesn't touch any shared state, then deriving everything from the
+ * result. */
+NBBOOL encryptor_get_shared_secret(uint8_t *their_public_key, uint8_t *my_private_key, uint8_t *shared_secret);
+void   encryptor_set_shared_secret(encryptor_t *encryptor, uint8_t *their_public_key, uint8_t *shared_secret);
+
 /* Get the next nonce. */
 uint16_t encryptor_get_nonce(encryptor_t *encryptor);
 
@@ -46,19 +102,24 @@ void encryptor_print(encryptor_t *encryptor);
 /* Print the short authentication string. */
 void encryptor_print_sas(encryptor_t *encryptor);
 
-/* Validates that the packet, stored in buffer, has a valid signature.
- * It also removes the signature from the buffer. */
-NBBOOL encryptor_check_signature(encryptor_t *encryptor, buffer_t *buffer);
+/* An encrypted packet is the plaintext one with a 6-byte (48-bit) signature
+ * and a 2-byte nonce inserted after its 5-byte header. */
+#define SIGNATURE_LENGTH 6
+#define ENCRYPTOR_OVERHEAD (SIGNATURE_LENGTH + 2)
 
-/* Decrypt the packet, stored in buffer. Also removes the nonce and
- * returns it in the nonce parameter, if it's not NULL. */
-void encryptor_decrypt_buffer(encryptor_t *encryptor, buffer_t *buffer, uint16_t *nonce);
+/* Encrypts then signs the packet, in place; packet has to have room for
+ * ENCRYPTOR_OVERHEAD more bytes after length. Returns the new length. */
+size_t encryptor_seal(encryptor_t *encryptor, uint8_t *packet, size_t length);
 
-/* Adds a signature to the packet stored in buffer. */
-void encryptor_sign_buffer(encryptor_t *encryptor, buffer_t *buffer);
+/* Validates the packet's signature then decrypts it, in place, updating
+ * length. Also returns the nonce in the nonce parameter, if it's not NULL.
+ * If the signature is wrong, returns FALSE and leaves the packet alone. */
+NBBOOL encryptor_open(encryptor_t *encryptor, uint8_t *packet, size_t *length, uint16_t *nonce);
 
-/* Encrypts the packet stored in buffer, and adds the nonce to it. */
-void encryptor_encrypt_buffer(encryptor_t *encryptor, buffer_t *buffer);
+/* Generate the keystream for the next few nonces each way, so sealing and
+ * opening those packets is just an xor. Meant to be called when there's
+ * nothing else to do; it's cheap when everything's ready already. */
+void encryptor_precompute(encryptor_t *encryptor);
 
 /* Destroy the encryptor and free/wipe any memory used. */
 void encryptor_destroy(encryptor_t *encryptor);
@@ -25,6 +25,44 @@ enum s20_keylen_t
   S20_KEYLEN_128
 };
 
+/**
+ * An expanded key, for encrypting many messages under the same key
+ * without setting it up every time. Only the key (and the constants)
+ * is kept; the nonce and block number are filled in per block.
+ */
+typedef struct
+{
+  uint32_t input[16];
+} s20_ctx_t;
+
+/**
+ * Expands key into ctx. Returns S20_FAILURE if a parameter is bad.
+ */
+enum s20_status_t s20_setup(s20_ctx_t *ctx,
+                            uint8_t *key,
+                            enum s20_keylen_t keylen);
+
+/**
+ * Generates blocks 64-byte blocks of keystream for the 8-byte nonce,
+ * starting at block number block (that is, at stream index block * 64),
+ * into keystream. The keystream can be xored with a message later, which
+ * is the same as s20_crypt_ctx() on it.
+ */
+void s20_keystream(s20_ctx_t *ctx,
+                   uint8_t nonce[],
+                   uint32_t block,
+                   uint8_t *keystream,
+                   uint32_t blocks);
+
+/**
+ * The same as s20_crypt(), with a key that's already been expanded.
+ */
+enum s20_status_t s20_crypt_ctx(s20_ctx_t *ctx,
+                                uint8_t nonce[],
+                                uint32_t si,
+                                uint8_t *buf,
+                                uint32_t buflen);
+
 /**
  * Performs up to 2^32-1 bytes of encryption or decryption under a
  * 128- or 256-bit key in blocks of arbitrary size. Permits seeking
@@ -0,0 +1,357 @@
+/* delta.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "crypto/sha3.h"
+#include "memory.h"
+
+#include "delta.h"
+
+/* For last_copy, when the last op wasn't a COPY. */
+#define NO_COPY ((size_t)-1)
+
+static void put_int32(uint8_t *data, uint32_t value)
+{
+  data[0] = (uint8_t)(value >> 24);
+  data[1] = (uint8_t)(value >> 16);
+  data[2] = (uint8_t)(value >> 8);
+  data[3] = (uint8_t)(value);
+}
+
+static uint32_t get_int32(uint8_t *data)
+{
+  return ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) | ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+}
+
+uint32_t delta_weak_checksum(uint8_t *data, size_t length)
+{
+  uint32_t a = 0;
+  uint32_t b = 0;
+  size_t   i;
+
+  for(i = 0; i < length; i++)
+  {
+    a += data[i];
+    b += (uint32_t)(length - i) * data[i];
+  }
+
+  return (a & 0xFFFF) | ((b & 0xFFFF) << 16);
+}
+
+uint32_t delta_roll_checksum(uint32_t weak, uint8_t out, uint8_t in, size_t length)
+{
+  uint32_t a = weak & 0xFFFF;
+  uint32_t b = weak >> 16;
+
+  a = (a - out + in) & 0xFFFF;
+  b = (b - (uint32_t)length * out + a) & 0xFFFF;
+
+  return a | (b << 16);
+}
+
+static void strong_checksum(uint8_t *data, size_t length, uint8_t *strong)
+{
+  sha3_ctx ctx;
+  uint8_t  hash[sha3_256_hash_size];
+
+  sha3_256_init(&ctx);
+  sha3_update(&ctx, data, length);
+  sha3_final(&ctx, hash);
+
+  memcpy(strong, hash, DELTA_STRONG_LENGTH);
+}
+
+void delta_sign_block(uint8_t *data, size_t length, uint8_t *signature)
+{
+  put_int32(signature, delta_weak_checksum(data, length));
+  strong_checksum(data, length, signature + 4);
+}
+
+static uint32_t bucket(delta_index_t *index, uint32_t weak)
+{
+  return (weak ^ (weak >> 16)) & index->mask;
+}
+
+delta_index_t *delta_index_create(uint8_t *signatures, uint32_t count, uint32_t block_size)
+{
+  delta_index_t *index = (delta_index_t*) safe_malloc(sizeof(delta_index_t));
+  uint32_t       size  = 16;
+  uint32_t       i;
+  uint32_t       b;
+
+  while(size < count * 2)
+    size *= 2;
+
+  index->signatures = signatures;
+  index->count      = count;
+  index->block_size = block_size;
+  index->buckets    = (uint32_t*) safe_malloc(size * sizeof(uint32_t));
+  index->next       = (uint32_t*) safe_malloc((count ? count : 1) * sizeof(uint32_t));
+  index->mask       = size - 1;
+
+  /* Backwards, so each bucket's list is in order and the first block that
+   * matches is the one we use (which makes runs of COPYs more likely). */
+  for(i = count; i > 0; i--)
+  {
+    b = bucket(index, get_int32(signatures + (i - 1) * DELTA_SIGNATURE_LENGTH));
+
+    index->next[i - 1] = index->buckets[b];
+    index->buckets[b]  = i;
+  }
+
+  return index;
+}
+
+void delta_index_destroy(delta_index_t *index)
+{
+  safe_free(index->buckets);
+  safe_free(index->next);
+  safe_free(index);
+}
+
+/* Find the block that data (one block long, with the given weak checksum)
+ * matches; the strong checksum is only worked out if the weak one matches
+ * something. */
+static NBBOOL find_block(delta_index_t *index, uint32_t weak, uint8_t *data, uint32_t *block)
+{
+  uint8_t  strong[DELTA_STRONG_LENGTH];
+  NBBOOL   have_strong = FALSE;
+  uint32_t i;
+  uint8_t *signature;
+
+  for(i = index->buckets[bucket(index, weak)]; i; i = index->next[i - 1])
+  {
+    signature = index->signatures + (i - 1) * DELTA_SIGNATURE_LENGTH;
+    if(get_int32(signature) != weak)
+      continue;
+
+    if(!have_strong)
+    {
+      strong_checksum(data, index->block_size, strong);
+      have_strong = TRUE;
+    }
+
+    if(!memcmp(signature + 4, strong, DELTA_STRONG_LENGTH))
+    {
+      *block = i - 1;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+/* These add an op to out, if there's room. */
+static NBBOOL add_data(uint8_t *out, size_t out_size, size_t *out_length, size_t *last_copy, uint8_t *data, size_t length)
+{
+  if(length == 0)
+    return TRUE;
+
+  if(out_size - *out_length < 5 + length)
+    return FALSE;
+
+  out[*out_length] = DELTA_OP_DATA;
+  put_int32(out + *out_length + 1, (uint32_t)length);
+  memcpy(out + *out_length + 5, data, length);
+  *out_length += 5 + length;
+  *last_copy = NO_COPY;
+
+  return TRUE;
+}
+
+static NBBOOL add_copy(uint8_t *out, size_t out_size, size_t *out_length, size_t *last_copy, uint32_t block)
+{
+  /* Right after the last block we copied? Just make that COPY longer. */
+  if(*last_copy != NO_COPY)
+  {
+    uint32_t first = get_int32(out + *last_copy + 1);
+    uint32_t count = get_int32(out + *last_copy + 5);
+
+    if(first + count == block)
+    {
+      put_int32(out + *last_copy + 5, count + 1);
+      return TRUE;
+    }
+  }
+
+  if(out_size - *out_length < 9)
+    return FALSE;
+
+  *last_copy = *out_length;
+  out[*out_length] = DELTA_OP_COPY;
+  put_int32(out + *out_length + 1, block);
+  put_int32(out + *out_length + 5, 1);
+  *out_length += 9;
+
+  return TRUE;
+}
+
+uint32_t delta_encode(delta_index_t *index, FILE *f, uint8_t *work, uint8_t *out, size_t out_size, size_t *out_length, NBBOOL *error)
+{
+  size_t   block_size = index->block_size;
+  size_t   work_size  = DELTA_WORK_SIZE(block_size);
+  size_t   length;        /* How much of work has data. */
+  size_t   base     = 0;  /* How far into the file work starts. */
+  size_t   position = 0;  /* Where the window starts. */
+  size_t   literal  = 0;  /* Where the data we haven't written yet starts. */
+  size_t   last_copy = NO_COPY;
+  size_t   got;
+  uint32_t weak = 0;
+  uint32_t block;
+  NBBOOL   have_weak = FALSE;
+  NBBOOL   at_end;
+  NBBOOL   is_full = FALSE;
+
+  *out_length = 0;
+  *error      = FALSE;
+
+  length = fread(work, 1, work_size, f);
+  at_end = (length < work_size);
+
+  while(!is_full)
+  {
+    if(length - position < block_size)
+    {
+      if(at_end)
+        break;
+
+      /* Keep what hasn't been written, and fill up the rest. */
+      memmove(work, work + literal, length - literal);
+      base     += literal;
+      position -= literal;
+      length   -= literal;
+      literal   = 0;
+
+      got = fread(work + length, 1, work_size - length, f);
+      at_end = (got < work_size - length);
+      length += got;
+
+      continue;
+    }
+
+    if(index->count > 0)
+    {
+      if(!have_weak)
+      {
+        weak = delta_weak_checksum(work + position, block_size);
+        have_weak = TRUE;
+      }
+
+      if(find_block(index, weak, work + position, &block))
+      {
+        if(!add_data(out, out_size, out_length, &last_copy, work + literal, position - literal))
+        {
+          is_full = TRUE;
+          break;
+        }
+        literal = position;
+
+        if(!add_copy(out, out_size, out_length, &last_copy, block))
+        {
+          is_full = TRUE;
+          break;
+        }
+
+        position += block_size;
+        literal   = position;
+        have_weak = FALSE;
+
+        continue;
+      }
+    }
+
+    if(position - literal == DELTA_MAX_LITERAL)
+    {
+      if(!add_data(out, out_size, out_length, &last_copy, work + literal, position - literal))
+      {
+        is_full = TRUE;
+        break;
+      }
+      literal = position;
+    }
+
+    if(have_weak && position + block_size < length)
+      weak = delta_roll_checksum(weak, work[position], work[position + block_size], block_size);
+    else
+      have_weak = FALSE;
+    position++;
+  }
+
+  if(ferror(f))
+  {
+    *error = TRUE;
+    return 0;
+  }
+
+  /* Whatever's left at the end is too short to match anything. */
+  if(!is_full && add_data(out, out_size, out_length, &last_copy, work + literal, length - literal))
+    literal = length;
+
+  return (uint32_t)(base + literal);
+}
+
+NBBOOL delta_apply(uint8_t *ops, size_t ops_length, uint32_t block_size, FILE *basis, FILE *out, uint8_t *work, size_t work_size, uint32_t *written)
+{
+  size_t   i = 0;
+  uint32_t first;
+  uint32_t count;
+  uint32_t length;
+  uint64_t remaining;
+  size_t   chunk;
+
+  *written = 0;
+
+  while(i < ops_length)
+  {
+    switch(ops[i++])
+    {
+      case DELTA_OP_COPY:
+        if(ops_length - i < 8 || !basis)
+          return FALSE;
+
+        first = get_int32(ops + i);
+        count = get_int32(ops + i + 4);
+        i += 8;
+
+        if(((uint64_t)first + count) * block_size > 0xFFFFFFFF)
+          return FALSE;
+
+        if(fseek(basis, (long)(first * block_size), SEEK_SET) != 0)
+          return FALSE;
+
+        for(remaining = (uint64_t)count * block_size; remaining > 0; remaining -= chunk)
+        {
+          chunk = (size_t)MIN(remaining, work_size);
+
+          if(fread(work, 1, chunk, basis) != chunk || fwrite(work, 1, chunk, out) != chunk)
+            return FALSE;
+          *written += (uint32_t)chunk;
+        }
+        break;
+
+      case DELTA_OP_DATA:
+        if(ops_length - i < 4)
+          return FALSE;
+
+        length = get_int32(ops + i);
+        i += 4;
+
+        if(length > ops_length - i || fwrite(ops + i, 1, length, out) != length)
+          return FALSE;
+        i += length;
+        *written += length;
+        break;
+
+      default:
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
@@ -0,0 +1,100 @@
+/* delta.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * rsync-style deltas, for sending a file to a side that already has an older
+ * copy of it (see COMMAND_UPLOAD_DELTA and COMMAND_DOWNLOAD_DELTA in
+ * doc/command_protocol.md).
+ *
+ * The side with the old copy (the basis) cuts it into fixed-size blocks and
+ * sends a signature for each one: a weak checksum that can be rolled along a
+ * byte at a time, and the start of its SHA3-256 hash. The side with the new
+ * copy slides a block-sized window over it, and wherever the window matches
+ * a signature, it sends the number of the block instead of the data. Only a
+ * partial block at the end of the basis doesn't get a signature.
+ *
+ * A delta is a list of ops, all big endian:
+ * - DELTA_OP_COPY: (uint32_t) first block, (uint32_t) count
+ * - DELTA_OP_DATA: (uint32_t) length, then that many bytes
+ *
+ * Nothing here allocates memory except delta_index_create() (and
+ * delta_index_destroy()), so the rest can run on a worker thread.
+ */
+
+#ifndef __DELTA_H__
+#define __DELTA_H__
+
+#include <stdio.h>
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+/* How much of each block's SHA3-256 is sent. */
+#define DELTA_STRONG_LENGTH 8
+
+/* The size of one signature, on the wire. */
+#define DELTA_SIGNATURE_LENGTH (4 + DELTA_STRONG_LENGTH)
+
+/* The biggest block we'll work with. */
+#define DELTA_MAX_BLOCK_SIZE 65536
+
+/* The most data delta_encode() holds onto before writing a DELTA_OP_DATA;
+ * an op can always fit in DELTA_MAX_LITERAL + DELTA_OP_OVERHEAD bytes. */
+#define DELTA_MAX_LITERAL  16384
+#define DELTA_OP_OVERHEAD  9
+
+/* How big delta_encode()'s work buffer has to be. */
+#define DELTA_WORK_SIZE(block_size) (DELTA_MAX_LITERAL + 2 * (size_t)(block_size))
+
+typedef enum
+{
+  DELTA_OP_COPY = 0x00,
+  DELTA_OP_DATA = 0x01
+} delta_op_t;
+
+/* The signatures of the basis, with a hash table on the weak checksums. */
+typedef struct
+{
+  uint8_t  *signatures;
+  uint32_t  count;
+  uint32_t  block_size;
+
+  /* Each bucket holds its first block plus one (0 is empty), and next[] has
+   * the one after that. */
+  uint32_t *buckets;
+  uint32_t *next;
+  uint32_t  mask;
+} delta_index_t;
+
+/* rsync's checksum of a block, and the checksum of the block one byte on
+ * (without out, and with in at the end). */
+uint32_t delta_weak_checksum(uint8_t *data, size_t length);
+uint32_t delta_roll_checksum(uint32_t weak, uint8_t out, uint8_t in, size_t length);
+
+/* Write the signature for one block into signature (DELTA_SIGNATURE_LENGTH
+ * bytes). */
+void     delta_sign_block(uint8_t *data, size_t length, uint8_t *signature);
+
+/* Index count signatures (packed like delta_sign_block() writes them); the
+ * signatures have to stay around as long as the index does. */
+delta_index_t *delta_index_create(uint8_t *signatures, uint32_t count, uint32_t block_size);
+void           delta_index_destroy(delta_index_t *index);
+
+/* Write ops to out that rebuild what's left of f (from where it is now) out
+ * of the indexed blocks. It stops at the end of the file, or once out is
+ * full; *out_length is how much of out was used, and the return value is how
+ * much of the file the ops cover. work has to be DELTA_WORK_SIZE() bytes,
+ * and out at least DELTA_MAX_LITERAL + 2 * DELTA_OP_OVERHEAD. Sets *error
+ * (and returns 0) if the file can't be read. */
+uint32_t delta_encode(delta_index_t *index, FILE *f, uint8_t *work, uint8_t *out, size_t out_size, size_t *out_length, NBBOOL *error);
+
+/* Follow a list of ops: copy blocks of block_size from basis (which can be
+ * NULL if there are no COPYs), and data from the ops themselves, to out.
+ * work is for copying through. Returns FALSE if the ops are malformed, or
+ * refer to a block the basis doesn't have, or a read or write fails; either
+ * way, *written is how many bytes went to out. */
+NBBOOL   delta_apply(uint8_t *ops, size_t ops_length, uint32_t block_size, FILE *basis, FILE *out, uint8_t *work, size_t work_size, uint32_t *written);
+
+#endif
@@ -22,6 +22,7 @@
 #include <sys/types.h>
 #endif
 
+#include "arena.h"
 #include "buffer.h"
 #include "memory.h"
 
@@ -59,11 +60,33 @@ static void buffer_add_dns_name(buffer_t *buffer, char *name)
   safe_free(domain_base);
 }
 
-static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t *real_length)
+/* The longest name, in dotted form, that we'll read out of a packet. Legal
+ * names are under 255 characters; anything longer is truncated. */
+#define MAX_DNS_NAME_LENGTH 255
+
+/* Allocate memory for a parsed packet, from its arena if it has one. */
+static void *dns_alloc(dns_t *dns, size_t size)
+{
+  if(dns->arena)
+    return arena_alloc(dns->arena, size);
+
+  return safe_malloc(size);
+}
+
+static char *dns_strdup(dns_t *dns, const char *str)
+{
+  if(dns->arena)
+    return arena_strdup(dns->arena, str);
+
+  return safe_strdup(str);
+}
+
+/* Read the name at the given offset, appending it (in dotted form) to name,
+ * which already has *name_length characters in it. */
+static void buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t *real_length, char name[MAX_DNS_NAME_LENGTH + 1], size_t *name_length)
 {
   uint8_t  piece_length;
   uint32_t pos = 0;
-  buffer_t *ret = buffer_create(BO_NETWORK);
 
   /* Read the first character -- it's the size of the initial string. */
   piece_length = buffer_read_int8_at(buffer, offset + pos);
@@ -76,12 +99,9 @@ static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t
       if(piece_length == 0xc0)
       {
         uint8_t relative_pos = buffer_read_int8_at(buffer, offset + pos);
-        char *new_data;
         pos++;
 
-        new_data = buffer_read_dns_name_at(buffer, relative_pos, NULL);
-        buffer_add_string(ret, new_data);
-        safe_free(new_data);
+        buffer_read_dns_name_at(buffer, relative_pos, NULL, name, name_length);
 
         /* Setting piece_length to 0 makes the loop end. */
         piece_length = 0;
@@ -94,10 +114,10 @@ static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t
     }
     else
     {
-      uint8_t *piece = (uint8_t*) safe_malloc(piece_length);
-      buffer_read_bytes_at(buffer, offset + pos, piece, piece_length);
-      buffer_add_bytes(ret, piece, piece_length);
-      safe_free(piece);
+      size_t to_copy = MIN(piece_length, MAX_DNS_NAME_LENGTH - *name_length);
+
+      buffer_read_bytes_at(buffer, offset + pos, name + *name_length, to_copy);
+      *name_length += to_copy;
 
       pos = pos + piece_length;
 
@@ -105,32 +125,77 @@ static char *buffer_read_dns_name_at(buffer_t *buffer, uint32_t offset, uint32_t
       piece_length = buffer_read_int8_at(buffer, offset + pos);
 
       /* If the next piece exists, add a period. */
-      if(piece_length)
-        buffer_add_int8(ret, '.');
+      if(piece_length && *name_length < MAX_DNS_NAME_LENGTH)
+        name[(*name_length)++] = '.';
 
       /* Increment the position. */
       pos++;
     }
   }
 
-  /* Add a final null terminator to the string. */
-  buffer_add_int8(ret, '\0');
-
   if(real_length)
     *real_length = pos;
-
-  return (char*)buffer_create_string_and_destroy(ret, NULL);
 }
 
-static char *buffer_read_next_dns_name(buffer_t *buffer)
+static char *buffer_read_next_dns_name(dns_t *dns, buffer_t *buffer)
 {
-  char *result;
+  char     name[MAX_DNS_NAME_LENGTH + 1];
+  size_t   name_length = 0;
   uint32_t actual_length;
 
-  result = buffer_read_dns_name_at(buffer, buffer_get_current_offset(buffer), &actual_length);
+  buffer_read_dns_name_at(buffer, buffer_get_current_offset(buffer), &actual_length, name, &name_length);
   buffer_set_current_offset(buffer, buffer_get_current_offset(buffer) + actual_length);
 
-  return result;
+  /* Add a final null terminator to the string. */
+  name[name_length] = '\0';
+
+  return dns_strdup(dns, name);
+}
+
+/* Read a TXT record's data (including its length), joining all of its
+ * strings together. The result is null terminated, for convenience. */
+static uint8_t *buffer_read_next_text(dns_t *dns, buffer_t *buffer, uint16_t *length)
+{
+  uint16_t remaining = buffer_read_next_int16(buffer);
+  uint8_t *text      = dns_alloc(dns, remaining + 1);
+  uint8_t  string_length;
+
+  *length = 0;
+  while(remaining > 0)
+  {
+    string_length = buffer_read_next_int8(buffer);
+    remaining--;
+
+    /* Don't trust a string that claims to go past the end of the record. */
+    if(string_length > remaining)
+      string_length = remaining;
+
+    buffer_read_next_bytes(buffer, text + *length, string_length);
+    *length   += string_length;
+    remaining -= string_length;
+  }
+  text[*length] = '\0';
+
+  return text;
+}
+
+/* The opposite of buffer_read_next_text(): anything longer than 255 bytes
+ * is split into multiple strings. */
+static void buffer_add_text(buffer_t *buffer, uint8_t *text, uint16_t length)
+{
+  uint16_t string_length;
+
+  buffer_add_int16(buffer, length + (length + 254) / 255 + (length == 0 ? 1 : 0));
+  do
+  {
+    string_length = MIN(length, 255);
+    buffer_add_int8(buffer, string_length);
+    buffer_add_bytes(buffer, text, string_length);
+
+    text   += string_length;
+    length -= string_length;
+  }
+  while(length > 0);
 }
 
 static char *buffer_read_ipv4_address_at(buffer_t *buffer, uint32_t offset, char result[16])
@@ -248,13 +313,23 @@ dns_t *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode)
   return dns;
 }
 
-dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
+dns_t *dns_create_from_packet_in(arena_t *arena, uint8_t *packet, size_t length)
 {
   uint16_t i;
   buffer_t *buffer = buffer_create_with_data(BO_NETWORK, packet, length);
-  dns_t *dns = dns_create_internal();
+  dns_t *dns;
   uint16_t flags;
 
+  if(arena)
+  {
+    dns = (dns_t*) arena_alloc(arena, sizeof(dns_t));
+    dns->arena = arena;
+  }
+  else
+  {
+    dns = dns_create_internal();
+  }
+
   dns->trn_id           = buffer_read_next_int16(buffer);
   flags                 = buffer_read_next_int16(buffer);
   dns->question_count   = buffer_read_next_int16(buffer);
@@ -275,10 +350,10 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
 
   if(dns->question_count)
   {
-    dns->questions = (question_t*) safe_malloc(dns->question_count * sizeof(question_t));
+    dns->questions = (question_t*) dns_alloc(dns, dns->question_count * sizeof(question_t));
     for(i = 0; i < dns->question_count; i++)
     {
-      dns->questions[i].name = buffer_read_next_dns_name(buffer);
+      dns->questions[i].name = buffer_read_next_dns_name(dns, buffer);
       dns->questions[i].type  = buffer_read_next_int16(buffer);
       dns->questions[i].class = buffer_read_next_int16(buffer);
     }
@@ -286,52 +361,49 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
 
   if(dns->answer_count)
   {
-    dns->answers = (answer_t*) safe_malloc(dns->answer_count * sizeof(answer_t));
+    dns->answers = (answer_t*) dns_alloc(dns, dns->answer_count * sizeof(answer_t));
     for(i = 0; i < dns->answer_count; i++)
     {
-      dns->answers[i].question = buffer_read_next_dns_name(buffer); /* The question. */
+      dns->answers[i].question = buffer_read_next_dns_name(dns, buffer); /* The question. */
       dns->answers[i].type     = buffer_read_next_int16(buffer); /* Type. */
       dns->answers[i].class    = buffer_read_next_int16(buffer); /* Class. */
       dns->answers[i].ttl      = buffer_read_next_int32(buffer); /* Time to live. */
-      dns->answers[i].answer   = (answer_types_t *) safe_malloc(sizeof(answer_types_t));
+      dns->answers[i].answer   = (answer_types_t *) dns_alloc(dns, sizeof(answer_types_t));
 
       if(dns->answers[i].type == _DNS_TYPE_A) /* 0x0001 */
       {
         buffer_read_next_int16(buffer); /* String size (don't care) */
 
-        dns->answers[i].answer->A.address = safe_malloc(16);
+        dns->answers[i].answer->A.address = dns_alloc(dns, 16);
         buffer_peek_next_bytes(buffer, dns->answers[i].answer->A.bytes, 4);
         buffer_read_next_ipv4_address(buffer, dns->answers[i].answer->A.address);
       }
       else if(dns->answers[i].type == _DNS_TYPE_NS) /* 0x0002 */
       {
         buffer_read_next_int16(buffer); /* String size. */
-        dns->answers[i].answer->NS.name = buffer_read_next_dns_name(buffer); /* The answer. */
+        dns->answers[i].answer->NS.name = buffer_read_next_dns_name(dns, buffer); /* The answer. */
       }
       else if(dns->answers[i].type == _DNS_TYPE_CNAME) /* 0x0005 */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->CNAME.name = buffer_read_next_dns_name(buffer); /* The answer. */
+        dns->answers[i].answer->CNAME.name = buffer_read_next_dns_name(dns, buffer); /* The answer. */
       }
       else if(dns->answers[i].type == _DNS_TYPE_MX) /* 0x000F */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
         dns->answers[i].answer->MX.preference = buffer_read_next_int16(buffer); /* Preference. */
-        dns->answers[i].answer->MX.name       = buffer_read_next_dns_name(buffer); /* The answer. */
+        dns->answers[i].answer->MX.name       = buffer_read_next_dns_name(dns, buffer); /* The answer. */
       }
       else if(dns->answers[i].type == _DNS_TYPE_TEXT) /* 0x0010 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->answers[i].answer->TEXT.length = buffer_read_next_int8(buffer); /* The actual length. */
-        dns->answers[i].answer->TEXT.text = safe_malloc(dns->answers[i].answer->TEXT.length); /* Allocate room for the answer. */
-        buffer_read_next_bytes(buffer, dns->answers[i].answer->TEXT.text, dns->answers[i].answer->TEXT.length); /* Read the answer. */
+        dns->answers[i].answer->TEXT.text = buffer_read_next_text(dns, buffer, &dns->answers[i].answer->TEXT.length); /* The answer, and its length. */
       }
 #ifndef WIN32
       else if(dns->answers[i].type == _DNS_TYPE_AAAA) /* 0x001C */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
 
-        dns->answers[i].answer->AAAA.address = safe_malloc(40);
+        dns->answers[i].answer->AAAA.address = dns_alloc(dns, 40);
         buffer_peek_next_bytes(buffer, dns->answers[i].answer->AAAA.bytes, 16);
         buffer_read_next_ipv6_address(buffer, dns->answers[i].answer->AAAA.address);
       }
@@ -341,7 +413,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
         buffer_read_next_int16(buffer); /* String size (don't care). */
 
         dns->answers[i].answer->NB.flags   = buffer_read_next_int16(buffer);
-        dns->answers[i].answer->NB.address = safe_malloc(16);
+        dns->answers[i].answer->NB.address = dns_alloc(dns, 16);
         buffer_read_next_ipv4_address(buffer, dns->answers[i].answer->NB.address);
       }
       else if(dns->answers[i].type == _DNS_TYPE_NBSTAT) /* 0x0021 */
@@ -350,7 +422,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
 
         uint16_t size = buffer_read_next_int16(buffer); /* String size (don't care). */
         dns->answers[i].answer->NBSTAT.name_count = buffer_read_next_int8(buffer);
-        dns->answers[i].answer->NBSTAT.names      = (NBSTAT_name_t*) safe_malloc(sizeof(NBSTAT_name_t) * dns->answers[i].answer->NBSTAT.name_count);
+        dns->answers[i].answer->NBSTAT.names      = (NBSTAT_name_t*) dns_alloc(dns, sizeof(NBSTAT_name_t) * dns->answers[i].answer->NBSTAT.name_count);
 
         /* Read the list of names. */
         for(j = 0; j < dns->answers[i].answer->NBSTAT.name_count; j++)
@@ -371,7 +443,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
             *end = 0;
 
           /* Save this name. */
-          dns->answers[i].answer->NBSTAT.names[j].name = safe_strdup(tmp);
+          dns->answers[i].answer->NBSTAT.names[j].name = dns_strdup(dns, tmp);
 
           /* Finally, read the flags. */
           dns->answers[i].answer->NBSTAT.names[j].name_flags = buffer_read_next_int16(buffer);
@@ -394,56 +466,53 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
   /* TODO */
   if(dns->authority_count)
   {
-    dns->authorities = (authority_t*) safe_malloc(dns->question_count * sizeof(question_t));
+    dns->authorities = (authority_t*) dns_alloc(dns, dns->question_count * sizeof(question_t));
   }
 
   if(dns->additional_count)
   {
-    dns->additionals = (additional_t*) safe_malloc(dns->additional_count * sizeof(additional_t));
+    dns->additionals = (additional_t*) dns_alloc(dns, dns->additional_count * sizeof(additional_t));
     for(i = 0; i < dns->additional_count; i++)
     {
-      dns->additionals[i].question   = buffer_read_next_dns_name(buffer); /* The question. */
+      dns->additionals[i].question   = buffer_read_next_dns_name(dns, buffer); /* The question. */
       dns->additionals[i].type       = buffer_read_next_int16(buffer); /* Type. */
       dns->additionals[i].class      = buffer_read_next_int16(buffer); /* Class. */
       dns->additionals[i].ttl        = buffer_read_next_int32(buffer); /* Time to live. */
-      dns->additionals[i].additional = (additional_types_t *) safe_malloc(sizeof(additional_types_t));
+      dns->additionals[i].additional = (additional_types_t *) dns_alloc(dns, sizeof(additional_types_t));
 
       if(dns->additionals[i].type == _DNS_TYPE_A) /* 0x0001 */
       {
         buffer_read_next_int16(buffer); /* String size (don't care) */
 
-        dns->additionals[i].additional->A.address = safe_malloc(16);
+        dns->additionals[i].additional->A.address = dns_alloc(dns, 16);
         buffer_read_next_ipv4_address(buffer, dns->additionals[i].additional->A.address);
       }
       else if(dns->additionals[i].type == _DNS_TYPE_NS) /* 0x0002 */
       {
         buffer_read_next_int16(buffer); /* String size. */
-        dns->additionals[i].additional->NS.name = buffer_read_next_dns_name(buffer); /* The additional. */
+        dns->additionals[i].additional->NS.name = buffer_read_next_dns_name(dns, buffer); /* The additional. */
       }
       else if(dns->additionals[i].type == _DNS_TYPE_CNAME) /* 0x0005 */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->CNAME.name = buffer_read_next_dns_name(buffer); /* The additional. */
+        dns->additionals[i].additional->CNAME.name = buffer_read_next_dns_name(dns, buffer); /* The additional. */
       }
       else if(dns->additionals[i].type == _DNS_TYPE_MX) /* 0x000F */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
         dns->additionals[i].additional->MX.preference = buffer_read_next_int16(buffer); /* Preference. */
-        dns->additionals[i].additional->MX.name       = buffer_read_next_dns_name(buffer); /* The additional. */
+        dns->additionals[i].additional->MX.name       = buffer_read_next_dns_name(dns, buffer); /* The additional. */
       }
       else if(dns->additionals[i].type == _DNS_TYPE_TEXT) /* 0x0010 */
       {
-        buffer_read_next_int16(buffer); /* String size (don't care). */
-        dns->additionals[i].additional->TEXT.length = buffer_read_next_int8(buffer); /* The actual length. */
-        dns->additionals[i].additional->TEXT.text = safe_malloc(dns->additionals[i].additional->TEXT.length); /* Allocate room for the additional. */
-        buffer_read_next_bytes(buffer, dns->additionals[i].additional->TEXT.text, dns->additionals[i].additional->TEXT.length); /* Read the additional. */
+        dns->additionals[i].additional->TEXT.text = buffer_read_next_text(dns, buffer, &dns->additionals[i].additional->TEXT.length); /* The additional, and its length. */
       }
 #ifndef WIN32
       else if(dns->additionals[i].type == _DNS_TYPE_AAAA) /* 0x001C */
       {
         buffer_read_next_int16(buffer); /* String size (don't care). */
 
-        dns->additionals[i].additional->AAAA.address = safe_malloc(40);
+        dns->additionals[i].additional->AAAA.address = dns_alloc(dns, 40);
         buffer_read_next_ipv6_address(buffer, dns->additionals[i].additional->AAAA.address);
       }
 #endif
@@ -452,7 +521,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
         buffer_read_next_int16(buffer); /* String size (don't care). */
 
         dns->additionals[i].additional->NB.flags   = buffer_read_next_int16(buffer);
-        dns->additionals[i].additional->NB.address = safe_malloc(16);
+        dns->additionals[i].additional->NB.address = dns_alloc(dns, 16);
         buffer_read_next_ipv4_address(buffer, dns->additionals[i].additional->NB.address);
       }
       else if(dns->additionals[i].type == _DNS_TYPE_NBSTAT) /* 0x0021 */
@@ -461,7 +530,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
 
         uint16_t size = buffer_read_next_int16(buffer); /* String size (don't care). */
         dns->additionals[i].additional->NBSTAT.name_count = buffer_read_next_int8(buffer);
-        dns->additionals[i].additional->NBSTAT.names      = (NBSTAT_name_t*) safe_malloc(sizeof(NBSTAT_name_t) * dns->additionals[i].additional->NBSTAT.name_count);
+        dns->additionals[i].additional->NBSTAT.names      = (NBSTAT_name_t*) dns_alloc(dns, sizeof(NBSTAT_name_t) * dns->additionals[i].additional->NBSTAT.name_count);
 
         /* Read the list of names. */
         for(j = 0; j < dns->additionals[i].additional->NBSTAT.name_count; j++)
@@ -482,7 +551,7 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
             *end = 0;
 
           /* Save this name. */
-          dns->additionals[i].additional->NBSTAT.names[j].name = safe_strdup(tmp);
+          dns->additionals[i].additional->NBSTAT.names[j].name = dns_strdup(dns, tmp);
 
           /* Finally, read the flags. */
           dns->additionals[i].additional->NBSTAT.names[j].name_flags = buffer_read_next_int16(buffer);
@@ -507,10 +576,19 @@ dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
   return dns;
 }
 
+dns_t *dns_create_from_packet(uint8_t *packet, size_t length)
+{
+  return dns_create_from_packet_in(NULL, packet, length);
+}
+
 void dns_destroy(dns_t *dns)
 {
   uint32_t i;
 
+  /* Everything belongs to the arena, and goes away when it's reset. */
+  if(dns->arena)
+    return;
+
   if(dns->questions)
   {
     /* Free the names. */
@@ -649,6 +727,9 @@ uint16_t dns_get_flags(dns_t *dns)
 
 void dns_add_question(dns_t *dns, char *name, dns_type_t type, dns_class_t class)
 {
+  /* Packets parsed into an arena are read-only. */
+  assert(!dns->arena);
+
   /* Increment the question count. */
   dns->question_count = dns->question_count + 1;
 
@@ -707,6 +788,9 @@ void dns_add_netbios_question(dns_t *dns, char *name, uint8_t name_type, char *s
 
 static void dns_add_answer(dns_t *dns, char *question, dns_type_t type, dns_class_t class, uint32_t ttl, answer_types_t *answer)
 {
+  /* Packets parsed into an arena are read-only. */
+  assert(!dns->arena);
+
   /* Increment the answer count. */
   dns->answer_count = dns->answer_count + 1;
 
@@ -755,7 +839,7 @@ void dns_add_answer_MX(dns_t *dns,    char *question, dns_class_t class, uint32_
   dns_add_answer(dns, question, _DNS_TYPE_MX, class, ttl, answer);
 }
 
-void dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length)
+void dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint16_t length)
 {
   answer_types_t *answer = safe_malloc(sizeof(answer_types_t));
   uint8_t *text_copy     = safe_malloc(length);
@@ -823,6 +907,9 @@ void dns_add_answer_NB(dns_t *dns,  char *question, uint8_t question_type, char
 /* This is pretty much identical to dns_add_answer. */
 static void dns_add_additional(dns_t *dns, char *question, dns_type_t type, dns_class_t class, uint32_t ttl, additional_types_t *additional)
 {
+  /* Packets parsed into an arena are read-only. */
+  assert(!dns->arena);
+
   /* Increment the additional count. */
   dns->additional_count = dns->additional_count + 1;
 
@@ -841,6 +928,25 @@ static void dns_add_additional(dns_t *dns, char *question, dns_type_t type, dns_
   (dns->additionals[dns->additional_count - 1]).additional = additional;
 }
 
+void dns_add_additional_OPT(dns_t *dns, uint16_t udp_size)
+{
+  /* The OPT record (RFC 6891) abuses the class for the UDP payload size, and
+   * the ttl for the extended rcode, version and flags (all 0). */
+  additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
+  dns_add_additional(dns, "", _DNS_TYPE_OPT, (dns_class_t)udp_size, 0, additional);
+}
+
+uint16_t dns_get_edns_size(dns_t *dns)
+{
+  uint16_t i;
+
+  for(i = 0; i < dns->additional_count; i++)
+    if(dns->additionals[i].type == _DNS_TYPE_OPT)
+      return MAX(dns->additionals[i].class, 512);
+
+  return 0;
+}
+
 void dns_add_additional_A(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *address)
 {
   additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
@@ -870,7 +976,7 @@ void dns_add_additional_MX(dns_t *dns,    char *question, dns_class_t class, uin
   dns_add_additional(dns, question, _DNS_TYPE_MX, class, ttl, additional);
 }
 
-void dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length)
+void dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint16_t length)
 {
   additional_types_t *additional = safe_malloc(sizeof(additional_types_t));
   uint8_t *text_copy     = safe_malloc(length);
@@ -1004,9 +1110,7 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
     }
     else if(dns->answers[i].type == _DNS_TYPE_TEXT)
     {
-      buffer_add_int16(buffer, dns->answers[i].answer->TEXT.length + 1);
-      buffer_add_int8(buffer, dns->answers[i].answer->TEXT.length);
-      buffer_add_bytes(buffer, dns->answers[i].answer->TEXT.text, dns->answers[i].answer->TEXT.length);
+      buffer_add_text(buffer, dns->answers[i].answer->TEXT.text, dns->answers[i].answer->TEXT.length);
     }
 #ifndef WIN32
     else if(dns->answers[i].type == _DNS_TYPE_AAAA)
@@ -1063,9 +1167,7 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
     }
     else if(dns->additionals[i].type == _DNS_TYPE_TEXT)
     {
-      buffer_add_int16(buffer, dns->additionals[i].additional->TEXT.length + 1);
-      buffer_add_int8(buffer, dns->additionals[i].additional->TEXT.length);
-      buffer_add_bytes(buffer, dns->additionals[i].additional->TEXT.text, dns->additionals[i].additional->TEXT.length);
+      buffer_add_text(buffer, dns->additionals[i].additional->TEXT.text, dns->additionals[i].additional->TEXT.length);
     }
 #ifndef WIN32
     else if(dns->additionals[i].type == _DNS_TYPE_AAAA)
@@ -1080,6 +1182,11 @@ uint8_t *dns_to_packet(dns_t *dns, size_t *length)
       buffer_add_int16(buffer, dns->additionals[i].additional->NB.flags);
       buffer_add_ipv4_address(buffer, dns->additionals[i].additional->NB.address);
     }
+    else if(dns->additionals[i].type == _DNS_TYPE_OPT)
+    {
+      /* Everything's in the class and ttl; we don't use any options. */
+      buffer_add_int16(buffer, 0);
+    }
     else
     {
       fprintf(stderr, "WARNING: Don't know how to build additional type 0x%02x; skipping!\n", dns->additionals[i].type);
@@ -1185,27 +1292,29 @@ uint8_t *dns_create_error_string(uint16_t trn_id, question_t question, size_t *l
   return packet;
 }
 
-/* Gets the first system dns server. */
-char *dns_get_system()
+/* Gets the system dns servers. */
+size_t dns_get_system(char **servers, size_t max_servers)
 {
 #ifdef WIN32
   DNS_STATUS error;
 
   DWORD address;
+  DWORD i;
 
-  char      *straddress = safe_malloc(16);
+  char      *straddress;
+  size_t     count = 0;
 
   /* Set the initial length to something we know is going to be wrong. */
   DWORD      length  = sizeof(IP4_ARRAY);
-  IP4_ARRAY *servers = safe_malloc(length);
+  IP4_ARRAY *list    = safe_malloc(length);
 
   /* Call the function, which will inevitably return an error but will also tell us how much memory we need. */
-  error = DnsQueryConfig(DnsConfigDnsServerList, 0, NULL, NULL, servers, &length);
+  error = DnsQueryConfig(DnsConfigDnsServerList, 0, NULL, NULL, list, &length);
   if(error == ERROR_MORE_DATA)
-    servers = safe_realloc(servers, length);
+    list = safe_realloc(list, length);
 
   /* Nowe that we have the right length, this call should succeed. */
-  error = DnsQueryConfig(DnsConfigDnsServerList, 0, NULL, NULL, servers, &length);
+  error = DnsQueryConfig(DnsConfigDnsServerList, 0, NULL, NULL, list, &length);
 
   /* Check for an error. */
   if(error)
@@ -1216,41 +1325,39 @@ char *dns_get_system()
   }
 
   /* Check if no servers were returned. */
-  if(servers->AddrCount == 0)
+  if(list->AddrCount == 0)
   {
     fprintf(stderr, "Couldn't find any system dns servers");
     fprintf(stderr, "You can use --dns to set a custom dns server.\n");
     exit(1);
   }
 
-  /* Take the first DNS server. */
-  address = servers->AddrArray[0];
+  for(i = 0; i < list->AddrCount && count < max_servers; i++)
+  {
+    address = list->AddrArray[i];
+
+    /* Convert the address to a string representation. */
+    straddress = safe_malloc(16);
+    sprintf_s(straddress, 16, "%d.%d.%d.%d", (address >>  0) & 0x000000FF,
+                       (address >>  8) & 0x000000FF,
+                       (address >> 16) & 0x000000FF,
+                       (address >> 24) & 0x000000FF);
+    servers[count++] = straddress;
+  }
 
   /* Get rid of the array (we don't need it anymore). */
-  safe_free(servers);
-
-  /* Convert the address to a string representation. */
-#ifdef WIN32
-  sprintf_s(straddress, 16, "%d.%d.%d.%d", (address >>  0) & 0x000000FF,
-                     (address >>  8) & 0x000000FF,
-                     (address >> 16) & 0x000000FF,
-                     (address >> 24) & 0x000000FF);
-#else
-  sprintf(straddress, "%d.%d.%d.%d", (address >>  0) & 0x000000FF,
-                     (address >>  8) & 0x000000FF,
-                     (address >> 16) & 0x000000FF,
-                     (address >> 24) & 0x000000FF);
-#endif
+  safe_free(list);
 
-  return straddress;
+  return count;
 #else
-  FILE *file = fopen("/etc/resolv.conf", "r");
-  char  buffer[1024];
+  FILE  *file = fopen("/etc/resolv.conf", "r");
+  char   buffer[1024];
+  size_t count = 0;
 
   if(!file)
-    return NULL;
+    return 0;
 
-  while(fgets(buffer, 1024, file))
+  while(count < max_servers && fgets(buffer, 1024, file))
   {
     if(strstr(buffer, "nameserver") == buffer)
     {
@@ -1280,13 +1387,13 @@ char *dns_get_system()
       if(end[0])
         end[0] = '\0';
 
-
-      /* In theory, we should now have the address of the first entry in resolv.conf. */
-      return safe_strdup(address);
+      servers[count++] = safe_strdup(address);
     }
   }
 
-  return NULL;
+  fclose(file);
+
+  return count;
 #endif
 }
 
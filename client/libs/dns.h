@@ -19,6 +19,7 @@
 #ifndef __DNS_H__
 #define __DNS_H__
 
+#include "arena.h"
 #include "types.h"
 
 /* Define a list of dns types. The initial '_' in all the names here is because Windows
@@ -215,7 +216,7 @@ typedef struct
 typedef struct
 {
   uint8_t *text;
-  uint8_t  length;
+  uint16_t length;
 } TEXT_answer_t;
 
 /* A NetBIOS answer (NB) is used by Windows on port 137. */
@@ -302,7 +303,7 @@ typedef struct
 typedef struct
 {
   uint8_t *text;
-  uint8_t  length;
+  uint16_t length;
 } TEXT_additional_t;
 
 /* A NetBIOS additional (NB) is used by Windows on port 137. */
@@ -362,6 +363,10 @@ typedef struct
   answer_t     *answers;
   authority_t  *authorities;
   additional_t *additionals;
+
+  /* If set, everything above was allocated from this arena, and is freed
+   * when it's reset rather than by dns_destroy(). */
+  arena_t      *arena;
 } dns_t;
 
 /* Allocate memory for a blank dns structure. Should be freed with dns_free(). */
@@ -371,6 +376,12 @@ dns_t   *dns_create(dns_opcode_t opcode, dns_flag_t flags, dns_rcode_t rcode);
  * Should also be cleaned up with dns_destroy(). */
 dns_t   *dns_create_from_packet(uint8_t *packet, size_t length);
 
+/* The same as dns_create_from_packet(), except that the dns_t and all its
+ * pieces are allocated from the given arena. dns_destroy() is a no-op for it;
+ * the memory is released by the next arena_reset(). The result is read-only,
+ * so don't try to add anything to it. */
+dns_t   *dns_create_from_packet_in(arena_t *arena, uint8_t *packet, size_t length);
+
 /* De-allocate memory and resources from a dns object. */
 void     dns_destroy(dns_t *dns);
 
@@ -387,18 +398,26 @@ void     dns_add_answer_A(dns_t *dns,     char *question, dns_class_t class, uin
 void     dns_add_answer_NS(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, char *name);
 void     dns_add_answer_CNAME(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *name);
 void     dns_add_answer_MX(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, uint16_t preference, char *name);
-void     dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length);
+void     dns_add_answer_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint16_t length);
 #ifndef WIN32
 void     dns_add_answer_AAAA(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, char *address);
 #endif
 void     dns_add_answer_NB(dns_t *dns,  char *question, uint8_t question_type, char *scope, dns_class_t class, uint32_t ttl, uint16_t flags, char *address);
 
+/* Add an EDNS0 OPT record, advertising that we can take UDP responses of up to
+ * udp_size bytes. */
+void     dns_add_additional_OPT(dns_t *dns, uint16_t udp_size);
+
+/* The UDP payload size advertised in the packet's OPT record (never less than
+ * 512), or 0 if it doesn't have one. */
+uint16_t dns_get_edns_size(dns_t *dns);
+
 /* These functions add additionals of the various types. */
 void     dns_add_additional_A(dns_t *dns,     char *question, dns_class_t class, uint32_t ttl, char *address);
 void     dns_add_additional_NS(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, char *name);
 void     dns_add_additional_CNAME(dns_t *dns, char *question, dns_class_t class, uint32_t ttl, char *name);
 void     dns_add_additional_MX(dns_t *dns,    char *question, dns_class_t class, uint32_t ttl, uint16_t preference, char *name);
-void     dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint8_t length);
+void     dns_add_additional_TEXT(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, uint8_t *text, uint16_t length);
 #ifndef WIN32
 void     dns_add_additional_AAAA(dns_t *dns,  char *question, dns_class_t class, uint32_t ttl, char *address);
 #endif
@@ -415,8 +434,10 @@ dns_t   *dns_create_error(uint16_t trn_id, question_t question);
 /* Create a DNS error packet, ready to send. */
 uint8_t *dns_create_error_string(uint16_t trn_id, question_t question, size_t *length);
 
-/* Get the first system DNS server. Works on Windows and any system that uses /etc/resolv.conf. */
-char *dns_get_system();
+/* Get up to max_servers of the system DNS servers, each allocated with
+ * safe_malloc(); returns how many there were. Works on Windows and any system
+ * that uses /etc/resolv.conf. */
+size_t dns_get_system(char **servers, size_t max_servers);
 
 /* Runs dnstest and exits. Useful for --test parameters on any of the dns* programs. */
 void dns_do_test(char *domain);
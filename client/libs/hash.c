@@ -0,0 +1,244 @@
+/* hash.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+
+#include "memory.h"
+
+#include "hash.h"
+
+#define HASH_MIN_BITS 4
+
+hash_t *hash_create(cmpfunc_t *cmpfunc, hashfunc_t *hashfunc)
+{
+  hash_t *hash = (hash_t*) safe_malloc(sizeof(hash_t));
+
+  if(cmpfunc && !hashfunc)
+  {
+    printf("A hash table with a cmpfunc needs a hashfunc, too!\n");
+    exit(1);
+  }
+
+  hash->bits       = HASH_MIN_BITS;
+  hash->buckets    = (hash_entry_t**) safe_malloc(((size_t)1 << hash->bits) * sizeof(hash_entry_t*));
+  hash->count      = 0;
+  hash->first_used = 0;
+  hash->cmpfunc    = cmpfunc;
+  hash->hashfunc   = hashfunc;
+
+  return hash;
+}
+
+void hash_destroy(hash_t *hash)
+{
+  hash_entry_t *entry;
+  size_t        i;
+
+  for(i = 0; i < ((size_t)1 << hash->bits); i++)
+  {
+    while((entry = hash->buckets[i]))
+    {
+      hash->buckets[i] = entry->next;
+      safe_free(entry);
+    }
+  }
+
+  safe_free(hash->buckets);
+  safe_free(hash);
+}
+
+static uint32_t hash_index(hash_t *hash, ll_index_t index)
+{
+  uint64_t value = 0;
+
+  switch(index.type)
+  {
+    case LL_8:
+      value = index.value.u8;
+      break;
+
+    case LL_16:
+      value = index.value.u16;
+      break;
+
+    case LL_32:
+      value = index.value.u32;
+      break;
+
+    case LL_64:
+      value = index.value.u64;
+      break;
+
+    case LL_PTR:
+      if(hash->cmpfunc)
+        value = hash->hashfunc(index.value.ptr);
+      else
+        value = (uint64_t)(size_t)index.value.ptr;
+      break;
+  }
+
+  /* Knuth's multiplicative hash; the top bits pick the bucket. */
+  return ((uint32_t)(value ^ (value >> 32)) ^ (uint32_t)index.type) * 2654435761UL;
+}
+
+static size_t get_bucket(hash_t *hash, ll_index_t index)
+{
+  return (size_t)(hash_index(hash, index) >> (32 - hash->bits));
+}
+
+static NBBOOL index_equals(hash_t *hash, ll_index_t a, ll_index_t b)
+{
+  if(a.type != b.type)
+    return FALSE;
+
+  switch(a.type)
+  {
+    case LL_8:
+      return a.value.u8 == b.value.u8;
+
+    case LL_16:
+      return a.value.u16 == b.value.u16;
+
+    case LL_32:
+      return a.value.u32 == b.value.u32;
+
+    case LL_64:
+      return a.value.u64 == b.value.u64;
+
+    case LL_PTR:
+      if(hash->cmpfunc)
+        return hash->cmpfunc(a.value.ptr, b.value.ptr) == 0;
+      return a.value.ptr == b.value.ptr;
+  }
+
+  return FALSE;
+}
+
+/* Double the number of buckets and re-distribute the entries. */
+static void grow(hash_t *hash)
+{
+  hash_entry_t **old_buckets = hash->buckets;
+  size_t         old_size    = (size_t)1 << hash->bits;
+  hash_entry_t  *entry;
+  size_t         i;
+  size_t         bucket;
+
+  hash->bits++;
+  hash->first_used = 0;
+  hash->buckets = (hash_entry_t**) safe_malloc(((size_t)1 << hash->bits) * sizeof(hash_entry_t*));
+
+  for(i = 0; i < old_size; i++)
+  {
+    while((entry = old_buckets[i]))
+    {
+      old_buckets[i] = entry->next;
+
+      bucket = get_bucket(hash, entry->index);
+      entry->next = hash->buckets[bucket];
+      hash->buckets[bucket] = entry;
+    }
+  }
+
+  safe_free(old_buckets);
+}
+
+void *hash_add(hash_t *hash, ll_index_t index, void *data)
+{
+  void         *old_data = hash_remove(hash, index);
+  hash_entry_t *entry    = (hash_entry_t*) safe_malloc(sizeof(hash_entry_t));
+  size_t        bucket;
+
+  if(hash->count >= ((size_t)1 << hash->bits))
+    grow(hash);
+
+  bucket = get_bucket(hash, index);
+
+  entry->index = index;
+  entry->data  = data;
+  entry->next  = hash->buckets[bucket];
+  hash->buckets[bucket] = entry;
+  hash->count++;
+
+  if(bucket < hash->first_used)
+    hash->first_used = bucket;
+
+  return old_data;
+}
+
+void *hash_remove(hash_t *hash, ll_index_t index)
+{
+  hash_entry_t **link = &hash->buckets[get_bucket(hash, index)];
+  hash_entry_t  *entry;
+  void          *data;
+
+  for(; (entry = *link); link = &entry->next)
+  {
+    if(index_equals(hash, entry->index, index))
+    {
+      *link = entry->next;
+      data  = entry->data;
+
+      safe_free(entry);
+      hash->count--;
+
+      return data;
+    }
+  }
+
+  return NULL;
+}
+
+void *hash_find(hash_t *hash, ll_index_t index)
+{
+  hash_entry_t *entry;
+
+  for(entry = hash->buckets[get_bucket(hash, index)]; entry; entry = entry->next)
+    if(index_equals(hash, entry->index, index))
+      return entry->data;
+
+  return NULL;
+}
+
+void *hash_remove_any(hash_t *hash)
+{
+  size_t        i;
+  hash_entry_t *entry;
+  void         *data;
+
+  for(i = hash->first_used; i < ((size_t)1 << hash->bits); i++)
+  {
+    hash->first_used = i;
+
+    if((entry = hash->buckets[i]))
+    {
+      hash->buckets[i] = entry->next;
+      data = entry->data;
+
+      safe_free(entry);
+      hash->count--;
+
+      return data;
+    }
+  }
+
+  return NULL;
+}
+
+size_t hash_get_count(hash_t *hash)
+{
+  return hash->count;
+}
+
+void hash_each(hash_t *hash, hash_each_t *callback, void *param)
+{
+  size_t        i;
+  hash_entry_t *entry;
+
+  for(i = 0; i < ((size_t)1 << hash->bits); i++)
+    for(entry = hash->buckets[i]; entry; entry = entry->next)
+      callback(entry->index, entry->data, param);
+}
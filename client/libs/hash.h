@@ -0,0 +1,79 @@
+/* hash.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A hash table with the same keys (ll_index_t) and much the same interface
+ * as ll_t, for when there are enough entries that walking a list for every
+ * lookup starts to hurt (like the tunnels of a busy port-forward).
+ *
+ * It's separately chained, and the number of buckets doubles whenever there
+ * are more entries than buckets, so lookups stay constant-time on average.
+ * Keys of different types never match, even if their values are equal.
+ */
+
+#ifndef __HASH_H__
+#define __HASH_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+#include "ll.h"
+
+/* For LL_PTR keys compared with a cmpfunc_t; equal keys have to hash the
+ * same. */
+typedef uint32_t(hashfunc_t)(const void *);
+
+/* Called by hash_each() for each entry. */
+typedef void(hash_each_t)(ll_index_t index, void *data, void *param);
+
+typedef struct _hash_entry_t
+{
+  ll_index_t             index;
+  void                  *data;
+  struct _hash_entry_t  *next;
+} hash_entry_t;
+
+/* This struct shouldn't be accessed directly */
+typedef struct
+{
+  hash_entry_t **buckets;
+
+  /* The number of buckets is always 1 << bits. */
+  size_t         bits;
+  size_t         count;
+
+  /* No bucket before this one has anything in it (so emptying the table
+   * with hash_remove_any() doesn't keep re-scanning the empty ones). */
+  size_t         first_used;
+
+  cmpfunc_t     *cmpfunc;
+  hashfunc_t    *hashfunc;
+} hash_t;
+
+/* Without a cmpfunc, LL_PTR keys are compared (and hashed) by address; with
+ * one (it returns 0 for equal keys, like strcmp()), hashfunc is required
+ * too. */
+hash_t *hash_create(cmpfunc_t *cmpfunc, hashfunc_t *hashfunc);
+
+/* Frees the table, but not the data in it. */
+void    hash_destroy(hash_t *hash);
+
+/* All of these return the data that was stored under the index (for
+ * hash_add(), the data it replaced), or NULL. */
+void   *hash_add(hash_t *hash,    ll_index_t index, void *data);
+void   *hash_remove(hash_t *hash, ll_index_t index);
+void   *hash_find(hash_t *hash,   ll_index_t index);
+
+/* Remove and return some entry (NULL if it's empty); handy for emptying the
+ * table. */
+void   *hash_remove_any(hash_t *hash);
+
+size_t  hash_get_count(hash_t *hash);
+
+/* Call callback for every entry, in no particular order. It mustn't add or
+ * remove anything. */
+void    hash_each(hash_t *hash, hash_each_t *callback, void *param);
+
+#endif
@@ -116,10 +116,12 @@ void *ll_remove_first(ll_t *ll)
 {
   ll_element_t *first = ll->first;
 
-  if(first)
-    ll->first = (ll_element_t *)first->next;
+  if(!first)
+    return NULL;
 
-  return first ? first->data : NULL;
+  ll->first = (ll_element_t *)first->next;
+
+  return destroy_element(first);
 }
 
 void *ll_find(ll_t *ll, ll_index_t index)
@@ -7,18 +7,76 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <string.h>
+
+#ifdef USE_THREADS
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#endif
 
 #include "assert.h"
 #include "memory.h"
+#include "types.h"
 
 #include "log.h"
 
+/* How much formatted text can be waiting to be written, and the longest one
+ * message can be (longer ones are cut short). */
+#define LOG_RING_SIZE   65536
+#define LOG_LINE_LENGTH 1024
+
+/* Where each message in the ring is going. */
+#define LOG_TO_CONSOLE  0x01
+#define LOG_TO_FILE     0x02
+
+/* Each message in the ring is a one-byte destination, a two-byte length,
+ * then the text. */
+#define LOG_ENTRY_HEADER 3
+
+#ifdef USE_THREADS
+/* So the writer sees the message before it sees the new head (and the other
+ * way around for the tail). */
+#ifdef WIN32
+#define LOG_BARRIER() MemoryBarrier()
+#define LOG_SLEEP()   Sleep(10)
+#else
+#define LOG_BARRIER() __sync_synchronize()
+#define LOG_SLEEP()   usleep(10000)
+#endif
+#else
+#define LOG_BARRIER()
+#endif
+
 static log_level_t log_console_min = LOG_LEVEL_WARNING;
 static log_level_t log_file_min = LOG_LEVEL_INFO;
 static FILE *log_file = NULL;
 
+log_level_t log_lowest_level = LOG_LEVEL_WARNING;
+
 static char *log_levels[] = { "INFO", "WARNING", "ERROR", "FATAL" };
 
+/* The ring: head is only changed by whoever's logging, and tail by whoever's
+ * writing, so (with one of each) neither needs a lock. */
+static char            ring[LOG_RING_SIZE];
+static volatile size_t ring_head = 0;
+static volatile size_t ring_tail = 0;
+
+/* Messages the writer thread didn't have room for. */
+static size_t dropped = 0;
+
+static NBBOOL started = FALSE;
+
+static void update_lowest_level()
+{
+  log_lowest_level = log_console_min;
+  if(log_file && log_file_min < log_lowest_level)
+    log_lowest_level = log_file_min;
+}
+
 void log_to_file(char *filename, log_level_t min_level)
 {
   assert(min_level >= LOG_LEVEL_INFO || min_level <= LOG_LEVEL_FATAL);
@@ -32,6 +90,8 @@ void log_to_file(char *filename, log_level_t min_level)
     log_file_min = min_level;
   else
     LOG_WARNING("Couldn't open logfile: %s", filename);
+
+  update_lowest_level();
 }
 
 void log_set_min_console_level(log_level_t min_level)
@@ -39,6 +99,7 @@ void log_set_min_console_level(log_level_t min_level)
   assert(min_level >= LOG_LEVEL_INFO || min_level <= LOG_LEVEL_FATAL);
 
   log_console_min = min_level;
+  update_lowest_level();
 }
 
 log_level_t log_get_min_console_level()
@@ -46,22 +107,200 @@ log_level_t log_get_min_console_level()
   return log_console_min;
 }
 
-/* Most of this code is from the manpage for vsprintf() */
+static size_t ring_used()
+{
+  return (ring_head - ring_tail + LOG_RING_SIZE) % LOG_RING_SIZE;
+}
+
+static void ring_read(size_t offset, char *out, size_t length)
+{
+  size_t i;
+
+  for(i = 0; i < length; i++)
+    out[i] = ring[(offset + i) % LOG_RING_SIZE];
+}
+
+static void ring_write(size_t offset, char *data, size_t length)
+{
+  size_t i;
+
+  for(i = 0; i < length; i++)
+    ring[(offset + i) % LOG_RING_SIZE] = data[i];
+}
+
+/* Write out whatever's in the ring (only one thing should be doing this). */
+static void drain()
+{
+  char   line[LOG_LINE_LENGTH];
+  char   header[LOG_ENTRY_HEADER];
+  size_t length;
+  NBBOOL wrote_file = FALSE;
+
+  while(ring_tail != ring_head)
+  {
+    LOG_BARRIER();
+
+    ring_read(ring_tail, header, LOG_ENTRY_HEADER);
+    length = ((uint8_t)header[1] << 8) | (uint8_t)header[2];
+    ring_read(ring_tail + LOG_ENTRY_HEADER, line, length);
+
+    if(header[0] & LOG_TO_CONSOLE)
+      fwrite(line, 1, length, stderr);
+    if((header[0] & LOG_TO_FILE) && log_file)
+    {
+      fwrite(line, 1, length, log_file);
+      wrote_file = TRUE;
+    }
+
+    LOG_BARRIER();
+    ring_tail = (ring_tail + LOG_ENTRY_HEADER + length) % LOG_RING_SIZE;
+  }
+
+  if(wrote_file)
+    fflush(log_file);
+}
+
+#ifdef USE_THREADS
+#ifdef WIN32
+static DWORD WINAPI writer_thread(void *param)
+#else
+static void *writer_thread(void *param)
+#endif
+{
+  while(TRUE)
+  {
+    drain();
+    LOG_SLEEP();
+  }
+
+  return 0;
+}
+#endif
+
+/* The first time anything's logged, make sure it's all written at exit (and
+ * start the writer, if there is one). */
+static void start()
+{
+#ifdef USE_THREADS
+#ifdef WIN32
+  HANDLE thread;
+#else
+  pthread_t thread;
+#endif
+#endif
+
+  started = TRUE;
+  atexit(log_flush);
+
+#ifdef USE_THREADS
+#ifdef WIN32
+  thread = CreateThread(NULL, 0, writer_thread, NULL, 0, NULL);
+  if(!thread)
+    DIE("log: couldn't create a thread");
+#else
+  if(pthread_create(&thread, NULL, writer_thread, NULL))
+    DIE("log: couldn't create a thread");
+  pthread_detach(thread);
+#endif
+#endif
+}
+
+void log_drain()
+{
+#ifndef USE_THREADS
+  drain();
+#endif
+}
+
+void log_flush()
+{
+#ifdef USE_THREADS
+  /* Give the writer a second to catch up; if it can't, it's stuck (and so
+   * would we be). */
+  int i;
+
+  for(i = 0; i < 100 && ring_tail != ring_head; i++)
+    LOG_SLEEP();
+#else
+  drain();
+#endif
+}
+
 static void log_internal(log_level_t level, char *format, va_list args)
 {
+  char   line[LOG_LINE_LENGTH];
+  char   header[LOG_ENTRY_HEADER];
+  int    prefix_length;
+  int    length;
+  char   where = 0;
+
   assert(level >= LOG_LEVEL_INFO || level <= LOG_LEVEL_FATAL);
 
   if(level >= log_console_min)
+    where |= LOG_TO_CONSOLE;
+  if(log_file && level >= log_file_min)
+    where |= LOG_TO_FILE;
+  if(!where)
+    return;
+
+  if(!started)
+    start();
+
+  prefix_length = sprintf(line, "[[ %s ]] :: ", log_levels[level]);
+
+  /* Leave room for the newline; a message that's cut short just ends. */
+#ifdef WIN32
+  length = _vsnprintf(line + prefix_length, sizeof(line) - prefix_length - 1, format, args);
+#else
+  length = vsnprintf(line + prefix_length, sizeof(line) - prefix_length - 1, format, args);
+#endif
+  if(length < 0 || length > (int)(sizeof(line) - prefix_length - 2))
+    length = sizeof(line) - prefix_length - 2;
+  length += prefix_length;
+  line[length++] = '\n';
+
+  /* Make room, if we can; otherwise count it and let the writer catch up. */
+  if(ring_used() + LOG_ENTRY_HEADER + length >= LOG_RING_SIZE)
   {
-    fprintf(stderr, "[[ %s ]] :: ", log_levels[level]);
-    vfprintf(stderr, format, args);
-    fprintf(stderr, "\n");
+#ifdef USE_THREADS
+    dropped++;
+    return;
+#else
+    drain();
+#endif
   }
 
-  if(log_file && level >= log_file_min)
+  if(dropped)
   {
-    vfprintf(log_file, format, args);
+    char note[64];
+    int  note_length = sprintf(note, "[[ WARNING ]] :: (%u log messages dropped)\n", (unsigned int)dropped);
+
+    if(ring_used() + (LOG_ENTRY_HEADER * 2) + note_length + length < LOG_RING_SIZE)
+    {
+      header[0] = where;
+      header[1] = (char)(note_length >> 8);
+      header[2] = (char)(note_length & 0xFF);
+      ring_write(ring_head, header, LOG_ENTRY_HEADER);
+      ring_write(ring_head + LOG_ENTRY_HEADER, note, note_length);
+
+      LOG_BARRIER();
+      ring_head = (ring_head + LOG_ENTRY_HEADER + note_length) % LOG_RING_SIZE;
+      dropped = 0;
+    }
   }
+
+  header[0] = where;
+  header[1] = (char)(length >> 8);
+  header[2] = (char)(length & 0xFF);
+  ring_write(ring_head, header, LOG_ENTRY_HEADER);
+  ring_write(ring_head + LOG_ENTRY_HEADER, line, length);
+
+  LOG_BARRIER();
+  ring_head = (ring_head + LOG_ENTRY_HEADER + length) % LOG_RING_SIZE;
+
+  /* The program's probably about to die; don't make it wait. */
+  if(level == LOG_LEVEL_FATAL)
+    log_flush();
 }
 
 void log_info(char *format, ...)
@@ -5,6 +5,21 @@
  *
  * This is a pretty boring module that is used for logging data to the
  * console.
+ *
+ * The LOG_* macros check the level before anything else happens, so a
+ * message that won't be shown doesn't cost its arguments or the formatting
+ * (which also means the arguments mustn't have side effects). Building with
+ * -DLOG_MIN_LEVEL=<n> ('make release' uses 1) leaves out everything below
+ * level n altogether.
+ *
+ * Messages that are shown are formatted into a ring buffer, and written out
+ * by log_drain() - from the select loop, between rounds - or, with
+ * USE_THREADS, by a thread of its own, so a slow terminal or disk doesn't
+ * hold up the tunnel. If the thread falls that far behind, messages are
+ * dropped (and counted) rather than waited on. FATAL messages are always
+ * written right away.
+ *
+ * Only one thread should log at a time.
  */
 
 #ifndef __LOG_H__
@@ -18,12 +33,22 @@ typedef enum
   LOG_LEVEL_FATAL   = 3
 } log_level_t;
 
-#define LOG_INFO    log_info
-#define LOG_WARNING log_warning
-#define LOG_ERROR   log_error
-#define LOG_FATAL   log_fatal
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL 0
+#endif
 
-void log_init();
+/* The lowest level anything (the console or the file) wants; kept up to
+ * date by the log_* functions below. Use log_is_enabled() rather than
+ * reading it. */
+extern log_level_t log_lowest_level;
+
+#define log_is_enabled(level) ((level) >= LOG_MIN_LEVEL && (level) >= log_lowest_level)
+
+/* These are used like printf(). */
+#define LOG_INFO    !log_is_enabled(LOG_LEVEL_INFO)    ? (void)0 : log_info
+#define LOG_WARNING !log_is_enabled(LOG_LEVEL_WARNING) ? (void)0 : log_warning
+#define LOG_ERROR   !log_is_enabled(LOG_LEVEL_ERROR)   ? (void)0 : log_error
+#define LOG_FATAL   log_fatal
 
 void log_to_file(char *filename, log_level_t min_level);
 void log_set_min_console_level(log_level_t level);
@@ -34,4 +59,14 @@ void log_warning(char *format, ...);
 void log_error(char *format, ...);
 void log_fatal(char *format, ...);
 
+/* Write out everything that's been logged so far, unless the thread is
+ * doing it (then this does nothing); it never waits, so the select loop
+ * calls it between rounds. */
+void log_drain();
+
+/* Write out everything that's been logged so far (with USE_THREADS, wait
+ * up to a second for the thread to); this is called at exit and for FATAL
+ * messages, and shouldn't be anywhere the tunnel's waiting on it. */
+void log_flush();
+
 #endif
@@ -22,9 +22,59 @@ typedef struct entry
 } entry_t;
 
 #ifdef TESTMEMORY
-static entry_t *first           = NULL;
+/* The allocations, hashed by address, so programs that keep a lot of memory
+ * around don't slow to a crawl. */
+#define ENTRY_BUCKETS 4096
+static entry_t *buckets[ENTRY_BUCKETS];
+
+static entry_t **get_bucket(void *memory)
+{
+  return &buckets[(((size_t)memory) >> 4) % ENTRY_BUCKETS];
+}
+#endif
+
+#ifdef MEMORY_POOL
+/* Blocks up to 2048 bytes come from per-size free lists, carved from
+ * MEMORY_SLAB_SIZE chunks that are never given back; bigger ones go
+ * straight to malloc(). Every block starts with a header saying which it
+ * is (MEMORY_HEADER bytes, to keep the alignment malloc() gives us).
+ *
+ * There's no locking: only the main thread allocates (see worker.h). */
+#define MEMORY_CLASSES     8
+#define MEMORY_MIN_CLASS   16
+#ifndef MEMORY_SLAB_SIZE
+#define MEMORY_SLAB_SIZE   65536
+#endif
+#define MEMORY_HEADER      16
+#define MEMORY_LARGE       ((size_t)-1)
+
+typedef struct block
+{
+  struct block *next;
+} block_t;
+
+static block_t *free_lists[MEMORY_CLASSES];
+
+#ifdef MEMORY_STATIC
+/* The slabs come from here first (the union is just for its alignment,
+ * which has to be as good as malloc()'s). */
+static union
+{
+  uint8_t     bytes[MEMORY_STATIC];
+  long double align_number;
+  void       *align_pointer;
+} static_pool;
+static size_t static_used = 0;
 #endif
 
+static size_t class_size(size_t size_class)
+{
+  return ((size_t)MEMORY_MIN_CLASS) << size_class;
+}
+#endif
+
+static size_t   allocation_count = 0;
+
 static void die(char *msg, char *file, int line)
 {
   printf("\n\nUnrecoverable error at %s:%d: %s\n\n", file, line, msg);
@@ -40,13 +90,14 @@ static void die_mem(char *file, int line)
 void add_entry(char *file, int line, void *memory, size_t size)
 {
 #ifdef TESTMEMORY
+  entry_t **bucket = get_bucket(memory);
   entry_t *current = (entry_t*) malloc(sizeof(entry_t));
   if(!current)
     die_mem(file, line);
 
-  /* Put the new entry at the front of the list. */
-  current->next = first;
-  first         = current;
+  /* Put the new entry at the front of its bucket. */
+  current->next = *bucket;
+  *bucket       = current;
 
   current->file   = file;
   current->line   = line;
@@ -58,16 +109,35 @@ void add_entry(char *file, int line, void *memory, size_t size)
 void update_entry(void *old_memory, void *new_memory, int new_size, char *file, int line)
 {
 #ifdef TESTMEMORY
-  entry_t *current = first;
+  entry_t **bucket = get_bucket(old_memory);
+  entry_t *last    = NULL;
+  entry_t *current = *bucket;
+
+  /* Like realloc(), re-allocating NULL is just allocating. */
+  if(!old_memory)
+  {
+    add_entry(file, line, new_memory, new_size);
+    return;
+  }
 
   while(current)
   {
     if(current->memory == old_memory)
     {
+      /* Take it out of its bucket, then put it in the new one. */
+      if(last)
+        last->next = current->next;
+      else
+        *bucket = current->next;
+
+      bucket = get_bucket(new_memory);
+      current->next   = *bucket;
+      *bucket         = current;
       current->memory = new_memory;
       current->size   = new_size;
       return;
     }
+    last = current;
     current = current->next;
   }
 
@@ -78,17 +148,18 @@ void update_entry(void *old_memory, void *new_memory, int new_size, char *file,
 void remove_entry(void *memory, char *file, int line)
 {
 #ifdef TESTMEMORY
+  entry_t **bucket = get_bucket(memory);
   entry_t *last    = NULL;
-  entry_t *current = first;
+  entry_t *current = *bucket;
 
   while(current)
   {
     if(current->memory == memory)
     {
-      if(current == first)
+      if(current == *bucket)
       {
         /* Beginning of the list. */
-        first = first->next;
+        *bucket = current->next;
         free(current);
       }
       else
@@ -111,40 +182,181 @@ void remove_entry(void *memory, char *file, int line)
 void print_memory()
 {
 #ifdef TESTMEMORY
-  if(first == NULL)
+  NBBOOL   found = FALSE;
+  entry_t *current;
+  size_t   i;
+
+  for(i = 0; i < ENTRY_BUCKETS; i++)
   {
+    for(current = buckets[i]; current; current = current->next)
+    {
+      if(!found)
+        fprintf(stderr, "Allocated memory:\n");
+      found = TRUE;
+
+      fprintf(stderr, "%p: 0x%08x bytes allocated at %s:%d\n", current->memory, (unsigned int)current->size, current->file, current->line);
+    }
+  }
+
+  if(!found)
     fprintf(stderr, "No allocated memory. Congratulations!\n");
+#endif
+}
+
+size_t memory_get_allocation_count()
+{
+  return allocation_count;
+}
+
+#ifdef MEMORY_POOL
+static uint8_t *get_slab()
+{
+#ifdef MEMORY_STATIC
+  if(static_used + MEMORY_SLAB_SIZE <= MEMORY_STATIC)
+  {
+    uint8_t *slab = static_pool.bytes + static_used;
+
+    static_used += MEMORY_SLAB_SIZE;
+    return slab;
   }
-  else
+#endif
+
+  return malloc(MEMORY_SLAB_SIZE);
+}
+
+static void *pool_alloc(size_t size)
+{
+  size_t   size_class;
+  uint8_t *block;
+
+  for(size_class = 0; size_class < MEMORY_CLASSES && class_size(size_class) < size; size_class++)
+    ;
+
+  if(size_class == MEMORY_CLASSES)
+  {
+    block = malloc(MEMORY_HEADER + size);
+    if(!block)
+      return NULL;
+    *(size_t*)block = MEMORY_LARGE;
+    return block + MEMORY_HEADER;
+  }
+
+  /* Carve a new slab into blocks if this size has run out. */
+  if(!free_lists[size_class])
   {
-    entry_t *current = first;
+    size_t   stride = MEMORY_HEADER + class_size(size_class);
+    uint8_t *slab   = get_slab();
+    size_t   i;
+
+    if(!slab)
+      return NULL;
 
-    fprintf(stderr, "Allocated memory:\n");
-    while(current)
+    for(i = 0; i + stride <= MEMORY_SLAB_SIZE; i += stride)
     {
-      fprintf(stderr, "%p: 0x%08x bytes allocated at %s:%d\n", current->memory, (unsigned int)current->size, current->file, current->line);
-      current = current->next;
+      block_t *free_block = (block_t*)(slab + i + MEMORY_HEADER);
+
+      *(size_t*)(slab + i) = size_class;
+      free_block->next = free_lists[size_class];
+      free_lists[size_class] = free_block;
     }
   }
-#endif
+
+  block = (uint8_t*)free_lists[size_class];
+  free_lists[size_class] = free_lists[size_class]->next;
+
+  return block;
 }
 
-void *safe_malloc_internal(size_t size, char *file, int line)
+static size_t pool_capacity(void *ptr)
+{
+  size_t size_class = *(size_t*)((uint8_t*)ptr - MEMORY_HEADER);
+
+  return size_class == MEMORY_LARGE ? 0 : class_size(size_class);
+}
+
+static void pool_free(void *ptr)
+{
+  uint8_t *header     = (uint8_t*)ptr - MEMORY_HEADER;
+  size_t   size_class = *(size_t*)header;
+
+  if(size_class == MEMORY_LARGE)
+  {
+    free(header);
+  }
+  else
+  {
+    block_t *free_block = (block_t*)ptr;
+
+    free_block->next = free_lists[size_class];
+    free_lists[size_class] = free_block;
+  }
+}
+
+static void *pool_realloc(void *ptr, size_t size)
+{
+  size_t   capacity;
+  uint8_t *header;
+  void    *ret;
+
+  if(!ptr)
+    return pool_alloc(size);
+
+  /* Big blocks stay big blocks, and small ones stay put if they fit. */
+  capacity = pool_capacity(ptr);
+  if(capacity == 0 && size > class_size(MEMORY_CLASSES - 1))
+  {
+    header = realloc((uint8_t*)ptr - MEMORY_HEADER, MEMORY_HEADER + size);
+    return header ? header + MEMORY_HEADER : NULL;
+  }
+  if(capacity >= size)
+    return ptr;
+
+  ret = pool_alloc(size);
+  if(!ret)
+    return NULL;
+
+  /* A big block shrinking into a small one only keeps what fits. */
+  memcpy(ret, ptr, capacity ? capacity : size);
+  pool_free(ptr);
+
+  return ret;
+}
+
+#define raw_malloc(size)       pool_alloc(size)
+#define raw_realloc(ptr, size) pool_realloc(ptr, size)
+#define raw_free(ptr)          pool_free(ptr)
+#else
+#define raw_malloc(size)       malloc(size)
+#define raw_realloc(ptr, size) realloc(ptr, size)
+#define raw_free(ptr)          free(ptr)
+#endif
+
+void *safe_malloc_nozero_internal(size_t size, char *file, int line)
 {
-  void *ret = malloc(size);
+  void *ret = raw_malloc(size);
   if(!ret)
     die_mem(file, line);
-  memset(ret, 0, size);
+  allocation_count++;
 
   add_entry(file, line, ret, size);
   return ret;
 }
 
+void *safe_malloc_internal(size_t size, char *file, int line)
+{
+  void *ret = safe_malloc_nozero_internal(size, file, line);
+
+  memset(ret, 0, size);
+
+  return ret;
+}
+
 void *safe_realloc_internal(void *ptr, size_t size, char *file, int line)
 {
-  void *ret = realloc(ptr, size);
+  void *ret = raw_realloc(ptr, size);
   if(!ret)
     die_mem(file, line);
+  allocation_count++;
 
   update_entry(ptr, ret, size, file, line);
   return ret;
@@ -157,7 +369,7 @@ char *safe_strdup_internal(const char *str, char *file, int line)
   if(strlen(str) + 1 < strlen(str))
     die("Overflow.", file, line);
 
-  ret = safe_malloc_internal(strlen(str) + 1, file, line);
+  ret = safe_malloc_nozero_internal(strlen(str) + 1, file, line);
   memcpy(ret, str, strlen(str) + 1);
 
   return ret;
@@ -167,7 +379,7 @@ void *safe_memcpy_internal(const void *data, size_t length, char *file, int line
 {
   uint8_t *ret;
 
-  ret = safe_malloc_internal(length, file, line);
+  ret = safe_malloc_nozero_internal(length, file, line);
   memcpy(ret, data, length);
 
   return ret;
@@ -176,5 +388,5 @@ void *safe_memcpy_internal(const void *data, size_t length, char *file, int line
 void safe_free_internal(void *ptr, char *file, int line)
 {
   remove_entry(ptr, file, line);
-  free(ptr);
+  raw_free(ptr);
 }
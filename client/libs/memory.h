@@ -7,6 +7,18 @@
  * Implements functions for managing memory. Optionally (based on defining
  * TEST_MEMORY) keeps track of all memory allocated and prints out a summary at
  * the end. Great for finding memory leaks.
+ *
+ * Defining MEMORY_POOL ('make release' does) serves small allocations from
+ * per-size free lists instead of malloc(), which is a lot quicker for the
+ * many small, short-lived allocations each packet makes, and doesn't
+ * fragment the heap over a long run. It's only safe if one thread does all
+ * the allocating.
+ *
+ * With MEMORY_STATIC=<bytes> as well ('make tiny' does), the pool is carved
+ * from a static block of that size before it asks malloc() for any more, so
+ * on a small device the memory a normal run needs is set aside (and shows up
+ * in the binary's size) from the start. MEMORY_SLAB_SIZE=<bytes> sets how
+ * much of it each size takes at a time (64k by default).
  */
 
 #ifndef __MEMORY_H__
@@ -20,6 +32,11 @@
 #define safe_malloc(size) safe_malloc_internal(size, __FILE__, __LINE__)
 void *safe_malloc_internal(size_t size, char *file, int line);
 
+/* The same, but the memory isn't cleared; for when it's about to be filled
+ * in anyway. */
+#define safe_malloc_nozero(size) safe_malloc_nozero_internal(size, __FILE__, __LINE__)
+void *safe_malloc_nozero_internal(size_t size, char *file, int line);
+
 #define safe_realloc(ptr,size) safe_realloc_internal(ptr, size, __FILE__, __LINE__)
 void *safe_realloc_internal(void *ptr, size_t size, char *file, int line);
 
@@ -41,4 +58,9 @@ char *unicode_alloc_upper(const char *string);
 /* Print the currently allocated memory. Useful for checking for memory leaks. */
 void print_memory();
 
+/* How many times safe_malloc() (or anything built on it) and safe_realloc()
+ * have been called so far; the difference between two calls is how many
+ * allocations whatever ran in between made. */
+size_t memory_get_allocation_count();
+
 #endif
@@ -0,0 +1,117 @@
+/* reorder_buffer.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+
+#include "reorder_buffer.h"
+
+/* How far seq is past expected; anything over this means it's behind. */
+#define REORDER_MAX_DISTANCE 0x7FFF
+
+static uint16_t distance(uint16_t expected, uint16_t seq)
+{
+  return (uint16_t)(seq - expected);
+}
+
+/* Remove the segment at index i (without freeing its data). */
+static void remove_segment(reorder_buffer_t *reorder, size_t i)
+{
+  reorder->count--;
+  memmove(reorder->segments + i, reorder->segments + i + 1, (reorder->count - i) * sizeof(reorder_segment_t));
+}
+
+reorder_buffer_t *reorder_buffer_create(size_t max_segments, size_t max_ahead)
+{
+  reorder_buffer_t *reorder = (reorder_buffer_t*) safe_malloc(sizeof(reorder_buffer_t));
+
+  reorder->segments     = (reorder_segment_t*) safe_malloc(max_segments * sizeof(reorder_segment_t));
+  reorder->max_segments = max_segments;
+  reorder->count        = 0;
+  reorder->max_ahead    = MIN(max_ahead, REORDER_MAX_DISTANCE);
+
+  return reorder;
+}
+
+void reorder_buffer_destroy(reorder_buffer_t *reorder)
+{
+  reorder_buffer_clear(reorder);
+  safe_free(reorder->segments);
+  safe_free(reorder);
+}
+
+NBBOOL reorder_buffer_add(reorder_buffer_t *reorder, uint16_t expected, uint16_t seq, uint8_t *data, size_t length)
+{
+  size_t             i;
+  uint16_t           ahead = distance(expected, seq);
+  reorder_segment_t *segment;
+
+  if(ahead == 0 || ahead > REORDER_MAX_DISTANCE || length == 0 || ahead + length > reorder->max_ahead || reorder->count >= reorder->max_segments)
+    return FALSE;
+
+  for(i = 0; i < reorder->count; i++)
+    if(reorder->segments[i].seq == seq)
+      return FALSE;
+
+  segment = &reorder->segments[reorder->count++];
+  segment->seq    = seq;
+  segment->length = length;
+  segment->data   = (uint8_t*) safe_malloc(length);
+  memcpy(segment->data, data, length);
+
+  return TRUE;
+}
+
+uint8_t *reorder_buffer_take(reorder_buffer_t *reorder, uint16_t expected, size_t *length)
+{
+  size_t   i = 0;
+  uint8_t *data;
+
+  while(i < reorder->count)
+  {
+    uint16_t ahead = distance(expected, reorder->segments[i].seq);
+
+    if(ahead == 0)
+    {
+      data    = reorder->segments[i].data;
+      *length = reorder->segments[i].length;
+      remove_segment(reorder, i);
+
+      return data;
+    }
+
+    if(ahead > REORDER_MAX_DISTANCE)
+    {
+      safe_free(reorder->segments[i].data);
+      remove_segment(reorder, i);
+    }
+    else
+    {
+      i++;
+    }
+  }
+
+  *length = 0;
+  return NULL;
+}
+
+size_t reorder_buffer_get_count(reorder_buffer_t *reorder)
+{
+  return reorder->count;
+}
+
+void reorder_buffer_clear(reorder_buffer_t *reorder)
+{
+  size_t i;
+
+  for(i = 0; i < reorder->count; i++)
+    safe_free(reorder->segments[i].data);
+
+  reorder->count = 0;
+}
@@ -0,0 +1,66 @@
+/* reorder_buffer.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Holds segments of a stream that showed up before the ones in front of
+ * them, keyed by their 16-bit sequence numbers (which are byte offsets, and
+ * wrap around, like the ones in dnscat2 packets), so they can be used once
+ * the gap is filled instead of having to be sent again.
+ *
+ * It's bounded both in how many segments it holds and in how far ahead of
+ * the stream they can be; anything past either is dropped (and will have
+ * to be re-sent).
+ */
+
+#ifndef __REORDER_BUFFER_H__
+#define __REORDER_BUFFER_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+typedef struct
+{
+  uint16_t seq;
+  uint8_t *data;
+  size_t   length;
+} reorder_segment_t;
+
+/* This struct shouldn't be accessed directly */
+typedef struct
+{
+  reorder_segment_t *segments;
+  size_t             max_segments;
+  size_t             count;
+
+  /* How far past the next expected byte a segment can end. */
+  size_t             max_ahead;
+} reorder_buffer_t;
+
+/* Create a reorder buffer that holds up to max_segments segments, none of
+ * which go past max_ahead bytes beyond the next one we're waiting for. */
+reorder_buffer_t *reorder_buffer_create(size_t max_segments, size_t max_ahead);
+
+/* Destroy the buffer, and whatever's still in it. */
+void    reorder_buffer_destroy(reorder_buffer_t *reorder);
+
+/* Hold onto a copy of a segment that starts at seq, when expected is the
+ * next byte we're waiting for. Returns FALSE (and holds onto nothing) if it
+ * doesn't start ahead of expected, it's one we already have, it's too far
+ * ahead, or there's no room. */
+NBBOOL  reorder_buffer_add(reorder_buffer_t *reorder, uint16_t expected, uint16_t seq, uint8_t *data, size_t length);
+
+/* Take out the segment that starts at expected, if there is one; the caller
+ * frees the data. Anything that starts behind expected (it was covered by
+ * the segments that came in order) is thrown away. */
+uint8_t *reorder_buffer_take(reorder_buffer_t *reorder, uint16_t expected, size_t *length);
+
+/* The number of segments being held. */
+size_t  reorder_buffer_get_count(reorder_buffer_t *reorder);
+
+/* Throw away everything. */
+void    reorder_buffer_clear(reorder_buffer_t *reorder);
+
+#endif
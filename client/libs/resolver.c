@@ -0,0 +1,247 @@
+/* resolver.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#endif
+
+#include "log.h"
+#include "memory.h"
+
+#include "resolver.h"
+
+resolver_t *resolver_create(select_group_t *group)
+{
+  resolver_t *resolver = (resolver_t*) safe_malloc(sizeof(resolver_t));
+  int         i;
+
+  for(i = 0; i < RESOLVER_THREADS; i++)
+    resolver->workers[i] = worker_create(group);
+
+  return resolver;
+}
+
+static resolver_cache_entry_t *cache_find(resolver_t *resolver, char *host)
+{
+  time_t now = time(NULL);
+  int    i;
+
+  for(i = 0; i < RESOLVER_CACHE_SIZE; i++)
+  {
+    if(resolver->cache[i].host && resolver->cache[i].expires > now && !strcmp(resolver->cache[i].host, host))
+      return &resolver->cache[i];
+  }
+
+  return NULL;
+}
+
+/* Take the place of whatever's closest to expiring (empty and expired
+ * entries are, since they've got the smallest expires). */
+static void cache_add(resolver_t *resolver, char *host, NBBOOL found, uint32_t address)
+{
+  resolver_cache_entry_t *entry = &resolver->cache[0];
+  int                     i;
+
+  for(i = 1; i < RESOLVER_CACHE_SIZE; i++)
+  {
+    if(resolver->cache[i].expires < entry->expires)
+      entry = &resolver->cache[i];
+  }
+
+  if(entry->host)
+    safe_free(entry->host);
+  entry->host    = safe_strdup(host);
+  entry->found   = found;
+  entry->address = address;
+  entry->expires = time(NULL) + (found ? RESOLVER_POSITIVE_TTL : RESOLVER_NEGATIVE_TTL);
+}
+
+/* On the worker's thread. getaddrinfo() allocates, but with the real
+ * malloc(), not ours. */
+static void lookup_run(void *param)
+{
+  resolver_lookup_t *lookup   = (resolver_lookup_t*) param;
+  struct addrinfo    hints;
+  struct addrinfo   *results = NULL;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+
+  if(getaddrinfo(lookup->host, NULL, &hints, &results) == 0 && results)
+  {
+    lookup->address = ((struct sockaddr_in*)results->ai_addr)->sin_addr.s_addr;
+    lookup->found   = TRUE;
+  }
+
+  if(results)
+    freeaddrinfo(results);
+}
+
+static void lookup_done(void *param)
+{
+  resolver_lookup_t  *lookup   = (resolver_lookup_t*) param;
+  resolver_t         *resolver = lookup->resolver;
+  resolver_lookup_t **i;
+  resolver_waiter_t  *waiter;
+  struct in_addr      address;
+
+  resolver->busy[lookup->worker]--;
+
+  address.s_addr = lookup->address;
+  if(lookup->found)
+    LOG_INFO("resolver: %s is %s", lookup->host, inet_ntoa(address));
+  else
+    LOG_WARNING("resolver: couldn't find host %s", lookup->host);
+
+  /* (Before the callbacks, in case they look it up again.) */
+  cache_add(resolver, lookup->host, lookup->found, lookup->address);
+
+  /* One at a time, so a callback can cancel the ones after it. */
+  while((waiter = lookup->waiters))
+  {
+    lookup->waiters = waiter->next;
+    waiter->callback(lookup->host, lookup->found, lookup->address, waiter->param);
+    safe_free(waiter);
+  }
+
+  for(i = &resolver->lookups; *i; i = &(*i)->next)
+  {
+    if(*i == lookup)
+    {
+      *i = lookup->next;
+      break;
+    }
+  }
+
+  safe_free(lookup->host);
+  safe_free(lookup);
+}
+
+void resolver_lookup(resolver_t *resolver, char *host, resolver_callback_t *callback, void *param)
+{
+  resolver_cache_entry_t *entry;
+  resolver_lookup_t      *lookup;
+  resolver_waiter_t      *waiter;
+  resolver_waiter_t     **last;
+  uint32_t                address;
+  int                     i;
+
+  /* An address doesn't need looking up. */
+  address = inet_addr(host);
+  if(address != INADDR_NONE)
+  {
+    callback(host, TRUE, address, param);
+    return;
+  }
+
+  entry = cache_find(resolver, host);
+  if(entry)
+  {
+    LOG_INFO("resolver: %s is cached", host);
+    callback(host, entry->found, entry->address, param);
+    return;
+  }
+
+  waiter = (resolver_waiter_t*) safe_malloc(sizeof(resolver_waiter_t));
+  waiter->callback = callback;
+  waiter->param    = param;
+
+  /* If somebody's already looking it up, wait (in line) for them. */
+  for(lookup = resolver->lookups; lookup; lookup = lookup->next)
+  {
+    if(!strcmp(lookup->host, host))
+    {
+      for(last = &lookup->waiters; *last; last = &(*last)->next)
+        ;
+      *last = waiter;
+      return;
+    }
+  }
+
+  lookup = (resolver_lookup_t*) safe_malloc(sizeof(resolver_lookup_t));
+  lookup->resolver = resolver;
+  lookup->host     = safe_strdup(host);
+  lookup->waiters  = waiter;
+  lookup->next     = resolver->lookups;
+  resolver->lookups = lookup;
+
+  /* Behind whichever worker's doing the least. */
+  lookup->worker = 0;
+  for(i = 1; i < RESOLVER_THREADS; i++)
+  {
+    if(resolver->busy[i] < resolver->busy[lookup->worker])
+      lookup->worker = i;
+  }
+  resolver->busy[lookup->worker]++;
+
+  LOG_INFO("resolver: looking up %s", host);
+  worker_post(resolver->workers[lookup->worker], lookup_run, lookup_done, lookup);
+}
+
+void resolver_cancel(resolver_t *resolver, void *param)
+{
+  resolver_lookup_t  *lookup;
+  resolver_waiter_t **i;
+  resolver_waiter_t  *waiter;
+
+  for(lookup = resolver->lookups; lookup; lookup = lookup->next)
+  {
+    i = &lookup->waiters;
+    while(*i)
+    {
+      if((*i)->param == param)
+      {
+        waiter = *i;
+        *i = waiter->next;
+        safe_free(waiter);
+      }
+      else
+      {
+        i = &(*i)->next;
+      }
+    }
+  }
+}
+
+void resolver_destroy(resolver_t *resolver)
+{
+  resolver_lookup_t *lookup;
+  resolver_waiter_t *waiter;
+  int                i;
+
+  for(lookup = resolver->lookups; lookup; lookup = lookup->next)
+  {
+    while((waiter = lookup->waiters))
+    {
+      lookup->waiters = waiter->next;
+      safe_free(waiter);
+    }
+  }
+
+  /* The lookups get freed as their jobs finish. */
+  for(i = 0; i < RESOLVER_THREADS; i++)
+    worker_destroy(resolver->workers[i]);
+
+  for(i = 0; i < RESOLVER_CACHE_SIZE; i++)
+  {
+    if(resolver->cache[i].host)
+      safe_free(resolver->cache[i].host);
+  }
+
+  safe_free(resolver);
+}
@@ -0,0 +1,98 @@
+/* resolver.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Looks up hostnames (IPv4 only, like the rest of tcp.c) without holding up
+ * the select loop: each lookup is a getaddrinfo() on one of a few workers
+ * (see worker.h), and the callback is called from inside
+ * select_group_do_select() once it's done.
+ *
+ * Answers - including names that weren't found - are cached for a little
+ * while, and lookups for a name that's already being looked up wait for
+ * that one instead of starting another, so a burst of connections to the
+ * same host only costs one lookup. Numeric addresses don't need a lookup at
+ * all.
+ *
+ * Like the worker, it only uses threads if it's compiled with USE_THREADS;
+ * otherwise, lookups that aren't cached are done on the spot (and the
+ * callback is called before resolver_lookup() returns).
+ */
+
+#ifndef __RESOLVER_H__
+#define __RESOLVER_H__
+
+#include <time.h>
+
+#include "select_group.h"
+#include "types.h"
+#include "worker.h"
+
+/* How many lookups can be going at once. */
+#define RESOLVER_THREADS 4
+
+/* How many names are cached, and for how long (in seconds); getaddrinfo()
+ * doesn't tell us the real TTLs. */
+#define RESOLVER_CACHE_SIZE   32
+#define RESOLVER_POSITIVE_TTL 60
+#define RESOLVER_NEGATIVE_TTL 10
+
+/* address is in network byte order (like a sockaddr_in's), and is only set
+ * if found is. */
+typedef void(resolver_callback_t)(char *host, NBBOOL found, uint32_t address, void *param);
+
+typedef struct _resolver_waiter_t
+{
+  resolver_callback_t        *callback;
+  void                       *param;
+  struct _resolver_waiter_t  *next;
+} resolver_waiter_t;
+
+/* These structs shouldn't be accessed directly */
+typedef struct _resolver_lookup_t
+{
+  struct _resolver_t         *resolver;
+  char                       *host;
+  int                         worker;
+
+  /* Set by the worker. */
+  NBBOOL                      found;
+  uint32_t                    address;
+
+  resolver_waiter_t          *waiters;
+  struct _resolver_lookup_t  *next;
+} resolver_lookup_t;
+
+typedef struct
+{
+  char     *host;
+  NBBOOL    found;
+  uint32_t  address;
+  time_t    expires;
+} resolver_cache_entry_t;
+
+typedef struct _resolver_t
+{
+  worker_t               *workers[RESOLVER_THREADS];
+  int                     busy[RESOLVER_THREADS];
+
+  resolver_lookup_t      *lookups;
+  resolver_cache_entry_t  cache[RESOLVER_CACHE_SIZE];
+} resolver_t;
+
+resolver_t *resolver_create(select_group_t *group);
+
+/* Look up host, and call callback with the answer (maybe right away, if
+ * it's cached or numeric). */
+void        resolver_lookup(resolver_t *resolver, char *host, resolver_callback_t *callback, void *param);
+
+/* Forget about every lookup that was going to call back with param (for
+ * when param is about to be freed). */
+void        resolver_cancel(resolver_t *resolver, void *param);
+
+/* Waits for the lookups that are running to finish; nothing that's still
+ * waiting gets called back. */
+void        resolver_destroy(resolver_t *resolver);
+
+#endif
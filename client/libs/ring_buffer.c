@@ -0,0 +1,157 @@
+/* ring_buffer.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "memory.h"
+
+#include "ring_buffer.h"
+
+/* The initial size; it's doubled as needed. */
+#define RING_BUFFER_INITIAL_SIZE 1024
+
+ring_buffer_t *ring_buffer_create(size_t high_water)
+{
+  ring_buffer_t *ring = (ring_buffer_t*) safe_malloc(sizeof(ring_buffer_t));
+
+  ring->capacity   = RING_BUFFER_INITIAL_SIZE;
+  ring->data       = (uint8_t*) safe_malloc(ring->capacity);
+  ring->start      = 0;
+  ring->length     = 0;
+  ring->high_water = high_water;
+
+  return ring;
+}
+
+void ring_buffer_destroy(ring_buffer_t *ring)
+{
+  safe_free(ring->data);
+  safe_free(ring);
+}
+
+size_t ring_buffer_get_length(ring_buffer_t *ring)
+{
+  return ring->length;
+}
+
+size_t ring_buffer_get_room(ring_buffer_t *ring)
+{
+  if(ring->high_water == 0)
+    return (size_t)-1;
+
+  if(ring->length >= ring->high_water)
+    return 0;
+
+  return ring->high_water - ring->length;
+}
+
+NBBOOL ring_buffer_is_full(ring_buffer_t *ring)
+{
+  return ring_buffer_get_room(ring) == 0;
+}
+
+NBBOOL ring_buffer_is_drained(ring_buffer_t *ring)
+{
+  return ring->length <= ring->high_water / 2;
+}
+
+/* Grow the ring so it can hold at least 'needed' bytes. The queued data is
+ * straightened out at the start of the new memory. */
+static void ring_buffer_grow(ring_buffer_t *ring, size_t needed)
+{
+  size_t   new_capacity = ring->capacity;
+  uint8_t *new_data;
+
+  while(new_capacity < needed)
+  {
+    if(new_capacity * 2 < new_capacity)
+      DIE("Overflow.");
+    new_capacity *= 2;
+  }
+
+  new_data = (uint8_t*) safe_malloc(new_capacity);
+  ring_buffer_read_at(ring, 0, new_data, ring->length);
+  safe_free(ring->data);
+
+  ring->data     = new_data;
+  ring->capacity = new_capacity;
+  ring->start    = 0;
+}
+
+void ring_buffer_add_bytes(ring_buffer_t *ring, const void *data, size_t length)
+{
+  size_t end;
+  size_t first;
+
+  if(ring->length + length < ring->length)
+    DIE("Overflow.");
+
+  if(ring->length + length > ring->capacity)
+    ring_buffer_grow(ring, ring->length + length);
+
+  /* Copy up to the end of the memory, then wrap around. */
+  end   = (ring->start + ring->length) & (ring->capacity - 1);
+  first = MIN(length, ring->capacity - end);
+
+  memcpy(ring->data + end, data, first);
+  memcpy(ring->data, (const uint8_t*)data + first, length - first);
+
+  ring->length += length;
+}
+
+void ring_buffer_consume(ring_buffer_t *ring, size_t length)
+{
+  if(length > ring->length)
+    DIE("Tried to consume more of a ring buffer than it holds.");
+
+  ring->start   = (ring->start + length) & (ring->capacity - 1);
+  ring->length -= length;
+
+  /* When it's empty, go back to the start so the next add doesn't wrap. */
+  if(ring->length == 0)
+    ring->start = 0;
+}
+
+size_t ring_buffer_peek(ring_buffer_t *ring, size_t offset, uint8_t **data)
+{
+  size_t pos;
+
+  if(offset > ring->length)
+    DIE("Tried to read past the end of a ring buffer.");
+
+  pos   = (ring->start + offset) & (ring->capacity - 1);
+  *data = ring->data + pos;
+
+  return MIN(ring->length - offset, ring->capacity - pos);
+}
+
+void ring_buffer_read_at(ring_buffer_t *ring, size_t offset, void *out, size_t length)
+{
+  uint8_t *data;
+  size_t   first;
+
+  if(offset + length > ring->length || offset + length < offset)
+    DIE("Tried to read past the end of a ring buffer.");
+
+  first = MIN(length, ring_buffer_peek(ring, offset, &data));
+  memcpy(out, data, first);
+  memcpy((uint8_t*)out + first, ring->data, length - first);
+}
+
+uint8_t *ring_buffer_read_remaining_bytes(ring_buffer_t *ring, size_t *length, size_t max_bytes)
+{
+  uint8_t *ret;
+
+  *length = MIN(ring->length, max_bytes);
+
+  ret = (uint8_t*) safe_malloc(*length + 1);
+  ring_buffer_read_at(ring, 0, ret, *length);
+  ring_buffer_consume(ring, *length);
+
+  return ret;
+}
@@ -0,0 +1,80 @@
+/* ring_buffer.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A byte queue for data that's appended at one end and consumed from the
+ * other, like a session's outgoing data. Unlike a buffer_t, consuming data
+ * frees up its space to be re-used, so the memory used depends on how much
+ * is queued at once rather than how much has ever gone through it.
+ *
+ * The ring grows (by doubling) if it has to, but a high-water mark can be set
+ * so whoever fills it knows when to stop; see ring_buffer_get_room().
+ */
+
+#ifndef __RING_BUFFER_H__
+#define __RING_BUFFER_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+/* This struct shouldn't be accessed directly */
+typedef struct
+{
+  uint8_t *data;
+
+  /* The size of data; always a power of two. */
+  size_t   capacity;
+
+  /* The offset of the first queued byte, and how many are queued. */
+  size_t   start;
+  size_t   length;
+
+  /* How much we'd like queued at most (0 for no limit). */
+  size_t   high_water;
+} ring_buffer_t;
+
+/* Create a ring buffer; high_water is the most it should normally hold. */
+ring_buffer_t *ring_buffer_create(size_t high_water);
+
+/* Destroy the ring buffer and free its data. */
+void    ring_buffer_destroy(ring_buffer_t *ring);
+
+/* The number of bytes queued. */
+size_t  ring_buffer_get_length(ring_buffer_t *ring);
+
+/* How many bytes can be added before the high-water mark is reached (or -1
+ * if there isn't one). */
+size_t  ring_buffer_get_room(ring_buffer_t *ring);
+
+/* TRUE if the high-water mark has been reached. */
+NBBOOL  ring_buffer_is_full(ring_buffer_t *ring);
+
+/* TRUE once it's down to half the high-water mark or less. If whoever fills
+ * the ring stops when it's full, this is a good time to start again (waiting
+ * for it to empty completely makes for a stall, and starting again as soon
+ * as there's any room makes for a lot of starting and stopping). */
+NBBOOL  ring_buffer_is_drained(ring_buffer_t *ring);
+
+/* Add bytes to the end. This always succeeds, growing the ring if needed. */
+void    ring_buffer_add_bytes(ring_buffer_t *ring, const void *data, size_t length);
+
+/* Discard bytes from the front. Doesn't move any memory. */
+void    ring_buffer_consume(ring_buffer_t *ring, size_t length);
+
+/* Get a pointer to the queued data starting at offset, without copying it.
+ * Since the data can wrap around the end of the ring, the return value is
+ * how many bytes are contiguous there, which can be less than what's
+ * queued. */
+size_t  ring_buffer_peek(ring_buffer_t *ring, size_t offset, uint8_t **data);
+
+/* Copy length bytes, starting at offset, into out. */
+void    ring_buffer_read_at(ring_buffer_t *ring, size_t offset, void *out, size_t length);
+
+/* Remove up to max_bytes (or everything, if it's -1) from the front, and
+ * return them in a newly allocated (and null-terminated) string. */
+uint8_t *ring_buffer_read_remaining_bytes(ring_buffer_t *ring, size_t *length, size_t max_bytes);
+
+#endif
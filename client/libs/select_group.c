@@ -5,9 +5,15 @@
  * (See LICENSE.md)
  */
 
+/* (For recvmmsg().) */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <winsock2.h>
@@ -22,15 +28,38 @@
 #include <sys/types.h>
 #endif
 
+#include "log.h"
 #include "memory.h"
 #include "select_group.h"
 #include "tcp.h"
 
+/* These depend on the backend chosen in select_group.h. */
+#if defined(SELECT_GROUP_EPOLL)
+#include <sys/epoll.h>
+#elif defined(SELECT_GROUP_KQUEUE)
+#include <sys/event.h>
+#endif
+
 /* People probably won't be using more than 32 sockets, so 32 should be a good number
  * to avoid unnecessary realloc() calls. */
 #define LIST_STARTING_SIZE 32
 #define MAX_RECV 8192
 
+/* How many datagrams a batch is read with: recvmmsg() gets them all at once
+ * on Linux, and elsewhere recv() is called till there aren't any more, except
+ * on Windows, which can't do that without making the socket non-blocking. */
+#ifdef WIN32
+#define BATCH_READS 1
+#else
+#define BATCH_READS SELECT_BATCH_SIZE
+#endif
+
+/* The most events we'll take from epoll/kqueue in a single call. */
+#define MAX_EVENTS 64
+
+/* The timer heap starts at this size, and doubles as needed. */
+#define TIMERS_STARTING_SIZE 8
+
 /* Some macros to access elements within the numbered structure. */
 #define SG_SOCKET(sg,i) sg->select_list[i]->s
 #ifdef WIN32
@@ -39,6 +68,7 @@
 #define SG_TYPE(sg,i) sg->select_list[i]->type
 #define SG_READY(sg,i) sg->select_list[i]->ready_callback
 #define SG_RECV(sg,i) sg->select_list[i]->recv_callback
+#define SG_RECV_BATCH(sg,i) sg->select_list[i]->recv_batch_callback
 #define SG_LISTEN(sg,i) sg->select_list[i]->listen_callback
 #define SG_ERROR(sg,i) sg->select_list[i]->error_callback
 #define SG_CLOSED(sg,i) sg->select_list[i]->closed_callback
@@ -46,8 +76,14 @@
 #define SG_BUFFER(sg,i) sg->select_list[i]->buffer
 #define SG_BUFFERED(sg,i) sg->select_list[i]->buffered
 #define SG_IS_READY(sg,i) sg->select_list[i]->ready
+#define SG_IS_WRITING(sg,i) sg->select_list[i]->writing
+#define SG_WANTS_WRITE(sg,i) (!SG_IS_READY(sg,i) || SG_IS_WRITING(sg,i))
 #define SG_IS_ACTIVE(sg,i) sg->select_list[i]->active
+#define SG_IS_PAUSED(sg,i) sg->select_list[i]->paused
 #define SG_PARAM(sg,i) sg->select_list[i]->param
+#ifdef SELECT_GROUP_BACKEND
+#define SG_POLLED(sg,i) sg->select_list[i]->polled
+#endif
 
 static int getlastsocketerror(int s)
 {
@@ -74,6 +110,440 @@ static select_t *find_select_by_socket(select_group_t *group, int s)
   return ret;
 }
 
+#if defined(SELECT_GROUP_EPOLL)
+static void backend_create(select_group_t *group)
+{
+  group->backend_fd = epoll_create(MAX_EVENTS);
+  if(group->backend_fd == -1)
+    nbdie("select_group: couldn't create an epoll descriptor");
+}
+
+static NBBOOL backend_watch(select_group_t *group, size_t i, int op)
+{
+  struct epoll_event event;
+
+  memset(&event, 0, sizeof(struct epoll_event));
+  event.events   = EPOLLIN | EPOLLPRI | (SG_WANTS_WRITE(group, i) ? EPOLLOUT : 0);
+  event.data.u32 = i;
+
+  return epoll_ctl(group->backend_fd, op, SG_SOCKET(group, i), &event) == 0;
+}
+
+static NBBOOL backend_add(select_group_t *group, size_t i)
+{
+  return backend_watch(group, i, EPOLL_CTL_ADD);
+}
+
+/* Called when we start or stop waiting for the socket to be writable. */
+static void backend_update(select_group_t *group, size_t i)
+{
+  backend_watch(group, i, EPOLL_CTL_MOD);
+}
+
+static void backend_remove(select_group_t *group, size_t i)
+{
+  struct epoll_event event;
+
+  /* This fails harmlessly if the socket was already closed. */
+  epoll_ctl(group->backend_fd, EPOLL_CTL_DEL, SG_SOCKET(group, i), &event);
+}
+#elif defined(SELECT_GROUP_KQUEUE)
+static void backend_create(select_group_t *group)
+{
+  group->backend_fd = kqueue();
+  if(group->backend_fd == -1)
+    nbdie("select_group: couldn't create a kqueue descriptor");
+}
+
+static NBBOOL backend_add(select_group_t *group, size_t i)
+{
+  struct kevent change;
+
+  EV_SET(&change, SG_SOCKET(group, i), EVFILT_READ, EV_ADD, 0, 0, (void*)(uintptr_t)i);
+  if(kevent(group->backend_fd, &change, 1, NULL, 0, NULL) == -1)
+    return FALSE;
+
+  /* We only care about the next time it's writable, so use a one-shot. */
+  if(SG_WANTS_WRITE(group, i))
+  {
+    EV_SET(&change, SG_SOCKET(group, i), EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, (void*)(uintptr_t)i);
+    kevent(group->backend_fd, &change, 1, NULL, 0, NULL);
+  }
+
+  return TRUE;
+}
+
+static void backend_update(select_group_t *group, size_t i)
+{
+  struct kevent change;
+
+  /* Stopping is taken care of, since the write filter is a one-shot. */
+  if(SG_IS_WRITING(group, i))
+  {
+    EV_SET(&change, SG_SOCKET(group, i), EVFILT_WRITE, EV_ADD | EV_ONESHOT, 0, 0, (void*)(uintptr_t)i);
+    kevent(group->backend_fd, &change, 1, NULL, 0, NULL);
+  }
+}
+
+static void backend_remove(select_group_t *group, size_t i)
+{
+  struct kevent change;
+
+  /* These fail harmlessly if the socket was already closed. */
+  EV_SET(&change, SG_SOCKET(group, i), EVFILT_READ, EV_DELETE, 0, 0, NULL);
+  kevent(group->backend_fd, &change, 1, NULL, 0, NULL);
+  EV_SET(&change, SG_SOCKET(group, i), EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+  kevent(group->backend_fd, &change, 1, NULL, 0, NULL);
+}
+#elif defined(SELECT_GROUP_IOCP)
+static HANDLE backend_handle(select_group_t *group, size_t i)
+{
+  if(SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
+    return SG_PIPE(group, i);
+
+  return (HANDLE)(SOCKET)SG_SOCKET(group, i);
+}
+
+static void backend_create(select_group_t *group)
+{
+  group->backend_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+  if(!group->backend_port)
+    nbdie("select_group: couldn't create a completion port");
+}
+
+static void backend_destroy(select_group_t *group)
+{
+  DWORD       bytes;
+  ULONG_PTR   key;
+  OVERLAPPED *overlapped;
+  size_t      reading = 0;
+  size_t      i;
+
+  /* The reads point into the select_t's, so they have to be finished before
+   * those are freed. */
+  for(i = 0; i < group->current_size; i++)
+  {
+    if(group->select_list[i]->reading)
+    {
+      CancelIo(backend_handle(group, i));
+      reading++;
+    }
+  }
+
+  while(reading > 0)
+  {
+    if(!GetQueuedCompletionStatus(group->backend_port, &bytes, &key, &overlapped, 1000) && !overlapped)
+      break;
+
+    if(overlapped)
+      reading--;
+  }
+
+  CloseHandle(group->backend_port);
+}
+
+/* Post the read that tells us when there's data. */
+static void post_read(select_group_t *group, size_t i)
+{
+  select_t *socket = group->select_list[i];
+  BOOL      result;
+  DWORD     error;
+
+  memset(&socket->overlapped, 0, sizeof(OVERLAPPED));
+  socket->reading = TRUE;
+
+  if(socket->type == SOCKET_TYPE_PIPE)
+  {
+    result = ReadFile(socket->pipe, socket->read_buffer, MAX_RECV, NULL, &socket->overlapped);
+    error  = result ? 0 : GetLastError();
+  }
+  else
+  {
+    /* Nothing is actually read, so the usual recv() can be done once it
+     * completes; datagrams are peeked at, or they'd be thrown away. */
+    WSABUF buffer;
+    DWORD  flags = (socket->type == SOCKET_TYPE_DATAGRAM) ? MSG_PEEK : 0;
+
+    buffer.buf = NULL;
+    buffer.len = 0;
+    result = (WSARecv((SOCKET)socket->s, &buffer, 1, NULL, &flags, &socket->overlapped, NULL) == 0);
+    error  = result ? 0 : WSAGetLastError();
+  }
+
+  /* Reads that finish right away still go through the completion port, but
+   * ones that fail don't; send those ourselves, so the callbacks only ever
+   * run from select_group_do_select(). */
+  if(!result && error != ERROR_IO_PENDING)
+  {
+    socket->reading         = FALSE;
+    socket->completed       = TRUE;
+    socket->completed_bytes = 0;
+    socket->completed_error = error;
+    PostQueuedCompletionStatus(group->backend_port, 0, (ULONG_PTR)i, NULL);
+  }
+}
+
+static NBBOOL backend_add(select_group_t *group, size_t i)
+{
+  select_t *socket = group->select_list[i];
+
+  /* A listener would need AcceptEx(), and a read can't say when a connection
+   * has finished, so those stay with select(). */
+  if(socket->type == SOCKET_TYPE_LISTEN || (socket->type != SOCKET_TYPE_PIPE && !socket->ready))
+    return FALSE;
+
+  if(!socket->associated)
+  {
+    if(!CreateIoCompletionPort(backend_handle(group, i), group->backend_port, (ULONG_PTR)i, 0))
+      return FALSE;
+
+    socket->associated = TRUE;
+  }
+
+  if(socket->type == SOCKET_TYPE_PIPE && !socket->read_buffer)
+    socket->read_buffer = (uint8_t*) safe_malloc(MAX_RECV);
+
+  /* If a read finished while it was paused, that gets handled first. */
+  if(socket->completed)
+    PostQueuedCompletionStatus(group->backend_port, 0, (ULONG_PTR)i, NULL);
+  else if(!socket->reading)
+    post_read(group, i);
+
+  return TRUE;
+}
+
+static void backend_update(select_group_t *group, size_t i)
+{
+  /* Nothing to do: a completion port can't say when a socket's writable, so
+   * select() watches the ones that are waiting for that (see
+   * is_selected()). */
+}
+
+/* Whether select() has to watch the socket; the completion port has its
+ * reads, if it's taken it. */
+static NBBOOL is_selected(select_group_t *group, size_t i)
+{
+  return SG_POLLED(group, i) || (SG_IS_READY(group, i) && SG_IS_WRITING(group, i));
+}
+
+/* Whether select() has anything to watch at all. */
+static NBBOOL any_selected(select_group_t *group)
+{
+  size_t i;
+
+  if(group->polled_count > 0)
+    return TRUE;
+
+  for(i = 0; i < group->current_size; i++)
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && is_selected(group, i))
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Anything the read already got still shows up, and is held till the socket
+ * is resumed (or dropped, if it was removed). */
+static void backend_remove(select_group_t *group, size_t i)
+{
+  if(group->select_list[i]->reading)
+    CancelIo(backend_handle(group, i));
+}
+#endif
+
+/* A clock that only goes forward, so setting the time (or NTP stepping it)
+ * doesn't hold the timers up or set them all off at once. */
+uint64_t select_group_time_ms()
+{
+#ifdef WIN32
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER        counter;
+
+  if(!frequency.QuadPart)
+    QueryPerformanceFrequency(&frequency);
+  QueryPerformanceCounter(&counter);
+
+  return ((uint64_t)counter.QuadPart / frequency.QuadPart) * 1000 + ((uint64_t)counter.QuadPart % frequency.QuadPart) * 1000 / frequency.QuadPart;
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec) * 1000 + (ts.tv_nsec) / 1000000;
+#endif
+}
+
+static void timer_swap(select_group_t *group, size_t a, size_t b)
+{
+  select_timer_t tmp = group->timers[a];
+  group->timers[a] = group->timers[b];
+  group->timers[b] = tmp;
+}
+
+static void timer_sift_up(select_group_t *group, size_t i)
+{
+  while(i > 0 && group->timers[(i - 1) / 2].deadline > group->timers[i].deadline)
+  {
+    timer_swap(group, i, (i - 1) / 2);
+    i = (i - 1) / 2;
+  }
+}
+
+static void timer_sift_down(select_group_t *group, size_t i)
+{
+  while(TRUE)
+  {
+    size_t left     = (2 * i) + 1;
+    size_t right    = (2 * i) + 2;
+    size_t smallest = i;
+
+    if(left < group->timer_count && group->timers[left].deadline < group->timers[smallest].deadline)
+      smallest = left;
+    if(right < group->timer_count && group->timers[right].deadline < group->timers[smallest].deadline)
+      smallest = right;
+
+    if(smallest == i)
+      break;
+
+    timer_swap(group, i, smallest);
+    i = smallest;
+  }
+}
+
+static void timer_push(select_group_t *group, select_timer_t *timer)
+{
+  if(group->timer_count >= group->timer_max)
+  {
+    group->timer_max = group->timer_max ? group->timer_max * 2 : TIMERS_STARTING_SIZE;
+    group->timers = safe_realloc(group->timers, group->timer_max * sizeof(select_timer_t));
+  }
+
+  group->timers[group->timer_count] = *timer;
+  group->timer_count++;
+  timer_sift_up(group, group->timer_count - 1);
+}
+
+static void timer_remove_at(select_group_t *group, size_t i)
+{
+  group->timer_count--;
+
+  if(i != group->timer_count)
+  {
+    group->timers[i] = group->timers[group->timer_count];
+    timer_sift_down(group, i);
+    timer_sift_up(group, i);
+  }
+}
+
+/* Run every timer that's due. */
+static void run_timers(select_group_t *group)
+{
+  uint64_t now = select_group_time_ms();
+
+  while(group->timer_count > 0 && group->timers[0].deadline <= now)
+  {
+    select_timer_t    timer = group->timers[0];
+    SELECT_RESPONSE_t response;
+
+    timer_remove_at(group, 0);
+
+    group->running_timer           = timer.id;
+    group->running_timer_cancelled = FALSE;
+    response = timer.callback(group, timer.param);
+    group->running_timer           = 0;
+
+    /* Put periodic timers back in, unless they asked to stop. */
+    if(timer.interval && response == SELECT_OK && !group->running_timer_cancelled)
+    {
+      timer.deadline = now + timer.interval;
+      timer_push(group, &timer);
+    }
+    else if(timer.owns_param)
+    {
+      safe_free(timer.param);
+    }
+  }
+}
+
+/* Figure out how long to wait: timeout_ms, unless a timer is due sooner. */
+static int get_wait_ms(select_group_t *group, int timeout_ms)
+{
+  uint64_t now;
+  uint64_t until;
+
+  if(group->timer_count == 0)
+    return timeout_ms;
+
+  now   = select_group_time_ms();
+  until = group->timers[0].deadline > now ? group->timers[0].deadline - now : 0;
+
+  if(until > 0x7FFFFFFF)
+    until = 0x7FFFFFFF;
+
+  if(timeout_ms < 0 || until < (uint64_t)timeout_ms)
+    return (int)until;
+
+  return timeout_ms;
+}
+
+static int add_timer(select_group_t *group, uint32_t delay_ms, uint32_t interval_ms, select_timeout *callback, void *param, NBBOOL owns_param)
+{
+  select_timer_t timer;
+
+  /* 0 is the "no timer" value, so skip it if we wrap. */
+  group->next_timer_id++;
+  if(group->next_timer_id <= 0)
+    group->next_timer_id = 1;
+
+  /* One added by a timer's callback has to wait for the next pass, even with
+   * no delay, or run_timers() could keep running it forever. */
+  if(group->running_timer && delay_ms == 0)
+    delay_ms = 1;
+
+  timer.deadline = select_group_time_ms() + delay_ms;
+  timer.interval = interval_ms;
+  timer.id       = group->next_timer_id;
+  timer.callback   = callback;
+  timer.param      = param;
+  timer.owns_param = owns_param;
+
+  timer_push(group, &timer);
+
+  return timer.id;
+}
+
+int select_group_add_timer(select_group_t *group, uint32_t delay_ms, uint32_t interval_ms, select_timeout *callback, void *param)
+{
+  return add_timer(group, delay_ms, interval_ms, callback, param, FALSE);
+}
+
+int select_group_add_owned_timer(select_group_t *group, uint32_t delay_ms, uint32_t interval_ms, select_timeout *callback, void *param)
+{
+  return add_timer(group, delay_ms, interval_ms, callback, param, TRUE);
+}
+
+NBBOOL select_group_cancel_timer(select_group_t *group, int id)
+{
+  size_t i;
+
+  /* It's not in the heap while it's running. */
+  if(id && id == group->running_timer)
+  {
+    group->running_timer_cancelled = TRUE;
+    return TRUE;
+  }
+
+  for(i = 0; i < group->timer_count; i++)
+  {
+    if(group->timers[i].id == id)
+    {
+      if(group->timers[i].owns_param)
+        safe_free(group->timers[i].param);
+      timer_remove_at(group, i);
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
 select_group_t *select_group_create()
 {
   select_group_t *new_group = (select_group_t*) safe_malloc(sizeof(select_group_t));
@@ -85,6 +555,10 @@ select_group_t *select_group_create()
   new_group->timeout_callback = NULL;
   new_group->timeout_param = NULL;
 
+#ifdef SELECT_GROUP_BACKEND
+  backend_create(new_group);
+#endif
+
   return new_group;
 }
 
@@ -92,6 +566,10 @@ void select_group_destroy(select_group_t *group)
 {
   size_t i;
 
+#ifdef SELECT_GROUP_IOCP
+  backend_destroy(group);
+#endif
+
   for(i = 0; i < group->current_size; i++)
   {
     if(SG_BUFFER(group, i))
@@ -99,6 +577,10 @@ void select_group_destroy(select_group_t *group)
       memset(SG_BUFFER(group, i), 0, SG_WAITING(group, i));
       safe_free(SG_BUFFER(group, i));
     }
+#ifdef SELECT_GROUP_IOCP
+    if(group->select_list[i]->read_buffer)
+      safe_free(group->select_list[i]->read_buffer);
+#endif
     memset(group->select_list[i], 0, sizeof(select_t));
     safe_free(group->select_list[i]);
   }
@@ -106,6 +588,20 @@ void select_group_destroy(select_group_t *group)
   memset(group->select_list, 0, group->maximum_size * sizeof(select_t*));
   safe_free(group->select_list);
 
+#if defined(SELECT_GROUP_BACKEND) && !defined(SELECT_GROUP_IOCP)
+  close(group->backend_fd);
+#endif
+
+  for(i = 0; i < group->timer_count; i++)
+    if(group->timers[i].owns_param)
+      safe_free(group->timers[i].param);
+
+  if(group->timers)
+    safe_free(group->timers);
+
+  if(group->batch_buffer)
+    safe_free(group->batch_buffer);
+
   memset(group, 0, sizeof(select_group_t));
   safe_free(group);
 }
@@ -126,6 +622,16 @@ void select_group_add_socket(select_group_t *group, int s, SOCKET_TYPE_t type, v
   new_select->param = param;
 
   group->select_list[group->current_size] = new_select;
+
+#ifdef SELECT_GROUP_BACKEND
+  /* If the backend can't watch it (eg, a regular file), use select(). */
+  if(!backend_add(group, group->current_size))
+  {
+    new_select->polled = TRUE;
+    group->polled_count++;
+  }
+#endif
+
   group->current_size++;
   if(group->current_size >= group->maximum_size)
   {
@@ -143,6 +649,33 @@ void select_group_add_socket(select_group_t *group, int s, SOCKET_TYPE_t type, v
 }
 
 #ifdef WIN32
+NBBOOL select_group_create_pipe(HANDLE *read_end, HANDLE *write_end, SECURITY_ATTRIBUTES *sa)
+{
+#ifdef SELECT_GROUP_IOCP
+  /* Anonymous pipes can't do overlapped reads, so use a named pipe that only
+   * we know the name of. */
+  static LONG next_pipe = 0;
+  char        name[64];
+
+  sprintf(name, "\\\\.\\pipe\\dnscat2-%lu-%ld", (unsigned long)GetCurrentProcessId(), (long)InterlockedIncrement(&next_pipe));
+
+  *read_end = CreateNamedPipeA(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE, PIPE_TYPE_BYTE | PIPE_WAIT, 1, MAX_RECV, MAX_RECV, 0, sa);
+  if(*read_end == INVALID_HANDLE_VALUE)
+    return FALSE;
+
+  *write_end = CreateFileA(name, GENERIC_WRITE, 0, sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if(*write_end == INVALID_HANDLE_VALUE)
+  {
+    CloseHandle(*read_end);
+    return FALSE;
+  }
+
+  return TRUE;
+#else
+  return CreatePipe(read_end, write_end, sa, 0) ? TRUE : FALSE;
+#endif
+}
+
 void select_group_add_pipe(select_group_t *group, int identifier, HANDLE pipe, void *param)
 {
   select_t *new_select;
@@ -159,6 +692,16 @@ void select_group_add_pipe(select_group_t *group, int identifier, HANDLE pipe, v
   new_select->param  = param;
 
   group->select_list[group->current_size] = new_select;
+
+#ifdef SELECT_GROUP_IOCP
+  /* If it can't be read overlapped, fall back to polling it. */
+  if(!backend_add(group, group->current_size))
+  {
+    new_select->polled = TRUE;
+    group->polled_count++;
+  }
+#endif
+
   group->current_size++;
   if(group->current_size >= group->maximum_size)
   {
@@ -199,6 +742,23 @@ select_recv *select_set_recv(select_group_t *group, int s, select_recv *callback
   return old;
 }
 
+select_recv_batch *select_set_recv_batch(select_group_t *group, int s, select_recv_batch *callback)
+{
+  select_t *select = find_select_by_socket(group, s);
+  select_recv_batch *old = NULL;
+
+  if(select)
+  {
+    old = select->recv_batch_callback;
+    select->recv_batch_callback = callback;
+  }
+
+  if(!group->batch_buffer)
+    group->batch_buffer = (uint8_t*) safe_malloc(SELECT_BATCH_SIZE * MAX_RECV);
+
+  return old;
+}
+
 select_listen *select_set_listen(select_group_t *group, int s, select_listen *callback)
 {
   select_t *select = find_select_by_socket(group, s);
@@ -250,18 +810,115 @@ select_timeout *select_set_timeout(select_group_t *group, select_timeout *callba
 
 NBBOOL select_group_remove_socket(select_group_t *group, int s)
 {
+#ifdef SELECT_GROUP_BACKEND
+  size_t i;
+
+  for(i = 0; i < group->current_size; i++)
+  {
+    if(SG_IS_ACTIVE(group, i) && SG_SOCKET(group, i) == s)
+    {
+      if(SG_POLLED(group, i))
+        group->polled_count--;
+      else
+        backend_remove(group, i);
+
+      SG_IS_ACTIVE(group, i) = FALSE;
+
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+#else
   select_t *socket = find_select_by_socket(group, s);
 
   if(socket)
     socket->active = FALSE;
 
   return (socket ? TRUE : FALSE);
+#endif
+}
+
+static NBBOOL set_paused(select_group_t *group, int s, NBBOOL paused)
+{
+  size_t i;
+
+  for(i = 0; i < group->current_size; i++)
+  {
+    if(SG_IS_ACTIVE(group, i) && SG_SOCKET(group, i) == s)
+    {
+      if(SG_IS_PAUSED(group, i) == paused)
+        return TRUE;
+
+      SG_IS_PAUSED(group, i) = paused;
+
+#ifdef SELECT_GROUP_BACKEND
+      /* Take it out of the backend entirely, rather than just not asking for
+       * reads; otherwise a hangup would keep waking us up. */
+      if(!SG_POLLED(group, i))
+      {
+        if(paused)
+          backend_remove(group, i);
+        else if(!backend_add(group, i))
+        {
+          SG_POLLED(group, i) = TRUE;
+          group->polled_count++;
+        }
+      }
+#endif
+
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
+
+NBBOOL select_group_pause_socket(select_group_t *group, int s)
+{
+  return set_paused(group, s, TRUE);
+}
+
+NBBOOL select_group_resume_socket(select_group_t *group, int s)
+{
+  return set_paused(group, s, FALSE);
+}
+
+NBBOOL select_group_wait_for_writable(select_group_t *group, int s)
+{
+  size_t i;
+
+  for(i = 0; i < group->current_size; i++)
+  {
+    if(SG_IS_ACTIVE(group, i) && SG_SOCKET(group, i) == s)
+    {
+      if(SG_IS_WRITING(group, i))
+        return TRUE;
+
+      SG_IS_WRITING(group, i) = TRUE;
+
+#ifdef SELECT_GROUP_BACKEND
+      /* If it isn't connected yet, the backend's already waiting; if it's
+       * paused, that happens when it's resumed. */
+      if(SG_IS_READY(group, i) && !SG_IS_PAUSED(group, i) && !SG_POLLED(group, i))
+        backend_update(group, i);
+#endif
+
+      return TRUE;
+    }
+  }
+
+  return FALSE;
 }
 
 NBBOOL select_group_remove_and_close_socket(select_group_t *group, int s)
 {
+  /* Remove it first, so the backend can still see the socket. */
+  NBBOOL result = select_group_remove_socket(group, s);
+
   tcp_close(s);
-  return select_group_remove_socket(group, s);
+
+  return result;
 }
 
 static SELECT_RESPONSE_t select_handle_response(select_group_t *group, int s, SELECT_RESPONSE_t response)
@@ -286,11 +943,80 @@ static SELECT_RESPONSE_t select_handle_response(select_group_t *group, int s, SE
   return response;
 }
 
+/* Read every datagram that's waiting (up to BATCH_READS of them), and pass
+ * them all to the batch callback. */
+static void handle_incoming_batch(select_group_t *group, size_t i)
+{
+  int s = SG_SOCKET(group, i);
+  select_datagram_t datagrams[SELECT_BATCH_SIZE];
+  int count;
+#ifdef __linux__
+  struct mmsghdr messages[SELECT_BATCH_SIZE];
+  struct iovec iovecs[SELECT_BATCH_SIZE];
+  int n;
+
+  memset(messages, 0, sizeof(messages));
+  for(n = 0; n < BATCH_READS; n++)
+  {
+    iovecs[n].iov_base = group->batch_buffer + (n * MAX_RECV);
+    iovecs[n].iov_len = MAX_RECV;
+    messages[n].msg_hdr.msg_iov = &iovecs[n];
+    messages[n].msg_hdr.msg_iovlen = 1;
+  }
+
+  /* The socket's readable, so this won't block; MSG_WAITFORONE stops it from
+   * waiting for any more than what's there. */
+  count = recvmmsg(s, messages, BATCH_READS, MSG_WAITFORONE, NULL);
+  for(n = 0; n < count; n++)
+  {
+    datagrams[n].data = iovecs[n].iov_base;
+    datagrams[n].length = messages[n].msg_len;
+  }
+#else
+  ssize_t size;
+
+  for(count = 0; count < BATCH_READS; count++)
+  {
+    /* Only the first one is sure to be there. */
+    datagrams[count].data = group->batch_buffer + (count * MAX_RECV);
+#ifdef WIN32
+    size = recv(s, datagrams[count].data, MAX_RECV, 0);
+#else
+    size = recv(s, datagrams[count].data, MAX_RECV, count ? MSG_DONTWAIT : 0);
+#endif
+    if(size < 0)
+      break;
+    datagrams[count].length = size;
+  }
+
+  if(count == 0)
+    count = -1;
+#endif
+
+  if(count < 0)
+  {
+    if(SG_ERROR(group, i))
+      select_handle_response(group, s, SG_ERROR(group, i)(group, s, getlastsocketerror(SG_SOCKET(group, i)), SG_PARAM(group, i)));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else if(count > 0)
+  {
+    select_handle_response(group, s, SG_RECV_BATCH(group, i)(group, s, datagrams, count, SG_PARAM(group, i)));
+  }
+}
+
 static void handle_incoming_data(select_group_t *group, size_t i)
 {
   int s = SG_SOCKET(group, i);
   uint8_t buffer[MAX_RECV];
 
+  if(SG_RECV_BATCH(group, i))
+  {
+    handle_incoming_batch(group, i);
+    return;
+  }
+
   /* SG_WAITING is set when we're buffering data. Doesn't work with Windows pipes. */
   if(SG_WAITING(group, i))
   {
@@ -429,6 +1155,208 @@ static void handle_incoming_connection(select_group_t *group, size_t i)
     select_handle_response(group, s, SG_LISTEN(group, i)(group, s, SG_PARAM(group, i)));
 }
 
+/* Handle activity on one socket, however the backend found out about it. */
+static void handle_activity(select_group_t *group, size_t i, NBBOOL readable, NBBOOL writable, NBBOOL error)
+{
+  /* It may have been paused by a callback since the event came in. */
+  if(SG_IS_PAUSED(group, i))
+    return;
+
+  /* If the socket is active and it has data waiting to be read, process it. */
+  if(SG_IS_ACTIVE(group, i) && readable)
+  {
+    if(SG_TYPE(group, i) == SOCKET_TYPE_LISTEN)
+    {
+      handle_incoming_connection(group, i);
+    }
+    else
+    {
+      handle_incoming_data(group, i);
+    }
+  }
+
+  /* If the socket became writable, update as appropriate. */
+  if(SG_IS_ACTIVE(group, i) && writable && SG_WANTS_WRITE(group, i))
+  {
+#ifdef SELECT_GROUP_IOCP
+    NBBOOL connected = !SG_IS_READY(group, i);
+#endif
+
+    /* Mark the socket as ready first, so the callback can ask to wait for
+     * it again. */
+    SG_IS_READY(group, i)   = TRUE;
+    SG_IS_WRITING(group, i) = FALSE;
+
+    /* Call the connect (or flush) callback. */
+    if(SG_READY(group, i))
+      select_handle_response(group, SG_SOCKET(group, i), SG_READY(group, i)(group, SG_SOCKET(group, i), SG_PARAM(group, i)));
+
+#ifdef SELECT_GROUP_BACKEND
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && !SG_POLLED(group, i))
+      backend_update(group, i);
+#endif
+
+#ifdef SELECT_GROUP_IOCP
+    /* Now that it's connected, the completion port can take it over. */
+    if(connected && SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && SG_POLLED(group, i) && backend_add(group, i))
+    {
+      SG_POLLED(group, i) = FALSE;
+      group->polled_count--;
+    }
+#endif
+  }
+
+  /* If there's an error, handle it. */
+  if(SG_IS_ACTIVE(group, i) && error)
+  {
+    /* If there's no handler defined, default to closing and removing the
+     * socket. */
+    if(SG_ERROR(group, i))
+      select_handle_response(group, SG_SOCKET(group, i), SG_ERROR(group, i)(group, SG_SOCKET(group, i), getlastsocketerror(SG_SOCKET(group, i)), SG_PARAM(group, i)));
+    else
+      select_handle_response(group, SG_SOCKET(group, i), SELECT_CLOSE_REMOVE);
+  }
+}
+
+#if defined(SELECT_GROUP_EPOLL)
+/* Wait for events and handle them; returns the number of events. */
+static int backend_wait(select_group_t *group, int timeout_ms)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int count;
+  int n;
+
+  count = epoll_wait(group->backend_fd, events, MAX_EVENTS, timeout_ms);
+  if(count == -1)
+    nbdie("select_group: couldn't epoll_wait()");
+
+  for(n = 0; n < count; n++)
+  {
+    uint32_t flags = events[n].events;
+
+    /* An error or hangup shows up as readable with select(), and the read
+     * reports it, so do the same. */
+    handle_activity(group, events[n].data.u32,
+        (flags & (EPOLLIN | EPOLLERR | EPOLLHUP)) ? TRUE : FALSE,
+        (flags & (EPOLLOUT | EPOLLERR)) ? TRUE : FALSE,
+        (flags & EPOLLPRI) ? TRUE : FALSE);
+  }
+
+  return count;
+}
+#elif defined(SELECT_GROUP_KQUEUE)
+static int backend_wait(select_group_t *group, int timeout_ms)
+{
+  struct kevent   events[MAX_EVENTS];
+  struct timespec timeout;
+  int count;
+  int n;
+
+  timeout.tv_sec  = timeout_ms / 1000;
+  timeout.tv_nsec = (timeout_ms % 1000) * 1000000;
+
+  count = kevent(group->backend_fd, NULL, 0, events, MAX_EVENTS, timeout_ms < 0 ? NULL : &timeout);
+  if(count == -1)
+    nbdie("select_group: couldn't kevent()");
+
+  for(n = 0; n < count; n++)
+  {
+    size_t i = (size_t)(uintptr_t)events[n].udata;
+
+    handle_activity(group, i,
+        events[n].filter == EVFILT_READ ? TRUE : FALSE,
+        events[n].filter == EVFILT_WRITE ? TRUE : FALSE,
+        (events[n].flags & EV_ERROR) ? TRUE : FALSE);
+  }
+
+  return count;
+}
+#elif defined(SELECT_GROUP_IOCP)
+/* Handle a read that's finished. */
+static void handle_completion(select_group_t *group, size_t i)
+{
+  select_t *socket = group->select_list[i];
+  int       s      = socket->s;
+  DWORD     error  = socket->completed_error;
+  NBBOOL    again  = TRUE;
+
+  socket->completed = FALSE;
+
+  if(error == ERROR_OPERATION_ABORTED)
+  {
+    /* It was only cancelled for pausing it, so start another one. */
+  }
+  else if(socket->type != SOCKET_TYPE_PIPE)
+  {
+    /* Do the real read now; it reports any errors, too. */
+    handle_activity(group, i, TRUE, FALSE, FALSE);
+  }
+  else if(error == 0 && socket->completed_bytes > 0)
+  {
+    if(SG_RECV(group, i))
+      select_handle_response(group, s, SG_RECV(group, i)(group, s, socket->read_buffer, socket->completed_bytes, NULL, -1, SG_PARAM(group, i)));
+  }
+  else if(error == 0 || error == ERROR_BROKEN_PIPE || error == ERROR_HANDLE_EOF)
+  {
+    /* Pipe closed */
+    again = FALSE;
+    if(SG_CLOSED(group, i))
+      select_handle_response(group, s, SG_CLOSED(group, i)(group, s, SG_PARAM(group, i)));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+  else
+  {
+    again = FALSE;
+    if(SG_ERROR(group, i))
+      select_handle_response(group, s, SG_ERROR(group, i)(group, s, error, SG_PARAM(group, i)));
+    else
+      select_group_remove_and_close_socket(group, s);
+  }
+
+  /* Unless a callback got rid of it or paused it, wait for more. */
+  if(again && socket->active && !socket->paused && !socket->reading && !socket->completed)
+    post_read(group, i);
+}
+
+static int backend_wait(select_group_t *group, int timeout_ms)
+{
+  DWORD       bytes;
+  ULONG_PTR   key;
+  OVERLAPPED *overlapped;
+  select_t   *socket;
+  BOOL        result;
+  int         count = 0;
+
+  /* Wait for the first one, then take whatever else is there. */
+  while(count < MAX_EVENTS)
+  {
+    result = GetQueuedCompletionStatus(group->backend_port, &bytes, &key, &overlapped, count ? 0 : (timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms));
+
+    /* Ones we posted ourselves don't have an OVERLAPPED, but they do succeed. */
+    if(!result && !overlapped)
+      break;
+
+    socket = group->select_list[key];
+    if(overlapped)
+    {
+      socket->reading         = FALSE;
+      socket->completed       = TRUE;
+      socket->completed_bytes = bytes;
+      socket->completed_error = result ? 0 : GetLastError();
+    }
+    count++;
+
+    /* Reads on removed sockets are dropped, and paused ones are held till
+     * they're resumed. */
+    if(socket->active && !socket->paused && socket->completed)
+      handle_completion(group, (size_t)key);
+  }
+
+  return count;
+}
+#endif
+
 void select_group_do_select(select_group_t *group, int timeout_ms)
 {
   fd_set read_set;
@@ -438,17 +1366,61 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
   size_t i;
   struct timeval select_timeout;
 
+  /* Don't sleep past the next timer; if we stop early for one, it isn't a
+   * real timeout. */
+  int wait_ms = get_wait_ms(group, timeout_ms);
+  NBBOOL timer_is_sooner = (wait_ms != timeout_ms);
+
 #ifdef WIN32
   size_t count = 0;
+  int interval;
+#endif
+#if defined(SELECT_GROUP_IOCP)
+  /* (Windows ignores this.) */
+  int biggest_socket = 0;
+#elif defined(SELECT_GROUP_BACKEND)
+  int biggest_socket = group->backend_fd;
+#else
+  int biggest_socket = group->biggest_socket;
+#endif
+
+  /* Write out whatever was logged last time around, now that we're about to
+   * wait anyway. */
+  log_drain();
+
+#ifdef SELECT_GROUP_BACKEND
+  /* If the backend is watching everything, let it do the waiting. */
+#ifdef SELECT_GROUP_IOCP
+  if(!any_selected(group))
+#else
+  if(group->polled_count == 0)
+#endif
+  {
+    if(backend_wait(group, wait_ms) == 0 && timeout_ms >= 0 && !timer_is_sooner && group->timeout_callback)
+      group->timeout_callback(group, group->timeout_param);
+
+    run_timers(group);
+
+    return;
+  }
 #endif
 
-  /* Always time out after an interval (like Ncat does) -- this lets us poll for non-Internet sockets on Windows. */
+  /* Always time out after an interval (like Ncat does) -- this lets us poll for non-Internet sockets on Windows.
+   * With the completion port, it's a much shorter one, since that's how long its reads can wait. */
 #ifdef WIN32
+#ifdef SELECT_GROUP_IOCP
+  interval = IOCP_INTERVAL;
+#else
+  interval = TIMEOUT_INTERVAL;
+#endif
+  if(wait_ms >= 0 && wait_ms < interval)
+    interval = wait_ms;
+
   select_timeout.tv_sec = 0;
-  select_timeout.tv_usec = TIMEOUT_INTERVAL * 1000;
+  select_timeout.tv_usec = interval * 1000;
 #else
-  select_timeout.tv_sec = timeout_ms / 1000;
-  select_timeout.tv_usec = (timeout_ms % 1000) * 1000;
+  select_timeout.tv_sec = wait_ms / 1000;
+  select_timeout.tv_usec = (wait_ms % 1000) * 1000;
 #endif
 
   /* Clear the current socket set */
@@ -461,10 +1433,18 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
   {
 #ifdef WIN32
     /* On Windows, don't add pipes. */
-    if(SG_IS_ACTIVE(group, i) && SG_TYPE(group, i) != SOCKET_TYPE_PIPE)
+#ifdef SELECT_GROUP_BACKEND
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && is_selected(group, i) && SG_TYPE(group, i) != SOCKET_TYPE_PIPE)
+#else
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && SG_TYPE(group, i) != SOCKET_TYPE_PIPE)
+#endif
     {
-      FD_SET(SG_SOCKET(group, i), &read_set);
-      if(!SG_IS_READY(group, i))
+#ifdef SELECT_GROUP_BACKEND
+      /* Unless the completion port has its reads. */
+      if(SG_POLLED(group, i))
+#endif
+        FD_SET(SG_SOCKET(group, i), &read_set);
+      if(SG_WANTS_WRITE(group, i))
         FD_SET(SG_SOCKET(group, i), &write_set);
 
       FD_SET(SG_SOCKET(group, i), &error_set);
@@ -474,10 +1454,18 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
       count++;
     }
 #else
-    if(SG_IS_ACTIVE(group, i))
+#ifdef SELECT_GROUP_BACKEND
+    /* Only sockets that the backend isn't watching. */
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && SG_POLLED(group, i))
+#else
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i))
+#endif
     {
+      if(SG_SOCKET(group, i) > biggest_socket)
+        biggest_socket = SG_SOCKET(group, i);
+
       FD_SET(SG_SOCKET(group, i), &read_set);
-      if(!SG_IS_READY(group, i))
+      if(SG_WANTS_WRITE(group, i))
         FD_SET(SG_SOCKET(group, i), &write_set);
 
       FD_SET(SG_SOCKET(group, i), &error_set);
@@ -485,14 +1473,22 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
 #endif
   }
 
+#if defined(SELECT_GROUP_BACKEND) && !defined(SELECT_GROUP_IOCP)
+  /* The backend's descriptor becomes readable when it has events. */
+  FD_SET(group->backend_fd, &read_set);
+#endif
+
 #ifdef WIN32
   /* If no sockets are added, then use the Sleep() function here. */
   if(count == 0)
-    Sleep(TIMEOUT_INTERVAL);
+  {
+    Sleep(select_timeout.tv_usec / 1000);
+    select_return = 0;
+  }
   else
-    select_return = select(group->biggest_socket + 1, &read_set, &write_set, &error_set, &select_timeout);
+    select_return = select(biggest_socket + 1, &read_set, &write_set, &error_set, &select_timeout);
 #else
-  select_return = select(group->biggest_socket + 1, &read_set, &write_set, &error_set, timeout_ms < 0 ? NULL : &select_timeout);
+  select_return = select(biggest_socket + 1, &read_set, &write_set, &error_set, wait_ms < 0 ? NULL : &select_timeout);
 #endif
 /*  fprintf(stderr, "Select returned %d\n", select_return); */
 
@@ -503,7 +1499,11 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
   /* Handle pipes on every run, whether it's a timeout or data arrived. */
   for(i = 0; i < group->current_size; i++)
   {
-    if(SG_IS_ACTIVE(group, i) && SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
+#ifdef SELECT_GROUP_BACKEND
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && SG_POLLED(group, i) && SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
+#else
+    if(SG_IS_ACTIVE(group, i) && !SG_IS_PAUSED(group, i) && SG_TYPE(group, i) == SOCKET_TYPE_PIPE)
+#endif
     {
       /* Check if the handle is ready. */
       DWORD n;
@@ -544,11 +1544,17 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
    * callback, we have to check if we crossed it. */
   if(select_return == 0)
   {
+#ifdef SELECT_GROUP_IOCP
+    /* The completion port can't be part of the select(), so check it now;
+     * if it had anything, it wasn't a timeout. */
+    if(backend_wait(group, 0) == 0 && timeout_ms >= 0)
+#else
     if(timeout_ms >= 0)
+#endif
     {
 #ifdef WIN32
       /* On Windows, check if we've overflowed our elapsed time. */
-      if((group->elapsed_time / timeout_ms) != ((group->elapsed_time + TIMEOUT_INTERVAL) / timeout_ms))
+      if((group->elapsed_time / timeout_ms) != ((group->elapsed_time + interval) / timeout_ms))
       {
         /* Timeout elapsed with no events, inform the callbacks. */
         if(group->timeout_callback)
@@ -556,55 +1562,43 @@ void select_group_do_select(select_group_t *group, int timeout_ms)
       }
 
       /* Increment the elapsed time. We don't really care if this overflows. */
-      group->elapsed_time = (group->elapsed_time + TIMEOUT_INTERVAL);
+      group->elapsed_time = (group->elapsed_time + interval);
 #else
       /* Timeout elapsed with no events, inform the callbacks. */
-    if(group->timeout_callback)
-      group->timeout_callback(group, group->timeout_param);
+      if(group->timeout_callback && !timer_is_sooner)
+        group->timeout_callback(group, group->timeout_param);
 #endif
     }
   }
   else
   {
+#if defined(SELECT_GROUP_IOCP)
+    /* Pick up whatever the completion port has. */
+    backend_wait(group, 0);
+#elif defined(SELECT_GROUP_BACKEND)
+    /* Pick up whatever the backend has. */
+    if(FD_ISSET(group->backend_fd, &read_set))
+      backend_wait(group, 0);
+#endif
+
     /* Loop through the sockets to find the one that had activity. */
     for(i = 0; i < group->current_size; i++)
     {
-      /* If the socket is active and it has data waiting to be read, process it. */
-      if(SG_IS_ACTIVE(group, i) && FD_ISSET(SG_SOCKET(group, i), &read_set))
-      {
-        if(SG_TYPE(group, i) == SOCKET_TYPE_LISTEN)
-        {
-          handle_incoming_connection(group, i);
-        }
-        else
-        {
-          handle_incoming_data(group, i);
-        }
-      }
-
-      /* If the socket became writable, update as appropriate. */
-      if(SG_IS_ACTIVE(group, i) && FD_ISSET(SG_SOCKET(group, i), &write_set))
-      {
-        /* Call the connect callback. */
-        if(SG_READY(group, i))
-          select_handle_response(group, SG_SOCKET(group, i), SG_READY(group, i)(group, SG_SOCKET(group, i), SG_PARAM(group, i)));
-
-        /* Mark the socket as ready. */
-        SG_IS_READY(group, i) = TRUE;
-      }
-
-      /* If there's an error, handle it. */
-      if(SG_IS_ACTIVE(group, i) && FD_ISSET(SG_SOCKET(group, i), &error_set))
-      {
-        /* If there's no handler defined, default to closing and removing the
-         * socket. */
-        if(SG_ERROR(group, i))
-          select_handle_response(group, SG_SOCKET(group, i), SG_ERROR(group, i)(group, SG_SOCKET(group, i), getlastsocketerror(SG_SOCKET(group, i)), SG_PARAM(group, i)));
-        else
-          select_handle_response(group, SG_SOCKET(group, i), SELECT_CLOSE_REMOVE);
-      }
+#if defined(SELECT_GROUP_IOCP)
+      if(!SG_IS_ACTIVE(group, i) || !is_selected(group, i))
+        continue;
+#elif defined(SELECT_GROUP_BACKEND)
+      if(!SG_IS_ACTIVE(group, i) || !SG_POLLED(group, i))
+        continue;
+#endif
+      handle_activity(group, i,
+          FD_ISSET(SG_SOCKET(group, i), &read_set) ? TRUE : FALSE,
+          FD_ISSET(SG_SOCKET(group, i), &write_set) ? TRUE : FALSE,
+          FD_ISSET(SG_SOCKET(group, i), &error_set) ? TRUE : FALSE);
     }
   }
+
+  run_timers(group);
 }
 
 NBBOOL select_group_wait_for_bytes(select_group_t *group, int s, size_t bytes)
@@ -697,7 +1691,8 @@ HANDLE get_stdin_handle()
   if(handle)
     return handle;
 
-  CreatePipe(&stdin_read, &stdin_write, NULL, 0);
+  if(!select_group_create_pipe(&stdin_read, &stdin_write, NULL))
+    nbdie("stdin: Couldn't create pipe");
   param->stdin_read  = stdin_read;
   param->stdin_write = stdin_write;
 
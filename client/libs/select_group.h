@@ -16,11 +16,18 @@
  * stdin on Windows).
  *
  * Windows support for pipes is a special case. Because Windows can't select()
- * on a pipe or HANDLE, I had to implement some special code. Basically, it
- * polls -- instead of adding pipes to the select(), it times out the select
- * after a set amount of time (right now, it's 100ms). That means that every
- * 100ms, select() returns and checks if any input is waiting on the pipes. Not
- * the greatest solution, but it isn't the greatest OS for networking stuff.
+ * on a pipe or HANDLE, select() times out after a set amount of time (right
+ * now, it's 100ms) and the pipes are polled with PeekNamedPipe().
+ *
+ * Defining SELECT_GROUP_USE_IOCP uses an I/O completion port instead (this
+ * is new, and is only built when asked for): every pipe has an overlapped
+ * read posted to it, and every connected socket a zero-byte one that
+ * completes when data arrives, so nothing is polled. Overlapped reads need a
+ * pipe that was opened for them, which CreatePipe() can't do, so that's what
+ * select_group_create_pipe() is for. Listeners and sockets that haven't
+ * finished connecting are left to select() till they have; while there are
+ * any of those, select() times out every IOCP_INTERVAL to check the
+ * completion port, and otherwise the port is all that's waited on.
  *
  * Even worse, stdin is a special case. stdin can be read through a pipe, so
  * the polling code works great -- except that Windows won't echo types
@@ -32,6 +39,13 @@
  * It's an ugly hack, I know, but when writing Ncat (http://nmap.org/ncat)
  * David Fifield came up with the same solution. Apparently, it's the best
  * we've got.
+ *
+ * On Linux and the BSDs (including Mac), epoll and kqueue are used instead of
+ * select() by default, which avoids walking every socket on every call and
+ * the FD_SETSIZE limit. The callbacks behave exactly the same way. Anything
+ * the backend refuses to watch (like a regular file redirected to stdin)
+ * falls back to select(), and defining SELECT_GROUP_USE_SELECT forces the
+ * old behaviour everywhere.
  */
 
 
@@ -50,15 +64,41 @@
 
 #include "types.h"
 
+/* Choose the event backend. */
+#if !defined(SELECT_GROUP_USE_SELECT)
+#if defined(WIN32)
+#if defined(SELECT_GROUP_USE_IOCP)
+#define SELECT_GROUP_IOCP
+#define SELECT_GROUP_BACKEND
+#endif
+#elif defined(__linux__)
+#define SELECT_GROUP_EPOLL
+#define SELECT_GROUP_BACKEND
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__) || defined(__DragonFly__)
+#define SELECT_GROUP_KQUEUE
+#define SELECT_GROUP_BACKEND
+#endif
+#endif
+
 /* The maximum number of possible sockets (huge number, but I want to prevent overflows). Note that this is
  * sort of a range, because the number of sockets are doubled each time. So it's between 32768 and 65536. */
 #define SOCKET_LIST_MAX_SOCKETS (65536/2)
 
+/* The most datagrams a select_recv_batch callback gets at once. */
+#define SELECT_BATCH_SIZE 32
+
 /* The time, in milliseconds, between select() timing out and polling for pipe data (on Windows). */
 #ifdef WIN32
 #define TIMEOUT_INTERVAL 100
 #endif
 
+/* With the completion port, how often select() stops to check it while
+ * something (a listener, or a socket that's connecting) still needs
+ * select(). */
+#ifdef SELECT_GROUP_IOCP
+#define IOCP_INTERVAL 10
+#endif
+
 /* Different types of sockets, which will affect different aspects. */
 typedef enum
 {
@@ -89,11 +129,40 @@ typedef enum
 typedef SELECT_RESPONSE_t(select_ready)(void *group, int s, void *param);
 /* 'addr' will only be filled in for datagram requests. */
 typedef SELECT_RESPONSE_t(select_recv)(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param);
+
+/* One of the datagrams passed to a select_recv_batch callback. */
+typedef struct
+{
+  uint8_t *data;
+  size_t   length;
+} select_datagram_t;
+
+typedef SELECT_RESPONSE_t(select_recv_batch)(void *group, int s, select_datagram_t *datagrams, size_t count, void *param);
 typedef SELECT_RESPONSE_t(select_listen)(void *group, int s, void *param);
 typedef SELECT_RESPONSE_t(select_error)(void *group, int s, int err, void *param);
 typedef SELECT_RESPONSE_t(select_closed)(void *group, int s, void *param);
 typedef SELECT_RESPONSE_t(select_timeout)(void *group, void *param);
 
+/* A timer, also for internal use. The callbacks are select_timeout
+ * functions. */
+typedef struct
+{
+  /* When it goes off, in select_group_time_ms() time. */
+  uint64_t        deadline;
+
+  /* For periodic timers, the time between runs (0 for one-shot timers). */
+  uint32_t        interval;
+
+  /* The handle returned by select_group_add_timer(). */
+  int             id;
+
+  select_timeout *callback;
+  void           *param;
+
+  /* Set if param is safe_free()d once the timer's done with it. */
+  NBBOOL          owns_param;
+} select_timer_t;
+
 /* This struct is for internal use. */
 typedef struct
 {
@@ -112,6 +181,9 @@ typedef struct
   /* The function to call when data arrives. */
   select_recv    *recv_callback;
 
+  /* The function to call with every datagram that's arrived, instead. */
+  select_recv_batch *recv_batch_callback;
+
   /* The function to call when a connection arrives. */
   select_listen  *listen_callback;
 
@@ -135,11 +207,43 @@ typedef struct
    * receive data. */
   NBBOOL         ready;
 
+  /* Set while we're waiting for the socket to be writable again (see
+   * select_group_wait_for_writable()). */
+  NBBOOL         writing;
+
   /* Set to 'false' when the socket is 'deleted'. It's easier than physically
    * removing it from the list, so until I implement something heavy weight
    * this will work. */
   NBBOOL         active;
 
+  /* Set while the socket is paused (see select_group_pause_socket()). */
+  NBBOOL         paused;
+
+#ifdef SELECT_GROUP_BACKEND
+  /* Set if epoll/kqueue wouldn't take the socket, so select() is used for it
+   * instead. */
+  NBBOOL         polled;
+#endif
+
+#ifdef SELECT_GROUP_IOCP
+  /* The read posted to the completion port. Pipes read into read_buffer;
+   * sockets use a zero-byte read that only says data has arrived. */
+  OVERLAPPED     overlapped;
+  uint8_t       *read_buffer;
+
+  /* Set once it's tied to the completion port, which can only happen once. */
+  NBBOOL         associated;
+
+  /* Set while the read is outstanding. */
+  NBBOOL         reading;
+
+  /* Set when the read has finished but hasn't been handled yet (eg, because
+   * the socket is paused), along with how it finished. */
+  NBBOOL         completed;
+  DWORD          completed_bytes;
+  DWORD          completed_error;
+#endif
+
   /* Stores a piece of arbitrary data that's sent to the callbacks. */
   void           *param;
 } select_t;
@@ -163,11 +267,39 @@ typedef struct
   /* The handle to the highest-numbered socket in the list (required for select() call). */
   int biggest_socket;
 
+#ifdef SELECT_GROUP_BACKEND
+#ifdef SELECT_GROUP_IOCP
+  /* The completion port. */
+  HANDLE backend_port;
+#else
+  /* The epoll/kqueue descriptor. */
+  int backend_fd;
+#endif
+
+  /* The number of active sockets that need select() (see select_t.polled). */
+  size_t polled_count;
+#endif
+
   /* The function to call when the timeout time expires. */
   select_timeout *timeout_callback;
 
   /* A parameter that is passed to the callback function. */
   void *timeout_param;
+
+  /* A binary min-heap of timers, keyed on the deadline. */
+  select_timer_t *timers;
+  size_t timer_count;
+  size_t timer_max;
+  int next_timer_id;
+
+  /* The timer whose callback is running, and whether it was cancelled
+   * from inside its own callback. */
+  int running_timer;
+  NBBOOL running_timer_cancelled;
+
+  /* Room for SELECT_BATCH_SIZE datagrams, for the recv_batch callbacks
+   * (allocated when the first one is set). */
+  uint8_t *batch_buffer;
 } select_group_t;
 
 /* Allocate memory for a select group */
@@ -180,18 +312,29 @@ void select_group_destroy(select_group_t *group);
 void select_group_add_socket(select_group_t *group, int s, SOCKET_TYPE_t type, void *param);
 
 #ifdef WIN32
+/* Create a pipe whose read end can be added with select_group_add_pipe(); the write end is an
+ * ordinary blocking handle. 'sa' is passed along, and can be NULL. */
+NBBOOL select_group_create_pipe(HANDLE *read_end, HANDLE *write_end, SECURITY_ATTRIBUTES *sa);
+
 /* Add a pipe to the group. The 'identifier' is treated as a socket and is used in place of a socket
- * to look up the pipe. */
+ * to look up the pipe. The pipe should come from select_group_create_pipe(). */
 void select_group_add_pipe(select_group_t *group, int identifier, HANDLE pipe, void *param);
 #endif
 
-/* Set a callback that's called when the socket becomes ready to send data. */
+/* Set a callback that's called when the socket becomes ready to send data: once it's connected, and
+ * again after each select_group_wait_for_writable(). */
 select_ready   *select_set_ready(select_group_t *group, int s, select_ready *callback);
 
 /* Set the recv() callback. This will return with as much data as comes in, or with the number of bytes set by
  * set_group_wait_for_bytes(), if that's set. Returns the old callback, if set. */
 select_recv    *select_set_recv(select_group_t *group, int s, select_recv *callback);
 
+/* Set a callback for a datagram socket that gets every datagram waiting on it
+ * at once (up to SELECT_BATCH_SIZE, with a single recvmmsg() on Linux), rather
+ * than calling the recv() callback once for each. This takes the place of the
+ * recv() callback. Returns the old callback, if set. */
+select_recv_batch *select_set_recv_batch(select_group_t *group, int s, select_recv_batch *callback);
+
 /* Set the listen() callback for incoming connections. It's up to the callback to perform the accept() to
  * get the new socket. */
 select_listen  *select_set_listen(select_group_t *group, int s, select_listen *callback);
@@ -209,16 +352,49 @@ select_closed  *select_set_closed(select_group_t *group, int s, select_closed *c
 /* Set the timeout callback, for when the time specified in select_group_do_select() elapses. */
 select_timeout *select_set_timeout(select_group_t *group, select_timeout *callback, void *param);
 
+/* Call the callback after delay_ms and then, if interval_ms isn't 0, every
+ * interval_ms after that till it's cancelled or the callback returns
+ * SELECT_REMOVE (a timer added by a timer's callback waits at least 1ms).
+ * Returns an id that can be passed to select_group_cancel_timer(). */
+int select_group_add_timer(select_group_t *group, uint32_t delay_ms, uint32_t interval_ms, select_timeout *callback, void *param);
+
+/* The same, but param (from safe_malloc()) belongs to the timer, and is
+ * freed once it stops, it's cancelled, or the group is destroyed. */
+int select_group_add_owned_timer(select_group_t *group, uint32_t delay_ms, uint32_t interval_ms, select_timeout *callback, void *param);
+
+/* Cancel a timer before it goes off. Returns FALSE if it wasn't found. */
+NBBOOL select_group_cancel_timer(select_group_t *group, int id);
+
+/* The current time in milliseconds, the same clock that the timers use; it
+ * counts from some arbitrary point (like boot), so it's only good for
+ * measuring time, not telling it. */
+uint64_t select_group_time_ms();
+
 /* Remove a socket from the group. Returns non-zero if successful. */
 NBBOOL select_group_remove_socket(select_group_t *group, int s);
 
 /* Remove a socket from the group, and close it. */
 NBBOOL select_group_remove_and_close_socket(select_group_t *group, int s);
 
+/* Stop watching a socket until select_group_resume_socket() is called,
+ * without removing it. While it's paused, none of its callbacks are called
+ * and incoming data waits in the OS (which eventually pushes back on
+ * whoever's sending it). Returns FALSE if the socket wasn't found. */
+NBBOOL select_group_pause_socket(select_group_t *group, int s);
+
+/* Start watching a paused socket again. */
+NBBOOL select_group_resume_socket(select_group_t *group, int s);
+
+/* Call the socket's ready callback the next time it can be written to (once), for sending whatever
+ * didn't fit last time. While the socket is paused, this waits till it's resumed. Returns FALSE if the
+ * socket wasn't found. */
+NBBOOL select_group_wait_for_writable(select_group_t *group, int s);
+
 /* Perform the select() call across the various sockets. with the given timeout in milliseconds.
  * Note that the timeout (and therefore the timeout callback) only fires if _every_ socket is idle.
- * If timeout_ms < 0, it will block indefinitely (till data arrives on any socket). Because of polling,
- * on Windows, timeout_ms actually has a resolution defined by TIMEOUT_INTERVAL. */
+ * If timeout_ms < 0, it will block indefinitely (till data arrives on any socket or a timer is due).
+ * Any timers that are due are run before it returns. While anything is polled on Windows (see
+ * above), timeout_ms actually has a resolution defined by TIMEOUT_INTERVAL. */
 void select_group_do_select(select_group_t *group, int timeout_ms);
 
 /* Wait for the given number of bytes to arrive on the socket, rather than any number of bytes. This doesn't
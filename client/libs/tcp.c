@@ -17,6 +17,7 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
 #include <sys/types.h>
 #endif
@@ -61,10 +62,9 @@ void winsock_initialize()
 #endif
 }
 
-int tcp_connect_options(char *host, uint16_t port, int non_blocking)
+int tcp_connect_address(uint32_t address, uint16_t port, int non_blocking)
 {
   struct sockaddr_in serv_addr;
-  struct hostent *server;
   int s;
   int status;
 
@@ -86,19 +86,11 @@ int tcp_connect_options(char *host, uint16_t port, int non_blocking)
 #endif
   }
 
-  /* Look up the host */
-  server = gethostbyname(host);
-  if(!server)
-  {
-    fprintf(stderr, "Couldn't find host %s\n", host);
-    return -1;
-  }
-
   /* Set up the server address */
   memset(&serv_addr, '\0', sizeof(serv_addr));
-  serv_addr.sin_family = AF_INET;
-  serv_addr.sin_port   = htons(port);
-  memcpy(&serv_addr.sin_addr, server->h_addr_list[0], server->h_length);
+  serv_addr.sin_family      = AF_INET;
+  serv_addr.sin_port        = htons(port);
+  serv_addr.sin_addr.s_addr = address;
 
   /* Connect */
   status = connect(s, (struct sockaddr*)&serv_addr, sizeof(serv_addr));
@@ -110,6 +102,7 @@ int tcp_connect_options(char *host, uint16_t port, int non_blocking)
 #endif
   {
     nberror("tcp: couldn't connect to host");
+    tcp_close(s);
 
     return -1;
   }
@@ -117,6 +110,23 @@ int tcp_connect_options(char *host, uint16_t port, int non_blocking)
   return s;
 }
 
+int tcp_connect_options(char *host, uint16_t port, int non_blocking)
+{
+  struct hostent *server;
+  uint32_t address;
+
+  /* Look up the host */
+  server = gethostbyname(host);
+  if(!server)
+  {
+    fprintf(stderr, "Couldn't find host %s\n", host);
+    return -1;
+  }
+  memcpy(&address, server->h_addr_list[0], sizeof(address));
+
+  return tcp_connect_address(address, port, non_blocking);
+}
+
 int tcp_connect(char *host, uint16_t port)
 {
   return tcp_connect_options(host, port, 0);
@@ -133,6 +143,13 @@ void tcp_set_nonblocking(int s)
 #endif
 }
 
+void tcp_set_nodelay(int s)
+{
+  int on = 1;
+
+  setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&on, sizeof(on));
+}
+
 int tcp_listen(char *address, uint16_t port)
 {
   int s;
@@ -155,6 +172,12 @@ int tcp_listen(char *address, uint16_t port)
   }
   else
   {
+#ifndef WIN32
+    /* So we can listen on the same port again right away. */
+    int on = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#endif
+
     /* Bind the socket */
     if (bind(s, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0)
       nbdie("tcp: couldn't bind to socket");
@@ -24,9 +24,17 @@ int    tcp_connect(char *host, uint16_t port);
  * socket. */
 int tcp_connect_options(char *host, uint16_t port, int non_blocking);
 
+/* The same as tcp_connect_options, for an address that's already been looked
+ * up (in network byte order; see resolver.h). */
+int tcp_connect_address(uint32_t address, uint16_t port, int non_blocking);
+
 /* Set a socket as non-blocking. */
 void   tcp_set_nonblocking(int s);
 
+/* Send small writes right away instead of waiting to fill a segment (for
+ * sockets that send a request and wait for the answer). */
+void   tcp_set_nodelay(int s);
+
 /* Puts a socket into listening mode on the given address (use '0.0.0.0' for any).
  * Returns -1 on an error, or the socket if successful. */
 int    tcp_listen(char *address, uint16_t port);
@@ -0,0 +1,181 @@
+/* tls.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#ifdef USE_TLS
+
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#else
+#include <arpa/inet.h>
+#endif
+
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+
+#include "log.h"
+#include "memory.h"
+
+#include "tls.h"
+
+/* Shared by every connection (verification is set per connection). */
+static SSL_CTX *ctx = NULL;
+
+static void log_openssl_error(char *what)
+{
+  char error[256];
+
+  ERR_error_string_n(ERR_get_error(), error, sizeof(error));
+  LOG_ERROR("TLS: %s: %s", what, error);
+  ERR_clear_error();
+}
+
+/* Push the handshake along, then write whatever's waiting once it's done. */
+static NBBOOL progress(tls_t *tls)
+{
+  uint8_t *data;
+  size_t   length;
+  int      result;
+
+  if(!SSL_is_init_finished(tls->ssl))
+  {
+    result = SSL_do_handshake(tls->ssl);
+    if(result != 1)
+    {
+      if(SSL_get_error(tls->ssl, result) == SSL_ERROR_WANT_READ)
+        return TRUE;
+
+      log_openssl_error("the handshake failed");
+      return FALSE;
+    }
+
+    LOG_INFO("TLS: connected (%s)", SSL_get_version(tls->ssl));
+  }
+
+  while(ring_buffer_get_length(tls->pending) > 0)
+  {
+    length = ring_buffer_peek(tls->pending, 0, &data);
+    result = SSL_write(tls->ssl, data, (int)length);
+    if(result <= 0)
+    {
+      log_openssl_error("couldn't write");
+      return FALSE;
+    }
+
+    ring_buffer_consume(tls->pending, result);
+  }
+
+  return TRUE;
+}
+
+tls_t *tls_create(char *host, NBBOOL verify)
+{
+  tls_t  *tls = (tls_t*) safe_malloc(sizeof(tls_t));
+  uint8_t addr[16];
+  NBBOOL  is_ip = inet_pton(AF_INET, host, addr) == 1 || inet_pton(AF_INET6, host, addr) == 1;
+
+  if(!ctx)
+  {
+    ctx = SSL_CTX_new(TLS_client_method());
+    if(!ctx)
+    {
+      log_openssl_error("couldn't create a context");
+      exit(1);
+    }
+
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    if(!SSL_CTX_set_default_verify_paths(ctx))
+      log_openssl_error("couldn't load the system's certificate authorities");
+  }
+
+  tls->ssl     = SSL_new(ctx);
+  tls->in      = BIO_new(BIO_s_mem());
+  tls->out     = BIO_new(BIO_s_mem());
+  tls->pending = ring_buffer_create(0);
+
+  SSL_set_bio(tls->ssl, tls->in, tls->out);
+  SSL_set_connect_state(tls->ssl);
+
+  /* Names get SNI; either way, the certificate has to match. */
+  if(!is_ip)
+    SSL_set_tlsext_host_name(tls->ssl, host);
+
+  if(verify)
+  {
+    SSL_set_verify(tls->ssl, SSL_VERIFY_PEER, NULL);
+    if(is_ip)
+      X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(tls->ssl), host);
+    else
+      SSL_set1_host(tls->ssl, host);
+  }
+
+  /* Get the ClientHello ready. */
+  progress(tls);
+
+  return tls;
+}
+
+void tls_destroy(tls_t *tls)
+{
+  /* (This frees the BIOs, too.) */
+  SSL_free(tls->ssl);
+  ring_buffer_destroy(tls->pending);
+  safe_free(tls);
+}
+
+NBBOOL tls_write(tls_t *tls, uint8_t *data, size_t length)
+{
+  ring_buffer_add_bytes(tls->pending, data, length);
+
+  return progress(tls);
+}
+
+NBBOOL tls_read(tls_t *tls, uint8_t *data, size_t length, buffer_t *plaintext)
+{
+  uint8_t decrypted[4096];
+  int     result;
+
+  BIO_write(tls->in, data, (int)length);
+
+  if(!progress(tls))
+    return FALSE;
+
+  while((result = SSL_read(tls->ssl, decrypted, sizeof(decrypted))) > 0)
+    buffer_add_bytes(plaintext, decrypted, result);
+
+  switch(SSL_get_error(tls->ssl, result))
+  {
+    case SSL_ERROR_WANT_READ:
+      return TRUE;
+
+    case SSL_ERROR_ZERO_RETURN:
+      LOG_INFO("TLS: the server closed the connection");
+      return FALSE;
+
+    default:
+      log_openssl_error("couldn't read");
+      return FALSE;
+  }
+}
+
+void tls_get_outgoing(tls_t *tls, ring_buffer_t *out)
+{
+  uint8_t data[4096];
+  int     length;
+
+  while((length = BIO_read(tls->out, data, sizeof(data))) > 0)
+    ring_buffer_add_bytes(out, data, length);
+}
+
+NBBOOL tls_is_connected(tls_t *tls)
+{
+  return SSL_is_init_finished(tls->ssl) ? TRUE : FALSE;
+}
+
+#endif
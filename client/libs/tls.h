@@ -0,0 +1,62 @@
+/* tls.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * The client end of a TLS connection (using OpenSSL), for DNS-over-TLS and
+ * DNS-over-HTTPS. It never touches the socket itself, so it fits into the
+ * select loop like anything else: whatever arrives on the socket goes in
+ * through tls_read(), and whatever tls_get_outgoing() hands back has to be
+ * sent. Data written before the handshake is done waits for it.
+ *
+ * This is only built with -DUSE_TLS ('make tls'), which needs OpenSSL.
+ */
+
+#ifndef __TLS_H__
+#define __TLS_H__
+
+#ifdef USE_TLS
+
+#include <openssl/ssl.h>
+
+#include "buffer.h"
+#include "ring_buffer.h"
+#include "types.h"
+
+typedef struct
+{
+  SSL           *ssl;
+
+  /* What's arrived from the server, for OpenSSL to read, and what OpenSSL
+   * wants sent to it. */
+  BIO           *in;
+  BIO           *out;
+
+  /* What we've been asked to send, waiting on the handshake. */
+  ring_buffer_t *pending;
+} tls_t;
+
+/* Start a connection to host, checking its certificate (against the
+ * system's certificate authorities) if verify is set. */
+tls_t  *tls_create(char *host, NBBOOL verify);
+void    tls_destroy(tls_t *tls);
+
+/* Encrypt data, to go out with the next tls_get_outgoing(). Returns FALSE
+ * if the connection is no good. */
+NBBOOL  tls_write(tls_t *tls, uint8_t *data, size_t length);
+
+/* Decrypt data that arrived on the socket, adding whatever plaintext there
+ * is to plaintext. Returns FALSE if the connection is no good (or the
+ * server closed it). */
+NBBOOL  tls_read(tls_t *tls, uint8_t *data, size_t length, buffer_t *plaintext);
+
+/* Move whatever has to be sent to the server into out. */
+void    tls_get_outgoing(tls_t *tls, ring_buffer_t *out);
+
+/* TRUE once the handshake is done. */
+NBBOOL  tls_is_connected(tls_t *tls);
+
+#endif
+
+#endif
@@ -0,0 +1,131 @@
+/* trace.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <sys/time.h>
+#endif
+
+#include "log.h"
+
+#include "trace.h"
+
+static FILE *trace_file = NULL;
+
+/* pcap headers are in the writer's byte order (the magic number tells the
+ * reader which); we always use little endian. */
+static void add_int16(uint8_t *out, uint16_t value)
+{
+  out[0] = (uint8_t)(value & 0xFF);
+  out[1] = (uint8_t)(value >> 8);
+}
+
+static void add_int32(uint8_t *out, uint32_t value)
+{
+  out[0] = (uint8_t)(value & 0xFF);
+  out[1] = (uint8_t)((value >> 8) & 0xFF);
+  out[2] = (uint8_t)((value >> 16) & 0xFF);
+  out[3] = (uint8_t)(value >> 24);
+}
+
+static void get_time(uint32_t *seconds, uint32_t *microseconds)
+{
+#ifdef WIN32
+  FILETIME ft;
+  uint64_t us;
+
+  /* FILETIME counts 100ns intervals since 1601. */
+  GetSystemTimeAsFileTime(&ft);
+  us = (((uint64_t)ft.dwLowDateTime + ((uint64_t)(ft.dwHighDateTime) << 32)) / 10) - 11644473600000000LL;
+
+  *seconds      = (uint32_t)(us / 1000000);
+  *microseconds = (uint32_t)(us % 1000000);
+#else
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  *seconds      = (uint32_t)tv.tv_sec;
+  *microseconds = (uint32_t)tv.tv_usec;
+#endif
+}
+
+NBBOOL trace_to_file(char *filename)
+{
+  uint8_t header[24];
+
+#ifdef WIN32
+  fopen_s(&trace_file, filename, "wb");
+#else
+  trace_file = fopen(filename, "wb");
+#endif
+  if(!trace_file)
+  {
+    LOG_ERROR("Couldn't open the trace file: %s", filename);
+    return FALSE;
+  }
+
+  add_int32(header +  0, 0xa1b2c3d4); /* Magic */
+  add_int16(header +  4, 2);          /* Version 2.4 */
+  add_int16(header +  6, 4);
+  add_int32(header +  8, 0);          /* Timezone */
+  add_int32(header + 12, 0);          /* Timestamp accuracy */
+  add_int32(header + 16, TRACE_SNAPLEN);
+  add_int32(header + 20, TRACE_LINKTYPE);
+  fwrite(header, 1, sizeof(header), trace_file);
+
+  return TRUE;
+}
+
+NBBOOL trace_is_enabled()
+{
+  return trace_file ? TRUE : FALSE;
+}
+
+void trace_packet(trace_direction_t direction, uint32_t options, uint8_t *data, size_t length)
+{
+  uint8_t  header[16 + TRACE_HEADER_LENGTH];
+  uint32_t seconds;
+  uint32_t microseconds;
+  size_t   captured = length;
+
+  if(!trace_file)
+    return;
+
+  if(captured > TRACE_SNAPLEN - TRACE_HEADER_LENGTH)
+    captured = TRACE_SNAPLEN - TRACE_HEADER_LENGTH;
+
+  get_time(&seconds, &microseconds);
+
+  add_int32(header +  0, seconds);
+  add_int32(header +  4, microseconds);
+  add_int32(header +  8, (uint32_t)(captured + TRACE_HEADER_LENGTH));
+  add_int32(header + 12, (uint32_t)(length + TRACE_HEADER_LENGTH));
+
+  /* The trace_header_t (big endian, like the packet after it). */
+  memset(header + 16, 0, TRACE_HEADER_LENGTH);
+  header[16] = (uint8_t)direction;
+  header[20] = (uint8_t)(options >> 24);
+  header[21] = (uint8_t)((options >> 16) & 0xFF);
+  header[22] = (uint8_t)((options >> 8) & 0xFF);
+  header[23] = (uint8_t)(options & 0xFF);
+
+  fwrite(header, 1, sizeof(header), trace_file);
+  fwrite(data, 1, captured, trace_file);
+}
+
+void trace_close()
+{
+  if(trace_file)
+  {
+    fclose(trace_file);
+    trace_file = NULL;
+  }
+}
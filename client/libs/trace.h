@@ -0,0 +1,69 @@
+/* trace.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * Writes every dnscat packet a session sends or receives to a file, in the
+ * pcap format, so a trace can be kept while the client is doing real work
+ * and looked at later (see bench/tracedump.c). Unlike --packet-trace, nothing
+ * is formatted: each packet is one buffered fwrite(), so it's cheap enough
+ * to leave on.
+ *
+ * The packets are the plaintext ones (before encryption / after decryption),
+ * so the session id, SEQ and ACK are all there. Each record is a
+ * trace_header_t followed by the packet.
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include <stdlib.h> /* For size_t */
+
+#include "types.h"
+
+#ifdef WIN32
+#include "pstdint.h"
+#else
+#include <stdint.h>
+#endif
+
+/* The pcap link type for "private use"; nothing else will know what's in
+ * them, so we don't pretend to be anything. */
+#define TRACE_LINKTYPE 147
+
+/* The biggest record we'll write (anything longer is cut short). */
+#define TRACE_SNAPLEN  65535
+
+typedef enum
+{
+  TRACE_OUTGOING = 0,
+  TRACE_INCOMING = 1,
+} trace_direction_t;
+
+/* In front of each packet, in network byte order; the options are what the
+ * session had when the packet was sent or received, which is needed to
+ * parse it. */
+typedef struct
+{
+  uint8_t  direction;
+  uint8_t  reserved[3];
+  uint32_t options;
+} trace_header_t;
+
+#define TRACE_HEADER_LENGTH 8
+
+/* Start writing to the given file (replacing it); FALSE if it can't be
+ * opened. */
+NBBOOL trace_to_file(char *filename);
+
+/* TRUE if trace_to_file() was called and worked. */
+NBBOOL trace_is_enabled();
+
+/* Add one packet to the trace (if there is one). */
+void trace_packet(trace_direction_t direction, uint32_t options, uint8_t *data, size_t length);
+
+/* Flush and close the file. */
+void trace_close();
+
+#endif
@@ -71,6 +71,10 @@ typedef int socklen_t;
 #define MAX(a,b) (a > b ? a : b)
 #endif
 
+/* Called once for each counter when something reports its statistics (see
+ * controller_get_stats()). */
+typedef void(stats_callback_t)(char *name, uint32_t value, void *param);
+
 #define DIE(a) {fprintf(stderr, "Unrecoverable error in %s(%d): %s\n\n", __FILE__, __LINE__, a); abort();}
 #define DIE_MEM() {DIE("Out of memory.");}
 
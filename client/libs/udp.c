@@ -5,6 +5,11 @@
  * (See LICENSE.md)
  */
 
+/* (For sendmmsg().) */
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -64,27 +69,121 @@ ssize_t udp_read(int s, void *buffer, size_t buffer_length, struct sockaddr_in *
   return received;
 }
 
-ssize_t udp_send(int sock, char *address, uint16_t port, void *data, size_t length)
+NBBOOL udp_resolve(char *address, uint16_t port, int family, udp_addr_t *result)
 {
-  int    result = -1;
-  struct sockaddr_in serv_addr;
-  struct hostent *server;
+#ifdef WIN32
+  struct sockaddr_in *serv_addr = (struct sockaddr_in*)&result->addr;
+  struct hostent     *server;
 
-  /* Look up the host */
+  /* Windows only gets IPv4 (the same as gethostbyname() always did). */
   server = gethostbyname(address);
   if(!server)
   {
     fprintf(stderr, "Couldn't find host %s\n", address);
+    return FALSE;
   }
-  else
+
+  memset(result, '\0', sizeof(udp_addr_t));
+  serv_addr->sin_family = AF_INET;
+  serv_addr->sin_port   = htons(port);
+  memcpy(&serv_addr->sin_addr, server->h_addr_list[0], server->h_length);
+  result->length = sizeof(struct sockaddr_in);
+
+  return TRUE;
+#else
+  struct addrinfo  hints;
+  struct addrinfo *info = NULL;
+  char             port_str[8];
+  int              status;
+
+  memset(&hints, '\0', sizeof(hints));
+  hints.ai_family   = family;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  sprintf(port_str, "%u", port);
+
+  status = getaddrinfo(address, port_str, &hints, &info);
+  if(status || !info)
   {
-    /* Set up the server address */
-    memset(&serv_addr, '\0', sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port   = htons(port);
-    memcpy(&serv_addr.sin_addr, server->h_addr_list[0], server->h_length);
+    fprintf(stderr, "Couldn't find host %s: %s\n", address, gai_strerror(status));
+    return FALSE;
+  }
+
+  memset(result, '\0', sizeof(udp_addr_t));
+  memcpy(&result->addr, info->ai_addr, info->ai_addrlen);
+  result->length = info->ai_addrlen;
+
+  freeaddrinfo(info);
 
-    result = sendto(sock, data, length, 0, (struct sockaddr *)&serv_addr, sizeof(struct sockaddr_in));
+  return TRUE;
+#endif
+}
+
+ssize_t udp_send_addr(int sock, udp_addr_t *addr, void *data, size_t length)
+{
+  return sendto(sock, data, length, 0, (struct sockaddr *)&addr->addr, addr->length);
+}
+
+size_t udp_send_batch(int sock, udp_datagram_t *datagrams, size_t count)
+{
+  size_t failed = 0;
+  size_t i;
+#ifdef __linux__
+  struct mmsghdr messages[UDP_BATCH_SIZE];
+  struct iovec   iovecs[UDP_BATCH_SIZE];
+  size_t         sent = 0;
+  int            n;
+
+  while(sent < count)
+  {
+    size_t batch = count - sent < UDP_BATCH_SIZE ? count - sent : UDP_BATCH_SIZE;
+
+    memset(messages, 0, sizeof(messages));
+    for(i = 0; i < batch; i++)
+    {
+      iovecs[i].iov_base = datagrams[sent + i].data;
+      iovecs[i].iov_len  = datagrams[sent + i].length;
+      messages[i].msg_hdr.msg_name    = &datagrams[sent + i].addr->addr;
+      messages[i].msg_hdr.msg_namelen = datagrams[sent + i].addr->length;
+      messages[i].msg_hdr.msg_iov     = &iovecs[i];
+      messages[i].msg_hdr.msg_iovlen  = 1;
+    }
+
+    /* It stops at the first one that fails, so skip past that and carry on
+     * with the rest. */
+    n = sendmmsg(sock, messages, batch, 0);
+    if(n <= 0)
+    {
+      datagrams[sent++].result = -1;
+      failed++;
+      continue;
+    }
+
+    for(i = 0; i < (size_t)n; i++)
+      datagrams[sent + i].result = messages[i].msg_len;
+    sent += n;
+  }
+#else
+  for(i = 0; i < count; i++)
+  {
+    datagrams[i].result = udp_send_addr(sock, datagrams[i].addr, datagrams[i].data, datagrams[i].length);
+    if(datagrams[i].result < 0)
+      failed++;
+  }
+#endif
+
+  return failed;
+}
+
+ssize_t udp_send(int sock, char *address, uint16_t port, void *data, size_t length)
+{
+  int        result = -1;
+  udp_addr_t addr;
+
+  /* Look up the host */
+  if(udp_resolve(address, port, AF_INET, &addr))
+  {
+    result = udp_send_addr(sock, &addr, data, length);
 
     if( result < 0 )
       nbdie("udp: couldn't send data");
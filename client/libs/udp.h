@@ -10,17 +10,24 @@
 #ifndef __UDP_H__
 #define __UDP_H__
 
-/*#ifdef WIN32
+#ifdef WIN32
 #include <winsock2.h>
+#include <ws2tcpip.h>
 #else
-#include <netdb.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#endif*/
+#include <sys/types.h>
+#include <sys/socket.h>
+#endif
 
 #include "types.h"
 
+/* A resolved address (IPv4 or IPv6), so a name only has to be looked up
+ * once instead of on every packet. */
+typedef struct
+{
+  struct sockaddr_storage addr;
+  socklen_t               length;
+} udp_addr_t;
+
 /* Must be called before any other functions. This is actually defined in tcp.c. */
 void winsock_initialize();
 
@@ -30,7 +37,37 @@ int udp_create_socket(uint16_t port, char *local_address);
 /* Read from the new socket, filling in the 'from' field if given. Not currently being used. */
 /*ssize_t udp_read(int s, void *buffer, size_t buffer_length, struct sockaddr_in *from);*/
 
-/* Send data to the given address on the given port. */
+/* Look up the address once and store it in result. family is AF_INET,
+ * AF_INET6, or AF_UNSPEC, and has to match the socket it'll be used with.
+ * Returns FALSE (and prints an error) if it can't be resolved. */
+NBBOOL udp_resolve(char *address, uint16_t port, int family, udp_addr_t *result);
+
+/* Send data to an address from udp_resolve(). Unlike udp_send(), this
+ * returns -1 on an error instead of exiting, so the caller can re-resolve. */
+ssize_t udp_send_addr(int sock, udp_addr_t *addr, void *data, size_t length);
+
+/* The most datagrams that go to the kernel at once with udp_send_batch()
+ * (bigger batches take more than one call). */
+#define UDP_BATCH_SIZE 32
+
+/* One of the datagrams for udp_send_batch(). */
+typedef struct
+{
+  udp_addr_t *addr;
+  uint8_t    *data;
+  size_t      length;
+
+  /* Filled in with what udp_send_addr() would have returned for it. */
+  ssize_t     result;
+} udp_datagram_t;
+
+/* Send a bunch of datagrams, with as few system calls as we can (one
+ * sendmmsg() per UDP_BATCH_SIZE of them on Linux; one sendto() each
+ * elsewhere). Returns how many of them couldn't be sent. */
+size_t udp_send_batch(int sock, udp_datagram_t *datagrams, size_t count);
+
+/* Send data to the given address on the given port (looking it up each
+ * time). */
 ssize_t udp_send(int sock, char *address, uint16_t port, void *data, size_t length);
 
 /* Close the UDP socket. */
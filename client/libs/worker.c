@@ -0,0 +1,254 @@
+/* worker.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <stdio.h>
+
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "log.h"
+#include "memory.h"
+
+#include "worker.h"
+
+#ifdef USE_THREADS
+
+#ifdef WIN32
+#define LOCK(worker)   EnterCriticalSection(&(worker)->lock)
+#define UNLOCK(worker) LeaveCriticalSection(&(worker)->lock)
+#else
+#define LOCK(worker)   pthread_mutex_lock(&(worker)->lock)
+#define UNLOCK(worker) pthread_mutex_unlock(&(worker)->lock)
+#endif
+
+/* (With the lock held.) */
+static void wait_for_job(worker_t *worker)
+{
+#ifdef WIN32
+  UNLOCK(worker);
+  WaitForSingleObject(worker->wakeup, INFINITE);
+  LOCK(worker);
+#else
+  pthread_cond_wait(&worker->wakeup, &worker->lock);
+#endif
+}
+
+static void signal_job(worker_t *worker)
+{
+#ifdef WIN32
+  SetEvent(worker->wakeup);
+#else
+  pthread_cond_signal(&worker->wakeup);
+#endif
+}
+
+/* Tell the main thread there's something on the finished list. */
+static void wake_main_thread(worker_t *worker)
+{
+  uint8_t byte = 0;
+
+#ifdef WIN32
+  DWORD written;
+  WriteFile(worker->pipe_write, &byte, 1, &written, NULL);
+#else
+  if(write(worker->pipe[1], &byte, 1) != 1)
+    LOG_ERROR("worker: couldn't wake up the main thread");
+#endif
+}
+
+#ifdef WIN32
+static DWORD WINAPI worker_thread(void *param)
+#else
+static void *worker_thread(void *param)
+#endif
+{
+  worker_t     *worker = (worker_t*) param;
+  worker_job_t *job;
+
+  LOCK(worker);
+  while(TRUE)
+  {
+    while(!worker->pending_first && !worker->is_stopping)
+      wait_for_job(worker);
+
+    if(worker->is_stopping)
+      break;
+
+    job = worker->pending_first;
+    worker->pending_first = job->next;
+    if(!worker->pending_first)
+      worker->pending_last = NULL;
+    UNLOCK(worker);
+
+    job->run(job->param);
+
+    LOCK(worker);
+    job->next = NULL;
+    if(worker->finished_last)
+    {
+      worker->finished_last->next = job;
+    }
+    else
+    {
+      /* Only the first one needs a wakeup; the main thread takes them all. */
+      worker->finished_first = job;
+      wake_main_thread(worker);
+    }
+    worker->finished_last = job;
+  }
+  UNLOCK(worker);
+
+  return 0;
+}
+
+/* Call done() for a list of jobs, and free them. */
+static void finish_jobs(worker_job_t *job)
+{
+  worker_job_t *next;
+
+  for(; job; job = next)
+  {
+    next = job->next;
+    job->done(job->param);
+    safe_free(job);
+  }
+}
+
+static SELECT_RESPONSE_t worker_wakeup(void *group, int socket, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
+{
+  worker_t     *worker = (worker_t*) param;
+  worker_job_t *finished;
+
+  LOCK(worker);
+  finished = worker->finished_first;
+  worker->finished_first = NULL;
+  worker->finished_last  = NULL;
+  UNLOCK(worker);
+
+  finish_jobs(finished);
+
+  return SELECT_OK;
+}
+
+worker_t *worker_create(select_group_t *group)
+{
+  worker_t *worker = (worker_t*) safe_malloc(sizeof(worker_t));
+#ifdef WIN32
+  static int next_pipe_id = -1000;
+#endif
+
+  worker->group = group;
+
+#ifdef WIN32
+  InitializeCriticalSection(&worker->lock);
+  worker->wakeup = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+  if(!select_group_create_pipe(&worker->pipe_read, &worker->pipe_write, NULL))
+    DIE("worker: couldn't create a pipe");
+
+  /* Any identifier works, as long as it's not a real socket. */
+  worker->pipe_id = next_pipe_id--;
+  select_group_add_pipe(group, worker->pipe_id, worker->pipe_read, worker);
+  select_set_recv(group, worker->pipe_id, worker_wakeup);
+
+  worker->thread = CreateThread(NULL, 0, worker_thread, worker, 0, NULL);
+  if(!worker->thread)
+    DIE("worker: couldn't create a thread");
+#else
+  pthread_mutex_init(&worker->lock, NULL);
+  pthread_cond_init(&worker->wakeup, NULL);
+
+  if(pipe(worker->pipe) == -1)
+    DIE("worker: couldn't create a pipe");
+
+  select_group_add_socket(group, worker->pipe[0], SOCKET_TYPE_STREAM, worker);
+  select_set_recv(group, worker->pipe[0], worker_wakeup);
+
+  if(pthread_create(&worker->thread, NULL, worker_thread, worker))
+    DIE("worker: couldn't create a thread");
+#endif
+
+  return worker;
+}
+
+void worker_post(worker_t *worker, worker_func_t *run, worker_func_t *done, void *param)
+{
+  worker_job_t *job = (worker_job_t*) safe_malloc(sizeof(worker_job_t));
+
+  job->run   = run;
+  job->done  = done;
+  job->param = param;
+  job->next  = NULL;
+
+  LOCK(worker);
+  if(worker->pending_last)
+    worker->pending_last->next = job;
+  else
+    worker->pending_first = job;
+  worker->pending_last = job;
+  signal_job(worker);
+  UNLOCK(worker);
+}
+
+void worker_destroy(worker_t *worker)
+{
+  LOCK(worker);
+  worker->is_stopping = TRUE;
+  signal_job(worker);
+  UNLOCK(worker);
+
+#ifdef WIN32
+  WaitForSingleObject(worker->thread, INFINITE);
+  CloseHandle(worker->thread);
+#else
+  pthread_join(worker->thread, NULL);
+#endif
+
+  /* The thread's gone, so no more locking. */
+  finish_jobs(worker->finished_first);
+  finish_jobs(worker->pending_first);
+
+#ifdef WIN32
+  select_group_remove_socket(worker->group, worker->pipe_id);
+  CloseHandle(worker->pipe_read);
+  CloseHandle(worker->pipe_write);
+  CloseHandle(worker->wakeup);
+  DeleteCriticalSection(&worker->lock);
+#else
+  select_group_remove_and_close_socket(worker->group, worker->pipe[0]);
+  close(worker->pipe[1]);
+  pthread_cond_destroy(&worker->wakeup);
+  pthread_mutex_destroy(&worker->lock);
+#endif
+
+  safe_free(worker);
+}
+
+#else
+
+worker_t *worker_create(select_group_t *group)
+{
+  worker_t *worker = (worker_t*) safe_malloc(sizeof(worker_t));
+
+  worker->group = group;
+
+  return worker;
+}
+
+void worker_post(worker_t *worker, worker_func_t *run, worker_func_t *done, void *param)
+{
+  run(param);
+  done(param);
+}
+
+void worker_destroy(worker_t *worker)
+{
+  safe_free(worker);
+}
+
+#endif
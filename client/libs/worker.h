@@ -0,0 +1,88 @@
+/* worker.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * A background thread for jobs that are too slow to run on the select loop,
+ * like generating keys. Each job is two functions: run() is called on the
+ * worker's thread, then done() is called back on the main thread, from inside
+ * select_group_do_select(). Only done() may touch anything the rest of the
+ * program uses; run() should stick to its param, and shouldn't allocate
+ * memory (the TESTMEMORY tracking isn't thread-safe).
+ *
+ * The worker wakes the main thread by writing to a pipe that's in the
+ * select_group, so a finished job gets its done() call as soon as the loop
+ * gets to it.
+ *
+ * Threads are only used if it's compiled with USE_THREADS ('make threaded').
+ * Otherwise, worker_post() just calls run() then done() right away.
+ */
+
+#ifndef __WORKER_H__
+#define __WORKER_H__
+
+#include <stdlib.h> /* For size_t */
+
+/* (This has to come before windows.h, for winsock2.h's sake.) */
+#include "select_group.h"
+#include "types.h"
+
+#ifdef USE_THREADS
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+typedef void(worker_func_t)(void *param);
+
+typedef struct _worker_job_t
+{
+  worker_func_t         *run;
+  worker_func_t         *done;
+  void                  *param;
+  struct _worker_job_t  *next;
+} worker_job_t;
+
+/* This struct shouldn't be accessed directly */
+typedef struct
+{
+  select_group_t   *group;
+
+#ifdef USE_THREADS
+  /* Both lists are protected by the lock. */
+  worker_job_t     *pending_first;
+  worker_job_t     *pending_last;
+  worker_job_t     *finished_first;
+  worker_job_t     *finished_last;
+  NBBOOL            is_stopping;
+
+#ifdef WIN32
+  HANDLE            thread;
+  CRITICAL_SECTION  lock;
+  HANDLE            wakeup;
+  HANDLE            pipe_read;
+  HANDLE            pipe_write;
+  int               pipe_id;
+#else
+  pthread_t         thread;
+  pthread_mutex_t   lock;
+  pthread_cond_t    wakeup;
+  int               pipe[2];
+#endif
+#endif
+} worker_t;
+
+worker_t *worker_create(select_group_t *group);
+
+/* Queue up a job. */
+void      worker_post(worker_t *worker, worker_func_t *run, worker_func_t *done, void *param);
+
+/* Waits for the job that's running (if any) to finish, then stops the
+ * thread. Every job that was posted still gets its done() called, whether
+ * or not it got to run. */
+void      worker_destroy(worker_t *worker);
+
+#endif
@@ -8,13 +8,23 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#endif
 
 #include "controller/controller.h"
+#include "controller/packet.h"
 #include "libs/buffer.h"
 #include "libs/dns.h"
 #include "libs/log.h"
 #include "libs/memory.h"
+#include "libs/tcp.h"
 #include "libs/types.h"
 #include "libs/udp.h"
 
@@ -24,14 +34,30 @@
 #define MAX_DNS_LENGTH   255
 #define WILDCARD_PREFIX  "dnscat"
 
-/* The max length is a little complicated:
- * 255 because that's the max DNS length
- * Halved, because we encode in hex
- * Minus the length of the domain, which is appended
- * Minus 1, for the period right before the domain
- * Minus the number of periods that could appear within the name
- */
-#define MAX_DNSCAT_LENGTH(domain) ((255/2) - (domain ? strlen(domain) : strlen(WILDCARD_PREFIX)) - 1 - ((MAX_DNS_LENGTH / MAX_FIELD_LENGTH) + 1))
+/* Each label of data holds at most this many characters. */
+#define MAX_LABEL_CHARS  (MAX_FIELD_LENGTH - 2)
+
+/* A query is a header, a name of up to MAX_DNS_LENGTH plus its null
+ * terminator, the type and class, then maybe an OPT record. */
+#define DNS_HEADER_SIZE    12
+#define DNS_OPT_SIZE       11
+#define DNS_QUERY_MAX_SIZE (DNS_HEADER_SIZE + MAX_DNS_LENGTH + 1 + 4 + DNS_OPT_SIZE)
+
+/* The biggest response UDP can carry without EDNS0, and how close to the
+ * limit a response has to be before we call it full. */
+#define DNS_UDP_SIZE       512
+#define DNS_FULL_SLACK     32
+
+/* How long (in ms) to wait before trying again when a TCP socket won't take
+ * any more data. */
+#define DNS_TCP_SEND_RETRY 10
+
+/* The most room the headers of a DoH request or response can take. */
+#define DNS_HTTP_MAX_HEADERS 1024
+
+/* Added to each server's round-trip time when weighing them up, so a server
+ * that hasn't answered yet (or answers instantly) doesn't get everything. */
+#define SERVER_RTT_BIAS 50
 
 #define HEXCHAR(c) ((c) < 10 ? ((c)+'0') : (((c)-10) + 'a'))
 
@@ -43,17 +69,70 @@ static SELECT_RESPONSE_t dns_data_closed(void *group, int socket, void *param)
   return SELECT_OK;
 }
 
-static uint8_t *remove_domain(char *str, char *domain)
+/* The ways data can be encoded in a name. Anything but hex starts with a
+ * tag label, which can't be mistaken for hex, so the server knows how to
+ * decode it (and answers CNAME and MX requests the same way, and TXT with
+ * raw bytes). */
+typedef struct
 {
-  if(domain)
+  char *name;
+  char *tag;
+  int   bits;
+  char *alphabet;
+  NBBOOL case_sensitive;
+} encoding_t;
+
+static encoding_t encodings[] =
+{
+  { "hex",    NULL,  4, "0123456789abcdef",                                                 FALSE },
+  { "base32", "x32", 5, "abcdefghijklmnopqrstuvwxyz234567",                                 FALSE },
+  { "base64", "x64", 6, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_", TRUE  },
+};
+#define ENCODING_COUNT (sizeof(encodings) / sizeof(encodings[0]))
+
+/* Every byte's two hex characters, and every character's value in each
+ * encoding (CHAR_INVALID if it isn't part of it); filled in the first time
+ * we need them. */
+#define CHAR_INVALID 0xFF
+static char    hex_table[256][2];
+static uint8_t decode_tables[ENCODING_COUNT][256];
+static NBBOOL  tables_ready = FALSE;
+
+static void init_tables()
+{
+  size_t e;
+  int    i;
+
+  for(i = 0; i < 256; i++)
   {
-    char *fixed = NULL;
+    hex_table[i][0] = HEXCHAR((i >> 4) & 0x0F);
+    hex_table[i][1] = HEXCHAR((i >> 0) & 0x0F);
+  }
 
-    if(!strstr(str, domain))
+  memset(decode_tables, CHAR_INVALID, sizeof(decode_tables));
+  for(e = 0; e < ENCODING_COUNT; e++)
+  {
+    for(i = 0; encodings[e].alphabet[i]; i++)
     {
-      LOG_ERROR("The response didn't contain the domain name: %s", str);
-      return NULL;
+      decode_tables[e][(uint8_t)encodings[e].alphabet[i]] = i;
+      if(!encodings[e].case_sensitive)
+        decode_tables[e][toupper((uint8_t)encodings[e].alphabet[i])] = i;
     }
+  }
+
+  tables_ready = TRUE;
+}
+
+#ifndef NO_NAME_TYPES
+/* Find the data part of a name returned by the server, without copying it:
+ * the part before ".<domain>", or after the wildcard prefix. */
+static char *remove_domain(char *str, char *domain, size_t *length)
+{
+  size_t str_length = strlen(str);
+
+  if(domain)
+  {
+    size_t domain_length = strlen(domain);
 
     /* The server returns an empty domain name for all errors. */
     if(!strcmp(str, domain))
@@ -62,181 +141,1170 @@ static uint8_t *remove_domain(char *str, char *domain)
       return NULL;
     }
 
-    fixed = safe_strdup(str);
-    fixed[strlen(str) - strlen(domain) - 1] = '\0';
+    if(str_length <= domain_length || strcmp(str + str_length - domain_length, domain) || str[str_length - domain_length - 1] != '.')
+    {
+      LOG_ERROR("The response didn't contain the domain name: %s", str);
+      return NULL;
+    }
 
-    return (uint8_t*)fixed;
+    *length = str_length - domain_length - 1;
+    return str;
   }
   else
   {
-    return (uint8_t*)safe_strdup(str += strlen(WILDCARD_PREFIX));
+    if(strncmp(str, WILDCARD_PREFIX, strlen(WILDCARD_PREFIX)))
+    {
+      LOG_ERROR("The response didn't start with the wildcard prefix: %s", str);
+      return NULL;
+    }
+
+    *length = str_length - strlen(WILDCARD_PREFIX);
+    return str + strlen(WILDCARD_PREFIX);
   }
 }
+#endif
 
-static uint8_t *buffer_decode_hex(uint8_t *str, size_t *length)
+/* Decode length characters from str into out, skipping periods. out needs
+ * room for length * bits / 8 bytes (it can be str itself). Returns FALSE if
+ * str isn't properly encoded. */
+static NBBOOL decode_name(driver_dns_t *driver, uint8_t *str, size_t length, uint8_t *out, size_t *out_length)
 {
-  size_t    i   = 0;
-  buffer_t *out = buffer_create(BO_BIG_ENDIAN);
+  uint8_t *table = decode_tables[driver->encoding];
+  int      bits  = encodings[driver->encoding].bits;
+  size_t   i;
+  size_t   o          = 0;
+  uint32_t value      = 0;
+  int      value_bits = 0;
+  uint8_t  c;
 
-  while(i < *length)
+  for(i = 0; i < length; i++)
   {
-    uint8_t c1 = 0;
-    uint8_t c2 = 0;
+    c = table[str[i]];
 
-    /* Read the first character, ignoring periods */
-    do
+    if(c == CHAR_INVALID)
     {
-      c1 = toupper(str[i++]);
-    } while(c1 == '.' && i < *length);
+      if(str[i] == '.')
+        continue;
+
+      LOG_ERROR("Couldn't decode the name (contains non-%s characters): %.*s", encodings[driver->encoding].name, (int)length, str);
+      return FALSE;
+    }
 
-    /* Make sure we aren't at the end of the buffer. */
-    if(i >= *length)
+    value = (value << bits) | c;
+    value_bits += bits;
+    if(value_bits >= 8)
     {
-      LOG_ERROR("Couldn't hex-decode the name (name was an odd length): %s", str);
-      return NULL;
+      value_bits -= 8;
+      out[o++] = (value >> value_bits) & 0xFF;
     }
+  }
 
-    /* Make sure we got a hex digit */
-    if(!isxdigit(c1))
+  /* Whatever's left over is padding, but a whole extra character is wrong. */
+  if(value_bits >= bits)
+  {
+    LOG_ERROR("Couldn't decode the name (name was an invalid length): %.*s", (int)length, str);
+    return FALSE;
+  }
+
+  *out_length = o;
+  return TRUE;
+}
+
+/* A and AAAA answers carry the data 3 (or 15) bytes to a record, after a
+ * sequence number (resolvers are free to shuffle the records, and the first
+ * number is random); the first record's data starts with the length. Each
+ * piece is copied straight to its place in out, going by its sequence
+ * number. */
+#ifndef NO_ADDRESS_TYPES
+NBBOOL driver_dns_decode_addresses(dns_t *dns, uint8_t *out, size_t max_length, size_t *out_length)
+{
+  dns_type_t type  = dns->answers[0].type;
+  size_t     piece = (type == _DNS_TYPE_A) ? 3 : 15;
+  NBBOOL     seen[256];
+  uint8_t    first = 0xFF;
+  uint8_t    last  = 0;
+  size_t     i;
+
+  memset(seen, 0, sizeof(seen));
+
+  /* Find where the numbers start, and make sure there's one of each. */
+  for(i = 0; i < dns->answer_count; i++)
+  {
+    uint8_t sequence;
+
+    if(dns->answers[i].type != type)
+      return FALSE;
+
+#ifndef WIN32
+    sequence = (type == _DNS_TYPE_A) ? dns->answers[i].answer->A.bytes[0] : dns->answers[i].answer->AAAA.bytes[0];
+#else
+    sequence = dns->answers[i].answer->A.bytes[0];
+#endif
+    if(seen[sequence])
+      return FALSE;
+
+    seen[sequence] = TRUE;
+    first = MIN(first, sequence);
+    last  = MAX(last, sequence);
+  }
+
+  if((size_t)(last - first) + 1 != dns->answer_count)
+    return FALSE;
+
+  for(i = 0; i < dns->answer_count; i++)
+  {
+    uint8_t *data;
+    size_t   start;
+    size_t   length = piece;
+
+#ifndef WIN32
+    data = ((type == _DNS_TYPE_A) ? dns->answers[i].answer->A.bytes : dns->answers[i].answer->AAAA.bytes);
+#else
+    data = dns->answers[i].answer->A.bytes;
+#endif
+    start = (data[0] - first) * piece;
+    data++;
+
+    /* The first byte of it all is the length, which isn't part of out. */
+    if(start == 0)
     {
-      LOG_ERROR("Couldn't hex-decode the name (contains non-hex characters): %s", str);
-      return NULL;
+      *out_length = *data;
+      data++;
+      length--;
+    }
+    else
+    {
+      start--;
     }
 
-    /* Read the second character. */
-    do
+    /* (Anything past max_length is padding.) */
+    if(start < max_length)
+      memcpy(out + start, data, MIN(length, max_length - start));
+  }
+
+  return *out_length <= (dns->answer_count * piece) - 1 && *out_length <= max_length;
+}
+#endif
+
+static dns_type_t get_type(driver_dns_t *driver)
+{
+  return driver->types[rand() % driver->type_count];
+}
+
+/* A query through this server was answered after rtt ms. */
+static void server_answered(dns_server_t *server, int rtt)
+{
+  server->srtt     = server->srtt ? (server->srtt * 7 + rtt) / 8 : MAX(rtt, 1);
+  server->loss    -= server->loss / 8;
+  server->failures = 0;
+}
+
+/* A query through this server went unanswered; after a few in a row, it's
+ * left out for a while (and once it's back, it only gets one chance till it
+ * answers something). */
+static void server_missed(driver_dns_t *driver, dns_server_t *server)
+{
+  server->loss += (256 - server->loss) / 8;
+
+  if(++server->failures >= DNS_SERVER_MAX_FAILURES && driver->server_count > 1)
+  {
+    LOG_WARNING("DNS server %s isn't answering, leaving it out for %dms", server->name, DNS_SERVER_DOWN_TIME);
+    server->down_until = select_group_time_ms() + DNS_SERVER_DOWN_TIME;
+  }
+}
+
+/* Free up a query's slot, and remember its id for a while (see
+ * DNS_RECENT_TRN_IDS). */
+static void release_slot(driver_dns_t *driver, dns_pending_t *slot)
+{
+  slot->in_use = FALSE;
+  slot->probe  = NULL;
+
+  driver->recent_trn_ids[driver->next_recent_trn_id] = slot->trn_id;
+  driver->next_recent_trn_id = (driver->next_recent_trn_id + 1) % DNS_RECENT_TRN_IDS;
+  if(driver->recent_trn_id_count < DNS_RECENT_TRN_IDS)
+    driver->recent_trn_id_count++;
+}
+
+static NBBOOL is_recent_trn_id(driver_dns_t *driver, uint16_t trn_id)
+{
+  size_t i;
+
+  for(i = 0; i < driver->recent_trn_id_count; i++)
+    if(driver->recent_trn_ids[i] == trn_id)
+      return TRUE;
+
+  return FALSE;
+}
+
+/* Drop our TCP connection to the server; if it failed, the server gets UDP
+ * for a while (or, with DoT or DoH, nothing). Whatever was waiting on it is
+ * given up on (the sessions will re-send whatever they need to). */
+static void tcp_disconnect(driver_dns_t *driver, dns_server_t *server, NBBOOL failed)
+{
+  size_t i;
+
+  if(server->tcp_s != -1)
+  {
+    select_group_remove_and_close_socket(driver->group, server->tcp_s);
+    server->tcp_s = -1;
+  }
+  server->tcp_connected = FALSE;
+
+#ifdef USE_TLS
+  if(server->tls)
+  {
+    tls_destroy(server->tls);
+    server->tls = NULL;
+  }
+#endif
+
+  buffer_clear(server->tcp_incoming);
+  ring_buffer_consume(server->tcp_outgoing, ring_buffer_get_length(server->tcp_outgoing));
+
+  for(i = 0; i < driver->pipeline; i++)
+    if(driver->pending[i].in_use && driver->pending[i].via_tcp && driver->pending[i].server == server)
+      release_slot(driver, &driver->pending[i]);
+
+  if(failed && driver->secure != DNS_SECURE_NONE)
+  {
+    LOG_WARNING("Couldn't connect securely to DNS server %s, trying again in %dms", server->name, DNS_SECURE_RETRY_TIME);
+    server->tcp_retry_at = select_group_time_ms() + DNS_SECURE_RETRY_TIME;
+    driver->stats.tcp_failures++;
+  }
+  else if(failed)
+  {
+    LOG_WARNING("Couldn't use TCP with DNS server %s, using UDP for %dms", server->name, DNS_TCP_RETRY_TIME);
+    server->tcp_retry_at = select_group_time_ms() + DNS_TCP_RETRY_TIME;
+    driver->stats.tcp_failures++;
+  }
+}
+
+/* TRUE once the connection to the server can carry queries (for DoT and
+ * DoH, that's once the handshake is done). */
+static NBBOOL tcp_is_up(dns_server_t *server)
+{
+  if(!server->tcp_connected)
+    return FALSE;
+
+#ifdef USE_TLS
+  if(server->tls && !tls_is_connected(server->tls))
+    return FALSE;
+#endif
+
+  return TRUE;
+}
+
+/* Give the server's TCP socket as much of our queries as it'll take. */
+static void tcp_flush(driver_dns_t *driver, dns_server_t *server)
+{
+  uint8_t *data;
+  size_t   length;
+  ssize_t  sent;
+
+  while(server->tcp_connected && ring_buffer_get_length(server->tcp_outgoing) > 0)
+  {
+    length = ring_buffer_peek(server->tcp_outgoing, 0, &data);
+    sent   = tcp_send(server->tcp_s, data, length);
+
+    if(sent < 0)
     {
-      c2 = toupper(str[i++]);
-    } while(c2 == '.' && i < *length);
+#ifdef WIN32
+      if(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+        return;
 
-    /* Make sure we got a hex digit */
-    if(!isxdigit(c2))
+      tcp_disconnect(driver, server, TRUE);
+      return;
+    }
+
+    ring_buffer_consume(server->tcp_outgoing, sent);
+  }
+}
+
+/* Queue a message to the server (through TLS, for DoT and DoH), and send
+ * what we can of it. */
+static void tcp_queue(driver_dns_t *driver, dns_server_t *server, uint8_t *data, size_t length)
+{
+#ifdef USE_TLS
+  if(server->tls)
+  {
+    if(!tls_write(server->tls, data, length))
     {
-      LOG_ERROR("Couldn't hex-decode the name (contains non-hex characters): %s", str);
-      return NULL;
+      tcp_disconnect(driver, server, TRUE);
+      return;
     }
+    tls_get_outgoing(server->tls, server->tcp_outgoing);
+  }
+  else
+#endif
+  ring_buffer_add_bytes(server->tcp_outgoing, data, length);
 
-    c1 = ((c1 < 'A') ? (c1 - '0') : (c1 - 'A' + 10));
-    c2 = ((c2 < 'A') ? (c2 - '0') : (c2 - 'A' + 10));
+  tcp_flush(driver, server);
+}
 
-    buffer_add_int8(out, (c1 << 4) | c2);
+/* Give up on queries that have been waiting too long (the query or the
+ * response was probably dropped), then return a free slot, if any. */
+static dns_pending_t *get_free_slot(driver_dns_t *driver)
+{
+  size_t         i;
+  uint64_t       now  = select_group_time_ms();
+  dns_pending_t *free_slot = NULL;
+
+  for(i = 0; i < driver->pipeline; i++)
+  {
+    if(driver->pending[i].in_use && now - driver->pending[i].sent_time > DNS_QUERY_TIMEOUT)
+    {
+      LOG_INFO("DNS query 0x%04x (through %s) timed out", driver->pending[i].trn_id, driver->pending[i].server->name);
+      release_slot(driver, &driver->pending[i]);
+      driver->stats.timeouts++;
+      server_missed(driver, driver->pending[i].server);
+
+      /* If it was waiting on a TCP connection (or a handshake) that never
+       * came up, that's not going to work either. */
+      if(driver->pending[i].via_tcp && driver->pending[i].server->tcp_s != -1 && !tcp_is_up(driver->pending[i].server))
+        tcp_disconnect(driver, driver->pending[i].server, TRUE);
+    }
+
+    if(!free_slot && !driver->pending[i].in_use)
+      free_slot = &driver->pending[i];
   }
 
-  return buffer_create_string_and_destroy(out, length);
+  return free_slot;
 }
 
-static int cmpfunc_a(const void *a, const void *b)
+static dns_pending_t *find_pending(driver_dns_t *driver, uint16_t trn_id)
 {
-  return ((const answer_t*)a)->answer->A.bytes[0] - ((const answer_t*)b)->answer->A.bytes[0];
+  size_t i;
+
+  for(i = 0; i < driver->pipeline; i++)
+    if(driver->pending[i].in_use && driver->pending[i].trn_id == trn_id)
+      return &driver->pending[i];
+
+  return NULL;
 }
 
-#ifndef WIN32
-static int cmpfunc_aaaa(const void *a, const void *b)
+/* Make sure we have an address for the DNS server, looking it up if it's
+ * never been resolved, it's old, or the last send failed. */
+static NBBOOL get_server_addr(driver_dns_t *driver, dns_server_t *server)
+{
+  uint64_t   now = select_group_time_ms();
+  udp_addr_t addr;
+
+  if(server->addr_valid && now - server->addr_time < DNS_SERVER_ADDR_TTL)
+    return TRUE;
+
+  /* Don't hammer the resolver if the lookup keeps failing. */
+  if(!server->addr_valid && server->addr_time && now - server->addr_time < DNS_SERVER_ADDR_RETRY)
+    return FALSE;
+
+  if(udp_resolve(server->name, driver->dns_port, AF_INET, &addr))
+  {
+    server->addr       = addr;
+    server->addr_valid = TRUE;
+    server->addr_time  = now;
+
+    return TRUE;
+  }
+
+  LOG_ERROR("Couldn't resolve the DNS server: %s", server->name);
+
+  /* If the address we have is just old, keep using it, and look it up again
+   * in DNS_SERVER_ADDR_RETRY ms. */
+  if(server->addr_valid)
+  {
+    server->addr_time = now - DNS_SERVER_ADDR_TTL + DNS_SERVER_ADDR_RETRY;
+    return TRUE;
+  }
+
+  server->addr_time = now;
+
+  return FALSE;
+}
+
+/* Pick the server for the next query: at random, but weighted towards the
+ * ones that have been answering quickly and reliably. Servers that have been
+ * left out are skipped, unless that's all of them. Returns NULL if none of
+ * them have an address right now. */
+static dns_server_t *pick_server(driver_dns_t *driver)
+{
+  uint64_t now = select_group_time_ms();
+  uint32_t weights[DNS_MAX_SERVERS];
+  uint32_t total = 0;
+  uint32_t choice;
+  NBBOOL   all_down = TRUE;
+  size_t   i;
+
+  for(i = 0; i < driver->server_count; i++)
+    if(driver->servers[i].down_until <= now)
+      all_down = FALSE;
+
+  for(i = 0; i < driver->server_count; i++)
+  {
+    dns_server_t *server = &driver->servers[i];
+
+    /* With DoT or DoH, a server we can't connect to can't be used at all. */
+    weights[i] = 0;
+    if(driver->secure != DNS_SECURE_NONE && server->tcp_retry_at > now)
+      continue;
+
+    if((all_down || server->down_until <= now) && get_server_addr(driver, server))
+      weights[i] = ((256 - server->loss) * 1024) / (server->srtt + SERVER_RTT_BIAS);
+    total += weights[i];
+  }
+
+  if(total == 0)
+    return NULL;
+
+  choice = rand() % total;
+  for(i = 0; choice >= weights[i]; i++)
+    choice -= weights[i];
+
+  return &driver->servers[i];
+}
+
+/* Pick a transaction id that isn't already in flight, or recently done
+ * with. */
+static uint16_t get_trn_id(driver_dns_t *driver)
+{
+  uint16_t trn_id;
+
+  do
+  {
+    trn_id = rand() & 0xFFFF;
+  } while(find_pending(driver, trn_id) || is_recent_trn_id(driver, trn_id));
+
+  return trn_id;
+}
+
+/* Convert a name like "example.com" to the label format used on the wire
+ * (without the terminating null byte), so it's only done once. */
+static size_t encode_labels(char *name, uint8_t *out, size_t max_length)
+{
+  size_t length = 0;
+  char  *label  = name;
+  char  *end;
+  size_t label_length;
+
+  while(*label)
+  {
+    end = strchr(label, '.');
+    label_length = end ? (size_t)(end - label) : strlen(label);
+
+    if(label_length > 0)
+    {
+      if(label_length > MAX_FIELD_LENGTH || length + label_length + 1 > max_length)
+      {
+        LOG_FATAL("The domain name is too long: %s", name);
+        exit(1);
+      }
+
+      out[length++] = (uint8_t)label_length;
+      memcpy(out + length, label, label_length);
+      length += label_length;
+    }
+
+    if(!end)
+      break;
+    label = end + 1;
+  }
+
+  return length;
+}
+
+/* Encode length bytes of data into out, which needs room for
+ * length * 8 / bits characters (rounded up). Returns the number written. */
+static size_t encode_data(driver_dns_t *driver, uint8_t *data, size_t length, char *out)
 {
-  return ((const answer_t*)a)->answer->AAAA.bytes[0] - ((const answer_t*)b)->answer->AAAA.bytes[0];
+  char    *alphabet   = encodings[driver->encoding].alphabet;
+  int      bits       = encodings[driver->encoding].bits;
+  uint32_t mask       = (1 << bits) - 1;
+  uint32_t value      = 0;
+  int      value_bits = 0;
+  size_t   o          = 0;
+  size_t   i;
+
+  /* Hex is the common case, so it gets the lookup table. */
+  if(driver->encoding == DNS_ENCODING_HEX)
+  {
+    for(i = 0; i < length; i++)
+    {
+      out[o++] = hex_table[data[i]][0];
+      out[o++] = hex_table[data[i]][1];
+    }
+
+    return o;
+  }
+
+  for(i = 0; i < length; i++)
+  {
+    value = (value << 8) | data[i];
+    value_bits += 8;
+
+    while(value_bits >= bits)
+    {
+      value_bits -= bits;
+      out[o++] = alphabet[(value >> value_bits) & mask];
+    }
+  }
+
+  /* Pad out the last character with zeroes. */
+  if(value_bits > 0)
+    out[o++] = alphabet[(value << (bits - value_bits)) & mask];
+
+  return o;
 }
+
+/* The most data that fits in a single query for the given domain. The name
+ * can be MAX_DNS_LENGTH bytes on the wire, including the null terminator,
+ * the domain (or the wildcard prefix), the tag and a length byte for each
+ * label. */
+static size_t get_max_length(driver_dns_t *driver, dns_domain_t *domain)
+{
+  size_t room = MAX_DNS_LENGTH - 1;
+  size_t chars;
+
+  if(domain->name)
+    room -= domain->labels_length;
+  else
+    room -= 1 + strlen(WILDCARD_PREFIX);
+
+  if(encodings[driver->encoding].tag)
+    room -= 1 + strlen(encodings[driver->encoding].tag);
+
+  /* Take the length bytes off for each label. */
+  chars = (room / (MAX_LABEL_CHARS + 1)) * MAX_LABEL_CHARS;
+  if(room % (MAX_LABEL_CHARS + 1) > 1)
+    chars += (room % (MAX_LABEL_CHARS + 1)) - 1;
+
+  return (chars * encodings[driver->encoding].bits) / 8;
+}
+
+/* Build a query for the given data and domain straight into packet, which
+ * must hold DNS_QUERY_MAX_SIZE bytes. Returns the length of the packet. */
+static size_t build_query(driver_dns_t *driver, dns_domain_t *domain, uint16_t trn_id, dns_type_t type, uint8_t *data, size_t length, uint8_t *packet)
+{
+  uint8_t *p = packet;
+  char    *tag = encodings[driver->encoding].tag;
+  char     encoded[MAX_DNS_LENGTH];
+  size_t   encoded_length;
+  size_t   i;
+  size_t   chunk;
+  uint16_t flags = _DNS_OPCODE_QUERY | _DNS_FLAG_RD | _DNS_RCODE_SUCCESS;
+
+  /* The header: one question and nothing else. */
+  *p++ = (trn_id >> 8) & 0xFF;
+  *p++ = (trn_id >> 0) & 0xFF;
+  *p++ = (flags >> 8) & 0xFF;
+  *p++ = (flags >> 0) & 0xFF;
+  *p++ = 0; *p++ = 1; /* Questions. */
+  *p++ = 0; *p++ = 0; /* Answers. */
+  *p++ = 0; *p++ = 0; /* Authorities. */
+  *p++ = 0; *p++ = driver->edns_size ? 1 : 0; /* Additionals. */
+
+  /* If no domain is set, add the wildcard prefix at the start. */
+  if(!domain->name)
+  {
+    *p++ = (uint8_t)strlen(WILDCARD_PREFIX);
+    memcpy(p, WILDCARD_PREFIX, strlen(WILDCARD_PREFIX));
+    p += strlen(WILDCARD_PREFIX);
+  }
+
+  /* The encoding's tag, if it has one. */
+  if(tag)
+  {
+    *p++ = (uint8_t)strlen(tag);
+    memcpy(p, tag, strlen(tag));
+    p += strlen(tag);
+  }
+
+  /* The data, encoded, as labels of up to MAX_LABEL_CHARS characters. */
+  encoded_length = encode_data(driver, data, length, encoded);
+  for(i = 0; i < encoded_length; i += chunk)
+  {
+    chunk = MIN(encoded_length - i, MAX_LABEL_CHARS);
+
+    *p++ = (uint8_t)chunk;
+    memcpy(p, encoded + i, chunk);
+    p += chunk;
+  }
+
+  /* The domain, if there is one, already in label form. */
+  memcpy(p, domain->labels, domain->labels_length);
+  p += domain->labels_length;
+  *p++ = 0;
+
+  /* Double-check we didn't mess up the length. */
+  assert((size_t)(p - packet) - DNS_HEADER_SIZE <= MAX_DNS_LENGTH);
+
+  *p++ = (type >> 8) & 0xFF;
+  *p++ = (type >> 0) & 0xFF;
+  *p++ = (_DNS_CLASS_IN >> 8) & 0xFF;
+  *p++ = (_DNS_CLASS_IN >> 0) & 0xFF;
+
+  /* An EDNS0 OPT record, so the server (and any resolvers along the way)
+   * can send back more than 512 bytes: a root name, the type, our UDP
+   * payload size in place of the class, then a zero ttl and length. */
+  if(driver->edns_size)
+  {
+    *p++ = 0;
+    *p++ = (_DNS_TYPE_OPT >> 8) & 0xFF;
+    *p++ = (_DNS_TYPE_OPT >> 0) & 0xFF;
+    *p++ = (driver->edns_size >> 8) & 0xFF;
+    *p++ = (driver->edns_size >> 0) & 0xFF;
+    memset(p, 0, 6);
+    p += 6;
+  }
+
+  return p - packet;
+}
+
+/* Find the server a TCP socket belongs to. */
+static dns_server_t *find_tcp_server(driver_dns_t *driver, int s)
+{
+  size_t i;
+
+  for(i = 0; i < driver->server_count; i++)
+    if(driver->servers[i].tcp_s == s)
+      return &driver->servers[i];
+
+  return NULL;
+}
+
+/* (Below, with the UDP callback; TCP responses are handled the same way.) */
+static NBBOOL handle_response(driver_dns_t *driver, uint8_t *data, size_t length, NBBOOL via_tcp);
+
+static SELECT_RESPONSE_t tcp_ready(void *group, int s, void *param)
+{
+  driver_dns_t *driver = (driver_dns_t*) param;
+  dns_server_t *server = find_tcp_server(driver, s);
+
+  LOG_INFO("Connected to DNS server %s over TCP", server->name);
+  server->tcp_connected = TRUE;
+
+#ifdef USE_TLS
+  /* Start the handshake. */
+  if(server->tls)
+    tls_get_outgoing(server->tls, server->tcp_outgoing);
 #endif
 
-static dns_type_t get_type(driver_dns_t *driver)
+  tcp_flush(driver, server);
+
+  return SELECT_OK;
+}
+
+#ifdef USE_TLS
+/* Find name in the HTTP headers (which are case-insensitive), and return its
+ * value (which ends at the next "\r\n"), or NULL. */
+static char *find_http_header(char *headers, size_t length, char *name)
 {
-  return driver->types[rand() % driver->type_count];
+  size_t name_length = strlen(name);
+  size_t i;
+  size_t j;
+
+  for(i = 0; i + name_length + 3 <= length; i++)
+  {
+    if(headers[i] != '\n')
+      continue;
+
+    for(j = 0; j < name_length && tolower((unsigned char)headers[i + 1 + j]) == name[j]; j++)
+      ;
+    if(j == name_length && headers[i + 1 + j] == ':')
+      return &headers[i + 2 + j];
+  }
+
+  return NULL;
 }
 
-static void do_send(driver_dns_t *driver)
+/* Take the next HTTP response (to a DoH query) out of incoming, if it's all
+ * there, pointing body at the DNS message it carries (or at NULL, if the
+ * server turned the query down). Returns FALSE if there isn't a whole one
+ * yet; sets *bad if there never will be, because it doesn't make sense (we
+ * don't support the chunked encoding, say). */
+static NBBOOL read_http_response(buffer_t *incoming, uint8_t **body, size_t *body_length, NBBOOL *bad)
 {
-  size_t        i;
-  dns_t        *dns;
-  buffer_t     *buffer;
-  uint8_t      *encoded_bytes;
-  size_t        encoded_length;
-  uint8_t      *dns_bytes;
-  size_t        dns_length;
-  size_t        section_length;
+  size_t   length;
+  char    *response = (char*) buffer_read_remaining_bytes_view(incoming, &length, -1, FALSE);
+  char    *content_length;
+  size_t   header_length;
+  char     status_line[32];
+  int      status = 0;
+
+  for(header_length = 0; header_length + 4 <= length; header_length++)
+    if(!memcmp(&response[header_length], "\r\n\r\n", 4))
+      break;
+
+  if(header_length + 4 > length)
+  {
+    /* The headers can't be that big. */
+    *bad = length > DNS_HTTP_MAX_HEADERS;
+    return FALSE;
+  }
+  header_length += 4;
+
+  /* (The response isn't NUL-terminated.) */
+  memcpy(status_line, response, MIN(header_length, sizeof(status_line) - 1));
+  status_line[MIN(header_length, sizeof(status_line) - 1)] = '\0';
+
+  content_length = find_http_header(response, header_length, "content-length");
+  if(sscanf(status_line, "HTTP/1.%*d %d", &status) != 1 || !content_length)
+  {
+    LOG_ERROR("The DoH server sent a response we don't understand");
+    *bad = TRUE;
+    return FALSE;
+  }
+
+  *body_length = strtoul(content_length, NULL, 10);
+  if(length < header_length + *body_length)
+    return FALSE;
+
+  buffer_read_remaining_bytes_view(incoming, &length, header_length, TRUE);
+  *body = buffer_read_remaining_bytes_view(incoming, body_length, *body_length, TRUE);
+
+  if(status != 200)
+  {
+    LOG_ERROR("The DoH server turned down a query (HTTP status %d)", status);
+    *body = NULL;
+  }
+
+  return TRUE;
+}
+#endif
+
+static SELECT_RESPONSE_t tcp_data_in(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
+{
+  driver_dns_t *driver = (driver_dns_t*) param;
+  dns_server_t *server = find_tcp_server(driver, s);
+  size_t        response_length;
+  uint8_t      *response;
+
+#ifdef USE_TLS
+  NBBOOL        bad = FALSE;
+
+  /* For DoT and DoH, decrypt it (and send whatever the handshake wants). */
+  if(server->tls)
+  {
+    if(!tls_read(server->tls, data, length, server->tcp_incoming))
+    {
+      tcp_disconnect(driver, server, !tls_is_connected(server->tls));
+      return SELECT_OK;
+    }
+    tls_get_outgoing(server->tls, server->tcp_outgoing);
+    tcp_flush(driver, server);
+  }
+  else
+#endif
+  buffer_add_bytes(server->tcp_incoming, data, length);
+
+#ifdef USE_TLS
+  /* DoH responses are HTTP, which gives their lengths its own way. */
+  if(driver->secure == DNS_SECURE_DOH)
+  {
+    while(server->tcp_s != -1 && read_http_response(server->tcp_incoming, &response, &response_length, &bad))
+      if(response)
+        handle_response(driver, response, response_length, TRUE);
+
+    if(bad)
+    {
+      tcp_disconnect(driver, server, TRUE);
+      return SELECT_OK;
+    }
+  }
+#endif
+
+  /* Handle every whole response we have (the main loop does the sending). */
+  while(driver->secure != DNS_SECURE_DOH && server->tcp_s != -1 && buffer_get_remaining_bytes(server->tcp_incoming) >= 2)
+  {
+    response_length = buffer_peek_next_int16(server->tcp_incoming);
+    if(buffer_get_remaining_bytes(server->tcp_incoming) < response_length + 2)
+      break;
+
+    buffer_read_next_int16(server->tcp_incoming);
+    response = buffer_read_remaining_bytes_view(server->tcp_incoming, &response_length, response_length, TRUE);
+    handle_response(driver, response, response_length, TRUE);
+  }
+
+  /* Keep only the partial response (if any), or the buffer grows as long as
+   * the connection stays up. */
+  buffer_compact(server->tcp_incoming);
+
+  return SELECT_OK;
+}
+
+static SELECT_RESPONSE_t tcp_closed(void *group, int s, void *param)
+{
+  driver_dns_t *driver = (driver_dns_t*) param;
+  dns_server_t *server = find_tcp_server(driver, s);
+
+  /* Servers close idle connections; we'll just make another. The socket's
+   * being taken care of. */
+  LOG_INFO("DNS server %s closed our TCP connection", server->name);
+  tcp_close(server->tcp_s);
+  server->tcp_s = -1;
+  tcp_disconnect(driver, server, FALSE);
+
+  return SELECT_REMOVE;
+}
+
+static SELECT_RESPONSE_t tcp_error(void *group, int s, int err, void *param)
+{
+  driver_dns_t *driver = (driver_dns_t*) param;
+  dns_server_t *server = find_tcp_server(driver, s);
+
+  LOG_ERROR("TCP connection to DNS server %s failed (error %d)", server->name, err);
+  tcp_close(server->tcp_s);
+  server->tcp_s = -1;
+  tcp_disconnect(driver, server, TRUE);
+
+  return SELECT_REMOVE;
+}
+
+/* Whether the next query through this server should go over TCP; makes the
+ * connection, if it has to. */
+static NBBOOL want_tcp(driver_dns_t *driver, dns_server_t *server)
+{
+  if(driver->secure == DNS_SECURE_NONE && (driver->tcp_mode == DNS_TCP_OFF || (driver->tcp_mode == DNS_TCP_AUTO && !driver->use_tcp)))
+    return FALSE;
+
+  if(server->tcp_retry_at > select_group_time_ms())
+    return FALSE;
+
+  if(server->tcp_s == -1)
+  {
+    LOG_INFO("Connecting to DNS server %s:%d over TCP", server->name, driver->dns_port);
+    server->tcp_s = tcp_connect_options(server->name, driver->dns_port, TRUE);
+    if(server->tcp_s == -1)
+    {
+      tcp_disconnect(driver, server, TRUE);
+      return FALSE;
+    }
+
+    /* The queries are small and each waits on its answer. */
+    tcp_set_nodelay(server->tcp_s);
+
+    select_group_add_socket(driver->group, server->tcp_s, SOCKET_TYPE_STREAM, driver);
+    select_set_recv(driver->group, server->tcp_s, tcp_data_in);
+    select_set_ready(driver->group, server->tcp_s, tcp_ready);
+    select_set_closed(driver->group, server->tcp_s, tcp_closed);
+    select_set_error(driver->group, server->tcp_s, tcp_error);
+
+#ifdef USE_TLS
+    if(driver->secure != DNS_SECURE_NONE)
+      server->tls = tls_create(server->name, driver->verify);
+#endif
+  }
+
+  return TRUE;
+}
+
+/* Send a single query through the given server using the given slot;
+ * returns FALSE if the controller didn't have anything to send. */
+/* Send a query with the given data through server (over TCP, or with this
+ * round's UDP queries), and fill in the slot for it. */
+static void send_data(driver_dns_t *driver, dns_pending_t *slot, dns_server_t *server, dns_domain_t *domain, dns_type_t type, uint8_t *data, size_t length, NBBOOL via_tcp)
+{
+  uint8_t   packet[DNS_QUERY_MAX_SIZE];
+  size_t    packet_length;
+  uint16_t  trn_id;
+  uint8_t   message[DNS_HTTP_MAX_HEADERS + DNS_QUERY_MAX_SIZE];
+  size_t    header_length;
+
+  assert(driver->s != -1); /* Make sure we have a valid socket. */
+  assert(length > 0); /* Make sure they aren't trying to send 0 bytes. */
+  assert(length <= domain->max_length);
+
+  trn_id = get_trn_id(driver);
+  packet_length = build_query(driver, domain, trn_id, type, data, length, packet);
+
+  LOG_INFO("Sending DNS query with %zu bytes of data to %s:%d%s (0x%04x)", length, server->name, driver->dns_port, via_tcp ? " over TCP" : "", trn_id);
+  if(via_tcp)
+  {
+    if(driver->secure == DNS_SECURE_DOH)
+    {
+      /* For DoH, each message is POSTed (HTTP/1.1 keeps the connection
+       * open, and lets the requests be pipelined). */
+      sprintf((char*)message, "POST %.256s HTTP/1.1\r\nHost: %.256s\r\nContent-Type: application/dns-message\r\nAccept: application/dns-message\r\nContent-Length: %u\r\n\r\n", driver->doh_path, server->name, (unsigned int)packet_length);
+      header_length = strlen((char*)message);
+    }
+    else
+    {
+      /* Over TCP (and DoT), each message is prefixed with its length. */
+      message[0] = (uint8_t)(packet_length >> 8);
+      message[1] = (uint8_t)(packet_length & 0xFF);
+      header_length = 2;
+    }
+
+    memcpy(message + header_length, packet, packet_length);
+    tcp_queue(driver, server, message, header_length + packet_length);
+
+    driver->stats.tcp_queries++;
+  }
+  else
+  {
+    /* It goes out with the rest of this round's (see udp_flush()). */
+    udp_datagram_t *datagram = &driver->udp_batch[driver->udp_batch_count];
+
+    memcpy(datagram->data, packet, packet_length);
+    datagram->addr   = &server->addr;
+    datagram->length = packet_length;
+    driver->udp_batch_servers[driver->udp_batch_count++] = server;
+  }
+
+  driver->stats.queries_sent++;
+
+  slot->in_use    = TRUE;
+  slot->trn_id    = trn_id;
+  slot->sent_time = select_group_time_ms();
+  slot->server    = server;
+  slot->domain    = domain;
+  slot->via_tcp   = via_tcp;
+  slot->probe     = NULL;
+}
+
+static NBBOOL send_query(driver_dns_t *driver, dns_pending_t *slot, dns_server_t *server)
+{
+  NBBOOL    via_tcp;
+
+  /* Take turns with the domains. */
+  dns_domain_t *domain = &driver->domains[driver->next_domain];
 
   size_t length;
-  uint8_t *data = controller_get_outgoing((size_t*)&length, (size_t)MAX_DNSCAT_LENGTH(driver->domain));
+  uint8_t *data;
+
+  /* DoT and DoH queries can't go anywhere else. */
+  via_tcp = want_tcp(driver, server);
+  if(driver->secure != DNS_SECURE_NONE && !via_tcp)
+    return FALSE;
+
+  data = controller_get_outgoing((size_t*)&length, domain->max_length);
 
   /* If we aren't supposed to send anything (like we're waiting for a timeout),
    * data is NULL. */
   if(!data)
+    return FALSE;
+
+  driver->next_domain = (driver->next_domain + 1) % driver->domain_count;
+
+  send_data(driver, slot, server, domain, get_type(driver), data, length, via_tcp);
+
+  safe_free(data);
+
+  return TRUE;
+}
+
+/* Send the UDP queries that have built up, all at once. */
+static void udp_flush(driver_dns_t *driver)
+{
+  size_t i;
+
+  if(driver->udp_batch_count == 0)
     return;
 
-  assert(driver->s != -1); /* Make sure we have a valid socket. */
-  assert(data); /* Make sure they aren't trying to send NULL. */
-  assert(length > 0); /* Make sure they aren't trying to send 0 bytes. */
-  assert(length <= MAX_DNSCAT_LENGTH(driver->domain));
+  if(udp_send_batch(driver->s, driver->udp_batch, driver->udp_batch_count) > 0)
+  {
+    for(i = 0; i < driver->udp_batch_count; i++)
+    {
+      dns_server_t *server = driver->udp_batch_servers[i];
 
-  buffer = buffer_create(BO_BIG_ENDIAN);
+      if(driver->udp_batch[i].result >= 0)
+        continue;
 
-  /* If no domain is set, add the wildcard prefix at the start. */
-  if(!driver->domain)
+      /* Look the server up again next time, in case it moved. */
+      LOG_ERROR("Couldn't send the DNS query to %s:%d", server->name, driver->dns_port);
+      server->addr_valid = FALSE;
+      server->addr_time  = 0;
+    }
+  }
+
+  driver->stats.send_batches++;
+  driver->udp_batch_count = 0;
+}
+
+/* Keep sending till either the pipeline is full or there's nothing left to
+ * send (the controller rotates through the sessions on each call). The UDP
+ * queries all go out at the end. */
+static void do_send(driver_dns_t *driver)
+{
+  dns_pending_t *slot;
+  dns_server_t  *server;
+  size_t         i;
+
+  /* Whatever the TCP sockets wouldn't take last time. */
+  for(i = 0; i < driver->server_count; i++)
+    tcp_flush(driver, &driver->servers[i]);
+
+  /* Don't take data from the sessions if there's nowhere to send it. */
+  while((slot = get_free_slot(driver)) && (server = pick_server(driver)))
+    if(!send_query(driver, slot, server))
+      break;
+
+  udp_flush(driver);
+}
+
+/* TRUE if at least one of the servers has an address. */
+static NBBOOL have_server_addr(driver_dns_t *driver)
+{
+  size_t i;
+
+  for(i = 0; i < driver->server_count; i++)
+    if(driver->servers[i].addr_valid)
+      return TRUE;
+
+  return FALSE;
+}
+
+static SELECT_RESPONSE_t send_timer_callback(void *group, void *param)
+{
+  /* The timer only has to wake up the main loop, which does the sending. */
+  ((driver_dns_t*)param)->send_timer = -1;
+
+  return SELECT_OK;
+}
+
+/* Set a timer for the next time we might have something to do: a session
+ * wants to transmit, a query times out, or a failed lookup can be retried. */
+static void schedule_send(driver_dns_t *driver)
+{
+  int    delay = controller_get_next_transmit_ms();
+  size_t i;
+
+  if(!have_server_addr(driver))
+    delay = MIN(delay, DNS_SERVER_ADDR_RETRY);
+
+  for(i = 0; i < driver->server_count; i++)
+    if(driver->servers[i].tcp_connected && ring_buffer_get_length(driver->servers[i].tcp_outgoing) > 0)
+      delay = MIN(delay, DNS_TCP_SEND_RETRY);
+
+  /* If every slot is busy, nothing can go out till one frees up. A response
+   * will wake us up on its own; a timeout won't. */
+  if(!get_free_slot(driver))
   {
-    buffer_add_bytes(buffer, (uint8_t*)WILDCARD_PREFIX, strlen(WILDCARD_PREFIX));
-    buffer_add_int8(buffer, '.');
+    uint64_t now = select_group_time_ms();
+
+    for(i = 0; i < driver->pipeline; i++)
+    {
+      uint64_t expires = driver->pending[i].sent_time + DNS_QUERY_TIMEOUT + 1;
+      int      until   = (expires > now) ? (int)(expires - now) : 0;
+
+      delay = MIN(delay, until);
+    }
+  }
+
+  /* With DoT or DoH, nothing can go out while every server is waiting to be
+   * tried again. */
+  if(driver->secure != DNS_SECURE_NONE)
+  {
+    uint64_t now  = select_group_time_ms();
+    uint64_t next = driver->servers[0].tcp_retry_at;
+
+    for(i = 1; i < driver->server_count; i++)
+      next = MIN(next, driver->servers[i].tcp_retry_at);
+
+    if(next > now)
+      delay = MAX(delay, (int)(next - now));
   }
 
-  /* Keep track of the length of the current section (the characters between two periods). */
-  section_length = 0;
-  for(i = 0; i < length; i++)
-  {
-    buffer_add_int8(buffer, HEXCHAR((data[i] >> 4) & 0x0F));
-    buffer_add_int8(buffer, HEXCHAR((data[i] >> 0) & 0x0F));
+  if(driver->send_timer >= 0)
+    select_group_cancel_timer(driver->group, driver->send_timer);
+  driver->send_timer = select_group_add_timer(driver->group, MAX(delay, 0), 0, send_timer_callback, driver);
+}
+
+/* In DNS_TCP_AUTO mode, move to TCP when a response over UDP is (about) as
+ * big as UDP allows, and back when one over TCP would have fit. CNAME and
+ * MX answers are names, which TCP doesn't make any bigger. */
+static void choose_transport(driver_dns_t *driver, dns_type_t type, size_t length, NBBOOL via_tcp)
+{
+  size_t udp_size = driver->edns_size ? driver->edns_size : DNS_UDP_SIZE;
+
+  if(driver->tcp_mode != DNS_TCP_AUTO || type == _DNS_TYPE_CNAME || type == _DNS_TYPE_MX)
+    return;
 
-    /* Add periods when we need them. */
-    section_length += 2;
-    if(i + 1 != length && section_length + 2 >= MAX_FIELD_LENGTH)
-    {
-      section_length = 0;
-      buffer_add_int8(buffer, '.');
-    }
+  if(!via_tcp && !driver->use_tcp && length + DNS_FULL_SLACK >= udp_size)
+  {
+    LOG_INFO("DNS responses are filling UDP packets, switching to TCP");
+    driver->use_tcp = TRUE;
   }
-
-  /* If a domain is set, instead of the wildcard prefix, add the domain to the end. */
-  if(driver->domain)
+  else if(via_tcp && driver->use_tcp && length + DNS_FULL_SLACK < udp_size)
   {
-    buffer_add_int8(buffer, '.');
-    buffer_add_bytes(buffer, driver->domain, strlen(driver->domain));
+    LOG_INFO("DNS responses fit in UDP packets again, switching back");
+    driver->use_tcp = FALSE;
   }
-  buffer_add_int8(buffer, '\0');
+}
 
-  /* Get the result out. */
-  encoded_bytes = buffer_create_string_and_destroy(buffer, &encoded_length);
+/* Handle a response, however it arrived. Returns TRUE if the sessions might
+ * have something new to send. */
+static NBBOOL handle_response(driver_dns_t *driver, uint8_t *data, size_t length, NBBOOL via_tcp)
+{
+  dns_t             *dns;
+  dns_pending_t     *slot;
+  dns_probe_query_t *probe;
+  uint16_t           trn_id;
+  NBBOOL             result = FALSE;
 
-  /* Double-check we didn't mess up the length. */
-  assert(encoded_length <= MAX_DNS_LENGTH);
+  LOG_INFO("DNS response received (%zu bytes%s)", length, via_tcp ? ", over TCP" : "");
 
-  dns = dns_create(_DNS_OPCODE_QUERY, _DNS_FLAG_RD, _DNS_RCODE_SUCCESS);
-  dns_add_question(dns, (char*)encoded_bytes, get_type(driver), _DNS_CLASS_IN);
-  dns_bytes = dns_to_packet(dns, &dns_length);
+  if(length < DNS_HEADER_SIZE)
+  {
+    LOG_ERROR("DNS response was too short (%zu bytes), ignoring", length);
+    return FALSE;
+  }
 
-  LOG_INFO("Sending DNS query for: %s to %s:%d", encoded_bytes, driver->dns_server, driver->dns_port);
-  udp_send(driver->s, driver->dns_server, driver->dns_port, dns_bytes, dns_length);
+  /* A truncated response is missing some (or all) of its answer, so there's
+   * nothing we can use in it; try TCP, if we can. The session will re-send
+   * whatever it needs to. */
+  if(data[2] & (_DNS_FLAG_TC >> 8))
+  {
+    LOG_INFO("DNS response was truncated%s", driver->tcp_mode == DNS_TCP_OFF ? "" : ", switching to TCP");
+    driver->stats.truncated_responses++;
 
-  safe_free(dns_bytes);
-  safe_free(encoded_bytes);
-  safe_free(data);
+    slot = find_pending(driver, (data[0] << 8) | data[1]);
+    if(slot)
+      release_slot(driver, slot);
+    if(driver->tcp_mode == DNS_TCP_AUTO)
+      driver->use_tcp = TRUE;
 
-  dns_destroy(dns);
-}
+    return TRUE;
+  }
 
-static SELECT_RESPONSE_t timeout_callback(void *group, void *param)
-{
-  do_send((driver_dns_t*)param);
-  controller_heartbeat();
+  /* The transaction id is all it takes to know whether we want it, so check
+   * that before going to the trouble of parsing it.
+   * (It has to come back the way the query went, too.) */
+  trn_id = (data[0] << 8) | data[1];
+  slot   = find_pending(driver, trn_id);
+  if(!slot || slot->via_tcp != via_tcp)
+  {
+    if(!slot && is_recent_trn_id(driver, trn_id))
+    {
+      /* A copy of an answer we already had (or a late one to a query we
+       * gave up on); either way, the session's seen, or will re-send,
+       * whatever it was. */
+      LOG_INFO("DNS response 0x%04x was a duplicate, ignoring", trn_id);
+      driver->stats.duplicate_responses++;
+    }
+    else
+    {
+      /* A stray packet. */
+      LOG_INFO("DNS response had an unknown transaction id (0x%04x), ignoring", trn_id);
+      driver->stats.unexpected_responses++;
+    }
 
-  return SELECT_OK;
-}
+    return FALSE;
+  }
 
-static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
-{
-  /*driver_dns_t *driver_dns = param;*/
-  dns_t        *dns    = dns_create_from_packet(data, length);
-  driver_dns_t *driver = (driver_dns_t*) param;
+  dns = dns_create_from_packet_in(driver->arena, data, length);
 
-  LOG_INFO("DNS response received (%d bytes)", length);
+  /* Free up the slot for the next query. */
+  probe = slot->probe;
+  release_slot(driver, slot);
+  server_answered(slot->server, (int)(select_group_time_ms() - slot->sent_time));
+  driver->stats.responses++;
 
   if(dns->rcode != _DNS_RCODE_SUCCESS)
   {
+    driver->stats.errors[dns->rcode & 0x0F]++;
+
     switch(dns->rcode)
     {
       case _DNS_RCODE_FORMAT_ERROR:
@@ -262,135 +1330,144 @@ static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, uint8_t *data,
   else if(dns->question_count != 1)
   {
     LOG_ERROR("DNS returned the wrong number of response fields (question_count should be 1, was instead %d).", dns->question_count);
+    driver->stats.empty_responses++;
     LOG_ERROR("This is probably due to a DNS error");
   }
   else if(dns->answer_count < 1)
   {
     LOG_ERROR("DNS didn't return an answer");
+    driver->stats.empty_responses++;
     LOG_ERROR("This is probably due to a DNS error");
   }
   else
   {
-    size_t    i;
-
+#if !defined(NO_NAME_TYPES) || !defined(NO_ADDRESS_TYPES)
+    uint8_t    decoded[256];
+#endif
     uint8_t   *answer = NULL;
-    uint8_t   *tmp_answer = NULL;
     size_t     answer_length = 0;
     dns_type_t type = dns->answers[0].type;
 
-    if(type == _DNS_TYPE_TEXT)
-    {
-      LOG_INFO("Received a TXT response: %s", dns->answers[0].answer->TEXT.text);
+    choose_transport(driver, type, length, via_tcp);
 
-      /* Get the answer. */
-      tmp_answer    = dns->answers[0].answer->TEXT.text;
-      answer_length = dns->answers[0].answer->TEXT.length;
-
-      /* Decode it. */
-      answer = buffer_decode_hex(tmp_answer, &answer_length);
-    }
-    else if(type == _DNS_TYPE_CNAME)
+    if(type == _DNS_TYPE_TEXT)
     {
-      LOG_INFO("Received a CNAME response: %s", (char*)dns->answers[0].answer->CNAME.name);
+      LOG_INFO("Received a TXT response (%d bytes)", dns->answers[0].answer->TEXT.length);
+      driver->stats.txt_responses++;
 
-      /* Get the answer. */
-      tmp_answer = remove_domain((char*)dns->answers[0].answer->CNAME.name, driver->domain);
-      if(!tmp_answer)
+      if(driver->encoding != DNS_ENCODING_HEX)
       {
-        answer = NULL;
+        /* Anything but hex gets the raw bytes back, which dns_t has already
+         * joined together if the server split them into several strings. */
+        answer        = dns->answers[0].answer->TEXT.text;
+        answer_length = dns->answers[0].answer->TEXT.length;
       }
-      else
+      else if(decode_name(driver, dns->answers[0].answer->TEXT.text, dns->answers[0].answer->TEXT.length, dns->answers[0].answer->TEXT.text, &answer_length))
       {
-        answer_length = strlen((char*)tmp_answer);
-
-        /* Decode it. */
-        answer = buffer_decode_hex(tmp_answer, &answer_length);
-        safe_free(tmp_answer);
+        /* Decoded in place, since it could be longer than decoded[]. */
+        answer = dns->answers[0].answer->TEXT.text;
       }
     }
-    else if(type == _DNS_TYPE_MX)
+#ifndef NO_NAME_TYPES
+    else if(type == _DNS_TYPE_CNAME || type == _DNS_TYPE_MX)
     {
-      LOG_INFO("Received a MX response: %s", (char*)dns->answers[0].answer->MX.name);
+      char   *name;
+      size_t  name_length = 0;
 
-      /* Get the answer. */
-      tmp_answer = remove_domain((char*)dns->answers[0].answer->MX.name, driver->domain);
-      if(!tmp_answer)
+      if(type == _DNS_TYPE_CNAME)
       {
-        answer = NULL;
+        name = (char*)dns->answers[0].answer->CNAME.name;
+        driver->stats.cname_responses++;
       }
       else
       {
-        answer_length = strlen((char*)tmp_answer);
-        LOG_INFO("Received a MX response (%zu bytes)", answer_length);
-
-        /* Decode it. */
-        answer = buffer_decode_hex(tmp_answer, &answer_length);
-        safe_free(tmp_answer);
+        name = (char*)dns->answers[0].answer->MX.name;
+        driver->stats.mx_responses++;
       }
-    }
-    else if(type == _DNS_TYPE_A)
-    {
-      buffer_t *buf = buffer_create(BO_BIG_ENDIAN);
-
-      qsort(dns->answers, dns->answer_count, sizeof(answer_t), cmpfunc_a);
+      LOG_INFO("Received a %s response: %s", type == _DNS_TYPE_CNAME ? "CNAME" : "MX", name);
 
-      for(i = 0; i < dns->answer_count; i++)
-        buffer_add_bytes(buf, dns->answers[i].answer->A.bytes + 1, 3);
-
-      answer_length = buffer_read_next_int8(buf);
-      LOG_INFO("Received an A response (%zu bytes)", answer_length);
-
-      answer = safe_malloc(answer_length);
-      buffer_read_bytes_at(buf, 1, answer, answer_length);
+      /* Get the answer, and decode it. */
+      name = remove_domain(name, slot->domain->name, &name_length);
+      if(name && (name_length * encodings[driver->encoding].bits) / 8 <= sizeof(decoded) && decode_name(driver, (uint8_t*)name, name_length, decoded, &answer_length))
+        answer = decoded;
     }
+#endif
+#ifndef NO_ADDRESS_TYPES
 #ifndef WIN32
-    else if(type == _DNS_TYPE_AAAA)
+    else if(type == _DNS_TYPE_A || type == _DNS_TYPE_AAAA)
+#else
+    else if(type == _DNS_TYPE_A)
+#endif
     {
-      buffer_t *buf = buffer_create(BO_BIG_ENDIAN);
-
-      qsort(dns->answers, dns->answer_count, sizeof(answer_t), cmpfunc_aaaa);
-
-      for(i = 0; i < dns->answer_count; i++)
-        buffer_add_bytes(buf, dns->answers[i].answer->AAAA.bytes + 1, 15);
-
-      answer_length = buffer_read_next_int8(buf);
-      LOG_INFO("Received an AAAA response (%zu bytes)", answer_length);
+      if(type == _DNS_TYPE_A)
+        driver->stats.a_responses++;
+      else
+        driver->stats.aaaa_responses++;
 
-      answer = safe_malloc(answer_length);
-      buffer_read_bytes_at(buf, 1, answer, answer_length);
+      if(driver_dns_decode_addresses(dns, decoded, sizeof(decoded), &answer_length))
+      {
+        LOG_INFO("Received an %s response (%zu bytes)", type == _DNS_TYPE_A ? "A" : "AAAA", answer_length);
+        answer = decoded;
+      }
+      else
+      {
+        LOG_ERROR("Received an %s response with records missing or doubled up, ignoring", type == _DNS_TYPE_A ? "A" : "AAAA");
+      }
     }
 #endif
     else
     {
       LOG_ERROR("Unknown DNS type returned: %d", type);
+      driver->stats.other_responses++;
       answer = NULL;
     }
 
-    if(answer)
+    if(answer && probe)
+    {
+      /* The probe only wants to know if its PING made it there and back. */
+      probe->ok = answer_length == probe->length && !memcmp(answer, probe->data, answer_length);
+    }
+    else if(answer)
     {
       /*LOG_WARNING("Received a %zu-byte DNS response: %s [0x%04x]", answer_length, answer, type);*/
 
-      /* Pass the buffer to the caller */
+      /* Pass the data elsewhere. */
       if(answer_length > 0)
-      {
-        /* Pass the data elsewhere. */
-        if(controller_data_incoming(answer, answer_length))
-          do_send(driver);
-      }
-
-      safe_free(answer);
+        result = controller_data_incoming(answer, answer_length);
     }
   }
 
   dns_destroy(dns);
+  arena_reset(driver->arena);
+
+  return result;
+}
+
+static SELECT_RESPONSE_t recv_socket_callback(void *group, int s, select_datagram_t *datagrams, size_t count, void *param)
+{
+  driver_dns_t *driver   = (driver_dns_t*) param;
+  NBBOOL        answered = FALSE;
+  size_t        i;
+
+  driver->stats.recv_batches++;
+
+  for(i = 0; i < count; i++)
+    if(handle_response(driver, datagrams[i].data, datagrams[i].length, FALSE))
+      answered = TRUE;
+
+  /* One round of sending for the lot, so the new queries go out together,
+   * too. */
+  if(answered)
+    do_send(driver);
 
   return SELECT_OK;
 }
 
-driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host, uint16_t port, char *types, char *server)
+driver_dns_t *driver_dns_create(select_group_t *group, char **domains, size_t domain_count, char *host, uint16_t port, char *types, char **servers, size_t server_count, size_t pipeline, char *encoding, uint16_t edns_size, char *tcp_mode, char *secure, char *doh_path, NBBOOL verify, NBBOOL probe, char *probe_cache)
 {
   driver_dns_t *driver = (driver_dns_t*) safe_malloc(sizeof(driver_dns_t));
   char *token = NULL;
+  size_t i;
 
   /* Create the actual DNS socket. */
   LOG_INFO("Creating UDP (DNS) socket on %s", host);
@@ -403,9 +1480,87 @@ driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host,
 
   /* Set the domain and stuff. */
   driver->group      = group;
-  driver->domain     = domain;
   driver->dns_port   = port;
-  driver->dns_server = server;
+  driver->pipeline   = MAX(1, MIN(pipeline, DNS_MAX_PIPELINE));
+  driver->send_timer = -1;
+  driver->edns_size  = edns_size ? MAX(512, MIN(edns_size, DNS_MAX_EDNS_SIZE)) : 0;
+  driver->arena      = arena_create(DNS_ARENA_SIZE);
+  driver->probe      = probe;
+  driver->probe_cache = probe_cache;
+
+  driver->udp_batch_data = (uint8_t*) safe_malloc(DNS_MAX_PIPELINE * DNS_QUERY_MAX_SIZE);
+  for(i = 0; i < DNS_MAX_PIPELINE; i++)
+    driver->udp_batch[i].data = driver->udp_batch_data + (i * DNS_QUERY_MAX_SIZE);
+
+  if(!tables_ready)
+    init_tables();
+
+  for(driver->encoding = 0; driver->encoding < ENCODING_COUNT; driver->encoding++)
+    if(!strcmp(encoding, encodings[driver->encoding].name))
+      break;
+  if(driver->encoding == ENCODING_COUNT)
+  {
+    LOG_FATAL("Unknown DNS encoding: %s (allowed encodings are "DNS_ENCODINGS")", encoding);
+    exit(1);
+  }
+
+  if(!strcmp(tcp_mode, "off"))
+    driver->tcp_mode = DNS_TCP_OFF;
+  else if(!strcmp(tcp_mode, "auto"))
+    driver->tcp_mode = DNS_TCP_AUTO;
+  else if(!strcmp(tcp_mode, "always"))
+    driver->tcp_mode = DNS_TCP_ALWAYS;
+  else
+  {
+    LOG_FATAL("Unknown TCP mode: %s (allowed modes are "DNS_TCP_MODES")", tcp_mode);
+    exit(1);
+  }
+
+  driver->secure   = DNS_SECURE_NONE;
+  driver->doh_path = doh_path;
+  driver->verify   = verify;
+  if(secure)
+  {
+#ifdef USE_TLS
+    if(!strcmp(secure, "dot"))
+      driver->secure = DNS_SECURE_DOT;
+    else if(!strcmp(secure, "doh"))
+      driver->secure = DNS_SECURE_DOH;
+    else
+    {
+      LOG_FATAL("Unknown secure mode: %s (allowed modes are "DNS_SECURE_MODES")", secure);
+      exit(1);
+    }
+
+    if(!verify)
+      LOG_WARNING("Not checking the DNS servers' certificates!");
+#else
+    LOG_FATAL("This dnscat was built without TLS (build it with 'make tls' to use secure=%s)", secure);
+    exit(1);
+#endif
+  }
+
+  /* Encode the domains once, rather than on every query. */
+  driver->domain_count = MAX(1, MIN(domain_count, DNS_MAX_DOMAINS));
+  for(i = 0; i < driver->domain_count; i++)
+  {
+    dns_domain_t *d = &driver->domains[i];
+
+    d->name          = domain_count ? domains[i] : NULL;
+    d->labels_length = d->name ? encode_labels(d->name, d->labels, MAX_DNS_LENGTH) : 0;
+    d->max_length    = get_max_length(driver, d);
+  }
+
+  /* Resolve the servers up front; if it fails, we'll keep trying. */
+  driver->server_count = MIN(server_count, DNS_MAX_SERVERS);
+  for(i = 0; i < driver->server_count; i++)
+  {
+    driver->servers[i].name         = servers[i];
+    driver->servers[i].tcp_s        = -1;
+    driver->servers[i].tcp_incoming = buffer_create(BO_BIG_ENDIAN);
+    driver->servers[i].tcp_outgoing = ring_buffer_create(0);
+    get_server_addr(driver, &driver->servers[i]);
+  }
 
   /* Allow the user to choose 'any' protocol. */
   if(!strcmp(types, "ANY"))
@@ -419,16 +1574,22 @@ driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host,
   {
     if(!strcmp(token, "TXT") || !strcmp(token, "TEXT"))
       driver->types[driver->type_count++] = _DNS_TYPE_TEXT;
+#ifndef NO_NAME_TYPES
     else if(!strcmp(token, "MX"))
       driver->types[driver->type_count++] = _DNS_TYPE_MX;
     else if(!strcmp(token, "CNAME"))
       driver->types[driver->type_count++] = _DNS_TYPE_CNAME;
+#endif
+#ifndef NO_ADDRESS_TYPES
     else if(!strcmp(token, "A"))
       driver->types[driver->type_count++] = _DNS_TYPE_A;
 #ifndef WIN32
     else if(!strcmp(token, "AAAA"))
       driver->types[driver->type_count++] = _DNS_TYPE_AAAA;
 #endif
+#endif
+    else
+      LOG_WARNING("DNS type %s isn't supported (this build has "DNS_TYPES"), ignoring it", token);
   }
 
   /* Now that we no longer need types. */
@@ -442,8 +1603,7 @@ driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host,
 
   /* If it succeeds, add it to the select_group */
   select_group_add_socket(group, driver->s, SOCKET_TYPE_STREAM, driver);
-  select_set_recv(group, driver->s, recv_socket_callback);
-  select_set_timeout(group, timeout_callback, driver);
+  select_set_recv_batch(group, driver->s, recv_socket_callback);
   select_set_closed(group, driver->s, dns_data_closed);
 
   return driver;
@@ -451,15 +1611,568 @@ driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host,
 
 void driver_dns_destroy(driver_dns_t *driver)
 {
+  size_t i;
+
+  /* The last session's FIN might be waiting to go out with its batch (the
+   * controller exits as soon as it's handed over). */
+  udp_flush(driver);
+
+  for(i = 0; i < driver->server_count; i++)
+  {
+    tcp_disconnect(driver, &driver->servers[i], FALSE);
+    buffer_destroy(driver->servers[i].tcp_incoming);
+    ring_buffer_destroy(driver->servers[i].tcp_outgoing);
+  }
+
+  arena_destroy(driver->arena);
+  safe_free(driver->udp_batch_data);
   safe_free(driver);
 }
 
-void driver_dns_go(driver_dns_t *driver)
+static void report_stat(stats_callback_t *callback, void *param, char *name, uint32_t value)
+{
+  char full_name[64];
+
+  sprintf(full_name, "dns.%s", name);
+  callback(full_name, value, param);
+}
+
+void driver_dns_get_stats(void *d, stats_callback_t *callback, void *param)
+{
+  driver_dns_t *driver = (driver_dns_t*) d;
+  driver_dns_stats_t *stats = &driver->stats;
+  char name[32];
+  size_t i;
+
+  /* The names for the RCODEs we know about; the rest are reported by number. */
+  static char *rcode_names[] = { NULL, "FORMAT_ERROR", "SERVER_FAILURE", "NAME_ERROR", "NOT_IMPLEMENTED", "REFUSED" };
+
+  report_stat(callback, param, "queries_sent",         stats->queries_sent);
+  report_stat(callback, param, "responses",            stats->responses);
+  report_stat(callback, param, "timeouts",             stats->timeouts);
+  report_stat(callback, param, "unexpected_responses", stats->unexpected_responses);
+  report_stat(callback, param, "duplicate_responses",  stats->duplicate_responses);
+  report_stat(callback, param, "empty_responses",      stats->empty_responses);
+  report_stat(callback, param, "responses.TXT",        stats->txt_responses);
+  report_stat(callback, param, "responses.CNAME",      stats->cname_responses);
+  report_stat(callback, param, "responses.MX",         stats->mx_responses);
+  report_stat(callback, param, "responses.A",          stats->a_responses);
+  report_stat(callback, param, "responses.AAAA",       stats->aaaa_responses);
+  report_stat(callback, param, "responses.other",      stats->other_responses);
+  report_stat(callback, param, "tcp_queries",          stats->tcp_queries);
+  report_stat(callback, param, "truncated_responses",  stats->truncated_responses);
+  report_stat(callback, param, "tcp_failures",         stats->tcp_failures);
+  report_stat(callback, param, "send_batches",         stats->send_batches);
+  report_stat(callback, param, "recv_batches",         stats->recv_batches);
+
+  /* Only the errors we've actually seen. */
+  for(i = 1; i < 16; i++)
+  {
+    if(!stats->errors[i])
+      continue;
+
+    if(i < sizeof(rcode_names) / sizeof(rcode_names[0]))
+      sprintf(name, "errors.%s", rcode_names[i]);
+    else
+      sprintf(name, "errors.%d", (int)i);
+    report_stat(callback, param, name, stats->errors[i]);
+  }
+
+  for(i = 0; i < driver->server_count; i++)
+  {
+    dns_server_t *server = &driver->servers[i];
+
+    sprintf(name, "server.%d.srtt_ms", (int)i);
+    report_stat(callback, param, name, server->srtt);
+    sprintf(name, "server.%d.loss_percent", (int)i);
+    report_stat(callback, param, name, (server->loss * 100) / 256);
+  }
+}
+
+/* The record types the probe tries, and what they're called in the cache. */
+static struct
+{
+  char       *name;
+  dns_type_t  type;
+} probe_types[] =
+{
+  { "TXT",   _DNS_TYPE_TEXT  },
+#ifndef NO_NAME_TYPES
+  { "CNAME", _DNS_TYPE_CNAME },
+  { "MX",    _DNS_TYPE_MX    },
+#endif
+#ifndef NO_ADDRESS_TYPES
+  { "A",     _DNS_TYPE_A     },
+#ifndef WIN32
+  { "AAAA",  _DNS_TYPE_AAAA  },
+#endif
+#endif
+};
+#define PROBE_TYPE_COUNT (sizeof(probe_types) / sizeof(probe_types[0]))
+
+/* Fill in a probe query: a PING packet of exactly length bytes, with a
+ * random string (the server sends the whole thing back as it is). */
+static void probe_init(dns_probe_query_t *query, dns_server_t *server, dns_type_t type, size_t length)
+{
+  static char *chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+  char        string[DNS_PROBE_MAX_LENGTH];
+  packet_t   *packet;
+  uint8_t    *bytes;
+  size_t      bytes_length;
+  size_t      i;
+
+  /* (The packet is the string, plus its null terminator and the header.) */
+  length = MAX(packet_get_ping_size() + 1, MIN(length, DNS_PROBE_MAX_LENGTH));
+
+  for(i = 0; i < length - packet_get_ping_size(); i++)
+    string[i] = chars[rand() % strlen(chars)];
+  string[i] = '\0';
+
+  packet = packet_create_ping(0, string);
+  bytes  = packet_to_bytes(packet, &bytes_length, (options_t)0);
+  packet_destroy(packet);
+
+  memcpy(query->data, bytes, bytes_length);
+  safe_free(bytes);
+
+  query->server = server;
+  query->type   = type;
+  query->length = bytes_length;
+  query->ok     = FALSE;
+}
+
+/* Send a round of probe queries (to the first domain, with the driver's
+ * current encoding) and wait for them to come back, or for
+ * DNS_PROBE_TIMEOUT. Returns how many came back unchanged. */
+static size_t probe_round(driver_dns_t *driver, dns_probe_query_t *queries, size_t count)
+{
+  dns_domain_t *domain     = &driver->domains[0];
+  size_t        pipeline   = driver->pipeline;
+  size_t        max_length = domain->max_length;
+  size_t        ok       = 0;
+  uint64_t      deadline;
+  NBBOOL        waiting;
+  size_t        i;
+
+  /* Every slot can be used, and the names can be as long as the encoding
+   * allows, for now. */
+  driver->pipeline   = DNS_MAX_PIPELINE;
+  domain->max_length = get_max_length(driver, domain);
+
+  for(i = 0; i < count && i < DNS_MAX_PIPELINE; i++)
+  {
+    dns_pending_t *slot = get_free_slot(driver);
+    NBBOOL         via_tcp;
+
+    if(!slot || !queries[i].server || !get_server_addr(driver, queries[i].server))
+      continue;
+
+    via_tcp = want_tcp(driver, queries[i].server);
+    if(driver->secure != DNS_SECURE_NONE && !via_tcp)
+      continue;
+
+    send_data(driver, slot, queries[i].server, domain, queries[i].type, queries[i].data, queries[i].length, via_tcp);
+    slot->probe = &queries[i];
+  }
+  udp_flush(driver);
+
+  /* The responses come in through the usual callbacks. */
+  deadline = select_group_time_ms() + DNS_PROBE_TIMEOUT;
+  do
+  {
+    uint64_t now = select_group_time_ms();
+
+    waiting = FALSE;
+    for(i = 0; i < DNS_MAX_PIPELINE; i++)
+      if(driver->pending[i].in_use && driver->pending[i].probe)
+        waiting = TRUE;
+
+    if(!waiting || now >= deadline)
+      break;
+
+    for(i = 0; i < driver->server_count; i++)
+      tcp_flush(driver, &driver->servers[i]);
+
+    select_group_do_select(driver->group, (int)MIN(deadline - now, DNS_TCP_SEND_RETRY * 5));
+  } while(TRUE);
+
+  /* Whatever's left didn't make it. */
+  for(i = 0; i < DNS_MAX_PIPELINE; i++)
+  {
+    dns_pending_t *slot = &driver->pending[i];
+
+    if(!slot->in_use || !slot->probe)
+      continue;
+
+    release_slot(driver, slot);
+    driver->stats.timeouts++;
+    server_missed(driver, slot->server);
+  }
+  driver->pipeline   = pipeline;
+  domain->max_length = max_length;
+
+  for(i = 0; i < count; i++)
+    if(queries[i].ok)
+      ok++;
+
+  return ok;
+}
+
+/* The most data a query can hold, for the first domain with the current
+ * encoding. */
+static size_t probe_max_length(driver_dns_t *driver)
+{
+  return get_max_length(driver, &driver->domains[0]);
+}
+
+/* Set the driver up the way the probe (or the cache) said to. */
+static void probe_apply(driver_dns_t *driver, dns_probe_result_t *result)
+{
+  size_t i;
+
+  memcpy(driver->types, result->types, sizeof(result->types));
+  driver->type_count = result->type_count;
+  driver->encoding   = result->encoding;
+  driver->edns_size  = result->edns_size;
+  driver->pipeline   = MAX(1, MIN(result->pipeline, DNS_MAX_PIPELINE));
+
+  for(i = 0; i < driver->domain_count; i++)
+  {
+    driver->domains[i].max_length = get_max_length(driver, &driver->domains[i]);
+    if(result->max_length)
+      driver->domains[i].max_length = MIN(driver->domains[i].max_length, result->max_length);
+  }
+
+  printf("DNS settings from the path probe:\n");
+  printf(" type   = ");
+  for(i = 0; i < driver->type_count; i++)
+  {
+    size_t t;
+
+    for(t = 0; t < PROBE_TYPE_COUNT; t++)
+      if(probe_types[t].type == driver->types[i])
+        printf("%s%s", i ? "," : "", probe_types[t].name);
+  }
+  printf("\n");
+  printf(" encoding = %s\n", encodings[driver->encoding].name);
+  printf(" max length = %zu bytes\n", driver->domains[0].max_length);
+  printf(" edns   = %u\n", driver->edns_size);
+  printf(" pipeline = %zu\n", driver->pipeline);
+  printf(" delay  = %dms\n", result->delay);
+}
+
+/* Run the probe. Returns FALSE if nothing got through at all (in which case
+ * the settings are left alone). */
+static NBBOOL probe_run(driver_dns_t *driver, dns_probe_result_t *result)
+{
+  dns_probe_query_t queries[DNS_MAX_PIPELINE];
+  dns_encoding_t    original_encoding = driver->encoding;
+  NBBOOL            survived[PROBE_TYPE_COUNT];
+  NBBOOL            have_txt = FALSE;
+  size_t            count;
+  size_t            i, t;
+  int               best_rtt = 0;
+
+  printf("Probing the path to the server...\n");
+
+  memcpy(result->types, driver->types, sizeof(driver->types));
+  result->type_count = driver->type_count;
+  result->encoding   = driver->encoding;
+  result->max_length = 0;
+  result->edns_size  = driver->edns_size;
+  result->pipeline   = driver->pipeline;
+  result->delay      = 0;
+
+  /* Each resolver's round trip and loss (the usual bookkeeping takes care
+   * of those), with EDNS0, then without it if nothing comes back. */
+  count = 0;
+  for(i = 0; i < driver->server_count; i++)
+    for(t = 0; t < DNS_PROBE_COUNT && count < DNS_MAX_PIPELINE; t++)
+      probe_init(&queries[count++], &driver->servers[i], driver->types[0], DNS_PROBE_SMALL);
+
+  if(!probe_round(driver, queries, count) && driver->edns_size)
+  {
+    driver->edns_size = 0;
+    if(probe_round(driver, queries, count))
+    {
+      LOG_WARNING("Queries with EDNS0 don't seem to get through, turning it off");
+      result->edns_size = 0;
+    }
+  }
+  driver->edns_size = result->edns_size;
+
+  for(i = 0; i < driver->server_count; i++)
+  {
+    dns_server_t *server = &driver->servers[i];
+
+    LOG_WARNING("DNS server %s: round trip %dms, loss %d%%", server->name, server->srtt, (server->loss * 100) / 256);
+    if(server->srtt && (!best_rtt || server->srtt < best_rtt))
+      best_rtt = server->srtt;
+  }
+
+  if(!best_rtt)
+  {
+    LOG_ERROR("Nothing came back from the path probe; leaving the DNS settings alone");
+    return FALSE;
+  }
+
+  /* Which record types make it there and back. */
+  count = 0;
+  for(t = 0; t < PROBE_TYPE_COUNT; t++)
+    for(i = 0; i < DNS_PROBE_COUNT; i++)
+      probe_init(&queries[count++], pick_server(driver), probe_types[t].type, DNS_PROBE_SMALL);
+  probe_round(driver, queries, count);
+
+  for(t = 0; t < PROBE_TYPE_COUNT; t++)
+  {
+    survived[t] = FALSE;
+    for(i = 0; i < DNS_PROBE_COUNT; i++)
+      if(queries[(t * DNS_PROBE_COUNT) + i].ok)
+        survived[t] = TRUE;
+
+    if(!survived[t])
+      LOG_WARNING("%s queries don't seem to get through", probe_types[t].name);
+    if(survived[t] && probe_types[t].type == _DNS_TYPE_TEXT)
+      have_txt = TRUE;
+  }
+
+  /* Keep the types we were asked to use that work; if none of them do, use
+   * whichever ones do. */
+  result->type_count = 0;
+  for(i = 0; i < driver->type_count; i++)
+    for(t = 0; t < PROBE_TYPE_COUNT; t++)
+      if(survived[t] && probe_types[t].type == driver->types[i])
+        result->types[result->type_count++] = driver->types[i];
+
+  for(t = 0; t < PROBE_TYPE_COUNT && result->type_count == 0; t++)
+    if(survived[t])
+      result->types[result->type_count++] = probe_types[t].type;
+
+  if(result->type_count == 0)
+  {
+    LOG_ERROR("None of the record types came back in one piece; leaving the DNS settings alone");
+    memcpy(result->types, driver->types, sizeof(driver->types));
+    result->type_count = driver->type_count;
+    return FALSE;
+  }
+
+  /* The densest encoding that survives a full-sized name (base64 only does
+   * if the resolvers keep the case); it takes TXT, since that's the only
+   * answer that can hold one. */
+  if(have_txt)
+  {
+    dns_encoding_t tries[] = { DNS_ENCODING_BASE64, DNS_ENCODING_BASE32, DNS_ENCODING_HEX };
+    size_t         e;
+
+    for(e = 0; e < sizeof(tries) / sizeof(tries[0]); e++)
+    {
+      driver->encoding = tries[e];
+      for(i = 0; i < DNS_PROBE_COUNT; i++)
+        probe_init(&queries[i], pick_server(driver), _DNS_TYPE_TEXT, probe_max_length(driver));
+
+      if(probe_round(driver, queries, DNS_PROBE_COUNT))
+        break;
+
+      if(tries[e] == DNS_ENCODING_BASE64)
+        LOG_WARNING("base64 names don't get through (either the case isn't kept, or the server doesn't support it)");
+    }
+
+    /* If even hex doesn't fit, see how much does. */
+    if(e == sizeof(tries) / sizeof(tries[0]))
+    {
+      size_t full = probe_max_length(driver);
+      size_t length;
+
+      for(length = (full * 3) / 4; length >= full / 4; length -= full / 4)
+      {
+        for(i = 0; i < DNS_PROBE_COUNT; i++)
+          probe_init(&queries[i], pick_server(driver), _DNS_TYPE_TEXT, length);
+
+        if(probe_round(driver, queries, DNS_PROBE_COUNT))
+        {
+          LOG_WARNING("Long names don't get through, only sending %zu bytes per query", length);
+          result->max_length = length;
+          break;
+        }
+      }
+    }
+
+    result->encoding = driver->encoding;
+    driver->encoding = original_encoding;
+  }
+  else
+  {
+    LOG_WARNING("TXT doesn't get through, so the encoding and name length can't be checked");
+  }
+
+  /* How many queries can be in flight before some go missing (some
+   * resolvers limit the rate). */
+  driver->encoding = result->encoding;
+  for(i = 0; i < driver->pipeline; i++)
+    probe_init(&queries[i], pick_server(driver), result->types[0], DNS_PROBE_SMALL);
+  count = probe_round(driver, queries, driver->pipeline);
+  driver->encoding = original_encoding;
+
+  if(count < driver->pipeline / 2)
+  {
+    LOG_WARNING("Only %zu of %zu queries sent at once came back, cutting the pipeline down", count, driver->pipeline);
+    result->pipeline = MAX(count, 1);
+  }
+
+  result->delay = MAX(DNS_PROBE_MIN_DELAY, MIN(best_rtt * DNS_PROBE_RTTS, DNS_PROBE_MAX_DELAY));
+
+  return TRUE;
+}
+
+/* What the cache is for: the same servers, domains and port (anything else
+ * is what the probe decides on). */
+static void probe_key(driver_dns_t *driver, char *key)
+{
+  size_t i;
+
+  sprintf(key, "port=%d", driver->dns_port);
+  for(i = 0; i < driver->server_count; i++)
+    sprintf(key + strlen(key), " server=%.200s", driver->servers[i].name);
+  for(i = 0; i < driver->domain_count; i++)
+    sprintf(key + strlen(key), " domain=%.200s", driver->domains[i].name ? driver->domains[i].name : "");
+}
+
+#define PROBE_KEY_LENGTH (16 + ((DNS_MAX_SERVERS + DNS_MAX_DOMAINS) * 210))
+
+static void probe_save(driver_dns_t *driver, dns_probe_result_t *result)
+{
+  char  key[PROBE_KEY_LENGTH];
+  FILE *f = fopen(driver->probe_cache, "w");
+  size_t i, t;
+
+  if(!f)
+  {
+    LOG_ERROR("Couldn't write the path probe's results to %s", driver->probe_cache);
+    return;
+  }
+
+  probe_key(driver, key);
+  fprintf(f, "key=%s\n", key);
+  fprintf(f, "time=%lu\n", (unsigned long)time(NULL));
+  fprintf(f, "types=");
+  for(i = 0; i < result->type_count; i++)
+    for(t = 0; t < PROBE_TYPE_COUNT; t++)
+      if(probe_types[t].type == result->types[i])
+        fprintf(f, "%s%s", i ? "," : "", probe_types[t].name);
+  fprintf(f, "\n");
+  fprintf(f, "encoding=%s\n", encodings[result->encoding].name);
+  fprintf(f, "max_length=%zu\n", result->max_length);
+  fprintf(f, "edns=%u\n", result->edns_size);
+  fprintf(f, "pipeline=%zu\n", result->pipeline);
+  fprintf(f, "delay=%d\n", result->delay);
+
+  fclose(f);
+}
+
+/* Read the cache, if it's there, for the same key and recent enough. */
+static NBBOOL probe_load(driver_dns_t *driver, dns_probe_result_t *result)
+{
+  char          key[PROBE_KEY_LENGTH];
+  char          line[PROBE_KEY_LENGTH + 8];
+  FILE         *f = fopen(driver->probe_cache, "r");
+  NBBOOL        key_ok = FALSE;
+  unsigned long when = 0;
+  size_t        e, t;
+
+  if(!f)
+    return FALSE;
+
+  probe_key(driver, key);
+
+  memcpy(result->types, driver->types, sizeof(driver->types));
+  result->type_count = driver->type_count;
+  result->encoding   = driver->encoding;
+  result->max_length = 0;
+  result->edns_size  = driver->edns_size;
+  result->pipeline   = driver->pipeline;
+  result->delay      = 0;
+
+  while(fgets(line, sizeof(line), f))
+  {
+    char *value = strchr(line, '=');
+
+    line[strcspn(line, "\r\n")] = '\0';
+    if(!value)
+      continue;
+    *value++ = '\0';
+
+    if(!strcmp(line, "key"))
+      key_ok = !strcmp(value, key);
+    else if(!strcmp(line, "time"))
+      when = strtoul(value, NULL, 10);
+    else if(!strcmp(line, "types"))
+    {
+      char *token;
+
+      result->type_count = 0;
+      for(token = strtok(value, ","); token && result->type_count < DNS_MAX_TYPES; token = strtok(NULL, ","))
+        for(t = 0; t < PROBE_TYPE_COUNT; t++)
+          if(!strcmp(token, probe_types[t].name))
+            result->types[result->type_count++] = probe_types[t].type;
+    }
+    else if(!strcmp(line, "encoding"))
+    {
+      for(e = 0; e < ENCODING_COUNT; e++)
+        if(!strcmp(value, encodings[e].name))
+          result->encoding = (dns_encoding_t)e;
+    }
+    else if(!strcmp(line, "max_length"))
+      result->max_length = atoi(value);
+    else if(!strcmp(line, "edns"))
+      result->edns_size = atoi(value) ? MAX(512, MIN(atoi(value), DNS_MAX_EDNS_SIZE)) : 0;
+    else if(!strcmp(line, "pipeline"))
+      result->pipeline = atoi(value);
+    else if(!strcmp(line, "delay"))
+      result->delay = atoi(value);
+  }
+  fclose(f);
+
+  if(!key_ok || result->type_count == 0 || (unsigned long)time(NULL) - when > DNS_PROBE_CACHE_TTL)
+    return FALSE;
+
+  return TRUE;
+}
+
+int driver_dns_probe(driver_dns_t *driver)
 {
-  /* Do a fake timeout at the start so we can get going more quickly. */
-  timeout_callback(driver->group, driver);
+  dns_probe_result_t result;
 
-  /* Loop forever and poke the socket. */
+  if(!driver->probe)
+    return 0;
+
+  if(driver->probe_cache && probe_load(driver, &result))
+  {
+    printf("Using the path probe's results from %s\n", driver->probe_cache);
+  }
+  else
+  {
+    if(!probe_run(driver, &result))
+      return 0;
+
+    if(driver->probe_cache)
+      probe_save(driver, &result);
+  }
+
+  probe_apply(driver, &result);
+
+  return result.delay;
+}
+
+void driver_dns_go(driver_dns_t *driver)
+{
+  /* Loop forever: send whatever we can, then sleep till there's a response,
+   * some data, or it's time to retransmit. */
   while(TRUE)
-    select_group_do_select(driver->group, 50);
+  {
+    do_send(driver);
+    controller_heartbeat();
+    schedule_send(driver);
+
+    select_group_do_select(driver->group, -1);
+  }
 }
@@ -15,29 +15,300 @@
 #ifndef __DRIVER_DNS_H__
 #define __DRIVER_DNS_H__
 
+#include "libs/buffer.h"
 #include "libs/dns.h"
+#include "libs/ring_buffer.h"
 #include "libs/select_group.h"
+#include "libs/tls.h"
+#include "libs/udp.h"
 
-/* Types of DNS queries we support */
-#ifndef WIN32
-#define DNS_TYPES "TXT, CNAME, MX, A, AAAA"
+/* Types of DNS queries we support. TXT is always there; a smaller build can
+ * leave out the types whose answers are names (CNAME and MX, with
+ * -DNO_NAME_TYPES) or addresses (A and AAAA, with -DNO_ADDRESS_TYPES), and
+ * the code that decodes them. */
+#ifndef NO_NAME_TYPES
+#define DNS_NAME_TYPES ", CNAME, MX"
 #else
-#define DNS_TYPES "TXT, CNAME, MX, A"
+#define DNS_NAME_TYPES ""
 #endif
 
+#if defined(NO_ADDRESS_TYPES)
+#define DNS_ADDRESS_TYPES ""
+#elif !defined(WIN32)
+#define DNS_ADDRESS_TYPES ", A, AAAA"
+#else
+#define DNS_ADDRESS_TYPES ", A"
+#endif
+
+#define DNS_TYPES "TXT" DNS_NAME_TYPES DNS_ADDRESS_TYPES
+
 /* The default types. */
+#ifndef NO_NAME_TYPES
 #define DEFAULT_TYPES "TXT,CNAME,MX"
+#else
+#define DEFAULT_TYPES "TXT"
+#endif
+
+/* How data is encoded in names; see the encodings table in driver_dns.c.
+ * Anything but hex also needs a server that supports it. */
+#define DNS_ENCODINGS "hex, base32, base64"
+#define DEFAULT_ENCODING "hex"
+
+typedef enum
+{
+  DNS_ENCODING_HEX,
+  DNS_ENCODING_BASE32,
+  DNS_ENCODING_BASE64,
+} dns_encoding_t;
+
+/* When queries go over TCP (each server gets a connection of its own, that
+ * queries are pipelined over): never, when the answers outgrow UDP (when a
+ * response comes back truncated, or full, till they fit again), or always.
+ * Either way, a server we can't connect to gets UDP. */
+#define DNS_TCP_MODES "off, auto, always"
+#define DEFAULT_TCP_MODE "auto"
+
+typedef enum
+{
+  DNS_TCP_OFF,
+  DNS_TCP_AUTO,
+  DNS_TCP_ALWAYS,
+} dns_tcp_mode_t;
+
+/* Queries can go through the resolvers over DNS-over-TLS (RFC 7858) or
+ * DNS-over-HTTPS (RFC 8484) instead, for networks that only let those out;
+ * every query goes over the server's TLS connection then (pipelined, like
+ * TCP). These need a build with TLS support ('make tls'). */
+#define DNS_SECURE_MODES "dot, doh"
+#define DNS_DOT_PORT     853
+#define DNS_DOH_PORT     443
+#define DEFAULT_DOH_PATH "/dns-query"
+
+typedef enum
+{
+  DNS_SECURE_NONE,
+  DNS_SECURE_DOT,
+  DNS_SECURE_DOH,
+} dns_secure_t;
 
 /* The maximum number of types that can be selected amongst. */
 #define DNS_MAX_TYPES 32
 
+/* The default and maximum number of queries we'll have in flight at once. */
+#define DNS_DEFAULT_PIPELINE 8
+#define DNS_MAX_PIPELINE     32
+
+/* How long (in ms) we wait on a query before giving its slot to another. */
+#define DNS_QUERY_TIMEOUT    2000
+
+/* How many transaction ids we remember after their queries are done with
+ * (answered or given up on). They aren't used again till they're forgotten,
+ * so a resolver that sends an answer twice (or late) can't have it taken for
+ * the answer to a newer query. */
+#define DNS_RECENT_TRN_IDS   64
+
+/* The most domains queries can be striped across. */
+#define DNS_MAX_DOMAINS      8
+
+/* The most DNS servers (resolvers) queries can be spread across. */
+#define DNS_MAX_SERVERS      8
+
+/* A server that misses this many answers in a row is left out for
+ * DNS_SERVER_DOWN_TIME ms (unless every server is out). */
+#define DNS_SERVER_MAX_FAILURES 3
+#define DNS_SERVER_DOWN_TIME    10000
+
+/* How long (in ms) we trust a resolved DNS server address before looking
+ * it up again. */
+#define DNS_SERVER_ADDR_TTL  300000
+
+/* How long (in ms) to wait before retrying a failed lookup. */
+#define DNS_SERVER_ADDR_RETRY 1000
+
+/* The default and maximum UDP payload size we advertise with EDNS0 (0
+ * turns it off). 1232 avoids fragmentation on almost any path. */
+#define DNS_DEFAULT_EDNS_SIZE 1232
+#define DNS_MAX_EDNS_SIZE     4096
+
+/* The biggest response over TCP (its length is 16 bits). */
+#define DNS_TCP_MAX_SIZE      65535
+
+/* How long (in ms) a server whose TCP connection failed gets UDP instead
+ * (or, with DoT or DoH, before we try it again). */
+#define DNS_TCP_RETRY_TIME    30000
+#define DNS_SECURE_RETRY_TIME 2000
+
+/* Responses are parsed into an arena that's reset after each one; this is
+ * enough for the biggest response we advertise, so it never has to grow. */
+#define DNS_ARENA_SIZE        (DNS_MAX_EDNS_SIZE * 2)
+
+/* The startup path probe (see driver_dns_probe()): it sends each query
+ * DNS_PROBE_COUNT times, and waits up to DNS_PROBE_TIMEOUT ms for a round
+ * of them to come back. */
+#define DNS_PROBE_COUNT      3
+#define DNS_PROBE_TIMEOUT    1500
+
+/* The size of the small probes (small enough for any record type's answer),
+ * and the biggest (more than fits in any name). */
+#define DNS_PROBE_SMALL      16
+#define DNS_PROBE_MAX_LENGTH 256
+
+/* The poll interval the probe picks is this many round trips, within these
+ * bounds (in ms). */
+#define DNS_PROBE_RTTS       4
+#define DNS_PROBE_MIN_DELAY  100
+#define DNS_PROBE_MAX_DELAY  1000
+
+/* How long (in seconds) a cached probe result is used for. */
+#define DNS_PROBE_CACHE_TTL  86400
+
+/* One of the domains we make requests for; name is NULL if there isn't
+ * one (the queries are sent straight to the server). */
+typedef struct
+{
+  char            *name;
+
+  /* name, already converted to the wire format's labels. */
+  uint8_t          labels[256];
+  size_t           labels_length;
+
+  /* How much data fits in one query for this domain (shorter domains leave
+   * more room). */
+  size_t           max_length;
+} dns_domain_t;
+
+/* One of the DNS servers we send queries through. */
+typedef struct
+{
+  char            *name;
+
+  /* name, resolved; re-resolved after DNS_SERVER_ADDR_TTL or an error. */
+  udp_addr_t       addr;
+  NBBOOL           addr_valid;
+  uint64_t         addr_time;
+
+  /* How it's been doing: srtt is a smoothed round-trip time in ms (0 till
+   * the first answer), and loss is the smoothed fraction of queries that
+   * went unanswered, out of 256. */
+  int              srtt;
+  int              loss;
+  int              failures;
+  uint64_t         down_until;
+
+  /* Our TCP connection to it, if there is one (tcp_s is -1 otherwise): the
+   * part of a response that's arrived so far, and the queries the socket
+   * hasn't taken yet. It isn't tried again till tcp_retry_at. */
+  int              tcp_s;
+  NBBOOL           tcp_connected;
+  buffer_t        *tcp_incoming;
+  ring_buffer_t   *tcp_outgoing;
+  uint64_t         tcp_retry_at;
+
+#ifdef USE_TLS
+  /* With DoT or DoH, the connection's TLS (tcp_incoming is the plaintext
+   * then). */
+  tls_t           *tls;
+#endif
+} dns_server_t;
+
+/* One of the path probe's queries: a PING (which the server echoes back)
+ * of the given type and length, and whether it came back unchanged. */
+typedef struct
+{
+  dns_server_t    *server;
+  dns_type_t       type;
+  size_t           length;
+
+  uint8_t          data[DNS_PROBE_MAX_LENGTH];
+  NBBOOL           ok;
+} dns_probe_query_t;
+
+/* What the path probe decided on (and what's kept in the cache). */
+typedef struct
+{
+  dns_type_t       types[DNS_MAX_TYPES];
+  size_t           type_count;
+  dns_encoding_t   encoding;
+
+  /* The most data that made it through in one query (0 if it's just what
+   * the name has room for). */
+  size_t           max_length;
+
+  uint16_t         edns_size;
+  size_t           pipeline;
+  int              delay;
+} dns_probe_result_t;
+
+/* A query that's waiting for a response. */
+typedef struct
+{
+  NBBOOL           in_use;
+  uint16_t         trn_id;
+  uint64_t         sent_time;
+  dns_server_t    *server;
+  dns_domain_t    *domain;
+  NBBOOL           via_tcp;
+
+  /* If it's one of the path probe's, rather than a session's. */
+  dns_probe_query_t *probe;
+} dns_pending_t;
+
+/* Running totals, for the stats command (see driver_dns_get_stats()). */
+typedef struct
+{
+  uint32_t         queries_sent;
+  uint32_t         responses;
+
+  /* Queries we gave up waiting on, and responses to queries we never sent
+   * (or sent too long ago to remember). */
+  uint32_t         timeouts;
+  uint32_t         unexpected_responses;
+
+  /* Responses to queries we'd just finished with: either copies of an answer
+   * (resolvers repeat themselves sometimes) or late answers to queries we
+   * gave up on. */
+  uint32_t         duplicate_responses;
+
+  /* Responses with an error, by RCODE, and ones that were fine but had no
+   * answer in them. */
+  uint32_t         errors[16];
+  uint32_t         empty_responses;
+
+  /* Everything else, by the type of the answer. */
+  uint32_t         txt_responses;
+  uint32_t         cname_responses;
+  uint32_t         mx_responses;
+  uint32_t         a_responses;
+  uint32_t         aaaa_responses;
+  uint32_t         other_responses;
+
+  /* Queries that went over TCP, UDP responses that came back truncated, and
+   * TCP connections that failed. */
+  uint32_t         tcp_queries;
+  uint32_t         truncated_responses;
+  uint32_t         tcp_failures;
+
+  /* How many batches the UDP queries went out in, and the responses came in
+   * (queries_sent / send_batches is how many go per system call). */
+  uint32_t         send_batches;
+  uint32_t         recv_batches;
+} driver_dns_stats_t;
+
 typedef struct
 {
   int              s;
 
   select_group_t  *group;
-  char            *domain;
-  char            *dns_server;
+
+  /* Queries take turns going to each domain (there's always at least one,
+   * even if it's just NULL). */
+  dns_domain_t     domains[DNS_MAX_DOMAINS];
+  size_t           domain_count;
+  size_t           next_domain;
+  /* Queries are spread across the servers, favouring the ones that answer
+   * quickly and reliably. */
+  dns_server_t     servers[DNS_MAX_SERVERS];
+  size_t           server_count;
   int              dns_port;
 
   NBBOOL           is_closed;
@@ -45,10 +316,78 @@ typedef struct
   dns_type_t       types[DNS_MAX_TYPES];
   size_t           type_count;
 
+  /* How the data in our queries is encoded. */
+  dns_encoding_t   encoding;
+
+  dns_pending_t    pending[DNS_MAX_PIPELINE];
+  size_t           pipeline;
+
+  /* The ids of the last DNS_RECENT_TRN_IDS queries to finish, in a ring
+   * (recent_trn_id_count of them are filled in). */
+  uint16_t         recent_trn_ids[DNS_RECENT_TRN_IDS];
+  size_t           recent_trn_id_count;
+  size_t           next_recent_trn_id;
+
+  /* The UDP queries from this round of sending, which all go out together
+   * at the end of it, and the servers they're going to. */
+  udp_datagram_t   udp_batch[DNS_MAX_PIPELINE];
+  dns_server_t    *udp_batch_servers[DNS_MAX_PIPELINE];
+  size_t           udp_batch_count;
+  uint8_t         *udp_batch_data;
+
+  /* The UDP payload size we advertise with EDNS0, or 0. */
+  uint16_t         edns_size;
+
+  /* When to use TCP, and (for DNS_TCP_AUTO) whether the answers have
+   * outgrown UDP right now. */
+  dns_tcp_mode_t   tcp_mode;
+  NBBOOL           use_tcp;
+
+  /* DoT or DoH, the path DoH requests go to, and whether we check the
+   * servers' certificates. */
+  dns_secure_t     secure;
+  char            *doh_path;
+  NBBOOL           verify;
+
+  /* Whether to probe the path before the sessions start, and the file to
+   * keep the result in (or NULL). */
+  NBBOOL           probe;
+  char            *probe_cache;
+
+  /* The timer that wakes us up for the next send, or -1. */
+  int              send_timer;
+
+  /* Where incoming responses are parsed. */
+  arena_t         *arena;
+
+  driver_dns_stats_t stats;
+
 } driver_dns_t;
 
-driver_dns_t *driver_dns_create(select_group_t *group, char *domain, char *host, uint16_t port, char *types, char *server);
-void          driver_dns_destroy();
+driver_dns_t *driver_dns_create(select_group_t *group, char **domains, size_t domain_count, char *host, uint16_t port, char *types, char **servers, size_t server_count, size_t pipeline, char *encoding, uint16_t edns_size, char *tcp_mode, char *secure, char *doh_path, NBBOOL verify, NBBOOL probe, char *probe_cache);
+void          driver_dns_destroy(driver_dns_t *driver);
 void          driver_dns_go(driver_dns_t *driver);
 
+/* If the driver was created with probe set, find out what the path to the
+ * server can take (each resolver's round trip and loss, which record types
+ * and encodings get through unchanged, how much fits in a name, whether
+ * EDNS0 works and how many queries can be in flight) and set the driver up
+ * to match; with a probe_cache, the result is saved there and used instead
+ * of probing next time. Returns the poll interval it'd suggest (for
+ * session_set_delay()), or 0. */
+int           driver_dns_probe(driver_dns_t *driver);
+
+/* Report the counters in driver_dns_stats_t (and each server's smoothed
+ * round trip and loss) to callback; driver is a driver_dns_t. This is a
+ * controller_stats_func_t, for controller_set_tunnel_stats(). */
+void          driver_dns_get_stats(void *driver, stats_callback_t *callback, void *param);
+
+#ifndef NO_ADDRESS_TYPES
+/* Put the data from an A or AAAA response (dns has at least one answer) back
+ * together into out, and set out_length. Returns FALSE if there are gaps in
+ * the sequence numbers or repeats, or the pieces don't add up to the length
+ * (or it doesn't fit in max_length). */
+NBBOOL        driver_dns_decode_addresses(dns_t *dns, uint8_t *out, size_t max_length, size_t *out_length);
+#endif
+
 #endif
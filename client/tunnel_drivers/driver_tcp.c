@@ -0,0 +1,330 @@
+/* driver_tcp.c
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ */
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#else
+#include <errno.h>
+#endif
+
+#include "controller/controller.h"
+#include "libs/log.h"
+#include "libs/memory.h"
+#include "libs/tcp.h"
+#include "libs/types.h"
+
+#include "driver_tcp.h"
+
+/* Give up on the connection (closing the socket, if it's still open);
+ * driver_tcp_go() returns once it notices. */
+static void fail(driver_tcp_t *driver, char *reason)
+{
+  if(driver->is_failed)
+    return;
+
+  LOG_ERROR("TCP connection to %s:%d failed: %s", driver->host, driver->port, reason);
+  driver->is_failed    = TRUE;
+  driver->is_connected = FALSE;
+
+  if(driver->s != -1)
+  {
+    select_group_remove_and_close_socket(driver->group, driver->s);
+    driver->s = -1;
+  }
+
+  if(driver->connect_timer >= 0)
+  {
+    select_group_cancel_timer(driver->group, driver->connect_timer);
+    driver->connect_timer = -1;
+  }
+}
+
+/* Give the socket as much of the outgoing data as it'll take. */
+static void flush_outgoing(driver_tcp_t *driver)
+{
+  uint8_t *data;
+  size_t   length;
+  ssize_t  sent;
+
+  while(driver->is_connected && ring_buffer_get_length(driver->outgoing) > 0)
+  {
+    length = ring_buffer_peek(driver->outgoing, 0, &data);
+    sent   = tcp_send(driver->s, data, length);
+
+    if(sent < 0)
+    {
+#ifdef WIN32
+      if(WSAGetLastError() == WSAEWOULDBLOCK)
+#else
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+#endif
+        return;
+
+      fail(driver, "couldn't send");
+      return;
+    }
+
+    ring_buffer_consume(driver->outgoing, sent);
+  }
+}
+
+/* Send a single packet; returns FALSE if the controller didn't have anything
+ * to send. */
+static NBBOOL send_packet(driver_tcp_t *driver)
+{
+  uint8_t  header[2];
+  size_t   length;
+  uint8_t *data = controller_get_outgoing(&length, TCP_MAX_LENGTH);
+
+  /* If we aren't supposed to send anything (like we're waiting for a timeout),
+   * data is NULL. */
+  if(!data)
+    return FALSE;
+
+  assert(length > 0); /* Make sure they aren't trying to send 0 bytes. */
+  assert(length <= TCP_MAX_LENGTH);
+
+  LOG_INFO("Sending a TCP packet with %zu bytes of data to %s:%d", length, driver->host, driver->port);
+
+  header[0] = (uint8_t)(length >> 8);
+  header[1] = (uint8_t)(length & 0xFF);
+  ring_buffer_add_bytes(driver->outgoing, header, 2);
+  ring_buffer_add_bytes(driver->outgoing, data, length);
+  safe_free(data);
+
+  driver->in_flight++;
+  driver->stats.packets_sent++;
+  driver->stats.bytes_sent += length;
+
+  return TRUE;
+}
+
+/* Keep sending till either the pipeline is full or there's nothing left to
+ * send (the controller rotates through the sessions on each call). */
+static void do_send(driver_tcp_t *driver)
+{
+  while(driver->is_connected && driver->in_flight < driver->pipeline)
+    if(!send_packet(driver))
+      break;
+
+  flush_outgoing(driver);
+}
+
+static SELECT_RESPONSE_t send_timer_callback(void *group, void *param)
+{
+  /* The timer only has to wake up the main loop, which does the sending. */
+  ((driver_tcp_t*)param)->send_timer = -1;
+
+  return SELECT_OK;
+}
+
+/* Set a timer for the next time we might have something to do: a session
+ * wants to transmit, or the socket might take the rest of our data. */
+static void schedule_send(driver_tcp_t *driver)
+{
+  int delay = controller_get_next_transmit_ms();
+
+  if(ring_buffer_get_length(driver->outgoing) > 0)
+    delay = MIN(delay, TCP_SEND_RETRY);
+
+  if(driver->send_timer >= 0)
+    select_group_cancel_timer(driver->group, driver->send_timer);
+  driver->send_timer = select_group_add_timer(driver->group, MAX(delay, 0), 0, send_timer_callback, driver);
+}
+
+static SELECT_RESPONSE_t connect_timer_callback(void *group, void *param)
+{
+  driver_tcp_t *driver = (driver_tcp_t*) param;
+
+  driver->connect_timer = -1;
+  fail(driver, "timed out");
+
+  return SELECT_OK;
+}
+
+static SELECT_RESPONSE_t tcp_ready(void *group, int s, void *param)
+{
+  driver_tcp_t *driver = (driver_tcp_t*) param;
+
+  LOG_WARNING("Connected to %s:%d over TCP", driver->host, driver->port);
+  driver->is_connected = TRUE;
+
+  if(driver->connect_timer >= 0)
+  {
+    select_group_cancel_timer(driver->group, driver->connect_timer);
+    driver->connect_timer = -1;
+  }
+
+  return SELECT_OK;
+}
+
+static SELECT_RESPONSE_t tcp_data_in(void *group, int s, uint8_t *data, size_t length, char *addr, uint16_t port, void *param)
+{
+  driver_tcp_t *driver   = (driver_tcp_t*) param;
+  NBBOOL        answered = FALSE;
+  size_t        packet_length;
+  uint8_t      *packet;
+
+  buffer_add_bytes(driver->incoming, data, length);
+
+  /* Pass along every whole packet we have. */
+  while(!driver->is_failed && buffer_get_remaining_bytes(driver->incoming) >= 2)
+  {
+    packet_length = buffer_peek_next_int16(driver->incoming);
+    if(buffer_get_remaining_bytes(driver->incoming) < packet_length + 2)
+      break;
+
+    buffer_read_next_int16(driver->incoming);
+    packet = buffer_read_remaining_bytes_view(driver->incoming, &packet_length, packet_length, TRUE);
+
+    /* Each packet answers one of ours. */
+    if(driver->in_flight > 0)
+      driver->in_flight--;
+    driver->stats.packets_received++;
+    driver->stats.bytes_received += packet_length;
+
+    LOG_INFO("TCP packet received (%zu bytes)", packet_length);
+
+    if(packet_length == 0)
+    {
+      driver->stats.empty_responses++;
+      answered = TRUE;
+    }
+    else if(controller_data_incoming(packet, packet_length))
+    {
+      answered = TRUE;
+    }
+  }
+
+  /* Keep only the partial packet (if any), or the buffer grows as long as the
+   * connection stays up. */
+  buffer_compact(driver->incoming);
+
+  if(answered)
+    do_send(driver);
+
+  return SELECT_OK;
+}
+
+static SELECT_RESPONSE_t tcp_closed(void *group, int s, void *param)
+{
+  driver_tcp_t *driver = (driver_tcp_t*) param;
+
+  /* The socket's being taken care of. */
+  tcp_close(driver->s);
+  driver->s = -1;
+  fail(driver, "the server closed the connection");
+
+  return SELECT_REMOVE;
+}
+
+static SELECT_RESPONSE_t tcp_error(void *group, int s, int err, void *param)
+{
+  driver_tcp_t *driver = (driver_tcp_t*) param;
+  char          reason[32];
+
+  tcp_close(driver->s);
+  driver->s = -1;
+  sprintf(reason, "error %d", err);
+  fail(driver, reason);
+
+  return SELECT_REMOVE;
+}
+
+driver_tcp_t *driver_tcp_create(select_group_t *group, char *host, uint16_t port, size_t pipeline)
+{
+  driver_tcp_t *driver = (driver_tcp_t*) safe_malloc(sizeof(driver_tcp_t));
+
+  driver->group         = group;
+  driver->host          = safe_strdup(host);
+  driver->port          = port;
+  driver->pipeline      = MAX(1, MIN(pipeline, TCP_MAX_PIPELINE));
+  driver->incoming      = buffer_create(BO_BIG_ENDIAN);
+  driver->outgoing      = ring_buffer_create(0);
+  driver->send_timer    = -1;
+  driver->connect_timer = -1;
+
+  LOG_INFO("Connecting to %s:%d over TCP", host, port);
+  driver->s = tcp_connect_options(host, port, TRUE);
+  if(driver->s == -1)
+  {
+    fail(driver, "couldn't connect");
+    return driver;
+  }
+
+  /* Every packet waits on its answer, so they can't wait on each other. */
+  tcp_set_nodelay(driver->s);
+
+  select_group_add_socket(group, driver->s, SOCKET_TYPE_STREAM, driver);
+  select_set_recv(group, driver->s, tcp_data_in);
+  select_set_ready(group, driver->s, tcp_ready);
+  select_set_closed(group, driver->s, tcp_closed);
+  select_set_error(group, driver->s, tcp_error);
+
+  driver->connect_timer = select_group_add_timer(group, TCP_CONNECT_TIMEOUT, 0, connect_timer_callback, driver);
+
+  return driver;
+}
+
+void driver_tcp_destroy(driver_tcp_t *driver)
+{
+  if(driver->s != -1)
+    select_group_remove_and_close_socket(driver->group, driver->s);
+  if(driver->send_timer >= 0)
+    select_group_cancel_timer(driver->group, driver->send_timer);
+  if(driver->connect_timer >= 0)
+    select_group_cancel_timer(driver->group, driver->connect_timer);
+
+  buffer_destroy(driver->incoming);
+  ring_buffer_destroy(driver->outgoing);
+  safe_free(driver->host);
+  safe_free(driver);
+}
+
+static void report_stat(stats_callback_t *callback, void *param, char *name, uint32_t value)
+{
+  char full_name[64];
+
+  sprintf(full_name, "tcp.%s", name);
+  callback(full_name, value, param);
+}
+
+void driver_tcp_get_stats(void *d, stats_callback_t *callback, void *param)
+{
+  driver_tcp_t       *driver = (driver_tcp_t*) d;
+  driver_tcp_stats_t *stats  = &driver->stats;
+
+  report_stat(callback, param, "packets_sent",     stats->packets_sent);
+  report_stat(callback, param, "packets_received", stats->packets_received);
+  report_stat(callback, param, "bytes_sent",       stats->bytes_sent);
+  report_stat(callback, param, "bytes_received",   stats->bytes_received);
+  report_stat(callback, param, "empty_responses",  stats->empty_responses);
+}
+
+void driver_tcp_go(driver_tcp_t *driver)
+{
+  /* Loop till the connection goes away: send whatever we can, then sleep
+   * till there's a response, some data, or it's time to retransmit. */
+  while(!driver->is_failed)
+  {
+    do_send(driver);
+    controller_heartbeat();
+    schedule_send(driver);
+
+    select_group_do_select(driver->group, -1);
+  }
+
+  if(driver->send_timer >= 0)
+  {
+    select_group_cancel_timer(driver->group, driver->send_timer);
+    driver->send_timer = -1;
+  }
+}
@@ -0,0 +1,102 @@
+/* driver_tcp.h
+ * By Ron Bowes
+ * Created October, 2026
+ *
+ * (See LICENSE.md)
+ *
+ * This is a "tunnel driver" for a plain TCP connection, for when one can be
+ * made straight to the server. It carries the same dnscat packets as the DNS
+ * driver, each prefixed with its length (a 16-bit big-endian integer), and
+ * the server answers each one the same way - with exactly one packet, which
+ * is empty if it has nothing to say. Since there's no resolver in the way,
+ * the packets can be much bigger, and several can be in flight at once.
+ *
+ * If the connection can't be made, or goes away, driver_tcp_go() returns,
+ * so the caller can carry on with another driver (the sessions don't care
+ * which driver their packets go over).
+ */
+
+#ifndef __DRIVER_TCP_H__
+#define __DRIVER_TCP_H__
+
+#include "libs/buffer.h"
+#include "libs/ring_buffer.h"
+#include "libs/select_group.h"
+#include "libs/types.h"
+
+/* The default port (the same as the server's). */
+#define TCP_DEFAULT_PORT     53531
+
+/* The most data we'll put in one packet; the server allows responses up to
+ * 32767 bytes. */
+#define TCP_MAX_LENGTH       16384
+
+/* The default and maximum number of packets we'll have in flight at once. */
+#define TCP_DEFAULT_PIPELINE 8
+#define TCP_MAX_PIPELINE     32
+
+/* How long (in ms) we wait for the connection before giving up on it. */
+#define TCP_CONNECT_TIMEOUT  5000
+
+/* How long (in ms) to wait before trying again when the socket won't take
+ * any more data. */
+#define TCP_SEND_RETRY       10
+
+/* Running totals, for the stats command (see driver_tcp_get_stats()). */
+typedef struct
+{
+  uint32_t         packets_sent;
+  uint32_t         packets_received;
+  uint32_t         bytes_sent;
+  uint32_t         bytes_received;
+
+  /* Responses that were empty (the server had nothing to say). */
+  uint32_t         empty_responses;
+} driver_tcp_stats_t;
+
+typedef struct
+{
+  int              s;
+
+  select_group_t  *group;
+
+  char            *host;
+  uint16_t         port;
+
+  /* Set once the connection's been made, and once it's failed or closed
+   * (after which it's never used again). */
+  NBBOOL           is_connected;
+  NBBOOL           is_failed;
+
+  /* The bytes that have arrived that don't make up a whole packet yet. */
+  buffer_t        *incoming;
+
+  /* Packets (with their lengths) that the socket hasn't taken yet. */
+  ring_buffer_t   *outgoing;
+
+  /* How many packets have been sent without being answered, and the most
+   * that can be. */
+  size_t           in_flight;
+  size_t           pipeline;
+
+  /* The timer that wakes us up for the next send, or -1. */
+  int              send_timer;
+
+  /* The timer that gives up on the connection, or -1. */
+  int              connect_timer;
+
+  driver_tcp_stats_t stats;
+} driver_tcp_t;
+
+driver_tcp_t *driver_tcp_create(select_group_t *group, char *host, uint16_t port, size_t pipeline);
+void          driver_tcp_destroy(driver_tcp_t *driver);
+
+/* Run the driver till the connection fails or closes. */
+void          driver_tcp_go(driver_tcp_t *driver);
+
+/* Report the counters in driver_tcp_stats_t to callback; driver is a
+ * driver_tcp_t. This is a controller_stats_func_t, for
+ * controller_set_tunnel_stats(). */
+void          driver_tcp_get_stats(void *driver, stats_callback_t *callback, void *param);
+
+#endif
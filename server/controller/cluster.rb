@@ -0,0 +1,340 @@
+##
+# cluster.rb
+# Created October, 2026
+# By Ron Bowes
+#
+# See: LICENSE.md
+#
+# Lets several servers share the load for the same domains (with an NS record
+# pointing at each of them). Resolvers send a session's queries to whichever
+# of them they like, so every session belongs to one node - its session_id
+# modulo the number of nodes - and only the owner has its state (sequence
+# numbers, what's queued up, keys, and its window). A node that gets a packet
+# for somebody else's session passes it to the owner over TCP, and answers the
+# query with whatever comes back.
+#
+# Each request on the link is:
+# - (uint32_t) id
+# - (uint16_t) max_length
+# - (uint8_t)  hold - 1 if the owner can sit on it for a while (a long poll)
+# - (uint32_t) length, then the packet
+#
+# and each response:
+# - (uint32_t) id
+# - (uint8_t)  has_answer - 0 if the owner isn't answering it
+# - (uint32_t) length, then the answer
+#
+# Held polls are answered late, so responses don't come back in order.
+#
+# Nothing on the link is encrypted or authenticated, but it's no more than
+# anybody could send to our DNS port; keep it on a private network anyway.
+##
+
+require 'socket'
+require 'thread'
+
+require 'controller/packet'
+
+class Cluster
+  # How long a packet waits for its owner to answer (a bit longer than a poll
+  # can be held for); after that, the client just has to send it again
+  TIMEOUT = 3
+
+  attr_reader :node, :nodes
+
+  # peers is each node's host:port, which has to be the same - in the same
+  # order - on every node; node is which of them we are. handler is called
+  # with the packets that other nodes pass us, like a tunnel driver's.
+  def initialize(parent_window, node, peers, &handler)
+    if(peers.length == 0)
+      raise(ArgumentError, "A cluster needs at least one peer")
+    end
+    if(node < 0 || node >= peers.length)
+      raise(ArgumentError, "node has to be between 0 and #{peers.length - 1}")
+    end
+
+    @node  = node
+    @nodes = peers.map() do |peer|
+      host, port = peer.split(/:/, 2)
+      if(port.nil?)
+        raise(ArgumentError, "Peers look like host:port, not '#{peer}'")
+      end
+
+      [host, port.to_i()]
+    end
+
+    @handler = handler
+    @mutex   = Mutex.new()
+    @links   = {}
+    @pending = {}
+    @next_id = 0
+
+    # Connecting to (and writing to) each peer has its own lock, so a peer
+    # that's down doesn't hold up the rest
+    @peer_locks = @nodes.map() { Mutex.new() }
+
+    host, port = @nodes[@node]
+    @server = TCPServer.new(host, port)
+
+    @window = SWindow.new(parent_window, false, {
+      :id => 'cluster',
+      :name => "Cluster node #{@node} (of #{@nodes.length}) on #{host}:#{port}",
+      :noinput => true,
+    })
+
+    @window.with({:to_ancestors => true}) do
+      @window.puts("This is node #{@node} of a #{@nodes.length}-node cluster; sessions where session_id % #{@nodes.length} == #{@node} live here, and the rest are passed along")
+      @window.puts("")
+    end
+
+    @thread = Thread.new() do
+      begin
+        loop do
+          Thread.start(@server.accept()) do |s|
+            _handle_connection(s)
+          end
+        end
+      rescue IOError
+        # The server was stopped
+      end
+    end
+  end
+
+  def owner(session_id)
+    return session_id % @nodes.length
+  end
+
+  def mine?(session_id)
+    return owner(session_id) == @node
+  end
+
+  # Pass a packet to its session's owner. With hold (a proc, see
+  # Controller#feed), this returns nil right away and the answer goes to hold
+  # once it's here (if it ever is); without it, this waits for the answer.
+  def forward(session_id, data, max_length, hold = nil)
+    if(!hold.nil?)
+      _send(owner(session_id), data, max_length, hold, true)
+      return nil
+    end
+
+    lock     = Mutex.new()
+    done     = ConditionVariable.new()
+    answered = false
+    response = nil
+
+    lock.synchronize() do
+      _send(owner(session_id), data, max_length, Proc.new() do |r|
+        lock.synchronize() do
+          response = r
+          answered = true
+          done.signal()
+        end
+      end, false)
+
+      deadline = Time.now() + TIMEOUT
+      while(!answered && Time.now() < deadline)
+        done.wait(lock, deadline - Time.now())
+      end
+    end
+
+    return response
+  end
+
+  def _read(s, length)
+    data = s.read(length)
+    if(data.nil? || data.length != length)
+      raise(IOError, "Connection closed")
+    end
+
+    return data
+  end
+
+  # Forget about packets that are never going to be answered
+  def _expire()
+    now = Time.now()
+    @pending.delete_if() { |id, pending| pending[:expires] < now }
+  end
+
+  # Get the link to another node, connecting if we have to (and starting a
+  # thread to read its answers); has to be called with that node's lock in
+  # @peer_locks held
+  def _link(node)
+    s = @mutex.synchronize() { @links[node] }
+    if(s)
+      return s
+    end
+
+    host, port = @nodes[node]
+    s = Socket.tcp(host, port, :connect_timeout => TIMEOUT)
+    s.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+    @mutex.synchronize() { @links[node] = s }
+
+    Thread.new() do
+      _read_responses(node, s)
+    end
+
+    return s
+  end
+
+  def _send(node, data, max_length, callback, hold)
+    id = @mutex.synchronize() do
+      _expire()
+
+      @next_id = (@next_id + 1) & 0xFFFFFFFF
+      @pending[@next_id] = {
+        :callback => callback,
+        :hold     => hold,
+        :expires  => Time.now() + TIMEOUT,
+      }
+
+      @next_id
+    end
+
+    @peer_locks[node].synchronize() do
+      begin
+        _link(node).write([id, max_length, hold ? 1 : 0, data.bytesize].pack("NnCN") + data)
+      rescue IOError, SystemCallError => e
+        @window.puts("Couldn't pass a packet to node #{node}: #{e.inspect}")
+
+        s = @mutex.synchronize() do
+          @pending.delete(id)
+          @links.delete(node)
+        end
+        if(s)
+          s.close() rescue nil
+        end
+      end
+    end
+  end
+
+  def _read_responses(node, s)
+    begin
+      loop do
+        id, has_answer, length = _read(s, 9).unpack("NCN")
+        response = _read(s, length)
+
+        pending = @mutex.synchronize() { @pending.delete(id) }
+        if(pending.nil?)
+          # Too late
+          next
+        end
+
+        # A held poll just doesn't get answered; anybody else is waiting
+        if(has_answer == 1)
+          pending[:callback].call(response)
+        elsif(!pending[:hold])
+          pending[:callback].call(nil)
+        end
+      end
+    rescue IOError, SystemCallError => e
+      @window.puts("Lost the link to node #{node}: #{e.inspect}")
+    rescue StandardError => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Error caught (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
+      end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+    ensure
+      @mutex.synchronize() do
+        if(@links[node].equal?(s))
+          @links.delete(node)
+        end
+      end
+      s.close() rescue nil
+    end
+  end
+
+  # Answer the packets another node passes us
+  def _handle_connection(s)
+    @window.puts("Received a connection from node #{s.peeraddr[3]}:#{s.peeraddr[1]}")
+    write_lock = Mutex.new()
+
+    begin
+      s.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+
+      loop do
+        header = s.read(11)
+        if(header.nil?)
+          break
+        end
+        if(header.length != 11)
+          raise(IOError, "Connection closed while reading a packet")
+        end
+
+        id, max_length, hold, length = header.unpack("NnCN")
+        data = _read(s, length)
+
+        reply = Proc.new() do |r|
+          begin
+            write_lock.synchronize() do
+              s.write([id, r.nil? ? 0 : 1, (r || '').bytesize].pack("NCN") + (r || ''))
+            end
+          rescue IOError, SystemCallError
+            # They'll find out when they read
+          end
+        end
+
+        # One that blows up just doesn't get answered; the rest of the
+        # sessions on the link keep going
+        begin
+          # If the other node disagrees about who owns what, passing it back
+          # would just go around in circles
+          if(!mine?(Packet.peek_session_id(data)))
+            @window.puts("Node #{s.peeraddr[3]}:#{s.peeraddr[1]} sent us session #{Packet.peek_session_id(data)}, which isn't ours; check that every node has the same peers")
+            reply.call(nil)
+            next
+          end
+
+          response = @handler.call(data, max_length, hold == 1 ? reply : nil)
+        rescue StandardError => e
+          @window.puts("Error handling a packet from node #{s.peeraddr[3]}:#{s.peeraddr[1]}: #{e.inspect}")
+          e.backtrace.each do |bt|
+            @window.puts(bt)
+          end
+          reply.call(nil)
+          next
+        end
+
+        if(!response.nil? || hold == 0)
+          reply.call(response)
+        end
+      end
+
+      @window.puts("Connection closed")
+    rescue IOError, SystemCallError => e
+      @window.puts("Connection error: #{e.inspect}")
+    rescue DnscatException => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Protocol exception caught in the cluster module (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
+      end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+    rescue StandardError => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Error caught (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
+      end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+    ensure
+      s.close() rescue nil
+    end
+  end
+
+  def stop()
+    @server.close()
+    @thread.join()
+
+    @mutex.synchronize() do
+      @links.each_value() { |s| s.close() rescue nil }
+      @links = {}
+    end
+
+    @window.close()
+  end
+end
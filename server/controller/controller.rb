@@ -19,11 +19,20 @@ require 'trollop'
 class Controller
   include ControllerCommands
 
+  # Don't bother answering a packet in a bundle if its share of the response
+  # would be smaller than this; the client will just re-send it later
+  BUNDLE_MIN_ROOM = 32
+
   attr_accessor :window
 
+  # If we're part of a cluster (see controller/cluster.rb), packets for
+  # sessions that belong to other nodes go to them
+  attr_accessor :cluster
+
   def initialize()
     @commander = Commander.new()
     @sessions = {}
+    @cluster = nil
 
     _register_commands()
 
@@ -78,7 +87,49 @@ class Controller
     return @sessions
   end
 
-  def feed(data, max_length)
+  # Each packet in the bundle gets an equal share of the response (after the
+  # length of every entry, since even the empty ones have one; if there isn't
+  # room for all of those, the ones at the end are left off, and the client
+  # sends them again)
+  def _feed_bundle(data, max_length)
+    packets = Packet.parse_bundle(data)
+    if(packets.length == 0)
+      return Packet.create_bundle([])
+    end
+
+    packets = packets.take([(max_length - Packet::BUNDLE_HEADER_SIZE) / Packet::BUNDLE_ENTRY_SIZE, 0].max())
+    room = max_length - Packet::BUNDLE_HEADER_SIZE - (packets.length * Packet::BUNDLE_ENTRY_SIZE)
+    count = [packets.length, room / BUNDLE_MIN_ROOM].min()
+    share = room / [count, 1].max()
+
+    # One that blows up just gets an empty answer, like one we're not
+    # answering; the rest of the bundle is still answered
+    responses = packets.each_with_index.map() do |packet, i|
+      begin
+        if(i >= count || Packet.peek_type(packet) == Packet::MESSAGE_TYPE_BUNDLE)
+          ''
+        else
+          feed(packet, share) || ''
+        end
+      rescue StandardError => e
+        WINDOW.puts("Error handling a packet in a bundle: #{e.inspect}")
+        e.backtrace.each do |bt|
+          WINDOW.puts(bt)
+        end
+        ''
+      end
+    end
+
+    return Packet.create_bundle(responses)
+  end
+
+  # hold is passed along to the session (see Session#feed); bundles and pings
+  # are always answered right away
+  def feed(data, max_length, hold = nil)
+    if(Packet.peek_type(data) == Packet::MESSAGE_TYPE_BUNDLE)
+      return _feed_bundle(data, max_length)
+    end
+
     # If it's a ping packet, handle it up here
     if(Packet.peek_type(data) == Packet::MESSAGE_TYPE_PING)
       WINDOW.puts("Responding to ping packet: #{Packet.parse(data).body}")
@@ -86,8 +137,12 @@ class Controller
     end
 
     session_id = Packet.peek_session_id(data)
+    if(@cluster && !@cluster.mine?(session_id))
+      return @cluster.forward(session_id, data, max_length, hold)
+    end
+
     session = _get_or_create_session(session_id)
 
-    return session.feed(data, max_length)
+    return session.feed(data, max_length, hold)
   end
 end
@@ -170,6 +170,7 @@ module ControllerCommands
                "  start --dns domain=skullseclabs.org\n" +
                "  start --dns domain=skullseclabs.org,port=53\n" +
                "  start --dns domain=skullseclabs.org,port=5353,host=127.0.0.1\n" +
+               "  start --dns domain=skullseclabs.org,workers=4\n" +
                "\n" +
                "To stop a driver, simply use the 'kill' command on the window\n" +
                "it created (td1, td2, etc)\n" +
@@ -185,7 +186,7 @@ module ControllerCommands
         end
 
         begin
-          dns = CommandHelpers.parse_setting_string(opts[:dns], { :host => "0.0.0.0", :port => "53", :domains => [], :domain => [] })
+          dns = CommandHelpers.parse_setting_string(opts[:dns], { :host => "0.0.0.0", :port => "53", :domains => [], :domain => [], :workers => "0" })
           dns[:domains] = dns[:domains] + dns[:domain]
         rescue ArgumentError => e
           WINDOW.puts("Couldn't parse setting:")
@@ -196,7 +197,7 @@ module ControllerCommands
         TunnelDrivers.start({
           :controller => self,
           :driver     => DriverDNS,
-          :args       => [dns[:host], dns[:port], dns[:domains], opts[:cache]]
+          :args       => [dns[:host], dns[:port], dns[:domains], opts[:cache], dns[:workers].to_i]
         })
       end
     )
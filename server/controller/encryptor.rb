@@ -22,6 +22,13 @@ class Encryptor
 
   ECDH_GROUP = ECDSA::Group::Nistp256
 
+  # How far behind the newest nonce the client's can be; with several queries
+  # in flight (or several servers in a cluster), they don't always show up in
+  # the order they were sent. Which ones in the window we've seen is kept in
+  # :their_nonces_seen (bit n is their_nonce - n), so none of them can be
+  # replayed.
+  NONCE_WINDOW = 64
+
   @@window = SWindow.new(WINDOW, false, { :noinput => true, :id => "crypto-debug", :name => "Debug window for crypto stuff"})
   @@window.puts("This window is for debugging encryption problems!")
   @@window.puts("In general, you can ignore it. :)")
@@ -63,6 +70,7 @@ class Encryptor
     @keys = {
       :my_nonce            => -1,
       :their_nonce         => -1,
+      :their_nonces_seen   => 0,
       :my_private_key      => nil,
       :my_public_key       => nil,
       :their_public_key    => nil,
@@ -90,6 +98,7 @@ class Encryptor
     @keys = {
       :my_nonce => -1,
       :their_nonce => -1,
+      :their_nonces_seen => 0,
     }
 
     if(ready?())
@@ -202,11 +211,18 @@ class Encryptor
 
     # Check the nonce *after* checking the signature (otherwise, we might update the nonce to a bad value and Bad Stuff happens)
     nonce_int = nonce.unpack("n").pop()
-    if(nonce_int < keys[:their_nonce])
-      @@window.puts("Client tried to use an invalid nonce: #{nonce_int} < #{keys[:their_nonce]}")
+    if(nonce_int > keys[:their_nonce])
+      keys[:their_nonces_seen] = ((keys[:their_nonces_seen] << (nonce_int - keys[:their_nonce])) | 1) & ((1 << NONCE_WINDOW) - 1)
+      keys[:their_nonce] = nonce_int
+    elsif(nonce_int <= keys[:their_nonce] - NONCE_WINDOW)
+      @@window.puts("Client tried to use an invalid nonce: #{nonce_int} <= #{keys[:their_nonce] - NONCE_WINDOW}")
+      raise(Encryptor::Error, "Invalid nonce!")
+    elsif(keys[:their_nonces_seen][keys[:their_nonce] - nonce_int] == 1)
+      @@window.puts("Client tried to re-use a nonce: #{nonce_int}")
       raise(Encryptor::Error, "Invalid nonce!")
+    else
+      keys[:their_nonces_seen] |= (1 << (keys[:their_nonce] - nonce_int))
     end
-    keys[:their_nonce] = nonce_int
 
     # Decrypt the body
     body = Salsa20.new(keys[:their_write_key], nonce.rjust(8, "\0")).decrypt(encrypted_body)
@@ -215,6 +231,25 @@ class Encryptor
     return header+body
   end
 
+  def _encrypt_packet_internal(keys, data)
+    #@@window.puts("Encrypting the response")
+
+    # Split the packet into a header and a body
+    header, body = data.unpack("a5a*")
+
+    # Encode the nonce properly
+    nonce = [keys[:my_nonce]].pack("n")
+
+    # Encrypt the body
+    encrypted_body = Salsa20.new(keys[:my_write_key], nonce.rjust(8, "\0")).encrypt(body)
+
+    # Sign it
+    signature = SHA3::Digest::SHA256.digest(keys[:my_mac_key] + header + nonce + encrypted_body)
+
+    # Arrange things appropriately
+    return [header, signature[0,6], nonce, encrypted_body].pack("a5a6a2a*")
+  end
+
   # By doing this as a single operation, we can always be sure that we're encrypting data
   # with the same key the client use to encrypt data
   def decrypt_and_encrypt(data)
@@ -255,22 +290,13 @@ class Encryptor
     end
 
     ## ** Encrypt
-    #@@window.puts("Encrypting the response")
-
-    # Split the packet into a header and a body
-    header, body = data.unpack("a5a*")
-
-    # Encode the nonce properly
-    nonce = [keys[:my_nonce]].pack("n")
-
-    # Encrypt the body
-    encrypted_body = Salsa20.new(keys[:my_write_key], nonce.rjust(8, "\0")).encrypt(body)
-
-    # Sign it
-    signature = SHA3::Digest::SHA256.digest(keys[:my_mac_key] + header + nonce + encrypted_body)
+    return _encrypt_packet_internal(keys, data)
+  end
 
-    # Arrange things appropriately
-    return [header, signature[0,6], nonce, encrypted_body].pack("a5a6a2a*")
+  # Encrypt a packet with the current keys (for one that isn't an answer to
+  # something the client encrypted, like the SYN that goes with an ENC INIT)
+  def encrypt_packet(data)
+    return _encrypt_packet_internal(@keys, data)
   end
 
   def my_authenticator()
@@ -29,7 +29,9 @@ class Packet
   MESSAGE_TYPE_MSG        = 0x01
   MESSAGE_TYPE_FIN        = 0x02
   MESSAGE_TYPE_PING       = 0xFF
+  MESSAGE_TYPE_BUNDLE     = 0xFE
   MESSAGE_TYPE_ENC        = 0x03
+  MESSAGE_TYPE_FEC        = 0x04
 
   OPT_NAME                = 0x0001
   # OPT_TUNNEL              = 0x0002 # Deprecated
@@ -37,13 +39,33 @@ class Packet
   # OPT_DOWNLOAD            = 0x0008 # Deprecated
   # OPT_CHUNKED_DOWNLOAD    = 0x0010 # Deprecated
   OPT_COMMAND             = 0x0020
+  # OPT_ENCRYPTED           = 0x0040 # Deprecated
+  OPT_WINDOWED            = 0x0080
+  OPT_COMPRESSED          = 0x0100
+  OPT_BUNDLED             = 0x0200
+  OPT_RESUMABLE           = 0x0400
+  OPT_RESUME              = 0x0800
+  OPT_LONG_POLL           = 0x1000
+  OPT_FEC                 = 0x2000
+  OPT_MSG_FLAGS           = 0x4000
+
+  # The most MSGs one FEC packet can cover
+  FEC_MAX_GROUP           = 16
+
+  # Resumption tickets (see OPT_RESUMABLE) are opaque blobs of this length
+  TICKET_LENGTH           = 16
+
+  # A bundle is a header (with session_id 0) followed by other packets, each
+  # prefixed with a 16-bit length
+  BUNDLE_HEADER_SIZE      = 5
+  BUNDLE_ENTRY_SIZE       = 2
 
   attr_reader :packet_id, :type, :session_id, :body
 
   class SynBody
     extend PacketHelper
 
-    attr_reader :seq, :options, :name
+    attr_reader :seq, :options, :name, :ack, :ticket, :long_poll, :fec_group
 
     def initialize(options, params = {})
       @options = options || raise(DnscatException, "options can't be nil!")
@@ -54,6 +76,30 @@ class Packet
       else
         @name = "(unnamed)"
       end
+
+      # The client only asks for a ticket, so it's up to the caller to pass
+      # one in when it's answering OPT_RESUMABLE
+      if((@options & OPT_RESUME) == OPT_RESUME)
+        @ack = params[:ack] || raise(DnscatException, "params[:ack] can't be nil when OPT_RESUME is set!")
+        @ticket = params[:ticket] || raise(DnscatException, "params[:ticket] can't be nil when OPT_RESUME is set!")
+      else
+        @ack = nil
+        @ticket = params[:ticket]
+      end
+
+      # How long (in ms) a poll can be held
+      if((@options & OPT_LONG_POLL) == OPT_LONG_POLL)
+        @long_poll = params[:long_poll] || raise(DnscatException, "params[:long_poll] can't be nil when OPT_LONG_POLL is set!")
+      else
+        @long_poll = nil
+      end
+
+      # The most MSGs one parity packet covers
+      if((@options & OPT_FEC) == OPT_FEC)
+        @fec_group = params[:fec_group] || raise(DnscatException, "params[:fec_group] can't be nil when OPT_FEC is set!")
+      else
+        @fec_group = nil
+      end
     end
 
     def SynBody.parse(data)
@@ -72,6 +118,25 @@ class Packet
         name = "[unnamed]"
       end
 
+      # A resumption SYN has an ACK and the ticket we gave out
+      ack = ticket = nil
+      if((options & OPT_RESUME) == OPT_RESUME)
+        at_least?(data, 2 + TICKET_LENGTH) || raise(DnscatException, "OPT_RESUME set, but no ticket given")
+        ack, ticket, data = data.unpack("na#{TICKET_LENGTH}a*")
+      end
+
+      long_poll = nil
+      if((options & OPT_LONG_POLL) == OPT_LONG_POLL)
+        at_least?(data, 2) || raise(DnscatException, "OPT_LONG_POLL set, but no time given")
+        long_poll, data = data.unpack("na*")
+      end
+
+      fec_group = nil
+      if((options & OPT_FEC) == OPT_FEC)
+        at_least?(data, 2) || raise(DnscatException, "OPT_FEC set, but no group given")
+        fec_group, data = data.unpack("na*")
+      end
+
       # Verify that that was the entire packet
       if(data.length > 0)
         raise(DnscatException, "Extra data on the end of an SYN packet :: #{data.unpack("H*")}")
@@ -80,6 +145,10 @@ class Packet
       return SynBody.new(options, {
         :seq          => seq,
         :name         => name,
+        :ack          => ack,
+        :ticket       => ticket,
+        :long_poll    => long_poll,
+        :fec_group    => fec_group,
       })
     end
 
@@ -94,6 +163,22 @@ class Packet
         result += [@name].pack("Z*")
       end
 
+      if((@options & OPT_RESUME) == OPT_RESUME)
+        result += [@ack].pack("n")
+      end
+
+      if(@ticket)
+        result += @ticket
+      end
+
+      if((@options & OPT_LONG_POLL) == OPT_LONG_POLL)
+        result += [@long_poll].pack("n")
+      end
+
+      if((@options & OPT_FEC) == OPT_FEC)
+        result += [@fec_group].pack("n")
+      end
+
       return result
     end
   end
@@ -101,24 +186,40 @@ class Packet
   class MsgBody
     extend PacketHelper
 
-    attr_reader :seq, :ack, :data
+    # With OPT_MSG_FLAGS, set when the sender has more data waiting than fit
+    FLAG_MORE = 0x01
+
+    attr_reader :seq, :ack, :flags, :data
 
     def initialize(options, params = {})
       @options = options
       @seq = params[:seq] || raise(DnscatException, "params[:seq] can't be nil!")
       @ack = params[:ack] || raise(DnscatException, "params[:ack] can't be nil!")
+      @flags = params[:flags] || 0
       @data = params[:data] || raise(DnscatException, "params[:data] can't be nil!")
     end
 
+    def MsgBody._has_flags?(options)
+      return !options.nil? && (options & OPT_MSG_FLAGS) == OPT_MSG_FLAGS
+    end
+
     def MsgBody.parse(options, data)
       at_least?(data, 4) || raise(DnscatException, "Packet is too short (MSG norm)")
 
       seq, ack = data.unpack("nn")
       data = data[4..-1] # Remove the first four bytes
 
+      flags = 0
+      if(_has_flags?(options))
+        at_least?(data, 1) || raise(DnscatException, "Packet is too short (MSG flags)")
+        flags = data.unpack("C").pop
+        data = data[1..-1]
+      end
+
       return MsgBody.new(options, {
         :seq   => seq,
         :ack   => ack,
+        :flags => flags,
         :data  => data,
       })
     end
@@ -132,14 +233,18 @@ class Packet
     end
 
     def to_s()
-      return "[[MSG]] :: seq = %04x, ack = %04x, data = 0x%x bytes" % [@seq, @ack, data.length]
+      return "[[MSG]] :: seq = %04x, ack = %04x, flags = %02x, data = 0x%x bytes" % [@seq, @ack, @flags, data.length]
     end
 
     def to_bytes()
       result = ""
       seq = @seq || 0
       ack = @ack || 0
-      result += [seq, ack, @data].pack("nna*")
+      result += [seq, ack].pack("nn")
+      if(MsgBody._has_flags?(@options))
+        result += [@flags].pack("C")
+      end
+      result += [@data].pack("a*")
 
       return result
     end
@@ -179,6 +284,51 @@ class Packet
     end
   end
 
+  # The XOR of a run of MSGs' data (each padded with zeroes to the longest);
+  # seq is the first one's, and the rest follow it with no gaps
+  class FecBody
+    extend PacketHelper
+
+    attr_reader :seq, :ack, :lengths, :parity
+
+    def initialize(options, params = {})
+      @options = options
+      @seq = params[:seq] || raise(DnscatException, "params[:seq] can't be nil!")
+      @ack = params[:ack] || raise(DnscatException, "params[:ack] can't be nil!")
+      @lengths = params[:lengths] || raise(DnscatException, "params[:lengths] can't be nil!")
+      @parity = params[:parity] || raise(DnscatException, "params[:parity] can't be nil!")
+
+      if(@lengths.length > FEC_MAX_GROUP)
+        raise(DnscatException, "An FEC packet can't cover more than #{FEC_MAX_GROUP} MSGs")
+      end
+    end
+
+    def FecBody.parse(options, data)
+      at_least?(data, 5) || raise(DnscatException, "Packet is too short (FEC)")
+
+      seq, ack, count, data = data.unpack("nnCa*")
+      at_least?(data, count * 2) || raise(DnscatException, "Packet is too short (FEC lengths)")
+
+      lengths = data.unpack("n#{count}")
+      data = data[(count * 2)..-1]
+
+      return FecBody.new(options, {
+        :seq     => seq,
+        :ack     => ack,
+        :lengths => lengths,
+        :parity  => data,
+      })
+    end
+
+    def to_s()
+      return "[[FEC]] :: seq = %04x, ack = %04x, lengths = %s, parity = 0x%x bytes" % [@seq, @ack, @lengths.join(","), @parity.length]
+    end
+
+    def to_bytes()
+      return [@seq, @ack, @lengths.length].pack("nnC") + @lengths.pack("n*") + @parity
+    end
+  end
+
   class PingBody
     extend PacketHelper
 
@@ -213,8 +363,14 @@ class Packet
 
     SUBTYPE_INIT = 0x0000
     SUBTYPE_AUTH = 0x0001
+
+    # An INIT with this flag has a whole SYN packet after the public key: in
+    # cleartext from the client, and encrypted with the new keys from us
+    FLAG_SYN = 0x0001
+
     attr_reader :subtype, :flags
     attr_reader :public_key_x, :public_key_y # SUBTYPE_INIT
+    attr_reader :syn # SUBTYPE_INIT, with FLAG_SYN
     attr_reader :authenticator # SUBTYPE_AUTH
 
     def initialize(params = {})
@@ -228,6 +384,10 @@ class Packet
         if(!@public_key_x.is_a?(Bignum) || !@public_key_y.is_a?(Bignum))
           raise(DnscatException, "Public keys have to be Bignums! (Seen: #{@public_key_x.class} #{@public_key_y.class})")
         end
+
+        if((@flags & FLAG_SYN) == FLAG_SYN)
+          @syn = params[:syn] || raise(DnscatException, "params[:syn] is required with FLAG_SYN!")
+        end
       elsif(@subtype == SUBTYPE_AUTH)
         @authenticator = params[:authenticator] || raise(DnscatException, "params[:authenticator] is required!")
 
@@ -250,13 +410,22 @@ class Packet
       }
 
       if(subtype == SUBTYPE_INIT)
-        exactly?(data, 64) || raise(DnscatException, "ENC packet is too short!")
+        if((flags & FLAG_SYN) == FLAG_SYN)
+          at_least?(data, 64) || raise(DnscatException, "ENC packet is too short!")
+        else
+          exactly?(data, 64) || raise(DnscatException, "ENC packet is too short!")
+        end
 
         public_key_x, public_key_y, data = data.unpack("a32a32a*")
 
         params[:public_key_x] = CryptoHelper.binary_to_bignum(public_key_x)
         params[:public_key_y] = CryptoHelper.binary_to_bignum(public_key_y)
 
+        if((flags & FLAG_SYN) == FLAG_SYN)
+          params[:syn] = data
+          data = ""
+        end
+
       elsif(subtype == SUBTYPE_AUTH)
         exactly?(data, 32) || raise(DnscatException, "ENC packet is too short!")
 
@@ -276,7 +445,11 @@ class Packet
 
     def to_s()
       if(@subtype == SUBTYPE_INIT)
-        return "[[ENC|INIT]] :: flags = 0x%04x, pubkey = %s,%s" % [@flags, CryptoHelper.bignum_to_text(@public_key_x), CryptoHelper.bignum_to_text(@public_key_y)]
+        s = "[[ENC|INIT]] :: flags = 0x%04x, pubkey = %s,%s" % [@flags, CryptoHelper.bignum_to_text(@public_key_x), CryptoHelper.bignum_to_text(@public_key_y)]
+        if(@syn)
+          s += ", syn = 0x%x bytes" % @syn.length
+        end
+        return s
       elsif(@subtype == SUBTYPE_AUTH)
         return "[[ENC|AUTH]] :: flags = 0x%04x, authenticator = %s" % [@flags, @authenticator.unpack("H*").pop()]
       else
@@ -289,7 +462,7 @@ class Packet
         public_key_x = CryptoHelper.bignum_to_binary(@public_key_x)
         public_key_y = CryptoHelper.bignum_to_binary(@public_key_y)
 
-        return [@subtype, @flags, public_key_x, public_key_y].pack("nna32a32")
+        return [@subtype, @flags, public_key_x, public_key_y, @syn || ""].pack("nna32a32a*")
       elsif(@subtype == SUBTYPE_AUTH)
         return [@subtype, @flags, @authenticator].pack("nna32")
       else
@@ -338,6 +511,36 @@ class Packet
     return type
   end
 
+  # Returns the packets inside a bundle, as strings
+  def Packet.parse_bundle(data)
+    _, _, _, data = Packet.parse_header(data)
+
+    packets = []
+    while(data.length > 0)
+      at_least?(data, BUNDLE_ENTRY_SIZE) || raise(DnscatException, "Packet is too short (BUNDLE entry)")
+
+      length, data = data.unpack("na*")
+      at_least?(data, length) || raise(DnscatException, "Bundle entry is truncated")
+
+      packets << data[0, length]
+      data = data[length..-1]
+    end
+
+    return packets
+  end
+
+  # Takes the responses (as strings, which can be empty) in the same order
+  # as the requests, and returns the bundle as a string
+  def Packet.create_bundle(packets)
+    result = [rand(0xFFFF), MESSAGE_TYPE_BUNDLE, 0].pack("nCn")
+
+    packets.each do |packet|
+      result += [packet.length, packet].pack("na*")
+    end
+
+    return result
+  end
+
   def Packet.parse(data, options = nil)
     packet_id, type, session_id, data = Packet.parse_header(data)
 
@@ -353,6 +556,11 @@ class Packet
         raise(DnscatException, "Options are required when parsing FIN packets!")
       end
       body = FinBody.parse(options, data)
+    elsif(type == MESSAGE_TYPE_FEC)
+      if(options.nil?)
+        raise(DnscatException, "Options are required when parsing FEC packets!")
+      end
+      body = FecBody.parse(options, data)
     elsif(type == MESSAGE_TYPE_PING)
       body = PingBody.parse(nil, data)
     elsif(type == MESSAGE_TYPE_ENC)
@@ -376,6 +584,10 @@ class Packet
     return Packet.new(params[:packet_id], MESSAGE_TYPE_FIN, params[:session_id], FinBody.new(options, params))
   end
 
+  def Packet.create_fec(options, params = {})
+    return Packet.new(params[:packet_id], MESSAGE_TYPE_FEC, params[:session_id], FecBody.new(options, params))
+  end
+
   def Packet.create_ping(params = {})
     return Packet.new(params[:packet_id], MESSAGE_TYPE_PING, params[:session_id], PingBody.new(nil, params))
   end
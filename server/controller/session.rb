@@ -7,12 +7,15 @@
 #
 ##
 
+require 'securerandom'
+
 require 'controller/encryptor'
 require 'controller/packet'
 require 'drivers/driver_command'
 require 'drivers/driver_console'
 require 'drivers/driver_process'
 require 'libs/commander'
+require 'libs/compressor'
 require 'libs/dnscat_exception'
 require 'libs/swindow'
 
@@ -34,11 +37,19 @@ class Session
   # After being manually killed
   STATE_KILLED        = 0xFF
 
+  # With a sliding window, the most data we'll have unacknowledged
+  MAX_IN_FLIGHT       = 16384
+
+  # With OPT_FEC, how many of the client's segments we remember after they've
+  # been delivered (the parity that covers them can come in after them)
+  FEC_HISTORY         = 2 * Packet::FEC_MAX_GROUP
+
   HANDLERS = {
     Packet::MESSAGE_TYPE_SYN => :_handle_syn,
     Packet::MESSAGE_TYPE_MSG => :_handle_msg,
     Packet::MESSAGE_TYPE_FIN => :_handle_fin,
     Packet::MESSAGE_TYPE_ENC => :_handle_enc,
+    Packet::MESSAGE_TYPE_FEC => :_handle_fec,
   }
 
   def initialize(id, main_window)
@@ -53,6 +64,45 @@ class Session
     @outgoing_data = ''
     @driver = nil
 
+    # Sliding-window state (only used with OPT_WINDOWED): how much of
+    # @outgoing_data is on the wire, and the length of each unacknowledged
+    # segment, oldest first
+    @window_size = 1
+    @sent_length = 0
+    @in_flight = []
+
+    # The client's windowed segments that came in ahead of one that's
+    # missing (seq => data)
+    @early = {}
+
+    # Only used if both sides agree to OPT_FEC: the most segments the client
+    # covers with one parity packet, and the last few that were delivered
+    # (seq => data)
+    @fec_group = 0
+    @fec_recent = {}
+
+    # Only created if both sides agree to OPT_COMPRESSED
+    @compressor = nil
+
+    # Only handed out if both sides agree to OPT_RESUMABLE
+    @ticket = nil
+
+    # The SYN we accepted and what we said back, so a retransmission of it
+    # (before any MSGs come in) gets the same answer
+    @syn_received = nil
+    @syn_response = nil
+
+    # How long (in ms) we can sit on a poll, if both sides agree to
+    # OPT_LONG_POLL, and the one we're sitting on (if any). The held poll is
+    # answered from another thread, so feed() takes the lock; that thread
+    # waits on @held_changed, which is signalled when the driver has
+    # something new or the session changes state.
+    @long_poll = 0
+    @held_poll = nil
+    @holding = false
+    @lock = Mutex.new()
+    @held_changed = ConditionVariable.new()
+
     # Stuff that's displayed after the window's name
     @crypto_state = '[cleartext]'
 
@@ -83,6 +133,7 @@ class Session
       if(@state != STATE_KILLED)
         @state = STATE_KILLED
         @kill_reason = reason
+        _wake_held_poll()
 
         @window.with({:to_ancestors => true}) do
           @window.puts("Session #{@window.id} killed: #{reason}")
@@ -121,8 +172,79 @@ class Session
     return bytes_acked <= @outgoing_data.length
   end
 
+  def _windowed?()
+    return (@options & Packet::OPT_WINDOWED) == Packet::OPT_WINDOWED
+  end
+
+  # The windowed version of _valid_ack? and _ack_outgoing(): a cumulative
+  # ACK can cover anything that's on the wire. Returns false for stale ACKs,
+  # which happen when queries are answered out of order.
+  def _ack_windowed(ack)
+    bytes_acked = (ack - @my_seq) & 0xFFFF
+    if(bytes_acked > @sent_length)
+      return false
+    end
+
+    @outgoing_data = @outgoing_data[bytes_acked..-1]
+    @my_seq = ack
+    @sent_length -= bytes_acked
+
+    while(bytes_acked > 0 && @in_flight.length > 0)
+      if(bytes_acked < @in_flight[0])
+        @in_flight[0] -= bytes_acked
+        break
+      end
+
+      bytes_acked -= @in_flight.shift()
+    end
+
+    return true
+  end
+
+  # Returns the seq and data for the next windowed MSG: new data if the
+  # window has room, otherwise a retransmission of the oldest segment. The
+  # bytes on the wire are capped, too, since the sequence numbers are only 16
+  # bits (and a response over TCP can hold a lot).
+  def _next_windowed(n)
+    room = MAX_IN_FLIGHT - @sent_length
+    if(@in_flight.length < @window_size && room > 0 && @outgoing_data.length > @sent_length)
+      offset = @sent_length
+      data = @outgoing_data[offset, [n-1, room].min()]
+
+      @in_flight << data.length
+      @sent_length += data.length
+    elsif(@in_flight.length > 0)
+      offset = 0
+      data = @outgoing_data[0, [@in_flight[0], n-1].min()]
+    else
+      offset = 0
+      data = ''
+    end
+
+    return (@my_seq + offset) & 0xFFFF, data
+  end
+
   def queue_outgoing(data)
-    @outgoing_data = @outgoing_data + data.force_encoding("ASCII-8BIT")
+    data = data.force_encoding("ASCII-8BIT")
+    if(@compressor)
+      data = @compressor.compress(data)
+    end
+
+    @outgoing_data = @outgoing_data + data
+  end
+
+  # Give the incoming data to the driver, and queue up whatever it wants to
+  # send back; with OPT_COMPRESSED, the data is decompressed on the way in and
+  # compressed on the way out.
+  def _feed_driver(data)
+    if(@compressor)
+      data = @compressor.decompress(data)
+    end
+
+    out = @driver.feed(data)
+    if(out && out.length > 0)
+      queue_outgoing(out)
+    end
   end
 
   def to_s()
@@ -145,9 +267,47 @@ class Session
     end
   end
 
+  # A client that lost touch with us wants to pick up where it left off. The
+  # SYN is signed with the session's keys (if it's encrypted at all), so the
+  # ticket only has to show that it's the same client. Everything that was in
+  # flight gets sent again.
+  def _handle_resume(packet)
+    if(@ticket.nil? || packet.body.ticket != @ticket)
+      raise(DnscatException, "Client tried to resume the session with a bad ticket!")
+    end
+
+    if(!_valid_ack?(packet.body.ack))
+      raise(DnscatException, "Client tried to resume the session with a bad ACK!")
+    end
+
+    _ack_outgoing(packet.body.ack)
+    @sent_length = 0
+    @in_flight = []
+
+    @window.with({:to_ancestors => true}) do
+      @window.puts("Session #{@window.id} resumed!")
+    end
+
+    return Packet.create_syn(Packet::OPT_RESUME, {
+      :session_id => @id,
+      :seq        => @my_seq,
+      :ack        => @their_seq,
+      :ticket     => @ticket,
+    })
+  end
+
   def _handle_syn(packet, max_length)
     options = 0
 
+    if(@state == STATE_ESTABLISHED && (packet.body.options & Packet::OPT_RESUME) == Packet::OPT_RESUME)
+      return _handle_resume(packet)
+    end
+
+    # If our answer to their SYN got lost, they'll send it again
+    if(@state == STATE_ESTABLISHED && !@syn_response.nil? && packet.body.to_bytes() == @syn_received)
+      return @syn_response
+    end
+
     # Ignore errant SYNs - they are, at worst, retransmissions that we don't care about
     if(@state != STATE_NEW)
       raise(DnscatException, "Duplicate SYN received!")
@@ -159,6 +319,58 @@ class Session
     @their_seq = packet.body.seq
     @options   = packet.body.options
 
+    # Agree to a sliding window if they asked for one (and we're allowed)
+    if(_windowed?() && Settings::GLOBAL.get("window_size") > 1)
+      @window_size = Settings::GLOBAL.get("window_size")
+      options |= Packet::OPT_WINDOWED
+    else
+      @options &= ~Packet::OPT_WINDOWED
+    end
+
+    # Same with compression
+    if((@options & Packet::OPT_COMPRESSED) == Packet::OPT_COMPRESSED && Settings::GLOBAL.get("compression"))
+      @compressor = Compressor.new()
+      options |= Packet::OPT_COMPRESSED
+    else
+      @options &= ~Packet::OPT_COMPRESSED
+    end
+
+    # We can always take bundles; this is just so the client knows
+    if((@options & Packet::OPT_BUNDLED) == Packet::OPT_BUNDLED)
+      options |= Packet::OPT_BUNDLED
+    end
+
+    # We can always say when there's more waiting; this is just so the client
+    # knows the MSGs have room for it
+    if((@options & Packet::OPT_MSG_FLAGS) == Packet::OPT_MSG_FLAGS)
+      options |= Packet::OPT_MSG_FLAGS
+    end
+
+    # Hold polls for as long as we're allowed to, or they're willing to wait
+    if((@options & Packet::OPT_LONG_POLL) == Packet::OPT_LONG_POLL && Settings::GLOBAL.get("long_poll") > 0)
+      @long_poll = [packet.body.long_poll, Settings::GLOBAL.get("long_poll")].min()
+      options |= Packet::OPT_LONG_POLL
+    else
+      @options &= ~Packet::OPT_LONG_POLL
+    end
+
+    # Parity only makes sense with a window; the group is no bigger than
+    # either side wants
+    if(_windowed?() && (@options & Packet::OPT_FEC) == Packet::OPT_FEC && Settings::GLOBAL.get("fec") > 0 && packet.body.fec_group > 0)
+      @fec_group = [packet.body.fec_group, Settings::GLOBAL.get("fec"), Packet::FEC_MAX_GROUP].min()
+      options |= Packet::OPT_FEC
+    else
+      @options &= ~Packet::OPT_FEC
+    end
+
+    # The ticket is nothing but random bytes; we keep everything it stands for
+    if((@options & Packet::OPT_RESUMABLE) == Packet::OPT_RESUMABLE && Settings::GLOBAL.get("resumable"))
+      @ticket = SecureRandom.random_bytes(Packet::TICKET_LENGTH)
+      options |= Packet::OPT_RESUMABLE
+    else
+      @options &= ~Packet::OPT_RESUMABLE
+    end
+
     # TODO: We're going to need different driver types
     if((@options & Packet::OPT_COMMAND) == Packet::OPT_COMMAND)
       @driver = DriverCommand.new(@window, @settings)
@@ -171,6 +383,10 @@ class Session
       end
     end
 
+    @driver.on_outgoing() do
+      _wake_held_poll()
+    end
+
     if((@options & Packet::OPT_NAME) == Packet::OPT_NAME)
       @settings.set("name", packet.body.name)
     else
@@ -192,21 +408,110 @@ class Session
     # Move states (this has to come after the encryption code, otherwise this packet is accidentally encrypted)
     @state = STATE_ESTABLISHED
 
-    return Packet.create_syn(options, {
+    @syn_received = packet.body.to_bytes()
+    @syn_response = Packet.create_syn(options, {
       :session_id => @id,
-      :seq        => @my_seq
+      :seq        => @my_seq,
+      :ticket     => @ticket,
+      :long_poll  => @long_poll,
+      :fec_group  => @fec_group,
     })
+
+    return @syn_response
   end
 
   def _actual_msg_max_length(max_data_length)
     return max_data_length - (Packet.header_size(@options) + Packet::MsgBody.header_size(@options))
   end
 
+  def _fec_remember(seq, data)
+    @fec_recent.delete(seq)
+    @fec_recent[seq] = data
+
+    while(@fec_recent.length > FEC_HISTORY)
+      @fec_recent.shift()
+    end
+  end
+
+  # Give the driver a segment of the client's data if it's the next one. A
+  # segment that's early (resolvers, and other nodes in a cluster, don't keep
+  # queries in order) waits for the ones before it, which might also get
+  # rebuilt from parity with FEC (see _handle_fec()).
+  def _receive_windowed(seq, data)
+    if(@their_seq != seq)
+      if(data.length > 0 && ((seq - @their_seq) & 0xFFFF) < MAX_IN_FLIGHT)
+        @early[seq] = data
+      end
+
+      return
+    end
+
+    # (Even an empty one, which is when the driver gets to say something)
+    _feed_driver(data)
+    if(data.length == 0)
+      return
+    end
+
+    while(!data.nil?)
+      if(@fec_group > 0)
+        _fec_remember(@their_seq, data)
+      end
+      @their_seq = (@their_seq + data.length) & 0xFFFF
+
+      if(!(data = @early.delete(@their_seq)).nil?)
+        _feed_driver(data)
+      end
+    end
+
+    # Anything that's left over and behind us was a retransmission
+    @early.delete_if() { |early_seq, _| ((early_seq - @their_seq) & 0xFFFF) >= MAX_IN_FLIGHT }
+  end
+
+  # The flags for a MSG to the client (only sent with OPT_MSG_FLAGS): whether
+  # there's more of @outgoing_data than the first sent bytes, so it knows to
+  # come back for it right away
+  def _msg_flags(sent)
+    if(@outgoing_data.length > sent)
+      return Packet::MsgBody::FLAG_MORE
+    end
+
+    return 0
+  end
+
+  def _windowed_response(max_length)
+    seq, data = _next_windowed(_actual_msg_max_length(max_length))
+
+    return Packet.create_msg(@options, {
+      :session_id => @id,
+      :data       => data,
+      :seq        => seq,
+      :ack        => @their_seq,
+      :flags      => _msg_flags(@sent_length),
+    })
+  end
+
+  # Unlike stop-and-wait, the ACK is processed even when the SEQ is out of
+  # order.
+  def _handle_msg_windowed(packet, max_length)
+    _ack_windowed(packet.body.ack)
+    _receive_windowed(packet.body.seq, packet.body.data)
+
+    return _windowed_response(max_length)
+  end
+
   def _handle_msg(packet, max_length)
     if(@state != STATE_ESTABLISHED)
       raise(DnscatException, "MSG received in invalid state!")
     end
 
+    # They got our SYN, so it won't be asked for again
+    @syn_received = nil
+    @syn_response = nil
+
+    if(_windowed?())
+      return _handle_msg_windowed(packet, max_length)
+    end
+
     # Validate the sequence number
     if(@their_seq != packet.body.seq)
       @window.puts("Client sent a bad sequence number (expected #{@their_seq}, received #{packet.body.seq}); re-sending")
@@ -219,6 +524,7 @@ class Session
         :data       => old_data,
         :seq        => @my_seq,
         :ack        => @their_seq,
+        :flags      => _msg_flags(old_data.length),
       })
     end
 
@@ -232,6 +538,7 @@ class Session
         :data       => old_data,
         :seq        => @my_seq,
         :ack        => @their_seq,
+        :flags      => _msg_flags(old_data.length),
       })
     end
 
@@ -240,7 +547,7 @@ class Session
     _ack_outgoing(packet.body.ack)
 
     # Write the incoming data to the session
-    @outgoing_data += @driver.feed(packet.body.data)
+    _feed_driver(packet.body.data)
 
     # Increment the expected sequence number
     @their_seq = (@their_seq + packet.body.data.length) & 0xFFFF;
@@ -254,15 +561,89 @@ class Session
       :data       => new_data,
       :seq        => @my_seq,
       :ack        => @their_seq,
+      :flags      => _msg_flags(new_data.length),
     })
 
     return packet
   end
 
+  # An FEC packet is the XOR of a run of the client's segments; if exactly one
+  # of them hasn't shown up, XORing the others out of it leaves that one.
+  # Either way, it's answered like a MSG.
+  def _handle_fec(packet, max_length)
+    if(@state != STATE_ESTABLISHED || @fec_group == 0)
+      raise(DnscatException, "FEC received, but FEC wasn't negotiated!")
+    end
+
+    parity = packet.body.parity.unpack("C*")
+    if(packet.body.lengths.any?() { |length| length > parity.length })
+      raise(DnscatException, "FEC packet's parity is shorter than what it covers!")
+    end
+
+    _ack_windowed(packet.body.ack)
+
+    missing = []
+    seq = packet.body.seq
+    packet.body.lengths.each do |length|
+      data = @fec_recent[seq] || @early[seq]
+
+      if(data.nil? || data.length != length)
+        missing << [seq, length]
+      else
+        data.unpack("C*").each_with_index() do |b, i|
+          parity[i] ^= b
+        end
+      end
+
+      seq = (seq + length) & 0xFFFF
+    end
+
+    if(missing.length == 1)
+      seq, length = missing[0]
+
+      # (It might just be one we've forgotten about)
+      if(((seq - @their_seq) & 0xFFFF) < MAX_IN_FLIGHT)
+        _receive_windowed(seq, parity[0, length].pack("C*"))
+      end
+    end
+
+    return _windowed_response(max_length)
+  end
+
   def _handle_fin(packet, max_length)
     raise(Session::SessionKiller, "Received FIN! Bye!")
   end
 
+  # The SYN that came along with an ENC|INIT, now that the keys are set; the
+  # answer goes back (encrypted) with our public key, if it fits
+  def _handle_enc_syn(data, max_length)
+    syn = Packet.parse(data, @options)
+    if(syn.type != Packet::MESSAGE_TYPE_SYN || syn.session_id != @id)
+      raise(DnscatException, "ENC|INIT carried something other than a SYN for this session: #{syn}")
+    end
+
+    if(Settings::GLOBAL.get("packet_trace"))
+      _get_pcap_window().puts("IN:  #{syn}")
+    end
+
+    # This is the only place the crypto rules get a say in it
+    _check_crypto_options(syn)
+
+    response = _handle_syn(syn, max_length)
+    if(Settings::GLOBAL.get("packet_trace"))
+      _get_pcap_window().puts("OUT: #{response}")
+    end
+
+    # If there's no room, they'll send the SYN again (encrypted, this time)
+    # and get the same answer
+    response = @encryptor.encrypt_packet(response.to_bytes())
+    if(Packet.header_size(@options) + 4 + 64 + response.length > max_length)
+      return nil
+    end
+
+    return response
+  end
+
   def _handle_enc(packet, max_length)
     params = {
       :session_id => @id,
@@ -277,6 +658,15 @@ class Session
       params[:public_key_x] = @encryptor.my_public_key_x()
       params[:public_key_y] = @encryptor.my_public_key_y()
 
+      # They might have sent their SYN along too
+      if(!packet.body.syn.nil?)
+        syn = _handle_enc_syn(packet.body.syn, max_length)
+        if(!syn.nil?)
+          params[:flags] |= Packet::EncBody::FLAG_SYN
+          params[:syn] = syn
+        end
+      end
+
     elsif(packet.body.subtype == Packet::EncBody::SUBTYPE_AUTH)
       if(!@encryptor.ready?())
         raise(Session::SessionKiller, "Tried to authenticate before the public key was set")
@@ -361,7 +751,21 @@ class Session
     end
   end
 
-  def _handle_incoming(data, max_length)
+  # A poll (a MSG with nothing in it) that we'd answer with nothing can wait
+  # till there's something to say
+  def _can_hold?(packet, response)
+    if(@long_poll == 0 || @state != STATE_ESTABLISHED || response.nil?)
+      return false
+    end
+
+    if(packet.type != Packet::MESSAGE_TYPE_MSG || response.type != Packet::MESSAGE_TYPE_MSG)
+      return false
+    end
+
+    return packet.body.data == '' && response.body.data == ''
+  end
+
+  def _handle_incoming(data, max_length, can_hold)
     packet = Packet.parse(data, @options)
 
     if(Settings::GLOBAL.get("packet_trace"))
@@ -384,12 +788,102 @@ class Session
     end
 
     # Handle the packet
-    return send(handler, packet, max_length)
+    response = send(handler, packet, max_length)
+
+    # If we're keeping the poll, feed() will hear about it
+    if(can_hold && _can_hold?(packet, response))
+      @holding = true
+      return nil
+    end
+
+    return response
+  end
+
+  # Answer the poll we're sitting on (if any) with whatever we've got; the
+  # packet's processed again from scratch (it didn't do anything the first
+  # time, so that's safe)
+  def _release_held_poll()
+    if(@held_poll.nil?)
+      return
+    end
+
+    held = @held_poll
+    @held_poll = nil
+    @held_changed.broadcast()
+
+    held[:reply].call(_feed(held[:data], held[:max_length], false))
+  end
+
+  # Wake up the held poll's thread (if any) so it takes another look; this
+  # can be called with or without the lock
+  def _wake_held_poll()
+    if(@lock.owned?())
+      @held_changed.broadcast()
+    else
+      @lock.synchronize() do
+        @held_changed.broadcast()
+      end
+    end
+  end
+
+  # Wait for the driver to have something for the client, or till it's time
+  # to answer anyway
+  def _hold_poll(data, max_length, reply)
+    held = @held_poll = {
+      :data       => data,
+      :max_length => max_length,
+      :reply      => reply,
+      :until      => Time.now() + (@long_poll / 1000.0),
+    }
+
+    Thread.new() do
+      begin
+        @lock.synchronize() do
+          # Till somebody else answers it, or we do
+          while(@held_poll.equal?(held))
+            remaining = held[:until] - Time.now()
+
+            if(remaining <= 0 || @state != STATE_ESTABLISHED || @driver.has_outgoing?())
+              _release_held_poll()
+            else
+              @held_changed.wait(@lock, remaining)
+            end
+          end
+        end
+      rescue StandardError => e
+        @window.puts("Error answering a held poll: #{e.inspect}")
+        e.backtrace.each do |bt|
+          @window.puts(bt)
+        end
+      end
+    end
+  end
+
+  # If hold is set, it's a proc that takes the response; we can keep the poll
+  # (returning nil) and answer it through hold later, once there's something
+  # to answer it with
+  def feed(possibly_encrypted_data, max_length, hold = nil)
+    response = nil
+
+    @lock.synchronize() do
+      # Whatever the client sent, the poll we're sitting on gets answered
+      # first (so the answers go out in order)
+      _release_held_poll()
+
+      response = _feed(possibly_encrypted_data, max_length, !hold.nil?)
+      if(@holding)
+        _hold_poll(possibly_encrypted_data, max_length, hold)
+        response = nil
+      end
+    end
+
+    return response
   end
 
-  def feed(possibly_encrypted_data, max_length)
+  def _feed(possibly_encrypted_data, max_length, can_hold)
     # Tell the window that we're still alive
     window.kick()
+    @holding = false
 
     begin
       return @encryptor.decrypt_and_encrypt(possibly_encrypted_data) do |data, was_encrypted|
@@ -402,7 +896,7 @@ class Session
             max_length -= 8
           end
 
-          response_packet = _handle_incoming(data, max_length)
+          response_packet = _handle_incoming(data, max_length, can_hold)
         rescue Session::SessionKiller => e
           # Kill it
           kill(e.message)
@@ -431,7 +925,9 @@ class Session
         # Print the packet if the user requested a trace
         if(Settings::GLOBAL.get("packet_trace"))
           window = _get_pcap_window()
-          if(response_packet.nil?)
+          if(@holding)
+            window.puts("OUT: <held>")
+          elsif(response_packet.nil?)
             window.puts("OUT: <no data>")
           else
             window.puts("OUT: #{response_packet}")
@@ -15,6 +15,7 @@ $LOAD_PATH << File.dirname(__FILE__) # A hack to make this work on 1.8/1.9
 require 'libs/swindow'
 WINDOW = SWindow.new(nil, true, { :prompt => "dnscat2> ", :name => "main" })
 
+require 'controller/cluster'
 require 'controller/controller'
 require 'libs/command_helpers'
 require 'libs/settings'
@@ -58,12 +59,16 @@ opts = Trollop::options do
   opt :h,         "Placeholder for help",   :type => :boolean, :default => false
   opt :version,   "Get the dnscat version", :type => :boolean, :default => false
 
-  opt :dns,       "Start a DNS server. Can optionally pass a number of comma-separated name=value pairs (host, port, domain). Eg, '--dns host=0.0.0.0,port=53531,domain=skullseclabs.org' - 'domain' can be passed multiple times",
+  opt :dns,       "Start a DNS server. Can optionally pass a number of comma-separated name=value pairs (host, port, domain, workers). Eg, '--dns host=0.0.0.0,port=53531,domain=skullseclabs.org' - 'domain' can be passed multiple times, and 'workers' sets how many threads handle requests (0, the default, handles them on the thread that receives them)",
+    :type => :string, :default => nil
+  opt :tcp,       "Also start a TCP server, for clients that can connect straight to us. Can optionally pass comma-separated name=value pairs (host, port). Eg, '--tcp host=0.0.0.0,port=53531'",
     :type => :string, :default => nil
   opt :dnshost,   "The DNS ip address to listen on [deprecated]",
     :type => :string,  :default => "0.0.0.0"
   opt :dnsport,   "The DNS port to listen on [deprecated]",
     :type => :integer, :default => 53
+  opt :cluster,   "Run as one node of a cluster of servers that share the same domains (each session lives on one of them, and the others pass its packets along). Takes comma-separated name=value pairs: 'node' is which one this is (from 0), and 'peer' is each node's host:port for talking to the others, passed once per node in the same order on all of them. Eg, '--cluster node=0,peer=10.0.0.1:53600,peer=10.0.0.2:53600'",
+    :type => :string, :default => nil
   opt :passthrough, "Unhandled requests are sent upstream DNS server, host:port",
     :type => :string, :default => ""
 
@@ -82,6 +87,16 @@ opts = Trollop::options do
     :type => :string,  :default => nil
   opt :history_size,   "The number of lines of history that windows will maintain",
     :type => :integer, :default => 1000
+  opt :window_size,    "The most MSG packets a session will have in flight at once, if the client asks for sliding-window mode",
+    :type => :integer, :default => 8
+  opt :compression,    "Compress session data for clients that ask for it",
+    :type => :boolean, :default => true
+  opt :resumable,      "Give clients a ticket they can use to pick their session back up after losing touch",
+    :type => :boolean, :default => true
+  opt :long_poll,      "How long (in ms) to hold onto an idle client's poll, waiting for something to answer it with, if the client allows it (0 to always answer right away); keep it below typical resolver timeouts",
+    :type => :integer, :default => 1000
+  opt :fec,            "The most MSG packets a client can cover with one parity packet (which lets us rebuild one that got lost), if it asks for FEC; 0 to turn it off",
+    :type => :integer, :default => 16
 
   opt :listener,       "DEBUG: Start a listener driver on the given port",
     :type => :integer, :default => nil
@@ -155,6 +170,34 @@ begin
     WINDOW.puts("history_size (for new windows) => #{new_val}")
   end
 
+  Settings::GLOBAL.create("window_size", Settings::TYPE_INTEGER, opts[:window_size], "The most MSG packets a new session will have in flight at once when the client supports sliding-window mode (use 1 to force stop-and-wait)") do |old_val, new_val|
+    if(new_val < 1)
+      raise(Settings::ValidationError, "window_size has to be at least 1")
+    end
+  end
+
+  Settings::GLOBAL.create("compression", Settings::TYPE_BOOLEAN, opts[:compression], "Compress the data in new sessions, if the client supports it") do |old_val, new_val|
+    WINDOW.puts("compression => #{new_val}")
+  end
+
+  Settings::GLOBAL.create("resumable", Settings::TYPE_BOOLEAN, opts[:resumable], "Hand out resumption tickets to new sessions, if the client supports them") do |old_val, new_val|
+    WINDOW.puts("resumable => #{new_val}")
+  end
+
+  Settings::GLOBAL.create("long_poll", Settings::TYPE_INTEGER, opts[:long_poll], "How long (in ms) new sessions can hold onto a poll, if the client supports it (0 to turn it off)") do |old_val, new_val|
+    if(new_val < 0 || new_val > 0xFFFF)
+      raise(Settings::ValidationError, "long_poll has to be between 0 and 65535")
+    end
+    WINDOW.puts("long_poll => #{new_val}")
+  end
+
+  Settings::GLOBAL.create("fec", Settings::TYPE_INTEGER, opts[:fec], "The most MSG packets a new session can cover with one parity packet, if the client supports FEC (0 to turn it off)") do |old_val, new_val|
+    if(new_val < 0 || new_val > Packet::FEC_MAX_GROUP)
+      raise(Settings::ValidationError, "fec has to be between 0 and #{Packet::FEC_MAX_GROUP}")
+    end
+    WINDOW.puts("fec => #{new_val}")
+  end
+
   Settings::GLOBAL.create("security", Settings::TYPE_STRING, opts[:security], "Options: 'open' (let the client decide), 'encrypted' (require clients to encrypt), 'authenticated' (require clients to authenticate)") do |old_val, new_val|
     options = {
       'open'          => "Client can decide on security level",
@@ -181,10 +224,24 @@ rescue Settings::ValidationError => e
   Trollop::die("Check your command-line arguments")
 end
 
+if(opts[:cluster])
+  begin
+    cluster_settings = CommandHelpers.parse_setting_string(opts[:cluster], { :node => "0", :peer => [] })
+
+    controller.cluster = Cluster.new(WINDOW, cluster_settings[:node].to_i(), cluster_settings[:peer]) do |data, max_length, hold|
+      controller.feed(data, max_length, hold)
+    end
+  rescue ArgumentError => e
+    WINDOW.puts("Sorry, we had trouble parsing your --cluster string:")
+    WINDOW.puts(e)
+    exit(1)
+  end
+end
+
 domains = []
 if(opts[:dns])
   begin
-    dns_settings = CommandHelpers.parse_setting_string(opts[:dns], { :host => "0.0.0.0", :port => "53", :domains => [], :domain => [] })
+    dns_settings = CommandHelpers.parse_setting_string(opts[:dns], { :host => "0.0.0.0", :port => "53", :domains => [], :domain => [], :workers => "0" })
     dns_settings[:domains] = dns_settings[:domain] + dns_settings[:domains]
   rescue ArgumentError => e
     WINDOW.puts("Sorry, we had trouble parsing your --dns string:")
@@ -208,8 +265,25 @@ dns_settings[:domains] += ARGV
 TunnelDrivers.start({
   :controller => controller,
   :driver     => DriverDNS,
-  :args       => [dns_settings[:host], dns_settings[:port], dns_settings[:domains], opts[:cache]],
+  :args       => [dns_settings[:host], dns_settings[:port], dns_settings[:domains], opts[:cache], dns_settings[:workers].to_i],
 })
 
+# Start the TCP driver, if they asked for one
+if(opts[:tcp])
+  begin
+    tcp_settings = CommandHelpers.parse_setting_string(opts[:tcp], { :host => "0.0.0.0", :port => "53531" })
+  rescue ArgumentError => e
+    WINDOW.puts("Sorry, we had trouble parsing your --tcp string:")
+    WINDOW.puts(e)
+    exit(1)
+  end
+
+  TunnelDrivers.start({
+    :controller => controller,
+    :driver     => DriverTCP,
+    :args       => [tcp_settings[:host], tcp_settings[:port].to_i],
+  })
+end
+
 # Wait for the input window to finish its thing
 SWindow.wait()
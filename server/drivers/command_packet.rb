@@ -26,6 +26,12 @@ class CommandPacket
   COMMAND_UPLOAD   = 0x0004
   COMMAND_SHUTDOWN = 0x0005
   COMMAND_DELAY    = 0x0006
+  COMMAND_DOWNLOAD_CHUNK = 0x0007
+  COMMAND_UPLOAD_CHUNK   = 0x0008
+  COMMAND_STATS    = 0x0009
+  COMMAND_FILE_SIGNATURE = 0x000A
+  COMMAND_UPLOAD_DELTA   = 0x000B
+  COMMAND_DOWNLOAD_DELTA = 0x000C
   TUNNEL_CONNECT   = 0x1000
   TUNNEL_DATA      = 0x1001
   TUNNEL_CLOSE     = 0x1002
@@ -39,6 +45,12 @@ class CommandPacket
     0x0004 => "COMMAND_UPLOAD",
     0x0005 => "COMMAND_SHUTDOWN",
     0x0006 => "COMMAND_DELAY",
+    0x0007 => "COMMAND_DOWNLOAD_CHUNK",
+    0x0008 => "COMMAND_UPLOAD_CHUNK",
+    0x0009 => "COMMAND_STATS",
+    0x000A => "COMMAND_FILE_SIGNATURE",
+    0x000B => "COMMAND_UPLOAD_DELTA",
+    0x000C => "COMMAND_DOWNLOAD_DELTA",
     0x1000 => "TUNNEL_CONNECT",
     0x1001 => "TUNNEL_DATA",
     0x1002 => "TUNNEL_CLOSE",
@@ -79,6 +91,30 @@ class CommandPacket
       :request  => [ :delay ],
       :response => [],
     },
+    COMMAND_DOWNLOAD_CHUNK => {
+      :request  => [ :filename, :offset, :length ],
+      :response => [ :offset, :size, :data ],
+    },
+    COMMAND_UPLOAD_CHUNK => {
+      :request  => [ :filename, :offset, :data ],
+      :response => [ :size ],
+    },
+    COMMAND_STATS => {
+      :request  => [],
+      :response => [ :stats ],
+    },
+    COMMAND_FILE_SIGNATURE => {
+      :request  => [ :filename, :block_size, :first_block, :count ],
+      :response => [ :size, :first_block, :data ],
+    },
+    COMMAND_UPLOAD_DELTA => {
+      :request  => [ :filename, :block_size, :offset, :size, :data ],
+      :response => [ :size ],
+    },
+    COMMAND_DOWNLOAD_DELTA => {
+      :request  => [ :filename, :block_size, :offset, :data ],
+      :response => [ :offset, :size, :data ],
+    },
     TUNNEL_CONNECT => {
       :request  => [ :options, :host, :port ],
       :response => [ :tunnel_id ],
@@ -198,6 +234,78 @@ class CommandPacket
         data[:delay], packet = packet.unpack("Na*")
       end
 
+    when COMMAND_DOWNLOAD_CHUNK
+      if(data[:is_request])
+        _null_terminated?(packet)
+        data[:filename], packet = packet.unpack("Z*a*")
+        _at_least?(packet, 8)
+        data[:offset], data[:length], packet = packet.unpack("NNa*")
+      else
+        _at_least?(packet, 8)
+        data[:offset], data[:size], data[:data], packet = packet.unpack("NNa*a0")
+      end
+
+    when COMMAND_UPLOAD_CHUNK
+      if(data[:is_request])
+        _null_terminated?(packet)
+        data[:filename], packet = packet.unpack("Z*a*")
+        _at_least?(packet, 4)
+        data[:offset], data[:data], packet = packet.unpack("Na*a0")
+      else
+        _at_least?(packet, 4)
+        data[:size], packet = packet.unpack("Na*")
+      end
+
+    when COMMAND_STATS
+      if(!data[:is_request])
+        _at_least?(packet, 4)
+        count, packet = packet.unpack("Na*")
+
+        # A list of [name, value] pairs
+        data[:stats] = []
+        0.upto(count - 1) do
+          _null_terminated?(packet)
+          name, packet = packet.unpack("Z*a*")
+          _at_least?(packet, 4)
+          value, packet = packet.unpack("Na*")
+
+          data[:stats] << [name, value]
+        end
+      end
+
+    when COMMAND_FILE_SIGNATURE
+      if(data[:is_request])
+        _null_terminated?(packet)
+        data[:filename], packet = packet.unpack("Z*a*")
+        _at_least?(packet, 12)
+        data[:block_size], data[:first_block], data[:count], packet = packet.unpack("NNNa*")
+      else
+        _at_least?(packet, 8)
+        data[:size], data[:first_block], data[:data], packet = packet.unpack("NNa*a0")
+      end
+
+    when COMMAND_UPLOAD_DELTA
+      if(data[:is_request])
+        _null_terminated?(packet)
+        data[:filename], packet = packet.unpack("Z*a*")
+        _at_least?(packet, 12)
+        data[:block_size], data[:offset], data[:size], data[:data], packet = packet.unpack("NNNa*a0")
+      else
+        _at_least?(packet, 4)
+        data[:size], packet = packet.unpack("Na*")
+      end
+
+    when COMMAND_DOWNLOAD_DELTA
+      if(data[:is_request])
+        _null_terminated?(packet)
+        data[:filename], packet = packet.unpack("Z*a*")
+        _at_least?(packet, 8)
+        data[:block_size], data[:offset], data[:data], packet = packet.unpack("NNa*a0")
+      else
+        _at_least?(packet, 8)
+        data[:offset], data[:size], data[:data], packet = packet.unpack("NNa*a0")
+      end
+
     when TUNNEL_CONNECT
       if(data[:is_request])
         _at_least?(packet, 4)
@@ -336,6 +444,49 @@ class CommandPacket
         packet += [@data[:delay]].pack("N")
       end
 
+    when COMMAND_DOWNLOAD_CHUNK
+      if(@data[:is_request])
+        packet += [@data[:filename], @data[:offset], @data[:length]].pack("Z*NN")
+      else
+        packet += [@data[:offset], @data[:size], @data[:data]].pack("NNa*")
+      end
+
+    when COMMAND_UPLOAD_CHUNK
+      if(@data[:is_request])
+        packet += [@data[:filename], @data[:offset], @data[:data]].pack("Z*Na*")
+      else
+        packet += [@data[:size]].pack("N")
+      end
+
+    when COMMAND_STATS
+      if(!@data[:is_request])
+        packet += [@data[:stats].length].pack("N")
+        @data[:stats].each do |name, value|
+          packet += [name, value].pack("Z*N")
+        end
+      end
+
+    when COMMAND_FILE_SIGNATURE
+      if(@data[:is_request])
+        packet += [@data[:filename], @data[:block_size], @data[:first_block], @data[:count]].pack("Z*NNN")
+      else
+        packet += [@data[:size], @data[:first_block], @data[:data]].pack("NNa*")
+      end
+
+    when COMMAND_UPLOAD_DELTA
+      if(@data[:is_request])
+        packet += [@data[:filename], @data[:block_size], @data[:offset], @data[:size], @data[:data]].pack("Z*NNNa*")
+      else
+        packet += [@data[:size]].pack("N")
+      end
+
+    when COMMAND_DOWNLOAD_DELTA
+      if(@data[:is_request])
+        packet += [@data[:filename], @data[:block_size], @data[:offset], @data[:data]].pack("Z*NNa*")
+      else
+        packet += [@data[:offset], @data[:size], @data[:data]].pack("NNa*")
+      end
+
     when TUNNEL_CONNECT
       if(@data[:is_request])
         packet += [@data[:options], @data[:host], @data[:port]].pack("NZ*n")
@@ -11,10 +11,12 @@ require 'shellwords'
 require 'drivers/command_packet'
 require 'drivers/driver_command_commands'
 require 'drivers/driver_command_tunnels'
+require 'drivers/driver_outgoing'
 
 class DriverCommand
   include DriverCommandCommands
   include DriverCommandTunnels
+  include DriverOutgoing
 
   attr_reader :stopped
 
@@ -59,6 +61,10 @@ class DriverCommand
       out = [out.length, out].pack("Na*")
       @outgoing += out
     end
+
+    # (Once the mutex is let go; the session might be holding its own lock
+    # and waiting on ours.)
+    _outgoing_queued()
   end
 
   def initialize(window, settings)
@@ -163,8 +169,14 @@ class DriverCommand
     return result
   end
 
+  # True if there's something for the client (so a held poll can be answered)
+  def has_outgoing?()
+    return @outgoing.length > 0 || @stopped
+  end
+
   def request_stop()
     @stopped = true
+    _outgoing_queued()
   end
 
   def shutdown()
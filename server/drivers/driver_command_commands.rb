@@ -7,8 +7,183 @@
 ##
 
 require 'libs/command_helpers'
+require 'libs/delta'
 
 module DriverCommandCommands
+  # How much of a file to ask for at once when downloading; the client won't
+  # send more than 64k no matter what.
+  DOWNLOAD_CHUNK_SIZE = 16384
+
+  # Ask for the piece of remote_file that starts at offset, and when it
+  # arrives, append it to local_file and ask for the next one. Only having
+  # one chunk in flight keeps the client from queueing up the whole file.
+  def _download_chunk(remote_file, local_file, offset)
+    chunk = CommandPacket.new({
+      :is_request => true,
+      :request_id => request_id(),
+      :command_id => CommandPacket::COMMAND_DOWNLOAD_CHUNK,
+      :filename   => remote_file,
+      :offset     => offset,
+      :length     => DOWNLOAD_CHUNK_SIZE,
+    })
+
+    _send_request(chunk, Proc.new() do |request, response|
+      data = response.get(:data)
+
+      File.open(local_file, "ab") do |f|
+        f.write(data)
+      end
+
+      offset += data.length
+      if(data.length == 0 || offset >= response.get(:size))
+        @window.puts("Wrote #{offset} bytes from #{request.get(:filename)} to #{local_file}!")
+      else
+        _download_chunk(remote_file, local_file, offset)
+      end
+    end)
+  end
+
+  # How much of a file to send in each COMMAND_UPLOAD_CHUNK.
+  UPLOAD_CHUNK_SIZE = 16384
+
+  # An offset that asks the client how much of the file it already has,
+  # instead of writing anything.
+  UPLOAD_QUERY_OFFSET = 0xFFFFFFFF
+
+  # Send the piece of local_file that starts at offset, and once the client
+  # says it's written, send the next one. The client tells us how much it has
+  # (rather than us assuming), so that's where we pick up from.
+  def _upload_chunk(local_file, remote_file, offset)
+    data = IO.binread(local_file, UPLOAD_CHUNK_SIZE, offset) || ""
+
+    chunk = CommandPacket.new({
+      :is_request => true,
+      :request_id => request_id(),
+      :command_id => CommandPacket::COMMAND_UPLOAD_CHUNK,
+      :filename   => remote_file,
+      :offset     => offset,
+      :data       => data,
+    })
+
+    _send_request(chunk, Proc.new() do |request, response|
+      offset = response.get(:size)
+
+      if(data.length < UPLOAD_CHUNK_SIZE || offset >= File.size(local_file))
+        @window.puts("#{offset} bytes uploaded from #{local_file} to #{remote_file}")
+      else
+        _upload_chunk(local_file, remote_file, offset)
+      end
+    end)
+  end
+
+  # With --delta, files are put together here (next to the old one) till
+  # they're done.
+  DELTA_TEMP_SUFFIX = ".dnscat-delta"
+
+  # How many block signatures to ask for at once; the client won't send more
+  # than 4096.
+  SIGNATURES_PER_REQUEST = 4096
+
+  # Ask for the rest of remote_file (from offset) as a delta against basis,
+  # our old copy of it, and append what it makes to temp_file; once it's all
+  # there, temp_file replaces local_file. The client says how far each
+  # response gets, so there's only ever one in flight, like _download_chunk().
+  def _download_delta(remote_file, local_file, temp_file, basis, block_size, signatures, offset, sent)
+    request = CommandPacket.new({
+      :is_request => true,
+      :request_id => request_id(),
+      :command_id => CommandPacket::COMMAND_DOWNLOAD_DELTA,
+      :filename   => remote_file,
+      :block_size => block_size,
+      :offset     => offset,
+      :data       => signatures,
+    })
+
+    _send_request(request, Proc.new() do |request, response|
+      begin
+        ops = Delta.unpack_ops(response.get(:data))
+        data = Delta.apply(ops, basis, block_size)
+      rescue DnscatException => e
+        @window.puts("Couldn't use the delta for #{remote_file}: #{e}")
+        next
+      end
+
+      File.open(temp_file, "ab") do |f|
+        f.write(data)
+      end
+
+      offset += data.length
+      sent += Delta.data_length(ops)
+      if(offset >= response.get(:size))
+        File.rename(temp_file, local_file)
+        @window.puts("Wrote #{offset} bytes from #{remote_file} to #{local_file}! (#{sent} of them were sent, the rest were already here)")
+      elsif(data.length == 0)
+        @window.puts("The client stopped sending #{remote_file} after #{offset} bytes")
+      else
+        _download_delta(remote_file, local_file, temp_file, basis, block_size, signatures, offset, sent)
+      end
+    end)
+  end
+
+  # Collect the signatures of the client's copy of remote_file, then work out
+  # what it needs to turn it into data (the new version) and send that.
+  def _upload_signatures(local_file, remote_file, data, block_size, signatures)
+    request = CommandPacket.new({
+      :is_request  => true,
+      :request_id  => request_id(),
+      :command_id  => CommandPacket::COMMAND_FILE_SIGNATURE,
+      :filename    => remote_file,
+      :block_size  => block_size,
+      :first_block => signatures.length,
+      :count       => SIGNATURES_PER_REQUEST,
+    })
+
+    _send_request(request, Proc.new() do |request, response|
+      begin
+        more = Delta.unpack_signatures(response.get(:data))
+      rescue DnscatException => e
+        @window.puts("Couldn't use the signatures for #{remote_file}: #{e}")
+        next
+      end
+
+      signatures += more
+      if(more.length > 0 && signatures.length < response.get(:size) / block_size)
+        _upload_signatures(local_file, remote_file, data, block_size, signatures)
+      else
+        ops = Delta.encode(data, signatures, block_size)
+        sent = Delta.data_length(ops)
+
+        @window.puts("#{remote_file} has #{response.get(:size)} bytes; #{sent} of the #{data.length} bytes in #{local_file} have to be sent")
+        _upload_delta(local_file, remote_file, data.length, block_size, Delta.split(ops, UPLOAD_CHUNK_SIZE), 0, sent)
+      end
+    end)
+  end
+
+  # Send the pieces of a delta one at a time; the client replaces its copy
+  # of remote_file once it has the last one.
+  def _upload_delta(local_file, remote_file, size, block_size, pieces, offset, sent)
+    request = CommandPacket.new({
+      :is_request => true,
+      :request_id => request_id(),
+      :command_id => CommandPacket::COMMAND_UPLOAD_DELTA,
+      :filename   => remote_file,
+      :block_size => block_size,
+      :offset     => offset,
+      :size       => size,
+      :data       => Delta.pack_ops(pieces.shift()),
+    })
+
+    _send_request(request, Proc.new() do |request, response|
+      offset = response.get(:size)
+
+      if(pieces.empty?())
+        @window.puts("#{offset} bytes uploaded from #{local_file} to #{remote_file} (#{sent} of them were sent, the rest were already there)")
+      else
+        _upload_delta(local_file, remote_file, size, block_size, pieces, offset, sent)
+      end
+    end)
+  end
+
   def _register_commands()
     @commander.register_alias('sessions', 'windows')
     @commander.register_alias('session',  'window')
@@ -147,7 +322,9 @@ module DriverCommandCommands
 
     @commander.register_command("download",
       Trollop::Parser.new do
-        banner("Download a file from the other side. Usage: download <from> [to]")
+        banner("Download a file from the other side. Usage: download [--resume|--delta] <from> [to]")
+        opt :resume, "If [to] already exists, keep it and download the rest", :type => :boolean, :required => false
+        opt :delta,  "If [to] already exists, only download the parts that are different", :type => :boolean, :required => false
       end,
 
       Proc.new do |opts, optarg|
@@ -155,8 +332,8 @@ module DriverCommandCommands
         remote_file, local_file = Shellwords.shellwords(optarg)
 
         # Sanity check
-        if(remote_file.nil? || remote_file == "")
-          @window.puts("Usage: download <from> [to]")
+        if(remote_file.nil? || remote_file == "" || (opts[:resume] && opts[:delta]))
+          @window.puts("Usage: download [--resume|--delta] <from> [to]")
         else
           # Make sure we have a local file
           if(local_file.nil? || local_file == "")
@@ -164,19 +341,27 @@ module DriverCommandCommands
             local_file = File.basename(remote_file)
           end
 
-          download = CommandPacket.new({
-            :is_request => true,
-            :request_id => request_id(),
-            :command_id => CommandPacket::COMMAND_DOWNLOAD,
-            :filename => remote_file,
-          })
+          offset = 0
+          if(opts[:delta])
+            basis = File.exist?(local_file) ? IO.binread(local_file) : ""
+            block_size = Delta.block_size(basis.length)
+            signatures = Delta.pack_signatures(Delta.signatures(basis, block_size))
+            temp_file = local_file + DELTA_TEMP_SUFFIX
+
+            File.open(temp_file, "wb") {}
+            _download_delta(remote_file, local_file, temp_file, basis, block_size, signatures, 0, 0)
+
+            @window.puts("Attempting to download the changes to #{remote_file} into #{local_file}")
+            next
+          elsif(opts[:resume] && File.exist?(local_file))
+            offset = File.size(local_file)
+            @window.puts("#{local_file} already has #{offset} bytes, resuming from there")
+          else
+            # Start with an empty file, so every chunk can simply be appended
+            File.open(local_file, "wb") {}
+          end
 
-          _send_request(download, Proc.new() do |request, response|
-            File.open(local_file, "wb") do |f|
-              f.write(response.get(:data))
-              @window.puts("Wrote #{response.get(:data).length} bytes from #{request.get(:filename)} to #{local_file}!")
-            end
-          end)
+          _download_chunk(remote_file, local_file, offset)
 
           @window.puts("Attempting to download #{remote_file} to #{local_file}")
         end
@@ -185,7 +370,9 @@ module DriverCommandCommands
 
     @commander.register_command("upload",
       Trollop::Parser.new do
-        banner("Upload a file to the other side. Usage: upload <from> <to>")
+        banner("Upload a file to the other side. Usage: upload [--resume|--delta] <from> <to>")
+        opt :resume, "If <to> already exists, keep it and upload the rest", :type => :boolean, :required => false
+        opt :delta,  "If <to> already exists, only upload the parts that are different", :type => :boolean, :required => false
       end,
 
       Proc.new do |opts, optarg|
@@ -193,23 +380,40 @@ module DriverCommandCommands
         local_file, remote_file = Shellwords.shellwords(optarg)
 
         # Sanity check
-        if(local_file.nil? || local_file == "" || remote_file.nil? || remote_file == "")
-          @window.puts("Usage: upload <from> <to>")
-        else
-          data = IO.read(local_file)
-
-          upload = CommandPacket.new({
+        if(local_file.nil? || local_file == "" || remote_file.nil? || remote_file == "" || (opts[:resume] && opts[:delta]))
+          @window.puts("Usage: upload [--resume|--delta] <from> <to>")
+        elsif(!File.file?(local_file))
+          @window.puts("Couldn't find #{local_file}")
+        elsif(opts[:delta])
+          data = IO.binread(local_file)
+          _upload_signatures(local_file, remote_file, data, Delta.block_size(data.length), [])
+
+          @window.puts("Attempting to upload the changes in #{local_file} to #{remote_file}")
+        elsif(opts[:resume])
+          query = CommandPacket.new({
             :is_request => true,
             :request_id => request_id(),
-            :command_id => CommandPacket::COMMAND_UPLOAD,
-            :filename => remote_file,
-            :data => data,
+            :command_id => CommandPacket::COMMAND_UPLOAD_CHUNK,
+            :filename   => remote_file,
+            :offset     => UPLOAD_QUERY_OFFSET,
+            :data       => "",
           })
 
-          _send_request(upload, Proc.new() do |request, response|
-            @window.puts("#{data.length} bytes uploaded from #{local_file} to #{remote_file}")
+          _send_request(query, Proc.new() do |request, response|
+            offset = response.get(:size)
+
+            if(offset > File.size(local_file))
+              @window.puts("#{remote_file} is already bigger than #{local_file}, not resuming")
+            else
+              @window.puts("#{remote_file} already has #{offset} bytes, resuming from there")
+              _upload_chunk(local_file, remote_file, offset)
+            end
           end)
 
+          @window.puts("Attempting to resume uploading #{local_file} to #{remote_file}")
+        else
+          _upload_chunk(local_file, remote_file, 0)
+
           @window.puts("Attempting to upload #{local_file} to #{remote_file}")
         end
       end
@@ -264,6 +468,37 @@ module DriverCommandCommands
       end
     )
 
+    @commander.register_command("stats",
+      Trollop::Parser.new do
+        banner("Show the remote session's counters (bytes, retransmits, DNS errors, etc.)")
+      end,
+
+      Proc.new do |opts, optarg|
+        stats = CommandPacket.new({
+          :is_request => true,
+          :request_id => request_id(),
+          :command_id => CommandPacket::COMMAND_STATS,
+        })
+
+        _send_request(stats, Proc.new() do |request, response|
+          # Group them by everything before the last '.' (eg, "dns.responses")
+          groups = {}
+          response.get(:stats).each do |name, value|
+            group, _, counter = name.rpartition('.')
+            (groups[group] ||= []) << [counter, value]
+          end
+
+          groups.keys.sort.each do |group|
+            @window.puts("#{group}:")
+            groups[group].sort.each do |counter, value|
+              @window.puts("  %-24s %d" % [counter, value])
+            end
+          end
+        end)
+        @window.puts("Requesting stats...")
+      end
+    )
+
     # This is almost the same as 'set' from 'controller', except it uses the
     # local settings and recurses into global if necessary
     @commander.register_command("set",
@@ -7,7 +7,11 @@
 #
 ##
 
+require 'drivers/driver_outgoing'
+
 class DriverConsole
+  include DriverOutgoing
+
   attr_reader :stopped
   
   def initialize(window, settings)
@@ -18,6 +22,7 @@ class DriverConsole
     @window.on_input() do |data|
       @outgoing += data
       @outgoing += "\n"
+      _outgoing_queued()
     end
 
     @window.puts("This is a console session!")
@@ -31,6 +36,11 @@ class DriverConsole
     @window.puts()
   end
 
+  # True if there's something for the client (so a held poll can be answered)
+  def has_outgoing?()
+    return @outgoing.length > 0
+  end
+
   def feed(data)
     @window.print(data)
 
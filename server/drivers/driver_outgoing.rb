@@ -0,0 +1,24 @@
+##
+# driver_outgoing.rb
+# Created October 14, 2026
+# By Ron Bowes
+#
+# See: LICENSE.md
+#
+# Lets a driver tell its session when it has something new for the client
+# (so a held poll can be answered right away; see Session#_hold_poll).
+##
+
+module DriverOutgoing
+  # The block is called (with no arguments) whenever there's something new
+  # for the client, maybe from another thread
+  def on_outgoing(&block)
+    @on_outgoing = block
+  end
+
+  def _outgoing_queued()
+    if(@on_outgoing)
+      @on_outgoing.call()
+    end
+  end
+end
@@ -9,7 +9,11 @@
 
 require 'open3'
 
+require 'drivers/driver_outgoing'
+
 class DriverProcess
+  include DriverOutgoing
+
   def initialize(window, settings, process)
     @window = window
     @settings = settings
@@ -52,6 +56,7 @@ class DriverProcess
           # binary friendly, and reading more than 1 byte means that buffering happens
           while line = stdout.read(1)
             @outgoing += line
+            _outgoing_queued()
           end
 
           # Get the exit status
@@ -64,6 +69,7 @@ class DriverProcess
           end
 
           @done = true
+          _outgoing_queued()
 
         end
       rescue Exception => e
@@ -72,6 +78,11 @@ class DriverProcess
     end
   end
 
+  # True if there's something for the client (so a held poll can be answered)
+  def has_outgoing?()
+    return @outgoing.length > 0 || @done
+  end
+
   def feed(data)
     if(@done)
       return nil
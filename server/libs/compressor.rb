@@ -0,0 +1,147 @@
+##
+# compressor.rb
+# By Ron Bowes
+# Created October, 2026
+#
+# See LICENSE.md
+#
+# The streaming LZ77 compressor used by sessions with OPT_COMPRESSED; see the
+# client's libs/compressor.h for the format. Each direction remembers the last
+# WINDOW bytes, so a match can point back into earlier packets.
+##
+
+require 'libs/dnscat_exception'
+
+class Compressor
+  WINDOW     = 0x10000
+  HASH_SIZE  = 0x1000
+  MIN_MATCH  = 4
+  MAX_MATCH  = 0x7F + MIN_MATCH
+  MAX_RUN    = 0x80
+
+  def initialize()
+    # Compressing: the end of what we've compressed so far, how much came
+    # before it, and where each 4-byte sequence was last seen
+    @out_history  = ''.force_encoding("ASCII-8BIT")
+    @out_position = 0
+    @out_hash     = Array.new(HASH_SIZE)
+
+    # Decompressing: the end of what we've produced so far, and whatever part
+    # of a token hasn't arrived yet
+    @in_history       = ''.force_encoding("ASCII-8BIT")
+    @in_token         = []
+    @in_literals_left = 0
+  end
+
+  # This is the same hash the client uses, but it doesn't have to be
+  def _hash(data, i)
+    value = (data.getbyte(i) << 24) | (data.getbyte(i+1) << 16) | (data.getbyte(i+2) << 8) | data.getbyte(i+3)
+
+    return ((value * 2654435761) & 0xFFFFFFFF) >> 20
+  end
+
+  def _add_literals(out, data)
+    0.step(data.length - 1, MAX_RUN) do |i|
+      run = data[i, MAX_RUN]
+      out << (run.length - 1).chr() << run
+    end
+  end
+
+  def compress(data)
+    data = data.dup().force_encoding("ASCII-8BIT")
+    out = ''.force_encoding("ASCII-8BIT")
+
+    # Gluing the history onto the front means matches are just offsets into
+    # one string
+    stream = @out_history + data
+    base = @out_history.length
+    start = @out_position - base
+
+    i = base
+    run_start = base
+    while(i < stream.length)
+      match_length = 0
+      distance = 0
+
+      if(stream.length - i >= MIN_MATCH)
+        bucket = _hash(stream, i)
+        candidate = @out_hash[bucket]
+        @out_hash[bucket] = start + i
+
+        if(candidate)
+          distance = (start + i) - candidate
+
+          if(distance > 0 && distance <= WINDOW && candidate >= start)
+            candidate -= start
+            while(match_length < MAX_MATCH && i + match_length < stream.length && stream.getbyte(candidate + match_length) == stream.getbyte(i + match_length))
+              match_length += 1
+            end
+          end
+        end
+      end
+
+      if(match_length < MIN_MATCH)
+        i += 1
+        next
+      end
+
+      _add_literals(out, stream[run_start...i])
+      out << [0x80 | (match_length - MIN_MATCH), distance - 1].pack("Cn")
+
+      1.upto(match_length - 1) do |j|
+        if(i + j + MIN_MATCH <= stream.length)
+          @out_hash[_hash(stream, i + j)] = start + i + j
+        end
+      end
+
+      i += match_length
+      run_start = i
+    end
+
+    _add_literals(out, stream[run_start..-1])
+
+    @out_position += data.length
+    @out_history = stream.length > WINDOW ? stream[-WINDOW..-1] : stream
+
+    return out
+  end
+
+  def decompress(data)
+    history = @in_history
+    base = history.length
+
+    data.each_byte do |b|
+      if(@in_literals_left > 0)
+        history << b.chr()
+        @in_literals_left -= 1
+        next
+      end
+
+      @in_token << b
+
+      if((@in_token[0] & 0x80) == 0)
+        @in_literals_left = @in_token[0] + 1
+        @in_token = []
+      elsif(@in_token.length == 3)
+        match_length = (@in_token[0] & 0x7F) + MIN_MATCH
+        distance = ((@in_token[1] << 8) | @in_token[2]) + 1
+
+        if(distance > history.length)
+          raise(DnscatException, "Compressed data refers to something we never saw")
+        end
+
+        # One byte at a time, since a match can overlap what it's creating
+        match_length.times() do
+          history << history[history.length - distance]
+        end
+
+        @in_token = []
+      end
+    end
+
+    out = history[base..-1]
+    @in_history = history.length > WINDOW ? history[-WINDOW..-1] : history
+
+    return out
+  end
+end
@@ -0,0 +1,225 @@
+##
+# delta.rb
+# By Ron Bowes
+# Created October, 2026
+#
+# See LICENSE.md
+#
+# rsync-style deltas, for the download --delta and upload --delta commands;
+# see the client's libs/delta.h for how they work and what they look like on
+# the wire. Signatures are [weak, strong] pairs, and ops are either
+# [OP_COPY, first_block, count] or [OP_DATA, data].
+##
+
+require 'sha3'
+
+require 'libs/dnscat_exception'
+
+module Delta
+  STRONG_LENGTH    = 8
+  SIGNATURE_LENGTH = 4 + STRONG_LENGTH
+
+  OP_COPY = 0x00
+  OP_DATA = 0x01
+
+  # Block sizes are picked so a file has about MAX_BLOCKS of them (but never
+  # less than MIN_BLOCK_SIZE, or more than the client supports)
+  MIN_BLOCK_SIZE = 512
+  MAX_BLOCK_SIZE = 65536
+  MAX_BLOCKS     = 1024
+
+  def Delta.block_size(file_size)
+    return [[MIN_BLOCK_SIZE, (file_size + MAX_BLOCKS - 1) / MAX_BLOCKS].max(), MAX_BLOCK_SIZE].min()
+  end
+
+  def Delta.weak(data, offset, length)
+    a = 0
+    b = 0
+
+    0.upto(length - 1) do |i|
+      byte = data.getbyte(offset + i)
+      a += byte
+      b += (length - i) * byte
+    end
+
+    return (a & 0xFFFF) | ((b & 0xFFFF) << 16)
+  end
+
+  def Delta.roll(weak, out, inn, length)
+    a = ((weak & 0xFFFF) - out + inn) & 0xFFFF
+    b = ((weak >> 16) - (length * out) + a) & 0xFFFF
+
+    return a | (b << 16)
+  end
+
+  def Delta.strong(data)
+    return SHA3::Digest::SHA256.digest(data)[0, STRONG_LENGTH]
+  end
+
+  # The signatures of every whole block in data
+  def Delta.signatures(data, block_size)
+    return (0...(data.length / block_size)).map() do |i|
+      [Delta.weak(data, i * block_size, block_size), Delta.strong(data[i * block_size, block_size])]
+    end
+  end
+
+  def Delta.pack_signatures(signatures)
+    return signatures.map() { |weak, strong| [weak, strong].pack("Na*") }.join()
+  end
+
+  def Delta.unpack_signatures(data)
+    if((data.length % SIGNATURE_LENGTH) != 0)
+      raise(DnscatException, "Signatures are the wrong length: #{data.length}")
+    end
+
+    return (0...(data.length / SIGNATURE_LENGTH)).map() do |i|
+      data[i * SIGNATURE_LENGTH, SIGNATURE_LENGTH].unpack("Na#{STRONG_LENGTH}")
+    end
+  end
+
+  # The ops that turn the blocks in signatures into data
+  def Delta.encode(data, signatures, block_size)
+    # weak => [[strong, block], ...], first block first
+    table = {}
+    signatures.each_with_index() do |(weak, strong), block|
+      (table[weak] ||= []) << [strong, block]
+    end
+
+    ops = []
+    literal = 0
+    position = 0
+    weak = nil
+
+    while(position + block_size <= data.length)
+      weak ||= Delta.weak(data, position, block_size)
+
+      match = nil
+      if(candidates = table[weak])
+        strong = Delta.strong(data[position, block_size])
+        match = candidates.find() { |s, block| s == strong }
+      end
+
+      if(match)
+        if(literal < position)
+          ops << [OP_DATA, data[literal...position]]
+        end
+
+        last = ops.last()
+        if(last && last[0] == OP_COPY && last[1] + last[2] == match[1])
+          last[2] += 1
+        else
+          ops << [OP_COPY, match[1], 1]
+        end
+
+        position += block_size
+        literal = position
+        weak = nil
+      else
+        if(position + block_size < data.length)
+          weak = Delta.roll(weak, data.getbyte(position), data.getbyte(position + block_size), block_size)
+        end
+        position += 1
+      end
+    end
+
+    if(literal < data.length)
+      ops << [OP_DATA, data[literal..-1]]
+    end
+
+    return ops
+  end
+
+  def Delta.pack_ops(ops)
+    return ops.map() do |op|
+      if(op[0] == OP_COPY)
+        [OP_COPY, op[1], op[2]].pack("CNN")
+      else
+        [OP_DATA, op[1].length, op[1]].pack("CNa*")
+      end
+    end.join()
+  end
+
+  def Delta.unpack_ops(data)
+    ops = []
+
+    while(data.length > 0)
+      type, data = data.unpack("Ca*")
+
+      if(type == OP_COPY && data.length >= 8)
+        first, count, data = data.unpack("NNa*")
+        ops << [OP_COPY, first, count]
+      elsif(type == OP_DATA && data.length >= 4)
+        length, data = data.unpack("Na*")
+        if(data.length < length)
+          raise(DnscatException, "A DATA op is longer than what's left")
+        end
+        ops << [OP_DATA, data[0, length]]
+        data = data[length..-1]
+      else
+        raise(DnscatException, "Bad delta op: #{type}")
+      end
+    end
+
+    return ops
+  end
+
+  # How much of the new file a list of ops makes
+  def Delta.length(ops, block_size)
+    return ops.inject(0) do |sum, op|
+      sum + (op[0] == OP_COPY ? op[2] * block_size : op[1].length)
+    end
+  end
+
+  # How much of it is sent as data
+  def Delta.data_length(ops)
+    return ops.inject(0) { |sum, op| sum + (op[0] == OP_DATA ? op[1].length : 0) }
+  end
+
+  # Follow the ops to make (part of) the new file out of basis
+  def Delta.apply(ops, basis, block_size)
+    out = ''.force_encoding("ASCII-8BIT")
+
+    ops.each do |op|
+      if(op[0] == OP_COPY)
+        if((op[1] + op[2]) * block_size > basis.length)
+          raise(DnscatException, "A COPY op goes past the end of the file")
+        end
+        out << basis[op[1] * block_size, op[2] * block_size]
+      else
+        out << op[1]
+      end
+    end
+
+    return out
+  end
+
+  # Split ops into pieces with about max_length bytes of data each (long DATAs
+  # get cut up), so they can be sent one at a time
+  def Delta.split(ops, max_length)
+    pieces = [[]]
+    length = 0
+
+    ops.each do |op|
+      if(op[0] == OP_COPY)
+        pieces.last() << op
+        length += 9
+        next
+      end
+
+      data = op[1]
+      while(data.length > 0)
+        if(length >= max_length)
+          pieces << []
+          length = 0
+        end
+
+        part = data[0, max_length - length]
+        pieces.last() << [OP_DATA, part]
+        length += part.length
+        data = data[part.length..-1]
+      end
+    end
+
+    return pieces
+  end
+end
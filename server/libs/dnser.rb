@@ -34,6 +34,17 @@
 # `transaction` is of type DNSer::Transaction, and allows you to respond to the
 # request either immediately or asynchronously.
 #
+# By default, UDP requests are handled one at a time by the thread that
+# receives them. Passing a number of workers to DNSer.new hands them off to
+# that many threads instead; on_request can be given a proc that says which
+# requests have to be handled in order (requests it returns the same value for
+# always go to the same worker):
+#
+#   dnser = DNSer.new("0.0.0.0", 53, false, 4)
+#   dnser.on_request(Proc.new() { |request| request.questions[0].name }) do |transaction|
+#     ...
+#   end
+#
 # DNSer currently supports the following record types: A, NS, CNAME, SOA, MX,
 # TXT, and AAAA.
 ##
@@ -42,7 +53,7 @@ require 'ipaddr'
 require 'socket'
 require 'timeout'
 
-require_relative './vash'
+require_relative './retransmit_cache'
 
 class DNSer
   # Create a custom error message
@@ -52,6 +63,9 @@ class DNSer
   class Packet
     attr_accessor :trn_id, :opcode, :flags, :rcode, :questions, :answers
 
+    # The UDP payload size from an EDNS0 OPT record, or nil if there wasn't one
+    attr_accessor :edns_size
+
     # Request / response
     QR_QUERY    = 0x0000
     QR_RESPONSE = 0x0001
@@ -97,6 +111,7 @@ class DNSer
     TYPE_MX    = 0x000f
     TYPE_TXT   = 0x0010
     TYPE_AAAA  = 0x001c
+    TYPE_OPT   = 0x0029
     TYPE_ANY   = 0x00FF
 
     TYPES = {
@@ -107,6 +122,7 @@ class DNSer
       TYPE_MX    => "MX",
       TYPE_TXT   => "TXT",
       TYPE_AAAA  => "AAAA",
+      TYPE_OPT   => "OPT",
       TYPE_ANY   => "ANY",
     }
 
@@ -135,6 +151,13 @@ class DNSer
       return result.join("|")
     end
 
+    # The smallest and largest UDP payload sizes we'll use with EDNS0
+    EDNS_MIN_SIZE = 512
+    EDNS_MAX_SIZE = 4096
+
+    # The largest message over TCP (its length is 16 bits)
+    TCP_MAX_SIZE = 65535
+
     # Classes - we only define IN (Internet)
     CLS_IN                = 0x0001 # Internet
 
@@ -243,15 +266,34 @@ class DNSer
         end
       end
 
+      # Pointers can only go this far into the packet; they can reach 0x3FFF,
+      # but the dnscat2 client only reads the low byte of them
+      MAX_POINTER = 0xFF
+
       # Take a name, as a dotted string ("google.com") and return it as length-
       # prefixed segments ("\x06google\x03com\x00").
       #
-      # TODO: Compress the name properly, if we can ("\xc0\x0c")
-      def DnsUnpacker.pack_name(name)
+      # If names is set, it's the names that are already in the packet (each
+      # suffix, downcased => its offset); the longest one this name ends with
+      # is replaced by a pointer to it ("\xc0\x0c"), and this name's own
+      # suffixes are added, given that it's going at offset.
+      def DnsUnpacker.pack_name(name, names = nil, offset = 0)
         result = ''
+        segments = name.split(/\./)
+
+        segments.each_index do |i|
+          if(names)
+            suffix = segments[i..-1].join('.').downcase()
+            if(names[suffix])
+              return result + [0xc000 | names[suffix]].pack("n")
+            end
+
+            if(offset + result.length <= MAX_POINTER)
+              names[suffix] = offset + result.length
+            end
+          end
 
-        name.split(/\./).each do |segment|
-          result += [segment.length(), segment].pack("Ca*")
+          result += [segments[i].length(), segments[i]].pack("Ca*")
         end
 
         result += "\0"
@@ -285,7 +327,7 @@ class DNSer
         return A.new(IPAddr.ntop(address))
       end
 
-      def serialize()
+      def serialize(names = nil, offset = 0)
         return @address.hton()
       end
 
@@ -305,8 +347,8 @@ class DNSer
         return NS.new(data.unpack_name())
       end
 
-      def serialize()
-        return DNSer::Packet::DnsUnpacker.pack_name(@name)
+      def serialize(names = nil, offset = 0)
+        return DNSer::Packet::DnsUnpacker.pack_name(@name, names, offset)
       end
 
       def to_s()
@@ -325,8 +367,8 @@ class DNSer
         return CNAME.new(data.unpack_name())
       end
 
-      def serialize()
-        return DNSer::Packet::DnsUnpacker.pack_name(@name)
+      def serialize(names = nil, offset = 0)
+        return DNSer::Packet::DnsUnpacker.pack_name(@name, names, offset)
       end
 
       def to_s()
@@ -355,10 +397,12 @@ class DNSer
         return SOA.new(primary, responsible, serial, refresh, retry_interval, expire, ttl)
       end
 
-      def serialize()
+      def serialize(names = nil, offset = 0)
+        primary = DNSer::Packet::DnsUnpacker.pack_name(@primary, names, offset)
+
         return [
-          DNSer::Packet::DnsUnpacker.pack_name(@primary),
-          DNSer::Packet::DnsUnpacker.pack_name(@responsible),
+          primary,
+          DNSer::Packet::DnsUnpacker.pack_name(@responsible, names, offset + primary.length),
           @serial,
           @refresh,
           @retry_interval,
@@ -390,8 +434,8 @@ class DNSer
         return MX.new(name, preference)
       end
 
-      def serialize()
-        name = DNSer::Packet::DnsUnpacker.pack_name(@name)
+      def serialize(names = nil, offset = 0)
+        name = DNSer::Packet::DnsUnpacker.pack_name(@name, names, offset + 2)
         return [@preference, name].pack("na*")
       end
 
@@ -414,8 +458,14 @@ class DNSer
         return TXT.new(bytes)
       end
 
-      def serialize()
-        return [@data.length, data].pack("Ca*")
+      # Anything longer than 255 bytes is split into several strings
+      def serialize(names = nil, offset = 0)
+        strings = @data.dup.force_encoding('ASCII-8BIT').scan(/.{1,255}/m)
+        if(strings.length == 0)
+          strings = ['']
+        end
+
+        return strings.map { |s| [s.length, s].pack("Ca*") }.join()
       end
 
       def to_s()
@@ -439,7 +489,7 @@ class DNSer
         return AAAA.new(IPAddr.ntop(address))
       end
 
-      def serialize()
+      def serialize(names = nil, offset = 0)
         return @address.hton()
       end
 
@@ -459,7 +509,7 @@ class DNSer
         return RRUnknown.new(type, data)
       end
 
-      def serialize()
+      def serialize(names = nil, offset = 0)
         return @data
       end
 
@@ -487,8 +537,8 @@ class DNSer
         return Question.new(name, type, cls)
       end
 
-      def serialize()
-        return [DNSer::Packet::DnsUnpacker.pack_name(@name), type, cls].pack("a*nn")
+      def serialize(names = nil, offset = 0)
+        return [DNSer::Packet::DnsUnpacker.pack_name(@name, names, offset), type, cls].pack("a*nn")
       end
 
       def type_s()
@@ -583,6 +633,9 @@ class DNSer
             rr = TXT.parse(data)
           when TYPE_AAAA
             rr = AAAA.parse(data)
+          when TYPE_OPT
+            # The EDNS0 options, which we don't use
+            rr = RRUnknown.parse(type, data, rr_length)
           else
             puts("Warning: Unknown record type: #{type}")
             rr = RRUnknown.parse(type, data, rr_length)
@@ -592,9 +645,11 @@ class DNSer
         return Answer.new(name, type, cls, ttl, rr)
       end
 
-      def serialize()
+      # The record's data starts 12 bytes after offset, right after the name
+      # pointer, type, class, ttl and length
+      def serialize(names = nil, offset = 0)
         # Hardcoding 0xc00c is kind of ugly, but it always works
-        rr = @rr.serialize()
+        rr = @rr.serialize(names, offset + 12)
         return [0xc00c, @type, @cls, @ttl, rr.length(), rr].pack("nnnNna*")
       end
 
@@ -631,7 +686,7 @@ class DNSer
 
     def Packet.parse(data)
       data = DnsUnpacker.new(data)
-      trn_id, full_flags, qdcount, ancount, _, _ = data.unpack("nnnnnn")
+      trn_id, full_flags, qdcount, ancount, nscount, arcount = data.unpack("nnnnnn")
 
       qr     = (full_flags >> 15) & 0x0001
       opcode = (full_flags >> 11) & 0x000F
@@ -650,6 +705,21 @@ class DNSer
         packet.add_answer(answer)
       end
 
+      # In requests, the only additional we care about is an EDNS0 OPT record
+      # (responses can have all sorts of stuff that we don't need)
+      if(qr == QR_QUERY)
+        0.upto(nscount - 1) do
+          Answer.parse(data)
+        end
+
+        0.upto(arcount - 1) do
+          additional = Answer.parse(data)
+          if(additional.type == TYPE_OPT)
+            packet.edns_size = [[additional.cls, EDNS_MIN_SIZE].max, EDNS_MAX_SIZE].min
+          end
+        end
+      end
+
       return packet
     end
 
@@ -671,15 +741,25 @@ class DNSer
                   @questions.length(), # qdcount
                   @answers.length(),   # ancount
                   0,                   # nscount (ignored)
-                  0                    # arcount (ignored)
+                  @edns_size ? 1 : 0   # arcount (just the OPT record)
                 ].pack("nnnnnn")
 
+      # Names that show up again (like our domain, at the end of a CNAME or MX
+      # answer) point back at the first one
+      names = {}
+
       questions.each do |q|
-        result += q.serialize()
+        result += q.serialize(names, result.length)
       end
 
       answers.each do |a|
-        result += a.serialize()
+        result += a.serialize(names, result.length)
+      end
+
+      # The OPT record: a root name, our UDP payload size as the class, and
+      # zeroes for the extended rcode/version/flags and the option length
+      if(@edns_size)
+        result += [0, TYPE_OPT, @edns_size, 0, 0].pack("CnnNn")
       end
 
       return result
@@ -734,16 +814,49 @@ class DNSer
   # Any methods with a bang ('!') in front will send the response back to the
   # requester. Only one bang method can be called, any subsequent calls will
   # throw an exception.
+  # A client's TCP connection: each message is prefixed with its length, and
+  # responses can be written from any thread.
+  class TCPConnection
+    def initialize(s)
+      @s = s
+      @mutex = Mutex.new()
+    end
+
+    # Returns nil once the connection is closed
+    def read()
+      length = @s.read(2)
+      if(length.nil? || length.length != 2)
+        return nil
+      end
+      length = length.unpack("n").shift
+
+      data = @s.read(length)
+      if(data.nil? || data.length != length)
+        return nil
+      end
+
+      return data
+    end
+
+    def write(data)
+      @mutex.synchronize() do
+        @s.write([data.length].pack("n") + data)
+      end
+    end
+  end
+
   class Transaction
     attr_reader :request, :response, :sent
 
-    def initialize(s, request, host, port, cache = nil)
+    # tcp is the TCPConnection the request came in on, or nil for UDP
+    def initialize(s, request, host, port, cache = nil, tcp = nil)
       @s       = s
       @request = request
       @host    = host
       @port    = port
       @sent    = false
       @cache   = cache
+      @tcp     = tcp
 
       @response = DNSer::Packet.new(
         @request.trn_id,
@@ -754,6 +867,36 @@ class DNSer
       )
 
       @response.add_question(@request.questions[0])
+
+      # Answer EDNS0 with EDNS0
+      if(@request.edns_size)
+        @response.edns_size = DNSer::Packet::EDNS_MAX_SIZE
+      end
+    end
+
+    # A retransmitted request comes from the same place, the same way, with the
+    # same id and question
+    def cache_key()
+      question = @request.questions[0]
+      if(question.nil?)
+        return nil
+      end
+
+      return [@host, tcp?(), @request.trn_id, question.name, question.type, question.cls]
+    end
+
+    # Whether the request came in over TCP (so the response can be as big as
+    # Packet::TCP_MAX_SIZE)
+    def tcp?()
+      return !@tcp.nil?
+    end
+
+    def _send(data)
+      if(@tcp)
+        @tcp.write(data)
+      else
+        @s.send(data, 0, @host, @port)
+      end
     end
 
     def add_answer(answer)
@@ -793,7 +936,7 @@ class DNSer
         end
 
         response.trn_id = @request.trn_id
-        @s.send(response.serialize(), 0, @host, @port)
+        _send(response.serialize())
 
         # Let the callback know if anybody registered one
         if(callback)
@@ -804,83 +947,191 @@ class DNSer
       @sent = true
     end
 
-    def reply!()
+    # Send the response; if a response is given (from the cache), that's sent
+    # instead
+    def reply!(response = nil)
       raise ArgumentError("Already sent!") if(@sent)
 
-      # Cache it if we have a cache
-      if(@cache)
-        @cache[@request.trn_id, 3] = {
-          :request  => @request,
-          :response => @response,
-        }
+      if(response)
+        @response = response
+      elsif(@cache && !cache_key().nil?)
+        @cache.set(cache_key(), @response)
       end
 
       # Send the response
-      @s.send(@response.serialize(), 0, @host, @port)
+      _send(@response.serialize())
       @sent = true
     end
   end
 
-  # Create a new DNSer and listen on the given host/port. This will throw an
-  # exception if we aren't allowed to bind to the given port.
-  def initialize(host, port, cache=false)
+  # The most UDP requests that can be waiting for each worker; past that,
+  # they're dropped (the client will send them again)
+  WORKER_QUEUE_SIZE = 256
+
+  # Create a new DNSer and listen on the given host/port (UDP, and TCP if we
+  # can). This will throw an exception if we aren't allowed to bind to the
+  # given UDP port. If workers is more than 0, that many threads handle the
+  # UDP requests (see on_request()).
+  def initialize(host, port, cache=false, workers=0)
     @s = UDPSocket.new()
     @s.bind(host, port)
     @thread = nil
+    @tcp_thread = nil
+    @workers = workers
+    @worker_threads = []
+
+    begin
+      @tcp_server = TCPServer.new(host, port)
+    rescue SystemCallError => e
+      puts("Couldn't listen on TCP port #{port} (#{e}), so DNS will be UDP-only")
+      @tcp_server = nil
+    end
 
     # Create a cache if the user wanted one
     if(cache)
-      @cache = Vash.new()
+      @cache = RetransmitCache.new()
     end
   end
 
-  # This method returns immediately, but spawns a background thread. The thread
-  # will recveive and parse DNS packets, create a transaction, and pass it to
-  # the caller's block.
-  def on_request()
-    @thread = Thread.new() do |t|
+  # Create a transaction for one request (checking the cache, if there is
+  # one), and pass it to the handler.
+  def _handle_request(data, host, port, tcp, handler)
+    _dispatch(DNSer::Packet.parse(data), host, port, tcp, handler)
+  end
+
+  def _dispatch(request, host, port, tcp, handler)
+    # Create a transaction object, which we can use to respond
+    transaction = Transaction.new(@s, request, host, port, @cache, tcp)
+
+    # If it's a retransmit, send the same answer as last time
+    if(@cache && !transaction.cache_key().nil?)
+      cached = @cache.get(transaction.cache_key())
+      if(!cached.nil?)
+        transaction.reply!(cached)
+      end
+    end
+
+    if(!transaction.sent)
       begin
-        loop do
-          data = @s.recvfrom(65536)
+        handler.call(transaction)
+      rescue StandardError => e
+        puts("Caught an error: #{e}")
+        puts(e.backtrace())
+        transaction.reply!(transaction.response_template({:rcode => DNSer::Packet::RCODE_SERVER_FAILURE}))
+      end
+    end
+  end
 
-          # Data is an array where the first element is the actual data, and the second is the host/port
-          request = DNSer::Packet.parse(data[0])
+  # Answer the requests on one TCP connection, in order, till it's closed.
+  def _handle_tcp(s, handler)
+    tcp = TCPConnection.new(s)
+    host = s.peeraddr[3]
+    port = s.peeraddr[1]
 
-          # Create a transaction object, which we can use to respond
-          transaction = Transaction.new(@s, request, data[1][3], data[1][1], @cache)
+    s.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
 
-          # If caching is enabled, deal with it
-          if(@cache)
-            # This is somewhat expensive, but we aren't using the cache for performance
-            @cache.cleanup!()
+    loop do
+      data = tcp.read()
+      if(data.nil?)
+        break
+      end
 
-            # See if the transaction is cached
-            cached = @cache[request.trn_id]
+      _handle_request(data, host, port, tcp, handler)
+    end
+  rescue IOError, SystemCallError
+    # The client went away
+  ensure
+    s.close() rescue nil
+  end
 
-            # Verify it deeper (for security reasons)
-            if(!cached.nil?)
-              puts("POTENTIAL CACHE HIT")
-              if(request == cached[:request])
-                puts("CACHE HIT")
-                transaction.reply!(cached[:response])
-              end
-            end
+  # Receive and parse UDP requests, and queue each one for the worker that
+  # handles its key.
+  def _receive(key, handler)
+    queues = []
+    @workers.times do
+      queue = SizedQueue.new(WORKER_QUEUE_SIZE)
+      queues << queue
+
+      @worker_threads << Thread.new() do
+        loop do
+          request, host, port = queue.pop()
+
+          # One bad request mustn't take the worker (and every session that
+          # hashes to it) down with it
+          begin
+            _dispatch(request, host, port, nil, handler)
+          rescue StandardError => e
+            puts("Caught an error handling a request from #{host}:#{port}: #{e}")
+            puts(e.backtrace())
           end
+        end
+      end
+    end
 
-          if(!transaction.sent)
-            begin
-              proc.call(transaction)
-            rescue StandardError => e
-              puts("Caught an error: #{e}")
-              puts(e.backtrace())
-              transaction.reply!(transaction.response_template({:rcode => DNSer::Packet::RCODE_SERVER_FAILURE}))
-            end
+    loop do
+      data = @s.recvfrom(65536)
+
+      begin
+        request = DNSer::Packet.parse(data[0])
+      rescue DNSer::DnsException => e
+        puts("Couldn't parse a request from #{data[1][3]}:#{data[1][1]}: #{e}")
+        next
+      end
+
+      # Without a key, everything from the same client stays in order
+      begin
+        k = key.nil? ? data[1][3] : key.call(request)
+      rescue StandardError
+        k = nil
+      end
+
+      begin
+        queues[k.hash % queues.length].push([request, data[1][3], data[1][1]], true)
+      rescue ThreadError
+        # That worker's full, so drop it
+      end
+    end
+  end
+
+  # This method returns immediately, but spawns a background thread. The thread
+  # will recveive and parse DNS packets, create a transaction, and pass it to
+  # the caller's block. Requests over TCP are handled the same way, by a
+  # thread per connection.
+  #
+  # If there are workers, the block is called on them instead, and key (if
+  # it's given) is called with each parsed request; requests it returns the
+  # same value for are handled in the order they arrived.
+  def on_request(key = nil, &handler)
+    @thread = Thread.new() do |t|
+      begin
+        if(@workers > 0)
+          _receive(key, handler)
+        else
+          loop do
+            data = @s.recvfrom(65536)
+
+            # Data is an array where the first element is the actual data, and the second is the host/port
+            _handle_request(data[0], data[1][3], data[1][1], nil, handler)
           end
         end
       ensure
         @s.close
       end
     end
+
+    if(@tcp_server)
+      @tcp_thread = Thread.new() do
+        begin
+          loop do
+            Thread.start(@tcp_server.accept()) do |s|
+              _handle_tcp(s, handler)
+            end
+          end
+        rescue IOError
+          # The server was stopped
+        end
+      end
+    end
   end
 
   # Kill the listener
@@ -892,6 +1143,18 @@ class DNSer
 
     @thread.kill()
     @thread = nil
+
+    @worker_threads.each do |thread|
+      thread.kill()
+    end
+    @worker_threads = []
+
+    if(@tcp_server)
+      @tcp_server.close()
+      @tcp_thread.join()
+      @tcp_server = nil
+      @tcp_thread = nil
+    end
   end
 
   # After calling on_request(), this can be called to halt the program's
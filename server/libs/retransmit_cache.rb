@@ -0,0 +1,105 @@
+##
+# retransmit_cache.rb
+# By Ron Bowes
+# Created October, 2026
+#
+# See LICENSE.md
+#
+# Remembers the responses the DNSer sent for a few seconds, so a resolver that
+# retransmits a request (because our answer was late or lost) gets the same
+# answer again instead of the request being handled twice.
+#
+# The entries live in a Hash, which keeps keys in the order they were added;
+# moving an entry to the end whenever it's used makes the first key the least
+# recently used one, and that's what goes when the cache is full. To expire
+# entries without looking at all of them, each one is also put in a timing
+# wheel: a ring of one-second slots, where an entry goes in the slot for the
+# second it expires. Each call only has to empty the slots for the seconds
+# that went by since the last one.
+#
+# It's safe to use from more than one thread.
+##
+
+class RetransmitCache
+  # How many entries are kept, and how long they last (in seconds), by default
+  DEFAULT_SIZE = 4096
+  DEFAULT_TTL  = 3
+
+  # The longest an entry can last, which is also the number of slots (less one)
+  MAX_TTL = 60
+
+  def initialize(size = DEFAULT_SIZE)
+    @size    = size
+    @entries = {}
+    @wheel   = Array.new(MAX_TTL + 1) { [] }
+    @now     = Time.now.to_i
+    @mutex   = Mutex.new()
+  end
+
+  # Expire everything that's due, one slot per second that's gone by
+  def _advance()
+    now = Time.now.to_i
+
+    # If we've been idle that long, everything is gone anyways
+    if(now - @now > MAX_TTL)
+      @entries.clear()
+      @wheel.each() { |slot| slot.clear() }
+      @now = now
+    end
+
+    while(@now < now)
+      @now += 1
+      slot = @wheel[@now % @wheel.length]
+
+      # Keys that were stored again since (or thrown away) are skipped
+      slot.each do |key|
+        entry = @entries[key]
+        if(!entry.nil? && entry[:expires] <= @now)
+          @entries.delete(key)
+        end
+      end
+
+      slot.clear()
+    end
+  end
+
+  # Get the value for a key, or nil if it isn't there (or has expired)
+  def get(key)
+    @mutex.synchronize() do
+      _advance()
+
+      entry = @entries.delete(key)
+      if(entry.nil?)
+        return nil
+      end
+
+      # It's the most recently used, now
+      @entries[key] = entry
+
+      return entry[:value]
+    end
+  end
+
+  def set(key, value, ttl = DEFAULT_TTL)
+    @mutex.synchronize() do
+      _advance()
+
+      expires = @now + [[ttl.to_i, 1].max, MAX_TTL].min
+
+      @entries.delete(key)
+      @entries[key] = { :value => value, :expires => expires }
+      @wheel[expires % @wheel.length] << key
+
+      # The first one is the least recently used
+      while(@entries.length > @size)
+        @entries.shift()
+      end
+    end
+  end
+
+  def length()
+    @mutex.synchronize() do
+      return @entries.length
+    end
+  end
+end
@@ -42,6 +42,12 @@
 # * :to_descendants - Sends to the current window, its children, its children's children, etc.
 #
 # Each window also maintains a history of typed comments, up to 1000 lines (by default).
+#
+# Nothing is written to the terminal straight away: output is collected and
+# written by its own thread every FLUSH_INTERVAL seconds, so a busy session
+# can't slow down whoever's printing (like the DNS driver). If more than
+# MAX_FLUSH bytes pile up between flushes, only the newest are drawn (the rest
+# are still in the window's history).
 ##
 
 require 'readline'
@@ -58,6 +64,20 @@ class SWindow
   @@history_size = 1000
   @@firehose = false
 
+  # How often output is written, in seconds
+  FLUSH_INTERVAL = 0.05
+
+  # The most output that's written per flush
+  MAX_FLUSH = 65536
+
+  @@output = []
+  @@output_length = 0
+  @@output_skipped = 0
+  @@output_lock = Mutex.new()
+
+  # Held while flushing, so two flushes can't write out of order
+  @@flush_lock = Mutex.new()
+
   # This function will trap the TSTP signal (suspend, ctrl-z) and, if possible,
   # activate the parent window.
   def SWindow._catch_suspend()
@@ -72,6 +92,70 @@ class SWindow
     Signal.trap("TSTP", orig_suspend)
   end
 
+  # Queue some output for the terminal
+  def SWindow._write(str)
+    @@output_lock.synchronize() do
+      @@output << str
+      @@output_length += str.length
+
+      # Only the newest MAX_FLUSH bytes are going to be drawn anyways
+      while(@@output.length > 1 && @@output_length - @@output[0].length >= MAX_FLUSH)
+        @@output_length -= @@output[0].length
+        @@output_skipped += @@output.shift().length
+      end
+    end
+  end
+
+  # Write out whatever's waiting
+  def SWindow.flush()
+    @@flush_lock.synchronize() do
+      output = nil
+      skipped = 0
+
+      @@output_lock.synchronize() do
+        if(@@output.length == 0)
+          return
+        end
+
+        output = @@output.join("")
+        skipped = @@output_skipped
+
+        @@output = []
+        @@output_length = 0
+        @@output_skipped = 0
+      end
+
+      if(output.length > MAX_FLUSH)
+        skipped += output.length - MAX_FLUSH
+        output = output[-MAX_FLUSH..-1]
+      end
+
+      if(skipped > 0)
+        $stdout.write("[... #{skipped} bytes weren't shown, but they're in the window's history ...]\n")
+      end
+      $stdout.write(output)
+      $stdout.flush()
+    end
+  end
+
+  @@output_thread = Thread.new() do
+    loop do
+      sleep(FLUSH_INTERVAL)
+
+      begin
+        SWindow.flush()
+      rescue StandardError => e
+        $stderr.puts(e)
+        $stderr.puts(e.backtrace.join("\n"))
+      end
+    end
+  end
+
+  # Don't lose the last of it when the program exits
+  at_exit() do
+    SWindow.flush()
+  end
+
   @@input_thread = Thread.new() do
     begin
       # This lets the program load a bit before the initial prompt is printed (a slightly better user experience)
@@ -82,6 +166,9 @@ class SWindow
             while @@active.nil? do
             end
 
+            # Anything the last command printed goes before the prompt
+            SWindow.flush()
+
             if(@@active.noinput)
               str = Readline::readline()
             else
@@ -226,15 +313,20 @@ class SWindow
 
   # Write to a window, just like $stdout.puts()
   def puts(str = "")
+    line = str.to_s()
+    if(!line.end_with?("\n"))
+      line += "\n"
+    end
+
     if(@@firehose)
-      $stdout.puts(str)
+      SWindow._write(line)
       return
     end
 
     _we_just_got_data()
 
     if(@@active == self)
-      $stdout.puts(str)
+      SWindow._write(line)
     end
     @history << (str.to_s() + "\n")
 
@@ -243,16 +335,17 @@ class SWindow
 
   # Write to a window, just like $stdout.print()
   def print(str = "")
+    str = str.to_s()
+
     if(@@firehose)
-      $stdout.print(str)
+      SWindow._write(str)
       return
     end
 
     _we_just_got_data()
 
-    str = str.to_s()
     if(@@active == self)
-      $stdout.print(str)
+      SWindow._write(str)
     end
     @history << str.to_s()
 
@@ -278,8 +371,10 @@ class SWindow
     # Set this window to the activate one
     @@active = self
 
-    # Re-draw the history
-    $stdout.puts(@history.join(""))
+    # Re-draw the history (straight away, so it comes before the prompt)
+    history = @history.join("")
+    SWindow._write(history.end_with?("\n") ? history : history + "\n")
+    SWindow.flush()
 
     # It appears that some versions of Readline don't support :clear, so only do this if we can
     if(Readline::HISTORY.respond_to?(:clear))
@@ -297,7 +392,7 @@ class SWindow
     if(@parent)
       @parent.activate()
     else
-      $stdout.puts("Can't close the main window!")
+      SWindow._write("Can't close the main window!\n")
     end
   end
 
@@ -0,0 +1,59 @@
+##
+# test_controller.rb
+# Created October 14, 2026
+# By Ron Bowes
+#
+# See: LICENSE.md
+#
+# Checks how the controller answers bundles.
+##
+
+$LOAD_PATH << File.dirname(__FILE__) + "/.."
+
+require 'minitest/autorun'
+require 'libs/swindow'
+
+WINDOW = SWindow.new(nil, true, { :quiet => true })
+
+require 'controller/controller'
+
+class TestController < Minitest::Test
+  # A controller whose sessions always answer with as much as they're allowed
+  def greedy_controller()
+    controller = Controller.allocate()
+
+    def controller.feed(data, max_length, hold = nil)
+      if(Packet.peek_type(data) == Packet::MESSAGE_TYPE_BUNDLE)
+        return _feed_bundle(data, max_length)
+      end
+
+      return "A" * max_length
+    end
+
+    return controller
+  end
+
+  def bundle(count)
+    return Packet.create_bundle((1..count).map() { |i| [i, Packet::MESSAGE_TYPE_MSG, i].pack("nCn") })
+  end
+
+  def test_bundle_fits()
+    controller = greedy_controller()
+
+    [1, 2, 3, 4, 5, 8, 16, 40].each do |count|
+      [40, 120, 255, 500, 1232].each do |max_length|
+        response = controller.feed(bundle(count), max_length)
+
+        assert(response.length <= max_length, "#{count} entries in #{max_length} bytes came back as #{response.length}")
+        assert_equal([count, (max_length - Packet::BUNDLE_HEADER_SIZE) / Packet::BUNDLE_ENTRY_SIZE].min(), Packet.parse_bundle(response).length)
+      end
+    end
+  end
+
+  # Every entry that's answered gets the same share
+  def test_bundle_shares()
+    responses = Packet.parse_bundle(greedy_controller().feed(bundle(4), 120))
+
+    assert_equal([(120 - Packet::BUNDLE_HEADER_SIZE - (4 * Packet::BUNDLE_ENTRY_SIZE)) / 3] * 3 + [0], responses.map(&:length))
+  end
+end
@@ -0,0 +1,46 @@
+##
+# test_driver_dns.rb
+# Created October 14, 2026
+# By Ron Bowes
+#
+# See: LICENSE.md
+#
+# Checks how DriverDNS builds its answers.
+##
+
+$LOAD_PATH << File.dirname(__FILE__) + "/.."
+
+require 'minitest/autorun'
+require 'tunnel_drivers/driver_dns'
+
+class TestDriverDNS < Minitest::Test
+  # With no domain, the client only takes names that start with "dnscat."
+  # (see remove_domain() in the client's driver_dns.c)
+  def test_no_domain_names_start_with_dnscat()
+    [DNSer::Packet::TYPE_CNAME, DNSer::Packet::TYPE_MX].each do |type|
+      question = DNSer::Packet::Question.new("dnscat.414243", type)
+      template = DriverDNS.get_template(question, nil, DriverDNS::ENCODING_HEX)
+
+      assert_equal("dnscat.414243", DriverDNS.do_encoding(template, "ABC"))
+      assert_equal("dnscat", DriverDNS.do_encoding(template, ""))
+
+      encoded = DriverDNS.do_encoding(template, "A" * template[:max_length])
+      assert(encoded.start_with?("dnscat."))
+      assert(encoded.length <= template[:max_encoded_length])
+    end
+  end
+
+  def test_domain_names_end_with_the_domain()
+    [DNSer::Packet::TYPE_CNAME, DNSer::Packet::TYPE_MX].each do |type|
+      question = DNSer::Packet::Question.new("414243.example.org", type)
+      template = DriverDNS.get_template(question, "example.org", DriverDNS::ENCODING_HEX)
+
+      assert_equal("414243.example.org", DriverDNS.do_encoding(template, "ABC"))
+      assert_equal("example.org", DriverDNS.do_encoding(template, ""))
+
+      encoded = DriverDNS.do_encoding(template, "A" * template[:max_length])
+      assert(encoded.end_with?(".example.org"))
+      assert(encoded.length <= template[:max_encoded_length])
+    end
+  end
+end
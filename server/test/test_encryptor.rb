@@ -0,0 +1,86 @@
+##
+# test_encryptor.rb
+# Created October 14, 2026
+# By Ron Bowes
+#
+# See: LICENSE.md
+#
+# Checks which nonces the encryptor takes.
+##
+
+$LOAD_PATH << File.dirname(__FILE__) + "/.."
+
+require 'minitest/autorun'
+require 'libs/swindow'
+
+WINDOW = SWindow.new(nil, true, { :quiet => true })
+
+require 'controller/encryptor'
+
+class TestEncryptor < Minitest::Test
+  def setup()
+    @encryptor = Encryptor.new("")
+
+    # Skip the key exchange; all that matters is that both sides have the
+    # same keys
+    @client_keys = {
+      :my_nonce     => -1,
+      :my_write_key => "W" * 32,
+      :my_mac_key   => "M" * 32,
+    }
+    @server_keys = {
+      :their_nonce       => -1,
+      :their_nonces_seen => 0,
+      :shared_secret     => 1,
+      :their_write_key   => "W" * 32,
+      :their_mac_key     => "M" * 32,
+    }
+  end
+
+  def packet(nonce)
+    @client_keys[:my_nonce] = nonce
+    return @encryptor._encrypt_packet_internal(@client_keys, "HEADR" + "body #{nonce}")
+  end
+
+  def accepted?(packet)
+    begin
+      @encryptor._decrypt_packet_internal(@server_keys, packet)
+      return true
+    rescue Encryptor::Error
+      return false
+    end
+  end
+
+  def test_in_order()
+    0.upto(200) do |nonce|
+      assert(accepted?(packet(nonce)), "nonce #{nonce}")
+    end
+  end
+
+  def test_out_of_order()
+    assert(accepted?(packet(100)))
+    assert(accepted?(packet(90)))
+    assert(accepted?(packet(100 - Encryptor::NONCE_WINDOW + 1)))
+    assert(!accepted?(packet(100 - Encryptor::NONCE_WINDOW)))
+    assert(accepted?(packet(101)))
+    assert(accepted?(packet(95)))
+  end
+
+  def test_replay()
+    packets = (0..10).map() { |nonce| packet(nonce) }
+    [3, 0, 7, 1, 10, 2].each do |i|
+      assert(accepted?(packets[i]), "first time for #{i}")
+    end
+
+    [3, 0, 7, 1, 10, 2].each do |i|
+      assert(!accepted?(packets[i]), "replay of #{i}")
+    end
+
+    # Still seen after the window moves along (as long as they're in it)
+    assert(accepted?(packet(60)))
+    assert(!accepted?(packets[3]))
+    assert(!accepted?(packets[10]))
+    assert(accepted?(packets[9]))
+    assert(!accepted?(packets[9]))
+  end
+end
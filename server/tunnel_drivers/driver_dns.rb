@@ -20,10 +20,25 @@ class DriverDNS
   @@passthrough = nil
   @@id = 0
 
+  # The regex for each domain (see figure_out_name()), and the templates for
+  # answering questions (see get_template()); both are built the first time
+  # they're needed
+  @@domain_regexes = {}
+  @@templates = {}
+  @@templates_lock = Mutex.new()
+
+  # The most templates we keep; there's one for each record type, domain,
+  # encoding, name length and EDNS0 size that's been asked about, so this is
+  # plenty for any normal number of clients
+  MAX_TEMPLATES = 4096
+
   # Experimentally determined to work
   MAX_A_RECORDS = 64
   MAX_AAAA_RECORDS = 16
 
+  # The biggest UDP response we'll send, unless the request used EDNS0
+  MAX_PACKET_SIZE = 512
+
   RECORD_TYPES = {
     DNSer::Packet::TYPE_TXT => {
       :requires_domain => false,
@@ -53,10 +68,11 @@ class DriverDNS
       :requires_domain => false,
       :max_length      => (MAX_A_RECORDS * (4-1)) - 1, # Length-prefixed and sequenced
       :requires_hex    => false,
+      :record_size     => 4,
 
       # Encode in length-prefixed dotted-decimal notation
       :encoder         => Proc.new() do |name|
-        i = rand(255 - MAX_A_RECORDS - 1)
+        i = rand(255 - ((name.length + 1) / 3.0).ceil - 1)
         (name.length.chr + name).chars.each_slice(3).map(&:join).map do |ip|
           ip = ip.force_encoding('ASCII-8BIT').ljust(3, "\xFF".force_encoding('ASCII-8BIT'))
           i += 1
@@ -68,10 +84,11 @@ class DriverDNS
       :requires_domain => false,
       :max_length      => (MAX_AAAA_RECORDS * (16-1)) - 1, # Length-prefixed and sequenced
       :requires_hex    => false,
+      :record_size     => 16,
 
       # Encode in length-prefixed IPv6 notation
       :encoder         => Proc.new() do |name|
-        i = rand(255 - MAX_AAAA_RECORDS - 1)
+        i = rand(255 - ((name.length + 1) / 15.0).ceil - 1)
         (name.length.chr + name).chars.each_slice(15).map(&:join).map do |ip|
           ip = ip.force_encoding('ASCII-8BIT').ljust(15, "\xFF".force_encoding('ASCII-8BIT'))
           i += 1
@@ -84,6 +101,34 @@ class DriverDNS
 
   }
 
+  # How the data in a name can be encoded. Hex is the default; anything else
+  # starts with a tag label (which can't be mistaken for hex). Responses go
+  # back the same way: names with the same encoding, and TXT as raw bytes.
+  ENCODING_HEX = {
+    :name           => 'hex',
+    :bits           => 4,
+    :alphabet       => '0123456789abcdef',
+    :case_sensitive => false,
+    :regex          => /^[a-fA-F0-9.]*$/,
+  }
+
+  ENCODINGS = {
+    'x32' => {
+      :name           => 'base32',
+      :bits           => 5,
+      :alphabet       => 'abcdefghijklmnopqrstuvwxyz234567',
+      :case_sensitive => false,
+      :regex          => /^[a-zA-Z2-7.]*$/,
+    },
+    'x64' => {
+      :name           => 'base64',
+      :bits           => 6,
+      :alphabet       => 'ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_',
+      :case_sensitive => true,
+      :regex          => /^[a-zA-Z0-9\-_.]*$/,
+    },
+  }
+
   # If domain is non-nil, match /(.*)\.domain/
   # If domain is nil, match /identifier\.(.*)/
   # If required_prefix is set, it only matches domains that contain that prefix
@@ -108,7 +153,8 @@ class DriverDNS
   def DriverDNS.figure_out_name(name, domains)
     # Check if it's one of our domains
     domains.each do |domain|
-      if(name =~ /^(.*)\.(#{domain})/i)
+      regex = (@@domain_regexes[domain] ||= /^(.*)\.(#{domain})/i)
+      if(name =~ regex)
         return $1, $2
       end
     end
@@ -123,6 +169,38 @@ class DriverDNS
     return nil
   end
 
+  # Split the encoding's tag (if any) off the front of the name
+  def DriverDNS.figure_out_encoding(name)
+    if(name =~ /^(x32|x64)\.(.*)$/i)
+      return ENCODINGS[$1.downcase], $2
+    end
+
+    return ENCODING_HEX, name
+  end
+
+  # Encode a string using any of the bit-packed encodings (the last
+  # character is padded with zeroes)
+  def DriverDNS.encode_bits(data, encoding)
+    bits = encoding[:bits]
+
+    return data.unpack("B*").pop.scan(/.{1,#{bits}}/).map do |b|
+      encoding[:alphabet][b.ljust(bits, '0').to_i(2)]
+    end.join
+  end
+
+  # The opposite of encode_bits (leftover padding bits are discarded)
+  def DriverDNS.decode_bits(str, encoding)
+    if(!encoding[:case_sensitive])
+      str = str.downcase
+    end
+
+    bits = str.chars.map do |c|
+      ("%0#{encoding[:bits]}b" % encoding[:alphabet].index(c))
+    end.join
+
+    return [bits[0, bits.length - (bits.length % 8)]].pack("B*")
+  end
+
   def DriverDNS.set_passthrough(host, port)
     if(host.nil?)
       @@passthrough = nil
@@ -160,95 +238,226 @@ class DriverDNS
     @shown_pt = true
   end
 
-  def DriverDNS.packet_to_bytes(question, domains)
+  # Split a question into which of our domains it's for (nil if it started
+  # with "dnscat."), how it's encoded, and the (still encoded) data; or nil,
+  # if it isn't for us
+  def DriverDNS.split_name(question, domains)
     # Determine the actual name, without the extra cruft
-    name, _ = DriverDNS.figure_out_name(question.name, domains)
+    name, domain = DriverDNS.figure_out_name(question.name, domains)
 
     if(name.nil?)
       return nil
     end
 
-    if(name !~ /^[a-fA-F0-9.]*$/)
+    encoding, name = DriverDNS.figure_out_encoding(name)
+
+    return domain, encoding, name
+  end
+
+  # Turn the data from split_name() into bytes (nil if it isn't valid)
+  def DriverDNS.decode_name(name, encoding)
+    if(name !~ encoding[:regex])
       return nil
     end
 
     # Get rid of periods in the incoming name
     name = name.gsub(/\./, '')
-    name = [name].pack("H*")
 
-    return name
+    if(encoding == ENCODING_HEX)
+      return [name].pack("H*")
+    end
+
+    return DriverDNS.decode_bits(name, encoding)
   end
 
-  def DriverDNS.get_max_length(question, domains)
-    # Determine the actual name, without the extra cruft
-    name, domain = DriverDNS.figure_out_name(question.name, domains)
+  def DriverDNS.packet_to_bytes(question, domains)
+    _, encoding, name = DriverDNS.split_name(question, domains)
 
-    if(name.nil?)
+    if(encoding.nil?)
       return nil
     end
 
+    return DriverDNS.decode_name(name, encoding)
+  end
+
+  # How big a response can be, based on the request's EDNS0 size (if any;
+  # requests over TCP pass DNSer::Packet::TCP_MAX_SIZE instead)
+  def DriverDNS.get_packet_size(edns_size)
+    if(edns_size.nil?)
+      return MAX_PACKET_SIZE
+    end
+
+    return [edns_size, DNSer::Packet::TCP_MAX_SIZE].min
+  end
+
+  # How much room is left in the response after the header, the question
+  # (name, type and class), the OPT record (if any), and the records' headers
+  # (compressed name, type, class, ttl and length)
+  def DriverDNS.get_room(question, edns_size, record_count = 1)
+    room = DriverDNS.get_packet_size(edns_size) - 12 - (question.name.length + 2 + 4) - (12 * record_count)
+    if(!edns_size.nil?)
+      room -= 11
+    end
+
+    return room
+  end
+
+  # Whether a TXT response can be split into several strings. Older clients
+  # only read the first, so only clients that use a tagged encoding or EDNS0
+  # (which older clients never did) get more than one.
+  def DriverDNS.multi_string_txt?(encoding, edns_size)
+    return encoding != ENCODING_HEX || !edns_size.nil?
+  end
+
+  # How many characters of TXT data fit in the response to the question,
+  # given that the TXT can be split into multiple 255-byte strings.
+  def DriverDNS.get_max_txt_length(question, edns_size)
+    room = DriverDNS.get_room(question, edns_size)
+
+    # Each string costs a length byte
+    return room - ((room + 255) / 256)
+  end
+
+  # How many bytes fit into A or AAAA records. Without EDNS0 we stick to the
+  # experimentally determined limits; with it, we use as many records as fit
+  # (but the length prefix is a single byte).
+  def DriverDNS.get_max_record_length(question, type_info, edns_size)
+    if(edns_size.nil?)
+      return type_info[:max_length]
+    end
+
+    record_size = type_info[:record_size]
+    records = DriverDNS.get_room(question, edns_size, 0) / (12 + record_size)
+
+    return [[(records * (record_size - 1)) - 1, 255].min, type_info[:max_length]].max
+  end
+
+  # Everything about answering a question that doesn't depend on what's in
+  # it: the record type, the encoding, what goes on the end of names, and how
+  # much data fits (:max_length) and how long it can be once it's encoded
+  # (:max_encoded_length). That only changes with the record type, domain,
+  # encoding, name length and EDNS0 size, and a session's queries tend to
+  # have the same ones, so they're cached.
+  def DriverDNS.get_template(question, domain, encoding, edns_size = nil)
+    key = [question.type, domain, encoding[:name], question.name.length, edns_size]
+
+    template = @@templates_lock.synchronize() { @@templates[key] }
+    if(template)
+      return template
+    end
+
     type_info = RECORD_TYPES[question.type]
     if(type_info.nil?)
-      raise(DnscatException, "Couldn't figure out how to handle the record type! (please report this, it shouldn't happen): " + type)
+      raise(DnscatException, "Couldn't figure out how to handle the record type! (please report this, it shouldn't happen): " + question.type_s())
     end
 
-    # Figure out the length of the domain based on the record type
+    # Figure out what goes on the names, based on the record type (with no
+    # domain, they start with "dnscat." instead of ending with the domain)
+    prefix = nil
+    suffix = nil
+    domain_length = 0
     if(type_info[:requires_domain])
       if(domain.nil?)
-        domain_length = ("dnscat.").length
+        prefix = "dnscat"
+        domain_length = prefix.length + 1 # +1 for the dot
       else
-        domain_length = domain.length + 1 # +1 for the dot
+        suffix = domain
+        domain_length = suffix.length + 1 # +1 for the dot
       end
-    else
-      domain_length = 0
     end
 
+    multi_string = (question.type == DNSer::Packet::TYPE_TXT && DriverDNS.multi_string_txt?(encoding, edns_size))
+
     # Figure out the max length of data we can handle
-    if(type_info[:requires_hex])
+    if(multi_string)
+      # As many strings as fit (raw bytes, unless the request was hex)
+      max_length = DriverDNS.get_max_txt_length(question, edns_size)
+      if(encoding == ENCODING_HEX)
+        max_length = max_length / 2
+      end
+    elsif(type_info[:requires_hex] && encoding != ENCODING_HEX)
+      # Leave room for the periods between each 63-character chunk
+      chars = type_info[:max_length] - domain_length
+      chars -= (chars / 64) + 1
+      max_length = (chars * encoding[:bits]) / 8
+    elsif(type_info[:requires_hex])
       max_length = (type_info[:max_length] / 2) - domain_length
     else
-      max_length = (type_info[:max_length]) - domain_length
+      max_length = DriverDNS.get_max_record_length(question, type_info, edns_size) - domain_length
     end
 
-    return max_length
-  end
+    template = {
+      :type_info          => type_info,
+      :encoding           => encoding,
+      :prefix             => prefix,
+      :suffix             => suffix,
+      :max_length         => max_length,
 
-  def DriverDNS.do_encoding(question, domains, response)
-    # Determine the actual name, without the extra cruft
-    _, domain = DriverDNS.figure_out_name(question.name, domains)
+      # (With the *actual* max length, since everything is encoded by then)
+      :max_encoded_length => multi_string ? DriverDNS.get_max_txt_length(question, edns_size) : type_info[:max_length],
+    }.freeze()
 
-    type_info = RECORD_TYPES[question.type]
-    if(type_info.nil?)
-      raise(DnscatException, "Couldn't figure out how to handle the record type! (please report this, it shouldn't happen): " + type)
+    @@templates_lock.synchronize() do
+      if(@@templates.length >= MAX_TEMPLATES)
+        @@templates.clear()
+      end
+      @@templates[key] = template
     end
 
-    # Encode the response as needed
-    response = type_info[:encoder].call(response)
+    return template
+  end
 
-    # Append domain, if needed
-    if(type_info[:requires_domain])
-      if(domain.nil?)
-        response = (response == "" ? "dnscat" : ("dnscat." + response))
-      else
-        response = (response == "" ? domain : (response + "." + domain))
+  # Encode a response the same way the request was encoded
+  def DriverDNS.do_encoding(template, response)
+    type_info = template[:type_info]
+    encoding  = template[:encoding]
+
+    if(type_info[:requires_hex] && encoding != ENCODING_HEX)
+      if(type_info[:requires_domain])
+        response = DriverDNS.encode_bits(response, encoding).chars.each_slice(63).map(&:join).join(".")
       end
+    else
+      response = type_info[:encoder].call(response)
     end
 
-    # Do another length sanity check (with the *actual* max length, since everything is encoded now)
-    if(response.is_a?(String) && response.length > type_info[:max_length])
+    # Add the prefix or domain, if needed
+    if(template[:prefix])
+      response = (response == "" ? template[:prefix] : (template[:prefix] + "." + response))
+    elsif(template[:suffix])
+      response = (response == "" ? template[:suffix] : (response + "." + template[:suffix]))
+    end
+
+    # Do another length sanity check
+    if(response.is_a?(String) && response.length > template[:max_encoded_length])
       raise(DnscatException, "The handler returned too much data (after encoding)! This shouldn't happen, please report.")
     end
 
     return response
   end
 
-  def initialize(parent_window, host, port, domains, cache)
+  # The dnscat2 session a request is for, so the DNSer's workers can keep each
+  # session's requests in order (it's the third field of the header, see
+  # controller/packet.rb)
+  def DriverDNS.session_key(request, domains)
+    if(request.questions.length < 1)
+      return nil
+    end
+
+    name = DriverDNS.packet_to_bytes(request.questions[0], domains)
+    if(name.nil? || name.length < 5)
+      return nil
+    end
+
+    return name.unpack("nCn")[2]
+  end
+
+  def initialize(parent_window, host, port, domains, cache, workers = 0)
     if(domains.nil?)
       domains = []
     end
 
     # Do this as early as we can, so we can fail early
-    @dnser = DNSer.new(host, port, cache)
+    @dnser = DNSer.new(host, port, cache, workers)
 
     @id = 'dns%d' % (@@id += 1)
     @window = SWindow.new(parent_window, false, {
@@ -289,8 +498,8 @@ class DriverDNS
     end
 
 
-    @dnser.on_request() do |transaction|
-      begin
+    @dnser.on_request(Proc.new() { |request| DriverDNS.session_key(request, domains) }) do |transaction|
+      _handle_errors(transaction) do
         request = transaction.request
 
         if(request.questions.length < 1)
@@ -300,72 +509,91 @@ class DriverDNS
         question = request.questions[0]
         @window.puts("Received:  #{question.name} (#{question.type_s})")
 
-        name = DriverDNS.packet_to_bytes(question, domains)
+        domain, encoding, name = DriverDNS.split_name(question, domains)
+        name = encoding.nil? ? nil : DriverDNS.decode_name(name, encoding)
         if(name.nil?)
           do_passthrough(transaction)
           next
         end
 
-        max_length = DriverDNS.get_max_length(question, domains)
-        if(max_length.nil?)
-          do_passthrough(transaction)
+        # Over TCP, the response can be as big as a DNS message gets
+        edns_size = transaction.tcp?() ? DNSer::Packet::TCP_MAX_SIZE : request.edns_size
+
+        template = DriverDNS.get_template(question, domain, encoding, edns_size)
+
+        # Get the response; if the session holds onto the query (a long poll),
+        # it's answered later, from another thread
+        response = proc.call(name, template[:max_length], Proc.new() do |late_response|
+          _handle_errors(transaction) do
+            _reply(transaction, question, template, late_response)
+          end
+        end)
+
+        if(response.nil?)
           next
         end
 
-        # Get the response
-        response = proc.call(name, max_length)
+        _reply(transaction, question, template, response)
+      end
+    end
+  end
 
-        if(response.length > max_length)
-          raise(DnscatException, "The handler returned too much data! This shouldn't happen, please report. (max = #{max_length}, returned = #{response.length}")
-        end
+  def _reply(transaction, question, template, response)
+    if(response.length > template[:max_length])
+      raise(DnscatException, "The handler returned too much data! This shouldn't happen, please report. (max = #{template[:max_length]}, returned = #{response.length}")
+    end
 
-        response = DriverDNS.do_encoding(question, domains, response)
+    response = DriverDNS.do_encoding(template, response)
 
-        # Log the response
-        @window.puts("Sending:  #{response}")
+    # Log the response
+    @window.puts("Sending:  #{response}")
 
-        # Allow multiple response records
-        if(response.is_a?(String))
-          transaction.add_answer(question.answer(60, response))
-        else
-          response.each do |r|
-            transaction.add_answer(question.answer(60, r))
-          end
-        end
+    # Allow multiple response records
+    if(response.is_a?(String))
+      transaction.add_answer(question.answer(60, response))
+    else
+      response.each do |r|
+        transaction.add_answer(question.answer(60, r))
+      end
+    end
 
-        transaction.reply!()
-      rescue DNSer::DnsException => e
-        @window.with({:to_ancestors => true}) do
-          @window.puts("There was a problem parsing the incoming packet! (for more information, check window '#{@window.id}')")
-          @window.puts(e.inspect)
-        end
+    transaction.reply!()
+  end
 
-        e.backtrace.each do |bt|
-          @window.puts(bt)
-        end
+  def _handle_errors(transaction)
+    begin
+      yield()
+    rescue DNSer::DnsException => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("There was a problem parsing the incoming packet! (for more information, check window '#{@window.id}')")
+        @window.puts(e.inspect)
+      end
 
-        transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
-      rescue DnscatException => e
-        @window.with({:to_ancestors => true}) do
-          @window.puts("Protocol exception caught in dnscat DNS module (for more information, check window '#{@window.id}'):")
-          @window.puts(e.inspect)
-        end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
 
-        e.backtrace.each do |bt|
-          @window.puts(bt)
-        end
-        transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
-      rescue StandardError => e
-        @window.with({:to_ancestors => true}) do
-          @window.puts("Error caught (for more information, check window '#{@window.id}'):")
-          @window.puts(e.inspect)
-        end
+      transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
+    rescue DnscatException => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Protocol exception caught in dnscat DNS module (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
+      end
 
-        e.backtrace.each do |bt|
-          @window.puts(bt)
-        end
-        transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+      transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
+    rescue StandardError => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Error caught (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
       end
+
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+      transaction.error!(DNSer::Packet::RCODE_NAME_ERROR)
     end
   end
 
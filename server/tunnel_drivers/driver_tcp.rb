@@ -5,58 +5,127 @@
 #
 # See: LICENSE.md
 #
-# A TCP wrapper for the dnscat2 protocol (mostly for testing)
+# A TCP wrapper for the dnscat2 protocol, for clients that can connect
+# straight to us. Each packet (both ways) is prefixed with its length, as a
+# 16-bit big-endian integer, and every packet gets exactly one answer - an
+# empty one if we've got nothing to say.
 ##
 
 require 'socket'
 
 class DriverTCP
-  def initialize(s)
-    @s = s
-  end
+  @@id = 0
 
-  def recv()
-    loop do
-      length = @s.read(2)
-      if(length.nil? || length.length != 2)
-        raise(IOError, "Connection closed while reading the length")
-      end
-      length = length.unpack("n").shift
+  # The most we'll send back in one packet
+  MAX_LENGTH = 32767
 
-      incoming = @s.read(length)
-      if(incoming.nil? || incoming.length != length)
-        raise(IOError, "Connection closed while reading packet")
-      end
+  def initialize(parent_window, host, port, &handler)
+    # Do this as early as we can, so we can fail early
+    @server = TCPServer.new(host, port)
+
+    @id = 'tcp%d' % (@@id += 1)
+    @window = SWindow.new(parent_window, false, {
+      :id => @id,
+      :name => "TCP Driver running on #{host}:#{port}",
+      :noinput => true,
+    })
 
-      outgoing = yield(incoming, 32767)
-      if(!outgoing.nil?)
-        outgoing = [outgoing.length, outgoing].pack("nA*")
-        @s.write(outgoing)
+    @window.with({:to_ancestors => true}) do
+      @window.puts("Starting Dnscat2 TCP server on #{host}:#{port}")
+      @window.puts("")
+      @window.puts("To connect to it, run:")
+      @window.puts()
+      @window.puts("  ./dnscat --tcp host=x.x.x.x,port=#{port} --secret=#{Settings::GLOBAL.get('secret')}")
+      @window.puts("")
+    end
+
+    @thread = Thread.new() do
+      begin
+        loop do
+          Thread.start(@server.accept()) do |s|
+            _handle_connection(s, handler)
+          end
+        end
+      rescue IOError
+        # The server was stopped
       end
     end
   end
 
-  def close()
-    @s.close
+  def id()
+    return @id
   end
 
-  def DriverTCP.go(host, port)
-    Log.WARNING(nil, "Starting Dnscat2 TCP server on #{host}:#{port}...")
-    server = TCPServer.new(port)
-
-    loop do
-      Thread.start(server.accept) do |s|
-        Log.INFO(nil, "Received a new connection from #{s.peeraddr[3]}:#{s.peeraddr[1]} (#{s.peeraddr[2]})...")
-
-        begin
-          tcp = DriverTCP.new(s)
-          Dnscat2.go(tcp)
-        rescue IOError => e
-          puts("IOError caught: #{e.inspect}")
-          puts(e.inspect)
-          puts(e.backtrace)
+  def _read_packet(s)
+    length = s.read(2)
+    if(length.nil? || length.length != 2)
+      return nil
+    end
+    length = length.unpack("n").shift
+
+    incoming = s.read(length)
+    if(incoming.nil? || incoming.length != length)
+      raise(IOError, "Connection closed while reading packet")
+    end
+
+    return incoming
+  end
+
+  def _handle_connection(s, handler)
+    @window.puts("Received a new connection from #{s.peeraddr[3]}:#{s.peeraddr[1]}")
+
+    begin
+      s.setsockopt(Socket::IPPROTO_TCP, Socket::TCP_NODELAY, 1)
+
+      loop do
+        incoming = _read_packet(s)
+        if(incoming.nil?)
+          break
         end
+
+        outgoing = incoming.length > 0 ? handler.call(incoming, MAX_LENGTH, nil) : nil
+        outgoing = outgoing || ""
+
+        s.write([outgoing.length].pack("n") + outgoing)
+      end
+
+      @window.puts("Connection closed")
+    rescue IOError, SystemCallError => e
+      @window.puts("Connection error: #{e.inspect}")
+    rescue DnscatException => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Protocol exception caught in dnscat TCP module (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
+      end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+    rescue StandardError => e
+      @window.with({:to_ancestors => true}) do
+        @window.puts("Error caught (for more information, check window '#{@window.id}'):")
+        @window.puts(e.inspect)
       end
+      e.backtrace.each do |bt|
+        @window.puts(bt)
+      end
+    ensure
+      s.close() rescue nil
+    end
+  end
+
+  def stop()
+    if(@server.nil?)
+      @window.puts("Tried to kill a session that isn't started or that's already dead!")
+      return
     end
+
+    @server.close()
+    @server = nil
+    @thread.join()
+    @window.close()
+  end
+
+  def to_s()
+    return @window.name
   end
 end